@@ -0,0 +1,588 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "aof.hh"
+#include <cinttypes>
+#include <cstdio>
+#include <boost/range/irange.hpp>
+#include "core/align.hh"
+#include "core/fstream.hh"
+#include "core/reactor.hh"
+#include "core/seastar.hh"
+#include "net/packet.hh"
+#include "util/log.hh"
+#include "flash_tier.hh"
+#include "hll.hh"
+#include "redis_protocol.hh"
+
+using logger =  seastar::logger;
+static logger aof_log ("aof");
+
+namespace redis {
+
+bool parse_aof_fsync_policy(const sstring& name, aof_fsync_policy& policy)
+{
+    static const std::unordered_map<sstring, aof_fsync_policy> policies = {
+        { "always", aof_fsync_policy::always },
+        { "everysec", aof_fsync_policy::everysec },
+        { "no", aof_fsync_policy::no },
+    };
+    auto it = policies.find(name);
+    if (it == policies.end()) {
+        return false;
+    }
+    policy = it->second;
+    return true;
+}
+
+void aof_encoder::begin_command(size_t argc)
+{
+    static const char asking[] = "*1\r\n$6\r\nASKING\r\n";
+    if (_asking) {
+        append_raw(asking, sizeof(asking) - 1);
+        ++_commands;
+    }
+    ++_commands;
+    char buf[32];
+    auto n = std::snprintf(buf, sizeof(buf), "*%zu\r\n", argc);
+    append_raw(buf, n);
+}
+
+void aof_encoder::begin_bulk(size_t size)
+{
+    char buf[32];
+    auto n = std::snprintf(buf, sizeof(buf), "$%zu\r\n", size);
+    append_raw(buf, n);
+}
+
+void aof_encoder::add(const char* data, size_t size)
+{
+    begin_bulk(size);
+    append_raw(data, size);
+    append_raw("\r\n", 2);
+}
+
+void aof_encoder::add(int64_t value)
+{
+    char buf[32];
+    auto n = std::snprintf(buf, sizeof(buf), "%" PRId64, value);
+    add(buf, n);
+}
+
+void aof_encoder::add(double value)
+{
+    char buf[32];
+    auto n = std::snprintf(buf, sizeof(buf), "%.17g", value);
+    add(buf, n);
+}
+
+void aof_encoder::append_entry(const cache_entry& e, clock_type::time_point now, std::chrono::system_clock::time_point wall_now)
+{
+    using namespace std::chrono;
+    auto key = e.key();
+    switch (e.type()) {
+    case entry_type::ENTRY_FLOAT:
+        append("SET", key, e.value_float());
+        break;
+    case entry_type::ENTRY_INT64:
+        append("INCRBY", key, e.value_integer());
+        break;
+    case entry_type::ENTRY_BYTES:
+        append("SET", key, flash_tier::value_of(e));
+        break;
+    case entry_type::ENTRY_HLL: {
+        // SET of the encoding of Redis creates the HyperLogLog again.
+        auto& registers = e.value_bytes();
+        uint8_t header[hll::DENSE_HEADER_SIZE];
+        hll::redis_header(registers, header);
+        begin_command(3);
+        add("SET");
+        add(key);
+        begin_bulk(hll::DENSE_HEADER_SIZE + registers.size() - HLL_CARD_CACHE_SIZE);
+        append_raw(reinterpret_cast<const char*>(header), sizeof(header));
+        append_raw(reinterpret_cast<const char*>(registers.data()) + HLL_CARD_CACHE_SIZE, registers.size() - HLL_CARD_CACHE_SIZE);
+        append_raw("\r\n", 2);
+        break;
+    }
+    case entry_type::ENTRY_LIST: {
+        std::vector<bytes_view> values;
+        auto flush = [this, &key, &values] {
+            begin_command(2 + values.size());
+            add("RPUSH");
+            add(key);
+            for (auto v : values) {
+                add(v);
+            }
+            values.clear();
+        };
+        e.value_list().for_each([&values, &flush] (bytes_view v) {
+            values.push_back(v);
+            if (values.size() == REWRITE_ITEMS_PER_COMMAND) {
+                flush();
+            }
+        });
+        if (!values.empty()) {
+            flush();
+        }
+        break;
+    }
+    case entry_type::ENTRY_MAP: {
+        // the counters keep their type only if HINCRBY(FLOAT) creates them.
+        std::vector<dict_field> fields;
+        auto flush = [this, &key, &fields] {
+            begin_command(2 + fields.size() * 2);
+            add("HMSET");
+            add(key);
+            for (auto& f : fields) {
+                add(f.key_data(), f.key_size());
+                add(f.value_bytes_data(), f.value_bytes_size());
+            }
+            fields.clear();
+        };
+        e.value_map().for_each([this, &key, &fields, &flush] (const dict_field& f) {
+            if (f.type_of_integer()) {
+                begin_command(4);
+                add("HINCRBY");
+                add(key);
+                add(f.key_data(), f.key_size());
+                add(f.value_integer());
+            } else if (f.type_of_float()) {
+                begin_command(4);
+                add("HINCRBYFLOAT");
+                add(key);
+                add(f.key_data(), f.key_size());
+                add(f.value_float());
+            } else {
+                fields.push_back(f);
+                if (fields.size() == REWRITE_ITEMS_PER_COMMAND) {
+                    flush();
+                }
+            }
+        });
+        if (!fields.empty()) {
+            flush();
+        }
+        break;
+    }
+    case entry_type::ENTRY_SET: {
+        std::vector<dict_field> members;
+        auto flush = [this, &key, &members] {
+            begin_command(2 + members.size());
+            add("SADD");
+            add(key);
+            for (auto& m : members) {
+                add(m.key_data(), m.key_size());
+            }
+            members.clear();
+        };
+        e.value_set().for_each([&members, &flush] (const dict_field& m) {
+            members.push_back(m);
+            if (members.size() == REWRITE_ITEMS_PER_COMMAND) {
+                flush();
+            }
+        });
+        if (!members.empty()) {
+            flush();
+        }
+        break;
+    }
+    case entry_type::ENTRY_SSET: {
+        std::vector<const sset_entry*> members;
+        auto flush = [this, &key, &members] {
+            begin_command(2 + members.size() * 2);
+            add("ZADD");
+            add(key);
+            for (auto m : members) {
+                add(m->score());
+                add(m->key_data(), m->key_size());
+            }
+            members.clear();
+        };
+        e.value_sset().reverse_for_each([&members, &flush] (const sset_entry& m) {
+            members.push_back(&m);
+            if (members.size() == REWRITE_ITEMS_PER_COMMAND) {
+                flush();
+            }
+        });
+        if (!members.empty()) {
+            flush();
+        }
+        break;
+    }
+    }
+    if (e.ever_expires()) {
+        auto at = wall_now + duration_cast<milliseconds>(e.get_timeout() - now);
+        append("PEXPIREAT", key, static_cast<int64_t>(duration_cast<milliseconds>(at.time_since_epoch()).count()));
+    }
+}
+
+future<lw_shared_ptr<aof_file>> aof_file::open(sstring path, bool truncate)
+{
+    auto flags = open_flags::rw | open_flags::create;
+    if (truncate) {
+        flags = flags | open_flags::truncate;
+    }
+    return open_file_dma(path, flags).then([] (file f) {
+        return f.size().then([f] (uint64_t size) mutable {
+            auto aligned_size = align_down<uint64_t>(size, ALIGNMENT);
+            auto tail_size = size - aligned_size;
+            if (tail_size == 0) {
+                return make_ready_future<lw_shared_ptr<aof_file>>(make_lw_shared<aof_file>(std::move(f), aligned_size, std::vector<char>()));
+            }
+            return f.dma_read<char>(aligned_size, ALIGNMENT).then([f, aligned_size, tail_size] (temporary_buffer<char> buf) mutable {
+                if (buf.size() < tail_size) {
+                    throw std::runtime_error("short read of the last block of the append only log");
+                }
+                std::vector<char> tail(buf.get(), buf.get() + tail_size);
+                return make_lw_shared<aof_file>(std::move(f), aligned_size, std::move(tail));
+            });
+        });
+    });
+}
+
+future<> aof_file::write(const std::vector<char>& data)
+{
+    if (data.empty()) {
+        return make_ready_future<>();
+    }
+    auto size = _tail.size() + data.size();
+    auto aligned_size = align_up<size_t>(size, ALIGNMENT);
+    auto buffer = temporary_buffer<char>::aligned(ALIGNMENT, aligned_size);
+    auto p = buffer.get_write();
+    std::copy(_tail.begin(), _tail.end(), p);
+    std::copy(data.begin(), data.end(), p + _tail.size());
+    std::fill(p + size, p + aligned_size, 0);
+    return _file.dma_write(_aligned_size, buffer.get(), aligned_size).then([this, buffer = std::move(buffer), size, aligned_size] (size_t written) {
+        if (written != aligned_size) {
+            throw std::runtime_error("short write to the append only log");
+        }
+        // the current partial block is written again by the next write, the
+        // state changes only once the write succeeded.
+        auto tail_size = size % ALIGNMENT;
+        _tail.assign(buffer.get() + size - tail_size, buffer.get() + size);
+        _aligned_size += size - tail_size;
+    });
+}
+
+future<> aof_file::close()
+{
+    return _file.truncate(size()).then([this] {
+        return _file.flush();
+    }).then([this] {
+        return _file.close();
+    });
+}
+
+future<> append_only_log::open(sstring directory, sstring filename, aof_fsync_policy policy, std::chrono::milliseconds fsync_interval, size_t fsync_bytes)
+{
+    _directory = std::move(directory);
+    _path = shard_file_path(_directory, filename, engine().cpu_id());
+    _policy = policy;
+    _fsync_interval = fsync_interval;
+    _fsync_bytes = fsync_bytes;
+    return aof_file::open(_path, false).then([this] (auto f) {
+        _file = std::move(f);
+        _enabled = true;
+        _timer.set_callback([this] { maybe_start_write(); });
+        _timer.arm_periodic(std::chrono::duration_cast<lowres_clock::duration>(_fsync_interval));
+        aof_log.info("appending to {} ({} bytes)", _path, _file->size());
+        return sync_directory(_directory);
+    });
+}
+
+void append_only_log::maybe_start_write()
+{
+    if (!_enabled || _flushing || _switching || (_pending.empty() && !_next)) {
+        return;
+    }
+    _flushing = true;
+    _inflight = std::move(_next);
+    _next = {};
+    auto fsync = _policy != aof_fsync_policy::no;
+    (void)with_gate(_gate, [this, file = _file, data = _pending.release(), fsync] () mutable {
+        return do_with(std::move(data), [this, file, fsync] (auto& data) {
+            return file->write(data).then([file, fsync] {
+                return fsync ? file->sync() : make_ready_future<>();
+            }).then_wrapped([this, &data, fsync] (future<> f) {
+                std::exception_ptr ep;
+                try {
+                    f.get();
+                } catch (...) {
+                    ep = std::current_exception();
+                }
+                finish_write(ep, data, fsync);
+            });
+        });
+    });
+}
+
+void append_only_log::finish_write(std::exception_ptr ep, std::vector<char>& data, bool fsync)
+{
+    _flushing = false;
+    auto waiters = std::move(_inflight);
+    _inflight = {};
+    if (ep) {
+        ++_write_errors;
+        aof_log.error("failed to write {} bytes to {}: {}", data.size(), _path, ep);
+        // the bytes are written again with the next write.
+        _pending.prepend(std::move(data));
+        if (waiters) {
+            waiters->set_exception(ep);
+        }
+    } else {
+        ++_writes;
+        _written_bytes += data.size();
+        if (fsync) {
+            ++_fsyncs;
+        }
+        if (waiters) {
+            waiters->set_value();
+        }
+    }
+    if (_next || (_fsync_bytes > 0 && _pending.size() >= _fsync_bytes)) {
+        maybe_start_write();
+    }
+}
+
+future<> append_only_log::sync()
+{
+    if (!_enabled) {
+        return make_ready_future<>();
+    }
+    if (_pending.empty()) {
+        if (!_flushing) {
+            return make_ready_future<>();
+        }
+        if (!_inflight) {
+            _inflight = make_lw_shared<shared_promise<>>();
+        }
+        return _inflight->get_shared_future();
+    }
+    if (!_next) {
+        _next = make_lw_shared<shared_promise<>>();
+    }
+    auto f = _next->get_shared_future();
+    maybe_start_write();
+    return f;
+}
+
+future<> append_only_log::close()
+{
+    if (!_enabled) {
+        return make_ready_future<>();
+    }
+    _enabled = false;
+    _timer.cancel();
+    return _gate.close().then([this] {
+        return do_with(_pending.release(), [this] (auto& data) {
+            return _file->write(data).then([this] {
+                return _file->sync();
+            });
+        }).then_wrapped([this] (future<> f) {
+            auto waiters = std::move(_next);
+            _next = {};
+            try {
+                f.get();
+                if (waiters) {
+                    waiters->set_value();
+                }
+            } catch (...) {
+                aof_log.error("failed to write to {}: {}", _path, std::current_exception());
+                if (waiters) {
+                    waiters->set_exception(std::current_exception());
+                }
+            }
+            return _file->close();
+        });
+    });
+}
+
+future<> append_only_log::begin_rewrite()
+{
+    return aof_file::open(_path + ".rewrite", true).then([this] (auto f) {
+        _rewrite_file = std::move(f);
+        _rewrite_pending = aof_encoder();
+        _rewriting = true;
+    });
+}
+
+future<> append_only_log::flush_rewrite()
+{
+    return do_with(_rewrite_pending.release(), [file = _rewrite_file] (auto& data) {
+        return file->write(data);
+    });
+}
+
+future<> append_only_log::finish_rewrite()
+{
+    return do_with(false, [this] (bool& synced) {
+        return repeat([this, &synced] {
+            if (_rewrite_pending.size() >= REWRITE_SWITCH_SIZE) {
+                synced = false;
+                return flush_rewrite().then([] {
+                    return stop_iteration::no;
+                });
+            }
+            if (!synced) {
+                synced = true;
+                return _rewrite_file->sync().then([] {
+                    return stop_iteration::no;
+                });
+            }
+            if (_flushing) {
+                if (!_inflight) {
+                    _inflight = make_lw_shared<shared_promise<>>();
+                }
+                return _inflight->get_shared_future().then_wrapped([] (auto&& f) {
+                    f.ignore_ready_future();
+                    return stop_iteration::no;
+                });
+            }
+            // no write is running on the old log, the rest of the rewrite buffer
+            // becomes the pending bytes of the new one. The commands pending for
+            // the old log are dropped, the new one has their changes already.
+            std::swap(_file, _rewrite_file);
+            _pending = std::move(_rewrite_pending);
+            _rewrite_pending = aof_encoder();
+            _rewriting = false;
+            _switching = true;
+            return make_ready_future<stop_iteration>(stop_iteration::yes);
+        });
+    }).then([this] {
+        return switch_to_rewritten();
+    });
+}
+
+future<> append_only_log::switch_to_rewritten()
+{
+    // the writes are held until the new file is in place: a change must not be
+    // acknowledged while only the unnamed file has it.
+    auto old = std::move(_rewrite_file);
+    _rewrite_file = {};
+    return rename_file(_path + ".rewrite", _path).then([this] {
+        return sync_directory(_directory);
+    }).then_wrapped([this, old] (future<> f) {
+        try {
+            f.get();
+            ++_rewrites;
+            aof_log.info("rewrote {} ({} bytes)", _path, _file->size());
+        } catch (...) {
+            aof_log.error("failed to replace {} by the rewritten log: {}", _path, std::current_exception());
+        }
+        _switching = false;
+        maybe_start_write();
+        return old->close().handle_exception([] (auto ep) {
+            aof_log.warn("failed to close the replaced log: {}", ep);
+        });
+    });
+}
+
+future<> append_only_log::abort_rewrite()
+{
+    _rewriting = false;
+    _rewrite_pending = aof_encoder();
+    auto file = std::move(_rewrite_file);
+    _rewrite_file = {};
+    if (!file) {
+        return make_ready_future<>();
+    }
+    return file->close().then([this] {
+        return remove_file(_path + ".rewrite");
+    }).handle_exception([this] (auto ep) {
+        aof_log.warn("failed to remove {}.rewrite: {}", _path, ep);
+    });
+}
+
+static future<> replay_append_only_log(redis_service& redis, sstring path)
+{
+    return open_file_dma(path, open_flags::rw).then([&redis, path] (file f) {
+        return do_with(std::move(f), aof_scanner(), [&redis, path] (auto& f, auto& scanner) {
+            return do_with(make_file_input_stream(f), [&scanner] (auto& in) {
+                return repeat([&in, &scanner] {
+                    return in.read().then([&scanner] (temporary_buffer<char> buf) {
+                        if (buf.empty() || !scanner.feed(buf.get(), buf.size())) {
+                            return stop_iteration::yes;
+                        }
+                        return stop_iteration::no;
+                    });
+                }).finally([&in] {
+                    return in.close();
+                });
+            }).then([&f] {
+                return f.size();
+            }).then([&f, &scanner, path] (uint64_t size) {
+                if (scanner.valid_size() == size) {
+                    return make_ready_future<>();
+                }
+                aof_log.warn("{}: dropped {} bytes after the last complete command", path, size - scanner.valid_size());
+                return f.truncate(scanner.valid_size()).then([&f] {
+                    return f.flush();
+                });
+            }).then([&redis, &f, path] {
+                auto start = steady_clock_type::now();
+                output_stream<char> out(data_sink(std::make_unique<null_data_sink>()), 8192);
+                return do_with(make_file_input_stream(f), std::move(out), redis_protocol(redis, false), request_latency_tracer(),
+                        [] (auto& in, auto& out, auto& protocol, auto& tracer) {
+                    return do_until([&in] { return in.eof(); }, [&in, &out, &protocol, &tracer] {
+                        return protocol.handle(in, out, tracer);
+                    }).finally([&in] {
+                        return in.close();
+                    });
+                }).then([path, start] {
+                    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(steady_clock_type::now() - start);
+                    aof_log.info("replayed {} in {} ms", path, elapsed.count());
+                });
+            }).finally([&f] {
+                return f.close();
+            });
+        });
+    });
+}
+
+future<unsigned> replay_append_only_logs(redis_service& redis, sstring directory, sstring filename)
+{
+    return count_shard_files(directory, filename).then([&redis, directory, filename] (unsigned found) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&redis, directory, filename, found] (unsigned cpu) {
+            return smp::submit_to(cpu, [&redis, directory, filename, found, cpu] {
+                return do_with(cpu, [&redis, directory, filename, found] (auto& log) {
+                    return do_until([&log, found] { return log >= found; }, [&redis, &log, directory, filename] {
+                        auto path = shard_file_path(directory, filename, log);
+                        log += smp::count;
+                        return replay_append_only_log(redis, path);
+                    });
+                });
+            });
+        }).then([found] {
+            return found;
+        });
+    });
+}
+
+future<> remove_stale_append_only_logs(sstring directory, sstring filename, unsigned found)
+{
+    return do_for_each(boost::irange<unsigned>(smp::count, std::max(found, smp::count)), [directory, filename] (unsigned log) {
+        auto path = shard_file_path(directory, filename, log);
+        aof_log.info("removing {}, its entries were rewritten to the logs of the shards running now", path);
+        return remove_file(path);
+    }).then([directory] {
+        return sync_directory(directory);
+    });
+}
+}
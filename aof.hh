@@ -0,0 +1,414 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/future.hh"
+#include "core/file.hh"
+#include "core/gate.hh"
+#include "core/shared_future.hh"
+#include "core/shared_ptr.hh"
+#include "core/sstring.hh"
+#include "core/stream.hh"
+#include "core/timer.hh"
+#include "net/packet.hh"
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include "cache.hh"
+
+namespace redis {
+class redis_service;
+
+// When the appended commands are flushed to the disk: before replying to the
+// command, once per interval, or as the kernel decides.
+enum class aof_fsync_policy {
+    always,
+    everysec,
+    no,
+};
+bool parse_aof_fsync_policy(const sstring& name, aof_fsync_policy& policy);
+
+// The sync of the log failed, the change which waited for it may be lost.
+class aof_write_error : public std::runtime_error {
+public:
+    aof_write_error() : std::runtime_error("error writing to the append only log") {}
+};
+
+// Encodes the commands as RESP arrays of bulk strings, which is the format of
+// the AOF of Redis, so that the log is replayed by the protocol parser.
+class aof_encoder final {
+    static constexpr const size_t UNKNOWN_DB = std::numeric_limits<size_t>::max();
+    std::vector<char> _buffer;
+    uint64_t _commands = 0;
+    bool _asking = false;
+    // The database the commands appended so far leave selected.
+    size_t _db = UNKNOWN_DB;
+public:
+    inline bool empty() const { return _buffer.empty(); }
+    inline size_t size() const { return _buffer.size(); }
+    inline const char* data() const { return _buffer.data(); }
+    // The number of commands in the buffer.
+    inline uint64_t commands() const { return _commands; }
+    // Every command is preceded by an ASKING, for the node of a cluster
+    // importing the slot of its key.
+    inline void ask_each_command() { _asking = true; }
+    // Drops the bytes, the buffer keeps its capacity.
+    inline void clear()
+    {
+        _buffer.clear();
+        _commands = 0;
+    }
+    inline std::vector<char> release()
+    {
+        std::vector<char> data;
+        data.swap(_buffer);
+        _commands = 0;
+        return data;
+    }
+    inline void append_raw(const char* data, size_t size)
+    {
+        _buffer.insert(_buffer.end(), data, data + size);
+    }
+    // Puts back the bytes failed to be written, in front of the new ones.
+    inline void prepend(std::vector<char>&& data)
+    {
+        data.insert(data.end(), _buffer.begin(), _buffer.end());
+        _buffer = std::move(data);
+    }
+
+    template <typename... Args>
+    inline void append(const char* command, const Args&... args)
+    {
+        begin_command(1 + count_all(args...));
+        add(command);
+        add_all(args...);
+    }
+
+    // The next commands change the database @db, they're preceded by a SELECT
+    // if the previous ones left another one selected.
+    inline void select_db(size_t db)
+    {
+        if (db != _db) {
+            append("SELECT", db);
+            _db = db;
+        }
+    }
+    // The next commands are read by a client which doesn't know the database
+    // selected, the first of them is preceded by a SELECT.
+    inline void forget_db() { _db = UNKNOWN_DB; }
+
+    // Appends the commands which rebuild @e, for the rewrite of the log. @now and
+    // @wall_now are the same moment, the expiry is logged as an absolute unix time.
+    void append_entry(const cache_entry& e, clock_type::time_point now, std::chrono::system_clock::time_point wall_now);
+private:
+    // Maximum number of items appended by a command rebuilding a large entry.
+    static constexpr const size_t REWRITE_ITEMS_PER_COMMAND = 64;
+
+    void begin_command(size_t argc);
+    void begin_bulk(size_t size);
+    void add(const char* data, size_t size);
+    inline void add(const char* s) { add(s, std::strlen(s)); }
+    inline void add(const sstring& s) { add(s.data(), s.size()); }
+    inline void add(const redis_key& rk) { add(rk.key()); }
+    inline void add(const managed_bytes& b) { add(reinterpret_cast<const char*>(b.data()), b.size()); }
+    inline void add(const bytes_view& b) { add(reinterpret_cast<const char*>(b.data()), b.size()); }
+    void add(int64_t value);
+    void add(double value);
+    template <typename T>
+    inline std::enable_if_t<std::is_integral<T>::value> add(T value) { add(static_cast<int64_t>(value)); }
+    inline void add(const std::vector<sstring>& values)
+    {
+        for (auto& v : values) {
+            add(v);
+        }
+    }
+    inline void add(const std::unordered_map<sstring, sstring>& values)
+    {
+        for (auto& kv : values) {
+            add(kv.first);
+            add(kv.second);
+        }
+    }
+    // The score comes before the member, as ZADD takes them.
+    inline void add(const std::unordered_map<sstring, double>& values)
+    {
+        for (auto& kv : values) {
+            add(kv.second);
+            add(kv.first);
+        }
+    }
+
+    inline void add_all() {}
+    template <typename T, typename... Rest>
+    inline void add_all(const T& first, const Rest&... rest)
+    {
+        add(first);
+        add_all(rest...);
+    }
+
+    template <typename T>
+    static inline size_t count(const T&) { return 1; }
+    static inline size_t count(const std::vector<sstring>& values) { return values.size(); }
+    static inline size_t count(const std::unordered_map<sstring, sstring>& values) { return values.size() * 2; }
+    static inline size_t count(const std::unordered_map<sstring, double>& values) { return values.size() * 2; }
+    static inline size_t count_all() { return 0; }
+    template <typename T, typename... Rest>
+    static inline size_t count_all(const T& first, const Rest&... rest)
+    {
+        return count(first) + count_all(rest...);
+    }
+};
+
+// Appends to a file opened for direct I/O: the writes are aligned, the partial
+// block at the end is kept in memory and written again with the next bytes.
+class aof_file final {
+    static constexpr const size_t ALIGNMENT = 4096;
+    file _file;
+    uint64_t _aligned_size;
+    std::vector<char> _tail;
+public:
+    aof_file(file f, uint64_t aligned_size, std::vector<char> tail)
+        : _file(std::move(f)), _aligned_size(aligned_size), _tail(std::move(tail)) {}
+
+    static future<lw_shared_ptr<aof_file>> open(sstring path, bool truncate);
+    inline uint64_t size() const { return _aligned_size + _tail.size(); }
+    future<> write(const std::vector<char>& data);
+    inline future<> sync() { return _file.flush(); }
+    // Cuts the padding of the last block off.
+    future<> close();
+};
+
+// The append only log of a shard. The commands changing the data are encoded
+// into the pending buffer, which is written (and flushed according to the fsync
+// policy) by one write at a time: the commands appended meanwhile are written
+// together by the next one, so a single fsync commits a whole group of them.
+class append_only_log final {
+    bool _enabled = false;
+    aof_fsync_policy _policy = aof_fsync_policy::everysec;
+    std::chrono::milliseconds _fsync_interval { 1000 };
+    size_t _fsync_bytes = 0;
+    sstring _directory;
+    sstring _path;
+    lw_shared_ptr<aof_file> _file;
+    aof_encoder _pending;
+    bool _flushing = false;
+    // The log switches to the rewritten file, no write may start meanwhile.
+    bool _switching = false;
+    // The waiters of the running write, and of the next one.
+    lw_shared_ptr<shared_promise<>> _inflight;
+    lw_shared_ptr<shared_promise<>> _next;
+    timer<lowres_clock> _timer;
+    seastar::gate _gate;
+
+    bool _rewriting = false;
+    aof_encoder _rewrite_pending;
+    lw_shared_ptr<aof_file> _rewrite_file;
+
+    uint64_t _appended_commands = 0;
+    uint64_t _appended_bytes = 0;
+    uint64_t _written_bytes = 0;
+    uint64_t _writes = 0;
+    uint64_t _fsyncs = 0;
+    uint64_t _write_errors = 0;
+    uint64_t _rewrites = 0;
+public:
+    // The rewrite switches to the new file once its buffer is this small.
+    static constexpr const size_t REWRITE_SWITCH_SIZE = 64 * 1024;
+
+    append_only_log() {}
+    // Opens the log of this shard in @directory, the new commands are appended
+    // to the end of it. @fsync_bytes starts an early write once that many bytes
+    // are pending, 0 means only the policy does.
+    future<> open(sstring directory, sstring filename, aof_fsync_policy policy, std::chrono::milliseconds fsync_interval, size_t fsync_bytes);
+    future<> close();
+
+    inline bool enabled() const { return _enabled; }
+    // Whether the reply of a change must wait for sync().
+    inline bool must_sync() const { return _enabled && _policy == aof_fsync_policy::always; }
+
+    // Appends the command changing the database @db, @rewritten is true if the
+    // changed entry was already copied by the running rewrite, which gets the
+    // command too then.
+    template <typename... Args>
+    inline void append(size_t db, bool rewritten, const char* command, const Args&... args)
+    {
+        _pending.select_db(db);
+        auto offset = _pending.size();
+        _pending.append(command, args...);
+        ++_appended_commands;
+        _appended_bytes += _pending.size() - offset;
+        if (rewritten && _rewriting) {
+            _rewrite_pending.select_db(db);
+            _rewrite_pending.append_raw(_pending.data() + offset, _pending.size() - offset);
+        }
+        if (_fsync_bytes > 0 && _pending.size() >= _fsync_bytes) {
+            maybe_start_write();
+        }
+    }
+    // Resolves once the commands appended so far are written and flushed.
+    future<> sync();
+
+    // [REWRITE]
+    // The entries are copied into the rewrite buffer while the shard keeps
+    // serving, the changes of the entries already copied are appended to both
+    // logs. Once everything is copied, the new file replaces the log.
+    future<> begin_rewrite();
+    inline bool rewriting() const { return _rewriting; }
+    inline aof_encoder& rewrite_buffer() { return _rewrite_pending; }
+    // Writes the rewrite buffer to the new file.
+    future<> flush_rewrite();
+    future<> finish_rewrite();
+    future<> abort_rewrite();
+
+    inline uint64_t appended_commands() const { return _appended_commands; }
+    inline uint64_t appended_bytes() const { return _appended_bytes; }
+    inline uint64_t written_bytes() const { return _written_bytes; }
+    inline uint64_t writes() const { return _writes; }
+    inline uint64_t fsyncs() const { return _fsyncs; }
+    inline uint64_t write_errors() const { return _write_errors; }
+    inline uint64_t rewrites() const { return _rewrites; }
+    inline uint64_t size() const { return _file ? _file->size() : 0; }
+    inline size_t pending_bytes() const { return _pending.size(); }
+private:
+    void maybe_start_write();
+    void finish_write(std::exception_ptr ep, std::vector<char>& data, bool fsync);
+    future<> switch_to_rewritten();
+};
+
+// Finds the end of the last complete command of a log: a crash may have cut the
+// last write off, or left the padding of the last block behind. The stream to a
+// replica is cut at the end of a command as well.
+class aof_scanner final {
+    enum class state {
+        array,
+        array_size,
+        array_lf,
+        bulk,
+        bulk_size,
+        bulk_lf,
+        data,
+        data_cr,
+        data_lf,
+        invalid,
+    };
+    state _state = state::array;
+    uint64_t _value = 0;
+    uint64_t _arguments = 0;
+    uint64_t _offset = 0;
+    uint64_t _valid_size = 0;
+public:
+    inline uint64_t valid_size() const { return _valid_size; }
+
+    // Returns false once the bytes are no commands.
+    bool feed(const char* p, size_t size)
+    {
+        for (size_t i = 0; i < size && _state != state::invalid; ++i, ++_offset) {
+            auto c = p[i];
+            switch (_state) {
+            case state::array:
+                _value = 0;
+                _state = c == '*' ? state::array_size : state::invalid;
+                break;
+            case state::array_size:
+            case state::bulk_size:
+                if (c >= '0' && c <= '9') {
+                    _value = _value * 10 + (c - '0');
+                } else if (c == '\r') {
+                    _state = _state == state::array_size ? state::array_lf : state::bulk_lf;
+                } else {
+                    _state = state::invalid;
+                }
+                break;
+            case state::array_lf:
+                if (c != '\n' || _value == 0) {
+                    _state = state::invalid;
+                    break;
+                }
+                _arguments = _value;
+                _state = state::bulk;
+                break;
+            case state::bulk:
+                _value = 0;
+                _state = c == '$' ? state::bulk_size : state::invalid;
+                break;
+            case state::bulk_lf:
+                if (c != '\n') {
+                    _state = state::invalid;
+                    break;
+                }
+                _state = _value > 0 ? state::data : state::data_cr;
+                break;
+            case state::data: {
+                auto n = std::min<uint64_t>(_value, size - i);
+                _value -= n;
+                i += n - 1;
+                _offset += n - 1;
+                if (_value == 0) {
+                    _state = state::data_cr;
+                }
+                break;
+            }
+            case state::data_cr:
+                _state = c == '\r' ? state::data_lf : state::invalid;
+                break;
+            case state::data_lf:
+                if (c != '\n') {
+                    _state = state::invalid;
+                    break;
+                }
+                if (--_arguments == 0) {
+                    _valid_size = _offset + 1;
+                    _state = state::array;
+                } else {
+                    _state = state::bulk;
+                }
+                break;
+            case state::invalid:
+                break;
+            }
+        }
+        return _state != state::invalid;
+    }
+};
+
+// The replies of the replayed commands are dropped.
+class null_data_sink final : public data_sink_impl {
+public:
+    virtual future<> put(net::packet) override
+    {
+        return make_ready_future<>();
+    }
+    virtual future<> close() override
+    {
+        return make_ready_future<>();
+    }
+};
+
+// Replays the logs of the last run before the shards serve: every shard replays
+// its own log, the logs of the shards not running now are replayed by shard
+// (i % smp::count). Returns the number of logs found.
+future<unsigned> replay_append_only_logs(redis_service& redis, sstring directory, sstring filename);
+// Removes the logs of the shards not running now, once the others were rewritten.
+future<> remove_stale_append_only_logs(sstring directory, sstring filename, unsigned found);
+}
@@ -25,11 +25,281 @@
 #include "core/shared_ptr.hh"
 #include "core/sharded.hh"
 #include "common.hh"
+#include <algorithm>
+#include <cstring>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define PEDIS_BITMAP_X86 1
+#endif
 namespace redis {
 // 512M bytes
 static const size_t MAX_BYTE_COUNT = 1024 * 1024 * 512 - 1;
 static const size_t RESIZE_STEP    = 16;
 
+namespace {
+
+inline uint64_t load_word(const char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline void store_word(char* p, uint64_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+size_t popcount_generic(const char* p, size_t n)
+{
+    size_t bits = 0;
+    for (; n >= 8; p += 8, n -= 8) {
+        auto v = load_word(p);
+        v = v - ((v >> 1) & 0x5555555555555555ULL);
+        v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+        v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+        bits += (v * 0x0101010101010101ULL) >> 56;
+    }
+    for (; n > 0; ++p, --n) {
+        auto v = uint8_t(*p);
+        v = v - ((v >> 1) & 0x55);
+        v = (v & 0x33) + ((v >> 2) & 0x33);
+        bits += (v + (v >> 4)) & 0x0f;
+    }
+    return bits;
+}
+
+template <int Op>
+inline uint64_t combine_word(uint64_t d, uint64_t s)
+{
+    if (Op == BITOP_AND) {
+        return d & s;
+    }
+    else if (Op == BITOP_OR) {
+        return d | s;
+    }
+    else if (Op == BITOP_XOR) {
+        return d ^ s;
+    }
+    return ~s;
+}
+
+template <int Op>
+void apply_generic(char* dst, const char* src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        store_word(dst + i, combine_word<Op>(load_word(dst + i), load_word(src + i)));
+    }
+    for (; i < n; ++i) {
+        dst[i] = static_cast<char>(combine_word<Op>(uint8_t(dst[i]), uint8_t(src[i])));
+    }
+}
+
+template <template <int> class Kernel>
+inline void apply_op(int op, char* dst, const char* src, size_t n)
+{
+    switch (op) {
+    case BITOP_AND:
+        return Kernel<BITOP_AND>::apply(dst, src, n);
+    case BITOP_OR:
+        return Kernel<BITOP_OR>::apply(dst, src, n);
+    case BITOP_XOR:
+        return Kernel<BITOP_XOR>::apply(dst, src, n);
+    default:
+        return Kernel<BITOP_NOT>::apply(dst, src, n);
+    }
+}
+
+template <int Op>
+struct generic_kernel {
+    static void apply(char* dst, const char* src, size_t n) { apply_generic<Op>(dst, src, n); }
+};
+
+void apply_generic(int op, char* dst, const char* src, size_t n)
+{
+    apply_op<generic_kernel>(op, dst, src, n);
+}
+
+// Returns the index of the first byte of @p which is not @skip, or @n.
+size_t skip_generic(const char* p, size_t n, uint8_t skip)
+{
+    size_t i = 0;
+    auto word = uint64_t(skip) * 0x0101010101010101ULL;
+    while (i + 8 <= n && load_word(p + i) == word) {
+        i += 8;
+    }
+    while (i < n && uint8_t(p[i]) == skip) {
+        ++i;
+    }
+    return i;
+}
+
+#ifdef PEDIS_BITMAP_X86
+__attribute__((target("popcnt")))
+size_t popcount_popcnt(const char* p, size_t n)
+{
+    uint64_t a = 0, b = 0, c = 0, d = 0;
+    for (; n >= 32; p += 32, n -= 32) {
+        a += __builtin_popcountll(load_word(p));
+        b += __builtin_popcountll(load_word(p + 8));
+        c += __builtin_popcountll(load_word(p + 16));
+        d += __builtin_popcountll(load_word(p + 24));
+    }
+    for (; n >= 8; p += 8, n -= 8) {
+        a += __builtin_popcountll(load_word(p));
+    }
+    for (; n > 0; ++p, --n) {
+        a += __builtin_popcount(uint8_t(*p));
+    }
+    return a + b + c + d;
+}
+
+// The bits of every nibble are looked up in a register, the 8-bit counts of
+// up to 8 blocks are summed per 64-bit lane before they could overflow.
+__attribute__((target("avx2,popcnt")))
+size_t popcount_avx2(const char* p, size_t n)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i total = zero;
+    while (n >= 32) {
+        __m256i counts = zero;
+        for (int i = 0; i < 8 && n >= 32; ++i, p += 32, n -= 32) {
+            auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            auto lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low_nibbles));
+            auto hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibbles));
+            counts = _mm256_add_epi8(counts, _mm256_add_epi8(lo, hi));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, zero));
+    }
+    size_t bits = static_cast<size_t>(_mm256_extract_epi64(total, 0)) + static_cast<size_t>(_mm256_extract_epi64(total, 1))
+        + static_cast<size_t>(_mm256_extract_epi64(total, 2)) + static_cast<size_t>(_mm256_extract_epi64(total, 3));
+    return bits + popcount_popcnt(p, n);
+}
+
+template <int Op>
+__attribute__((target("avx2")))
+inline __m256i combine_vector(__m256i d, __m256i s)
+{
+    if (Op == BITOP_AND) {
+        return _mm256_and_si256(d, s);
+    }
+    else if (Op == BITOP_OR) {
+        return _mm256_or_si256(d, s);
+    }
+    else if (Op == BITOP_XOR) {
+        return _mm256_xor_si256(d, s);
+    }
+    return _mm256_andnot_si256(s, _mm256_set1_epi8(-1));
+}
+
+template <int Op>
+struct avx2_kernel {
+    __attribute__((target("avx2")))
+    static void apply(char* dst, const char* src, size_t n)
+    {
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            auto d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+            auto s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), combine_vector<Op>(d, s));
+        }
+        apply_generic<Op>(dst + i, src + i, n - i);
+    }
+};
+
+void apply_avx2(int op, char* dst, const char* src, size_t n)
+{
+    apply_op<avx2_kernel>(op, dst, src, n);
+}
+
+__attribute__((target("avx2")))
+size_t skip_avx2(const char* p, size_t n, uint8_t skip)
+{
+    const __m256i word = _mm256_set1_epi8(static_cast<char>(skip));
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, word)));
+        if (mask != 0xffffffffu) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+    return i + skip_generic(p + i, n - i, skip);
+}
+#endif
+
+struct bitmap_kernels {
+    size_t (*popcount)(const char* p, size_t n);
+    void (*apply)(int op, char* dst, const char* src, size_t n);
+    size_t (*skip)(const char* p, size_t n, uint8_t skip);
+};
+
+bitmap_kernels select_kernels()
+{
+#ifdef PEDIS_BITMAP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        return bitmap_kernels { popcount_avx2, apply_avx2, skip_avx2 };
+    }
+    if (__builtin_cpu_supports("popcnt")) {
+        return bitmap_kernels { popcount_popcnt, apply_generic, skip_generic };
+    }
+#endif
+    return bitmap_kernels { popcount_generic, apply_generic, skip_generic };
+}
+
+const bitmap_kernels kernels = select_kernels();
+
+// Resolves the byte range @start to @end of a value of @size bytes as Redis
+// does, returns false if it is empty.
+bool resolve_range(size_t size, long& start, long& end)
+{
+    auto length = static_cast<long>(size);
+    if (start < 0) start += length;
+    if (end < 0) end += length;
+    if (start < 0) start = 0;
+    if (end < 0) end = 0;
+    if (end >= length) end = length - 1;
+    return length > 0 && start <= end;
+}
+
+// Invokes func(data, size, offset) on the parts of the fragments of @o within
+// the bytes @start to @end, until it returns true.
+template <typename Func>
+void for_each_range(const bitmap_view& o, size_t start, size_t end, Func&& func)
+{
+    size_t offset = 0;
+    bool done = false;
+    o.for_each_fragment([&] (bytes_view fragment) {
+        if (done) {
+            return;
+        }
+        auto first = std::max(start, offset);
+        auto last = std::min(end + 1, offset + fragment.size());
+        if (first < last) {
+            done = func(reinterpret_cast<const char*>(fragment.data()) + (first - offset), last - first, first);
+        }
+        offset += fragment.size();
+        done |= offset > end;
+    });
+}
+
+// Folds the @size bytes at @src into @dst by @op. AND clears the bytes of
+// @dst past them, the missing bytes of a source are clear.
+void fold(int op, char* dst, size_t dst_size, const char* src, size_t size)
+{
+    kernels.apply(op, dst, src, size);
+    if (op == BITOP_AND) {
+        memset(dst + size, 0, dst_size - size);
+    }
+}
+
+}
+
 bool bits_operation::set(managed_bytes& o, size_t offset, bool value)
 {
     auto index = offset >> 3;
@@ -51,7 +321,7 @@ bool bits_operation::set(managed_bytes& o, size_t offset, bool value)
     return bit_val > 0;
 }
 
-bool bits_operation::get(const managed_bytes& o, size_t offset)
+bool bits_operation::get(bitmap_view o, size_t offset)
 {
     auto offset_in_bytes = offset >> 3;
     if (offset_in_bytes > BITMAP_MAX_OFFSET || offset_in_bytes >= o.size()) {
@@ -63,72 +333,80 @@ bool bits_operation::get(const managed_bytes& o, size_t offset)
     return bit_val > 0;
 }
 
-size_t bits_operation::count(const managed_bytes& o, long start, long end)
+
+size_t bits_operation::count(bitmap_view o, long start, long end)
 {
-    if (start < 0) start = static_cast<size_t>(start) + o.size();
-    if (end < 0) end = static_cast<size_t>(end) + o.size();
-    if (start < 0) start = 0;
-    if (end < 0) end = 0;
-    if (end >= static_cast<long>(o.size())) end = static_cast<long>(o.size()) - 1;
-    size_t bits_count = 0, count = static_cast<size_t>(end - start) + 1;
-    size_t p = start /*, p4 = 0 */;
-    static const unsigned char bits_in_byte[256] = {
-        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,
-        1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
-        1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
-        2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
-        1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,
-        2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
-        2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,
-        3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8
-    };
-
-    while((unsigned long)(uint8_t(o[p])) & 3 && count) {
-        uint8_t v = uint8_t(o[p++]);
-        bits_count += static_cast<size_t>(bits_in_byte[static_cast<unsigned int>(v)]);
-        count--;
+    if (!resolve_range(o.size(), start, end)) {
+        return 0;
     }
-/*
-    p4 = p;
-    uint32_t d1 = 0, d2 = 0, d3 = 0, d4 = 0, d5 = 0, d6 = 0, d7 = 0;
-    while(count>=28) {
-        d1 = uint8_t(o[p4++]);
-        d2 = uint8_t(o[p4++]);
-        d3 = uint8_t(o[p4++]);
-        d4 = uint8_t(o[p4++]);
-        d5 = uint8_t(o[p4++]);
-        d6 = uint8_t(o[p4++]);
-        d7 = uint8_t(o[p4++]);
-        count -= 28;
-
-        d1 = d1 - ((d1 >> 1) & 0x55555555);
-        d1 = (d1 & 0x33333333) + ((d1 >> 2) & 0x33333333);
-        d2 = d2 - ((d2 >> 1) & 0x55555555);
-        d2 = (d2 & 0x33333333) + ((d2 >> 2) & 0x33333333);
-        d3 = d3 - ((d3 >> 1) & 0x55555555);
-        d3 = (d3 & 0x33333333) + ((d3 >> 2) & 0x33333333);
-        d4 = d4 - ((d4 >> 1) & 0x55555555);
-        d4 = (d4 & 0x33333333) + ((d4 >> 2) & 0x33333333);
-        d5 = d5 - ((d5 >> 1) & 0x55555555);
-        d5 = (d5 & 0x33333333) + ((d5 >> 2) & 0x33333333);
-        d6 = d6 - ((d6 >> 1) & 0x55555555);
-        d6 = (d6 & 0x33333333) + ((d6 >> 2) & 0x33333333);
-        d7 = d7 - ((d7 >> 1) & 0x55555555);
-        d7 = (d7 & 0x33333333) + ((d7 >> 2) & 0x33333333);
-        bits_count += ((((d1 + (d1 >> 4)) & 0x0F0F0F0F) +
-                    ((d2 + (d2 >> 4)) & 0x0F0F0F0F) +
-                    ((d3 + (d3 >> 4)) & 0x0F0F0F0F) +
-                    ((d4 + (d4 >> 4)) & 0x0F0F0F0F) +
-                    ((d5 + (d5 >> 4)) & 0x0F0F0F0F) +
-                    ((d6 + (d6 >> 4)) & 0x0F0F0F0F) +
-                    ((d7 + (d7 >> 4)) & 0x0F0F0F0F))* 0x01010101) >> 24;
-    }
-    p = p4;
-*/
-    while(count--) {
-        uint8_t v = uint8_t(o[p++]);
-        bits_count += static_cast<size_t>(bits_in_byte[static_cast<unsigned int>(v)]);
+    size_t bits = 0;
+    for_each_range(o, start, end, [&bits] (const char* p, size_t n, size_t) {
+        bits += kernels.popcount(p, n);
+        return false;
+    });
+    return bits;
+}
+
+long bits_operation::position(bitmap_view o, bool bit, long start, long end, bool end_given)
+{
+    if (!resolve_range(o.size(), start, end)) {
+        return -1;
+    }
+    long found = -1;
+    uint8_t skip = bit ? 0 : 0xff;
+    for_each_range(o, start, end, [&found, bit, skip] (const char* p, size_t n, size_t offset) {
+        auto i = kernels.skip(p, n, skip);
+        if (i == n) {
+            return false;
+        }
+        unsigned v = bit ? uint8_t(p[i]) : uint8_t(~p[i]);
+        found = static_cast<long>((offset + i) * 8) + (__builtin_clz(v) - 24);
+        return true;
+    });
+    if (found < 0 && !bit && !end_given) {
+        return (end + 1) * 8;
+    }
+    return found;
+}
+
+sstring bits_operation::combine(int op, const std::vector<bitmap_view>& sources)
+{
+    size_t size = 0;
+    for (auto& source : sources) {
+        size = std::max<size_t>(size, source.size());
+    }
+    sstring result(sstring::initialized_later(), size);
+    auto dst = result.begin();
+    memset(dst, op == BITOP_AND ? 0xff : 0, size);
+    for (auto& source : sources) {
+        size_t offset = 0;
+        source.for_each_fragment([op, dst, &offset] (bytes_view fragment) {
+            kernels.apply(op, dst + offset, reinterpret_cast<const char*>(fragment.data()), fragment.size());
+            offset += fragment.size();
+        });
+        if (op == BITOP_AND) {
+            memset(dst + offset, 0, size - offset);
+        }
+    }
+    return result;
+}
+
+sstring bits_operation::combine(int op, const std::vector<sstring>& partials)
+{
+    // NOT has a single source, whose shard returns it inverted.
+    if (op == BITOP_NOT || partials.size() == 1) {
+        return partials.empty() ? sstring() : partials[0];
+    }
+    size_t size = 0;
+    for (auto& partial : partials) {
+        size = std::max<size_t>(size, partial.size());
+    }
+    sstring result(sstring::initialized_later(), size);
+    auto dst = result.begin();
+    memset(dst, op == BITOP_AND ? 0xff : 0, size);
+    for (auto& partial : partials) {
+        fold(op, dst, size, partial.begin(), partial.size());
     }
-    return bits_count;
+    return result;
 }
 }
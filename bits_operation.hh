@@ -20,11 +20,53 @@
 */
 #pragma once
 #include "utils/managed_bytes.hh"
+#include "core/sstring.hh"
+#include <vector>
 namespace redis {
+// The bytes of a string read as a bitmap: its managed bytes, which may be
+// fragmented, or the bytes of a short string inlined into its entry. The
+// default view is the bitmap of a missing key.
+class bitmap_view {
+    const managed_bytes* _bytes = nullptr;
+    bytes_view _contiguous;
+public:
+    bitmap_view() {}
+    bitmap_view(const managed_bytes& b) : _bytes(&b) {}
+    explicit bitmap_view(bytes_view b) : _contiguous(b) {}
+
+    inline size_t size() const {
+        return _bytes ? _bytes->size() : _contiguous.size();
+    }
+    inline uint8_t operator[](size_t index) const {
+        return uint8_t(_bytes ? (*_bytes)[index] : _contiguous[index]);
+    }
+    template <typename Func>
+    inline void for_each_fragment(Func&& func) const {
+        if (_bytes) {
+            _bytes->for_each_fragment(std::forward<Func>(func));
+        }
+        else if (!_contiguous.empty()) {
+            func(_contiguous);
+        }
+    }
+};
+
+// The bitmaps are scanned fragment by fragment. The kernels counting,
+// combining and searching the bytes use POPCNT or AVX2 when the CPU has them,
+// which is checked once at start.
 struct bits_operation
 {
     static bool set(managed_bytes& o, size_t offset, bool value);
-    static bool get(const managed_bytes& o, size_t offset);
-    static size_t count(const managed_bytes& o, long start, long end);
+    static bool get(bitmap_view o, size_t offset);
+    // The number of bits set in the bytes @start to @end (inclusive) of @o.
+    static size_t count(bitmap_view o, long start, long end);
+    // The position of the first bit @bit in the bytes @start to @end of @o, or
+    // -1. The bytes past the end of @o are clear unless @end_given, as in BITPOS.
+    static long position(bitmap_view o, bool bit, long start, long end, bool end_given);
+    // BITOP @op of the @sources, empty views for the missing keys. AND, OR and XOR
+    // are associative, so the results of several shards are combined again with
+    // the same operation.
+    static sstring combine(int op, const std::vector<bitmap_view>& sources);
+    static sstring combine(int op, const std::vector<sstring>& partials);
 };
 }
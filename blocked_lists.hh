@@ -0,0 +1,157 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/future.hh"
+#include "core/reactor.hh"
+#include "core/shared_ptr.hh"
+#include "core/sstring.hh"
+#include "core/timer.hh"
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+namespace redis {
+
+// The outcome of a pop of BLPOP, BRPOP or BLMOVE on the lists of a shard.
+struct blocked_pop {
+    enum class state {
+        // no list had an element, or the client timed out.
+        empty,
+        // @_value was popped from the list @_key.
+        popped,
+        // a list of the client was pushed to, it pops again.
+        woken,
+        wrong_type,
+    };
+    state _state = state::empty;
+    sstring _key;
+    sstring _value;
+};
+
+// A connection running BLPOP, BRPOP or BLMOVE: the ids it blocks as on the
+// shards of its keys, and whether the client disconnected meanwhile. A client
+// gone is unblocked on every shard, the element it was handed goes back.
+struct blocked_client {
+    std::vector<uint64_t> _ids;
+    bool _gone = false;
+};
+
+// The clients of a shard blocked on its empty lists. A client waits in the
+// queue of every key it blocks on, in the database the client selected, and a push to one of them serves the
+// clients in the order they blocked, one per element. A client whose keys are
+// all owned by the shard is handed its element by the push; a client also
+// blocked on the lists of other shards is only woken, and pops again from its
+// keys in their order, so that no element is taken twice.
+class blocked_lists final {
+public:
+    struct waiter {
+        uint64_t _id;
+        size_t _db;
+        std::vector<sstring> _keys;
+        bool _left;
+        bool _hand_off;
+        promise<blocked_pop> _promise;
+        timer<lowres_clock> _timer;
+    };
+private:
+    using queue_map = std::unordered_map<sstring, std::deque<lw_shared_ptr<waiter>>>;
+    // The queues of every database, grown on demand.
+    std::vector<queue_map> _queues;
+    std::unordered_map<uint64_t, lw_shared_ptr<waiter>> _waiters;
+public:
+    // Blocks the client @id on @keys until @deadline, lowres_clock::time_point::max()
+    // blocks it until it's served. The client is queued before this returns.
+    future<blocked_pop> block(uint64_t id, size_t db, const std::vector<sstring>& keys, bool left, bool hand_off, lowres_clock::time_point deadline)
+    {
+        auto w = make_lw_shared<waiter>();
+        w->_id = id;
+        w->_db = db;
+        w->_keys = keys;
+        w->_left = left;
+        w->_hand_off = hand_off;
+        if (deadline != lowres_clock::time_point::max()) {
+            w->_timer.set_callback([this, id] {
+                finish(id, blocked_pop {});
+            });
+            w->_timer.arm(deadline);
+        }
+        if (_queues.size() <= db) {
+            _queues.resize(db + 1);
+        }
+        for (auto& key : w->_keys) {
+            _queues[db][key].push_back(w);
+        }
+        _waiters.emplace(id, w);
+        return w->_promise.get_future();
+    }
+
+    inline bool blocked(size_t db, const sstring& key) const
+    {
+        return db < _queues.size() && !_queues[db].empty() && _queues[db].find(key) != _queues[db].end();
+    }
+
+    // The first client blocked on @key, which must be blocked.
+    inline waiter& first(size_t db, const sstring& key)
+    {
+        return *_queues[db].find(key)->second.front();
+    }
+
+    // Unblocks the client @id with @result, if it's still blocked.
+    void finish(uint64_t id, blocked_pop result)
+    {
+        auto it = _waiters.find(id);
+        if (it == _waiters.end()) {
+            return;
+        }
+        auto w = std::move(it->second);
+        _waiters.erase(it);
+        w->_timer.cancel();
+        auto& queues = _queues[w->_db];
+        for (auto& key : w->_keys) {
+            auto q = queues.find(key);
+            auto& queue = q->second;
+            queue.erase(std::remove_if(queue.begin(), queue.end(), [&w] (const lw_shared_ptr<waiter>& o) {
+                return o.get() == w.get();
+            }), queue.end());
+            if (queue.empty()) {
+                queues.erase(q);
+            }
+        }
+        w->_promise.set_value(std::move(result));
+    }
+
+    // The number of the clients blocked.
+    inline size_t size() const
+    {
+        return _waiters.size();
+    }
+
+    // Unblocks all the clients as timed out.
+    void clear()
+    {
+        while (!_waiters.empty()) {
+            finish(_waiters.begin()->first, blocked_pop {});
+        }
+    }
+};
+}
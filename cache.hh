@@ -24,6 +24,17 @@
 #include <boost/intrusive_ptr.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/optional.hpp>
+#include <random>
+#include <algorithm>
+#include <memory>
+#include <deque>
+#include <unordered_map>
+#include <limits>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define PEDIS_CACHE_SSE2 1
+#endif
+#include <cassert>
 #include "common.hh"
 #include "utils/bytes.hh"
 #include "utils/managed_ref.hh"
@@ -87,18 +98,58 @@ enum class entry_type {
     ENTRY_SSET  = 6,
     ENTRY_HLL   = 7,
 };
+// The policies to pick the entry to evict when the memory limit is reached,
+// the same as the maxmemory-policy of Redis.
+enum class eviction_policy {
+    noeviction,
+    allkeys_lru,
+    volatile_lru,
+    allkeys_lfu,
+    volatile_ttl,
+};
+
+// Takes back the record of a tiered value once its entry is destroyed, the
+// flash tier of the shard if it has one, see flash_tier.
+class tier_releaser {
+public:
+    virtual ~tier_releaser() {}
+    virtual void release(uint64_t location) = 0;
+    static inline tier_releaser*& local()
+    {
+        static thread_local tier_releaser* releaser = nullptr;
+        return releaser;
+    }
+};
+
 class cache_entry
 {
 protected:
     friend class cache;
-    using hook_type = boost::intrusive::unordered_set_member_hook<>;
-    hook_type _cache_link;
+    friend class entry_table;
+    // The slot of the entry in the index of its cache, see entry_table.
+    cache_entry** _slot = nullptr;
     entry_type _type;
+    // Access metadata for the eviction: the last access time (seconds of
+    // clock_type), and a logarithmic access frequency counter, as the LFU of Redis.
+    mutable uint32_t _access_time;
+    mutable uint8_t _frequency;
+    // Set while the entry is expired and waits in the backlog of the active expiry.
+    bool _expiry_pending = false;
+    // Set while the string value is inlined, see make().
+    bool _value_inlined = false;
+    // Set while the string value is in the flash tier, the storage holds its location.
+    bool _value_tiered = false;
+    // Set while a reply is read from the value, see entry_reader.
+    mutable bool _streamed = false;
+    uint32_t _key_size;
+    // Null while the key is inlined.
     managed_ref<managed_bytes> _key;
     size_t _key_hash;
     union storage {
         double _float_number;
         int64_t _integer_number;
+        size_t _inline_size;
+        uint64_t _tier_location;
         managed_ref<managed_bytes> _bytes;
         managed_ref<list_lsa> _list;
         managed_ref<dict_lsa> _dict;
@@ -111,12 +162,71 @@ protected:
 public:
     using time_point = expiration::time_point;
     using duration = expiration::duration;
+    static constexpr const uint8_t LFU_INIT_FREQUENCY = 5;
+    static constexpr const uint8_t LFU_LOG_FACTOR = 10;
+
+    // Short keys, and the short string values with their keys, are stored in
+    // the entry itself, right after it, so that looking them up or reading them
+    // does not follow another pointer, and no other object is allocated for them.
+    static constexpr const size_t INLINE_CAPACITY = 64;
+
+    static inline uint32_t access_clock()
+    {
+        return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(clock_type::now().time_since_epoch()).count());
+    }
+
+    static inline bool inlines_key(size_t key_size)
+    {
+        return key_size <= INLINE_CAPACITY;
+    }
+
+    static inline bool inlines_value(size_t key_size, size_t value_size)
+    {
+        return key_size + value_size <= INLINE_CAPACITY;
+    }
+
+    // Bytes allocated after the entry for its inlined key and value.
+    static inline size_t inline_size(const sstring& key)
+    {
+        return inlines_key(key.size()) ? key.size() : 0;
+    }
+
+    static inline size_t inline_size(const sstring& key, const sstring& data)
+    {
+        return inlines_value(key.size(), data.size()) ? key.size() + data.size() : inline_size(key);
+    }
+
+    template <typename T>
+    static inline size_t inline_size(const sstring& key, const T&)
+    {
+        return inline_size(key);
+    }
+
+    // Allocates an entry with the room for its inlined key and value. The
+    // entries must be created by make(), the constructors write the inlined
+    // bytes past the end of the object, and are destroyed as usual by
+    // current_allocator().destroy().
+    template <typename... Args>
+    static cache_entry* make(const sstring& key, size_t hash, Args&&... args)
+    {
+        auto size = sizeof(cache_entry) + inline_size(key, args...);
+        void* storage = current_allocator().alloc(&standard_migrator<cache_entry>::object, size, alignof(cache_entry));
+        return new (storage) cache_entry(key, hash, std::forward<Args>(args)...);
+    }
+
     cache_entry(const sstring& key, size_t hash, entry_type type) noexcept
-        : _cache_link()
-        , _type(type)
+        : _type(type)
+        , _access_time(access_clock())
+        , _frequency(LFU_INIT_FREQUENCY)
+        , _key_size(key.size())
         , _key_hash(hash)
     {
-        _key = make_managed<managed_bytes>(bytes_view{reinterpret_cast<const signed char*>(key.data()), key.size()});
+        if (inlines_key(key.size())) {
+            std::copy_n(key.data(), key.size(), inline_data());
+        }
+        else {
+            _key = make_managed<managed_bytes>(bytes_view{reinterpret_cast<const signed char*>(key.data()), key.size()});
+        }
     }
 
     cache_entry(const sstring& key, size_t hash, double data) noexcept
@@ -131,16 +241,24 @@ public:
         _storage._integer_number = data;
     }
 
+    // The bitmaps are grown in place, they are never inlined.
     cache_entry(const sstring key, size_t hash, size_t origin_size) noexcept
         : cache_entry(key, hash, entry_type::ENTRY_BYTES)
     {
-        _storage._bytes = make_managed<managed_bytes>(origin_size, 0);
+        new (&_storage._bytes) managed_ref<managed_bytes>(make_managed<managed_bytes>(origin_size, 0));
     }
 
     cache_entry(const sstring& key, size_t hash, const sstring& data) noexcept
         : cache_entry(key, hash, entry_type::ENTRY_BYTES)
     {
-        _storage._bytes = make_managed<managed_bytes>(bytes_view{reinterpret_cast<const signed char*>(data.data()), data.size()});
+        if (inlines_value(key.size(), data.size())) {
+            _value_inlined = true;
+            _storage._inline_size = data.size();
+            std::copy_n(data.data(), data.size(), inline_data() + key.size());
+        }
+        else {
+            new (&_storage._bytes) managed_ref<managed_bytes>(make_managed<managed_bytes>(bytes_view{reinterpret_cast<const signed char*>(data.data()), data.size()}));
+        }
     }
     struct list_initializer {};
     cache_entry(const sstring& key, size_t hash, list_initializer) noexcept
@@ -174,15 +292,33 @@ public:
     cache_entry(const sstring& key, size_t hash, hll_initializer) noexcept
         : cache_entry(key, hash, entry_type::ENTRY_HLL)
     {
-        _storage._bytes = make_managed<managed_bytes>(HLL_BYTES_SIZE, 0);
+        _storage._bytes = make_managed<managed_bytes>(hll::empty());
     }
 
+    // Only the compaction of the LSA moves an entry, into an allocation as
+    // large as the source, so the inlined bytes are copied along, the slot of
+    // the entry is pointed to the new location, and the new entry takes the
+    // place of the source in the expiring set (or the expiry backlog).
     cache_entry(cache_entry&& o) noexcept
-        : _cache_link(std::move(o._cache_link))
+        : _slot(o._slot)
         , _type(o._type)
-        , _key(std::move(_key))
+        , _access_time(o._access_time)
+        , _frequency(o._frequency)
+        , _expiry_pending(o._expiry_pending)
+        , _value_inlined(o._value_inlined)
+        , _value_tiered(o._value_tiered)
+        , _streamed(o._streamed)
+        , _key_size(o._key_size)
+        , _key(std::move(o._key))
         , _key_hash(std::move(o._key_hash))
+        , _expiry(o._expiry)
     {
+        if (_slot) {
+            *_slot = this;
+            o._slot = nullptr;
+        }
+        _timer_link.swap_nodes(o._timer_link);
+        std::copy_n(o.inline_data(), o.inline_size(), inline_data());
         switch (_type) {
             case entry_type::ENTRY_FLOAT:
                 _storage._float_number = std::move(o._storage._float_number);
@@ -192,7 +328,16 @@ public:
                 break;
             case entry_type::ENTRY_BYTES:
             case entry_type::ENTRY_HLL:
-                _storage._bytes = std::move(o._storage._bytes);
+                if (_value_inlined) {
+                    _storage._inline_size = o._storage._inline_size;
+                }
+                else if (_value_tiered) {
+                    // the source gives nothing back to the tier once destroyed.
+                    _storage._tier_location = std::exchange(o._storage._tier_location, 0);
+                }
+                else {
+                    new (&_storage._bytes) managed_ref<managed_bytes>(std::move(o._storage._bytes));
+                }
                 break;
             case entry_type::ENTRY_LIST:
                 _storage._list = std::move(o._storage._list);
@@ -215,7 +360,14 @@ public:
                 break;
             case entry_type::ENTRY_BYTES:
             case entry_type::ENTRY_HLL:
-                _storage._bytes.~managed_ref<managed_bytes>();
+                if (_value_tiered) {
+                    if (_storage._tier_location != 0 && tier_releaser::local() != nullptr) {
+                        tier_releaser::local()->release(_storage._tier_location);
+                    }
+                }
+                else if (!_value_inlined) {
+                    _storage._bytes.~managed_ref<managed_bytes>();
+                }
                 break;
             case entry_type::ENTRY_LIST:
                 _storage._list.~managed_ref<list_lsa>();
@@ -251,7 +403,7 @@ public:
         return msg_type_none;
     }
     friend inline bool operator == (const cache_entry &l, const cache_entry &r) {
-        return (l._key_hash == r._key_hash) && (*(l._key) == *(r._key));
+        return (l._key_hash == r._key_hash) && (l.key() == r.key());
     }
 
     friend inline std::size_t hash_value(const cache_entry& e) {
@@ -261,9 +413,7 @@ public:
     struct compare {
     public:
         inline bool operator () (const cache_entry& l, const cache_entry& r) const {
-            const auto& lk = *(l._key);
-            const auto& rk = *(r._key);
-            return (l.key_hash() == r.key_hash()) && (lk == rk);
+            return (l.key_hash() == r.key_hash()) && (l.key() == r.key());
         }
         inline bool operator () (const redis_key& k, const cache_entry& e) const {
             return (k.hash() == e.key_hash()) && (k.size() == e.key_size()) && (memcmp(k.data(), e.key_data(), k.size()) == 0);
@@ -273,6 +423,33 @@ public:
         }
     };
 public:
+    // The frequency counter decays by one every minute without access.
+    inline uint8_t frequency(uint32_t now) const
+    {
+        auto elapsed = (now - _access_time) / 60;
+        return elapsed >= _frequency ? 0 : _frequency - elapsed;
+    }
+
+    inline void touch(uint32_t random) const
+    {
+        auto now = access_clock();
+        auto counter = frequency(now);
+        if (counter < 255) {
+            // the counter is increased with probability 1 / ((counter - init) * factor + 1).
+            auto base = counter > LFU_INIT_FREQUENCY ? counter - LFU_INIT_FREQUENCY : 0;
+            if (random % (base * LFU_LOG_FACTOR + 1) == 0) {
+                ++counter;
+            }
+        }
+        _frequency = counter;
+        _access_time = now;
+    }
+
+    inline uint32_t idle_time(uint32_t now) const
+    {
+        return now - _access_time;
+    }
+
     inline const clock_type::time_point get_timeout() const
     {
         return _expiry.to_time_point();
@@ -293,6 +470,11 @@ public:
         _expiry = expiry;
     }
 
+    inline bool expired(clock_type::time_point now) const
+    {
+        return _expiry.ever_expires() && _expiry.to_time_point() <= now;
+    }
+
     inline const size_t time_of_live() const
     {
         auto dur = get_timeout() - clock_type::now();
@@ -311,30 +493,127 @@ public:
 
     inline size_t key_size() const
     {
-        return _key->size();
+        return _key_size;
     }
 
     inline const bytes_view key() const
     {
-        return { _key->data(), _key->size() };
+        return { reinterpret_cast<const signed char*>(key_data()), key_size() };
     }
 
     inline const char* key_data() const
     {
-        return reinterpret_cast<const char*>(_key->data());
+        return _key ? reinterpret_cast<const char*>(_key->data()) : inline_data();
+    }
+    inline bool value_inlined() const
+    {
+        return _value_inlined;
+    }
+    // The value of a tiered string must be read back before it's used, see
+    // database::promote(), or staged, see flash_tier::value_of().
+    inline bool value_tiered() const
+    {
+        return _value_tiered;
+    }
+    inline uint64_t tier_location() const
+    {
+        return _storage._tier_location;
+    }
+    // Drops the value, kept by the flash tier at @location from now on. It
+    // must be called with the allocator of the entry.
+    inline void move_value_to_tier(uint64_t location)
+    {
+        assert(type_of_bytes() && !_value_inlined && !_value_tiered);
+        _storage._bytes.~managed_ref<managed_bytes>();
+        _storage._tier_location = location;
+        _value_tiered = true;
+    }
+    // Takes the value read back from the tier, whose record is released by
+    // the caller. It must be called with the allocator of the entry.
+    inline void load_tiered_value(bytes_view data)
+    {
+        assert(_value_tiered);
+        auto value = make_managed<managed_bytes>(data);
+        new (&_storage._bytes) managed_ref<managed_bytes>(std::move(value));
+        _value_tiered = false;
     }
     inline size_t value_bytes_size() const
     {
-        return _storage._bytes->size();
+        return _value_inlined ? _storage._inline_size : _storage._bytes->size();
     }
     inline const char* value_bytes_data() const
     {
-        return reinterpret_cast<const char*>(_storage._bytes->data());
+        return _value_inlined ? inline_data() + _key_size : reinterpret_cast<const char*>(_storage._bytes->data());
+    }
+    inline const bytes_view value_bytes_view() const
+    {
+        return { reinterpret_cast<const signed char*>(value_bytes_data()), value_bytes_size() };
     }
     inline entry_type type() const
     {
         return _type;
     }
+    // Bytes allocated for the entry, its key and its value, as MEMORY USAGE reports.
+    size_t memory_usage() const
+    {
+        size_t usage = sizeof(cache_entry) + inline_size();
+        if (_key) {
+            usage += sizeof(managed<managed_bytes>) + _key->external_memory_usage();
+        }
+        switch (_type) {
+            case entry_type::ENTRY_FLOAT:
+            case entry_type::ENTRY_INT64:
+                break;
+            case entry_type::ENTRY_BYTES:
+            case entry_type::ENTRY_HLL:
+                if (!_value_inlined && !_value_tiered) {
+                    usage += sizeof(managed<managed_bytes>) + _storage._bytes->external_memory_usage();
+                }
+                break;
+            case entry_type::ENTRY_LIST:
+                usage += sizeof(managed<list_lsa>) - sizeof(list_lsa) + _storage._list->memory_usage();
+                break;
+            case entry_type::ENTRY_MAP:
+            case entry_type::ENTRY_SET:
+                usage += sizeof(managed<dict_lsa>) - sizeof(dict_lsa) + _storage._dict->memory_usage();
+                break;
+            case entry_type::ENTRY_SSET:
+                usage += sizeof(managed<sset_lsa>) - sizeof(sset_lsa) + _storage._sset->memory_usage();
+                break;
+        }
+        return usage;
+    }
+    // The number of the allocations freed with the value, roughly.
+    size_t free_effort() const
+    {
+        switch (_type) {
+            case entry_type::ENTRY_LIST:
+                return _storage._list->size();
+            case entry_type::ENTRY_MAP:
+            case entry_type::ENTRY_SET:
+                return _storage._dict->packed() || _storage._dict->integers() ? 1 : _storage._dict->size();
+            case entry_type::ENTRY_SSET:
+                return _storage._sset->size();
+            default:
+                return 1;
+        }
+    }
+    // Frees up to @budget elements of a collection, see cache::release_lazily().
+    // Returns true once nothing but the entry is left to free.
+    bool release_value(size_t& budget)
+    {
+        switch (_type) {
+            case entry_type::ENTRY_LIST:
+                return _storage._list->release(budget);
+            case entry_type::ENTRY_MAP:
+            case entry_type::ENTRY_SET:
+                return _storage._dict->release(budget);
+            case entry_type::ENTRY_SSET:
+                return _storage._sset->release(budget);
+            default:
+                return true;
+        }
+    }
     inline bool type_of_float() const
     {
         return _type == entry_type::ENTRY_FLOAT;
@@ -381,12 +660,30 @@ public:
     {
         _storage._float_number += step;
     }
+    // An inlined value is moved out of the entry first, as a string being
+    // modified in place (SETBIT, SETRANGE, ...) is likely to grow. It must be
+    // called with the allocator of the entry.
     inline managed_bytes& value_bytes() {
+        if (_value_inlined) {
+            spill_value(value_bytes_view());
+        }
         return *(_storage._bytes);
     }
+    // The value must not be inlined, see value_bytes_view().
     inline const managed_bytes& value_bytes() const {
+        assert(!_value_inlined);
         return *(_storage._bytes);
     }
+    // Replaces the string value. The new value is never inlined, the room
+    // after the entry was sized for the previous one.
+    inline void assign_value_bytes(bytes_view data) {
+        if (_value_inlined) {
+            spill_value(data);
+        }
+        else {
+            _storage._bytes = make_managed<managed_bytes>(data);
+        }
+    }
     inline list_lsa& value_list() {
         return *(_storage._list);
     }
@@ -411,37 +708,768 @@ public:
     inline const sset_lsa& value_sset() const {
         return *(_storage._sset);
     }
+private:
+    inline char* inline_data()
+    {
+        return reinterpret_cast<char*>(this) + sizeof(cache_entry);
+    }
+    inline const char* inline_data() const
+    {
+        return reinterpret_cast<const char*>(this) + sizeof(cache_entry);
+    }
+    inline size_t inline_size() const
+    {
+        return (_key ? 0 : _key_size) + (_value_inlined ? _storage._inline_size : 0);
+    }
+    // Stores @data as the managed value of an entry whose value is inlined.
+    void spill_value(bytes_view data)
+    {
+        auto value = make_managed<managed_bytes>(data);
+        new (&_storage._bytes) managed_ref<managed_bytes>(std::move(value));
+        _value_inlined = false;
+    }
 };
 
 static constexpr const size_t DEFAULT_INITIAL_SIZE = 1 << 20;
+static constexpr const std::chrono::microseconds DEFAULT_EXPIRY_BUDGET { 500 };
+
+// The index of the entries of a cache, an open addressing table in the way of
+// SwissTable. The slots are split into groups of GROUP_SIZE, and every slot
+// has a control byte: EMPTY, DELETED, or the 7 low bits of the hash of its
+// entry. The other bits of the hash pick the home group of the entry, the
+// groups are probed from there, quadratically, up to the first group with an
+// empty slot. A lookup matches the control bytes of a whole group at once,
+// with SSE2 where available, and compares the keys of the matching slots
+// only, so that most hits and most misses read a single group of control
+// bytes before the key compare.
+//
+// An entry points back to its slot, which it updates when the compaction of
+// the LSA moves it, as managed_ref does; the arrays of the table are not
+// allocated from the LSA.
+//
+// A bucket is made of the entries of a home group. The buckets split into
+// two in a table twice as large, as the buckets of a chained table, so the
+// incremental rehashing and SCAN of the cache work bucket by bucket.
+class entry_table {
+public:
+    static constexpr const size_t GROUP_SIZE = 16;
+private:
+    static constexpr const int8_t EMPTY = -128;
+    static constexpr const int8_t DELETED = -2;
+    size_t _group_count = 0;
+    std::unique_ptr<int8_t[]> _control;
+    std::unique_ptr<cache_entry*[]> _slots;
+    size_t _size = 0;
+    size_t _deleted = 0;
+
+    static inline int8_t tag(size_t hash)
+    {
+        return static_cast<int8_t>(hash & 0x7f);
+    }
+
+    inline const int8_t* group(size_t g) const
+    {
+        return _control.get() + g * GROUP_SIZE;
+    }
 
+    // Bit i is set if the control byte i of @control is @c.
+    static inline uint32_t match(const int8_t* control, int8_t c)
+    {
+#ifdef PEDIS_CACHE_SSE2
+        auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(control));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(c))));
+#else
+        uint32_t bits = 0;
+        for (size_t i = 0; i < GROUP_SIZE; ++i) {
+            bits |= uint32_t(control[i] == c) << i;
+        }
+        return bits;
+#endif
+    }
+
+    // Bit i is set if the slot i of @control is empty or deleted, the control
+    // bytes of which have their high bit set.
+    static inline uint32_t match_free(const int8_t* control)
+    {
+#ifdef PEDIS_CACHE_SSE2
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(control))));
+#else
+        uint32_t bits = 0;
+        for (size_t i = 0; i < GROUP_SIZE; ++i) {
+            bits |= uint32_t(control[i] < 0) << i;
+        }
+        return bits;
+#endif
+    }
+
+    static inline uint32_t match_full(const int8_t* control)
+    {
+        return ~match_free(control) & ((1u << GROUP_SIZE) - 1);
+    }
+
+    // Calls @func on the groups of the probe sequence from the group @home,
+    // until it returns true. The triangular steps visit every group once.
+    template <typename Func>
+    inline void probe(size_t home, Func&& func) const
+    {
+        auto g = home;
+        for (size_t i = 1; i <= _group_count; ++i) {
+            if (func(g)) {
+                return;
+            }
+            g = (g + i) & (_group_count - 1);
+        }
+    }
+public:
+    // A table without any slot, as the old table of a cache which is not rehashing.
+    entry_table() {}
+
+    explicit entry_table(size_t group_count)
+        : _group_count(group_count)
+        , _control(new int8_t[group_count * GROUP_SIZE])
+        , _slots(new cache_entry*[group_count * GROUP_SIZE])
+    {
+        std::fill_n(_control.get(), group_count * GROUP_SIZE, EMPTY);
+    }
+
+    entry_table(entry_table&& o) noexcept
+        : _group_count(o._group_count)
+        , _control(std::move(o._control))
+        , _slots(std::move(o._slots))
+        , _size(o._size)
+        , _deleted(o._deleted)
+    {
+        o._group_count = o._size = o._deleted = 0;
+    }
+
+    entry_table& operator = (entry_table&& o) noexcept
+    {
+        if (this != &o) {
+            this->~entry_table();
+            new (this) entry_table(std::move(o));
+        }
+        return *this;
+    }
+
+    inline size_t bucket_count() const
+    {
+        return _group_count;
+    }
+
+    inline size_t capacity() const
+    {
+        return _group_count * GROUP_SIZE;
+    }
+
+    inline size_t size() const
+    {
+        return _size;
+    }
+
+    inline bool empty() const
+    {
+        return _size == 0;
+    }
+
+    // The slots which are full or deleted, the deleted slots are reused by the
+    // insertions but still lengthen the probing.
+    inline size_t used() const
+    {
+        return _size + _deleted;
+    }
+
+    inline size_t bucket_of(size_t hash) const
+    {
+        return (hash >> 7) & (_group_count - 1);
+    }
+
+    template <typename Key, typename Equal>
+    inline cache_entry* find(const Key& key, size_t hash, Equal&& equal) const
+    {
+        cache_entry* found = nullptr;
+        auto t = tag(hash);
+        probe(bucket_of(hash), [this, &key, &equal, &found, t] (size_t g) {
+            auto control = group(g);
+            for (auto bits = match(control, t); bits != 0; bits &= bits - 1) {
+                auto e = _slots[g * GROUP_SIZE + __builtin_ctz(bits)];
+                if (equal(key, *e)) {
+                    found = e;
+                    return true;
+                }
+            }
+            return match(control, EMPTY) != 0;
+        });
+        return found;
+    }
+
+    // The first stage of a batched lookup: prefetches the control bytes and
+    // the slots of the home group of @hash.
+    inline void prefetch_group(size_t hash) const
+    {
+        auto g = bucket_of(hash);
+        __builtin_prefetch(group(g));
+        __builtin_prefetch(_slots.get() + g * GROUP_SIZE);
+        __builtin_prefetch(_slots.get() + g * GROUP_SIZE + GROUP_SIZE / 2);
+    }
+
+    // The second stage: prefetches the entries of the home group of @hash
+    // whose tag matches, with their inlined keys.
+    inline void prefetch_candidates(size_t hash) const
+    {
+        auto g = bucket_of(hash);
+        for (auto bits = match(group(g), tag(hash)); bits != 0; bits &= bits - 1) {
+            auto e = _slots[g * GROUP_SIZE + __builtin_ctz(bits)];
+            __builtin_prefetch(e);
+            __builtin_prefetch(reinterpret_cast<const char*>(e) + sizeof(cache_entry));
+        }
+    }
+
+    // The entry must not be in the table yet. Returns false, and leaves the
+    // entry out, if the table is full.
+    inline bool insert(cache_entry& e)
+    {
+        auto hash = e.key_hash();
+        bool inserted = false;
+        probe(bucket_of(hash), [this, &e, &inserted, hash] (size_t g) {
+            auto bits = match_free(group(g));
+            if (bits == 0) {
+                return false;
+            }
+            auto i = g * GROUP_SIZE + __builtin_ctz(bits);
+            if (_control[i] == DELETED) {
+                --_deleted;
+            }
+            _control[i] = tag(hash);
+            _slots[i] = &e;
+            e._slot = &_slots[i];
+            ++_size;
+            inserted = true;
+            return true;
+        });
+        return inserted;
+    }
+
+    // Whether @e is in the table.
+    inline bool owns(const cache_entry& e) const
+    {
+        return e._slot >= _slots.get() && e._slot < _slots.get() + capacity();
+    }
+
+    // A group which has an empty slot never ended a probing, its slot can be
+    // empty again. Otherwise a lookup may have to probe past it.
+    inline void erase(cache_entry& e)
+    {
+        auto i = static_cast<size_t>(e._slot - _slots.get());
+        if (match(group(i / GROUP_SIZE), EMPTY) != 0) {
+            _control[i] = EMPTY;
+        } else {
+            _control[i] = DELETED;
+            ++_deleted;
+        }
+        e._slot = nullptr;
+        --_size;
+    }
+
+    // Calls @func on the entries of the bucket @bucket, @func may erase the
+    // entry it is called on.
+    template <typename Func>
+    inline void for_each_in_bucket(size_t bucket, Func&& func) const
+    {
+        probe(bucket, [this, bucket, &func] (size_t g) {
+            auto control = group(g);
+            for (auto bits = match_full(control); bits != 0; bits &= bits - 1) {
+                auto e = _slots[g * GROUP_SIZE + __builtin_ctz(bits)];
+                if (bucket_of(e->key_hash()) == bucket) {
+                    func(*e);
+                }
+            }
+            return match(control, EMPTY) != 0;
+        });
+    }
+
+    template <typename Func>
+    inline void for_each(Func&& func) const
+    {
+        for (size_t g = 0; g < _group_count; ++g) {
+            for (auto bits = match_full(group(g)); bits != 0; bits &= bits - 1) {
+                func(*_slots[g * GROUP_SIZE + __builtin_ctz(bits)]);
+            }
+        }
+    }
+
+    // Returns a full slot of the group @g, the first one from the slot @start.
+    inline cache_entry* entry_in_group(size_t g, unsigned start) const
+    {
+        auto bits = match_full(group(g));
+        if (bits == 0) {
+            return nullptr;
+        }
+        start %= GROUP_SIZE;
+        auto rotated = (bits >> start) | (bits << (GROUP_SIZE - start));
+        auto i = (__builtin_ctz(rotated & ((1u << GROUP_SIZE) - 1)) + start) % GROUP_SIZE;
+        return _slots[g * GROUP_SIZE + i];
+    }
+
+    // Forgets the entries, which the caller releases.
+    void clear()
+    {
+        std::fill_n(_control.get(), capacity(), EMPTY);
+        _size = 0;
+        _deleted = 0;
+    }
+};
+
+// Reads the value of an entry over several tasks, e.g. a reply encoded chunk
+// after chunk, see cache::attach(). Before the entry changes, or goes, the
+// cache calls read_all(), which reads the rest of the value at once.
+class entry_reader {
+public:
+    virtual ~entry_reader() {}
+    virtual void read_all(const cache_entry& e) = 0;
+};
+
+// The cache grows (or shrinks) its table incrementally. When the load factor
+// crosses a threshold, a new table is allocated and becomes the primary one,
+// and the old one is drained into it a few buckets per operation, or by the
+// rehash timer if the shard is idle. While draining, an entry lives in the old
+// table iff its bucket in the old table was not drained yet, so every lookup,
+// insertion and erasure touches exactly one table. A table with too many
+// deleted slots is rebuilt the same way, at the same size.
+//
+// The tables don't resize while a traversal is paused on them. The entries
+// which don't fit then go to an overflow table, which grows as needed and is
+// merged into the tables once the resizing resumes.
 class cache {
-    using cache_type = boost::intrusive::unordered_set<cache_entry,
-        boost::intrusive::member_hook<cache_entry, cache_entry::hook_type, &cache_entry::_cache_link>,
-        boost::intrusive::power_2_buckets<true>,
-        boost::intrusive::constant_time_size<true>>;
-    using cache_iterator = typename cache_type::iterator;
-    using const_cache_iterator = typename cache_type::const_iterator;
-    static constexpr size_t initial_bucket_count = DEFAULT_INITIAL_SIZE;
+    using cache_type = entry_table;
     static constexpr float load_factor = 0.75f;
-    size_t _resize_up_threshold = load_factor * initial_bucket_count;
-    cache_type::bucket_type* _buckets;
+    static constexpr float shrink_factor = 0.1f;
+    // The load of a table past which the insertions go to the overflow while
+    // the resizing is paused.
+    static constexpr float paused_load_factor = 0.875f;
+    // Number of old buckets moved by every insertion or erasure while rehashing.
+    static constexpr size_t rehash_step_buckets = 8;
+    // Number of old buckets moved by every tick of the rehash timer.
+    static constexpr size_t rehash_idle_buckets = 4096;
+    // Number of keys whose lookups are interleaved by with_entries_run().
+    static constexpr size_t lookup_batch = 16;
+    // Number of elements freed by every tick of the lazyfree timer.
+    static constexpr size_t lazyfree_slice = 4096;
+    // The sizes, and the thresholds of the load, count the slots of the tables.
+    size_t _initial_bucket_count;
+    size_t _resize_up_threshold;
+    size_t _resize_down_threshold = 0;
     cache_type _store;
-    seastar::timer_set<cache_entry, &cache_entry::_timer_link> _alive;
+    // The table being drained into _store, it has no slot unless rehashing.
+    cache_type _old_store;
+    size_t _rehash_position = 0;
+    timer<clock_type> _rehash_timer;
+    // While positive, the bucket arrays are neither resized nor drained.
+    size_t _resize_paused = 0;
+    // The entries inserted into a table too loaded while the resizing is
+    // paused. They are not part of the traversals, nor of the SCANs.
+    cache_type _overflow;
+    // The traversal position of flush_step().
+    size_t _flush_position = 0;
+    using expiring_set = seastar::timer_set<cache_entry, &cache_entry::_timer_link>;
+    expiring_set _alive;
     timer<clock_type> _timer;
+    // The expired entries which were not released yet, since the active expiry
+    // releases entries only within its time budget per tick.
+    expiring_set::timer_list_t _expired_backlog;
+    std::chrono::microseconds _expiry_budget = DEFAULT_EXPIRY_BUDGET;
+    uint64_t _expired_entries = 0;
+    // The entries unlinked from the table whose values are still being freed
+    // by the lazyfree timer. The slot of every such entry points into the queue.
+    std::deque<cache_entry*> _lazyfree;
+    timer<clock_type> _lazyfree_timer;
+    allocation_strategy* _lazyfree_allocator = nullptr;
+    bool _lazyfree_overwrite = false;
+    uint64_t _lazyfreed_entries = 0;
+    // The entries built aside before they replace the entry of their key, by
+    // the id given by their builder. The slot of every such entry points here.
+    std::unordered_map<uint64_t, cache_entry*> _staged;
+    // The readers of the streamed entries, by the keys of the entries.
+    std::unordered_multimap<sstring, entry_reader*> _readers;
     clock_type::duration _wc_to_clock_type_delta;
     allocation_strategy* alloc;
     using expired_entry_releaser_type = std::function<void(cache_entry& e)>;
     expired_entry_releaser_type _expired_entry_releaser;
+    // Called before an entry is inserted, it may evict entries to make room.
+    using evicter_type = std::function<void()>;
+    evicter_type _evicter;
+    mutable std::default_random_engine _random;
+
+    inline bool rehashing() const
+    {
+        return _old_store.bucket_count() != 0;
+    }
+
+    inline bool in_old_store(size_t hash) const
+    {
+        return rehashing() && _old_store.bucket_of(hash) >= _rehash_position;
+    }
+
+    static inline size_t group_count_for(size_t slots)
+    {
+        return std::max<size_t>(slots / cache_type::GROUP_SIZE, 1);
+    }
+
+    inline cache_type& store_of(size_t hash)
+    {
+        return in_old_store(hash) ? _old_store : _store;
+    }
+
+    inline const cache_type& store_of(size_t hash) const
+    {
+        return in_old_store(hash) ? _old_store : _store;
+    }
+
+    template <typename Key>
+    inline cache_entry* lookup(const Key& key, size_t hash) const
+    {
+        auto e = store_of(hash).find(key, hash, cache_entry::compare());
+        if (e == nullptr && !_overflow.empty()) {
+            e = _overflow.find(key, hash, cache_entry::compare());
+        }
+        return e;
+    }
+
+    inline cache_type& table_of(const cache_entry& e)
+    {
+        return _overflow.owns(e) ? _overflow : store_of(e.key_hash());
+    }
+
+    // The lookups expire the entries lazily: an expired entry is never returned,
+    // and is released at once if the cache is mutable.
+    inline cache_entry* find(const redis_key& rk)
+    {
+        auto e = lookup(rk, rk.hash());
+        if (e == nullptr) {
+            return nullptr;
+        }
+        before_change(*e);
+        return unless_expired(*e);
+    }
+
+    inline const cache_entry* find(const redis_key& rk) const
+    {
+        const cache_entry* e = lookup(rk, rk.hash());
+        return e != nullptr && !e->expired(clock_type::now()) ? e : nullptr;
+    }
+
+    inline cache_entry* find(const cache_entry& entry)
+    {
+        auto e = lookup(entry, entry.key_hash());
+        if (e == nullptr) {
+            return nullptr;
+        }
+        before_change(*e);
+        return unless_expired(*e);
+    }
+
+    // The mutable lookups, and the erasures, hand the rest of the value to
+    // the readers of the entry first, since it may change or go.
+    inline void before_change(const cache_entry& e)
+    {
+        if (e._streamed) {
+            read_all(e);
+        }
+    }
+
+    void read_all(const cache_entry& e)
+    {
+        e._streamed = false;
+        auto range = _readers.equal_range(sstring(e.key_data(), e.key_size()));
+        std::vector<entry_reader*> readers;
+        for (auto it = range.first; it != range.second; ++it) {
+            readers.push_back(it->second);
+        }
+        _readers.erase(range.first, range.second);
+        for (auto r : readers) {
+            r->read_all(e);
+        }
+    }
+
+    inline cache_entry* unless_expired(cache_entry& e)
+    {
+        if (e.expired(clock_type::now())) {
+            unlink_expiry(e);
+            ++_expired_entries;
+            _expired_entry_releaser(e);
+            return nullptr;
+        }
+        return &e;
+    }
+
+    // Removes the entry from the expiring set, or from the backlog of the active expiry.
+    inline void unlink_expiry(cache_entry& e)
+    {
+        if (e._expiry_pending) {
+            _expired_backlog.erase(_expired_backlog.iterator_to(e));
+            e._expiry_pending = false;
+        } else if (e.ever_expires()) {
+            _alive.remove(e);
+        }
+    }
+
+    // If @lazily, the value of a large collection is left to the lazyfree
+    // timer, the entry is only unlinked from the table.
+    inline void erase_and_dispose(cache_entry& e, bool lazily = false)
+    {
+        before_change(e);
+        table_of(e).erase(e);
+        if (lazily && e.free_effort() > LAZYFREE_THRESHOLD && dispose_lazily(e)) {
+            return;
+        }
+        current_allocator().destroy(&e);
+    }
+
+    bool dispose_lazily(cache_entry& e)
+    {
+        try {
+            _lazyfree.push_back(&e);
+        } catch (const std::bad_alloc&) {
+            return false;
+        }
+        e._slot = &_lazyfree.back();
+        // the entries are always erased within the allocator of the cache.
+        _lazyfree_allocator = &current_allocator();
+        if (!_lazyfree_timer.armed()) {
+            _lazyfree_timer.arm_periodic(std::chrono::milliseconds(1));
+        }
+        return true;
+    }
+
+    // @new_size counts the slots of the new table.
+    void start_rehash(size_t new_size)
+    {
+        cache_type table;
+        try {
+            table = cache_type(group_count_for(new_size));
+        } catch (const std::bad_alloc& e) {
+            return;
+        }
+        _old_store = std::move(_store);
+        _store = std::move(table);
+        _rehash_position = 0;
+        _resize_up_threshold = new_size * load_factor;
+        _resize_down_threshold = new_size > _initial_bucket_count ? new_size * shrink_factor : 0;
+        _rehash_timer.arm_periodic(std::chrono::milliseconds(1));
+    }
+
+    // Moves up to @count buckets of the old table into the primary one.
+    void rehash_step(size_t count)
+    {
+        if (!rehashing() || _resize_paused) {
+            return;
+        }
+        auto bucket_count = _old_store.bucket_count();
+        for (; count > 0 && _rehash_position < bucket_count; --count, ++_rehash_position) {
+            _old_store.for_each_in_bucket(_rehash_position, [this] (cache_entry& e) {
+                _old_store.erase(e);
+                _store.insert(e);
+            });
+        }
+        if (_rehash_position == bucket_count) {
+            assert(_old_store.empty());
+            _old_store = cache_type();
+            _rehash_position = 0;
+            _rehash_timer.cancel();
+        }
+    }
+
+    // Links @e into the table of its hash, or into the overflow while the
+    // tables can't resize. Returns false if there's no room for it.
+    bool index(cache_entry& e)
+    {
+        auto& store = store_of(e.key_hash());
+        if (_resize_paused) {
+            if (store.used() < store.capacity() * paused_load_factor && store.insert(e)) {
+                return true;
+            }
+            return spill(e);
+        }
+        // the old table is drained at once rather than filled up.
+        if (&store == &_old_store && _old_store.used() + 1 >= _old_store.capacity()) {
+            rehash_step(_old_store.bucket_count());
+        }
+        return store_of(e.key_hash()).insert(e);
+    }
+
+    // Links @e into the overflow, which is rebuilt twice as large once loaded.
+    bool spill(cache_entry& e)
+    {
+        if (_overflow.used() + 1 > _overflow.capacity() * load_factor) {
+            cache_type table;
+            try {
+                table = cache_type(group_count_for(std::max<size_t>(_overflow.capacity() * 2, 4 * cache_type::GROUP_SIZE)));
+            } catch (const std::bad_alloc&) {
+                return _overflow.insert(e);
+            }
+            _overflow.for_each([&table] (cache_entry& o) {
+                table.insert(o);
+            });
+            _overflow = std::move(table);
+        }
+        return _overflow.insert(e);
+    }
+
+    // Calls @func on the entries of the overflow whose home is the bucket
+    // @bucket of @store, so that the traversals still visit them there.
+    template <typename Func>
+    void for_each_spilled(const cache_type& store, size_t bucket, Func& func) const
+    {
+        if (_overflow.empty()) {
+            return;
+        }
+        auto visit = [this, &store, bucket, &func] (const cache_entry& e) {
+            auto hash = e.key_hash();
+            if (&store_of(hash) == &store && store.bucket_of(hash) == bucket) {
+                func(e);
+            }
+        };
+        // both counts are powers of 2: the bucket maps to one bucket of a
+        // smaller overflow, or to every bucket_count()-th one of a larger.
+        auto count = store.bucket_count();
+        auto overflow_count = _overflow.bucket_count();
+        if (overflow_count <= count) {
+            _overflow.for_each_in_bucket(bucket & (overflow_count - 1), visit);
+            return;
+        }
+        for (auto b = bucket; b < overflow_count; b += count) {
+            _overflow.for_each_in_bucket(b, visit);
+        }
+    }
+
+    // Moves the entries of the overflow into the tables, as long as they have
+    // room for them.
+    void merge_overflow()
+    {
+        _overflow.for_each([this] (cache_entry& e) {
+            _overflow.erase(e);
+            if (!index(e)) {
+                _overflow.insert(e);
+                return;
+            }
+            maybe_rehash();
+        });
+        if (_overflow.empty()) {
+            _overflow = cache_type();
+        }
+    }
+
+    void maybe_rehash()
+    {
+        if (_resize_paused) {
+            return;
+        }
+        if (rehashing()) {
+            rehash_step(rehash_step_buckets);
+            return;
+        }
+        auto size = _store.size();
+        if (size >= _resize_up_threshold) {
+            start_rehash(_store.capacity() * 2);
+        } else if (size < _resize_down_threshold) {
+            start_rehash(_store.capacity() / 2);
+        } else if (_store.used() >= _resize_up_threshold) {
+            start_rehash(_store.capacity());
+        }
+    }
 public:
-    cache ()
-        : _buckets(new cache_type::bucket_type[initial_bucket_count])
-        , _store(cache_type::bucket_traits(_buckets, initial_bucket_count))
+    cache (size_t initial_bucket_count = DEFAULT_INITIAL_SIZE)
+        : _initial_bucket_count(group_count_for(initial_bucket_count) * cache_type::GROUP_SIZE)
+        , _resize_up_threshold(load_factor * _initial_bucket_count)
+        , _store(group_count_for(initial_bucket_count))
     {
         _timer.set_callback([this] { erase_expired_entries(); });
+        _rehash_timer.set_callback([this] { rehash_step(rehash_idle_buckets); });
+        _lazyfree_timer.set_callback([this] {
+            with_allocator(*_lazyfree_allocator, [this] {
+                release_lazily(lazyfree_slice);
+            });
+        });
     }
-    ~cache ()
+
+    // The collections of more elements are freed lazily, if asked for.
+    static constexpr size_t LAZYFREE_THRESHOLD = 64;
+
+    // Whether the value of an entry overwritten by replace() or insert_if()
+    // is freed lazily.
+    inline void set_lazyfree_overwrite(bool lazily)
     {
+        _lazyfree_overwrite = lazily;
+    }
+
+    // Frees up to @budget elements of the values erased lazily, the oldest
+    // first, and the entries whose values are done. The caller holds the
+    // allocator of the entries. Returns the number of entries left.
+    size_t release_lazily(size_t budget)
+    {
+        while (budget > 0 && !_lazyfree.empty()) {
+            auto e = _lazyfree.front();
+            if (!e->release_value(budget)) {
+                break;
+            }
+            e->_slot = nullptr;
+            current_allocator().destroy(e);
+            _lazyfree.pop_front();
+            ++_lazyfreed_entries;
+        }
+        if (_lazyfree.empty()) {
+            _lazyfree_timer.cancel();
+        }
+        return _lazyfree.size();
+    }
+
+    // Erases up to @budget buckets and entries of a cache dropped as a whole,
+    // e.g. by FLUSHDB, and calls @func on the type of every entry erased. The
+    // large collections are freed lazily, the caller holds the allocator of
+    // the entries. Returns true once nothing is left to free.
+    template <typename Func>
+    bool flush_step(size_t budget, Func&& func)
+    {
+        // the traversal positions must stay where they are.
+        if (!_resize_paused) {
+            pause_resize();
+        }
+        while (budget > 0 && _flush_position < traversal_size()) {
+            auto old_bucket_count = _old_store.bucket_count();
+            auto& store = _flush_position < old_bucket_count ? _old_store : _store;
+            auto bucket = _flush_position < old_bucket_count ? _flush_position : _flush_position - old_bucket_count;
+            store.for_each_in_bucket(bucket, [this, &budget, &func] (cache_entry& e) {
+                func(e.type());
+                unlink_expiry(e);
+                erase_and_dispose(e, true);
+                if (budget > 0) {
+                    --budget;
+                }
+            });
+            ++_flush_position;
+            if (budget > 0) {
+                --budget;
+            }
+        }
+        if (_flush_position >= traversal_size()) {
+            _overflow.for_each([this, &func] (cache_entry& e) {
+                func(e.type());
+                unlink_expiry(e);
+                erase_and_dispose(e, true);
+            });
+            drop_staged();
+        }
+        return _flush_position >= traversal_size() && _lazyfree.empty();
+    }
+
+    // The entries erased lazily whose values are not freed yet.
+    inline size_t lazyfree_backlog() const
+    {
+        return _lazyfree.size();
+    }
+
+    inline uint64_t lazyfreed_entries() const
+    {
+        return _lazyfreed_entries;
     }
 
     inline size_t expiring_size() const
@@ -449,6 +1477,102 @@ public:
         return _alive.size();
     }
 
+    // The number of slots of the primary table.
+    inline size_t bucket_count() const
+    {
+        return _store.capacity();
+    }
+
+    // Pauses the resizing of the bucket arrays, so that a traversal by the
+    // position of the buckets visits every entry staying in the cache exactly
+    // once, even if it yields between the buckets. The pauses nest. The
+    // entries inserted meanwhile may go to the overflow, they are visited
+    // with the bucket of their hash all the same.
+    inline void pause_resize()
+    {
+        ++_resize_paused;
+    }
+
+    inline void resume_resize()
+    {
+        assert(_resize_paused > 0);
+        if (--_resize_paused == 0 && !_overflow.empty()) {
+            merge_overflow();
+        }
+    }
+
+    // The entries waiting in the overflow for the resizing to resume.
+    inline size_t overflow_size() const
+    {
+        return _overflow.size();
+    }
+
+    // Sizes the table of an empty cache for @size entries at once, e.g.
+    // before loading them, so that the insertions don't rehash.
+    void reserve(size_t size)
+    {
+        if (!empty() || rehashing() || _resize_paused) {
+            return;
+        }
+        auto new_size = _store.capacity();
+        while (new_size * load_factor < size) {
+            new_size *= 2;
+        }
+        if (new_size == _store.capacity()) {
+            return;
+        }
+        try {
+            _store = cache_type(group_count_for(new_size));
+        } catch (const std::bad_alloc& e) {
+            return;
+        }
+        _resize_up_threshold = new_size * load_factor;
+        // the cache fills up from empty, it must not shrink meanwhile.
+        _resize_down_threshold = 0;
+    }
+
+    // The buckets of the old table come first in the traversal, then the
+    // buckets of the primary one.
+    inline size_t traversal_size() const
+    {
+        return _old_store.bucket_count() + _store.bucket_count();
+    }
+
+    // The position of the bucket holding @hash in the traversal, which is stable
+    // as long as the resizing is paused.
+    inline size_t traversal_position(size_t hash) const
+    {
+        auto old_bucket_count = _old_store.bucket_count();
+        if (in_old_store(hash)) {
+            return _old_store.bucket_of(hash);
+        }
+        return old_bucket_count + _store.bucket_of(hash);
+    }
+
+    template <typename Func>
+    inline void for_each_in_bucket(size_t position, Func&& func) const
+    {
+        auto old_bucket_count = _old_store.bucket_count();
+        auto& store = position < old_bucket_count ? _old_store : _store;
+        auto bucket = position < old_bucket_count ? position : position - old_bucket_count;
+        store.for_each_in_bucket(bucket, [&func] (const cache_entry& e) {
+            func(e);
+        });
+        for_each_spilled(store, bucket, func);
+    }
+
+    // Calls @func on the entries of the buckets at @cursor of a SCAN, and returns
+    // the next cursor, 0 at the end. See scan_tables().
+    template <typename Func>
+    inline size_t scan(size_t cursor, Func&& func) const
+    {
+        return scan_tables(&_store, rehashing() ? &_old_store : nullptr, cursor, [this, &func] (const cache_type* t, size_t bucket) {
+            t->for_each_in_bucket(bucket, [&func] (const cache_entry& e) {
+                func(e);
+            });
+            for_each_spilled(*t, bucket, func);
+        });
+    }
 
     void set_expired_entry_releaser(expired_entry_releaser_type&& releaser)
     {
@@ -458,32 +1582,106 @@ public:
 
     void flush_all()
     {
-        for (auto it = _store.begin(); it != _store.end(); ++it) {
-            if (it->ever_expires()) {
-                _alive.remove(*it);
+        for (auto store : { &_old_store, &_store, &_overflow }) {
+            store->for_each([this] (cache_entry& e) {
+                before_change(e);
+                unlink_expiry(e);
+                e._slot = nullptr;
+                current_allocator().destroy(&e);
+            });
+            store->clear();
+        }
+        rehash_step(_old_store.bucket_count());
+        release_lazily(std::numeric_limits<size_t>::max());
+        drop_staged();
+    }
+
+    // Keeps @e, which is in no table, as @id until it's unstaged: it's neither
+    // found by the lookups nor part of the traversals. The caller holds the
+    // allocator of the entries.
+    void stage(uint64_t id, cache_entry* e)
+    {
+        auto& slot = _staged[id];
+        slot = e;
+        e->_slot = &slot;
+    }
+
+    inline cache_entry* staged(uint64_t id) const
+    {
+        auto it = _staged.find(id);
+        return it != _staged.end() ? it->second : nullptr;
+    }
+
+    // Gives up the entry kept as @id, nullptr if none, e.g. since the cache was flushed.
+    cache_entry* unstage(uint64_t id)
+    {
+        auto it = _staged.find(id);
+        if (it == _staged.end()) {
+            return nullptr;
+        }
+        auto e = it->second;
+        e->_slot = nullptr;
+        _staged.erase(it);
+        return e;
+    }
+
+    // Registers @r as a reader of @e, until detach() or until read_all() is
+    // called on it. The entry must not change while it has readers but
+    // through the mutable lookups of the cache.
+    void attach(const cache_entry& e, entry_reader& r)
+    {
+        _readers.emplace(sstring(e.key_data(), e.key_size()), &r);
+        e._streamed = true;
+    }
+
+    void detach(const sstring& key, entry_reader& r)
+    {
+        auto range = _readers.equal_range(key);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == &r) {
+                _readers.erase(it);
+                break;
             }
         }
-        _store.erase_and_dispose(_store.begin(), _store.end(), current_deleter<cache_entry>());
+    }
+
+    // Looks up the entry of @rk as it is, even if it's expired. The readers
+    // find their entry again this way once the compaction may have moved it.
+    inline const cache_entry* peek(const redis_key& rk) const
+    {
+        return lookup(rk, rk.hash());
+    }
+
+    void drop_staged()
+    {
+        for (auto& staged : _staged) {
+            staged.second->_slot = nullptr;
+            current_allocator().destroy(staged.second);
+        }
+        _staged.clear();
     }
 
     inline bool erase(const redis_key& key)
     {
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(key, hash_fn, cache_entry::compare());
-        if (it != _store.end()) {
-            if (it->ever_expires()) {
-                _alive.remove(*it);
-            }
-            _store.erase_and_dispose(it, current_deleter<cache_entry>());
+        auto e = find(key);
+        if (e) {
+            unlink_expiry(*e);
+            erase_and_dispose(*e);
+            maybe_rehash();
             return true;
         }
         return false;
     }
 
-    inline bool erase(cache_entry& e)
+    // If @lazily, a large collection is freed by the lazyfree timer, see
+    // release_lazily().
+    inline bool erase(cache_entry& e, bool lazily = false)
     {
-        auto it = _store.iterator_to(e);
-        _store.erase_and_dispose(it, current_deleter<cache_entry>());
+        if (e._timer_link.is_linked()) {
+            unlink_expiry(e);
+        }
+        erase_and_dispose(e, lazily);
+        maybe_rehash();
         return true;
     }
 
@@ -491,13 +1689,10 @@ public:
     {
         bool res = true;
         if (entry) {
-            static auto hash_fn = [] (const cache_entry& e) -> size_t { return e.key_hash(); };
-            auto it = _store.find(*entry, hash_fn, cache_entry::compare());
-            if (it != _store.end()) {
-                if (it->ever_expires()) {
-                    _alive.remove(*it);
-                }
-                _store.erase_and_dispose(it, current_deleter<cache_entry>());
+            auto e = find(*entry);
+            if (e) {
+                unlink_expiry(*e);
+                erase_and_dispose(*e, _lazyfree_overwrite);
                 res = false;
             }
         }
@@ -507,20 +1702,7 @@ public:
 
     inline bool replace(cache_entry* entry, long expired)
     {
-        bool res = true;
-        if (entry) {
-            static auto hash_fn = [] (const cache_entry& e) -> size_t { return e.key_hash(); };
-            auto it = _store.find(*entry, hash_fn, cache_entry::compare());
-            if (it != _store.end()) {
-                if (it->ever_expires()) {
-                    _alive.remove(*it);
-                }
-                _store.erase_and_dispose(it, current_deleter<cache_entry>());
-                res = false;
-            }
-        }
-        insert(entry);
-        return res;
+        return replace(entry);
     }
 
     // return value: true if the entry was inserted, otherwise false.
@@ -529,15 +1711,13 @@ public:
         if (!entry) {
             return false;
         }
-        static auto hash_fn = [] (const cache_entry& e) -> size_t { return e.key_hash(); };
-        auto it = _store.find(*entry, hash_fn, cache_entry::compare());
-        if (it != _store.end() && (xx || (!xx && !nx))) {
-            if (it->ever_expires()) {
-                _alive.remove(*it);
-            }
-            _store.erase_and_dispose(it, current_deleter<cache_entry>());
+        auto e = find(*entry);
+        bool found = e != nullptr;
+        if (found && (xx || (!xx && !nx))) {
+            unlink_expiry(*e);
+            erase_and_dispose(*e, _lazyfree_overwrite);
         }
-        bool should_insert = (xx && it != _store.end()) || (nx && it == _store.end()) || (!nx && !xx);
+        bool should_insert = (xx && found) || (nx && !found) || (!nx && !xx);
         if (should_insert) {
             if (expired > 0) {
                 auto expiry = expiration(expired);
@@ -546,120 +1726,267 @@ public:
                     _timer.rearm(entry->get_timeout());
                 }
             }
-            _store.insert(*entry);
-            maybe_rehash();
+            insert(entry);
             return true;
         }
         return false;
     }
 
+    // Throws std::bad_alloc, once the entry is destroyed, if there is no room
+    // to index it.
     inline void insert(cache_entry* entry)
     {
-        auto& etnry_reference = *entry;
-        _store.insert(etnry_reference);
+        if (_evicter) {
+            _evicter();
+        }
+        if (!index(*entry)) {
+            if (entry->_timer_link.is_linked()) {
+                unlink_expiry(*entry);
+            }
+            current_allocator().destroy(entry);
+            throw std::bad_alloc();
+        }
         // maybe cache will be rehashed.
         maybe_rehash();
     }
 
     template <typename Func>
     inline std::result_of_t<Func(const cache_entry* e)> with_entry_run(const redis_key& rk, Func&& func) const {
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(rk, hash_fn, cache_entry::compare());
-        if (it != _store.end()) {
-            const auto& e = *it;
-            return func(&e);
-        }
-        else {
-            return func(nullptr);
+        const cache_entry* e = find(rk);
+        if (e) {
+            e->touch(_random());
         }
+        return func(e);
     }
 
     template <typename Func>
     inline std::result_of_t<Func(cache_entry* e)> with_entry_run(const redis_key& rk, Func&& func) {
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(rk, hash_fn, cache_entry::compare());
-        if (it != _store.end()) {
-            auto& e = *it;
-            return func(&e);
+        cache_entry* e = find(rk);
+        if (e) {
+            e->touch(_random());
         }
-        else {
-            return func(nullptr);
+        return func(e);
+    }
+
+    // Calls @func(i, e) on the entry of every key @keys[i], in order, as
+    // with_entry_run() does. The keys are looked up by batches: the groups of
+    // the keys of a batch are prefetched, then the entries their tags match,
+    // then the keys are compared, so that the cache misses of the keys of a
+    // batch overlap rather than stall one after the other.
+    template <typename Func>
+    void with_entries_run(const std::vector<redis_key>& keys, Func&& func)
+    {
+        for (size_t first = 0; first < keys.size(); first += lookup_batch) {
+            auto last = std::min(keys.size(), first + lookup_batch);
+            for (auto i = first; i < last; ++i) {
+                store_of(keys[i].hash()).prefetch_group(keys[i].hash());
+            }
+            for (auto i = first; i < last; ++i) {
+                store_of(keys[i].hash()).prefetch_candidates(keys[i].hash());
+            }
+            for (auto i = first; i < last; ++i) {
+                with_entry_run(keys[i], [&func, i] (cache_entry* e) {
+                    func(i, e);
+                });
+            }
         }
     }
 
+    void set_evicter(evicter_type&& evicter)
+    {
+        _evicter = std::move(evicter);
+    }
 
-    inline bool exists(const redis_key& rk)
+    // Returns a random entry, or nullptr if the cache is empty.
+    cache_entry* random_entry()
     {
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(rk, hash_fn, cache_entry::compare());
-        return it != _store.end();
+        if (empty()) {
+            return nullptr;
+        }
+        auto r = _random() % size();
+        auto& store = r < _old_store.size() ? _old_store : r < _old_store.size() + _overflow.size() ? _overflow : _store;
+        auto n = store.bucket_count();
+        auto g = _random() & (n - 1);
+        for (size_t i = 0; i < n; ++i, g = (g + 1) & (n - 1)) {
+            if (auto e = store.entry_in_group(g, _random())) {
+                return e;
+            }
+        }
+        return nullptr;
     }
 
-    void maybe_rehash()
+    // Approximates the policy as Redis does: the best candidate among @samples
+    // random entries is returned, nullptr if there is none.
+    cache_entry* eviction_candidate(eviction_policy policy, size_t samples)
     {
-        if (_store.size() >= _resize_up_threshold) {
-            auto new_size = _store.bucket_count() * 2;
-            auto old_buckets = _buckets;
-            try {
-                _buckets = new cache_type::bucket_type[new_size];
-            } catch (const std::bad_alloc& e) {
-                return;
+        bool volatile_only = policy == eviction_policy::volatile_lru || policy == eviction_policy::volatile_ttl;
+        if (policy == eviction_policy::noeviction || (volatile_only && _alive.size() == 0)) {
+            return nullptr;
+        }
+        auto now = cache_entry::access_clock();
+        cache_entry* candidate = nullptr;
+        // volatile policies skip the persistent entries, give up after a bounded number of tries.
+        for (size_t tries = 0; samples > 0 && tries < samples * 4; ++tries) {
+            auto e = random_entry();
+            if (!e) {
+                break;
+            }
+            if (volatile_only && !e->ever_expires()) {
+                continue;
+            }
+            --samples;
+            if (!candidate) {
+                candidate = e;
+                continue;
+            }
+            switch (policy) {
+            case eviction_policy::allkeys_lru:
+            case eviction_policy::volatile_lru:
+                if (e->idle_time(now) > candidate->idle_time(now)) {
+                    candidate = e;
+                }
+                break;
+            case eviction_policy::allkeys_lfu:
+                if (e->frequency(now) < candidate->frequency(now)) {
+                    candidate = e;
+                }
+                break;
+            case eviction_policy::volatile_ttl:
+                if (e->get_timeout() < candidate->get_timeout()) {
+                    candidate = e;
+                }
+                break;
+            default:
+                break;
             }
-            _store.rehash(typename cache_type::bucket_traits(_buckets, new_size));
-            delete[] old_buckets;
-            _resize_up_threshold = _store.bucket_count() * load_factor;
         }
+        return candidate;
+    }
+
+    // The string to move to the flash tier, the least recently used of
+    // @samples entries holding a value of @min_size to @max_size bytes in
+    // memory, nullptr if none was found.
+    cache_entry* tier_candidate(size_t samples, size_t min_size, size_t max_size)
+    {
+        auto now = cache_entry::access_clock();
+        cache_entry* candidate = nullptr;
+        for (size_t tries = 0; samples > 0 && tries < samples * 4; ++tries) {
+            auto e = random_entry();
+            if (!e) {
+                break;
+            }
+            if (!e->type_of_bytes() || e->value_inlined() || e->value_tiered() || e->_expiry_pending) {
+                continue;
+            }
+            auto size = e->value_bytes_size();
+            if (size < min_size || size > max_size) {
+                continue;
+            }
+            --samples;
+            if (!candidate || e->idle_time(now) > candidate->idle_time(now)) {
+                candidate = e;
+            }
+        }
+        return candidate;
+    }
+
+    // Erases the entry without resizing the bucket array, so that it never
+    // allocates and is safe in the reclaiming context.
+    void evict(cache_entry& e)
+    {
+        unlink_expiry(e);
+        erase_and_dispose(e);
+        rehash_step(rehash_step_buckets);
+    }
+
+
+    inline bool exists(const redis_key& rk)
+    {
+        return find(rk) != nullptr;
     }
 
     inline size_t size() const
     {
-        return _store.size();
+        return _store.size() + _old_store.size() + _overflow.size();
     }
 
     inline bool empty() const
     {
-        return _store.empty();
+        return _store.empty() && _old_store.empty() && _overflow.empty();
     }
 
     bool expire(const redis_key& rk, long expired)
     {
         bool result = false;
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(rk, hash_fn, cache_entry::compare());
-        if (it != _store.end()) {
+        auto e = find(rk);
+        if (e) {
+            unlink_expiry(*e);
             auto expiry = expiration(expired);
-            it->set_expiry(expiry);
-            auto& ref = *it;
-            if (_alive.insert(ref)) {
-                _timer.rearm(it->get_timeout());
-                result = true;
+            e->set_expiry(expiry);
+            if (_alive.insert(*e)) {
+                _timer.rearm(e->get_timeout());
             }
+            result = true;
         }
         return result;
     }
 
+    inline void set_expiry_budget(std::chrono::microseconds budget)
+    {
+        _expiry_budget = budget;
+    }
+
+    inline uint64_t expired_entries() const
+    {
+        return _expired_entries;
+    }
+
+    inline size_t expiry_backlog() const
+    {
+        return _expired_backlog.size();
+    }
+
+    // The active expiry releases the expired entries within the time budget. The
+    // rest stays in the backlog: if it's a large share of the expiring entries,
+    // the next tick runs as soon as possible, otherwise after one clock tick.
     void erase_expired_entries()
     {
         assert(_expired_entry_releaser);
 
-        auto expired_entries = _alive.expire(clock_type::now());
-        while (!expired_entries.empty()) {
-            auto entry = &*expired_entries.begin();
-            expired_entries.pop_front();
-            _expired_entry_releaser(*entry);
+        auto now = clock_type::now();
+        auto expired_entries = _alive.expire(now);
+        for (auto& e : expired_entries) {
+            e._expiry_pending = true;
+        }
+        _expired_backlog.splice(_expired_backlog.end(), expired_entries);
+        auto deadline = steady_clock_type::now() + _expiry_budget;
+        size_t released = 0;
+        while (!_expired_backlog.empty()) {
+            auto& entry = _expired_backlog.front();
+            _expired_backlog.pop_front();
+            entry._expiry_pending = false;
+            ++_expired_entries;
+            _expired_entry_releaser(entry);
+            if ((++released & 63) == 0 && steady_clock_type::now() >= deadline) {
+                break;
+            }
+        }
+        if (_expired_backlog.empty()) {
+            _timer.arm(_alive.get_next_timeout());
+        } else if (_expired_backlog.size() * 4 >= _alive.size() + _expired_backlog.size()) {
+            _timer.arm(now);
+        } else {
+            _timer.arm(now + std::chrono::milliseconds(10));
         }
-        _timer.arm(_alive.get_next_timeout());
     }
 
     bool never_expired(const redis_key& rk)
     {
         bool result = false;
-        static auto hash_fn = [] (const redis_key& k) -> size_t { return k.hash(); };
-        auto it = _store.find(rk, hash_fn, cache_entry::compare());
-        if (it != _store.end() && it->ever_expires()) {
-            it->set_never_expired();
-            auto& ref = *it;
-            _alive.remove(ref);
+        auto e = find(rk);
+        if (e && e->ever_expires()) {
+            unlink_expiry(*e);
+            e->set_never_expired();
             result = true;
         }
         return result;
@@ -0,0 +1,734 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "cluster.hh"
+#include <algorithm>
+#include <sstream>
+#include <boost/algorithm/string.hpp>
+#include "core/fstream.hh"
+#include "core/reactor.hh"
+#include "core/seastar.hh"
+#include "core/timer.hh"
+#include "util/log.hh"
+#include "aof.hh"
+#include "db.hh"
+
+using logger =  seastar::logger;
+static logger cluster_log ("cluster");
+
+namespace redis {
+
+// The nodes of a cluster talk to each other on the port of their clients plus
+// this offset in Redis, CLUSTER NODES shows it.
+static constexpr const unsigned CLUSTER_BUS_PORT_OFFSET = 10000;
+
+static void add_integer(std::string& out, int64_t value)
+{
+    out += ":" + std::to_string(value) + "\r\n";
+}
+
+static void add_bulk(std::string& out, const char* data, size_t size)
+{
+    out += "$" + std::to_string(size) + "\r\n";
+    out.append(data, size);
+    out += "\r\n";
+}
+
+static void add_bulk(std::string& out, const sstring& s)
+{
+    add_bulk(out, s.data(), s.size());
+}
+
+static void add_array(std::string& out, size_t count)
+{
+    out += "*" + std::to_string(count) + "\r\n";
+}
+
+static inline sstring to_reply(const std::string& s)
+{
+    return sstring(s.data(), s.size());
+}
+
+cluster_config cluster_config::create(sstring host, uint16_t port)
+{
+    cluster_config config;
+    cluster_node myself;
+    myself._id = random_run_id();
+    myself._host = std::move(host);
+    myself._port = port;
+    config._nodes.emplace_back(std::move(myself));
+    return config;
+}
+
+// Parses "first" or "first-last" into the range of slots.
+static bool parse_slot_range(const std::string& s, unsigned& first, unsigned& last)
+{
+    try {
+        auto dash = s.find('-');
+        first = std::stoul(s.substr(0, dash));
+        last = dash == std::string::npos ? first : std::stoul(s.substr(dash + 1));
+    } catch (...) {
+        return false;
+    }
+    return first <= last && last < CLUSTER_SLOTS;
+}
+
+bool cluster_config::parse(const sstring& text, sstring host, uint16_t port, cluster_config& config)
+{
+    std::vector<std::string> lines;
+    boost::split(lines, std::string(text.data(), text.size()), boost::is_any_of("\n"));
+    std::vector<std::vector<std::string>> entries;
+    bool found_myself = false;
+    config = cluster_config();
+    // the nodes first, the slots of a line may name the nodes of the next ones.
+    for (auto& line : lines) {
+        boost::trim(line);
+        if (line.empty() || boost::starts_with(line, "vars ")) {
+            continue;
+        }
+        std::vector<std::string> words;
+        boost::split(words, line, boost::is_any_of(" "), boost::token_compress_on);
+        if (words.size() < 8) {
+            return false;
+        }
+        cluster_node node;
+        node._id = sstring(words[0].data(), words[0].size());
+        auto address = words[1].substr(0, words[1].find_first_of("@,"));
+        auto colon = address.rfind(':');
+        if (colon == std::string::npos) {
+            return false;
+        }
+        try {
+            node._port = std::stoul(address.substr(colon + 1));
+            node._epoch = std::stoull(words[6]);
+        } catch (...) {
+            return false;
+        }
+        node._host = sstring(address.data(), colon);
+        std::vector<std::string> flags;
+        boost::split(flags, words[2], boost::is_any_of(","));
+        bool myself = std::find(flags.begin(), flags.end(), "myself") != flags.end();
+        if (myself) {
+            if (found_myself) {
+                return false;
+            }
+            found_myself = true;
+            node._host = host;
+            node._port = port;
+            config._nodes.insert(config._nodes.begin(), std::move(node));
+            entries.insert(entries.begin(), std::move(words));
+        } else {
+            config._nodes.emplace_back(std::move(node));
+            entries.emplace_back(std::move(words));
+        }
+    }
+    if (!found_myself) {
+        return false;
+    }
+    for (size_t n = 0; n < entries.size(); ++n) {
+        auto& words = entries[n];
+        config._current_epoch = std::max(config._current_epoch, config._nodes[n]._epoch);
+        for (size_t i = 8; i < words.size(); ++i) {
+            auto& w = words[i];
+            if (w.size() > 2 && w.front() == '[' && w.back() == ']') {
+                // "[slot->-id]" migrating to the node, "[slot-<-id]" importing from it.
+                auto migrating = w.find("->-");
+                auto importing = w.find("-<-");
+                auto mark = migrating != std::string::npos ? migrating : importing;
+                if (mark == std::string::npos) {
+                    return false;
+                }
+                unsigned slot, last;
+                if (!parse_slot_range(w.substr(1, mark - 1), slot, last)) {
+                    return false;
+                }
+                auto peer = config.find(sstring(w.data() + mark + 3, w.size() - mark - 4));
+                if (peer == NO_NODE) {
+                    continue;
+                }
+                if (migrating != std::string::npos) {
+                    config.migrate(slot, peer);
+                } else {
+                    config.import(slot, peer);
+                }
+                continue;
+            }
+            unsigned first, last;
+            if (!parse_slot_range(w, first, last)) {
+                return false;
+            }
+            for (auto slot = first; slot <= last; ++slot) {
+                config._owners[slot] = n;
+            }
+        }
+    }
+    return true;
+}
+
+std::vector<std::tuple<unsigned, unsigned, int>> cluster_config::slot_ranges() const
+{
+    std::vector<std::tuple<unsigned, unsigned, int>> ranges;
+    for (unsigned slot = 0; slot < CLUSTER_SLOTS; ++slot) {
+        auto node = _owners[slot];
+        if (node == NO_NODE) {
+            continue;
+        }
+        if (!ranges.empty() && std::get<1>(ranges.back()) + 1 == slot && std::get<2>(ranges.back()) == node) {
+            std::get<1>(ranges.back()) = slot;
+        } else {
+            ranges.emplace_back(slot, slot, node);
+        }
+    }
+    return ranges;
+}
+
+sstring cluster_config::describe() const
+{
+    auto ranges = slot_ranges();
+    std::ostringstream os;
+    for (size_t n = 0; n < _nodes.size(); ++n) {
+        auto& node = _nodes[n];
+        os << node._id << " " << node._host << ":" << node._port << "@" << node._port + CLUSTER_BUS_PORT_OFFSET
+           << (n == 0 ? " myself,master" : " master") << " - 0 0 " << node._epoch << " connected";
+        for (auto& r : ranges) {
+            if (std::get<2>(r) != int(n)) {
+                continue;
+            }
+            os << " " << std::get<0>(r);
+            if (std::get<1>(r) != std::get<0>(r)) {
+                os << "-" << std::get<1>(r);
+            }
+        }
+        if (n == 0) {
+            for (auto& m : _migrating) {
+                os << " [" << m.first << "->-" << _nodes[m.second]._id << "]";
+            }
+            for (auto& i : _importing) {
+                os << " [" << i.first << "-<-" << _nodes[i.second]._id << "]";
+            }
+        }
+        os << "\n";
+    }
+    auto s = os.str();
+    return sstring(s.data(), s.size());
+}
+
+int cluster_config::find(const sstring& id) const
+{
+    for (size_t n = 0; n < _nodes.size(); ++n) {
+        if (_nodes[n]._id == id) {
+            return n;
+        }
+    }
+    return NO_NODE;
+}
+
+int cluster_config::meet(sstring id, sstring host, uint16_t port)
+{
+    auto n = find(id);
+    if (n == NO_NODE) {
+        n = _nodes.size();
+        _nodes.emplace_back();
+        _nodes.back()._id = std::move(id);
+    }
+    _nodes[n]._host = std::move(host);
+    _nodes[n]._port = port;
+    return n;
+}
+
+bool cluster_config::forget(const sstring& id)
+{
+    auto n = find(id);
+    if (n == NO_NODE || n == 0) {
+        return false;
+    }
+    _nodes.erase(_nodes.begin() + n);
+    // the nodes after the forgotten one move down.
+    auto renumber = [n] (int node) {
+        return node == n ? NO_NODE : (node > n ? node - 1 : node);
+    };
+    for (auto& owner : _owners) {
+        owner = renumber(owner);
+    }
+    for (auto* moves : { &_migrating, &_importing }) {
+        std::unordered_map<unsigned, int> renumbered;
+        for (auto& m : *moves) {
+            auto node = renumber(m.second);
+            if (node != NO_NODE) {
+                renumbered.emplace(m.first, node);
+            }
+        }
+        moves->swap(renumbered);
+    }
+    return true;
+}
+
+void cluster_config::assign(unsigned slot, int node)
+{
+    _owners[slot] = node;
+    stabilize(slot);
+}
+
+int cluster_config::migrating_to(unsigned slot) const
+{
+    auto it = _migrating.find(slot);
+    return it == _migrating.end() ? NO_NODE : it->second;
+}
+
+int cluster_config::importing_from(unsigned slot) const
+{
+    auto it = _importing.find(slot);
+    return it == _importing.end() ? NO_NODE : it->second;
+}
+
+void cluster_config::bump_epoch()
+{
+    _nodes[0]._epoch = ++_current_epoch;
+}
+
+size_t cluster_config::assigned_slots() const
+{
+    return std::count_if(_owners.begin(), _owners.end(), [] (int16_t owner) {
+        return owner != NO_NODE;
+    });
+}
+
+size_t cluster_config::masters() const
+{
+    std::vector<bool> owning(_nodes.size(), false);
+    for (auto owner : _owners) {
+        if (owner != NO_NODE) {
+            owning[owner] = true;
+        }
+    }
+    return std::count(owning.begin(), owning.end(), true);
+}
+
+sstring cluster_config::address_of(int node) const
+{
+    return _nodes[node]._host + ":" + to_sstring(_nodes[node]._port);
+}
+
+sstring cluster_config::slots_reply() const
+{
+    auto ranges = slot_ranges();
+    std::string out;
+    add_array(out, ranges.size());
+    for (auto& r : ranges) {
+        auto& node = _nodes[std::get<2>(r)];
+        add_array(out, 3);
+        add_integer(out, std::get<0>(r));
+        add_integer(out, std::get<1>(r));
+        add_array(out, 3);
+        add_bulk(out, node._host);
+        add_integer(out, node._port);
+        add_bulk(out, node._id);
+    }
+    return to_reply(out);
+}
+
+sstring cluster_config::shards_reply() const
+{
+    // every node is a shard of its own, the nodes have no replicas.
+    auto ranges = slot_ranges();
+    std::string out;
+    add_array(out, _nodes.size());
+    for (size_t n = 0; n < _nodes.size(); ++n) {
+        auto& node = _nodes[n];
+        std::vector<std::pair<unsigned, unsigned>> slots;
+        for (auto& r : ranges) {
+            if (std::get<2>(r) == int(n)) {
+                slots.emplace_back(std::get<0>(r), std::get<1>(r));
+            }
+        }
+        add_array(out, 4);
+        add_bulk(out, "slots", 5);
+        add_array(out, slots.size() * 2);
+        for (auto& s : slots) {
+            add_integer(out, s.first);
+            add_integer(out, s.second);
+        }
+        add_bulk(out, "nodes", 5);
+        add_array(out, 1);
+        add_array(out, 14);
+        add_bulk(out, "id", 2);
+        add_bulk(out, node._id);
+        add_bulk(out, "port", 4);
+        add_integer(out, node._port);
+        add_bulk(out, "ip", 2);
+        add_bulk(out, node._host);
+        add_bulk(out, "endpoint", 8);
+        add_bulk(out, node._host);
+        add_bulk(out, "role", 4);
+        add_bulk(out, "master", 6);
+        add_bulk(out, "replication-offset", 18);
+        add_integer(out, 0);
+        add_bulk(out, "health", 6);
+        add_bulk(out, "online", 6);
+    }
+    return to_reply(out);
+}
+
+sstring cluster_config::info_reply() const
+{
+    auto assigned = assigned_slots();
+    std::ostringstream os;
+    os << "cluster_state:" << (assigned == CLUSTER_SLOTS ? "ok" : "fail") << "\r\n"
+       << "cluster_slots_assigned:" << assigned << "\r\n"
+       << "cluster_slots_ok:" << assigned << "\r\n"
+       << "cluster_slots_pfail:0\r\n"
+       << "cluster_slots_fail:0\r\n"
+       << "cluster_known_nodes:" << _nodes.size() << "\r\n"
+       << "cluster_size:" << masters() << "\r\n"
+       << "cluster_current_epoch:" << _current_epoch << "\r\n"
+       << "cluster_my_epoch:" << myself()._epoch << "\r\n";
+    std::string out;
+    auto body = os.str();
+    add_bulk(out, body.data(), body.size());
+    return to_reply(out);
+}
+
+future<> cluster_state::enable(sstring path, sstring host, uint16_t port)
+{
+    _path = path;
+    return file_exists(path).then([this, path, host, port] (bool exists) {
+        if (!exists) {
+            set_config(cluster_config::create(host, port));
+            cluster_log.info("created the cluster config {}, the node is {}", path, _config.myself()._id);
+            return save();
+        }
+        return open_file_dma(path, open_flags::ro).then([this, path, host, port] (file f) {
+            return f.size().then([this, f, path, host, port] (uint64_t size) mutable {
+                return do_with(make_file_input_stream(std::move(f)), [this, size, path, host, port] (auto& in) {
+                    return in.read_exactly(size).then([this, path, host, port] (temporary_buffer<char> data) {
+                        cluster_config config;
+                        if (!cluster_config::parse(sstring(data.get(), data.size()), host, port, config)) {
+                            throw std::runtime_error(std::string("bad cluster config ") + std::string(path.data(), path.size()));
+                        }
+                        set_config(config);
+                        cluster_log.info("loaded the cluster config {}, the node is {}, {} nodes are known", path, _config.myself()._id, _config.nodes().size());
+                    }).finally([&in] {
+                        return in.close();
+                    });
+                });
+            });
+        });
+    });
+}
+
+future<> cluster_state::save()
+{
+    return with_semaphore(_saves, 1, [this] {
+        auto text = _config.describe();
+        auto temporary_path = _path + ".tmp";
+        return open_file_dma(temporary_path, open_flags::wo | open_flags::create | open_flags::truncate).then([text] (file f) {
+            return do_with(make_file_output_stream(std::move(f)), [text] (auto& out) {
+                return out.write(text).then([&out] {
+                    return out.flush();
+                }).finally([&out] {
+                    return out.close();
+                });
+            });
+        }).then([this, temporary_path] {
+            return rename_file(temporary_path, _path);
+        }).handle_exception([this] (auto ep) {
+            cluster_log.error("failed to save the cluster config {}: {}", _path, ep);
+        });
+    });
+}
+
+cluster_route cluster_state::route(unsigned slot, bool asking, sstring& redirect) const
+{
+    auto owner = _config.owner(slot);
+    if (owner == 0) {
+        return _config.migrating_to(slot) == cluster_config::NO_NODE ? cluster_route::serve : cluster_route::check_keys;
+    }
+    if (asking && _config.importing_from(slot) != cluster_config::NO_NODE) {
+        return cluster_route::serve;
+    }
+    if (owner == cluster_config::NO_NODE) {
+        redirect = msg_clusterdown_err;
+    } else {
+        redirect = sstring("-MOVED ") + to_sstring(slot) + sstring(" ") + _config.address_of(owner) + msg_crlf;
+    }
+    return cluster_route::redirect;
+}
+
+sstring cluster_state::ask_redirect(unsigned slot) const
+{
+    auto node = _config.migrating_to(slot);
+    if (node == cluster_config::NO_NODE) {
+        return msg_tryagain_err;
+    }
+    return sstring("-ASK ") + to_sstring(slot) + sstring(" ") + _config.address_of(node) + msg_crlf;
+}
+
+// Reads the replies of a node: only single line replies and bulk strings are
+// expected. The first error, and the value of the last reply, are kept.
+class node_replies final {
+    // The errors and values kept are cut to this size.
+    static constexpr const size_t MAX_VALUE = 1024;
+    enum class state { type, line, bulk };
+    state _state = state::type;
+    char _type = 0;
+    std::string _line;
+    size_t _bulk_left = 0;
+    uint64_t _replies = 0;
+    std::string _error;
+    std::string _value;
+
+    void end_of_line()
+    {
+        switch (_type) {
+        case '-':
+            if (_error.empty()) {
+                _error = _line;
+            }
+            break;
+        case '$': {
+            auto n = std::atoll(_line.c_str());
+            _value.clear();
+            if (n >= 0) {
+                _bulk_left = n + 2;
+                _state = state::bulk;
+                return;
+            }
+            break;
+        }
+        case '*':
+            if (_error.empty()) {
+                _error = "unexpected array reply";
+            }
+            break;
+        default:
+            _value = _line;
+            break;
+        }
+        ++_replies;
+        _state = state::type;
+    }
+public:
+    inline uint64_t replies() const { return _replies; }
+    inline const std::string& error() const { return _error; }
+    inline const std::string& value() const { return _value; }
+    inline void reset()
+    {
+        _replies = 0;
+        _error.clear();
+    }
+
+    void feed(const char* p, const char* end)
+    {
+        while (p < end) {
+            switch (_state) {
+            case state::type:
+                _type = *p++;
+                _line.clear();
+                _state = state::line;
+                break;
+            case state::line: {
+                auto c = *p++;
+                if (c == '\n') {
+                    end_of_line();
+                } else if (c != '\r' && _line.size() < MAX_VALUE) {
+                    _line.push_back(c);
+                }
+                break;
+            }
+            case state::bulk: {
+                auto n = std::min<size_t>(_bulk_left, end - p);
+                // the CRLF after the data isn't part of it.
+                auto data = std::min<size_t>(n, _bulk_left > 2 ? _bulk_left - 2 : 0);
+                _value.append(p, std::min(data, MAX_VALUE - std::min(MAX_VALUE, _value.size())));
+                p += n;
+                _bulk_left -= n;
+                if (_bulk_left == 0) {
+                    ++_replies;
+                    _state = state::type;
+                }
+                break;
+            }
+            }
+        }
+    }
+};
+
+// A connection to another node. A round trip fails if the node doesn't reply
+// within the timeout.
+class node_session final {
+    connected_socket _socket;
+    input_stream<char> _in;
+    output_stream<char> _out;
+    std::chrono::milliseconds _timeout;
+    timer<> _timer;
+    node_replies _replies;
+public:
+    node_session(connected_socket socket, std::chrono::milliseconds timeout)
+        : _socket(std::move(socket))
+        , _in(_socket.input())
+        , _out(_socket.output())
+        , _timeout(timeout)
+    {
+        _timer.set_callback([this] {
+            _socket.shutdown_input();
+            _socket.shutdown_output();
+        });
+    }
+
+    static future<lw_shared_ptr<node_session>> connect(sstring host, uint16_t port, std::chrono::milliseconds timeout)
+    {
+        auto address = make_ipv4_address(ipv4_addr(std::string(host), port));
+        return engine().connect(address).then([timeout] (connected_socket socket) {
+            return make_lw_shared<node_session>(std::move(socket), timeout);
+        });
+    }
+
+    // Sends the @commands, and reads their replies.
+    future<const node_replies*> round_trip(std::vector<char> commands, uint64_t count)
+    {
+        _replies.reset();
+        _timer.arm(_timeout);
+        return do_with(std::move(commands), [this, count] (auto& commands) {
+            return _out.write(commands.data(), commands.size()).then([this] {
+                return _out.flush();
+            }).then([this, count] {
+                return do_until([this, count] { return _replies.replies() >= count; }, [this] {
+                    return _in.read().then([this] (temporary_buffer<char> buf) {
+                        if (buf.empty()) {
+                            throw std::runtime_error("the target node closed the connection");
+                        }
+                        _replies.feed(buf.begin(), buf.end());
+                    });
+                });
+            });
+        }).then_wrapped([this] (future<> f) {
+            _timer.cancel();
+            f.get();
+            return &_replies;
+        });
+    }
+
+    future<> close()
+    {
+        _timer.cancel();
+        return _out.close().handle_exception([] (auto) {});
+    }
+};
+
+future<sstring> cluster_state::node_id_of(sstring host, uint16_t port, std::chrono::milliseconds timeout)
+{
+    return node_session::connect(host, port, timeout).then([] (lw_shared_ptr<node_session> s) {
+        aof_encoder request;
+        request.append("CLUSTER", "MYID");
+        auto count = request.commands();
+        return s->round_trip(request.release(), count).then([] (const node_replies* r) {
+            if (!r->error().empty()) {
+                throw std::runtime_error(r->error());
+            }
+            return sstring(r->value().data(), r->value().size());
+        }).finally([s] {
+            return s->close();
+        });
+    });
+}
+
+future<sstring> cluster_state::migrate(database& db, sstring host, uint16_t port, std::vector<sstring> keys, bool copy, bool replace, std::chrono::milliseconds timeout)
+{
+    struct migration {
+        std::vector<sstring> _keys;
+        aof_encoder _encoder;
+        bool _started = false;
+        sstring _reply;
+    };
+    auto m = make_lw_shared<migration>();
+    m->_keys = std::move(keys);
+    m->_encoder.ask_each_command();
+    return with_semaphore(_migrations, 1, [&db, m, host, port, copy, replace, timeout] {
+        return node_session::connect(host, port, timeout).then([&db, m, copy, replace] (lw_shared_ptr<node_session> s) {
+            // without REPLACE, the keys must not exist on the target node.
+            auto probe = make_ready_future<bool>(true);
+            if (!replace) {
+                aof_encoder exists;
+                exists.ask_each_command();
+                exists.append("EXISTS", m->_keys);
+                auto count = exists.commands();
+                probe = s->round_trip(exists.release(), count).then([m] (const node_replies* r) {
+                    if (!r->error().empty()) {
+                        m->_reply = sstring("-ERR Target instance replied with error: ") + sstring(r->error().data(), r->error().size()) + msg_crlf;
+                        return false;
+                    }
+                    if (r->value() != "0") {
+                        m->_reply = sstring("-BUSYKEY Target key name already exists.\r\n");
+                        return false;
+                    }
+                    return true;
+                });
+            }
+            return probe.then([&db, m] (bool go) {
+                // the encoder reads the values in memory only.
+                return go ? db.promote(m->_keys).then([] { return true; }) : make_ready_future<bool>(false);
+            }).then([&db, m, s, copy, replace] (bool go) {
+                if (!go) {
+                    return make_ready_future<>();
+                }
+                if (db.begin_migration(m->_keys, replace, m->_encoder) == 0) {
+                    m->_reply = msg_nokey;
+                    return make_ready_future<>();
+                }
+                m->_started = true;
+                // the changes of the entries made while the last commands were
+                // sent follow, the entries are removed once none is left.
+                return repeat([&db, m, s, copy] {
+                    auto count = m->_encoder.commands();
+                    return s->round_trip(m->_encoder.release(), count).then([&db, m, copy] (const node_replies* r) {
+                        if (!r->error().empty()) {
+                            m->_reply = sstring("-ERR Target instance replied with error: ") + sstring(r->error().data(), r->error().size()) + msg_crlf;
+                            m->_started = false;
+                            db.end_migration(false);
+                            return stop_iteration::yes;
+                        }
+                        if (m->_encoder.empty()) {
+                            m->_reply = msg_ok;
+                            m->_started = false;
+                            db.end_migration(!copy);
+                            return stop_iteration::yes;
+                        }
+                        return stop_iteration::no;
+                    });
+                });
+            }).finally([s] {
+                return s->close();
+            });
+        }).then_wrapped([&db, m] (future<> f) {
+            if (m->_started) {
+                m->_started = false;
+                db.end_migration(false);
+            }
+            try {
+                f.get();
+            } catch (std::exception& e) {
+                cluster_log.warn("failed to migrate {} keys: {}", m->_keys.size(), e.what());
+                return sstring("-IOERR error or timeout writing to target instance\r\n");
+            }
+            return m->_reply;
+        });
+    });
+}
+}
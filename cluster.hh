@@ -0,0 +1,168 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/future.hh"
+#include "core/semaphore.hh"
+#include "core/sstring.hh"
+#include <chrono>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "common.hh"
+
+namespace redis {
+class database;
+
+// [CLUSTER]
+// The nodes of a cluster own the hash slots, and every node owns a slot by
+// the shard slot % shards, see redis_key::shard_hash_of(). A node knows the
+// others and the slots they own by the CLUSTER commands it's sent, there is
+// no cluster bus: the tools (or the operator) send the same changes to every
+// node, as redis-cli --cluster does for the slots it moves.
+struct cluster_node {
+    sstring _id;
+    sstring _host;
+    uint16_t _port = 0;
+    uint64_t _epoch = 0;
+};
+
+// The view of the cluster of a node, saved to its config file in the format
+// of CLUSTER NODES. The node itself is always the first one.
+class cluster_config final {
+public:
+    static constexpr const int NO_NODE = -1;
+private:
+    std::vector<cluster_node> _nodes;
+    std::vector<int16_t> _owners;
+    std::unordered_map<unsigned, int> _migrating;
+    std::unordered_map<unsigned, int> _importing;
+    uint64_t _current_epoch = 0;
+public:
+    cluster_config() : _owners(CLUSTER_SLOTS, NO_NODE) {}
+    // A new node, which owns no slot and knows no other node.
+    static cluster_config create(sstring host, uint16_t port);
+    // Reads the config saved by a node, which is still reached at @host:@port.
+    // Returns false if the config is invalid.
+    static bool parse(const sstring& text, sstring host, uint16_t port, cluster_config& config);
+    // The config in the format of CLUSTER NODES, a line per node.
+    sstring describe() const;
+
+    inline const cluster_node& myself() const { return _nodes[0]; }
+    inline const std::vector<cluster_node>& nodes() const { return _nodes; }
+    inline int owner(unsigned slot) const { return _owners[slot]; }
+    inline bool owned(unsigned slot) const { return _owners[slot] == 0; }
+    int find(const sstring& id) const;
+    // Adds the node, or moves it to its new address.
+    int meet(sstring id, sstring host, uint16_t port);
+    // Removes the node, its slots aren't served any more. The node itself can't
+    // be forgotten.
+    bool forget(const sstring& id);
+
+    // Assigns @slot to @node, NO_NODE if none, the slot is stable then.
+    void assign(unsigned slot, int node);
+    // @slot is moving from this node to @node, or from @node to this node, the
+    // requests on the keys gone already are redirected by ASK.
+    inline void migrate(unsigned slot, int node) { _migrating[slot] = node; }
+    inline void import(unsigned slot, int node) { _importing[slot] = node; }
+    inline void stabilize(unsigned slot)
+    {
+        _migrating.erase(slot);
+        _importing.erase(slot);
+    }
+    int migrating_to(unsigned slot) const;
+    int importing_from(unsigned slot) const;
+    // The node takes a new epoch once it was assigned slots of other nodes.
+    void bump_epoch();
+
+    // The number of assigned slots, and the number of nodes owning some.
+    size_t assigned_slots() const;
+    size_t masters() const;
+    // The replies of CLUSTER SLOTS, SHARDS and INFO.
+    sstring slots_reply() const;
+    sstring shards_reply() const;
+    sstring info_reply() const;
+    // The address of @node, "host:port".
+    sstring address_of(int node) const;
+private:
+    // The ranges of consecutive slots owned by the same node, as [first, last, node].
+    std::vector<std::tuple<unsigned, unsigned, int>> slot_ranges() const;
+};
+
+// Where a request on the keys of a slot goes.
+enum class cluster_route {
+    serve,
+    // moved to the owner of the slot, or refused, see the redirect.
+    redirect,
+    // the slot is migrating to another node: the request is served here if its
+    // keys are, or redirected by ASK if they're gone.
+    check_keys,
+};
+
+// The cluster state of a shard: every shard holds a copy of the view of its
+// node, the changes are made by shard 0 and copied to the other shards.
+class cluster_state final {
+public:
+    // The default config file of a node, in the directory of its data.
+    static constexpr const char* DEFAULT_CONFIG_FILE = "nodes.conf";
+private:
+    bool _enabled = false;
+    sstring _path;
+    cluster_config _config;
+    // The migrations run one at a time on a shard, see database::begin_migration().
+    semaphore _migrations { 1 };
+    semaphore _saves { 1 };
+public:
+    // Loads the config of the node from @path, or creates it if it doesn't exist.
+    future<> enable(sstring path, sstring host, uint16_t port);
+    inline bool enabled() const { return _enabled; }
+    inline const cluster_config& config() const { return _config; }
+    inline void set_config(const cluster_config& config)
+    {
+        _enabled = true;
+        _config = config;
+    }
+    // Writes the config to its file, replaced at once.
+    future<> save();
+    future<> stop() { return make_ready_future<>(); }
+
+    // Where the request on the keys of @slot goes, @asking is true if it follows
+    // an ASKING of the client.
+    cluster_route route(unsigned slot, bool asking, sstring& redirect) const;
+    // The ASK redirect to the node importing @slot.
+    sstring ask_redirect(unsigned slot) const;
+
+    // MIGRATE of the @keys of this shard to the node at @host:@port, their
+    // entries are removed here once the node applied them, unless @copy. The
+    // changes of the entries meanwhile follow them. Returns the reply.
+    future<sstring> migrate(database& db, sstring host, uint16_t port, std::vector<sstring> keys, bool copy, bool replace, std::chrono::milliseconds timeout);
+    // The id of the node at @host:@port, asked by CLUSTER MYID, for CLUSTER MEET.
+    static future<sstring> node_id_of(sstring host, uint16_t port, std::chrono::milliseconds timeout);
+};
+
+// The error replies of the cluster mode.
+static const sstring msg_cluster_disabled_err {"-ERR This instance has cluster support disabled\r\n"};
+static const sstring msg_crossslot_err {"-CROSSSLOT Keys in request don't hash to the same slot\r\n"};
+static const sstring msg_clusterdown_err {"-CLUSTERDOWN Hash slot not served\r\n"};
+static const sstring msg_tryagain_err {"-TRYAGAIN Multiple keys request during rehashing of slot\r\n"};
+static const sstring msg_invalid_slot_err {"-ERR Invalid or out of range slot\r\n"};
+static const sstring msg_unknown_node_err {"-ERR Unknown node\r\n"};
+static const sstring msg_nokey {"+NOKEY\r\n"};
+}
@@ -27,6 +27,7 @@
 #include <iomanip>
 #include <sstream>
 #include <functional>
+#include <experimental/string_view>
 #include <vector>
 #include "core/app-template.hh"
 #include "core/future-util.hh"
@@ -78,30 +79,107 @@ struct args_collection {
     std::unordered_map<sstring, double> _tmp_key_scores;
     std::vector<std::pair<sstring, sstring>> _tmp_key_value_pairs;
     args_collection () : _command_args_count(0) {}
+    // Clears the arguments of the previous request, the containers keep their
+    // capacity, so a connection stops allocating them once it is warmed up.
+    void reset() {
+        _command_args_count = 0;
+        _command_args.clear();
+        _tmp_keys.clear();
+        _tmp_key_values.clear();
+        _tmp_key_scores.clear();
+        _tmp_key_value_pairs.clear();
+    }
 };
 
 using clock_type = lowres_clock;
 static constexpr clock_type::time_point never_expire_timepoint = clock_type::time_point(clock_type::duration::min());
 
 
+// The varints (LEB128) of the lengths in the packed encodings.
+inline size_t varint_size(size_t v)
+{
+    size_t n = 1;
+    for (; v >= 0x80; v >>= 7) {
+        ++n;
+    }
+    return n;
+}
+
+inline char* write_varint(char* p, size_t v)
+{
+    for (; v >= 0x80; v >>= 7) {
+        *p++ = static_cast<char>((v & 0x7f) | 0x80);
+    }
+    *p++ = static_cast<char>(v);
+    return p;
+}
+
+inline size_t read_varint(const char*& p)
+{
+    size_t v = 0;
+    unsigned shift = 0;
+    uint8_t b = 0;
+    do {
+        b = static_cast<uint8_t>(*p++);
+        v |= static_cast<size_t>(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return v;
+}
+
+// The hash slots of Redis Cluster. The slot of a key is the CRC16 of its hash
+// tag, the content of its first {...} if it is not empty, or of the whole key.
+static constexpr const unsigned CLUSTER_SLOTS = 16384;
+uint16_t crc16(const char* data, size_t size);
+inline unsigned key_slot(const char* key, size_t size)
+{
+    auto open = static_cast<const char*>(memchr(key, '{', size));
+    if (open != nullptr) {
+        auto tag = open + 1;
+        auto close = static_cast<const char*>(memchr(tag, '}', key + size - tag));
+        if (close != nullptr && close != tag) {
+            return crc16(tag, close - tag) & (CLUSTER_SLOTS - 1);
+        }
+    }
+    return crc16(key, size) & (CLUSTER_SLOTS - 1);
+}
+
 class db;
 struct redis_key {
     sstring& _key;
     size_t  _hash;
-    redis_key(sstring& key) : _key(key), _hash(std::hash<sstring>()(_key)) {}
+    // The hash deciding the owner shard.
+    size_t  _shard_hash;
+    redis_key(sstring& key) : _key(key), _hash(std::hash<sstring>()(_key)), _shard_hash(shard_hash_of(_key)) {}
     redis_key& operator = (const redis_key& o) {
         if (this != &o) {
             _key = o._key;
             _hash = o._hash;
+            _shard_hash = o._shard_hash;
         }
         return *this;
     }
-    inline unsigned get_cpu() const { return _hash % smp::count; }
+    // The keys are owned by the shards by their hash slot, as the nodes of a
+    // cluster own them: every slot is held by a single shard, and the keys
+    // sharing a hash tag by the same shard.
+    static inline size_t shard_hash_of(const sstring& key)
+    {
+        return key_slot(key.data(), key.size());
+    }
+    inline unsigned get_cpu() const { return _shard_hash % smp::count; }
     inline const size_t hash() const { return _hash; }
     inline const sstring& key() const { return _key; }
     inline const size_t size() const { return _key.size(); }
     inline const char* data() const { return _key.c_str(); }
 };
+
+// A key WATCHed by a connection, with the version it had then.
+struct watched_key {
+    sstring _key;
+    size_t _db;
+    unsigned _cpu;
+    uint64_t _version;
+};
 // The defination of `item was copied from apps/memcached
 static const sstring msg_crlf {"\r\n"};
 static const sstring msg_ok {"+OK\r\n"};
@@ -115,6 +193,8 @@ static const sstring msg_null_blik = {"$-1\r\n"};
 static const sstring msg_null_multi_bulk = {"*-1\r\n"};
 static const sstring msg_empty_multi_bulk = {"*0\r\n"};
 static const sstring msg_type_err = {"-WRONGTYPE Operation against a key holding the wrong kind of value\r\n"};
+static const sstring msg_timeout_err = {"-ERR timeout is not a float or out of range\r\n"};
+static const sstring msg_negative_timeout_err = {"-ERR timeout is negative\r\n"};
 static const sstring msg_nokey_err = {"-ERR no such key\r\n"};
 static const sstring msg_syntax_err = {"-ERR syntax error\r\n"};
 static const sstring msg_same_object_err = {"-ERR source and destination objects are the same\r\n"};
@@ -127,6 +207,27 @@ static const sstring msg_sigle_tag = {"*"};
 static const sstring msg_batch_tag = {"$"};
 static const sstring msg_not_found = {"+(nil)\r\n"};
 static const sstring msg_nil = {"+(nil)\r\n"};
+static const sstring msg_bgsave_started = {"+Background saving started\r\n"};
+static const sstring msg_save_in_progress_err = {"-ERR Background save already in progress\r\n"};
+static const sstring msg_rewrite_started = {"+Background append only file rewriting started\r\n"};
+static const sstring msg_rewrite_in_progress_err = {"-ERR Background append only file rewriting already in progress\r\n"};
+static const sstring msg_aof_disabled_err = {"-ERR Append only file is disabled\r\n"};
+static const sstring msg_aof_write_err = {"-ERR Errors writing to the AOF file\r\n"};
+static const sstring msg_invalid_bulk_len_err = {"-ERR Protocol error: invalid bulk length\r\n"};
+static const sstring msg_invalid_port_err = {"-ERR Invalid master port\r\n"};
+static const sstring msg_db_index_err = {"-ERR DB index is out of range\r\n"};
+static const sstring msg_invalid_db_index_err = {"-ERR invalid DB index\r\n"};
+static const sstring msg_select_cluster_err = {"-ERR SELECT is not allowed in cluster mode\r\n"};
+static const sstring msg_snapshot_in_progress_err = {"-ERR a snapshot, a rewrite or a full sync is in progress, retry later\r\n"};
+static const sstring msg_busy_err = {"-BUSY the shard owning the key is overloaded, retry later\r\n"};
+static const sstring msg_queued = {"+QUEUED\r\n"};
+static const sstring msg_multi_nested_err = {"-ERR MULTI calls can not be nested\r\n"};
+static const sstring msg_exec_without_multi_err = {"-ERR EXEC without MULTI\r\n"};
+static const sstring msg_discard_without_multi_err = {"-ERR DISCARD without MULTI\r\n"};
+static const sstring msg_watch_in_multi_err = {"-ERR WATCH inside MULTI is not allowed\r\n"};
+static const sstring msg_not_in_multi_err = {"-ERR Command not allowed inside a transaction\r\n"};
+static const sstring msg_execabort_err = {"-EXECABORT Transaction discarded because of previous errors.\r\n"};
+static const sstring msg_exec_cross_shard_err = {"-CROSSSLOT Keys of the transaction are owned by several shards, the transaction was discarded\r\n"};
 static constexpr const int REDIS_OK = 0;
 static constexpr const int REDIS_ERR = 1;
 static constexpr const int REDIS_NONE = -1;
@@ -173,10 +274,22 @@ static constexpr const int ZAGGREGATE_MIN = (1 << 0);
 static constexpr const int ZAGGREGATE_MAX = (1 << 1);
 static constexpr const int ZAGGREGATE_SUM = (1 << 2);
 
-static constexpr const int GEODIST_UNIT_M  = (1 << 0);
-static constexpr const int GEODIST_UNIT_KM = (1 << 1);
-static constexpr const int GEODIST_UNIT_MI = (1 << 2);
-static constexpr const int GEODIST_UNIT_FT = (1 << 3);
+inline double score_aggregation(double old, double newscore, int flag)
+{
+    if (flag == ZAGGREGATE_MIN) {
+        return std::min(old, newscore);
+    }
+    else if (flag == ZAGGREGATE_SUM) {
+        return old + newscore;
+    }
+    else {
+        return std::max(old, newscore);
+    }
+}
+
+static constexpr const int SOPERATE_UNION = 0;
+static constexpr const int SOPERATE_INTER = 1;
+static constexpr const int SOPERATE_DIFF  = 2;
 
 static constexpr const int GEORADIUS_ASC         = (1 << 0);
 static constexpr const int GEORADIUS_DESC        = (1 << 1);
@@ -191,6 +304,78 @@ static constexpr const int GEO_UNIT_M      = (1 << 9);
 static constexpr const int GEO_UNIT_KM     = (1 << 10);
 static constexpr const int GEO_UNIT_MI     = (1 << 11);
 static constexpr const int GEO_UNIT_FT     = (1 << 12);
+static constexpr const int GEORADIUS_ANY   = (1 << 13);
 
 static constexpr const size_t BITMAP_MAX_OFFSET  = (1 << 31);
+
+static constexpr const int BITOP_AND = 0;
+static constexpr const int BITOP_OR  = 1;
+static constexpr const int BITOP_XOR = 2;
+static constexpr const int BITOP_NOT = 3;
+
+// 40 random hex digits, as the replication ids and the node ids of Redis.
+sstring random_run_id();
+
+// Every shard keeps its own snapshot and log files, the shard is inserted before
+// the extension: "dump.rdb" of shard 3 becomes "dump.3.rdb".
+sstring shard_file_path(const sstring& directory, const sstring& filename, unsigned shard);
+// The number of shard files in @directory, counted from shard 0 up to the first
+// missing one, i.e. the number of shards of the run which wrote them.
+future<unsigned> count_shard_files(sstring directory, sstring filename);
+
+// Returns true if the @size bytes at @s match the glob-style @pattern (*, ?,
+// [...] and \\ escapes), as the MATCH option of the SCAN family of Redis.
+bool glob_match(const char* pattern, size_t pattern_size, const char* s, size_t size);
+
+inline size_t reverse_bits(size_t v)
+{
+    size_t s = 8 * sizeof(v);
+    size_t mask = ~size_t(0);
+    while ((s >>= 1) > 0) {
+        mask ^= (mask << s);
+        v = ((v >> s) & mask) | ((v << s) & ~mask);
+    }
+    return v;
+}
+
+// Calls @visit(t, bucket) on the buckets at @cursor of a power of 2 hash
+// table, which may be draining the old table @old (nullptr if it is not), and
+// returns the next cursor, 0 once every bucket was visited. As the SCAN of
+// Redis, the cursor increments its reversed bits: a bucket is visited along
+// with the buckets it splits into in a larger table, so an entry staying in
+// the table is visited at least once even if the table is resized, or the old
+// one drained, between the calls.
+template <typename Table, typename Visit>
+size_t scan_tables(const Table* table, const Table* old, size_t cursor, Visit&& visit)
+{
+    if (old == nullptr) {
+        auto mask = table->bucket_count() - 1;
+        visit(table, cursor & mask);
+        cursor |= ~mask;
+        return reverse_bits(reverse_bits(cursor) + 1);
+    }
+    auto small = table->bucket_count() < old->bucket_count() ? table : old;
+    auto large = small == table ? old : table;
+    auto small_mask = small->bucket_count() - 1;
+    auto large_mask = large->bucket_count() - 1;
+    visit(small, cursor & small_mask);
+    do {
+        visit(large, cursor & large_mask);
+        cursor |= ~large_mask;
+        cursor = reverse_bits(reverse_bits(cursor) + 1);
+    } while (cursor & (small_mask ^ large_mask));
+    return cursor;
+}
+
+// scan_tables() of the tables of boost::intrusive, calls @func on the entries
+// of the buckets.
+template <typename Table, typename Func>
+size_t scan_buckets(const Table* table, const Table* old, size_t cursor, Func&& func)
+{
+    return scan_tables(table, old, cursor, [&func] (const Table* t, size_t bucket) {
+        for (auto it = t->begin(bucket); it != t->end(bucket); ++it) {
+            func(*it);
+        }
+    });
+}
 } /* namespace redis */
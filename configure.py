@@ -170,10 +170,14 @@ modes = {
 
 tests = [
     'tests/cache_test',
+    'tests/perf/cache_perf',
+    'tests/perf/containers_perf',
+    'tests/perf/encoding_perf',
     ]
 
 apps = [
     'pedis',
+    'pedis_bench',
     ]
 
 all_artifacts = apps + tests + ['libseastar.a', 'seastar.pc']
@@ -347,6 +351,17 @@ utils =  [
     'utils/bytes.cc',
     'utils/dynamic_bitset.cc',
 ]
+# The data structures measured by the benchmarks of tests/perf, and tested by
+# the unit tests.
+perf_deps = [
+    'common.cc',
+    'dict_lsa.cc',
+    'intset.cc',
+    'list_lsa.cc',
+    'hll.cc',
+    'geo.cc',
+    'bits_operation.cc',
+]
 deps = {
     'libseastar.a' : core + libnet + http + protobuf + prometheus,
     'seastar.pc': [],
@@ -354,6 +369,7 @@ deps = {
       'common.cc',
       'redis.cc',
       'dict_lsa.cc',
+      'intset.cc',
       'server.cc',
       'main.cc',
       'db.cc',
@@ -365,8 +381,18 @@ deps = {
       'list_lsa.cc',
       'cache.cc',
       'reply_builder.cc',
+      'rdb.cc',
+      'aof.cc',
+      'replication.cc',
+      'cluster.cc',
+      'pubsub.cc',
+      'flash_tier.cc',
       ] + libnet + core + http + utils + protobuf + prometheus,
-      'tests/cache_test': ['tests/cache_test.cc'] + core + utils,
+      'pedis_bench': ['tools/pedis_bench.cc', 'common.cc'] + libnet + core + utils,
+      'tests/cache_test': ['tests/cache_test.cc', 'rdb.cc', 'flash_tier.cc'] + perf_deps + core + utils,
+      'tests/perf/cache_perf': ['tests/perf/cache_perf.cc'] + perf_deps + core + utils,
+      'tests/perf/containers_perf': ['tests/perf/containers_perf.cc'] + perf_deps + core + utils,
+      'tests/perf/encoding_perf': ['tests/perf/encoding_perf.cc'] + perf_deps + core + utils,
 }
 
 boost_tests = [
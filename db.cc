@@ -25,7 +25,11 @@
 #include "util/log.hh"
 #include "bits_operation.hh"
 #include "core/metrics.hh"
+#include "core/fstream.hh"
+#include "core/reactor.hh"
+#include "core/seastar.hh"
 #include "hll.hh"
+#include <boost/range/irange.hpp>
 
 using logger =  seastar::logger;
 static logger db_log ("db");
@@ -61,62 +65,453 @@ private:
     std::uniform_int_distribution<size_t> _dist;
 };
 
-database::database()
+database::database(size_t databases)
 {
     using namespace std::chrono;
 
-    for (size_t i = 0; i < DEFAULT_DB_COUNT; ++i) {
-        auto& store = _cache_stores[i];
-        _cache_stores[i].set_expired_entry_releaser([this, &store] (cache_entry& e) {
-             with_allocator(allocator(), [this, &store, &e] {
-                 auto type = e.type();
-                 if (store.erase(e)) {
-                     switch (type) {
-                         case entry_type::ENTRY_FLOAT:
-                         case entry_type::ENTRY_INT64:
-                             --_stat._total_counter_entries;
-                             break;
-                         case entry_type::ENTRY_BYTES:
-                             --_stat._total_string_entries;
-                             break;
-                         case entry_type::ENTRY_LIST:
-                             --_stat._total_list_entries;
-                             break;
-                         case entry_type::ENTRY_MAP:
-                             --_stat._total_bitmap_entries;
-                             break;
-                         case entry_type::ENTRY_SET:
-                             --_stat._total_set_entries;
-                             break;
-                         case entry_type::ENTRY_SSET:
-                             --_stat._total_zset_entries;
-                             break;
-                         case entry_type::ENTRY_HLL:
-                             --_stat._total_hll_entries;
-                             break;
-                     }
-                 }
-             });
-        });
+    _cache_stores.reserve(std::max<size_t>(databases, 1));
+    for (size_t i = 0; i < std::max<size_t>(databases, 1); ++i) {
+        _cache_stores.emplace_back(make_store());
     }
+    _flush_timer.set_callback([this] { flush_step(); });
+    _compaction_timer.set_callback([this] { compaction_step(); });
     setup_metrics();
 }
 
 database::~database()
 {
+    logalloc::shard_tracker().set_stall_observer({});
+    with_allocator(allocator(), [this] {
+        for (size_t i = 0; i < _cache_stores.size(); ++i) {
+            db_log.info("total {} entries were released in cache [{}]", _cache_stores[i]->size(), i);
+            _cache_stores[i]->flush_all();
+        }
+        for (auto& store : _flushed_stores) {
+            store->flush_all();
+        }
+        _cache_stores.clear();
+        _flushed_stores.clear();
+    });
+}
+
+std::unique_ptr<cache> database::make_store()
+{
+    auto store = std::make_unique<cache>(STORE_INITIAL_SIZE);
+    auto s = store.get();
+    s->set_expired_entry_releaser([this, s] (cache_entry& e) {
+         with_allocator(allocator(), [this, s, &e] {
+             auto type = e.type();
+             if (s->erase(e, _lazyfree_expire)) {
+                 count_released_entry(type);
+             }
+         });
+    });
+    s->set_evicter([this] { maybe_evict(); });
+    s->set_expiry_budget(_expiry_budget);
+    s->set_lazyfree_overwrite(_lazyfree_overwrite);
+    return store;
+}
+
+void database::flush_step()
+{
+    with_allocator(allocator(), [this] {
+        auto budget = FLUSH_SLICE;
+        while (!_flushed_stores.empty()) {
+            auto& store = *_flushed_stores.front();
+            if (!store.flush_step(budget, [this] (entry_type type) { count_released_entry(type); })) {
+                return;
+            }
+            _stat._flushed_expired_entries += store.expired_entries();
+            _stat._flushed_lazyfreed_entries += store.lazyfreed_entries();
+            _flushed_stores.pop_front();
+        }
+        _flush_timer.cancel();
+    });
+}
+
+void database::count_inserted_entry(entry_type type)
+{
+    switch (type) {
+        case entry_type::ENTRY_FLOAT:
+        case entry_type::ENTRY_INT64:
+            ++_stat._total_counter_entries;
+            break;
+        case entry_type::ENTRY_BYTES:
+            ++_stat._total_string_entries;
+            break;
+        case entry_type::ENTRY_LIST:
+            ++_stat._total_list_entries;
+            break;
+        case entry_type::ENTRY_MAP:
+            ++_stat._total_dict_entries;
+            break;
+        case entry_type::ENTRY_SET:
+            ++_stat._total_set_entries;
+            break;
+        case entry_type::ENTRY_SSET:
+            ++_stat._total_zset_entries;
+            break;
+        case entry_type::ENTRY_HLL:
+            ++_stat._total_hll_entries;
+            break;
+    }
+}
+
+void database::count_released_entry(entry_type type)
+{
+    switch (type) {
+        case entry_type::ENTRY_FLOAT:
+        case entry_type::ENTRY_INT64:
+            --_stat._total_counter_entries;
+            break;
+        case entry_type::ENTRY_BYTES:
+            --_stat._total_string_entries;
+            break;
+        case entry_type::ENTRY_LIST:
+            --_stat._total_list_entries;
+            break;
+        case entry_type::ENTRY_MAP:
+            --_stat._total_dict_entries;
+            break;
+        case entry_type::ENTRY_SET:
+            --_stat._total_set_entries;
+            break;
+        case entry_type::ENTRY_SSET:
+            --_stat._total_zset_entries;
+            break;
+        case entry_type::ENTRY_HLL:
+            --_stat._total_hll_entries;
+            break;
+    }
+}
+
+bool database::parse_eviction_policy(const sstring& name, eviction_policy& policy)
+{
+    static const std::unordered_map<sstring, eviction_policy> policies = {
+        { "noeviction", eviction_policy::noeviction },
+        { "allkeys-lru", eviction_policy::allkeys_lru },
+        { "volatile-lru", eviction_policy::volatile_lru },
+        { "allkeys-lfu", eviction_policy::allkeys_lfu },
+        { "volatile-ttl", eviction_policy::volatile_ttl },
+    };
+    auto it = policies.find(name);
+    if (it == policies.end()) {
+        return false;
+    }
+    policy = it->second;
+    return true;
+}
+
+const char* database::eviction_policy_name(eviction_policy policy)
+{
+    switch (policy) {
+    case eviction_policy::noeviction:
+        return "noeviction";
+    case eviction_policy::allkeys_lru:
+        return "allkeys-lru";
+    case eviction_policy::volatile_lru:
+        return "volatile-lru";
+    case eviction_policy::allkeys_lfu:
+        return "allkeys-lfu";
+    case eviction_policy::volatile_ttl:
+        return "volatile-ttl";
+    }
+    return "";
+}
+
+void database::configure_eviction(size_t maxmemory, eviction_policy policy)
+{
+    // the region is not made evictable: the reclaimer runs within any
+    // allocation, and would free the entries the running command points to.
+    _maxmemory = maxmemory;
+    _eviction_policy = policy;
+}
+
+bool database::evict_entry()
+{
+    for (size_t i = 0; i < _cache_stores.size(); ++i) {
+        auto index = _eviction_store_index;
+        auto& store = *_cache_stores[index];
+        _eviction_store_index = (_eviction_store_index + 1) % _cache_stores.size();
+        auto e = store.eviction_candidate(_eviction_policy, EVICTION_SAMPLES);
+        if (e) {
+            sstring key(e->key_data(), e->key_size());
+            with_allocator(allocator(), [this, &store, e] {
+                auto type = e->type();
+                store.evict(*e);
+                count_released_entry(type);
+            });
+            ++_stat._evicted_entries;
+            // an eviction is a DEL for the log, the replicas, the watchers and
+            // the copies of the key.
+            with_store(index, [this, &key] {
+                log(redis_key {std::ref(key)}, "DEL");
+            });
+            return true;
+        }
+    }
+    return false;
+}
+
+void database::maybe_evict()
+{
+    if (_maxmemory == 0 || _eviction_policy == eviction_policy::noeviction) {
+        return;
+    }
+    for (size_t n = 0; n < EVICTION_MAX_PER_WRITE && occupancy().used_space() > _maxmemory; ++n) {
+        if (!evict_entry()) {
+            break;
+        }
+    }
+}
+
+void database::configure_expiry(std::chrono::microseconds budget)
+{
+    _expiry_budget = budget;
+    for (auto& store : _cache_stores) {
+        store->set_expiry_budget(budget);
+    }
+}
+
+void database::configure_lazyfree(bool del, bool expire, bool overwrite)
+{
+    _lazyfree_del = del;
+    _lazyfree_expire = expire;
+    _lazyfree_overwrite = overwrite;
+    for (auto& store : _cache_stores) {
+        store->set_lazyfree_overwrite(overwrite);
+    }
+}
+
+uint64_t database::watch(size_t db, const sstring& key)
+{
+    if (_watched.size() <= db) {
+        _watched.resize(db + 1);
+    }
+    auto& w = _watched[db][key];
+    if (w._watchers++ == 0) {
+        w._version = _watch_version;
+        ++_watched_keys;
+    }
+    return w._version;
+}
+
+void database::unwatch(size_t db, const sstring& key)
+{
+    if (db >= _watched.size()) {
+        return;
+    }
+    auto it = _watched[db].find(key);
+    if (it != _watched[db].end() && --it->second._watchers == 0) {
+        _watched[db].erase(it);
+        --_watched_keys;
+    }
+}
+
+bool database::watched_changed(size_t db, const sstring& key, uint64_t version) const
+{
+    if (db >= _watched.size()) {
+        return true;
+    }
+    auto it = _watched[db].find(key);
+    return it == _watched[db].end() || it->second._version != version;
+}
+
+void database::touch_watched(const sstring& key)
+{
+    if (current_store_index >= _watched.size()) {
+        return;
+    }
+    auto it = _watched[current_store_index].find(key);
+    if (it != _watched[current_store_index].end()) {
+        it->second._version = ++_watch_version;
+    }
+}
+
+void database::touch_all_watched()
+{
+    // FLUSHDB, FLUSHALL and SWAPDB change every key, of one or two databases.
+    auto version = ++_watch_version;
+    for (auto& keys : _watched) {
+        for (auto& w : keys) {
+            w.second._version = version;
+        }
+    }
+}
+
+void database::configure_compaction(size_t free_segments, std::chrono::microseconds budget, std::chrono::microseconds stall_threshold)
+{
+    auto& tracker = logalloc::shard_tracker();
+    _compaction_budget = budget;
+    _stall_threshold = stall_threshold;
+    tracker.set_compaction_watermark(free_segments);
+    tracker.set_idle_compaction_budget(budget);
+    tracker.set_stall_observer([this] (const logalloc::tracker::stall& s) { on_stall(s); });
+    engine().set_idle_cpu_handler([] (reactor::work_waiting_on_reactor check_for_work) {
+        return logalloc::shard_tracker().compact_on_idle(check_for_work);
+    });
+    _compaction_timer.arm_periodic(std::chrono::milliseconds(COMPACTION_STEP_MS));
+}
+
+void database::on_stall(const logalloc::tracker::stall& s)
+{
+    _stall_latencies.record(s.duration.count());
+    _stat._stall_moved_bytes += s.bytes_moved;
+    if (s.duration >= _stall_threshold) {
+        _stall_traces[_stall_traced++ % STALL_TRACE_SIZE] = s;
+    }
+}
+
+void database::compaction_step()
+{
+    // the stalls are logged here, out of the allocations which ran into them;
+    // the oldest ones are overwritten if more than STALL_TRACE_SIZE stalled.
+    if (_stall_traced - _stall_logged > STALL_TRACE_SIZE) {
+        db_log.warn("{} allocation stalls were not logged", _stall_traced - _stall_logged - STALL_TRACE_SIZE);
+        _stall_logged = _stall_traced - STALL_TRACE_SIZE;
+    }
+    for (; _stall_logged < _stall_traced; ++_stall_logged) {
+        auto& s = _stall_traces[_stall_logged % STALL_TRACE_SIZE];
+        db_log.warn("allocation stalled {} us compacting or evicting, {} bytes released, {} bytes moved, during {}",
+            s.duration.count(), s.bytes_released, s.bytes_moved, s.context ? s.context : "no command");
+    }
+    // a loaded shard is never idle, its segments are compacted here.
+    logalloc::shard_tracker().compact_in_background(_compaction_budget, [] { return false; });
+}
+
+void database::configure_encoding(size_t max_entries, size_t max_value, size_t max_intset_entries)
+{
+    dict_lsa::configure(max_entries, max_value, max_intset_entries);
+}
+
+future<> database::configure_tier(sstring path, size_t max_size, size_t memory, size_t min_value_size, bool compression)
+{
+    _tier_memory = memory;
+    return _tier.open(std::move(path), max_size, min_value_size, compression).then([this] {
+        _tier_timer.set_callback([this] { tier_step(); });
+        _tier_timer.arm_periodic(std::chrono::milliseconds(TIER_STEP_MS));
+    });
+}
+
+void database::tier_step()
+{
+    // the snapshots, the rewrites and the full syncs hold the gate.
+    if (occupancy().used_space() <= _tier_memory || _snapshot_gate.get_count() > 0) {
+        return;
+    }
     with_allocator(allocator(), [this] {
-        for (size_t i = 0; i < DEFAULT_DB_COUNT; ++i) {
-            db_log.info("total {} entries were released in cache [{}]", _cache_stores[i].size(), i);
-            _cache_stores[i].flush_all();
+        for (size_t n = 0; n < TIER_MAX_PER_STEP && _tier.accepting() && occupancy().used_space() > _tier_memory; ++n) {
+            auto& store = *_cache_stores[_tier_store_index];
+            _tier_store_index = (_tier_store_index + 1) % _cache_stores.size();
+            auto e = store.tier_candidate(TIER_SAMPLES, _tier.min_value_size(), flash_tier::MAX_VALUE_SIZE);
+            if (!e) {
+                continue;
+            }
+            auto location = with_linearized_managed_bytes([this, e] {
+                return _tier.append(e->value_bytes_view());
+            });
+            if (location == 0) {
+                break;
+            }
+            e->move_value_to_tier(location);
         }
     });
 }
 
+future<> database::promote(std::vector<sstring> keys)
+{
+    return do_with(std::move(keys), [this, index = current_store_index] (auto& keys) {
+        return parallel_for_each(keys, [this, index] (sstring& key) {
+            redis_key rk { key };
+            auto e = current_store().find(rk);
+            if (!e || !e->value_tiered()) {
+                return make_ready_future<>();
+            }
+            auto location = e->tier_location();
+            return _tier.read(location).then([this, index, &key, location] (temporary_buffer<char> value) {
+                redis_key rk { key };
+                auto e = _cache_stores[index]->find(rk);
+                // the entry was changed, removed, or promoted by another read meanwhile.
+                if (!e || !e->value_tiered() || e->tier_location() != location) {
+                    return;
+                }
+                with_allocator(allocator(), [e, &value] {
+                    e->load_tiered_value(bytes_view(reinterpret_cast<const signed char*>(value.get()), value.size()));
+                });
+                _tier.release(location);
+                ++_stat._tier_promotions;
+            });
+        });
+    });
+}
+
+std::vector<sstring> database::tiered_keys(std::vector<sstring>& keys)
+{
+    std::vector<sstring> tiered;
+    if (!_tier.enabled()) {
+        return tiered;
+    }
+    for (auto& key : keys) {
+        redis_key rk { key };
+        auto e = current_store().find(rk);
+        if (e && e->value_tiered()) {
+            tiered.push_back(key);
+        }
+    }
+    return tiered;
+}
+
+size_t database::sum_expired_entries()
+{
+    size_t sum = _stat._flushed_expired_entries;
+    for (auto& store : _cache_stores) {
+        sum += store->expired_entries();
+    }
+    for (auto& store : _flushed_stores) {
+        sum += store->expired_entries();
+    }
+    return sum;
+}
+
+size_t database::sum_lazyfree_backlog()
+{
+    size_t sum = 0;
+    for (auto& store : _cache_stores) {
+        sum += store->lazyfree_backlog();
+    }
+    // the entries of the flushed databases are pending too.
+    for (auto& store : _flushed_stores) {
+        sum += store->size() + store->lazyfree_backlog();
+    }
+    return sum;
+}
+
+uint64_t database::sum_lazyfreed_entries()
+{
+    uint64_t sum = _stat._flushed_lazyfreed_entries;
+    for (auto& store : _cache_stores) {
+        sum += store->lazyfreed_entries();
+    }
+    for (auto& store : _flushed_stores) {
+        sum += store->lazyfreed_entries();
+    }
+    return sum;
+}
+
+size_t database::sum_expiry_backlog()
+{
+    size_t sum = 0;
+    for (auto& store : _cache_stores) {
+        sum += store->expiry_backlog();
+    }
+    return sum;
+}
+
 size_t database::sum_expiring_entries()
 {
     size_t sum = 0;
-    for (size_t i = 0; i < DEFAULT_DB_COUNT; ++i) {
-        sum += _cache_stores[i].expiring_size();
+    for (auto& store : _cache_stores) {
+        sum += store->expiring_size();
     }
     return sum;
 }
@@ -135,6 +530,43 @@ void database::setup_metrics()
         sm::make_counter("total_sorted_set_entries", [this] { return _stat._total_zset_entries; }, sm::description("Total of sorted set entries.")),
         sm::make_counter("total_hll_entries", [this] { return _stat._total_hll_entries; }, sm::description("Total of hyperloglog entries.")),
         sm::make_counter("total_expiring_entries", [this] { return sum_expiring_entries(); }, sm::description("Total of expiring entries.")),
+        sm::make_counter("expired_entries", [this] { return sum_expired_entries(); }, sm::description("Total number of entries released since they expired.")),
+        sm::make_gauge("expiry_backlog", [this] { return sum_expiry_backlog(); }, sm::description("Number of expired entries waiting to be released by the active expiry.")),
+        sm::make_gauge("lazyfree_backlog", [this] { return sum_lazyfree_backlog(); }, sm::description("Number of erased entries whose values are still being freed in the background.")),
+        sm::make_counter("lazyfreed_entries", [this] { return sum_lazyfreed_entries(); }, sm::description("Total number of entries whose values were freed in the background.")),
+        sm::make_counter("evicted_entries", [this] { return _stat._evicted_entries; }, sm::description("Total number of entries evicted to respect the memory limit.")),
+        sm::make_counter("tier_promotions", [this] { return _stat._tier_promotions; }, sm::description("Total number of values read back from the flash tier into memory.")),
+        sm::make_counter("saved_entries", [this] { return _stat._saved_entries; }, sm::description("Total number of entries written to the snapshots.")),
+        sm::make_counter("saved_bytes", [this] { return _stat._saved_bytes; }, sm::description("Total number of bytes written to the snapshots.")),
+        sm::make_gauge("loading", [this] { return _loading; }, sm::description("Number of snapshot files being loaded, the clients are accepted once the loading is done.")),
+        sm::make_gauge("load_total_bytes", [this] { return _load_total_bytes; }, sm::description("Size (bytes) of the snapshot files loaded by this shard.")),
+        sm::make_counter("loaded_bytes", [this] { return _stat._loaded_bytes; }, sm::description("Total number of bytes read from the snapshot files.")),
+        sm::make_counter("loaded_entries", [this] { return _stat._loaded_entries; }, sm::description("Total number of entries loaded from the snapshots.")),
+        sm::make_counter("forwarded_entries", [this] { return _stat._forwarded_entries; }, sm::description("Total number of entries of the snapshot forwarded to the shard owning them.")),
+        sm::make_counter("aof_appended_commands", [this] { return _aof.appended_commands(); }, sm::description("Total number of commands appended to the log.")),
+        sm::make_counter("aof_appended_bytes", [this] { return _aof.appended_bytes(); }, sm::description("Total number of bytes appended to the log.")),
+        sm::make_counter("aof_written_bytes", [this] { return _aof.written_bytes(); }, sm::description("Total number of bytes written to the log file.")),
+        sm::make_counter("aof_writes", [this] { return _aof.writes(); }, sm::description("Total number of writes to the log file, each one commits a group of commands.")),
+        sm::make_counter("aof_fsyncs", [this] { return _aof.fsyncs(); }, sm::description("Total number of flushes of the log file.")),
+        sm::make_counter("aof_write_errors", [this] { return _aof.write_errors(); }, sm::description("Total number of failed writes to the log file.")),
+        sm::make_counter("aof_rewrites", [this] { return _aof.rewrites(); }, sm::description("Total number of rewrites of the log.")),
+        sm::make_gauge("aof_size", [this] { return _aof.size(); }, sm::description("Size (bytes) of the log file.")),
+        sm::make_gauge("aof_pending_bytes", [this] { return _aof.pending_bytes(); }, sm::description("Number of bytes appended to the log but not written yet.")),
+        sm::make_gauge("repl_backlog_size", [this] { return _backlog.size(); }, sm::description("Size (bytes) of the backlog of the changes kept for the replicas, 0 until the first replica syncs.")),
+        sm::make_gauge("repl_offset", [this] { return _backlog.end_offset(); }, sm::description("Number of bytes of changes appended to the backlog.")),
+        sm::make_gauge("repl_streams", [this] { return _backlog.streams(); }, sm::description("Number of replicas streaming the changes of this shard.")),
+        sm::make_counter("repl_full_syncs", [this] { return _backlog.full_syncs(); }, sm::description("Total number of full syncs of the replicas, with the snapshot of this shard.")),
+        sm::make_counter("repl_partial_syncs", [this] { return _backlog.partial_syncs(); }, sm::description("Total number of replicas resumed from the backlog.")),
+        sm::make_gauge("blocked_clients", [this] { return _blocked.size(); }, sm::description("Number of clients blocked on the lists of this shard.")),
+        sm::make_gauge("used_memory", [this] { return occupancy().used_space(); }, sm::description("Memory (bytes) used by the data.")),
+        sm::make_gauge("maxmemory", [this] { return _maxmemory; }, sm::description("Memory limit (bytes) of the data, 0 means no limit.")),
+        sm::make_counter("local_dispatch", [this] { return _stat._local_dispatch; }, sm::description("Total number of requests executed locally since the key is owned by this shard.")),
+        sm::make_counter("remote_dispatch", [this] { return _stat._remote_dispatch; }, sm::description("Total number of requests submitted to the owner shard of the key.")),
+        sm::make_gauge("replicated_keys", [this] { return _replicas.published_keys(); }, sm::description("Number of keys of this shard whose copies are held by the other shards.")),
+        sm::make_gauge("replica_copies", [this] { return _replicas.copies(); }, sm::description("Number of copies of the keys of the other shards held by this shard.")),
+        sm::make_counter("replica_hits", [this] { return _replicas.hits(); }, sm::description("Total number of reads served by the copies held by this shard.")),
+        sm::make_counter("replica_publications", [this] { return _replicas.published_total(); }, sm::description("Total number of copies of the keys of this shard pushed to the other shards.")),
+        sm::make_counter("replica_invalidations", [this] { return _replicas.invalidated_total(); }, sm::description("Total number of changes of the keys of this shard which dropped their copies.")),
     });
 
     _metrics.add_group("op", {
@@ -216,6 +648,10 @@ void database::setup_metrics()
         sm::make_counter("geohash", [this] { return _stat._geohash; }, sm::description("GEOHASH")),
         sm::make_counter("geopos", [this] { return _stat._geopos; }, sm::description("GEOPOS")),
         sm::make_counter("georadius", [this] { return _stat._georadius; }, sm::description("GEORADIUS")),
+        sm::make_counter("scan", [this] { return _stat._scan; }, sm::description("SCAN")),
+        sm::make_counter("hscan", [this] { return _stat._hscan; }, sm::description("HSCAN")),
+        sm::make_counter("sscan", [this] { return _stat._sscan; }, sm::description("SSCAN")),
+        sm::make_counter("zscan", [this] { return _stat._zscan; }, sm::description("ZSCAN")),
         sm::make_counter("setbit", [this] { return _stat._setbit; }, sm::description("SETBIT")),
         sm::make_counter("getbit", [this] { return _stat._getbit; }, sm::description("GETBIT")),
         sm::make_counter("bitcount", [this] { return _stat._bitcount; }, sm::description("BITCOUNT")),
@@ -228,14 +664,29 @@ void database::setup_metrics()
      });
 }
 
+cache_entry* database::make_string_entry(const redis_key& rk, const sstring& val)
+{
+    // the HyperLogLog of Redis, e.g. from the log, is a HyperLogLog again.
+    if (hll::is_redis_encoding(val.data(), val.size())) {
+        auto entry = cache_entry::make(rk.key(), rk.hash(), cache_entry::hll_initializer());
+        entry->value_bytes() = hll::import(val.data(), val.size());
+        return entry;
+    }
+    return cache_entry::make(rk.key(), rk.hash(), val);
+}
+
 bool database::set_direct(const redis_key& rk, sstring& val, long expired, uint32_t flag)
 {
     ++_stat._set;
     return with_allocator(allocator(), [this, &rk, &val, expired, flag] {
-        auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val);
+        auto entry = make_string_entry(rk, val);
         bool result = true;
         if (current_store().insert_if(entry, expired, flag & FLAG_SET_NX, flag & FLAG_SET_XX)) {
-            ++_stat._total_string_entries;
+            entry->type_of_hll() ? ++_stat._total_hll_entries : ++_stat._total_string_entries;
+            log(rk, "SET", val);
+            if (expired > 0) {
+                log(rk, "PEXPIREAT", unix_time_after(expired));
+            }
         }
         else {
             result = false;
@@ -245,83 +696,68 @@ bool database::set_direct(const redis_key& rk, sstring& val, long expired, uint3
     });
 }
 
-future<scattered_message_ptr> database::set(const redis_key& rk, sstring& val, long expired, uint32_t flag)
+future<reply> database::set(const redis_key& rk, sstring& val, long expired, uint32_t flag)
 {
     ++_stat._set;
-    return with_allocator(allocator(), [this, &rk, &val, expired, flag] {
-        auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val);
+    return logged(with_allocator(allocator(), [this, &rk, &val, expired, flag] {
+        auto entry = make_string_entry(rk, val);
         bool result = true;
         if (current_store().insert_if(entry, expired, flag & FLAG_SET_NX, flag & FLAG_SET_XX)) {
-            ++_stat._total_string_entries;
+            entry->type_of_hll() ? ++_stat._total_hll_entries : ++_stat._total_string_entries;
+            log(rk, "SET", val);
+            if (expired > 0) {
+                log(rk, "PEXPIREAT", unix_time_after(expired));
+            }
         }
         else {
             result = false;
             current_allocator().destroy<cache_entry>(entry);
         }
         return reply_builder::build(result ? msg_ok : msg_nil);
+    }));
+}
+
+bool database::remove(const redis_key& rk, bool lazily, const char* command)
+{
+    return with_allocator(allocator(), [this, &rk, lazily, command] {
+        return current_store().with_entry_run(rk, [this, &rk, lazily, command] (cache_entry* e) {
+            if (!e) {
+                // a copy outliving its key, e.g. an expired one, is dropped all the same.
+                if (_replicas.publishing()) {
+                    _replicas.changed(rk.key());
+                }
+                return false;
+            }
+            count_released_entry(e->type());
+            auto result = current_store().erase(*e, lazily);
+            log(rk, command);
+            return result;
+        });
     });
 }
 
 bool database::del_direct(const redis_key& rk)
 {
     ++_stat._del;
-    return current_store().with_entry_run(rk, [this, &rk] (cache_entry* e) {
-        if (!e) return false;
-        if (e->type_of_bytes()) {
-            --_stat._total_string_entries;
-        }
-        else if (e->type_of_set()) {
-            --_stat._total_set_entries;
-        }
-        else if (e->type_of_list()) {
-            --_stat._total_list_entries;
-        }
-        else if (e->type_of_map()) {
-            --_stat._total_dict_entries;
-        }
-        else if (e->type_of_sset()) {
-            --_stat._total_zset_entries;
-        }
-        else if (e->type_of_hll()) {
-            --_stat._total_hll_entries;
-        }
-        else {
-            --_stat._total_counter_entries;
-        }
-        auto result =  current_store().erase(*e);
-        return result;
-    });
+    return remove(rk, _lazyfree_del, "DEL");
 }
 
-future<scattered_message_ptr> database::del(const redis_key& rk)
+future<reply> database::del(const redis_key& rk)
 {
     ++_stat._del;
-    return current_store().with_entry_run(rk, [this, &rk] (cache_entry* e) {
-        if (!e) return reply_builder::build(msg_zero);
-        if (e->type_of_bytes()) {
-            --_stat._total_string_entries;
-        }
-        else if (e->type_of_set()) {
-            --_stat._total_set_entries;
-        }
-        else if (e->type_of_list()) {
-            --_stat._total_list_entries;
-        }
-        else if (e->type_of_map()) {
-            --_stat._total_dict_entries;
-        }
-        else if (e->type_of_sset()) {
-            --_stat._total_zset_entries;
-        }
-        else if (e->type_of_hll()) {
-            --_stat._total_hll_entries;
-        }
-        else {
-            --_stat._total_counter_entries;
-        }
-        auto result =  current_store().erase(*e);
-        return reply_builder::build(result ? msg_one : msg_zero);
-    });
+    return logged(reply_builder::build(remove(rk, _lazyfree_del, "DEL") ? msg_one : msg_zero));
+}
+
+bool database::unlink_direct(const redis_key& rk)
+{
+    ++_stat._del;
+    return remove(rk, true, "UNLINK");
+}
+
+future<reply> database::unlink(const redis_key& rk)
+{
+    ++_stat._del;
+    return logged(reply_builder::build(remove(rk, true, "UNLINK") ? msg_one : msg_zero));
 }
 
 bool database::exists_direct(const redis_key& rk)
@@ -330,23 +766,24 @@ bool database::exists_direct(const redis_key& rk)
     return current_store().exists(rk);
 }
 
-future<scattered_message_ptr> database::exists(const redis_key& rk)
+future<reply> database::exists(const redis_key& rk)
 {
     ++_stat._exists;
     auto result = current_store().exists(rk);
     return reply_builder::build(result ? msg_one : msg_zero);
 }
 
-future<scattered_message_ptr> database::counter_by(const redis_key& rk, int64_t step, bool incr)
+future<reply> database::counter_by(const redis_key& rk, int64_t step, bool incr)
 {
     ++_stat._counter;
-    return with_allocator(allocator(), [this, &rk, step, incr] {
+    return logged(with_allocator(allocator(), [this, &rk, step, incr] {
         return current_store().with_entry_run(rk, [this, &rk, step, incr] (cache_entry* e) {
             if (!e) {
                 // not exists
-                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), int64_t{step});
+                auto entry = cache_entry::make(rk.key(), rk.hash(), int64_t{step});
                 current_store().replace(entry);
                 ++_stat._total_counter_entries;
+                log(rk, "INCRBY", step);
                 return reply_builder::build<false, true>(entry);
             }
             if (!e->type_of_integer()) {
@@ -358,44 +795,54 @@ future<scattered_message_ptr> database::counter_by(const redis_key& rk, int64_t
             else {
                 e->value_integer_incr(-step);
             }
+            log(rk, "INCRBY", incr ? step : -step);
             return reply_builder::build<false, true>(e);
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::append(const redis_key& rk, sstring& val)
+future<reply> database::append(const redis_key& rk, sstring& val)
 {
     ++_stat._append;
-    return with_allocator(allocator(), [this, &rk, &val] {
+    return logged(with_allocator(allocator(), [this, &rk, &val] {
         return current_store().with_entry_run(rk, [this, &rk, &val] (cache_entry* e) {
             if (!e) {
                 // not exists
-                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val);
+                auto entry = cache_entry::make(rk.key(), rk.hash(), val);
                 current_store().replace(entry);
                 ++_stat._total_string_entries;
+                log(rk, "APPEND", val);
                 return reply_builder::build(val.size());
             }
             if (!e->type_of_bytes()) {
                 return reply_builder::build(msg_type_err);
             }
+            if (e->value_tiered()) {
+                return promoted(rk, [this, &val] (const redis_key& rk) { return append(rk, val); });
+            }
             size_t new_size = e->value_bytes_size() + val.size();
             auto data = std::unique_ptr<bytes_view::value_type[]>(new bytes_view::value_type[new_size]);
             std::copy_n(e->value_bytes_data(), e->value_bytes_size(), data.get());
             std::copy_n(val.data(), val.size(), data.get() + e->value_bytes_size());
-            auto new_value = current_allocator().construct<managed_bytes>(data.get(), new_size);
-            auto& old_value = e->value_bytes();
-            current_allocator().destroy<managed_bytes>(&old_value);
-            e->value_bytes() = std::move(*new_value);
+            e->assign_value_bytes(bytes_view(data.get(), new_size));
+            log(rk, "APPEND", val);
             return reply_builder::build(new_size);
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::get(const redis_key& rk)
+future<reply> database::get(const redis_key& rk)
 {
     ++_stat._read;
     ++_stat._get;
-    return current_store().with_entry_run(rk, [this] (const cache_entry* e) {
+    if (auto c = _replicas.find(rk.key(), clock_type::now())) {
+        ++_stat._hit;
+        return reply_builder::build(c->_hash ? msg_type_err : c->_value);
+    }
+    return current_store().with_entry_run(rk, [this, &rk] (const cache_entry* e) {
+       if (e && e->value_tiered()) {
+           return promoted(rk, [this] (const redis_key& rk) { return get(rk); });
+       }
        if (e && e->type_of_bytes() == false) {
            return reply_builder::build(msg_type_err);
        }
@@ -406,10 +853,13 @@ future<scattered_message_ptr> database::get(const redis_key& rk)
     });
 }
 
-future<scattered_message_ptr> database::strlen(const redis_key& rk)
+future<reply> database::strlen(const redis_key& rk)
 {
     ++_stat._strlen;
-    return current_store().with_entry_run(rk, [] (const cache_entry* e) {
+    return current_store().with_entry_run(rk, [this, &rk] (const cache_entry* e) {
+        if (e && e->value_tiered()) {
+            return promoted(rk, [this] (const redis_key& rk) { return strlen(rk); });
+        }
         if (e) {
             if (e->type_of_bytes()) {
                 return reply_builder::build(e->value_bytes_size());
@@ -420,7 +870,7 @@ future<scattered_message_ptr> database::strlen(const redis_key& rk)
     });
 }
 
-future<scattered_message_ptr> database::type(const redis_key& rk)
+future<reply> database::type(const redis_key& rk)
 {
     ++_stat._type;
     return current_store().with_entry_run(rk, [this, &rk] (const cache_entry* e) {
@@ -432,32 +882,279 @@ future<scattered_message_ptr> database::type(const redis_key& rk)
     });
 }
 
-future<scattered_message_ptr> database::expire(const redis_key& rk, long expired)
+future<reply> database::memory_usage(const redis_key& rk)
 {
-    ++_stat._expire;
-    auto result = current_store().expire(rk, expired);
-    return reply_builder::build(result ? msg_one : msg_zero);
+    return current_store().with_entry_run(rk, [] (const cache_entry* e) {
+        if (!e) {
+            return reply_builder::build(msg_nil);
+        }
+        return reply_builder::build(e->memory_usage());
+    });
 }
 
-future<scattered_message_ptr> database::persist(const redis_key& rk)
+database::shard_info& database::shard_info::operator += (const shard_info& o)
 {
-    ++_stat._persist;
-    auto result = current_store().never_expired(rk);
-    return reply_builder::build(result ? msg_one : msg_zero);
+    keys += o.keys;
+    expires += o.expires;
+    if (databases.size() < o.databases.size()) {
+        databases.resize(o.databases.size());
+    }
+    for (size_t i = 0; i < o.databases.size(); ++i) {
+        databases[i].first += o.databases[i].first;
+        databases[i].second += o.databases[i].second;
+    }
+    reads += o.reads;
+    hits += o.hits;
+    expired += o.expired;
+    evicted += o.evicted;
+    local_dispatch += o.local_dispatch;
+    remote_dispatch += o.remote_dispatch;
+    used_memory += o.used_memory;
+    total_memory += o.total_memory;
+    dataset_used += o.dataset_used;
+    dataset_total += o.dataset_total;
+    lsa_used += o.lsa_used;
+    lsa_total += o.lsa_total;
+    lsa_free_segments += o.lsa_free_segments;
+    lsa_zones += o.lsa_zones;
+    lsa_segments_compacted += o.lsa_segments_compacted;
+    lsa_segments_migrated += o.lsa_segments_migrated;
+    non_lsa_memory += o.non_lsa_memory;
+    maxmemory += o.maxmemory;
+    maxmemory_policy = o.maxmemory_policy;
+    replicated_keys += o.replicated_keys;
+    replica_copies += o.replica_copies;
+    replica_hits += o.replica_hits;
+    replica_invalidations += o.replica_invalidations;
+    repl_offset += o.repl_offset;
+    repl_backlog_size += o.repl_backlog_size;
+    repl_streams += o.repl_streams;
+    repl_full_syncs += o.repl_full_syncs;
+    repl_partial_syncs += o.repl_partial_syncs;
+    blocked_clients += o.blocked_clients;
+    tiered_values += o.tiered_values;
+    tiered_bytes += o.tiered_bytes;
+    tier_promotions += o.tier_promotions;
+    lazyfree_pending += o.lazyfree_pending;
+    lazyfreed += o.lazyfreed;
+    lsa_compacted_bytes += o.lsa_compacted_bytes;
+    lsa_background_compacted_bytes += o.lsa_background_compacted_bytes;
+    lsa_stall_moved_bytes += o.lsa_stall_moved_bytes;
+    lsa_stalls += o.lsa_stalls;
+    return *this;
 }
 
-future<scattered_message_ptr> database::push(const redis_key& rk, sstring& val, bool force, bool left)
+database::shard_info database::info()
 {
-    left ? ++_stat._lpush : ++_stat._rpush;
-    return with_allocator(allocator(), [this, &rk, &val, force, left] () {
-        return current_store().with_entry_run(rk, [this, &rk, &val, force, left] (cache_entry* o) {
-            auto e = o;
-            if (!e) {
-                 if (!force) {
-                     return reply_builder::build(msg_err);
-                 }
-                // create new list object
-                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::list_initializer());
+    shard_info info;
+    for (auto& store : _cache_stores) {
+        info.keys += store->size();
+        info.expires += store->expiring_size();
+        info.databases.emplace_back(store->size(), store->expiring_size());
+    }
+    info.reads = _stat._read;
+    info.hits = _stat._hit;
+    info.expired = sum_expired_entries();
+    info.evicted = _stat._evicted_entries;
+    info.local_dispatch = _stat._local_dispatch;
+    info.remote_dispatch = _stat._remote_dispatch;
+    auto memory = memory::stats();
+    info.used_memory = memory.allocated_memory();
+    info.total_memory = memory.total_memory();
+    auto dataset = occupancy();
+    info.dataset_used = dataset.used_space();
+    info.dataset_total = dataset.total_space();
+    auto& tracker = logalloc::shard_tracker();
+    auto regions = tracker.region_occupancy();
+    info.lsa_used = regions.used_space();
+    info.lsa_total = regions.total_space();
+    auto segments = tracker.segment_statistics();
+    info.lsa_free_segments = segments.free_segments;
+    info.lsa_zones = segments.zones;
+    info.lsa_segments_compacted = segments.segments_compacted;
+    info.lsa_segments_migrated = segments.segments_migrated;
+    info.lsa_compacted_bytes = segments.bytes_compacted;
+    info.lsa_background_compacted_bytes = segments.background_bytes_compacted;
+    info.lsa_stall_moved_bytes = _stat._stall_moved_bytes;
+    info.lsa_stalls = _stall_latencies;
+    info.non_lsa_memory = segments.non_lsa_memory_in_use;
+    info.maxmemory = _maxmemory;
+    info.maxmemory_policy = eviction_policy_name(_eviction_policy);
+    info.replicated_keys = _replicas.published_keys();
+    info.replica_copies = _replicas.copies();
+    info.replica_hits = _replicas.hits();
+    info.replica_invalidations = _replicas.invalidated_total();
+    info.repl_id = _backlog.replid();
+    info.repl_offset = _backlog.end_offset();
+    info.repl_backlog_size = _backlog.size();
+    info.repl_streams = _backlog.streams();
+    info.repl_full_syncs = _backlog.full_syncs();
+    info.repl_partial_syncs = _backlog.partial_syncs();
+    info.blocked_clients = _blocked.size();
+    info.tiered_values = _tier.values();
+    info.tiered_bytes = _tier.live_bytes();
+    info.tier_promotions = _stat._tier_promotions;
+    info.lazyfree_pending = sum_lazyfree_backlog();
+    info.lazyfreed = sum_lazyfreed_entries();
+    return info;
+}
+
+future<reply> database::scan(size_t cursor, const sstring& pattern, size_t count, const sstring& type)
+{
+    ++_stat._read;
+    ++_stat._scan;
+    std::vector<sstring> keys;
+    auto now = clock_type::now();
+    // as Redis does, a call visits up to 10 times @count buckets to fill its reply.
+    size_t buckets = count * 10;
+    do {
+        cursor = current_store().scan(cursor, [&] (const cache_entry& e) {
+            if (e.expired(now) || (!type.empty() && e.type_name() != type)) {
+                return;
+            }
+            if (!pattern.empty() && !glob_match(pattern.data(), pattern.size(), e.key_data(), e.key_size())) {
+                return;
+            }
+            keys.emplace_back(e.key_data(), e.key_size());
+        });
+    } while (cursor != 0 && --buckets > 0 && keys.size() < count);
+    // the cursor of SCAN is the cursor within the shard times the number of
+    // shards, plus the shard, once a shard is done the next one starts at 0.
+    size_t next = 0;
+    if (cursor != 0) {
+        next = cursor * smp::count + engine().cpu_id();
+    }
+    else if (engine().cpu_id() + 1 < smp::count) {
+        next = engine().cpu_id() + 1;
+    }
+    if (!keys.empty()) ++_stat._hit;
+    return reply_builder::build_scan(next, keys);
+}
+
+// The value of a field of a hash, as HGET replies it.
+static sstring field_value(const dict_field& f)
+{
+    if (f.type_of_integer()) {
+        return to_sstring(f.value_integer());
+    }
+    if (f.type_of_float()) {
+        return to_sstring(f.value_float());
+    }
+    return sstring(f.value_bytes_data(), f.value_bytes_size());
+}
+
+template <bool Value>
+static size_t scan_fields(const dict_lsa& fields, size_t cursor, const sstring& pattern, size_t count, std::vector<sstring>& elements)
+{
+    size_t buckets = count * 10;
+    size_t found = 0;
+    do {
+        cursor = fields.scan(cursor, [&] (const dict_field& f) {
+            if (!pattern.empty() && !glob_match(pattern.data(), pattern.size(), f.key_data(), f.key_size())) {
+                return;
+            }
+            ++found;
+            elements.emplace_back(f.key_data(), f.key_size());
+            if (Value) {
+                elements.emplace_back(field_value(f));
+            }
+        });
+    } while (cursor != 0 && --buckets > 0 && found < count);
+    return cursor;
+}
+
+future<reply> database::hscan(const redis_key& rk, size_t cursor, const sstring& pattern, size_t count)
+{
+    ++_stat._read;
+    ++_stat._hscan;
+    return current_store().with_entry_run(rk, [this, cursor, &pattern, count] (const cache_entry* e) {
+        std::vector<sstring> elements;
+        if (!e) {
+            return reply_builder::build_scan(0, elements);
+        }
+        if (e->type_of_map() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto next = scan_fields<true>(e->value_map(), cursor, pattern, count, elements);
+        if (!elements.empty()) ++_stat._hit;
+        return reply_builder::build_scan(next, elements);
+    });
+}
+
+future<reply> database::sscan(const redis_key& rk, size_t cursor, const sstring& pattern, size_t count)
+{
+    ++_stat._read;
+    ++_stat._sscan;
+    return current_store().with_entry_run(rk, [this, cursor, &pattern, count] (const cache_entry* e) {
+        std::vector<sstring> elements;
+        if (!e) {
+            return reply_builder::build_scan(0, elements);
+        }
+        if (e->type_of_set() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto next = scan_fields<false>(e->value_set(), cursor, pattern, count, elements);
+        if (!elements.empty()) ++_stat._hit;
+        return reply_builder::build_scan(next, elements);
+    });
+}
+
+future<reply> database::zscan(const redis_key& rk, size_t cursor, const sstring& pattern, size_t count)
+{
+    ++_stat._read;
+    ++_stat._zscan;
+    return current_store().with_entry_run(rk, [this, cursor, &pattern, count] (const cache_entry* e) {
+        std::vector<sstring> elements;
+        if (!e) {
+            return reply_builder::build_scan(0, elements);
+        }
+        if (e->type_of_sset() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto next = e->value_sset().scan(cursor, count, [&] (const sset_entry& m) {
+            if (!pattern.empty() && !glob_match(pattern.data(), pattern.size(), m.key_data(), m.key_size())) {
+                return;
+            }
+            elements.emplace_back(m.key_data(), m.key_size());
+            elements.emplace_back(to_sstring(m.score()));
+        });
+        if (!elements.empty()) ++_stat._hit;
+        return reply_builder::build_scan(next, elements);
+    });
+}
+
+future<reply> database::expire(const redis_key& rk, long expired)
+{
+    ++_stat._expire;
+    auto result = current_store().expire(rk, expired);
+    if (result) {
+        log(rk, "PEXPIREAT", unix_time_after(expired));
+    }
+    return logged(reply_builder::build(result ? msg_one : msg_zero));
+}
+
+future<reply> database::persist(const redis_key& rk)
+{
+    ++_stat._persist;
+    auto result = current_store().never_expired(rk);
+    if (result) {
+        log(rk, "PERSIST");
+    }
+    return logged(reply_builder::build(result ? msg_one : msg_zero));
+}
+
+future<reply> database::push(const redis_key& rk, sstring& val, bool force, bool left)
+{
+    left ? ++_stat._lpush : ++_stat._rpush;
+    return logged(with_allocator(allocator(), [this, &rk, &val, force, left] () {
+        return current_store().with_entry_run(rk, [this, &rk, &val, force, left] (cache_entry* o) {
+            auto e = o;
+            if (!e) {
+                 if (!force) {
+                     return reply_builder::build(msg_err);
+                 }
+                // create new list object
+                auto entry = cache_entry::make(rk.key(), rk.hash(), cache_entry::list_initializer());
                 current_store().insert(entry);
                 ++_stat._total_list_entries;
                 e = entry;
@@ -467,15 +1164,46 @@ future<scattered_message_ptr> database::push(const redis_key& rk, sstring& val,
             }
             auto& list = e->value_list();
             left ? list.insert_head(val) : list.insert_tail(val);
-            return reply_builder::build(list.size());
+            log(rk, left ? "LPUSH" : "RPUSH", val);
+            auto reply = reply_builder::build(list.size());
+            if (_blocked.blocked(current_store_index, rk.key())) {
+                serve_blocked(rk, e);
+            }
+            return reply;
+        });
+    }));
+}
+
+bool database::push_direct(const redis_key& rk, sstring& val, bool left)
+{
+    left ? ++_stat._lpush : ++_stat._rpush;
+    return with_allocator(allocator(), [this, &rk, &val, left] () {
+        return current_store().with_entry_run(rk, [this, &rk, &val, left] (cache_entry* o) {
+            auto e = o;
+            if (!e) {
+                auto entry = cache_entry::make(rk.key(), rk.hash(), cache_entry::list_initializer());
+                current_store().insert(entry);
+                ++_stat._total_list_entries;
+                e = entry;
+            }
+            if (e->type_of_list() == false) {
+                return false;
+            }
+            auto& list = e->value_list();
+            left ? list.insert_head(val) : list.insert_tail(val);
+            log(rk, left ? "LPUSH" : "RPUSH", val);
+            if (_blocked.blocked(current_store_index, rk.key())) {
+                serve_blocked(rk, e);
+            }
+            return true;
         });
     });
 }
 
-future<scattered_message_ptr> database::push_multi(const redis_key& rk, std::vector<sstring>& values, bool force, bool left)
+future<reply> database::push_multi(const redis_key& rk, std::vector<sstring>& values, bool force, bool left)
 {
     left ? ++_stat._lpush : ++_stat._rpush;
-    return with_allocator(allocator(), [this, &rk, &values, force, left] () {
+    return logged(with_allocator(allocator(), [this, &rk, &values, force, left] () {
         return current_store().with_entry_run(rk, [this, &rk, &values, force, left] (cache_entry* o) {
             auto e = o;
             if (!e) {
@@ -483,7 +1211,7 @@ future<scattered_message_ptr> database::push_multi(const redis_key& rk, std::vec
                      return reply_builder::build(msg_err);
                  }
                 // create new list object
-                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::list_initializer());
+                auto entry = cache_entry::make(rk.key(), rk.hash(), cache_entry::list_initializer());
                 current_store().insert(entry);
                 ++_stat._total_list_entries;
                 e = entry;
@@ -495,16 +1223,21 @@ future<scattered_message_ptr> database::push_multi(const redis_key& rk, std::vec
             for (auto& val : values) {
                 left ? list.insert_head(val) : list.insert_tail(val);
             }
-            return reply_builder::build(list.size());
+            log(rk, left ? "LPUSH" : "RPUSH", values);
+            auto reply = reply_builder::build(list.size());
+            if (_blocked.blocked(current_store_index, rk.key())) {
+                serve_blocked(rk, e);
+            }
+            return reply;
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::pop(const redis_key& rk, bool left)
+future<reply> database::pop(const redis_key& rk, bool left)
 {
     ++_stat._read;
     left ? ++_stat._lpop : ++_stat._rpop;
-    return with_allocator(allocator(), [this, &rk, left] () {
+    return logged(with_allocator(allocator(), [this, &rk, left] () {
         return current_store().with_entry_run(rk, [this, &rk, left] (cache_entry* e) {
             if (!e) {
                 return reply_builder::build(msg_nil);
@@ -520,13 +1253,102 @@ future<scattered_message_ptr> database::pop(const redis_key& rk, bool left)
                --_stat._total_list_entries;
                current_store().erase(rk);
             }
+            log(rk, left ? "LPOP" : "RPOP");
             ++_stat._hit;
             return reply;
         });
+    }));
+}
+
+void database::take_blocked(const redis_key& rk, cache_entry* e, bool left, blocked_pop& result)
+{
+    ++_stat._read;
+    ++_stat._hit;
+    left ? ++_stat._lpop : ++_stat._rpop;
+    auto& list = e->value_list();
+    auto value = left ? list.front() : list.back();
+    result._state = blocked_pop::state::popped;
+    result._key = rk.key();
+    result._value = sstring(reinterpret_cast<const char*>(value.data()), value.size());
+    left ? list.pop_front() : list.pop_back();
+    if (list.empty()) {
+        --_stat._total_list_entries;
+        current_store().erase(rk);
+    }
+    log(rk, left ? "LPOP" : "RPOP");
+}
+
+void database::pop_blocked(const redis_key& rk, bool left, bool take, blocked_pop& result)
+{
+    with_allocator(allocator(), [this, &rk, left, take, &result] () {
+        current_store().with_entry_run(rk, [this, &rk, left, take, &result] (cache_entry* e) {
+            if (!e) {
+                return;
+            }
+            if (e->type_of_list() == false) {
+                result._state = blocked_pop::state::wrong_type;
+                return;
+            }
+            if (!take) {
+                result._state = blocked_pop::state::woken;
+                return;
+            }
+            take_blocked(rk, e, left, result);
+        });
+    });
+}
+
+void database::serve_blocked(const redis_key& rk, cache_entry* e)
+{
+    // one client is served per element, the woken ones pop it themselves.
+    auto available = e->value_list().size();
+    while (available > 0 && _blocked.blocked(current_store_index, rk.key())) {
+        auto& w = _blocked.first(current_store_index, rk.key());
+        blocked_pop result;
+        if (w._hand_off) {
+            take_blocked(rk, e, w._left, result);
+        } else {
+            result._state = blocked_pop::state::woken;
+        }
+        --available;
+        _blocked.finish(w._id, std::move(result));
+    }
+}
+
+future<blocked_pop> database::logged(blocked_pop result)
+{
+    if (result._state != blocked_pop::state::popped || !_aof.must_sync()) {
+        return make_ready_future<blocked_pop>(std::move(result));
+    }
+    return _aof.sync().then([result = std::move(result)] () mutable {
+        return std::move(result);
+    });
+}
+
+future<blocked_pop> database::block_pop(std::vector<sstring>& keys, bool left, bool hand_off, uint64_t id, lowres_clock::time_point deadline)
+{
+    for (auto& key : keys) {
+        blocked_pop result;
+        redis_key rk {std::ref(key)};
+        pop_blocked(rk, left, hand_off, result);
+        if (result._state != blocked_pop::state::empty) {
+            return logged(std::move(result));
+        }
+    }
+    return _blocked.block(id, current_store_index, keys, left, hand_off, deadline).then([this] (blocked_pop result) {
+        return logged(std::move(result));
     });
 }
 
-future<scattered_message_ptr> database::llen(const redis_key& rk)
+future<blocked_pop> database::try_pop(sstring& key, bool left)
+{
+    blocked_pop result;
+    redis_key rk {std::ref(key)};
+    pop_blocked(rk, left, true, result);
+    return logged(std::move(result));
+}
+
+future<reply> database::llen(const redis_key& rk)
 {
     ++_stat._llen;
     return current_store().with_entry_run(rk, [&rk] (const cache_entry* e) {
@@ -541,7 +1363,7 @@ future<scattered_message_ptr> database::llen(const redis_key& rk)
     });
 }
 
-future<scattered_message_ptr> database::lindex(const redis_key& rk, long idx)
+future<reply> database::lindex(const redis_key& rk, long idx)
 {
     ++_stat._read;
     ++_stat._lindex;
@@ -557,13 +1379,13 @@ future<scattered_message_ptr> database::lindex(const redis_key& rk, long idx)
         if (list.index_out_of_range(index)) {
             return reply_builder::build(msg_nil);
         }
-        auto& result = list.at(static_cast<size_t>(index));
+        auto result = list.at(static_cast<size_t>(index));
         ++_stat._hit;
         return reply_builder::build(result);
     });
 }
 
-future<scattered_message_ptr> database::lrange(const redis_key& rk, long start, long end)
+future<reply> database::lrange(const redis_key& rk, long start, long end)
 {
     ++_stat._read;
     ++_stat._lrange;
@@ -579,22 +1401,16 @@ future<scattered_message_ptr> database::lrange(const redis_key& rk, long start,
         end = database::alignment_index_base_on(list.size(), end);
         if (start < 0) start = 0;
         if (end >= static_cast<long>(list.size())) end = static_cast<size_t>(list.size()) - 1;
-        std::vector<const managed_bytes*> data;
-        if (start < end) {
-           for (auto i = start; i < end; ++i) {
-              const auto& b = list.at(static_cast<size_t>(i));
-              data.push_back(&b);
-           }
-        }
-        if (!data.empty()) ++_stat._hit;
-        return reply_builder::build(data);
+        auto count = start <= end ? static_cast<size_t>(end - start + 1) : 0;
+        if (count > 0) ++_stat._hit;
+        return reply_builder::build(current_store(), *this, *e, static_cast<size_t>(start), count);
     });
 }
 
-future<scattered_message_ptr> database::lrem(const redis_key& rk, long count, sstring& val)
+future<reply> database::lrem(const redis_key& rk, long count, sstring& val)
 {
     ++_stat._lrem;
-    return with_allocator(allocator(), [this, &rk, count, &val] {
+    return logged(with_allocator(allocator(), [this, &rk, count, &val] {
         return current_store().with_entry_run(rk, [this, &rk, &val, &count] (cache_entry* e) {
             if (!e) {
                 return reply_builder::build(msg_err);
@@ -606,20 +1422,23 @@ future<scattered_message_ptr> database::lrem(const redis_key& rk, long count, ss
             size_t removed = 0;
             if (count == 0) removed = list.trem<true, true>(val, count);
             else if (count > 0) removed = list.trem<false, true>(val, count);
-            else removed = list.trem<false, false>(val, count);
+            else removed = list.trem<false, false>(val, static_cast<size_t>(-count));
             if (list.empty()) {
                 --_stat._total_list_entries;
                 current_store().erase(rk);
             }
+            if (removed > 0) {
+                log(rk, "LREM", count, val);
+            }
             return reply_builder::build(removed);
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::linsert(const redis_key& rk, sstring& pivot, sstring& val, bool after)
+future<reply> database::linsert(const redis_key& rk, sstring& pivot, sstring& val, bool after)
 {
     ++_stat._linsert;
-    return with_allocator(allocator(), [this, &rk, &pivot, &val, after] {
+    return logged(with_allocator(allocator(), [this, &rk, &pivot, &val, after] {
         return current_store().with_entry_run(rk, [this, &rk, &val, &pivot, after] (cache_entry* e) {
             if (!e) {
                 return reply_builder::build(msg_zero);
@@ -629,26 +1448,26 @@ future<scattered_message_ptr> database::linsert(const redis_key& rk, sstring& pi
             }
             auto& list = e->value_list();
             auto index = list.index_of(pivot);
-            if (list.index_out_of_range(index)) {
+            if (list.index_out_of_range(static_cast<long>(index))) {
                 return reply_builder::build(msg_zero);
             }
             if (after) {
-                if (index == list.size()) list.insert_tail(val);
-                else  list.insert_at(++index, val);
+                if (index + 1 == list.size()) list.insert_tail(val);
+                else list.insert_at(index + 1, val);
             }
             else {
-               if (index == 0) list.insert_head(val);
-               else list.insert_at(--index, val);
+                list.insert_at(index, val);
             }
+            log(rk, "LINSERT", after ? "AFTER" : "BEFORE", pivot, val);
             return reply_builder::build(msg_one);
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::lset(const redis_key& rk, long idx, sstring& val)
+future<reply> database::lset(const redis_key& rk, long idx, sstring& val)
 {
     ++_stat._lset;
-    return with_allocator(allocator(), [this, &rk, idx, &val] {
+    return logged(with_allocator(allocator(), [this, &rk, idx, &val] {
         return current_store().with_entry_run(rk, [this, &rk, idx, &val] (cache_entry* e) {
             if (!e) {
                 return reply_builder::build(msg_nokey_err);
@@ -661,19 +1480,17 @@ future<scattered_message_ptr> database::lset(const redis_key& rk, long idx, sstr
             if (list.index_out_of_range(nidx)) {
                 return reply_builder::build(msg_out_of_range_err);
             }
-            auto& old = list.at(static_cast<size_t>(nidx));
-            current_allocator().destroy<managed_bytes>(&old);
-            auto entry = current_allocator().construct<managed_bytes>(bytes_view{reinterpret_cast<const signed char*>(val.data()), val.size()});
-            list.at(idx) = std::move(*entry);
+            list.set(static_cast<size_t>(nidx), val);
+            log(rk, "LSET", idx, val);
             return reply_builder::build(msg_ok);
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::ltrim(const redis_key& rk, long start, long end)
+future<reply> database::ltrim(const redis_key& rk, long start, long end)
 {
     ++_stat._ltrim;
-    return with_allocator(allocator(), [this, &rk, start, end] {
+    return logged(with_allocator(allocator(), [this, &rk, start, end] {
         return current_store().with_entry_run(rk, [this, &rk, start, end] (cache_entry* e) {
             if (!e) {
                 return reply_builder::build(msg_ok);
@@ -685,28 +1502,32 @@ future<scattered_message_ptr> database::ltrim(const redis_key& rk, long start, l
             auto nstart = database::alignment_index_base_on(list.size(), start);
             if (nstart < 0) nstart = 0;
             auto nend = database::alignment_index_base_on(list.size(), end);
-            if (nstart > nend || nstart > static_cast<long>(list.size()) || nend < 0) {
+            if (nend >= static_cast<long>(list.size())) nend = static_cast<long>(list.size()) - 1;
+            if (nstart > nend || nstart >= static_cast<long>(list.size()) || nend < 0) {
                 list.clear();
             }
-            list.trim(static_cast<size_t>(nstart), static_cast<size_t>(nend));
+            else {
+                list.trim(static_cast<size_t>(nstart), static_cast<size_t>(nend));
+            }
             if (list.empty()) {
                 --_stat._total_list_entries;
                 current_store().erase(rk);
             }
+            log(rk, "LTRIM", start, end);
             return reply_builder::build(msg_ok);
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::hset(const redis_key& rk, sstring& key, sstring& val)
+future<reply> database::hset(const redis_key& rk, sstring& key, sstring& val)
 {
     ++_stat._hset;
-    return with_allocator(allocator(), [this, &rk, &key, &val] {
+    return logged(with_allocator(allocator(), [this, &rk, &key, &val] {
         return current_store().with_entry_run(rk, [this, &rk, &key, &val] (cache_entry* o) {
             auto e = o;
             if (!e) {
                 // the rk was not exists, then create it.
-                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::dict_initializer());
+                auto entry = cache_entry::make(rk.key(), rk.hash(), cache_entry::dict_initializer());
                 current_store().insert(entry);
                 ++_stat._total_dict_entries;
                 e = entry;
@@ -715,23 +1536,22 @@ future<scattered_message_ptr> database::hset(const redis_key& rk, sstring& key,
                 return reply_builder::build(msg_type_err);
             }
             auto& map = e->value_map();
-            bool exists = map.exists(key);
-            auto entry = current_allocator().construct<dict_entry>(key, val);
-            map.insert(entry);
-            return reply_builder::build(exists ? msg_zero : msg_one);
+            bool inserted = map.insert(key, val);
+            log(rk, "HSET", key, val);
+            return reply_builder::build(inserted ? msg_one : msg_zero);
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::hincrby(const redis_key& rk, sstring& key, int64_t delta)
+future<reply> database::hincrby(const redis_key& rk, sstring& key, int64_t delta)
 {
     ++_stat._hincrby;
-    return with_allocator(allocator(), [this, &rk, &key, delta] {
+    return logged(with_allocator(allocator(), [this, &rk, &key, delta] {
         return current_store().with_entry_run(rk, [this, &rk, &key, delta] (cache_entry* o) {
             auto e = o;
             if (!e) {
                 // the rk was not exists, then create it.
-                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::dict_initializer());
+                auto entry = cache_entry::make(rk.key(), rk.hash(), cache_entry::dict_initializer());
                 current_store().insert(entry);
                 ++_stat._total_dict_entries;
                 e = entry;
@@ -740,31 +1560,26 @@ future<scattered_message_ptr> database::hincrby(const redis_key& rk, sstring& ke
                 return reply_builder::build(msg_type_err);
             }
             auto& map = e->value_map();
-            return map.with_entry_run(key, [&map, &key, delta] (dict_entry* d) {
-                if (!d) {
-                    auto entry = current_allocator().construct<dict_entry>(key, delta);
-                    map.insert(entry);
-                    return reply_builder::build<false, true>(entry);
-                }
-                if (!d->type_of_integer()) {
-                    return reply_builder::build(msg_not_integer_err);
-                }
-                d->value_integer_incr(delta);
+            if (!map.incr(key, delta)) {
+                return reply_builder::build(msg_not_integer_err);
+            }
+            log(rk, "HINCRBY", key, delta);
+            return map.with_entry_run(key, [] (const dict_field* d) {
                 return reply_builder::build<false, true>(d);
             });
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::hincrbyfloat(const redis_key& rk, sstring& key, double delta)
+future<reply> database::hincrbyfloat(const redis_key& rk, sstring& key, double delta)
 {
     ++_stat._hincrbyfloat;
-    return with_allocator(allocator(), [this, &rk, &key, delta] {
+    return logged(with_allocator(allocator(), [this, &rk, &key, delta] {
         return current_store().with_entry_run(rk, [this, &rk, &key, delta] (cache_entry* o) {
             auto e = o;
             if (!e) {
                 // the rk was not exists, then create it.
-                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::dict_initializer());
+                auto entry = cache_entry::make(rk.key(), rk.hash(), cache_entry::dict_initializer());
                 current_store().insert(entry);
                 ++_stat._total_dict_entries;
                 e = entry;
@@ -773,31 +1588,26 @@ future<scattered_message_ptr> database::hincrbyfloat(const redis_key& rk, sstrin
                 return reply_builder::build(msg_type_err);
             }
             auto& map = e->value_map();
-            return map.with_entry_run(key, [&map, &key, delta] (dict_entry* d) {
-                if (!d) {
-                    auto entry = current_allocator().construct<dict_entry>(key, delta);
-                    map.insert(entry);
-                    return reply_builder::build<false, true>(entry);
-                }
-                if (!d->type_of_float()) {
-                    return reply_builder::build(msg_not_float_err);
-                }
-                d->value_float_incr(delta);
+            if (!map.incr(key, delta)) {
+                return reply_builder::build(msg_not_float_err);
+            }
+            log(rk, "HINCRBYFLOAT", key, delta);
+            return map.with_entry_run(key, [] (const dict_field* d) {
                 return reply_builder::build<false, true>(d);
             });
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::hmset(const redis_key& rk, std::unordered_map<sstring, sstring>& kvs)
+future<reply> database::hmset(const redis_key& rk, std::unordered_map<sstring, sstring>& kvs)
 {
     ++_stat._hmset;
-    return with_allocator(allocator(), [this, &rk, &kvs] {
+    return logged(with_allocator(allocator(), [this, &rk, &kvs] {
         return current_store().with_entry_run(rk, [this, &rk, &kvs] (cache_entry* o) {
             auto e = o;
             if (!e) {
                 // the rk was not exists, then create it.
-                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::dict_initializer());
+                auto entry = cache_entry::make(rk.key(), rk.hash(), cache_entry::dict_initializer());
                 current_store().insert(entry);
                 ++_stat._total_dict_entries;
                 e = entry;
@@ -806,21 +1616,30 @@ future<scattered_message_ptr> database::hmset(const redis_key& rk, std::unordere
                 return reply_builder::build(msg_type_err);
             }
             auto& map = e->value_map();
-            bool result = false;
             for (auto& kv : kvs) {
-               auto entry = current_allocator().construct<dict_entry>(kv.first, kv.second);
-               result = map.insert(entry);
-               if (!result) break;
+               map.insert(kv.first, kv.second);
             }
-            return reply_builder::build(result ? msg_ok : msg_err);
+            log(rk, "HMSET", kvs);
+            return reply_builder::build(msg_ok);
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::hget(const redis_key& rk, sstring& key)
+future<reply> database::hget(const redis_key& rk, sstring& key)
 {
     ++_stat._read;
     ++_stat._hget;
+    if (auto c = _replicas.find(rk.key(), clock_type::now())) {
+        if (!c->_hash) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto it = c->_fields.find(key);
+        if (it == c->_fields.end()) {
+            return reply_builder::build(msg_nil);
+        }
+        ++_stat._hit;
+        return reply_builder::build(it->second);
+    }
     return current_store().with_entry_run(rk, [this, &key] (cache_entry* e) {
         if (!e) {
             return reply_builder::build(msg_err);
@@ -829,17 +1648,17 @@ future<scattered_message_ptr> database::hget(const redis_key& rk, sstring& key)
             return reply_builder::build(msg_type_err);
         }
         auto& map = e->value_map();
-        return map.with_entry_run(key, [this] (const dict_entry* d) {
+        return map.with_entry_run(key, [this] (const dict_field* d) {
             if (d) ++_stat._hit;
             return reply_builder::build<false, true>(d);
         });
     });
 }
 
-future<scattered_message_ptr> database::hdel_multi(const redis_key& rk, std::vector<sstring>& keys)
+future<reply> database::hdel_multi(const redis_key& rk, std::vector<sstring>& keys)
 {
     ++_stat._hdel;
-    return with_allocator(allocator(), [this, &rk, &keys] {
+    return logged(with_allocator(allocator(), [this, &rk, &keys] {
         return current_store().with_entry_run(rk, [this, &rk, &keys] (cache_entry* e) {
             if (!e) {
                 return reply_builder::build(msg_zero);
@@ -858,16 +1677,19 @@ future<scattered_message_ptr> database::hdel_multi(const redis_key& rk, std::vec
                 --_stat._total_dict_entries;
                 current_store().erase(rk);
             }
+            if (removed > 0) {
+                log(rk, "HDEL", keys);
+            }
             return reply_builder::build(removed);
         });
-    });
+    }));
 }
 
 
-future<scattered_message_ptr> database::hdel(const redis_key& rk, sstring& key)
+future<reply> database::hdel(const redis_key& rk, sstring& key)
 {
     ++_stat._hdel;
-    return with_allocator(allocator(), [this, &rk, &key] {
+    return logged(with_allocator(allocator(), [this, &rk, &key] {
         return current_store().with_entry_run(rk, [this, &rk, &key] (cache_entry* e) {
             if (!e) {
                 return reply_builder::build(msg_zero);
@@ -881,12 +1703,15 @@ future<scattered_message_ptr> database::hdel(const redis_key& rk, sstring& key)
                 --_stat._total_dict_entries;
                 current_store().erase(rk);
             }
+            if (exists) {
+                log(rk, "HDEL", key);
+            }
             return reply_builder::build(exists ? msg_ok : msg_err);
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::hexists(const redis_key& rk, sstring& key)
+future<reply> database::hexists(const redis_key& rk, sstring& key)
 {
     ++_stat._hexists;
     return with_allocator(allocator(), [this, &rk, &key] {
@@ -904,7 +1729,7 @@ future<scattered_message_ptr> database::hexists(const redis_key& rk, sstring& ke
     });
 }
 
-future<scattered_message_ptr> database::hstrlen(const redis_key& rk, sstring& key)
+future<reply> database::hstrlen(const redis_key& rk, sstring& key)
 {
     ++_stat._hstrlen;
     return current_store().with_entry_run(rk, [this, &key] (cache_entry* e) {
@@ -915,7 +1740,7 @@ future<scattered_message_ptr> database::hstrlen(const redis_key& rk, sstring& ke
             return reply_builder::build(msg_type_err);
         }
         auto& map = e->value_map();
-        return map.with_entry_run(key, [] (const dict_entry* d) {
+        return map.with_entry_run(key, [] (const dict_field* d) {
             if (!d) {
                 return reply_builder::build(msg_zero);
             }
@@ -924,7 +1749,7 @@ future<scattered_message_ptr> database::hstrlen(const redis_key& rk, sstring& ke
     });
 }
 
-future<scattered_message_ptr> database::hlen(const redis_key& rk)
+future<reply> database::hlen(const redis_key& rk)
 {
     ++_stat._hlen;
     return current_store().with_entry_run(rk, [this] (cache_entry* e) {
@@ -939,23 +1764,23 @@ future<scattered_message_ptr> database::hlen(const redis_key& rk)
     });
 }
 
-future<scattered_message_ptr> database::hgetall(const redis_key& rk)
+future<reply> database::hgetall(const redis_key& rk)
 {
     return hgetall_impl<true, true>(rk);
 }
 
-future<scattered_message_ptr> database::hgetall_values(const redis_key& rk)
+future<reply> database::hgetall_values(const redis_key& rk)
 {
     return hgetall_impl<false, true>(rk);
 }
 
-future<scattered_message_ptr> database::hgetall_keys(const redis_key& rk)
+future<reply> database::hgetall_keys(const redis_key& rk)
 {
     return hgetall_impl<true, false>(rk);
 }
 
 
-future<scattered_message_ptr> database::hmget(const redis_key& rk, std::vector<sstring>& keys)
+future<reply> database::hmget(const redis_key& rk, std::vector<sstring>& keys)
 {
     ++_stat._read;
     ++_stat._hmget;
@@ -967,19 +1792,19 @@ future<scattered_message_ptr> database::hmget(const redis_key& rk, std::vector<s
             return reply_builder::build(msg_type_err);
         }
         auto& map = e->value_map();
-        std::vector<const dict_entry*> entries;
+        std::vector<dict_field> entries;
         map.fetch(keys, entries);
         if (!entries.empty()) ++_stat._hit;
         return reply_builder::build<false, true>(entries);
     });
 }
 
-future<scattered_message_ptr> database::srandmember(const redis_key& rk, size_t count)
+future<reply> database::srandmember(const redis_key& rk, size_t count)
 {
     ++_stat._read;
     ++_stat._srandmember;
      return current_store().with_entry_run(rk, [this, &count] (const cache_entry* e) {
-        std::vector<const dict_entry*> result;
+        std::vector<dict_field> result;
         if (!e) {
             return reply_builder::build<true, false>(result);
         }
@@ -990,22 +1815,21 @@ future<scattered_message_ptr> database::srandmember(const redis_key& rk, size_t
         count = std::min(count, set.size());
         for (size_t i = 0; i < count; ++i) {
             auto index = rand_generater::rand_less_than(set.size());
-            auto entry = set.at(index);
-            result.push_back(&(*entry));
+            result.push_back(set.at(index));
         }
         if (!result.empty()) ++_stat._hit;
         return reply_builder::build<true, false>(result);
      });
 }
 
-future<scattered_message_ptr> database::sadds(const redis_key& rk, std::vector<sstring>& members)
+future<reply> database::sadds(const redis_key& rk, std::vector<sstring>& members)
 {
     ++_stat._sadd;
-    return with_allocator(allocator(), [this, &rk, &members] {
+    return logged(with_allocator(allocator(), [this, &rk, &members] {
         return current_store().with_entry_run(rk, [this, &rk, &members] (cache_entry* e) {
             auto o = e;
             if (!o) {
-                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::set_initializer());
+                auto entry = cache_entry::make(rk.key(), rk.hash(), cache_entry::set_initializer());
                 current_store().insert(entry);
                 ++_stat._total_set_entries;
                 o = entry;
@@ -1016,13 +1840,16 @@ future<scattered_message_ptr> database::sadds(const redis_key& rk, std::vector<s
             auto& set = o->value_set();
             size_t inserted = 0;
             for (auto& member : members) {
-                if (set.insert(current_allocator().construct<dict_entry>(member))) {
+                if (set.insert(member)) {
                     inserted++;
                 }
             }
+            if (inserted > 0) {
+                log(rk, "SADD", members);
+            }
             return reply_builder::build(inserted);
         });
-    });
+    }));
 }
 
 bool database::sadd_direct(const redis_key& rk, sstring& member)
@@ -1032,7 +1859,7 @@ bool database::sadd_direct(const redis_key& rk, sstring& member)
         return current_store().with_entry_run(rk, [this, &rk, &member] (cache_entry* e) {
             auto o = e;
             if (!o) {
-                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::set_initializer());
+                auto entry = cache_entry::make(rk.key(), rk.hash(), cache_entry::set_initializer());
                 current_store().insert(entry);
                 ++_stat._total_set_entries;
                 o = entry;
@@ -1041,7 +1868,8 @@ bool database::sadd_direct(const redis_key& rk, sstring& member)
                 return false;
             }
             auto& set = o->value_set();
-            set.insert(current_allocator().construct<dict_entry>(member));
+            set.insert(member);
+            log(rk, "SADD", member);
             return true;
         });
     });
@@ -1054,7 +1882,7 @@ bool database::sadds_direct(const redis_key& rk, std::vector<sstring>& members)
         return current_store().with_entry_run(rk, [this, &rk, &members] (cache_entry* e) {
             auto o = e;
             if (!o) {
-                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::set_initializer());
+                auto entry = cache_entry::make(rk.key(), rk.hash(), cache_entry::set_initializer());
                 current_store().insert(entry);
                 ++_stat._total_set_entries;
                 o = entry;
@@ -1065,16 +1893,19 @@ bool database::sadds_direct(const redis_key& rk, std::vector<sstring>& members)
             auto& set = o->value_set();
             size_t inserted = 0;
             for (auto& member : members) {
-                if (set.insert(current_allocator().construct<dict_entry>(member))) {
+                if (set.insert(member)) {
                     inserted++;
                 }
             }
+            if (inserted > 0) {
+                log(rk, "SADD", members);
+            }
             return true;
         });
     });
 }
 
-future<scattered_message_ptr> database::scard(const redis_key& rk)
+future<reply> database::scard(const redis_key& rk)
 {
     ++_stat._scard;
     return current_store().with_entry_run(rk, [] (const cache_entry* e) {
@@ -1089,7 +1920,7 @@ future<scattered_message_ptr> database::scard(const redis_key& rk)
     });
 }
 
-future<scattered_message_ptr> database::sismember(const redis_key& rk, sstring& member)
+future<reply> database::sismember(const redis_key& rk, sstring& member)
 {
     ++_stat._sismember;
     return current_store().with_entry_run(rk, [&member] (const cache_entry* e) {
@@ -1105,7 +1936,7 @@ future<scattered_message_ptr> database::sismember(const redis_key& rk, sstring&
     });
 }
 
-future<scattered_message_ptr> database::smembers(const redis_key& rk)
+future<reply> database::smembers(const redis_key& rk)
 {
     ++_stat._read;
     ++_stat._smembers;
@@ -1117,20 +1948,23 @@ future<scattered_message_ptr> database::smembers(const redis_key& rk)
             return reply_builder::build(msg_type_err);
         }
         auto& set = e->value_set();
-        std::vector<const dict_entry*> entries;
-        set.fetch(entries);
-        if (!entries.empty()) ++_stat._hit;
-        return reply_builder::build<true, false>(entries);
+        if (set.size() > 0) ++_stat._hit;
+        return reply_builder::build<true, false>(current_store(), *this, *e);
     });
 }
 
-future<foreign_ptr<lw_shared_ptr<sstring>>> database::get_hll_direct(const redis_key& rk)
+future<foreign_ptr<lw_shared_ptr<sstring>>> database::get_direct(const redis_key& rk)
 {
+    ++_stat._read;
+    ++_stat._get;
     using return_type = foreign_ptr<lw_shared_ptr<sstring>>;
-    return current_store().with_entry_run(rk, [this] (const cache_entry* e) {
-        if (!e || e->type_of_hll() == false) {
+    return current_store().with_entry_run(rk, [this, &rk] (const cache_entry* e) {
+        if (!e || e->type_of_bytes() == false) {
             return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<sstring>>(nullptr));
         }
+        if (e->value_tiered()) {
+            return promoted(rk, [this] (const redis_key& rk) { return get_direct(rk); });
+        }
         auto data = e->value_bytes_data();
         auto size = e->value_bytes_size();
         ++_stat._hit;
@@ -1138,66 +1972,361 @@ future<foreign_ptr<lw_shared_ptr<sstring>>> database::get_hll_direct(const redis
     });
 }
 
-future<foreign_ptr<lw_shared_ptr<sstring>>> database::get_direct(const redis_key& rk)
+// The keys of a batched lookup, see cache::with_entries_run().
+static std::vector<redis_key> redis_keys_of(std::vector<sstring>& keys)
+{
+    std::vector<redis_key> rks;
+    rks.reserve(keys.size());
+    for (auto& key : keys) {
+        rks.emplace_back(key);
+    }
+    return rks;
+}
+
+future<foreign_ptr<lw_shared_ptr<reply_fragments>>> database::mget_direct(std::vector<sstring>& keys)
+{
+    using return_type = foreign_ptr<lw_shared_ptr<reply_fragments>>;
+    // the entries are looked up first to size the fragments, nothing can
+    // release them before the fragments are written.
+    std::vector<const cache_entry*> entries;
+    entries.reserve(keys.size());
+    size_t size = 0;
+    std::vector<sstring> tiered;
+    current_store().with_entries_run(redis_keys_of(keys), [this, &keys, &entries, &size, &tiered] (size_t i, const cache_entry* e) {
+        ++_stat._read;
+        ++_stat._get;
+        if (e && !e->type_of_bytes()) {
+            e = nullptr;
+        }
+        if (e && e->value_tiered()) {
+            tiered.push_back(keys[i]);
+        }
+        else if (e) {
+            ++_stat._hit;
+            auto n = e->value_bytes_size();
+            size += msg_batch_tag.size() + to_sstring(n).size() + msg_crlf.size() + n + msg_crlf.size();
+        }
+        else {
+            size += msg_null_blik.size();
+        }
+        entries.push_back(e);
+    });
+    if (!tiered.empty()) {
+        return promote(std::move(tiered)).then([this, index = current_store_index, &keys] {
+            return with_store(index, [this, &keys] { return mget_direct(keys); });
+        });
+    }
+    auto fragments = make_lw_shared<reply_fragments>();
+    fragments->_data = sstring(sstring::initialized_later(), size);
+    fragments->_ends.reserve(entries.size());
+    auto begin = fragments->_data.begin();
+    auto p = begin;
+    auto append = [&p] (const char* data, size_t size) {
+        p = std::copy_n(data, size, p);
+    };
+    for (auto e : entries) {
+        if (e) {
+            auto n = to_sstring(e->value_bytes_size());
+            append(msg_batch_tag.data(), msg_batch_tag.size());
+            append(n.data(), n.size());
+            append(msg_crlf.data(), msg_crlf.size());
+            append(e->value_bytes_data(), e->value_bytes_size());
+            append(msg_crlf.data(), msg_crlf.size());
+        }
+        else {
+            append(msg_null_blik.data(), msg_null_blik.size());
+        }
+        fragments->_ends.push_back(p - begin);
+    }
+    return make_ready_future<return_type>(return_type(std::move(fragments)));
+}
+
+bool database::mset_direct(std::vector<std::pair<sstring, sstring>>& pairs)
+{
+    bool result = true;
+    for (auto& pair : pairs) {
+        redis_key rk {std::ref(pair.first)};
+        result &= set_direct(rk, pair.second, 0, FLAG_SET_NO);
+    }
+    return result;
+}
+
+size_t database::mdel_direct(std::vector<sstring>& keys)
+{
+    size_t removed = 0;
+    for (auto& key : keys) {
+        redis_key rk {std::ref(key)};
+        if (del_direct(rk)) {
+            ++removed;
+        }
+    }
+    return removed;
+}
+
+size_t database::munlink_direct(std::vector<sstring>& keys)
+{
+    size_t removed = 0;
+    for (auto& key : keys) {
+        redis_key rk {std::ref(key)};
+        if (unlink_direct(rk)) {
+            ++removed;
+        }
+    }
+    return removed;
+}
+
+size_t database::mexists_direct(std::vector<sstring>& keys)
+{
+    size_t found = 0;
+    current_store().with_entries_run(redis_keys_of(keys), [this, &found] (size_t, const cache_entry* e) {
+        ++_stat._exists;
+        if (e) {
+            ++found;
+        }
+    });
+    return found;
+}
+
+future<foreign_ptr<lw_shared_ptr<sstring>>> database::mget_hll_direct(std::vector<sstring>& keys)
 {
-    ++_stat._read;
-    ++_stat._get;
     using return_type = foreign_ptr<lw_shared_ptr<sstring>>;
-    return current_store().with_entry_run(rk, [this] (const cache_entry* e) {
-        if (!e || e->type_of_bytes() == false) {
-            return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<sstring>>(nullptr));
+    lw_shared_ptr<sstring> merged;
+    // a single HyperLogLog is sent as it is, several are merged and compacted.
+    std::vector<uint8_t> raw;
+    current_store().with_entries_run(redis_keys_of(keys), [this, &merged, &raw] (size_t, const cache_entry* e) {
+        if (!e || e->type_of_hll() == false) {
+            return;
+        }
+        if (!merged) {
+            merged = make_lw_shared<sstring>(e->value_bytes_data(), e->value_bytes_size());
+        }
+        else {
+            if (raw.empty()) {
+                raw.resize(hll::RAW_SIZE, 0);
+                hll::merge(raw.data(), merged->data(), merged->size());
+            }
+            hll::merge(raw.data(), e->value_bytes());
         }
-        auto data = e->value_bytes_data();
-        auto size = e->value_bytes_size();
         ++_stat._hit;
-        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<sstring>>(make_lw_shared<sstring>(sstring {data, size})));
     });
+    if (!raw.empty()) {
+        *merged = hll::compact(raw.data());
+    }
+    return make_ready_future<return_type>(return_type(std::move(merged)));
 }
 
-future<foreign_ptr<lw_shared_ptr<std::vector<sstring>>>> database::smembers_direct(const redis_key& rk)
+future<foreign_ptr<lw_shared_ptr<set_members>>> database::smembers_direct(const redis_key& rk)
 {
     ++_stat._read;
     ++_stat._smembers;
-    using result_type = std::vector<sstring>;
+    using result_type = set_members;
     using return_type = foreign_ptr<lw_shared_ptr<result_type>>;
     return current_store().with_entry_run(rk, [this] (const cache_entry* e) {
         if (!e || e->type_of_set() == false) {
             return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<result_type>>(make_lw_shared<result_type>(result_type {})));
         }
         auto& set = e->value_set();
-        result_type keys;
-        set.fetch_keys(keys);
-        if (!keys.empty()) ++_stat._hit;
-        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<result_type>>(make_lw_shared<result_type>(std::move(keys))));
+        result_type members;
+        if (set.integers()) {
+            set.fetch_integers(members._values);
+        }
+        else {
+            members._integers = false;
+            set.fetch_keys(members._keys);
+        }
+        if (!set.empty()) ++_stat._hit;
+        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<result_type>>(make_lw_shared<result_type>(std::move(members))));
+    });
+}
+
+size_t database::scard_direct(const redis_key& rk)
+{
+    ++_stat._scard;
+    return current_store().with_entry_run(rk, [] (const cache_entry* e) {
+        if (!e || e->type_of_set() == false) {
+            return size_t(0);
+        }
+        return e->value_set().size();
     });
 }
 
-future<scattered_message_ptr> database::spop(const redis_key& rk, size_t count)
+future<foreign_ptr<lw_shared_ptr<set_members>>> database::sfilter_direct(const redis_key& rk, const set_members& candidates, bool members)
 {
     ++_stat._read;
-    ++_stat._spop;
-    return with_allocator(allocator(), [this, &rk, &count] {
-        return current_store().with_entry_run(rk, [this, &rk, &count] (cache_entry* e) {
-            if (!e) {
-                return reply_builder::build(msg_nil);
+    using result_type = set_members;
+    using return_type = foreign_ptr<lw_shared_ptr<result_type>>;
+    return current_store().with_entry_run(rk, [this, &candidates, members] (const cache_entry* e) {
+        result_type result;
+        result._integers = candidates._integers;
+        if (!e || e->type_of_set() == false) {
+            if (!members) {
+                result = candidates;
             }
-            if (e->type_of_set() == false) {
-                return reply_builder::build(msg_type_err);
+            return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<result_type>>(make_lw_shared<result_type>(std::move(result))));
+        }
+        auto& set = e->value_set();
+        for (auto v : candidates._values) {
+            if (set.exists(v) == members) {
+                result._values.push_back(v);
             }
-            auto& set = e->value_set();
-            std::vector<dict_lsa::const_iterator> removed;
-            std::vector<const dict_entry*> entries;
+        }
+        for (auto& key : candidates._keys) {
+            if (set.exists(key) == members) {
+                result._keys.push_back(key);
+            }
+        }
+        ++_stat._hit;
+        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<result_type>>(make_lw_shared<result_type>(std::move(result))));
+    });
+}
+
+size_t database::sstore_direct(const redis_key& rk, std::vector<sstring>& members)
+{
+    ++_stat._sadd;
+    return with_allocator(allocator(), [this, &rk, &members] {
+        current_store().with_entry_run(rk, [this, &rk] (cache_entry* e) {
+            if (e) {
+                count_released_entry(e->type());
+                current_store().erase(*e);
+                log(rk, "DEL");
+            }
+        });
+        if (members.empty()) {
+            return size_t(0);
+        }
+        auto entry = cache_entry::make(rk.key(), rk.hash(), cache_entry::set_initializer());
+        current_store().insert(entry);
+        ++_stat._total_set_entries;
+        auto& set = entry->value_set();
+        for (auto& member : members) {
+            set.insert(member);
+        }
+        log(rk, "SADD", members);
+        return set.size();
+    });
+}
+
+future<reply> database::soperate(std::vector<sstring>& keys, sstring* dest, int op)
+{
+    ++_stat._read;
+    std::vector<sstring> result;
+    {
+        // the sets are read in place, they must not move meanwhile.
+        logalloc::reclaim_lock lock(*this);
+        std::vector<const dict_lsa*> sets;
+        sets.reserve(keys.size());
+        for (auto& key : keys) {
+            redis_key rk {std::ref(key)};
+            sets.push_back(current_store().with_entry_run(rk, [] (const cache_entry* e) -> const dict_lsa* {
+                return e != nullptr && e->type_of_set() ? &e->value_set() : nullptr;
+            }));
+        }
+        auto contains = [] (const dict_lsa* set, const sstring& member) {
+            return set != nullptr && set->exists(member);
+        };
+        if (op == SOPERATE_UNION) {
+            // a member is taken from the first set holding it.
+            for (size_t i = 0; i < sets.size(); ++i) {
+                if (sets[i] == nullptr) {
+                    continue;
+                }
+                sets[i]->for_each([&sets, &result, &contains, i] (const dict_field& f) {
+                    sstring member(f.key_data(), f.key_size());
+                    for (size_t j = 0; j < i; ++j) {
+                        if (contains(sets[j], member)) {
+                            return;
+                        }
+                    }
+                    result.emplace_back(std::move(member));
+                });
+            }
+        }
+        else {
+            size_t first = 0;
+            if (op == SOPERATE_INTER) {
+                for (size_t i = 0; i < sets.size(); ++i) {
+                    if (sets[i] == nullptr) {
+                        first = sets.size();
+                        break;
+                    }
+                    if (sets[i]->size() < sets[first]->size()) {
+                        first = i;
+                    }
+                }
+            }
+            if (first < sets.size() && sets[first] != nullptr) {
+                auto intersect = op == SOPERATE_INTER;
+                sets[first]->for_each([&sets, &result, &contains, first, intersect] (const dict_field& f) {
+                    sstring member(f.key_data(), f.key_size());
+                    for (size_t j = 0; j < sets.size(); ++j) {
+                        if (j != first && contains(sets[j], member) != intersect) {
+                            return;
+                        }
+                    }
+                    result.emplace_back(std::move(member));
+                });
+            }
+        }
+    }
+    if (dest == nullptr) {
+        return reply_builder::build(result);
+    }
+    redis_key rk {std::ref(*dest)};
+    return logged(reply_builder::build(sstore_direct(rk, result)));
+}
+
+future<reply> database::smove(const redis_key& src, const redis_key& dst, sstring& member)
+{
+    ++_stat._smove;
+    return logged(with_allocator(allocator(), [this, &src, &dst, &member] {
+        auto wrong_type = [] (const cache_entry* e) {
+            return e != nullptr && e->type_of_set() == false;
+        };
+        if (current_store().with_entry_run(src, wrong_type) || current_store().with_entry_run(dst, wrong_type)) {
+            return reply_builder::build(msg_type_err);
+        }
+        auto found = current_store().with_entry_run(src, [&member] (const cache_entry* e) {
+            return e != nullptr && e->value_set().exists(member);
+        });
+        if (!found) {
+            return reply_builder::build(msg_zero);
+        }
+        srem_direct(src, member);
+        sadd_direct(dst, member);
+        return reply_builder::build(msg_one);
+    }));
+}
+
+future<reply> database::spop(const redis_key& rk, size_t count)
+{
+    ++_stat._read;
+    ++_stat._spop;
+    return logged(with_allocator(allocator(), [this, &rk, &count] {
+        return current_store().with_entry_run(rk, [this, &rk, &count] (cache_entry* e) {
+            if (!e) {
+                return reply_builder::build(msg_nil);
+            }
+            if (e->type_of_set() == false) {
+                return reply_builder::build(msg_type_err);
+            }
+            auto& set = e->value_set();
+            std::vector<dict_field> entries;
             count = std::min(count, set.size());
             for (size_t i = 0; i < count; ++i) {
                 auto index = rand_generater::rand_less_than(set.size());
-                auto entry = set.at(index);
-                entries.push_back(&(*entry));
-                removed.push_back(entry);
+                entries.push_back(set.at(index));
             }
             auto reply = reply_builder::build<true, false>(entries);
-            if (!removed.empty()) {
-                for (auto it : removed) {
-                    set.erase(it);
+            if (!entries.empty()) {
+                // the fields point into the set, the members are copied
+                // before the set changes.
+                std::vector<sstring> members;
+                for (auto& m : entries) {
+                    members.emplace_back(m.key_data(), m.key_size());
+                }
+                log(rk, "SREM", members);
+                for (auto& member : members) {
+                    set.erase(member);
                 }
                 if (set.empty()) {
                     --_stat._total_set_entries;
@@ -1206,13 +2335,13 @@ future<scattered_message_ptr> database::spop(const redis_key& rk, size_t count)
             }
             return reply;
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::srem(const redis_key& rk, sstring& member)
+future<reply> database::srem(const redis_key& rk, sstring& member)
 {
     ++_stat._srem;
-    return with_allocator(allocator(), [this, &rk, &member] {
+    return logged(with_allocator(allocator(), [this, &rk, &member] {
         return current_store().with_entry_run(rk, [this, &rk, &member] (cache_entry* e) {
             if (!e) {
                 return reply_builder::build(msg_zero);
@@ -1226,9 +2355,12 @@ future<scattered_message_ptr> database::srem(const redis_key& rk, sstring& membe
                 --_stat._total_set_entries;
                 current_store().erase(rk);
             }
+            if (result) {
+                log(rk, "SREM", member);
+            }
             return reply_builder::build(result ? msg_one : msg_zero);
         });
-    });
+    }));
 }
 bool database::srem_direct(const redis_key& rk, sstring& member)
 {
@@ -1247,15 +2379,18 @@ bool database::srem_direct(const redis_key& rk, sstring& member)
                 --_stat._total_set_entries;
                 current_store().erase(rk);
             }
+            if (result) {
+                log(rk, "SREM", member);
+            }
             return result;
         });
     });
 }
 
-future<scattered_message_ptr> database::srems(const redis_key& rk, std::vector<sstring>& members)
+future<reply> database::srems(const redis_key& rk, std::vector<sstring>& members)
 {
     ++_stat._srem;
-    return with_allocator(allocator(), [this, &rk, &members] {
+    return logged(with_allocator(allocator(), [this, &rk, &members] {
         return current_store().with_entry_run(rk, [this, &rk, &members] (cache_entry* e) {
             if (!e) {
                 return reply_builder::build(msg_zero);
@@ -1274,12 +2409,15 @@ future<scattered_message_ptr> database::srems(const redis_key& rk, std::vector<s
                 --_stat._total_set_entries;
                 current_store().erase(rk);
             }
+            if (removed > 0) {
+                log(rk, "SREM", members);
+            }
             return reply_builder::build(removed);
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::pttl(const redis_key& rk)
+future<reply> database::pttl(const redis_key& rk)
 {
     ++_stat._pttl;
     return current_store().with_entry_run(rk, [this, &rk] (const cache_entry* e) {
@@ -1293,7 +2431,7 @@ future<scattered_message_ptr> database::pttl(const redis_key& rk)
     });
 }
 
-future<scattered_message_ptr> database::ttl(const redis_key& rk)
+future<reply> database::ttl(const redis_key& rk)
 {
     ++_stat._ttl;
     return current_store().with_entry_run(rk, [this, &rk] (const cache_entry* e) {
@@ -1307,14 +2445,14 @@ future<scattered_message_ptr> database::ttl(const redis_key& rk)
     });
 }
 
-future<scattered_message_ptr> database::zadds(const redis_key& rk, std::unordered_map<sstring, double>& members, int flags)
+future<reply> database::zadds(const redis_key& rk, std::unordered_map<sstring, double>& members, int flags)
 {
     ++_stat._zadd;
-    return with_allocator(allocator(), [this, &rk, &members, flags] {
+    return logged(with_allocator(allocator(), [this, &rk, &members, flags] {
         return current_store().with_entry_run(rk, [this, &rk, &members, flags] (cache_entry* e) {
             auto o = e;
             if (o == nullptr) {
-                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::sset_initializer());
+                auto entry = cache_entry::make(rk.key(), rk.hash(), cache_entry::sset_initializer());
                 current_store().insert(entry);
                 ++_stat._total_zset_entries;
                 o = entry;
@@ -1336,9 +2474,10 @@ future<scattered_message_ptr> database::zadds(const redis_key& rk, std::unordere
             else {
                 assert(false);
             }
+            log_zadd(rk, members, flags);
             return reply_builder::build(inserted);
         });
-    });
+    }));
 }
 
 bool database::zadds_direct(const redis_key& rk, std::unordered_map<sstring, double>& members, int flags)
@@ -1348,7 +2487,7 @@ bool database::zadds_direct(const redis_key& rk, std::unordered_map<sstring, dou
         return current_store().with_entry_run(rk, [this, &rk, &members, flags] (cache_entry* e) {
             auto o = e;
             if (o == nullptr) {
-                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::sset_initializer());
+                auto entry = cache_entry::make(rk.key(), rk.hash(), cache_entry::sset_initializer());
                 current_store().insert(entry);
                 ++_stat._total_zset_entries;
                 o = entry;
@@ -1370,13 +2509,171 @@ bool database::zadds_direct(const redis_key& rk, std::unordered_map<sstring, dou
             else {
                 assert(false);
             }
+            log_zadd(rk, members, flags);
             return inserted > 0;
         });
     });
 }
 
 
-future<scattered_message_ptr> database::zcard(const redis_key& rk)
+size_t database::zcard_direct(const redis_key& rk)
+{
+    ++_stat._zcard;
+    return current_store().with_entry_run(rk, [] (const cache_entry* e) {
+        if (e == nullptr || e->type_of_sset() == false) {
+            return size_t(0);
+        }
+        return e->value_sset().size();
+    });
+}
+
+future<foreign_ptr<lw_shared_ptr<zset_partials>>> database::zaggregate_direct(const std::vector<std::pair<sstring, double>>& sources, int aggregate_flag, bool from_start, const sstring& after, size_t limit)
+{
+    ++_stat._read;
+    std::unordered_map<sstring, std::pair<double, size_t>> aggregated;
+    auto partial = make_lw_shared<zset_partials>();
+    partial->_truncated = zaggregate(sources, aggregate_flag, from_start, after, limit, aggregated, partial->_last);
+    partial->_members.reserve(aggregated.size());
+    for (auto& entry : aggregated) {
+        partial->_members.emplace_back(zset_partial {std::move(entry.first), entry.second.first, entry.second.second});
+    }
+    return make_ready_future<foreign_ptr<lw_shared_ptr<zset_partials>>>(foreign_ptr<lw_shared_ptr<zset_partials>>(std::move(partial)));
+}
+
+bool database::zaggregate(const std::vector<std::pair<sstring, double>>& sources, int aggregate_flag, bool from_start, const sstring& after, size_t limit,
+                          std::unordered_map<sstring, std::pair<double, size_t>>& aggregated, sstring& last)
+{
+    bool truncated = false;
+    for (const auto& source : sources) {
+        sstring key = source.first;
+        redis_key rk {std::ref(key)};
+        auto weight = source.second;
+        current_store().with_entry_run(rk, [&aggregated, &truncated, &last, aggregate_flag, from_start, &after, limit, weight] (const cache_entry* e) {
+            if (e == nullptr || e->type_of_sset() == false) {
+                return;
+            }
+            const sset_entry* read = nullptr;
+            auto more = e->value_sset().for_each_after(from_start, after, limit, [&aggregated, aggregate_flag, weight, &read] (const sset_entry& m) {
+                auto score = m.score() * weight;
+                auto r = aggregated.emplace(sstring(m.key_data(), m.key_size()), std::make_pair(score, size_t(1)));
+                if (!r.second) {
+                    auto& entry = r.first->second;
+                    entry.first = score_aggregation(entry.first, score, aggregate_flag);
+                    ++entry.second;
+                }
+                read = &m;
+            });
+            if (more && read != nullptr) {
+                sstring m(read->key_data(), read->key_size());
+                if (!truncated || sset_lsa::member_less(m, last)) {
+                    last = std::move(m);
+                    truncated = true;
+                }
+            }
+        });
+    }
+    if (truncated) {
+        // the sets with members after @last did not read them yet.
+        for (auto it = aggregated.begin(); it != aggregated.end();) {
+            if (sset_lsa::member_less(last, it->first)) {
+                it = aggregated.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    return truncated;
+}
+
+future<reply> database::zstore(const redis_key& rk, const std::vector<std::pair<sstring, double>>& sources, int aggregate_flag, bool intersect)
+{
+    ++_stat._read;
+    std::unordered_map<sstring, std::pair<double, size_t>> aggregated;
+    sstring after, last;
+    zaggregate(sources, aggregate_flag, true, after, std::numeric_limits<size_t>::max(), aggregated, last);
+    std::unordered_map<sstring, double> result;
+    for (auto& entry : aggregated) {
+        if (!intersect || entry.second.second == sources.size()) {
+            result.emplace(std::move(entry.first), entry.second.first);
+        }
+    }
+    ++_stat._zadd;
+    return logged(reply_builder::build(with_allocator(allocator(), [this, &rk, &result] {
+        cache_entry* e = nullptr;
+        if (!result.empty()) {
+            e = cache_entry::make(rk.key(), rk.hash(), cache_entry::sset_initializer());
+            e->value_sset().insert_or_update(result);
+        }
+        return replace_sset(rk, e);
+    })));
+}
+
+uint64_t database::zstage_direct(const redis_key& rk, uint64_t id, std::unordered_map<sstring, double>& members)
+{
+    ++_stat._zadd;
+    return with_allocator(allocator(), [this, &rk, id, &members] {
+        auto e = id != 0 ? current_store().staged(id) : nullptr;
+        if (e == nullptr) {
+            // a new sorted set, or the cache was flushed meanwhile.
+            id = ++_last_staged_id;
+            e = cache_entry::make(rk.key(), rk.hash(), cache_entry::sset_initializer());
+            current_store().stage(id, e);
+        }
+        e->value_sset().insert_or_update(members);
+        return id;
+    });
+}
+
+size_t database::zcommit_direct(const redis_key& rk, uint64_t id)
+{
+    return with_allocator(allocator(), [this, &rk, id] {
+        return replace_sset(rk, current_store().unstage(id));
+    });
+}
+
+void database::zdiscard_direct(uint64_t id)
+{
+    with_allocator(allocator(), [this, id] {
+        auto e = current_store().unstage(id);
+        if (e != nullptr) {
+            current_allocator().destroy(e);
+        }
+    });
+}
+
+// The number of members of a sorted set logged by every ZADD replacing it.
+static constexpr size_t zstore_log_members = 1024;
+
+size_t database::replace_sset(const redis_key& rk, cache_entry* e)
+{
+    current_store().with_entry_run(rk, [this, &rk] (cache_entry* o) {
+        if (o) {
+            count_released_entry(o->type());
+            current_store().erase(*o);
+            log(rk, "DEL");
+        }
+    });
+    if (e == nullptr) {
+        return 0;
+    }
+    current_store().insert(e);
+    ++_stat._total_zset_entries;
+    auto& sset = e->value_sset();
+    std::unordered_map<sstring, double> members;
+    sstring after;
+    bool more = true;
+    for (bool from_start = true; more; from_start = false) {
+        more = sset.for_each_after(from_start, after, zstore_log_members, [&members, &after] (const sset_entry& m) {
+            after = sstring(m.key_data(), m.key_size());
+            members.emplace(after, m.score());
+        });
+        log(rk, "ZADD", members);
+        members.clear();
+    }
+    return sset.size();
+}
+
+future<reply> database::zcard(const redis_key& rk)
 {
     ++_stat._zcard;
     return current_store().with_entry_run(rk, [] (const cache_entry* e) {
@@ -1392,10 +2689,10 @@ future<scattered_message_ptr> database::zcard(const redis_key& rk)
     });
 }
 
-future<scattered_message_ptr> database::zrem(const redis_key& rk, std::vector<sstring>& members)
+future<reply> database::zrem(const redis_key& rk, std::vector<sstring>& members)
 {
     ++_stat._zrem;
-    return with_allocator(allocator(), [this, &rk, &members] {
+    return logged(with_allocator(allocator(), [this, &rk, &members] {
         return current_store().with_entry_run(rk, [this, &rk, &members] (cache_entry* e) {
             if (e == nullptr) {
                 return reply_builder::build(msg_zero);
@@ -1409,12 +2706,15 @@ future<scattered_message_ptr> database::zrem(const redis_key& rk, std::vector<ss
                --_stat._total_zset_entries;
                current_store().erase(rk);
             }
+            if (removed > 0) {
+                log(rk, "ZREM", members);
+            }
             return reply_builder::build(removed);
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::zcount(const redis_key& rk, double min, double max)
+future<reply> database::zcount(const redis_key& rk, double min, double max)
 {
     ++_stat._zcount;
     return current_store().with_entry_run(rk, [min, max] (const cache_entry* e) {
@@ -1430,14 +2730,14 @@ future<scattered_message_ptr> database::zcount(const redis_key& rk, double min,
     });
 }
 
-future<scattered_message_ptr> database::zincrby(const redis_key& rk, sstring& member, double delta)
+future<reply> database::zincrby(const redis_key& rk, sstring& member, double delta)
 {
     ++_stat._zincrby;
-    return with_allocator(allocator(), [this, &rk, &member, delta] {
+    return logged(with_allocator(allocator(), [this, &rk, &member, delta] {
         return current_store().with_entry_run(rk, [this, &rk, &member, delta] (cache_entry* e) {
             auto o = e;
             if (o == nullptr) {
-                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::sset_initializer());
+                auto entry = cache_entry::make(rk.key(), rk.hash(), cache_entry::sset_initializer());
                 current_store().insert(entry);
                 ++_stat._total_zset_entries;
                 o = entry;
@@ -1447,9 +2747,10 @@ future<scattered_message_ptr> database::zincrby(const redis_key& rk, sstring& me
             }
             auto& sset = o->value_sset();
             auto result = sset.insert_or_update(member, delta);
+            log(rk, "ZINCRBY", delta, member);
             return reply_builder::build(result);
         });
-    });
+    }));
 }
 
 future<foreign_ptr<lw_shared_ptr<std::vector<std::pair<sstring, double>>>>> database::zrange_direct(const redis_key& rk, long begin, long end)
@@ -1470,7 +2771,7 @@ future<foreign_ptr<lw_shared_ptr<std::vector<std::pair<sstring, double>>>>> data
     });
 }
 
-future<scattered_message_ptr> database::zrange(const redis_key& rk, long begin, long end, bool reverse, bool with_score)
+future<reply> database::zrange(const redis_key& rk, long begin, long end, bool reverse, bool with_score)
 {
     ++_stat._read;
     ++_stat._zrange;
@@ -1482,17 +2783,13 @@ future<scattered_message_ptr> database::zrange(const redis_key& rk, long begin,
         if (e->type_of_sset() == false) {
             return reply_builder::build(msg_type_err);
         }
-        auto& sset = e->value_sset();
-        sset.fetch_by_rank(begin, end, entries);
-        if (reverse) {
-           std::reverse(std::begin(entries), std::end(entries));
-        }
-        if (!entries.empty()) ++_stat._hit;
-        return reply_builder::build(entries, with_score);
+        auto first = begin, last = end;
+        if (e->value_sset().normalize_rank(first, last)) ++_stat._hit;
+        return reply_builder::build(current_store(), *this, *e, begin, end, reverse, with_score);
     });
 }
 
-future<scattered_message_ptr> database::zrangebyscore(const redis_key& rk, double min, double max, bool reverse, bool with_score)
+future<reply> database::zrangebyscore(const redis_key& rk, double min, double max, bool reverse, bool with_score)
 {
     ++_stat._read;
     ++_stat._zrangebyscore;
@@ -1505,16 +2802,13 @@ future<scattered_message_ptr> database::zrangebyscore(const redis_key& rk, doubl
             return reply_builder::build(msg_type_err);
         }
         auto& sset = e->value_sset();
-        sset.fetch_by_score(min, max, entries);
-        if (reverse) {
-           std::reverse(std::begin(entries), std::end(entries));
-        }
+        sset.fetch_by_score(min, max, entries, 0, reverse);
         if (!entries.empty()) ++_stat._hit;
         return reply_builder::build(entries, with_score);
     });
 }
 
-future<scattered_message_ptr> database::zrank(const redis_key& rk, sstring& member, bool reverse)
+future<reply> database::zrank(const redis_key& rk, sstring& member, bool reverse)
 {
     ++_stat._read;
     ++_stat._zrank;
@@ -1530,7 +2824,7 @@ future<scattered_message_ptr> database::zrank(const redis_key& rk, sstring& memb
         if (rank_opt) {
            auto rank = *rank_opt;
            if (reverse) {
-               rank = sset.size() - rank;
+               rank = sset.size() - 1 - rank;
            }
            ++_stat._hit;
            return reply_builder::build(rank);
@@ -1539,7 +2833,7 @@ future<scattered_message_ptr> database::zrank(const redis_key& rk, sstring& memb
     });
 }
 
-future<scattered_message_ptr> database::zscore(const redis_key& rk, sstring& member)
+future<reply> database::zscore(const redis_key& rk, sstring& member)
 {
     ++_stat._read;
     ++_stat._zscore;
@@ -1560,10 +2854,10 @@ future<scattered_message_ptr> database::zscore(const redis_key& rk, sstring& mem
     });
 }
 
-future<scattered_message_ptr> database::zremrangebyscore(const redis_key& rk, double min, double max)
+future<reply> database::zremrangebyscore(const redis_key& rk, double min, double max)
 {
     ++_stat._zremrangebyscore;
-    return with_allocator(allocator(), [this, &rk, min, max] {
+    return logged(with_allocator(allocator(), [this, &rk, min, max] {
         return current_store().with_entry_run(rk, [this, &rk, min, max] (cache_entry* e) {
             if (e == nullptr) {
                 return reply_builder::build(msg_zero);
@@ -1574,6 +2868,13 @@ future<scattered_message_ptr> database::zremrangebyscore(const redis_key& rk, do
             std::vector<const sset_entry*> entries;
             auto& sset = e->value_sset();
             sset.fetch_by_score(min, max, entries);
+            if (logging() && !entries.empty()) {
+                std::vector<sstring> members;
+                for (auto m : entries) {
+                    members.emplace_back(m->key_data(), m->key_size());
+                }
+                log(rk, "ZREM", members);
+            }
             auto removed = sset.erase(entries);
             if (sset.empty()) {
                 --_stat._total_zset_entries;
@@ -1581,13 +2882,13 @@ future<scattered_message_ptr> database::zremrangebyscore(const redis_key& rk, do
             }
             return reply_builder::build(removed);
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::zremrangebyrank(const redis_key& rk, size_t begin, size_t end)
+future<reply> database::zremrangebyrank(const redis_key& rk, size_t begin, size_t end)
 {
     ++_stat._zremrangebyrank;
-    return with_allocator(allocator(), [this, &rk, begin, end] {
+    return logged(with_allocator(allocator(), [this, &rk, begin, end] {
         return current_store().with_entry_run(rk, [this, &rk, begin, end] (cache_entry* e) {
             if (e == nullptr) {
                 return reply_builder::build(msg_zero);
@@ -1598,6 +2899,13 @@ future<scattered_message_ptr> database::zremrangebyrank(const redis_key& rk, siz
             std::vector<const sset_entry*> entries;
             auto& sset = e->value_sset();
             sset.fetch_by_rank(begin, end, entries);
+            if (logging() && !entries.empty()) {
+                std::vector<sstring> members;
+                for (auto m : entries) {
+                    members.emplace_back(m->key_data(), m->key_size());
+                }
+                log(rk, "ZREM", members);
+            }
             auto removed = sset.erase(entries);
             if (sset.empty()) {
                 --_stat._total_zset_entries;
@@ -1605,38 +2913,76 @@ future<scattered_message_ptr> database::zremrangebyrank(const redis_key& rk, siz
             }
             return reply_builder::build(removed);
         });
-    });
+    }));
 }
 
 bool database::select(size_t index)
 {
     ++_stat._select;
-    if (index > DEFAULT_DB_COUNT) {
+    return index < _cache_stores.size();
+}
+
+void database::drop_store(size_t index)
+{
+    auto& store = _cache_stores[index];
+    if (store->empty()) {
+        return;
+    }
+    auto fresh = make_store();
+    _flushed_stores.emplace_back(std::move(store));
+    store = std::move(fresh);
+    if (!_flush_timer.armed()) {
+        _flush_timer.arm_periodic(std::chrono::milliseconds(1));
+    }
+}
+
+bool database::flushdb()
+{
+    // the snapshots, the rewrites and the full syncs walk the tables in place.
+    if (_snapshot_gate.get_count() > 0) {
         return false;
     }
-    current_store_index = index;
+    drop_store(current_store_index);
+    // the copies are the ones of the database 0.
+    if (current_store_index == 0) {
+        _replicas.changed_all();
+    }
+    log_db("FLUSHDB");
     return true;
 }
 
-
-future<scattered_message_ptr> database::geodist(const redis_key& rk, sstring& lpos, sstring& rpos, int flag)
+bool database::flushall()
 {
-    ++_stat._read;
-    ++_stat._geodist;
-    double factor = 1;
-    if (flag & GEODIST_UNIT_M) {
-        factor = 1;
+    if (_snapshot_gate.get_count() > 0) {
+        return false;
     }
-    else if (flag & GEODIST_UNIT_KM) {
-        factor = 1000;
+    for (size_t i = 0; i < _cache_stores.size(); ++i) {
+        drop_store(i);
     }
-    else if (flag & GEODIST_UNIT_MI) {
-        factor = 0.3048;
+    _replicas.changed_all();
+    log_db("FLUSHALL");
+    return true;
+}
+
+bool database::swapdb(size_t index1, size_t index2)
+{
+    if (_snapshot_gate.get_count() > 0) {
+        return false;
     }
-    else if (flag & GEODIST_UNIT_FT) {
-        factor = 1609.34;
+    std::swap(_cache_stores[index1], _cache_stores[index2]);
+    if (index1 == 0 || index2 == 0) {
+        _replicas.changed_all();
     }
-    return current_store().with_entry_run(rk, [this, &lpos, &rpos, factor] (const cache_entry* e) {
+    log_db("SWAPDB", index1, index2);
+    return true;
+}
+
+
+future<reply> database::geodist(const redis_key& rk, sstring& lpos, sstring& rpos, int flag)
+{
+    ++_stat._read;
+    ++_stat._geodist;
+    return current_store().with_entry_run(rk, [this, &lpos, &rpos, flag] (const cache_entry* e) {
         if (e == nullptr) {
            return reply_builder::build(msg_err);
         }
@@ -1650,9 +2996,9 @@ future<scattered_message_ptr> database::geodist(const redis_key& rk, sstring& lp
            return reply_builder::build(msg_err);
         }
         double dist = 0;
-        if (geo::dist(*l_score_opt, *r_score_opt, dist)) {
+        if (geo::dist(*l_score_opt, *r_score_opt, dist) && geo::from_meters(dist, flag)) {
            ++_stat._hit;
-           return reply_builder::build(dist / factor);
+           return reply_builder::build(dist);
         }
         else {
            return reply_builder::build(msg_err);
@@ -1660,7 +3006,7 @@ future<scattered_message_ptr> database::geodist(const redis_key& rk, sstring& lp
     });
 }
 
-future<scattered_message_ptr> database::geohash(const redis_key& rk, std::vector<sstring>& members)
+future<reply> database::geohash(const redis_key& rk, std::vector<sstring>& members)
 {
     ++_stat._read;
     ++_stat._geohash;
@@ -1688,7 +3034,7 @@ future<scattered_message_ptr> database::geohash(const redis_key& rk, std::vector
     });
 }
 
-future<scattered_message_ptr> database::geopos(const redis_key& rk, std::vector<sstring>& members)
+future<reply> database::geopos(const redis_key& rk, std::vector<sstring>& members)
 {
     ++_stat._read;
     ++_stat._geopos;
@@ -1716,10 +3062,10 @@ future<scattered_message_ptr> database::geopos(const redis_key& rk, std::vector<
     });
 }
 using georadius_result_type = std::pair<std::vector<std::tuple<sstring, double, double, double, double>>, int>;
-future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius_coord_direct(const redis_key& rk, double longitude, double latitude, double radius, size_t count, int flag)
+future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius_coord_direct(const redis_key& rk, geo::shape shape, size_t count, int flag)
 {
     using return_type = foreign_ptr<lw_shared_ptr<georadius_result_type>>;
-    return current_store().with_entry_run(rk, [this, longitude, latitude, radius, count, flag] (const cache_entry* e) {
+    return current_store().with_entry_run(rk, [this, &shape, count, flag] (const cache_entry* e) {
         if (e == nullptr) {
             return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_ERR})));
         }
@@ -1727,15 +3073,15 @@ future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius_co
             return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_WRONG_TYPE})));
         }
         auto& sset = e->value_sset();
-        return georadius(sset, longitude, latitude, radius, count, flag);
+        return georadius(sset, shape, count, flag);
     });
 }
 
-future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius_member_direct(const redis_key& rk, sstring& pos, double radius, size_t count, int flag)
+future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius_member_direct(const redis_key& rk, sstring& pos, geo::shape shape, size_t count, int flag)
 {
 
     using return_type = foreign_ptr<lw_shared_ptr<georadius_result_type>>;
-    return current_store().with_entry_run(rk, [this, pos, radius, count, flag] (const cache_entry* e) {
+    return current_store().with_entry_run(rk, [this, &pos, &shape, count, flag] (const cache_entry* e) {
         if (e == nullptr) {
             return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_ERR})));
         }
@@ -1747,59 +3093,128 @@ future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius_me
         if (!score_opt) {
             return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_ERR})));
         }
-        double longitude = 0, latitude = 0;
-        if (geo::decode_from_geohash(*score_opt, longitude, latitude) == false) {
+        if (geo::decode_from_geohash(*score_opt, shape.longitude, shape.latitude) == false) {
             return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_ERR})));
         }
-        return georadius(sset, longitude, latitude, radius, count, flag);
+        return georadius(sset, shape, count, flag);
     });
 }
 
-future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius(const sset_lsa& sset, double longitude, double latitude, double radius, size_t count, int flag)
+future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> database::georadius(const sset_lsa& sset, const geo::shape& shape, size_t count, int flag)
 {
     ++_stat._read;
     ++_stat._georadius;
     using return_type = foreign_ptr<lw_shared_ptr<georadius_result_type>>;
     using data_type = std::vector<std::tuple<sstring, double, double, double, double>>;
-    data_type points;
-    auto fetch_point = [&sset, count] (double min, double max, double log, double lat, double r, data_type& points) -> size_t {
-        std::vector<const sset_entry*> entries;
-        sset.fetch_by_score(min, max, entries, count);
-        size_t _count = 0;
-        for (size_t i = 0; i < entries.size(); ++i) {
-            auto e = entries[i];
-            double score = e->score(), longitude = 0, latitude = 0, dist = 0;
-            if (geo::decode_from_geohash(score, longitude, latitude) == false) {
+    std::vector<geo::area> areas;
+    double bounds[4];
+    if (geo::areas_of(shape, areas, bounds) == false) {
+        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_ERR})));
+    }
+    // as Redis does, COUNT without ANY keeps the nearest members.
+    bool any = (flag & GEORADIUS_ANY) && count > 0;
+    if (count > 0 && !any && !(flag & (GEORADIUS_ASC | GEORADIUS_DESC))) {
+        flag |= GEORADIUS_ASC;
+    }
+    bool desc = flag & GEORADIUS_DESC;
+    bool bounded = count > 0 && !any;
+    struct candidate {
+        const sset_entry* _entry;
+        double _dist;
+        double _longitude;
+        double _latitude;
+    };
+    // l is replied before r. With COUNT, the candidates are a heap of the
+    // COUNT best members, the last one to reply on the top.
+    auto ahead = [desc] (const candidate& l, const candidate& r) {
+        return desc ? l._dist > r._dist : l._dist < r._dist;
+    };
+    std::vector<candidate> kept;
+    if (bounded) {
+        kept.reserve(count);
+    }
+    // the members of a box are decoded and filtered by batches, only the
+    // members within the bounds are measured.
+    static constexpr const size_t batch_size = 64;
+    const sset_entry* batch[batch_size];
+    double scores[batch_size], longitudes[batch_size], latitudes[batch_size];
+    uint32_t selected[batch_size];
+    size_t pending = 0;
+    auto flush = [&] {
+        auto n = geo::decode_within(scores, pending, bounds, longitudes, latitudes, selected);
+        pending = 0;
+        for (size_t j = 0; j < n; ++j) {
+            auto i = selected[j];
+            double dist = 0;
+            if (geo::inside(shape, longitudes[i], latitudes[i], dist) == false) {
                 continue;
             }
-            if (geo::dist(log, lat, longitude, latitude, dist) == false) {
-                continue;
+            candidate c { batch[i], dist, longitudes[i], latitudes[i] };
+            if (!bounded) {
+                kept.push_back(c);
+                if (any && kept.size() == count) {
+                    return;
+                }
             }
-            if (dist < r) {
-                _count++;
-                sstring n(e->key_data(), e->key_size());
-                points.emplace_back(std::move(std::tuple<sstring, double, double, double, double>{std::move(n), score, dist, longitude, latitude}));
+            else if (kept.size() < count) {
+                kept.push_back(c);
+                std::push_heap(kept.begin(), kept.end(), ahead);
+            }
+            else if (ahead(c, kept.front())) {
+                std::pop_heap(kept.begin(), kept.end(), ahead);
+                kept.back() = c;
+                std::push_heap(kept.begin(), kept.end(), ahead);
             }
         }
-        return _count;
     };
-    if (geo::fetch_points_from_location(longitude, latitude, radius, std::move(fetch_point), points) == false) {
-        return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {{}, REDIS_ERR})));
+    auto done = [&] { return any && kept.size() == count; };
+    for (auto& area : areas) {
+        // the boxes are sorted by their least distance, none of the next ones
+        // holds a nearer member than the kept ones.
+        if (bounded && !desc && kept.size() == count && area._nearest >= kept.front()._dist) {
+            break;
+        }
+        sset.for_each_in_range(area._min, area._max, [&] (const sset_entry& e) {
+            batch[pending] = &e;
+            scores[pending] = e.score();
+            if (++pending == batch_size) {
+                flush();
+            }
+            return !done();
+        });
+        if (pending > 0) {
+            flush();
+        }
+        if (done()) {
+            break;
+        }
     }
-    if (flag & GEORADIUS_ASC) {
-        std::sort(points.begin(), points.end(), [] (const auto& l, const auto& r) { return std::get<2>(l) > std::get<2>(r); });
+    if (flag & (GEORADIUS_ASC | GEORADIUS_DESC)) {
+        std::sort(kept.begin(), kept.end(), ahead);
     }
-    else if (flag & GEORADIUS_DESC) {
-        std::sort(points.begin(), points.end(), [] (const auto& l, const auto& r) { return std::get<2>(l) < std::get<2>(r); });
+    data_type points;
+    points.reserve(kept.size());
+    for (auto& c : kept) {
+        auto e = c._entry;
+        points.emplace_back(sstring(e->key_data(), e->key_size()), e->score(), c._dist, c._longitude, c._latitude);
     }
     if (!points.empty()) ++_stat._hit;
     return make_ready_future<return_type>(foreign_ptr<lw_shared_ptr<georadius_result_type>>(make_lw_shared<georadius_result_type>(georadius_result_type {std::move(points), REDIS_OK})));
 }
 
-future<scattered_message_ptr> database::setbit(const redis_key& rk, size_t offset, bool value)
+// A short string is read where it is inlined, it is not moved out of its entry.
+static bitmap_view bitmap_of(const cache_entry* e)
+{
+    if (e == nullptr) {
+        return bitmap_view();
+    }
+    return e->value_inlined() ? bitmap_view(e->value_bytes_view()) : bitmap_view(e->value_bytes());
+}
+
+future<reply> database::setbit(const redis_key& rk, size_t offset, bool value)
 {
     ++_stat._setbit;
-    return with_allocator(allocator(), [this, &rk, offset, value] {
+    return logged(with_allocator(allocator(), [this, &rk, offset, value] {
         return current_store().with_entry_run(rk, [this, &rk, offset, value] (cache_entry* e) {
             auto o = e;
             size_t offset_in_bytes = offset >> 3;
@@ -1809,7 +3224,7 @@ future<scattered_message_ptr> database::setbit(const redis_key& rk, size_t offse
                if (origin_size < 15) {
                    origin_size = 15;
                }
-               auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), origin_size);
+               auto entry = cache_entry::make(rk.key(), rk.hash(), origin_size);
                current_store().insert(entry);
                 --_stat._total_bitmap_entries;
                o = entry;
@@ -1817,65 +3232,173 @@ future<scattered_message_ptr> database::setbit(const redis_key& rk, size_t offse
             if (o->type_of_bytes() == false) {
                 return reply_builder::build(msg_type_err);
             }
+            if (o->value_tiered()) {
+                return promoted(rk, [this, offset, value] (const redis_key& rk) { return setbit(rk, offset, value); });
+            }
             auto& mbytes = o->value_bytes();
             if (mbytes.size() < offset_in_bytes) {
                 auto extend_size = offset_in_bytes + offset_in_bytes / 4;
                 mbytes.extend(extend_size, 0);
             }
             auto result = bits_operation::set(mbytes, offset, value);
+            log(rk, "SETBIT", offset, value);
             return reply_builder::build(result ? msg_one : msg_zero);
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::getbit(const redis_key& rk, size_t offset)
+future<reply> database::getbit(const redis_key& rk, size_t offset)
 {
     ++_stat._read;
     ++_stat._getbit;
-    return current_store().with_entry_run(rk, [this, offset] (const cache_entry* e) {
+    return current_store().with_entry_run(rk, [this, &rk, offset] (const cache_entry* e) {
         if (e == nullptr) {
             return reply_builder::build(msg_zero);
         }
         if (e->type_of_bytes() == false) {
             return reply_builder::build(msg_type_err);
         }
-        auto& mbytes = e->value_bytes();
-        auto result = bits_operation::get(mbytes, offset);
+        if (e->value_tiered()) {
+            return promoted(rk, [this, offset] (const redis_key& rk) { return getbit(rk, offset); });
+        }
+        auto result = bits_operation::get(bitmap_of(e), offset);
         ++_stat._hit;
         return reply_builder::build(result ? msg_one : msg_zero);
     });
 }
 
-future<scattered_message_ptr> database::bitcount(const redis_key& rk, long start, long end)
+future<reply> database::bitcount(const redis_key& rk, long start, long end)
 {
     ++_stat._read;
     ++_stat._bitcount;
-    return current_store().with_entry_run(rk, [this, start, end] (const cache_entry* e) {
+    return current_store().with_entry_run(rk, [this, &rk, start, end] (const cache_entry* e) {
         if (e == nullptr) {
             return reply_builder::build(msg_zero);
         }
         if (e->type_of_bytes() == false) {
             return reply_builder::build(msg_type_err);
         }
-        auto& mbytes = e->value_bytes();
-        auto result = bits_operation::count(mbytes, start, end);
+        if (e->value_tiered()) {
+            return promoted(rk, [this, start, end] (const redis_key& rk) { return bitcount(rk, start, end); });
+        }
+        auto result = bits_operation::count(bitmap_of(e), start, end);
         ++_stat._hit;
         return reply_builder::build(result);
     });
 }
 
-future<scattered_message_ptr> database::bitpos(const redis_key& rk, bool bit, long start, long end)
+future<reply> database::bitpos(const redis_key& rk, bool bit, long start, long end, bool end_given)
 {
-    return reply_builder::build(msg_nil);
+    ++_stat._read;
+    ++_stat._bitpos;
+    return current_store().with_entry_run(rk, [this, &rk, bit, start, end, end_given] (const cache_entry* e) {
+        if (e == nullptr) {
+            return reply_builder::build(bit ? msg_neg_one : msg_zero);
+        }
+        if (e->type_of_bytes() == false) {
+            return reply_builder::build(msg_type_err);
+        }
+        if (e->value_tiered()) {
+            return promoted(rk, [this, bit, start, end, end_given] (const redis_key& rk) { return bitpos(rk, bit, start, end, end_given); });
+        }
+        auto result = bits_operation::position(bitmap_of(e), bit, start, end, end_given);
+        ++_stat._hit;
+        if (result < 0) {
+            return reply_builder::build(msg_neg_one);
+        }
+        return reply_builder::build(static_cast<size_t>(result));
+    });
+}
+
+bool database::bitop_sources(std::vector<sstring>& keys, std::vector<bitmap_view>& sources)
+{
+    for (auto& key : keys) {
+        redis_key rk {std::ref(key)};
+        auto valid = current_store().with_entry_run(rk, [&sources] (const cache_entry* e) {
+            if (e != nullptr && e->type_of_bytes() == false) {
+                return false;
+            }
+            sources.push_back(bitmap_of(e));
+            return true;
+        });
+        if (!valid) {
+            return false;
+        }
+    }
+    return true;
+}
+
+future<reply> database::bitop(const redis_key& rk, int op, std::vector<sstring>& keys)
+{
+    ++_stat._bitop;
+    auto tiered = tiered_keys(keys);
+    if (!tiered.empty()) {
+        // the destination is replaced, only the sources are read back.
+        return promote(std::move(tiered)).then([this, index = current_store_index, key = rk.key(), op, &keys] () mutable {
+            return do_with(std::move(key), [this, index, op, &keys] (sstring& key) {
+                return with_store(index, [this, op, &keys, &key] { return bitop(redis_key { key }, op, keys); });
+            });
+        });
+    }
+    sstring result;
+    {
+        // the sources are read in place, they must not move meanwhile.
+        logalloc::reclaim_lock lock(*this);
+        std::vector<bitmap_view> sources;
+        if (!bitop_sources(keys, sources)) {
+            return reply_builder::build(msg_type_err);
+        }
+        result = bits_operation::combine(op, sources);
+    }
+    return logged(reply_builder::build(bitstore_direct(rk, result)));
+}
+
+future<foreign_ptr<lw_shared_ptr<sstring>>> database::bitop_direct(std::vector<sstring>& keys, int op)
+{
+    ++_stat._read;
+    using return_type = foreign_ptr<lw_shared_ptr<sstring>>;
+    auto tiered = tiered_keys(keys);
+    if (!tiered.empty()) {
+        return promote(std::move(tiered)).then([this, index = current_store_index, &keys, op] {
+            return with_store(index, [this, &keys, op] { return bitop_direct(keys, op); });
+        });
+    }
+    logalloc::reclaim_lock lock(*this);
+    std::vector<bitmap_view> sources;
+    if (!bitop_sources(keys, sources)) {
+        return make_ready_future<return_type>(return_type(nullptr));
+    }
+    return make_ready_future<return_type>(return_type(make_lw_shared<sstring>(bits_operation::combine(op, sources))));
+}
+
+size_t database::bitstore_direct(const redis_key& rk, sstring& value)
+{
+    return with_allocator(allocator(), [this, &rk, &value] {
+        current_store().with_entry_run(rk, [this, &rk] (cache_entry* e) {
+            if (e) {
+                count_released_entry(e->type());
+                current_store().erase(*e);
+                log(rk, "DEL");
+            }
+        });
+        if (value.empty()) {
+            return size_t(0);
+        }
+        auto entry = make_string_entry(rk, value);
+        current_store().insert(entry);
+        count_inserted_entry(entry->type());
+        log(rk, "SET", value);
+        return value.size();
+    });
 }
 
-future<scattered_message_ptr> database::pfadd(const redis_key& rk, std::vector<sstring>& elements)
+future<reply> database::pfadd(const redis_key& rk, std::vector<sstring>& elements)
 {
     ++_stat._pfadd;
-    return with_allocator(allocator(), [this, &rk, &elements] {
+    return logged(with_allocator(allocator(), [this, &rk, &elements] {
         return current_store().with_entry_run(rk, [this, &rk, &elements] (cache_entry* e) {
             if (e == nullptr) {
-                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::hll_initializer());
+                auto entry = cache_entry::make(rk.key(), rk.hash(), cache_entry::hll_initializer());
                 current_store().insert(entry);
                 --_stat._total_hll_entries;
                 e = entry;
@@ -1885,12 +3408,13 @@ future<scattered_message_ptr> database::pfadd(const redis_key& rk, std::vector<s
             }
             managed_bytes& mbytes = e->value_bytes();
             auto result = hll::append(mbytes, elements);
+            log(rk, "PFADD", elements);
             return reply_builder::build(result);
         });
-    });
+    }));
 }
 
-future<scattered_message_ptr> database::pfcount(const redis_key& rk)
+future<reply> database::pfcount(const redis_key& rk)
 {
     ++_stat._read;
     ++_stat._pfcount;
@@ -1908,13 +3432,13 @@ future<scattered_message_ptr> database::pfcount(const redis_key& rk)
     });
 }
 
-future<scattered_message_ptr> database::pfmerge(const redis_key& rk, uint8_t* merged_sources, size_t size)
+future<reply> database::pfmerge(const redis_key& rk, const uint8_t* raw)
 {
     ++_stat._pfmerge;
-    return with_allocator(allocator(), [this, &rk, merged_sources, size] {
-        return current_store().with_entry_run(rk, [this, &rk, merged_sources, size] (cache_entry* e) {
+    return logged(with_allocator(allocator(), [this, &rk, raw] {
+        return current_store().with_entry_run(rk, [this, &rk, raw] (cache_entry* e) {
             if (e == nullptr) {
-                auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), cache_entry::hll_initializer());
+                auto entry = cache_entry::make(rk.key(), rk.hash(), cache_entry::hll_initializer());
                 current_store().insert(entry);
                 --_stat._total_hll_entries;
                 e = entry;
@@ -1923,15 +3447,864 @@ future<scattered_message_ptr> database::pfmerge(const redis_key& rk, uint8_t* me
                 return reply_builder::build(msg_type_err);
             }
             auto& mbytes = e->value_bytes();
-            hll::merge(mbytes, merged_sources, size);
+            hll::merge(mbytes, raw);
+            if (logging()) {
+                log(rk, "SET", hll::to_redis(mbytes));
+            }
             return reply_builder::build(msg_ok);
         });
+    }));
+}
+
+future<size_t> database::stage_tiered(size_t index, size_t position)
+{
+    if (!_tier.enabled()) {
+        return make_ready_future<size_t>(SNAPSHOT_BUCKETS_PER_STEP);
+    }
+    // the buckets are visited as the step does, until the values staged would
+    // fill its buffer.
+    std::vector<uint64_t> locations;
+    size_t bytes = 0;
+    size_t visited = 0;
+    for (; visited < SNAPSHOT_BUCKETS_PER_STEP && bytes < SNAPSHOT_BUFFER_SIZE; ++visited) {
+        if (index == _cache_stores.size()) {
+            break;
+        }
+        auto& store = *_cache_stores[index];
+        if (position == store.traversal_size() || (position == 0 && store.empty())) {
+            ++index;
+            position = 0;
+            continue;
+        }
+        store.for_each_in_bucket(position++, [&locations, &bytes] (const cache_entry& e) {
+            if (e.value_tiered()) {
+                locations.push_back(e.tier_location());
+                bytes += flash_tier::stored_size(e.tier_location());
+            }
+        });
+    }
+    return _tier.stage(std::move(locations)).then([visited] {
+        return std::max<size_t>(visited, 1);
+    });
+}
+
+bool database::save_step(rdb_writer& writer, size_t& index, size_t& position, size_t buckets)
+{
+    // the entries must neither move nor be reclaimed while they are encoded.
+    logalloc::reclaim_lock lock(*this);
+    return with_linearized_managed_bytes([this, &writer, &index, &position, buckets] {
+        auto now = clock_type::now();
+        auto wall_now = std::chrono::system_clock::now();
+        for (size_t visited = 0; visited < buckets && writer.size() < SNAPSHOT_BUFFER_SIZE; ++visited) {
+            if (index == _cache_stores.size()) {
+                break;
+            }
+            auto& store = *_cache_stores[index];
+            if (position == store.traversal_size() || (position == 0 && store.empty())) {
+                ++index;
+                position = 0;
+                continue;
+            }
+            if (position == 0) {
+                writer.write_select_db(index);
+                writer.write_resize_db(store.size(), store.expiring_size());
+            }
+            store.for_each_in_bucket(position++, [&writer, now, wall_now] (const cache_entry& e) {
+                if (!e.expired(now)) {
+                    writer.write_entry(e, now, wall_now);
+                }
+            });
+        }
+        return index == _cache_stores.size();
     });
 }
 
+void database::begin_snapshot(rdb_writer& writer)
+{
+    writer.write_header();
+    writer.write_aux("redis-bits", to_sstring(sizeof(void*) * 8));
+    writer.write_aux("ctime", to_sstring(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count()));
+    writer.write_aux("pedis-shard", to_sstring(engine().cpu_id()));
+    writer.write_aux("pedis-shards", to_sstring(smp::count));
+}
 
-future<> database::stop()
+future<> database::save(sstring directory, sstring dbfilename)
+{
+    return with_gate(_snapshot_gate, [this, directory = std::move(directory), dbfilename = std::move(dbfilename)] {
+        auto path = shard_file_path(directory, dbfilename, engine().cpu_id());
+        auto temporary_path = path + ".tmp";
+        for (auto& store : _cache_stores) {
+            store->pause_resize();
+        }
+        auto start = steady_clock_type::now();
+        return open_file_dma(temporary_path, open_flags::wo | open_flags::create | open_flags::truncate).then([this] (file f) {
+            auto out = make_file_output_stream(std::move(f), SNAPSHOT_BUFFER_SIZE);
+            return do_with(std::move(out), rdb_writer(SNAPSHOT_BUFFER_SIZE), size_t {0}, size_t {0}, [this] (auto& out, auto& writer, auto& index, auto& position) {
+                begin_snapshot(writer);
+                return repeat([this, &out, &writer, &index, &position] {
+                    return stage_tiered(index, position).then([this, &out, &writer, &index, &position] (size_t buckets) {
+                        bool done = false;
+                        try {
+                            done = save_step(writer, index, position, buckets);
+                        } catch (...) {
+                            return make_exception_future<stop_iteration>(std::current_exception());
+                        }
+                        return out.write(writer.release()).then([done] {
+                            return done ? stop_iteration::yes : stop_iteration::no;
+                        });
+                    });
+                }).then([&out, &writer] {
+                    writer.write_eof();
+                    return out.write(writer.release());
+                }).then([&out] {
+                    return out.flush();
+                }).finally([&out] {
+                    return out.close();
+                }).then([this, &writer] {
+                    _stat._saved_entries += writer.entries();
+                    _stat._saved_bytes += writer.bytes();
+                    return std::make_pair(writer.entries(), writer.bytes());
+                });
+            });
+        }).then([temporary_path, path] (auto saved) {
+            return rename_file(temporary_path, path).then([saved] {
+                return saved;
+            });
+        }).then([directory, path, start] (auto saved) {
+            return sync_directory(directory).then([path, start, saved] {
+                auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(steady_clock_type::now() - start);
+                db_log.info("saved {} entries ({} bytes) to {} in {} ms", saved.first, saved.second, path, elapsed.count());
+            });
+        }).finally([this] {
+            for (auto& store : _cache_stores) {
+                store->resume_resize();
+            }
+        });
+    });
+}
+
+struct database::load_context {
+    bool from_file;
+    size_t db_index = 0;
+    // the shards which saved the snapshot, the buckets are sized by them.
+    unsigned saved_shards = 0;
+    unsigned saved_shard = 0;
+    // the key of the entry whose elements are being loaded.
+    bool building = false;
+    sstring key;
+    uint64_t entries = 0;
+    uint64_t expired = 0;
+    // the shard which the entry being skipped is forwarded to, none if it expired.
+    unsigned forward_to = 0;
+    bool skipping = false;
+    std::vector<rdb_writer> batches;
+    std::vector<size_t> batch_db_index;
+
+    explicit load_context(bool file) : from_file(file)
+    {
+        if (file) {
+            batches.reserve(smp::count);
+            for (unsigned i = 0; i < smp::count; ++i) {
+                batches.emplace_back(LOAD_BATCH_SIZE);
+            }
+            batch_db_index.resize(smp::count, std::numeric_limits<size_t>::max());
+        }
+    }
+};
+
+void database::load_step(rdb_reader& reader, load_context& context)
 {
+    with_allocator(allocator(), [this, &reader, &context] {
+        auto wall_now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        cache_entry* e = nullptr;
+        if (context.building) {
+            // the entry was loaded by an earlier step, it may have been moved since.
+            redis_key rk {context.key};
+            e = _cache_stores[context.db_index]->with_entry_run(rk, [] (cache_entry* found) { return found; });
+        }
+        for (;;) {
+            switch (reader.next()) {
+            case rdb_reader::item::none:
+            case rdb_reader::item::eof:
+                return;
+            case rdb_reader::item::aux: {
+                auto field = reader.field().str();
+                if (field == "pedis-shards") {
+                    context.saved_shards = std::atoi(reader.value().str().c_str());
+                } else if (field == "pedis-shard") {
+                    context.saved_shard = std::atoi(reader.value().str().c_str());
+                }
+                break;
+            }
+            case rdb_reader::item::select_db:
+                if (reader.db_index() >= _cache_stores.size()) {
+                    throw std::runtime_error("the snapshot has more databases than " + to_sstring(_cache_stores.size()));
+                }
+                context.db_index = reader.db_index();
+                break;
+            case rdb_reader::item::resize_db: {
+                // a snapshot of this very shard has its entries only, the others
+                // are spread over all shards.
+                auto size = reader.db_size();
+                if (context.saved_shards != smp::count || context.saved_shard != engine().cpu_id()) {
+                    size /= smp::count;
+                }
+                _cache_stores[context.db_index]->reserve(size);
+                break;
+            }
+            case rdb_reader::item::entry: {
+                context.building = false;
+                e = nullptr;
+                auto key = reader.key().str();
+                redis_key rk {key};
+                auto expire_at = reader.expire_at();
+                if (expire_at >= 0 && expire_at <= wall_now) {
+                    ++context.expired;
+                    context.skipping = true;
+                    reader.forward();
+                    break;
+                }
+                if (rk.get_cpu() != engine().cpu_id() && context.from_file) {
+                    context.forward_to = rk.get_cpu();
+                    context.skipping = false;
+                    reader.forward();
+                    break;
+                }
+                long expired = expire_at >= 0 ? static_cast<long>(expire_at - wall_now) : 0;
+                switch (reader.type()) {
+                case RDB_TYPE_STRING: {
+                    int64_t integer = 0;
+                    if (reader.value().to_integer(integer)) {
+                        e = cache_entry::make(rk.key(), rk.hash(), integer);
+                    } else {
+                        e = make_string_entry(rk, reader.value().str());
+                    }
+                    break;
+                }
+                case RDB_TYPE_LIST:
+                    e = cache_entry::make(rk.key(), rk.hash(), cache_entry::list_initializer());
+                    break;
+                case RDB_TYPE_SET:
+                    e = cache_entry::make(rk.key(), rk.hash(), cache_entry::set_initializer());
+                    break;
+                case RDB_TYPE_HASH:
+                    e = cache_entry::make(rk.key(), rk.hash(), cache_entry::dict_initializer());
+                    break;
+                default:
+                    e = cache_entry::make(rk.key(), rk.hash(), cache_entry::sset_initializer());
+                    break;
+                }
+                _cache_stores[context.db_index]->insert_if(e, expired, false, false);
+                count_inserted_entry(e->type());
+                ++context.entries;
+                if (reader.elements() > 0) {
+                    context.building = true;
+                    context.key = std::move(key);
+                }
+                break;
+            }
+            case rdb_reader::item::element: {
+                if (e == nullptr) {
+                    // the entry was evicted meanwhile.
+                    break;
+                }
+                auto& field = reader.field();
+                switch (e->type()) {
+                case entry_type::ENTRY_LIST:
+                    e->value_list().insert_tail(field.str());
+                    break;
+                case entry_type::ENTRY_SET:
+                    e->value_set().insert(field.str());
+                    break;
+                case entry_type::ENTRY_MAP: {
+                    int64_t integer = 0;
+                    if (reader.value().to_integer(integer)) {
+                        e->value_map().insert(field.str(), integer);
+                    } else {
+                        e->value_map().insert(field.str(), reader.value().str());
+                    }
+                    break;
+                }
+                case entry_type::ENTRY_SSET:
+                    e->value_sset().insert(current_allocator().construct<sset_entry>(field.str(), reader.score()));
+                    break;
+                default:
+                    break;
+                }
+                break;
+            }
+            case rdb_reader::item::forwarded: {
+                if (context.skipping) {
+                    break;
+                }
+                auto record = reader.record();
+                auto& batch = context.batches[context.forward_to];
+                if (context.batch_db_index[context.forward_to] != context.db_index) {
+                    batch.write_select_db(context.db_index);
+                    context.batch_db_index[context.forward_to] = context.db_index;
+                }
+                batch.write_record(record.first, record.second);
+                ++_stat._forwarded_entries;
+                break;
+            }
+            }
+        }
+    });
+}
+
+future<> database::forward_records(load_context& context, record_forwarder& forward, bool all)
+{
+    return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&context, &forward, all] (unsigned shard) {
+        auto& batch = context.batches[shard];
+        if (batch.size() == 0 || (!all && batch.size() < LOAD_BATCH_SIZE)) {
+            return make_ready_future<>();
+        }
+        // the next batch starts over with the database of its first record.
+        context.batch_db_index[shard] = std::numeric_limits<size_t>::max();
+        return forward(shard, batch.release());
+    });
+}
+
+future<> database::load(sstring path, record_forwarder forward)
+{
+    return open_file_dma(path, open_flags::ro).then([this, path, forward = std::move(forward)] (file f) mutable {
+        return f.size().then([this, path, f, forward = std::move(forward)] (uint64_t size) mutable {
+            ++_loading;
+            _load_total_bytes += size;
+            auto start = steady_clock_type::now();
+            file_input_stream_options options;
+            options.buffer_size = LOAD_BUFFER_SIZE;
+            options.read_ahead = LOAD_READ_AHEAD;
+            return do_with(make_file_input_stream(std::move(f), options), rdb_reader(), load_context(true), std::move(forward),
+                    [this, path, start] (auto& in, auto& reader, auto& context, auto& forward) {
+                return repeat([this, &in, &reader, &context, &forward] {
+                    return in.read().then([this, &reader, &context, &forward] (temporary_buffer<char> buf) {
+                        if (buf.empty()) {
+                            if (!reader.done()) {
+                                throw std::runtime_error("the snapshot is truncated");
+                            }
+                            return make_ready_future<stop_iteration>(stop_iteration::yes);
+                        }
+                        _stat._loaded_bytes += buf.size();
+                        reader.feed(buf.get(), buf.size());
+                        try {
+                            load_step(reader, context);
+                        } catch (...) {
+                            return make_exception_future<stop_iteration>(std::current_exception());
+                        }
+                        return forward_records(context, forward, false).then([] {
+                            return stop_iteration::no;
+                        });
+                    });
+                }).then([this, &context, &forward] {
+                    return forward_records(context, forward, true);
+                }).finally([&in] {
+                    return in.close();
+                }).then([this, &context, path, start] {
+                    _stat._loaded_entries += context.entries;
+                    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(steady_clock_type::now() - start);
+                    db_log.info("loaded {} entries from {} in {} ms, {} expired entries were skipped", context.entries, path, elapsed.count(), context.expired);
+                });
+            }).finally([this] {
+                --_loading;
+            });
+        });
+    });
+}
+
+future<> database::load_records(temporary_buffer<char> records)
+{
+    rdb_reader reader(false);
+    load_context context(false);
+    reader.feed(records.get(), records.size());
+    try {
+        load_step(reader, context);
+    } catch (...) {
+        return make_exception_future<>(std::current_exception());
+    }
+    _stat._loaded_entries += context.entries;
+    if (!reader.at_boundary()) {
+        return make_exception_future<>(std::runtime_error("the forwarded records are truncated"));
+    }
     return make_ready_future<>();
 }
+
+future<> database::configure_aof(sstring directory, sstring filename, aof_fsync_policy policy, std::chrono::milliseconds fsync_interval, size_t fsync_bytes)
+{
+    return _aof.open(std::move(directory), std::move(filename), policy, fsync_interval, fsync_bytes);
+}
+
+future<reply> database::logged(future<reply>&& r)
+{
+    if (!_aof.must_sync()) {
+        return std::move(r);
+    }
+    return r.then([this] (reply rep) {
+        return _aof.sync().then_wrapped([rep = std::move(rep)] (future<> f) mutable {
+            try {
+                f.get();
+                return make_ready_future<reply>(std::move(rep));
+            } catch (...) {
+                return reply_builder::build(msg_aof_write_err);
+            }
+        });
+    });
+}
+
+bool database::rewrite_step(aof_encoder& encoder, size_t buckets)
+{
+    // the entries must neither move nor be reclaimed while they are encoded.
+    logalloc::reclaim_lock lock(*this);
+    return with_linearized_managed_bytes([this, &encoder, buckets] {
+        auto now = clock_type::now();
+        auto wall_now = std::chrono::system_clock::now();
+        for (size_t visited = 0; visited < buckets && encoder.size() < SNAPSHOT_BUFFER_SIZE; ++visited) {
+            if (_rewrite_index == _cache_stores.size()) {
+                break;
+            }
+            auto& store = *_cache_stores[_rewrite_index];
+            if (_rewrite_position == store.traversal_size() || (_rewrite_position == 0 && store.empty())) {
+                ++_rewrite_index;
+                _rewrite_position = 0;
+                continue;
+            }
+            // the changes appended meanwhile may have selected another database.
+            encoder.select_db(_rewrite_index);
+            store.for_each_in_bucket(_rewrite_position++, [&encoder, now, wall_now] (const cache_entry& e) {
+                if (!e.expired(now)) {
+                    encoder.append_entry(e, now, wall_now);
+                }
+            });
+        }
+        return _rewrite_index == _cache_stores.size();
+    });
+}
+
+future<> database::rewrite_log()
+{
+    if (!_aof.enabled() || _aof.rewriting()) {
+        return make_ready_future<>();
+    }
+    return with_gate(_snapshot_gate, [this] {
+        // the buckets must stay where they are, rewritten() compares positions.
+        for (auto& store : _cache_stores) {
+            store->pause_resize();
+        }
+        return _aof.begin_rewrite().then([this] {
+            _rewrite_index = 0;
+            _rewrite_position = 0;
+            return repeat([this] {
+                return stage_tiered(_rewrite_index, _rewrite_position).then([this] (size_t buckets) {
+                    bool done = false;
+                    try {
+                        done = rewrite_step(_aof.rewrite_buffer(), buckets);
+                    } catch (...) {
+                        return make_exception_future<stop_iteration>(std::current_exception());
+                    }
+                    return _aof.flush_rewrite().then([done] {
+                        return done ? stop_iteration::yes : stop_iteration::no;
+                    });
+                });
+            }).then([this] {
+                return _aof.finish_rewrite();
+            }).handle_exception([this] (auto ep) {
+                db_log.error("failed to rewrite the append only log: {}", ep);
+                return _aof.abort_rewrite().then([ep] {
+                    return make_exception_future<>(ep);
+                });
+            });
+        }).finally([this] {
+            for (auto& store : _cache_stores) {
+                store->resume_resize();
+            }
+        });
+    });
+}
+
+void database::configure_backlog(size_t size)
+{
+    _backlog.configure(size);
+}
+
+future<replication_chunk> database::psync(sstring replid, int64_t offset)
+{
+    _backlog.enable();
+    if (!_backlog.enabled()) {
+        return make_exception_future<replication_chunk>(std::runtime_error("the replication is disabled"));
+    }
+    replication_chunk chunk;
+    chunk._replid = _backlog.replid();
+    auto frames = make_lw_shared<reply_chunks>();
+    if (offset >= 0 && _backlog.contains(replid, offset)) {
+        _backlog.open_stream(true);
+        add_replication_line(*frames, sstring("+CONTINUE ") + _backlog.replid());
+        chunk._frames = reply(std::move(frames));
+        chunk._offset = offset;
+        chunk._synced = true;
+        return make_ready_future<replication_chunk>(std::move(chunk));
+    }
+    if (_backlog.syncing()) {
+        return make_exception_future<replication_chunk>(std::runtime_error("a full sync of this shard is running, retry later"));
+    }
+    // the buckets must stay where they are, synced() compares positions.
+    _snapshot_gate.enter();
+    for (auto& store : _cache_stores) {
+        store->pause_resize();
+    }
+    _backlog.begin_sync();
+    _backlog.open_stream(false);
+    _sync_index = 0;
+    _sync_position = 0;
+    _sync_writer = rdb_writer(REPLICATION_FRAME_SIZE);
+    begin_snapshot(_sync_writer);
+    add_replication_line(*frames, sstring("+FULLRESYNC ") + _backlog.replid() + sstring(" ") + to_sstring(_backlog.end_offset()));
+    chunk._frames = reply(std::move(frames));
+    return make_ready_future<replication_chunk>(std::move(chunk));
+}
+
+future<replication_chunk> database::sync_step()
+{
+    if (!_backlog.syncing()) {
+        return make_exception_future<replication_chunk>(std::runtime_error("no full sync is running"));
+    }
+    return stage_tiered(_sync_index, _sync_position).then([this] (size_t buckets) {
+        // the replica may have left meanwhile.
+        if (!_backlog.syncing()) {
+            return make_exception_future<replication_chunk>(std::runtime_error("no full sync is running"));
+        }
+        return sync_step(buckets);
+    });
+}
+
+future<replication_chunk> database::sync_step(size_t buckets)
+{
+    bool done = false;
+    try {
+        done = save_step(_sync_writer, _sync_index, _sync_position, buckets);
+    } catch (...) {
+        abort_sync();
+        return make_exception_future<replication_chunk>(std::current_exception());
+    }
+    if (done) {
+        _sync_writer.write_eof();
+    }
+    replication_chunk chunk;
+    auto frames = make_lw_shared<reply_chunks>();
+    if (_sync_writer.size() > 0) {
+        add_replication_frame(*frames, '$', _sync_writer.release());
+    }
+    if (done) {
+        auto pending = _backlog.finish_sync();
+        auto data = pending.data();
+        auto size = pending.size();
+        add_replication_frame(*frames, '*', temporary_buffer<char>(data, size, make_object_deleter(std::move(pending))));
+        add_replication_line(*frames, sstring(":") + to_sstring(_backlog.end_offset()));
+        chunk._offset = _backlog.end_offset();
+        chunk._synced = true;
+        for (auto& store : _cache_stores) {
+            store->resume_resize();
+        }
+        _snapshot_gate.leave();
+        db_log.info("sent the snapshot of {} entries to a replica", _sync_writer.entries());
+    }
+    chunk._frames = reply(std::move(frames));
+    return make_ready_future<replication_chunk>(std::move(chunk));
+}
+
+void database::abort_sync()
+{
+    if (!_backlog.syncing()) {
+        return;
+    }
+    _backlog.abort_sync();
+    for (auto& store : _cache_stores) {
+        store->resume_resize();
+    }
+    _snapshot_gate.leave();
+}
+
+future<replication_chunk> database::stream_step(sstring replid, uint64_t offset)
+{
+    if (!_backlog.contains(replid, offset)) {
+        return make_exception_future<replication_chunk>(std::runtime_error("the replica fell behind the backlog"));
+    }
+    return _backlog.wait(offset).then([this, replid, offset] {
+        if (!_backlog.contains(replid, offset)) {
+            return make_exception_future<replication_chunk>(std::runtime_error("the replica fell behind the backlog"));
+        }
+        auto size = _backlog.complete_size(offset, REPLICATION_FRAME_SIZE);
+        auto frames = make_lw_shared<reply_chunks>();
+        add_replication_frame(*frames, '*', _backlog.read(offset, size));
+        replication_chunk chunk;
+        chunk._frames = reply(std::move(frames));
+        chunk._offset = offset + size;
+        chunk._synced = true;
+        return make_ready_future<replication_chunk>(std::move(chunk));
+    });
+}
+
+void database::flush_all()
+{
+    with_allocator(allocator(), [this] {
+        for (auto& store : _cache_stores) {
+            store->flush_all();
+        }
+        // the counters of the entries were reset, the flushed ones aren't counted any more.
+        for (auto& store : _flushed_stores) {
+            store->flush_all();
+            _stat._flushed_expired_entries += store->expired_entries();
+            _stat._flushed_lazyfreed_entries += store->lazyfreed_entries();
+        }
+        _flushed_stores.clear();
+        _flush_timer.cancel();
+    });
+    _stat._total_counter_entries = 0;
+    _stat._total_string_entries = 0;
+    _stat._total_dict_entries = 0;
+    _stat._total_list_entries = 0;
+    _stat._total_set_entries = 0;
+    _stat._total_zset_entries = 0;
+    _stat._total_bitmap_entries = 0;
+    _stat._total_hll_entries = 0;
+    _replicas.changed_all();
+    if (_backlog.enabled()) {
+        _backlog.reset();
+    }
+}
+
+template <typename Func>
+future<> database::for_each_in_slot(unsigned slot, Func func)
+{
+    return with_gate(_snapshot_gate, [this, slot, func = std::move(func)] () mutable {
+        // the buckets must stay where they are between the steps.
+        current_store().pause_resize();
+        return do_with(size_t(0), std::move(func), [this, slot] (size_t& position, Func& func) {
+            return repeat([this, slot, &position, &func] {
+                auto& store = current_store();
+                auto now = clock_type::now();
+                bool done = false;
+                for (size_t visited = 0; visited < SNAPSHOT_BUCKETS_PER_STEP && !done; ++visited) {
+                    if (position == store.traversal_size() || (position == 0 && store.empty())) {
+                        done = true;
+                        break;
+                    }
+                    store.for_each_in_bucket(position++, [&func, &done, slot, now] (const cache_entry& e) {
+                        if (!done && !e.expired(now) && key_slot(e.key_data(), e.key_size()) == slot) {
+                            done = func(e);
+                        }
+                    });
+                }
+                return done ? stop_iteration::yes : stop_iteration::no;
+            });
+        }).finally([this] {
+            current_store().resume_resize();
+        });
+    });
+}
+
+future<std::vector<sstring>> database::keys_in_slot(unsigned slot, size_t count)
+{
+    return do_with(std::vector<sstring>(), [this, slot, count] (auto& keys) {
+        if (count == 0) {
+            return make_ready_future<std::vector<sstring>>();
+        }
+        return this->for_each_in_slot(slot, [&keys, count] (const cache_entry& e) {
+            keys.emplace_back(e.key_data(), e.key_size());
+            return keys.size() == count;
+        }).then([&keys] {
+            return std::move(keys);
+        });
+    });
+}
+
+future<size_t> database::count_keys_in_slot(unsigned slot)
+{
+    return do_with(size_t(0), [this, slot] (auto& found) {
+        return this->for_each_in_slot(slot, [&found] (const cache_entry&) {
+            ++found;
+            return false;
+        }).then([&found] {
+            return found;
+        });
+    });
+}
+
+size_t database::begin_migration(std::vector<sstring>& keys, bool replace, aof_encoder& encoder)
+{
+    assert(_migration == nullptr);
+    // the entries must neither move nor be reclaimed while they are encoded.
+    logalloc::reclaim_lock lock(*this);
+    return with_linearized_managed_bytes([this, &keys, replace, &encoder] {
+        auto now = clock_type::now();
+        auto wall_now = std::chrono::system_clock::now();
+        size_t found = 0;
+        for (auto& key : keys) {
+            redis_key rk {std::ref(key)};
+            auto e = current_store().find(rk);
+            if (e == nullptr) {
+                continue;
+            }
+            if (replace) {
+                encoder.append("DEL", rk);
+            }
+            encoder.append_entry(*e, now, wall_now);
+            _migrating_keys.emplace(key);
+            ++found;
+        }
+        if (found > 0) {
+            _migration = &encoder;
+        }
+        return found;
+    });
+}
+
+void database::end_migration(bool remove)
+{
+    _migration = nullptr;
+    auto keys = std::move(_migrating_keys);
+    _migrating_keys.clear();
+    if (!remove) {
+        return;
+    }
+    for (auto& key : keys) {
+        sstring k = key;
+        redis_key rk {std::ref(k)};
+        del_direct(rk);
+    }
+}
+
+void database::configure_replication(distributed<database>& peers, const std::vector<sstring>& pinned)
+{
+    if (smp::count == 1) {
+        return;
+    }
+    _peers = &peers;
+    auto now = clock_type::now();
+    for (auto& key : pinned) {
+        if (redis_key::shard_hash_of(key) % smp::count == engine().cpu_id()) {
+            _replicas.request(key, true, now);
+        }
+    }
+    _replica_timer.set_callback([this] { sweep_replicas(); });
+    _replica_timer.arm_periodic(std::chrono::milliseconds(unsigned(key_replicas::SWEEP_PERIOD_MS)));
+}
+
+void database::replicate(const sstring& key)
+{
+    if (_peers && _replicas.request(key, false, clock_type::now()) && publish(key)) {
+        _replicas.published(key);
+    }
+}
+
+bool database::publish(const sstring& key)
+{
+    using payload = std::pair<sstring, key_replicas::copy>;
+    auto p = make_lw_shared<payload>(key, key_replicas::copy());
+    auto& c = p->second;
+    redis_key rk { p->first };
+    auto copied = current_store().with_entry_run(rk, [&c] (const cache_entry* e) {
+        if (!e || !(e->type_of_bytes() || e->type_of_map())) {
+            return false;
+        }
+        if (e->ever_expires()) {
+            c._volatile = true;
+            c._deadline = e->get_timeout();
+        }
+        if (e->type_of_bytes()) {
+            if (e->value_tiered() || e->value_bytes_size() > key_replicas::MAX_COPY_SIZE) {
+                return false;
+            }
+            c._value = key_replicas::encode_bulk(e->value_bytes_data(), e->value_bytes_size());
+            return true;
+        }
+        auto& map = e->value_map();
+        if (map.size() > key_replicas::MAX_FIELDS) {
+            return false;
+        }
+        c._hash = true;
+        map.for_each([&c] (const dict_field& f) {
+            sstring value;
+            if (f.type_of_bytes()) {
+                value = key_replicas::encode_bulk(f.value_bytes_data(), f.value_bytes_size());
+            } else {
+                auto n = f.type_of_integer() ? to_sstring(f.value_integer()) : to_sstring(f.value_float());
+                value = key_replicas::encode_bulk(n.data(), n.size());
+            }
+            c._fields.emplace(sstring(f.key_data(), f.key_size()), std::move(value));
+        });
+        return c.size() <= key_replicas::MAX_COPY_SIZE;
+    });
+    if (!copied) {
+        return false;
+    }
+    // the other shards read the copy from this shard, and build their own.
+    propagate_step([this, p] {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [this, p] (unsigned cpu) {
+            if (cpu == engine().cpu_id()) {
+                return make_ready_future<>();
+            }
+            return _peers->invoke_on(cpu, [p = p.get()] (database& db) {
+                db._replicas.install(p->first, p->second);
+            });
+        }).finally([p] {});
+    });
+    return true;
+}
+
+void database::sweep_replicas()
+{
+    _replicas.sweep(clock_type::now(), [this] (const sstring& key) {
+        return publish(key);
+    });
+    // the drops of the keys which cooled down, nobody waits for them.
+    (void)propagate();
+}
+
+void database::propagate_step(std::function<future<>()> step)
+{
+    ++_propagating;
+    _propagation = shared_future<>(_propagation.get_future().then(std::move(step)).handle_exception([] (std::exception_ptr e) {
+        db_log.warn("failed to propagate the copies of the replicated keys: {}", e);
+    }).finally([this] {
+        --_propagating;
+    }));
+}
+
+future<> database::propagate()
+{
+    if (_replicas.invalidated()) {
+        auto keys = make_lw_shared<std::vector<sstring>>(_replicas.take_invalidated());
+        propagate_step([this, keys] {
+            return parallel_for_each(boost::irange<unsigned>(0, smp::count), [this, keys] (unsigned cpu) {
+                if (cpu == engine().cpu_id()) {
+                    return make_ready_future<>();
+                }
+                return _peers->invoke_on(cpu, [keys = keys.get()] (database& db) {
+                    db._replicas.drop(*keys);
+                });
+            }).finally([keys] {});
+        });
+    }
+    if (_propagating == 0) {
+        return make_ready_future<>();
+    }
+    return _propagation.get_future();
+}
+
+future<> database::stop()
+{
+    _replica_timer.cancel();
+    _tier_timer.cancel();
+    _compaction_timer.cancel();
+    _blocked.clear();
+    abort_sync();
+    _backlog.close();
+    return _snapshot_gate.close().then([this] {
+        return _aof.close();
+    }).then([this] {
+        return _tier.close();
+    }).then([this] {
+        return propagate();
+    });
+}
 }
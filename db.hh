@@ -25,130 +25,758 @@
 #include "core/sharded.hh"
 #include "core/temporary_buffer.hh"
 #include "core/metrics_registration.hh"
+#include "core/gate.hh"
 #include <sstream>
 #include <iostream>
 #include "common.hh"
 #include "geo.hh"
 #include "bits_operation.hh"
 #include <tuple>
+#include <array>
+#include <unordered_set>
+#include <deque>
+#include <memory>
 #include "cache.hh"
 #include "reply_builder.hh"
+#include "rdb.hh"
+#include "aof.hh"
+#include "flash_tier.hh"
+#include "replicas.hh"
+#include "replication.hh"
+#include "blocked_lists.hh"
+#include "latency_histogram.hh"
+#include "utils/logalloc.hh"
+#include "core/shared_future.hh"
+#include "core/timer.hh"
 #include  <experimental/vector>
 namespace stdx = std::experimental;
 namespace redis {
-using scattered_message_ptr = foreign_ptr<lw_shared_ptr<scattered_message<char>>>;
 class sset_lsa;
+
+// The members of a set shipped to the shard computing a set operation: the
+// sorted integers of an intset, or the members in their string form.
+struct set_members {
+    bool _integers = true;
+    std::vector<int64_t> _values;
+    std::vector<sstring> _keys;
+
+    void to_keys() {
+        if (_integers) {
+            _keys.reserve(_keys.size() + _values.size());
+            for (auto v : _values) {
+                _keys.emplace_back(to_sstring(v));
+            }
+            _values.clear();
+            _integers = false;
+        }
+    }
+};
+
+// The replies of a shard to its keys of a multi-key read, encoded one after
+// the other in _data: the reply to the i-th key ends at _ends[i].
+struct reply_fragments {
+    sstring _data;
+    std::vector<size_t> _ends;
+};
+
+// The weighted score of a member of a range, aggregated over the sorted sets
+// of one shard, and the number of these sets the member was found in.
+struct zset_partial {
+    sstring _member;
+    double _score;
+    size_t _sources;
+};
+
+// The members of a range of members aggregated by a shard. The range ends at
+// @_last if a source has members after it, it's the last range otherwise.
+struct zset_partials {
+    std::vector<zset_partial> _members;
+    bool _truncated = false;
+    sstring _last;
+};
+
 class database final : private logalloc::region {
 public:
-    database();
+    static constexpr const size_t DEFAULT_DB_COUNT = 16;
+    explicit database(size_t databases = DEFAULT_DB_COUNT);
     ~database();
 
-    future<scattered_message_ptr> set(const redis_key& rk, sstring& val, long expire, uint32_t flag);
+    inline size_t databases() const
+    {
+        return _cache_stores.size();
+    }
+    // Runs @func on the database @index, which must be valid. The calls made
+    // outside of with_store() see the database 0, the continuations of a call
+    // select their database again.
+    template <typename Func>
+    inline auto with_store(size_t index, Func&& func)
+    {
+        struct restore {
+            size_t& _index;
+            size_t _previous;
+            ~restore() { _index = _previous; }
+        } r { current_store_index, current_store_index };
+        current_store_index = index;
+        return func();
+    }
+
+    // Counts the requests dispatched from this shard, @local is true if the
+    // key was owned by this shard.
+    inline void count_dispatch(bool local) {
+        if (local) {
+            ++_stat._local_dispatch;
+        } else {
+            ++_stat._remote_dispatch;
+        }
+    }
+
+    future<reply> set(const redis_key& rk, sstring& val, long expire, uint32_t flag);
     bool set_direct(const redis_key& rk, sstring& val, long expire, uint32_t flag);
 
-    future<scattered_message_ptr> counter_by(const redis_key& rk, int64_t step, bool incr);
-    future<scattered_message_ptr> append(const redis_key& rk, sstring& val);
+    future<reply> counter_by(const redis_key& rk, int64_t step, bool incr);
+    future<reply> append(const redis_key& rk, sstring& val);
 
-    future<scattered_message_ptr> del(const redis_key& key);
+    future<reply> del(const redis_key& key);
     bool del_direct(const redis_key& key);
+    // As DEL, but a large collection is freed in the background, see
+    // configure_lazyfree().
+    future<reply> unlink(const redis_key& key);
+    bool unlink_direct(const redis_key& key);
 
-    future<scattered_message_ptr> exists(const redis_key& key);
+    future<reply> exists(const redis_key& key);
     bool exists_direct(const redis_key& key);
 
-    future<scattered_message_ptr> get(const redis_key& key);
+    future<reply> get(const redis_key& key);
     future<foreign_ptr<lw_shared_ptr<sstring>>> get_direct(const redis_key& rk);
-    future<scattered_message_ptr> strlen(const redis_key& key);
 
-    future<scattered_message_ptr> expire(const redis_key& rk, long expired);
-    future<scattered_message_ptr> persist(const redis_key& rk);
-    future<scattered_message_ptr> type(const redis_key& rk);
-    future<scattered_message_ptr> pttl(const redis_key& rk);
-    future<scattered_message_ptr> ttl(const redis_key& rk);
+    // [MULTI-KEY]
+    // The keys of a multi-key command owned by this shard, sent in a single
+    // message and read from the calling shard.
+    future<foreign_ptr<lw_shared_ptr<reply_fragments>>> mget_direct(std::vector<sstring>& keys);
+    bool mset_direct(std::vector<std::pair<sstring, sstring>>& pairs);
+    size_t mdel_direct(std::vector<sstring>& keys);
+    size_t munlink_direct(std::vector<sstring>& keys);
+    size_t mexists_direct(std::vector<sstring>& keys);
+    // Returns the union of the HyperLogLogs of @keys, nullptr if none exists.
+    future<foreign_ptr<lw_shared_ptr<sstring>>> mget_hll_direct(std::vector<sstring>& keys);
+
+    future<reply> strlen(const redis_key& key);
+
+    future<reply> expire(const redis_key& rk, long expired);
+    future<reply> persist(const redis_key& rk);
+    future<reply> type(const redis_key& rk);
+    // SCAN of the keys of this shard, @cursor is the cursor within the shard. The
+    // reply holds the cursor of the next call, on this shard or the next one.
+    // @type is the reply of TYPE the keys must match, the empty string for any.
+    future<reply> scan(size_t cursor, const sstring& pattern, size_t count, const sstring& type);
+    future<reply> pttl(const redis_key& rk);
+    future<reply> ttl(const redis_key& rk);
     bool select(size_t index);
+    // [DATABASES]
+    // Empties the selected database: a new empty table replaces it at once, the
+    // entries of the former one are freed in the background. Returns false
+    // while a snapshot, a rewrite or a full sync walks the tables.
+    bool flushdb();
+    // As flushdb(), for every database.
+    bool flushall();
+    // Swaps the databases @index1 and @index2 of this shard, as flushdb().
+    bool swapdb(size_t index1, size_t index2);
 
     // [LIST]
-    future<scattered_message_ptr> push(const redis_key& rk, sstring& value, bool force, bool left);
-    future<scattered_message_ptr> push_multi(const redis_key& rk, std::vector<sstring>& value, bool force, bool left);
-    future<scattered_message_ptr> pop(const redis_key& rk, bool left);
-    future<scattered_message_ptr> llen(const redis_key& rk);
-    future<scattered_message_ptr> lindex(const redis_key& rk, long idx);
-    future<scattered_message_ptr> linsert(const redis_key& rk, sstring& pivot, sstring& value, bool after);
-    future<scattered_message_ptr> lrange(const redis_key& rk, long start, long end);
-    future<scattered_message_ptr> lset(const redis_key& rk, long idx, sstring& value);
-    future<scattered_message_ptr> lrem(const redis_key& rk, long count, sstring& value);
-    future<scattered_message_ptr> ltrim(const redis_key& rk, long start, long end);
+    future<reply> push(const redis_key& rk, sstring& value, bool force, bool left);
+    future<reply> push_multi(const redis_key& rk, std::vector<sstring>& value, bool force, bool left);
+    future<reply> pop(const redis_key& rk, bool left);
+    // Pushes @value to the list @rk for BLMOVE, false if @rk isn't a list.
+    bool push_direct(const redis_key& rk, sstring& value, bool left);
+    // [BLOCKING LIST]
+    // Pops from the first list of @keys holding an element, at the @left or the
+    // right end. If all are empty, the client @id blocks on them until @deadline:
+    // it is handed the element pushed, or, without @hand_off, only woken.
+    future<blocked_pop> block_pop(std::vector<sstring>& keys, bool left, bool hand_off, uint64_t id, lowres_clock::time_point deadline);
+    // Pops from the list @key if it holds an element, without blocking.
+    future<blocked_pop> try_pop(sstring& key, bool left);
+    // Unblocks the client @id if it's still blocked here.
+    inline void unblock(uint64_t id)
+    {
+        _blocked.finish(id, blocked_pop {});
+    }
+    future<reply> llen(const redis_key& rk);
+    future<reply> lindex(const redis_key& rk, long idx);
+    future<reply> linsert(const redis_key& rk, sstring& pivot, sstring& value, bool after);
+    future<reply> lrange(const redis_key& rk, long start, long end);
+    future<reply> lset(const redis_key& rk, long idx, sstring& value);
+    future<reply> lrem(const redis_key& rk, long count, sstring& value);
+    future<reply> ltrim(const redis_key& rk, long start, long end);
 
     // [HASHMAP]
-    future<scattered_message_ptr> hset(const redis_key& rk, sstring& field, sstring& value);
-    future<scattered_message_ptr> hmset(const redis_key& rk, std::unordered_map<sstring, sstring>& kv);
-    future<scattered_message_ptr> hget(const redis_key& rk, sstring& field);
-    future<scattered_message_ptr> hdel(const redis_key& rk, sstring& field);
-    future<scattered_message_ptr> hdel_multi(const redis_key& rk, std::vector<sstring>& fields);
-    future<scattered_message_ptr> hexists(const redis_key& rk, sstring& field);
-    future<scattered_message_ptr> hstrlen(const redis_key& rk, sstring& field);
-    future<scattered_message_ptr> hlen(const redis_key& rk);
-    future<scattered_message_ptr> hincrby(const redis_key& rk, sstring& field, int64_t delta);
-    future<scattered_message_ptr> hincrbyfloat(const redis_key& rk, sstring& field, double delta);
-    future<scattered_message_ptr> hgetall(const redis_key& rk);
-    future<scattered_message_ptr> hgetall_values(const redis_key& rk);
-    future<scattered_message_ptr> hgetall_keys(const redis_key& rk);
-    future<scattered_message_ptr> hmget(const redis_key& rk, std::vector<sstring>& keys);
+    future<reply> hset(const redis_key& rk, sstring& field, sstring& value);
+    future<reply> hmset(const redis_key& rk, std::unordered_map<sstring, sstring>& kv);
+    future<reply> hget(const redis_key& rk, sstring& field);
+    future<reply> hdel(const redis_key& rk, sstring& field);
+    future<reply> hdel_multi(const redis_key& rk, std::vector<sstring>& fields);
+    future<reply> hexists(const redis_key& rk, sstring& field);
+    future<reply> hstrlen(const redis_key& rk, sstring& field);
+    future<reply> hlen(const redis_key& rk);
+    future<reply> hincrby(const redis_key& rk, sstring& field, int64_t delta);
+    future<reply> hincrbyfloat(const redis_key& rk, sstring& field, double delta);
+    future<reply> hgetall(const redis_key& rk);
+    future<reply> hgetall_values(const redis_key& rk);
+    future<reply> hgetall_keys(const redis_key& rk);
+    future<reply> hmget(const redis_key& rk, std::vector<sstring>& keys);
+    future<reply> hscan(const redis_key& rk, size_t cursor, const sstring& pattern, size_t count);
 
     // [SET]
-    future<scattered_message_ptr> sadds(const redis_key& rk, std::vector<sstring>& members);
+    future<reply> sadds(const redis_key& rk, std::vector<sstring>& members);
     bool sadds_direct(const redis_key& rk, std::vector<sstring>& members);
     bool sadd_direct(const redis_key& rk, sstring& member);
-    future<scattered_message_ptr> sadd(const redis_key& rk, sstring& member);
-    future<scattered_message_ptr> scard(const redis_key& rk);
-    future<scattered_message_ptr> sismember(const redis_key& rk, sstring& member);
-    future<scattered_message_ptr> smembers(const redis_key& rk);
-    future<scattered_message_ptr> spop(const redis_key& rk, size_t count);
-    future<scattered_message_ptr> srem(const redis_key& rk, sstring& member);
+    future<reply> sadd(const redis_key& rk, sstring& member);
+    future<reply> scard(const redis_key& rk);
+    future<reply> sismember(const redis_key& rk, sstring& member);
+    future<reply> smembers(const redis_key& rk);
+    future<reply> sscan(const redis_key& rk, size_t cursor, const sstring& pattern, size_t count);
+    future<reply> spop(const redis_key& rk, size_t count);
+    future<reply> srem(const redis_key& rk, sstring& member);
     bool srem_direct(const redis_key& rk, sstring& member);
-    future<scattered_message_ptr> srems(const redis_key& rk, std::vector<sstring>& members);
-    future<foreign_ptr<lw_shared_ptr<std::vector<sstring>>>> smembers_direct(const redis_key& rk);
-    future<scattered_message_ptr> srandmember(const redis_key& rk, size_t count);
+    future<reply> srems(const redis_key& rk, std::vector<sstring>& members);
+    future<foreign_ptr<lw_shared_ptr<set_members>>> smembers_direct(const redis_key& rk);
+    // Returns the number of members of the set, 0 if @rk holds no set.
+    size_t scard_direct(const redis_key& rk);
+    // Returns the @candidates which are members of the set, or which are not if
+    // @members is false. The candidates are read from the calling shard.
+    future<foreign_ptr<lw_shared_ptr<set_members>>> sfilter_direct(const redis_key& rk, const set_members& candidates, bool members);
+    // Replaces the value of @rk with the set of @members, @rk is removed if there
+    // is none. Returns the size of the new set.
+    size_t sstore_direct(const redis_key& rk, std::vector<sstring>& members);
+    // SUNION, SINTER and SDIFF (by @op) of the sets @keys, all owned by this
+    // shard. The result is stored in @dest if it is not nullptr.
+    future<reply> soperate(std::vector<sstring>& keys, sstring* dest, int op);
+    future<reply> smove(const redis_key& src, const redis_key& dst, sstring& member);
+    future<reply> srandmember(const redis_key& rk, size_t count);
 
 
     // [SORTED SET]
-    future<scattered_message_ptr> zadds(const redis_key& rk, std::unordered_map<sstring, double>& members, int flags);
+    future<reply> zadds(const redis_key& rk, std::unordered_map<sstring, double>& members, int flags);
     bool zadds_direct(const redis_key& rk, std::unordered_map<sstring, double>& members, int flags);
-    future<scattered_message_ptr> zcard(const redis_key& rk);
-    future<scattered_message_ptr> zrem(const redis_key& rk, std::vector<sstring>& members);
-    future<scattered_message_ptr> zcount(const redis_key& rk, double min, double max);
-    future<scattered_message_ptr> zincrby(const redis_key& rk, sstring& member, double delta);
-    future<scattered_message_ptr> zrange(const redis_key& rk, long begin, long end, bool reverse, bool with_score);
+    future<reply> zcard(const redis_key& rk);
+    future<reply> zrem(const redis_key& rk, std::vector<sstring>& members);
+    future<reply> zcount(const redis_key& rk, double min, double max);
+    future<reply> zincrby(const redis_key& rk, sstring& member, double delta);
+    future<reply> zrange(const redis_key& rk, long begin, long end, bool reverse, bool with_score);
     future<foreign_ptr<lw_shared_ptr<std::vector<std::pair<sstring, double>>>>> zrange_direct(const redis_key& rk, long begin, long end);
-    future<scattered_message_ptr> zrangebyscore(const redis_key& rk, double min, double max, bool reverse, bool with_score);
-    future<scattered_message_ptr> zrank(const redis_key& rk, sstring& member, bool reverse);
-    future<scattered_message_ptr> zscore(const redis_key& rk, sstring& member);
-    future<scattered_message_ptr> zremrangebyscore(const redis_key& rk, double min, double max);
-    future<scattered_message_ptr> zremrangebyrank(const redis_key& rk, size_t begin, size_t end);
+    // Returns the number of members of the sorted set, 0 if @rk holds no sorted set.
+    size_t zcard_direct(const redis_key& rk);
+    // Aggregates the range of members following @after, from the first one if
+    // @from_start, of the sorted sets of this shard in @sources, with their
+    // weights; at most @limit members of every source. The sources are read
+    // from the calling shard.
+    future<foreign_ptr<lw_shared_ptr<zset_partials>>> zaggregate_direct(const std::vector<std::pair<sstring, double>>& sources, int aggregate_flag, bool from_start, const sstring& after, size_t limit);
+    // Adds @members to the sorted set built aside as @id for the key @rk, a new
+    // one if @id is 0. Returns the id of the sorted set.
+    uint64_t zstage_direct(const redis_key& rk, uint64_t id, std::unordered_map<sstring, double>& members);
+    // Replaces the value of @rk by the sorted set built aside as @id, or drops
+    // it if there is none. Returns the size of the sorted set.
+    size_t zcommit_direct(const redis_key& rk, uint64_t id);
+    // Drops the sorted set built aside as @id, if any.
+    void zdiscard_direct(uint64_t id);
+    // ZUNIONSTORE and ZINTERSTORE of @sources into @rk, all owned by this shard.
+    future<reply> zstore(const redis_key& rk, const std::vector<std::pair<sstring, double>>& sources, int aggregate_flag, bool intersect);
+    future<reply> zrangebyscore(const redis_key& rk, double min, double max, bool reverse, bool with_score);
+    future<reply> zrank(const redis_key& rk, sstring& member, bool reverse);
+    future<reply> zscore(const redis_key& rk, sstring& member);
+    future<reply> zscan(const redis_key& rk, size_t cursor, const sstring& pattern, size_t count);
+    future<reply> zremrangebyscore(const redis_key& rk, double min, double max);
+    future<reply> zremrangebyrank(const redis_key& rk, size_t begin, size_t end);
 
     // [GEO]
-    future<scattered_message_ptr> geodist(const redis_key& rk, sstring& lpos, sstring& rpos, int flag);
-    future<scattered_message_ptr> geohash(const redis_key& rk, std::vector<sstring>& members);
-    future<scattered_message_ptr> geopos(const redis_key& rk, std::vector<sstring>& members);
+    future<reply> geodist(const redis_key& rk, sstring& lpos, sstring& rpos, int flag);
+    future<reply> geohash(const redis_key& rk, std::vector<sstring>& members);
+    future<reply> geopos(const redis_key& rk, std::vector<sstring>& members);
     using georadius_result_type = std::pair<std::vector<std::tuple<sstring, double, double, double, double>>, int>;
-    future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> georadius_coord_direct(const redis_key& rk, double longtitude, double latitude, double radius, size_t count, int flag);
-    future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> georadius_member_direct(const redis_key& rk, sstring& pos, double radius, size_t count, int flag);
+    future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> georadius_coord_direct(const redis_key& rk, geo::shape shape, size_t count, int flag);
+    // The center of @shape is the position of the member @pos.
+    future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> georadius_member_direct(const redis_key& rk, sstring& pos, geo::shape shape, size_t count, int flag);
 
     // [BITMAP]
-    future<scattered_message_ptr> setbit(const redis_key& rk, size_t offset, bool value);
-    future<scattered_message_ptr> getbit(const redis_key& rk, size_t offset);
-    future<scattered_message_ptr> bitcount(const redis_key& rk, long start, long end);
-    future<scattered_message_ptr> bitop(const redis_key& rk, int flags, std::vector<sstring>& keys);
-    future<scattered_message_ptr> bitpos(const redis_key& rk, bool bit, long start, long end);
+    future<reply> setbit(const redis_key& rk, size_t offset, bool value);
+    future<reply> getbit(const redis_key& rk, size_t offset);
+    future<reply> bitcount(const redis_key& rk, long start, long end);
+    // BITOP @op of @keys into @rk, all owned by this shard.
+    future<reply> bitop(const redis_key& rk, int op, std::vector<sstring>& keys);
+    // BITOP @op of the @keys owned by this shard, nullptr if one of them is not
+    // a string.
+    future<foreign_ptr<lw_shared_ptr<sstring>>> bitop_direct(std::vector<sstring>& keys, int op);
+    // Replaces the value of @rk with the string @value, @rk is removed if it is
+    // empty. Returns the length of the string.
+    size_t bitstore_direct(const redis_key& rk, sstring& value);
+    future<reply> bitpos(const redis_key& rk, bool bit, long start, long end, bool end_given);
 
     // [HLL]
-    future<scattered_message_ptr> pfadd(const redis_key& rk, std::vector<sstring>& keys);
-    future<scattered_message_ptr> pfcount(const redis_key& rk);
-    future<scattered_message_ptr> pfmerge(const redis_key& rk, uint8_t* merged_sources, size_t size);
-    future<foreign_ptr<lw_shared_ptr<sstring>>> get_hll_direct(const redis_key& rk);
+    future<reply> pfadd(const redis_key& rk, std::vector<sstring>& keys);
+    future<reply> pfcount(const redis_key& rk);
+    // Raises the registers of @rk to the @raw registers, read from the calling shard.
+    future<reply> pfmerge(const redis_key& rk, const uint8_t* raw);
+
+    // [EVICTION]
+    // Limits the memory used by the data of this shard, 0 means no limit. Once the
+    // limit is reached, entries are evicted according to the policy before every
+    // command run on this shard and every insertion, when no command holds an
+    // entry yet, instead of failing the writes. The writes growing the values of
+    // the keys evict as well as the writes creating them.
+    void configure_eviction(size_t maxmemory, eviction_policy policy);
+    // Evicts entries while the limit is exceeded, see configure_eviction().
+    void maybe_evict();
+    static bool parse_eviction_policy(const sstring& name, eviction_policy& policy);
+
+    // [TIER]
+    // Moves the cold strings of @min_value_size bytes or more to the flash
+    // tier at @path, up to @max_size bytes of it, once the data of this shard
+    // takes more than @memory bytes. They are compressed first if @compression.
+    future<> configure_tier(sstring path, size_t max_size, size_t memory, size_t min_value_size, bool compression);
+    // Reads the tiered values of @keys back into memory.
+    future<> promote(std::vector<sstring> keys);
+
+    // [EXPIRY]
+    // Limits the time an active expiry tick may hold the shard.
+    void configure_expiry(std::chrono::microseconds budget);
+
+    // [LAZYFREE]
+    // The values erased by DEL (@del), by the expiry (@expire), or overwritten
+    // (@overwrite) are freed lazily, as UNLINK always does: a collection of more
+    // than cache::LAZYFREE_THRESHOLD elements is unlinked from the cache at once,
+    // and freed in slices by a timer of the cache.
+    void configure_lazyfree(bool del, bool expire, bool overwrite);
+
+    // [TRANSACTIONS]
+    // WATCH of @key of the database @db: returns the version of the key, which
+    // every change of the key, or of its whole database, bumps until the last
+    // client watching it calls unwatch(). The expiry doesn't bump it.
+    uint64_t watch(size_t db, const sstring& key);
+    void unwatch(size_t db, const sstring& key);
+    bool watched_changed(size_t db, const sstring& key, uint64_t version) const;
+
+    // [COMPACTION]
+    // Compacts the sparsest LSA segments of this shard ahead of the allocations,
+    // from the idle reactor and every COMPACTION_STEP_MS, for at most @budget
+    // at a time, until @free_segments segments are free, so that an allocation
+    // rarely compacts or evicts by itself. Such stalls of @stall_threshold or
+    // more are logged with the command which ran into them.
+    void configure_compaction(size_t free_segments, std::chrono::microseconds budget, std::chrono::microseconds stall_threshold);
+
+    // [ENCODING]
+    // Hashes and sets of at most @max_entries fields, none of whose keys or values is
+    // longer than @max_value bytes, are packed in a single blob. Sets of at most
+    // @max_intset_entries integers are stored as sorted arrays of integers.
+    void configure_encoding(size_t max_entries, size_t max_value, size_t max_intset_entries);
+
+    // [PERSISTENCE]
+    // Writes the data of this shard to its RDB file in @directory. The entries
+    // are encoded a few buckets at a time and the shard keeps serving requests
+    // meanwhile, so the snapshot isn't a point in time one: an entry modified
+    // while saving is saved with either value, an entry inserted into a bucket
+    // already saved is missed.
+    future<> save(sstring directory, sstring dbfilename);
+    // Loads the snapshot file at @path into this shard, the entries are built in
+    // place as their elements are read. The entries owned by other shards, e.g.
+    // of a snapshot saved by another number of shards, are handed to @forward in
+    // batches of records, for load_records() of their shard.
+    using record_forwarder = std::function<future<>(unsigned shard, temporary_buffer<char> records)>;
+    future<> load(sstring path, record_forwarder forward);
+    future<> load_records(temporary_buffer<char> records);
+
+    // Appends the changes of this shard to its log in @directory from now on,
+    // the log of the last run must have been replayed before.
+    future<> configure_aof(sstring directory, sstring filename, aof_fsync_policy policy, std::chrono::milliseconds fsync_interval, size_t fsync_bytes);
+    // Rewrites the log of this shard with the commands rebuilding its data, as
+    // the snapshot does, the shard keeps serving meanwhile.
+    future<> rewrite_log();
+
+    // [REPLICAS]
+    // Publishes the copies of the keys of this shard to the other shards of
+    // @peers: @pinned are always published, if this shard owns them, and the
+    // hot keys once they're requested by replicate().
+    void configure_replication(distributed<database>& peers, const std::vector<sstring>& pinned);
+    // Promotes @key, owned by this shard and requested often by the clients of
+    // another shard. It's published until it's not requested for a while.
+    void replicate(const sstring& key);
+    // Whether the reads of @key are served by its copy on this shard.
+    inline bool holds_copy(const sstring& key) const {
+        return _replicas.holds(key, clock_type::now());
+    }
+    // The result of a request run by the owner shard waits until the copies
+    // of the keys it changed are dropped.
+    template <typename... T>
+    inline future<T...> replicated(future<T...>&& f) {
+        if (!_replicas.publishing() && _propagating == 0) {
+            return std::move(f);
+        }
+        return f.finally([this] {
+            return propagate();
+        });
+    }
+
+    // The result of a direct call, which has no reply to wait in logged(),
+    // waits until the log is synced if the call appended to it and the fsync
+    // policy is always. Fails with aof_write_error if the sync fails.
+    template <typename... T>
+    inline future<T...> durable(future<T...>&& f, uint64_t appended) {
+        if (!_aof.must_sync() || _aof.appended_commands() == appended) {
+            return std::move(f);
+        }
+        return f.then_wrapped([this] (future<T...> r) {
+            return _aof.sync().then_wrapped([r = std::move(r)] (future<> s) mutable {
+                try {
+                    s.get();
+                } catch (...) {
+                    r.ignore_ready_future();
+                    return make_exception_future<T...>(aof_write_error());
+                }
+                return std::move(r);
+            });
+        });
+    }
+    inline uint64_t log_appended() const {
+        return _aof.appended_commands();
+    }
+
+    // [REPLICATION]
+    // The backlog of this shard keeps the last @size bytes of its changes for its
+    // replicas, from the first PSYNC on. 0 means this shard has no replicas.
+    void configure_backlog(size_t size);
+    // PSYNC of a replica of this shard, which applied the changes of @replid up to
+    // @offset, -1 if none. The frames hold the reply: the stream goes on with
+    // sync_step() until it's synced, then with stream_step().
+    future<replication_chunk> psync(sstring replid, int64_t offset);
+    // The next piece of the snapshot of the running full sync, then its end.
+    // The entries are encoded a few buckets at a time, as save() does, and the
+    // changes of the entries already sent are sent after the snapshot.
+    future<replication_chunk> sync_step();
+    // The replica left during its full sync.
+    void abort_sync();
+    // The changes of @replid after @offset, only whole commands, or a heartbeat
+    // if none came for a while. Fails once @offset isn't in the backlog any more.
+    future<replication_chunk> stream_step(sstring replid, uint64_t offset);
+    inline void close_stream() { _backlog.close_stream(); }
+    inline const replication_backlog& backlog() const { return _backlog; }
+    // Drops all the entries of this shard, before the snapshot of its master is
+    // loaded. The replicas of this shard sync again.
+    void flush_all();
+
+    // [CLUSTER]
+    // The keys of this shard in the hash slot @slot, up to @count of them. The
+    // shard is traversed a few buckets at a time, as the snapshot is, and keeps
+    // serving meanwhile.
+    future<std::vector<sstring>> keys_in_slot(unsigned slot, size_t count);
+    future<size_t> count_keys_in_slot(unsigned slot);
+    // Encodes the entries of @keys found in this shard into @encoder, as the
+    // commands rebuilding them, each after a DEL of its key if @replace. The
+    // changes of these entries are encoded into @encoder too from now on, until
+    // end_migration(), which removes the entries if @remove. Returns the number
+    // of entries encoded.
+    size_t begin_migration(std::vector<sstring>& keys, bool replace, aof_encoder& encoder);
+    void end_migration(bool remove);
+
+    // [INFO]
+    // The statistics of a shard reported by INFO, which sums them over the shards
+    // and lists the ones of every shard.
+    struct shard_info {
+        size_t keys = 0;
+        size_t expires = 0;
+        // The keys and the expiring keys of every database.
+        std::vector<std::pair<size_t, size_t>> databases;
+        uint64_t reads = 0;
+        uint64_t hits = 0;
+        uint64_t expired = 0;
+        uint64_t evicted = 0;
+        uint64_t local_dispatch = 0;
+        uint64_t remote_dispatch = 0;
+        // Memory allocated by the shard, and the memory it owns.
+        size_t used_memory = 0;
+        size_t total_memory = 0;
+        // The LSA region of the data, and the one of all the regions of the shard.
+        size_t dataset_used = 0;
+        size_t dataset_total = 0;
+        size_t lsa_used = 0;
+        size_t lsa_total = 0;
+        size_t lsa_free_segments = 0;
+        size_t lsa_zones = 0;
+        size_t lsa_segments_compacted = 0;
+        size_t lsa_segments_migrated = 0;
+        size_t non_lsa_memory = 0;
+        size_t maxmemory = 0;
+        const char* maxmemory_policy = "";
+        // The keys of the shard published to the other shards, the copies of
+        // the keys of the other shards held, and the reads they served.
+        size_t replicated_keys = 0;
+        size_t replica_copies = 0;
+        uint64_t replica_hits = 0;
+        uint64_t replica_invalidations = 0;
+        // The backlog of the changes kept for the replicas of the shard.
+        sstring repl_id;
+        uint64_t repl_offset = 0;
+        size_t repl_backlog_size = 0;
+        unsigned repl_streams = 0;
+        uint64_t repl_full_syncs = 0;
+        uint64_t repl_partial_syncs = 0;
+        // The clients blocked on the lists of the shard.
+        size_t blocked_clients = 0;
+        // The values moved to the flash tier, the bytes they take there, and
+        // the values read back.
+        size_t tiered_values = 0;
+        size_t tiered_bytes = 0;
+        uint64_t tier_promotions = 0;
+        // The entries whose values are being freed lazily, and the ones done.
+        size_t lazyfree_pending = 0;
+        uint64_t lazyfreed = 0;
+        // The bytes moved by the LSA compactions, and by the background ones,
+        // and the allocations which stalled compacting or evicting themselves.
+        uint64_t lsa_compacted_bytes = 0;
+        uint64_t lsa_background_compacted_bytes = 0;
+        uint64_t lsa_stall_moved_bytes = 0;
+        latency_histogram lsa_stalls;
+        shard_info& operator += (const shard_info& o);
+    };
+    shard_info info();
+    static const char* eviction_policy_name(eviction_policy policy);
+    // MEMORY USAGE, the bytes allocated for the entry of @rk.
+    future<reply> memory_usage(const redis_key& rk);
 
     future<> stop();
 private:
-    future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> georadius(const sset_lsa&, double longtitude, double latitude, double radius, size_t count, int flag);
+    // Maximum number of buckets encoded in a step of the snapshot.
+    static constexpr const size_t SNAPSHOT_BUCKETS_PER_STEP = 1024;
+    // The encoded entries are written to the file once the buffer is this large.
+    static constexpr const size_t SNAPSHOT_BUFFER_SIZE = 128 * 1024;
+    seastar::gate _snapshot_gate;
+    void begin_snapshot(rdb_writer& writer);
+    // Encodes the entries of at most @buckets buckets.
+    bool save_step(rdb_writer& writer, size_t& index, size_t& position, size_t buckets);
+    // Reads the tiered values of the buckets the next step from @index and
+    // @position encodes, see flash_tier::stage(). Returns the number of buckets
+    // the step may visit.
+    future<size_t> stage_tiered(size_t index, size_t position);
+    // The step of a full sync, once the tiered values of its @buckets are staged.
+    future<replication_chunk> sync_step(size_t buckets);
+    // The snapshot is read in buffers of this size, a few of them ahead.
+    static constexpr const size_t LOAD_BUFFER_SIZE = 1024 * 1024;
+    static constexpr const unsigned LOAD_READ_AHEAD = 4;
+    // The records forwarded to a shard are sent once this many bytes are batched.
+    static constexpr const size_t LOAD_BATCH_SIZE = 256 * 1024;
+    struct load_context;
+    // Builds the entries out of the items decoded so far.
+    void load_step(rdb_reader& reader, load_context& context);
+    future<> forward_records(load_context& context, record_forwarder& forward, bool all);
+    unsigned _loading = 0;
+    uint64_t _load_total_bytes = 0;
+    append_only_log _aof;
+    // The position of the running rewrite of the log, see rewritten().
+    size_t _rewrite_index = 0;
+    size_t _rewrite_position = 0;
+    bool rewrite_step(aof_encoder& encoder, size_t buckets);
+    // Whether the entry of @rk was already copied by the running rewrite, its
+    // changes go to the rewritten log too then.
+    inline bool rewritten(const redis_key& rk)
+    {
+        if (!_aof.rewriting()) {
+            return false;
+        }
+        if (current_store_index != _rewrite_index) {
+            return current_store_index < _rewrite_index;
+        }
+        return current_store().traversal_position(rk.hash()) < _rewrite_position;
+    }
+    replication_backlog _backlog;
+    // The position of the running full sync, see synced().
+    rdb_writer _sync_writer { REPLICATION_FRAME_SIZE };
+    size_t _sync_index = 0;
+    size_t _sync_position = 0;
+    // Whether the entry of @rk was already sent by the running full sync, its
+    // changes are sent after the snapshot then.
+    inline bool synced(const redis_key& rk)
+    {
+        if (!_backlog.syncing()) {
+            return false;
+        }
+        if (current_store_index != _sync_index) {
+            return current_store_index < _sync_index;
+        }
+        return current_store().traversal_position(rk.hash()) < _sync_position;
+    }
+    // The entries migrating to another node, and the encoder of their changes.
+    std::unordered_set<sstring> _migrating_keys;
+    aof_encoder* _migration = nullptr;
+    template <typename Func>
+    future<> for_each_in_slot(unsigned slot, Func func);
+    // Whether the changes are logged, the commands which build their arguments
+    // only for the log check it first.
+    inline bool logging() const
+    {
+        return _aof.enabled() || _backlog.enabled() || _replicas.publishing() || _migration != nullptr || _watched_keys > 0;
+    }
+    // The keys watched by the clients of every database, and how many clients
+    // watch each of them. The versions are taken from _watch_version.
+    struct watch_state {
+        size_t _watchers = 0;
+        uint64_t _version = 0;
+    };
+    std::vector<std::unordered_map<sstring, watch_state>> _watched;
+    size_t _watched_keys = 0;
+    uint64_t _watch_version = 0;
+    void touch_watched(const sstring& key);
+    void touch_all_watched();
+    // Appends the change of @rk to the log and to the backlog, as a command
+    // replaying it, and drops the copies of @rk if it's published. The changes
+    // of a migrating entry follow it to the node importing its slot.
+    template <typename... Args>
+    inline void log(const redis_key& rk, const char* command, const Args&... args)
+    {
+        if (_watched_keys > 0) {
+            touch_watched(rk.key());
+        }
+        if (_replicas.publishing()) {
+            _replicas.changed(rk.key());
+        }
+        if (_aof.enabled()) {
+            _aof.append(current_store_index, rewritten(rk), command, rk, args...);
+        }
+        if (_backlog.enabled()) {
+            _backlog.append(current_store_index, synced(rk), command, rk, args...);
+        }
+        if (_migration != nullptr && _migrating_keys.count(rk.key())) {
+            _migration->append(command, rk, args...);
+        }
+    }
+    // Appends a change of whole databases, e.g. FLUSHDB, which is refused while
+    // a rewrite or a full sync runs.
+    template <typename... Args>
+    inline void log_db(const char* command, const Args&... args)
+    {
+        if (_watched_keys > 0) {
+            touch_all_watched();
+        }
+        if (_aof.enabled()) {
+            _aof.append(current_store_index, false, command, args...);
+        }
+        if (_backlog.enabled()) {
+            _backlog.append(current_store_index, false, command, args...);
+        }
+    }
+    inline void log_zadd(const redis_key& rk, const std::unordered_map<sstring, double>& members, int flags)
+    {
+        if (flags & ZADD_NX) {
+            log(rk, "ZADD", "NX", members);
+        }
+        else if (flags & ZADD_XX) {
+            log(rk, "ZADD", "XX", members);
+        }
+        else {
+            log(rk, "ZADD", members);
+        }
+    }
+    // The reply of a change waits for the log, if every change must be flushed
+    // before it's acknowledged.
+    future<reply> logged(future<reply>&& r);
+
+    distributed<database>* _peers = nullptr;
+    key_replicas _replicas;
+    blocked_lists _blocked;
+    // Takes the element at the @left or right end of the list @rk for a pop,
+    // or only tells there is one unless @take.
+    void pop_blocked(const redis_key& rk, bool left, bool take, blocked_pop& result);
+    void take_blocked(const redis_key& rk, cache_entry* e, bool left, blocked_pop& result);
+    // The element popped waits for the log as the replies do, see logged().
+    future<blocked_pop> logged(blocked_pop result);
+    // Serves the clients blocked on the list @rk of @e, just pushed to.
+    void serve_blocked(const redis_key& rk, cache_entry* e);
+    // The pushes of the copies and their drops run one after the other, so
+    // the copies of a key end as the last of them left them.
+    shared_future<> _propagation { make_ready_future<>() };
+    unsigned _propagating = 0;
+    timer<lowres_clock> _replica_timer;
+    // Copies the value of @key and queues its push to the other shards.
+    bool publish(const sstring& key);
+    void sweep_replicas();
+    void propagate_step(std::function<future<>()> step);
+    // Queues the drops of the copies of the changed keys, the future resolves
+    // once every step queued so far ran.
+    future<> propagate();
+    // The expiry is logged as an absolute unix time (ms), which stays right
+    // when the log is replayed later.
+    static inline int64_t unix_time_after(long ms)
+    {
+        using namespace std::chrono;
+        return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count() + ms;
+    }
+    cache_entry* make_string_entry(const redis_key& rk, const sstring& val);
+    flash_tier _tier;
+    // Number of entries sampled to pick one to move to the tier.
+    static constexpr const size_t TIER_SAMPLES = 5;
+    // Maximum number of values moved to the tier by a step.
+    static constexpr const size_t TIER_MAX_PER_STEP = 256;
+    static constexpr const unsigned TIER_STEP_MS = 10;
+    size_t _tier_memory = 0;
+    size_t _tier_store_index = 0;
+    timer<lowres_clock> _tier_timer;
+
+    static constexpr const unsigned COMPACTION_STEP_MS = 10;
+    // The last stalls of at least _stall_threshold, logged by the next step.
+    static constexpr const size_t STALL_TRACE_SIZE = 16;
+    std::chrono::microseconds _compaction_budget { 0 };
+    std::chrono::microseconds _stall_threshold { 0 };
+    timer<lowres_clock> _compaction_timer;
+    latency_histogram _stall_latencies;
+    std::array<logalloc::tracker::stall, STALL_TRACE_SIZE> _stall_traces;
+    uint64_t _stall_traced = 0;
+    uint64_t _stall_logged = 0;
+    // Runs from the allocation which stalled, it doesn't allocate.
+    void on_stall(const logalloc::tracker::stall& s);
+    void compaction_step();
+    // Moves the coldest strings to the tier while the data is too large. No
+    // value is moved while a snapshot, a rewrite or a full sync runs, the
+    // values they need are staged before.
+    void tier_step();
+    // Runs @func on @rk once its tiered value is back in memory.
+    template <typename Func>
+    inline futurize_t<std::result_of_t<Func(const redis_key&)>> promoted(const redis_key& rk, Func&& func)
+    {
+        auto key = rk.key();
+        return promote({ key }).then([this, index = current_store_index, key = std::move(key), func = std::forward<Func>(func)] () mutable {
+            return do_with(std::move(key), [this, index, func = std::move(func)] (sstring& key) mutable {
+                return with_store(index, [&func, &key] { return func(redis_key { key }); });
+            });
+        });
+    }
+    // The @keys whose value is in the tier.
+    std::vector<sstring> tiered_keys(std::vector<sstring>& keys);
+    // Number of entries sampled to pick one to evict.
+    static constexpr const size_t EVICTION_SAMPLES = 5;
+    // Maximum number of entries evicted before every command or insertion.
+    static constexpr const size_t EVICTION_MAX_PER_WRITE = 64;
+    size_t _maxmemory = 0;
+    eviction_policy _eviction_policy = eviction_policy::noeviction;
+    size_t _eviction_store_index = 0;
+    bool evict_entry();
+    void count_released_entry(entry_type type);
+    void count_inserted_entry(entry_type type);
+    bool _lazyfree_del = false;
+    bool _lazyfree_expire = false;
+    // Erases the entry of @rk, as UNLINK if @lazily, and logs @command.
+    bool remove(const redis_key& rk, bool lazily, const char* command);
+    // Looks up the strings @keys, nullptr if missing. Returns false if a key
+    // holds another type. The strings stay in place under a reclaim lock only.
+    bool bitop_sources(std::vector<sstring>& keys, std::vector<bitmap_view>& sources);
+    // Adds the weighted scores of the range of members following @after of the
+    // sorted sets @sources to @aggregated, with the number of sets holding each
+    // member, at most @limit members of every set. Returns whether a set has
+    // members after the range, which then ends at @last: the members after it
+    // are left out of @aggregated.
+    bool zaggregate(const std::vector<std::pair<sstring, double>>& sources, int aggregate_flag, bool from_start, const sstring& after, size_t limit,
+                    std::unordered_map<sstring, std::pair<double, size_t>>& aggregated, sstring& last);
+    // Replaces the value of @rk by @e, which is in no table, or drops it if @e
+    // is nullptr, and logs the members of the sorted set.
+    size_t replace_sset(const redis_key& rk, cache_entry* e);
+    // The ids of the sorted sets built aside, unique across the databases.
+    uint64_t _last_staged_id = 0;
+    future<foreign_ptr<lw_shared_ptr<georadius_result_type>>> georadius(const sset_lsa&, const geo::shape& shape, size_t count, int flag);
     static inline long alignment_index_base_on(size_t size, long index)
     {
         if (index < 0) {
@@ -158,7 +786,7 @@ private:
     }
 
     template<bool Key, bool Value>
-    future<scattered_message_ptr> hgetall_impl(const redis_key& rk)
+    future<reply> hgetall_impl(const redis_key& rk)
     {
         ++_stat._read;
         return current_store().with_entry_run(rk, [this] (const cache_entry* e) {
@@ -169,17 +797,27 @@ private:
                 return reply_builder::build(msg_type_err);
             }
             auto& map = e->value_map();
-            std::vector<const dict_entry*> entries;
-            map.fetch(entries);
-            if (!entries.empty()) ++_stat._hit;
-            return reply_builder::build<Key, Value>(entries);
+            if (map.size() > 0) ++_stat._hit;
+            return reply_builder::build<Key, Value>(current_store(), *this, *e);
         });
     }
 private:
-    static const int DEFAULT_DB_COUNT = 1;
-    cache _cache_stores[DEFAULT_DB_COUNT];
+    // Every database starts with a small table, grown as it's filled.
+    static constexpr const size_t STORE_INITIAL_SIZE = 64;
+    std::vector<std::unique_ptr<cache>> _cache_stores;
     size_t current_store_index = 0;
-    inline cache& current_store() { return _cache_stores[current_store_index]; }
+    inline cache& current_store() { return *_cache_stores[current_store_index]; }
+    std::chrono::microseconds _expiry_budget = DEFAULT_EXPIRY_BUDGET;
+    bool _lazyfree_overwrite = false;
+    std::unique_ptr<cache> make_store();
+    // Replaces the database @index by an empty one, and queues the former one
+    // to the flush timer.
+    void drop_store(size_t index);
+    // The tables dropped by FLUSHDB, freed a slice at a time by the flush timer.
+    static constexpr const size_t FLUSH_SLICE = 4096;
+    std::deque<std::unique_ptr<cache>> _flushed_stores;
+    timer<lowres_clock> _flush_timer;
+    void flush_step();
     seastar::metrics::metric_groups _metrics;
     struct stats {
         uint64_t _read = 0;
@@ -192,6 +830,20 @@ private:
         uint64_t _total_zset_entries = 0;
         uint64_t _total_bitmap_entries = 0;
         uint64_t _total_hll_entries = 0;
+        uint64_t _local_dispatch = 0;
+        uint64_t _remote_dispatch = 0;
+        uint64_t _evicted_entries = 0;
+        uint64_t _saved_entries = 0;
+        uint64_t _saved_bytes = 0;
+        uint64_t _loaded_entries = 0;
+        uint64_t _loaded_bytes = 0;
+        uint64_t _forwarded_entries = 0;
+        uint64_t _tier_promotions = 0;
+        // The counters of the databases flushed and freed.
+        uint64_t _flushed_expired_entries = 0;
+        uint64_t _flushed_lazyfreed_entries = 0;
+        // Bytes moved by the allocations which stalled compacting.
+        uint64_t _stall_moved_bytes = 0;
 
         uint64_t _echo = 0;
         uint64_t _set = 0;
@@ -274,6 +926,10 @@ private:
         uint64_t _geohash = 0;
         uint64_t _geopos = 0;
         uint64_t _georadius = 0;
+        uint64_t _scan = 0;
+        uint64_t _hscan = 0;
+        uint64_t _sscan = 0;
+        uint64_t _zscan = 0;
         uint64_t _setbit = 0;
         uint64_t _getbit = 0;
         uint64_t _bitcount = 0;
@@ -287,5 +943,9 @@ private:
     stats _stat;
     void setup_metrics();
     size_t sum_expiring_entries();
+    size_t sum_expired_entries();
+    size_t sum_expiry_backlog();
+    size_t sum_lazyfree_backlog();
+    uint64_t sum_lazyfreed_entries();
 };
 }
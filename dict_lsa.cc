@@ -19,4 +19,516 @@
 *
 */
 #include "dict_lsa.hh"
-namespace redis {}
+namespace redis {
+
+thread_local size_t dict_lsa::max_packed_entries = 128;
+thread_local size_t dict_lsa::max_packed_value = 64;
+thread_local size_t dict_lsa::max_intset_entries = 512;
+
+bool dict_lsa::valid_configuration(size_t entries, size_t value, size_t intset_entries)
+{
+    // the largest field: the type, the key and a value of either kind.
+    const size_t field = 1 + varint_size(value) + value + std::max(varint_size(value) + value, sizeof(int64_t));
+    return value <= max_blob_size && entries <= max_blob_size / field && intset_entries <= max_blob_size / sizeof(int64_t);
+}
+
+// The packed form of a collection is the sequence of its fields, every one
+// encoded as:
+//
+//   type (1 byte) | key length (varint) | key | value
+//
+// where the value is a varint length and the bytes for BYTES, or the 8 bytes
+// of the number for INTEGER and FLOAT. A member of a set is an empty BYTES.
+namespace {
+
+inline dict_field::entry_type type_of(int64_t) { return dict_field::entry_type::INTEGER; }
+inline dict_field::entry_type type_of(double) { return dict_field::entry_type::FLOAT; }
+inline int64_t& value_of(dict_field& f, int64_t) { return f._integer; }
+inline double& value_of(dict_field& f, double) { return f._float; }
+inline void incr_entry(dict_entry& e, int64_t delta) { e.value_integer_incr(delta); }
+inline void incr_entry(dict_entry& e, double delta) { e.value_float_incr(delta); }
+
+inline dict_field make_field(const sstring& key)
+{
+    dict_field f;
+    f._key = key.data();
+    f._key_size = key.size();
+    return f;
+}
+
+dict_entry* make_entry(const dict_field& f)
+{
+    auto key = sstring(f.key_data(), f.key_size());
+    if (f.type_of_integer()) {
+        return current_allocator().construct<dict_entry>(key, f.value_integer());
+    }
+    else if (f.type_of_float()) {
+        return current_allocator().construct<dict_entry>(key, f.value_float());
+    }
+    return current_allocator().construct<dict_entry>(key, sstring(f.value_bytes_data(), f.value_bytes_size()));
+}
+}
+
+dict_field dict_lsa::decode(const char*& p)
+{
+    dict_field f;
+    f._type = static_cast<dict_field::entry_type>(*p++);
+    f._key_size = read_varint(p);
+    f._key = p;
+    p += f._key_size;
+    switch (f._type) {
+        case dict_field::entry_type::BYTES:
+            f._data_size = read_varint(p);
+            f._data = p;
+            p += f._data_size;
+            break;
+        case dict_field::entry_type::FLOAT:
+            memcpy(&f._float, p, sizeof(double));
+            p += sizeof(double);
+            break;
+        case dict_field::entry_type::INTEGER:
+            memcpy(&f._integer, p, sizeof(int64_t));
+            p += sizeof(int64_t);
+            break;
+    }
+    return f;
+}
+
+size_t dict_lsa::encoded_size(const dict_field& f)
+{
+    size_t size = 1 + varint_size(f.key_size()) + f.key_size();
+    if (f.type_of_bytes()) {
+        return size + varint_size(f.value_bytes_size()) + f.value_bytes_size();
+    }
+    return size + sizeof(int64_t);
+}
+
+char* dict_lsa::encode(char* p, const dict_field& f)
+{
+    *p++ = static_cast<char>(f._type);
+    p = write_varint(p, f.key_size());
+    memcpy(p, f.key_data(), f.key_size());
+    p += f.key_size();
+    switch (f._type) {
+        case dict_field::entry_type::BYTES:
+            p = write_varint(p, f.value_bytes_size());
+            // the members of a set have no data at all.
+            p = std::copy_n(f.value_bytes_data(), f.value_bytes_size(), p);
+            break;
+        case dict_field::entry_type::FLOAT:
+            memcpy(p, &f._float, sizeof(double));
+            p += sizeof(double);
+            break;
+        case dict_field::entry_type::INTEGER:
+            memcpy(p, &f._integer, sizeof(int64_t));
+            p += sizeof(int64_t);
+            break;
+    }
+    return p;
+}
+
+long dict_lsa::packed_find(const sstring& key) const
+{
+    auto begin = packed_begin();
+    auto p = begin;
+    for (size_t i = 0; i < _packed_count; ++i) {
+        auto offset = p - begin;
+        auto f = decode(p);
+        if (f.key_size() == key.size() && memcmp(f.key_data(), key.data(), key.size()) == 0) {
+            return offset;
+        }
+    }
+    return -1;
+}
+
+void dict_lsa::packed_store(long offset, const dict_field* f)
+{
+    auto begin = packed_begin();
+    const size_t size = _packed.size();
+    size_t at = size;
+    size_t old_size = 0;
+    if (offset >= 0) {
+        at = static_cast<size_t>(offset);
+        auto p = begin + at;
+        decode(p);
+        old_size = (p - begin) - at;
+    }
+    // @f may point into the old blob, which is released only once the new
+    // one is written.
+    managed_bytes blob(managed_bytes::initialized_later(), size - old_size + (f ? encoded_size(*f) : 0));
+    auto out = reinterpret_cast<char*>(blob.data());
+    memcpy(out, begin, at);
+    out += at;
+    if (f) {
+        out = encode(out, *f);
+    }
+    memcpy(out, begin + at + old_size, size - at - old_size);
+    _packed = std::move(blob);
+    if (f == nullptr) {
+        --_packed_count;
+    }
+    else if (offset < 0) {
+        ++_packed_count;
+    }
+}
+
+bool dict_lsa::fits_packed(const dict_field& f) const
+{
+    return f.key_size() <= max_packed_value && (!f.type_of_bytes() || f.value_bytes_size() <= max_packed_value);
+}
+
+void dict_lsa::convert_to_table()
+{
+    auto table = std::make_unique<dict_table>(_packed_count);
+    auto p = packed_begin();
+    for (size_t i = 0; i < _packed_count; ++i) {
+        table->insert(make_entry(decode(p)));
+    }
+    _table = std::move(table);
+    _packed = managed_bytes();
+    _packed_count = 0;
+}
+
+void dict_lsa::convert_from_integers()
+{
+    intset integers(std::move(_integers));
+    _integers.clear();
+    size_t size = 0;
+    bool fits = integers.size() <= max_packed_entries;
+    integers.for_each([this, &size, &fits] (int64_t member) {
+        auto f = dict_field::of_integer_member(member);
+        fits = fits && fits_packed(f);
+        size += encoded_size(f);
+    });
+    if (fits) {
+        managed_bytes blob(managed_bytes::initialized_later(), size);
+        auto out = reinterpret_cast<char*>(blob.data());
+        integers.for_each([&out] (int64_t member) {
+            out = encode(out, dict_field::of_integer_member(member));
+        });
+        _packed = std::move(blob);
+        _packed_count = integers.size();
+        return;
+    }
+    auto table = std::make_unique<dict_table>(integers.size());
+    integers.for_each([&table] (int64_t member) {
+        table->insert(make_entry(dict_field::of_integer_member(member)));
+    });
+    _table = std::move(table);
+}
+
+bool dict_lsa::store(const sstring& key, const dict_field& f)
+{
+    if (integers()) {
+        convert_from_integers();
+    }
+    if (packed()) {
+        auto offset = packed_find(key);
+        if (fits_packed(f) && (offset >= 0 || _packed_count < max_packed_entries)) {
+            packed_store(offset, &f);
+            return offset < 0;
+        }
+        convert_to_table();
+    }
+    auto entry = make_entry(f);
+    bool inserted = !_table->erase(key);
+    _table->insert(entry);
+    return inserted;
+}
+
+bool dict_lsa::insert(const sstring& key)
+{
+    int64_t member;
+    if ((integers() || (packed() && _packed_count == 0)) && intset::parse(key.data(), key.size(), member)) {
+        if (_integers.contains(member)) {
+            return false;
+        }
+        if (_integers.size() < max_intset_entries) {
+            return _integers.insert(member);
+        }
+    }
+    if (exists(key)) {
+        return false;
+    }
+    return store(key, make_field(key));
+}
+
+bool dict_lsa::insert(const sstring& key, const sstring& val)
+{
+    auto f = make_field(key);
+    f._data = val.data();
+    f._data_size = val.size();
+    return store(key, f);
+}
+
+bool dict_lsa::insert(const sstring& key, int64_t val)
+{
+    auto f = make_field(key);
+    f._type = dict_field::entry_type::INTEGER;
+    f._integer = val;
+    return store(key, f);
+}
+
+bool dict_lsa::insert(const sstring& key, double val)
+{
+    auto f = make_field(key);
+    f._type = dict_field::entry_type::FLOAT;
+    f._float = val;
+    return store(key, f);
+}
+
+template <typename T>
+bool dict_lsa::incr_impl(const sstring& key, T delta)
+{
+    if (integers()) {
+        convert_from_integers();
+    }
+    if (packed()) {
+        auto offset = packed_find(key);
+        if (offset >= 0) {
+            auto p = packed_begin() + offset;
+            auto f = decode(p);
+            if (f._type != type_of(delta)) {
+                return false;
+            }
+            // the number is the tail of the field, it is updated in place.
+            auto value = value_of(f, delta) + delta;
+            auto end = p - packed_begin();
+            memcpy(reinterpret_cast<char*>(_packed.data()) + end - sizeof(T), &value, sizeof(T));
+            return true;
+        }
+    }
+    else {
+        auto e = _table->find(key);
+        if (e != nullptr) {
+            if (dict_field(*e)._type != type_of(delta)) {
+                return false;
+            }
+            incr_entry(*e, delta);
+            return true;
+        }
+    }
+    insert(key, delta);
+    return true;
+}
+
+template bool dict_lsa::incr_impl<int64_t>(const sstring& key, int64_t delta);
+template bool dict_lsa::incr_impl<double>(const sstring& key, double delta);
+
+bool dict_lsa::erase(const sstring& key)
+{
+    if (integers()) {
+        int64_t member;
+        return intset::parse(key.data(), key.size(), member) && _integers.erase(member);
+    }
+    if (packed()) {
+        auto offset = packed_find(key);
+        if (offset < 0) {
+            return false;
+        }
+        packed_store(offset, nullptr);
+        return true;
+    }
+    return _table->erase(key);
+}
+
+dict_field dict_lsa::find(const sstring& key) const
+{
+    if (integers()) {
+        int64_t member;
+        if (intset::parse(key.data(), key.size(), member) && _integers.contains(member)) {
+            return dict_field::of_integer_member(member);
+        }
+        return dict_field();
+    }
+    if (packed()) {
+        auto offset = packed_find(key);
+        if (offset < 0) {
+            return dict_field();
+        }
+        auto p = packed_begin() + offset;
+        return decode(p);
+    }
+    auto e = _table->find(key);
+    return e != nullptr ? dict_field(*e) : dict_field();
+}
+
+bool dict_lsa::exists(int64_t member) const
+{
+    if (integers()) {
+        return _integers.contains(member);
+    }
+    char digits[intset::max_digits];
+    return exists(sstring(digits, intset::format(member, digits)));
+}
+
+dict_field dict_lsa::at(size_t index) const
+{
+    assert(index < size());
+    if (integers()) {
+        return dict_field::of_integer_member(_integers.at(index));
+    }
+    if (packed()) {
+        auto p = packed_begin();
+        auto f = decode(p);
+        while (index-- > 0) {
+            f = decode(p);
+        }
+        return f;
+    }
+    return dict_field(_table->at(index));
+}
+
+size_t dict_table::bucket_count_for(size_t size)
+{
+    size_t count = 16;
+    while (count * load_factor <= size) {
+        count *= 2;
+    }
+    return count;
+}
+
+dict_table::dict_table(size_t size)
+    : _initial_bucket_count(bucket_count_for(size))
+    , _resize_up_threshold(_initial_bucket_count * load_factor)
+    , _buckets(new bucket_type[_initial_bucket_count])
+    , _store(table_type::bucket_traits(_buckets.get(), _initial_bucket_count))
+    , _old_store(table_type::bucket_traits(_spare_bucket, 1))
+{
+}
+
+dict_table::~dict_table()
+{
+    _store.clear_and_dispose(current_deleter<dict_entry>());
+    _old_store.clear_and_dispose(current_deleter<dict_entry>());
+}
+
+size_t dict_table::memory_usage() const
+{
+    size_t usage = sizeof(dict_table) + _store.bucket_count() * sizeof(bucket_type);
+    if (rehashing()) {
+        usage += _old_store.bucket_count() * sizeof(bucket_type);
+    }
+    for_each([&usage] (const dict_entry& e) {
+        usage += sizeof(dict_entry) + e._key.external_memory_usage();
+        if (e._type == dict_entry::entry_type::BYTES) {
+            usage += e._u._data.external_memory_usage();
+        }
+    });
+    return usage;
+}
+
+void dict_table::start_rehash(size_t new_size)
+{
+    std::unique_ptr<bucket_type[]> buckets;
+    try {
+        buckets.reset(new bucket_type[new_size]);
+    } catch (const std::bad_alloc& e) {
+        return;
+    }
+    _old_store.swap(_store);
+    _old_buckets = std::move(_buckets);
+    _buckets = std::move(buckets);
+    _store.rehash(table_type::bucket_traits(_buckets.get(), new_size));
+    _rehash_position = 0;
+    _resize_up_threshold = new_size * load_factor;
+    _resize_down_threshold = new_size > _initial_bucket_count ? new_size * shrink_factor : 0;
+}
+
+void dict_table::rehash_step(size_t count)
+{
+    auto bucket_count = _old_store.bucket_count();
+    for (; count > 0 && _rehash_position < bucket_count; --count, ++_rehash_position) {
+        auto it = _old_store.begin(_rehash_position);
+        while (it != _old_store.end(_rehash_position)) {
+            auto& e = *it;
+            ++it;
+            _old_store.erase(_old_store.iterator_to(e));
+            _store.insert(e);
+        }
+    }
+    if (_rehash_position == bucket_count) {
+        assert(_old_store.empty());
+        _old_store.rehash(table_type::bucket_traits(_spare_bucket, 1));
+        _old_buckets.reset();
+        _rehash_position = 0;
+    }
+}
+
+void dict_table::maybe_rehash()
+{
+    if (rehashing()) {
+        rehash_step(rehash_step_buckets);
+        return;
+    }
+    auto size = _store.size();
+    if (size >= _resize_up_threshold) {
+        start_rehash(_store.bucket_count() * 2);
+    } else if (size < _resize_down_threshold) {
+        start_rehash(_store.bucket_count() / 2);
+    }
+}
+
+dict_entry* dict_table::find(const sstring& key) const
+{
+    dict_entry::lookup_key k(key);
+    auto& store = store_of(k._hash);
+    auto it = store.find(k, dict_entry::hash(), dict_entry::equal());
+    return it != store.end() ? const_cast<dict_entry*>(&*it) : nullptr;
+}
+
+void dict_table::insert(dict_entry* e)
+{
+    store_of(e->_key_hash).insert(*e);
+    maybe_rehash();
+}
+
+bool dict_table::erase(const sstring& key)
+{
+    dict_entry::lookup_key k(key);
+    auto& store = store_of(k._hash);
+    auto it = store.find(k, dict_entry::hash(), dict_entry::equal());
+    if (it == store.end()) {
+        return false;
+    }
+    store.erase_and_dispose(it, current_deleter<dict_entry>());
+    maybe_rehash();
+    return true;
+}
+
+bool dict_table::release(size_t& budget)
+{
+    auto drain = [this, &budget] (table_type& store) {
+        while (budget > 0 && !store.empty()) {
+            auto it = store.begin(_release_position);
+            if (it == store.end(_release_position)) {
+                ++_release_position;
+            } else {
+                store.erase_and_dispose(store.iterator_to(*it), current_deleter<dict_entry>());
+            }
+            --budget;
+        }
+        return store.empty();
+    };
+    if (!_old_store.empty()) {
+        if (!drain(_old_store)) {
+            return false;
+        }
+        _release_position = 0;
+    }
+    return drain(_store);
+}
+
+const dict_entry& dict_table::at(size_t index) const
+{
+    assert(index < size());
+    if (index < _store.size()) {
+        auto it = _store.begin();
+        std::advance(it, index);
+        return *it;
+    }
+    auto it = _old_store.begin();
+    std::advance(it, index - _store.size());
+    return *it;
+}
+}
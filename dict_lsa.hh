@@ -19,7 +19,7 @@
 *
 */
 #pragma once
-#include <boost/intrusive/set.hpp>
+#include <boost/intrusive/unordered_set.hpp>
 #include "utils/allocation_strategy.hh"
 #include "utils/managed_ref.hh"
 #include "utils/managed_bytes.hh"
@@ -28,7 +28,9 @@
 #include "utils/logalloc.hh"
 #include "common.hh"
 #include "core/sstring.hh"
+#include "intset.hh"
 #include  <experimental/vector>
+#include <memory>
 namespace stdx = std::experimental;
 namespace redis {
 
@@ -36,7 +38,7 @@ class dict_lsa;
 struct dict_entry
 {
     friend class dict_lsa;
-    using hook_type = boost::intrusive::set_member_hook<>;
+    using hook_type = boost::intrusive::unordered_set_member_hook<>;
     hook_type _link;
     managed_bytes _key;
     size_t _key_hash;
@@ -57,24 +59,25 @@ struct dict_entry
 
     dict_entry(const sstring& key, const sstring& val) noexcept
         : _link()
-        , _key(std::move(*(current_allocator().construct<managed_bytes>(bytes_view {reinterpret_cast<const signed char*>(key.data()), key.size()}))))
+        , _key(bytes_view {reinterpret_cast<const signed char*>(key.data()), key.size()})
         , _key_hash(std::hash<managed_bytes>()(_key))
         , _type(entry_type::BYTES)
     {
-        _u._data = std::move(*(current_allocator().construct<managed_bytes>(bytes_view {reinterpret_cast<const signed char*>(val.data()), val.size()})));
+        new (&_u._data) managed_bytes(bytes_view {reinterpret_cast<const signed char*>(val.data()), val.size()});
     }
 
     dict_entry(const sstring& key) noexcept
         : _link()
-        , _key(std::move(*(current_allocator().construct<managed_bytes>(bytes_view {reinterpret_cast<const signed char*>(key.data()), key.size()}))))
+        , _key(bytes_view {reinterpret_cast<const signed char*>(key.data()), key.size()})
         , _key_hash(std::hash<managed_bytes>()(_key))
         , _type(entry_type::BYTES)
     {
+        new (&_u._data) managed_bytes();
     }
 
     dict_entry(const sstring& key, double data) noexcept
         : _link()
-        , _key(std::move(*(current_allocator().construct<managed_bytes>(bytes_view {reinterpret_cast<const signed char*>(key.data()), key.size()}))))
+        , _key(bytes_view {reinterpret_cast<const signed char*>(key.data()), key.size()})
         , _key_hash(std::hash<managed_bytes>()(_key))
         , _type(entry_type::FLOAT)
     {
@@ -83,22 +86,24 @@ struct dict_entry
 
     dict_entry(const sstring& key, int64_t data) noexcept
         : _link()
-        , _key(std::move(*(current_allocator().construct<managed_bytes>(bytes_view {reinterpret_cast<const signed char*>(key.data()), key.size()}))))
+        , _key(bytes_view {reinterpret_cast<const signed char*>(key.data()), key.size()})
         , _key_hash(std::hash<managed_bytes>()(_key))
         , _type(entry_type::INTEGER)
     {
         _u._integer = data;
     }
 
+    // The compaction moves an entry, the new one takes its place in its bucket.
     dict_entry(dict_entry&& o) noexcept
-        : _link(std::move(o._link))
+        : _link()
         , _key(std::move(o._key))
         , _key_hash(std::move(o._key_hash))
         , _type(std::move(o._type))
     {
+        _link.swap_nodes(o._link);
         switch (_type) {
             case entry_type::BYTES:
-                 _u._data = std::move(o._u._data);
+                 new (&_u._data) managed_bytes(std::move(o._u._data));
                  break;
             case entry_type::FLOAT:
                  _u._float = o._u._float;
@@ -109,24 +114,42 @@ struct dict_entry
         }
     }
 
-    struct compare {
-        inline bool compare_impl(const char* d1, size_t s1, const char* d2, size_t s2) const noexcept {
-            const int len = std::min(s1, s2);
-            auto r = memcmp(d1, d2, len);
-            if (r == 0) {
-                if (s1 < s2) return true;
-                else if (s1 > s2) return false;
-            }
-            return r < 0;
+    ~dict_entry()
+    {
+        if (_type == entry_type::BYTES) {
+            _u._data.~managed_bytes();
         }
+    }
+
+    static inline size_t hash_of(const char* data, size_t size) {
+        return std::hash<bytes_view>()(bytes_view {reinterpret_cast<const signed char*>(data), size});
+    }
+
+    // The key of a lookup, hashed as the keys of the entries.
+    struct lookup_key {
+        const sstring& _key;
+        size_t _hash;
+        explicit lookup_key(const sstring& key) : _key(key), _hash(hash_of(key.data(), key.size())) {}
+    };
+
+    struct hash {
+        inline size_t operator () (const dict_entry& e) const noexcept {
+            return e._key_hash;
+        }
+        inline size_t operator () (const lookup_key& k) const noexcept {
+            return k._hash;
+        }
+    };
+
+    struct equal {
         inline bool operator () (const dict_entry& l, const dict_entry& r) const noexcept {
-            return compare_impl(l.key_data(), l.key_size(), r.key_data(), r.key_size());
+            return l._key_hash == r._key_hash && l.key_size() == r.key_size() && memcmp(l.key_data(), r.key_data(), l.key_size()) == 0;
         }
-        inline bool operator () (const sstring& k, const dict_entry& e) const noexcept {
-            return compare_impl(k.data(), k.size(), e.key_data(), e.key_size());
+        inline bool operator () (const lookup_key& k, const dict_entry& e) const noexcept {
+            return k._hash == e._key_hash && k._key.size() == e.key_size() && memcmp(k._key.data(), e.key_data(), e.key_size()) == 0;
         }
-        inline bool operator () (const dict_entry& e, const sstring& k) const noexcept {
-            return compare_impl(e.key_data(), e.key_size(), k.data(), k.size());
+        inline bool operator () (const dict_entry& e, const lookup_key& k) const noexcept {
+            return (*this)(k, e);
         }
     };
 
@@ -181,146 +204,395 @@ struct dict_entry
     }
 };
 
-class database;
-class dict_lsa final {
-    friend class database;
-    using dict_type = boost::intrusive::set<dict_entry,
+// A field of a hash, or a member of a set, as dict_lsa hands it out. It
+// points into the collection whatever the encoding of the latter, and is
+// valid until the collection is modified. A default constructed field
+// stands for a missing one. The member of an intset carries its decimal form.
+struct dict_field
+{
+    using entry_type = dict_entry::entry_type;
+    const char* _key = nullptr;
+    size_t _key_size = 0;
+    bool _integer_key = false;
+    char _digits[intset::max_digits];
+    entry_type _type = entry_type::BYTES;
+    const char* _data = nullptr;
+    size_t _data_size = 0;
+    double _float = 0;
+    int64_t _integer = 0;
+
+    dict_field() noexcept {}
+    explicit dict_field(const dict_entry& e) noexcept
+        : _key(e.key_data())
+        , _key_size(e.key_size())
+        , _type(e._type)
+    {
+        switch (_type) {
+            case entry_type::BYTES:
+                _data = e.value_bytes_data();
+                _data_size = e.value_bytes_size();
+                break;
+            case entry_type::FLOAT:
+                _float = e.value_float();
+                break;
+            case entry_type::INTEGER:
+                _integer = e.value_integer();
+                break;
+        }
+    }
+
+    static dict_field of_integer_member(int64_t member) noexcept {
+        dict_field f;
+        f._integer_key = true;
+        f._key_size = intset::format(member, f._digits);
+        return f;
+    }
+
+    explicit operator bool() const {
+        return _key != nullptr || _integer_key;
+    }
+    bool type_of_bytes() const {
+        return _type == entry_type::BYTES;
+    }
+    bool type_of_integer() const {
+        return _type == entry_type::INTEGER;
+    }
+    bool type_of_float() const {
+        return _type == entry_type::FLOAT;
+    }
+    inline const char* key_data() const {
+        return _integer_key ? _digits : _key;
+    }
+    inline size_t key_size() const {
+        return _key_size;
+    }
+    inline const char* value_bytes_data() const {
+        return _data;
+    }
+    inline size_t value_bytes_size() const {
+        return _data_size;
+    }
+    inline double value_float() const {
+        return _float;
+    }
+    inline int64_t value_integer() const {
+        return _integer;
+    }
+};
+
+// The hash table of the fields of a large collection.
+//
+// It grows (or shrinks) incrementally as the cache does: when the load factor
+// crosses a threshold, a new bucket array becomes the primary table, and the old
+// one is drained into it a few buckets per insertion or erasure. While draining,
+// an entry lives in the old table iff its bucket in the old table was not drained
+// yet. The table and its buckets are allocated out of the LSA region, like the
+// bucket arrays of the cache, so that the collection owns it by a plain pointer.
+class dict_table final {
+    using table_type = boost::intrusive::unordered_set<dict_entry,
         boost::intrusive::member_hook<dict_entry, dict_entry::hook_type, &dict_entry::_link>,
-        boost::intrusive::compare<dict_entry::compare>>;
-    using iterator = typename dict_type::iterator;
-    using const_iterator = typename dict_type::const_iterator;
-    dict_type _dict;
-public:
-    dict_lsa () noexcept : _dict()
+        boost::intrusive::hash<dict_entry::hash>,
+        boost::intrusive::equal<dict_entry::equal>,
+        boost::intrusive::power_2_buckets<true>,
+        boost::intrusive::constant_time_size<true>>;
+    using bucket_type = table_type::bucket_type;
+    static constexpr float load_factor = 0.75f;
+    static constexpr float shrink_factor = 0.1f;
+    // Number of old buckets moved by every insertion or erasure while rehashing.
+    static constexpr size_t rehash_step_buckets = 8;
+    size_t _initial_bucket_count;
+    size_t _resize_up_threshold;
+    size_t _resize_down_threshold = 0;
+    std::unique_ptr<bucket_type[]> _buckets;
+    table_type _store;
+    // The table being drained into _store, it owns _old_buckets during rehashing,
+    // or the spare bucket otherwise.
+    bucket_type _spare_bucket[1];
+    std::unique_ptr<bucket_type[]> _old_buckets;
+    table_type _old_store;
+    size_t _rehash_position = 0;
+    // The bucket drained by release().
+    size_t _release_position = 0;
+
+    inline bool rehashing() const
     {
+        return _old_buckets != nullptr;
     }
 
-    dict_lsa (dict_lsa&& o) noexcept : _dict(std::move(o._dict))
+    inline bool in_old_store(size_t hash) const
     {
+        return rehashing() && (hash & (_old_store.bucket_count() - 1)) >= _rehash_position;
     }
 
-    ~dict_lsa ()
+    inline table_type& store_of(size_t hash)
     {
-        flush_all();
+        return in_old_store(hash) ? _old_store : _store;
     }
 
-    void flush_all()
+    inline const table_type& store_of(size_t hash) const
     {
-        _dict.erase_and_dispose(_dict.begin(), _dict.end(), current_deleter<dict_entry>());
+        return in_old_store(hash) ? _old_store : _store;
     }
 
-    bool insert(dict_entry* e)
+    static size_t bucket_count_for(size_t size);
+    void start_rehash(size_t new_size);
+    void rehash_step(size_t count);
+    void maybe_rehash();
+public:
+    // Sizes the bucket array for @size entries, it never shrinks below.
+    explicit dict_table(size_t size);
+    ~dict_table();
+
+    inline size_t size() const
     {
-        assert(e != nullptr);
-        auto r = _dict.insert(*e);
-        return r.second;
+        return _store.size() + _old_store.size();
     }
 
+    // Bytes allocated for the table, its buckets and its entries.
+    size_t memory_usage() const;
+
+    dict_entry* find(const sstring& key) const;
+    // Links @e, whose key must not be in the table yet.
+    void insert(dict_entry* e);
+    bool erase(const sstring& key);
+    const dict_entry& at(size_t index) const;
+    // Erases up to @budget entries, a bucket after the other, and takes them
+    // and the empty buckets visited off @budget. The table does not resize
+    // meanwhile. Returns true once it is empty.
+    bool release(size_t& budget);
+
     template <typename Func>
-    inline std::result_of_t<Func(const dict_entry* e)> with_entry_run(const sstring& k, Func&& func) const {
-        auto it = _dict.find(k, dict_entry::compare());
-        if (it != _dict.end()) {
-            const auto& e = *it;
-            return func(&e);
+    void for_each(Func&& func) const
+    {
+        for (auto& e : _store) {
+            func(e);
         }
-        else {
-            return func(nullptr);
+        for (auto& e : _old_store) {
+            func(e);
         }
     }
 
+    // See scan_buckets().
     template <typename Func>
-    inline std::result_of_t<Func(dict_entry* e)> with_entry_run(const sstring& k, Func&& func) {
-        auto it = _dict.find(k, dict_entry::compare());
-        if (it != _dict.end()) {
-            auto& e = *it;
-            return func(&e);
-        }
-        else {
-            return func(nullptr);
-        }
+    size_t scan(size_t cursor, Func&& func) const
+    {
+        return scan_buckets(&_store, rehashing() ? &_old_store : nullptr, cursor, std::forward<Func>(func));
     }
+};
 
-    inline bool erase(const_iterator i)
+class database;
+// The fields of a hash, or the members of a set.
+//
+// A small collection is packed: all its fields are encoded one after the
+// other in a single blob, which saves the allocation, the hash hook and the
+// two managed_bytes of every dict_entry, and keeps a lookup within a few
+// cache lines. Once it holds more than max_packed_entries fields, or a key
+// or a value longer than max_packed_value bytes, the collection converts
+// itself to the hash table of dict_entry and stays so.
+//
+// A set whose members are all integers is an intset, up to max_intset_entries
+// members. It is converted to one of the forms above once a member of another
+// kind is added.
+class dict_lsa final {
+    friend class database;
+    // Set once the collection is not packed anymore.
+    std::unique_ptr<dict_table> _table;
+    managed_bytes _packed;
+    size_t _packed_count = 0;
+    // Not empty while the collection is an intset.
+    intset _integers;
+public:
+    static thread_local size_t max_packed_entries;
+    static thread_local size_t max_packed_value;
+    static thread_local size_t max_intset_entries;
+    // The packed form and an intset are single managed_bytes, which the LSA
+    // keeps contiguous only up to a fraction of a segment.
+    static constexpr size_t max_blob_size = 24 * 1024;
+    static void configure(size_t entries, size_t value, size_t intset_entries) {
+        max_packed_entries = entries;
+        max_packed_value = value;
+        max_intset_entries = intset_entries;
+    }
+    // Returns false if a blob could outgrow max_blob_size under these thresholds.
+    static bool valid_configuration(size_t entries, size_t value, size_t intset_entries);
+
+    dict_lsa () noexcept
     {
-        if (i != _dict.cend()) {
-            _dict.erase_and_dispose(i, current_deleter<dict_entry>());
-            return true;
-        }
-        return false;
     }
 
-    inline bool erase(const sstring& key)
+    dict_lsa (dict_lsa&& o) noexcept
+        : _table(std::move(o._table))
+        , _packed(std::move(o._packed))
+        , _packed_count(o._packed_count)
+        , _integers(std::move(o._integers))
     {
-        auto it = _dict.find(key, dict_entry::compare());
-        if (it != _dict.end()) {
-            _dict.erase_and_dispose(it, current_deleter<dict_entry>());
-            return true;
-        }
-        return false;
+        o._packed_count = 0;
+    }
+
+    ~dict_lsa ()
+    {
+        flush_all();
+    }
+
+    void flush_all()
+    {
+        _table.reset();
+        _packed = managed_bytes();
+        _packed_count = 0;
+        _integers.clear();
+    }
+
+    inline bool packed() const {
+        return _table == nullptr && _integers.empty();
+    }
+
+    // Bytes allocated for the collection in any of its encodings.
+    size_t memory_usage() const {
+        return sizeof(dict_lsa) + _packed.external_memory_usage() + _integers.memory_usage() + (_table ? _table->memory_usage() : 0);
+    }
+
+    inline bool integers() const {
+        return !_integers.empty();
+    }
+
+    // Appends the sorted members of an intset to @values.
+    void fetch_integers(std::vector<int64_t>& values) const {
+        _integers.fetch(values);
+    }
+
+    // Adds a member of a set, returns true if it was not there.
+    bool insert(const sstring& key);
+    // Sets a field of a hash, returns true if it is a new one.
+    bool insert(const sstring& key, const sstring& val);
+    bool insert(const sstring& key, int64_t val);
+    bool insert(const sstring& key, double val);
+
+    // Adds @delta to the integer field @key, which is created if it does not
+    // exist. Returns false if the field holds another type of value.
+    bool incr(const sstring& key, int64_t delta) {
+        return incr_impl(key, delta);
+    }
+    bool incr(const sstring& key, double delta) {
+        return incr_impl(key, delta);
+    }
+
+    bool erase(const sstring& key);
+
+    template <typename Func>
+    inline std::result_of_t<Func(const dict_field* e)> with_entry_run(const sstring& k, Func&& func) const {
+        auto f = find(k);
+        return func(f ? &f : nullptr);
     }
 
     inline bool empty() const {
-        return _dict.empty();
+        return size() == 0;
     }
 
     inline size_t size() const {
-        return _dict.size();
+        if (integers()) {
+            return _integers.size();
+        }
+        return packed() ? _packed_count : _table->size();
     }
 
     inline void clear() {
         flush_all();
     }
 
+    // Erases up to @budget fields of the table, and takes them off @budget.
+    // A packed collection or an intset is a single blob, freed at once.
+    // Returns true once the collection is empty.
+    bool release(size_t& budget) {
+        if (_table && !_table->release(budget)) {
+            return false;
+        }
+        flush_all();
+        return true;
+    }
+
     inline bool exists(const sstring& key) const
     {
-        return _dict.find(key, dict_entry::compare()) != _dict.end();
+        return static_cast<bool>(find(key));
     }
 
-    inline const dict_entry* begin() const
-    {
-        if (_dict.begin() != _dict.end()) {
-            const auto& e = *(_dict.begin());
-            return &e;
+    // Looks up the member of a set that is the decimal form of @member.
+    bool exists(int64_t member) const;
+
+    // Returns the field at @index in the order of for_each().
+    dict_field at(size_t index) const;
+
+    void fetch(const std::vector<sstring>& keys, std::vector<dict_field>& entries) const {
+        for (const auto& key : keys) {
+            entries.push_back(find(key));
         }
-        return nullptr;
     }
 
-    inline const_iterator at(size_t index) const
-    {
-        assert(index >= 0 && index < size());
-        for (auto i = _dict.cbegin(); i != _dict.cend(); ++i, index--) {
-            if (index == 0) {
-                return i;
-            }
-        }
-        return _dict.cend();
+    void fetch(std::vector<dict_field>& entries) const {
+        for_each([&entries] (const dict_field& f) {
+            entries.push_back(f);
+        });
     }
 
-    void fetch(const std::vector<sstring>& keys, std::vector<const dict_entry*>& entries) const {
-        for (const auto& key : keys) {
-            auto it = _dict.find(key, dict_entry::compare());
-            if (it != _dict.end()) {
-                const auto& e = *it;
-                entries.push_back(&e);
-            }
-            else {
-                entries.push_back(nullptr);
+    template <typename Func>
+    void for_each(Func&& func) const {
+        if (integers()) {
+            _integers.for_each([&func] (int64_t member) {
+                func(dict_field::of_integer_member(member));
+            });
+        }
+        else if (packed()) {
+            auto p = packed_begin();
+            for (size_t i = 0; i < _packed_count; ++i) {
+                func(decode(p));
             }
         }
+        else {
+            _table->for_each([&func] (const dict_entry& e) {
+                func(dict_field(e));
+            });
+        }
     }
 
-    void fetch(std::vector<const dict_entry*>& entries) const {
-        for (auto it = _dict.begin(); it != _dict.end(); ++it) {
-            const auto& e = *it;
-            entries.push_back(&e);
+    // Calls @func on the fields at @cursor of a HSCAN or a SSCAN, and returns
+    // the next cursor, 0 at the end. A packed collection or an intset is
+    // visited at once, as Redis does for its small encodings.
+    template <typename Func>
+    size_t scan(size_t cursor, Func&& func) const {
+        if (_table == nullptr) {
+            for_each(std::forward<Func>(func));
+            return 0;
         }
+        return _table->scan(cursor, [&func] (const dict_entry& e) {
+            func(dict_field(e));
+        });
     }
 
     void fetch_keys(std::vector<sstring>& entries) const {
-        for (auto it = _dict.begin(); it != _dict.end(); ++it) {
-            const auto& e = *it;
-            entries.emplace_back(std::move(sstring(e.key_data(), e.key_size())));
-        }
-    }
+        for_each([&entries] (const dict_field& f) {
+            entries.emplace_back(f.key_data(), f.key_size());
+        });
+    }
+private:
+    dict_field find(const sstring& key) const;
+    // Returns the offset of the field @key in the blob, or -1.
+    long packed_find(const sstring& key) const;
+    inline const char* packed_begin() const {
+        return reinterpret_cast<const char*>(_packed.data());
+    }
+    // Decodes the field at @p and moves @p past it.
+    static dict_field decode(const char*& p);
+    static size_t encoded_size(const dict_field& f);
+    static char* encode(char* p, const dict_field& f);
+    // Replaces the field at @offset, if not -1, with @f, or appends @f if
+    // @offset is -1. The field is removed if @f is nullptr.
+    void packed_store(long offset, const dict_field* f);
+    bool store(const sstring& key, const dict_field& f);
+    template <typename T>
+    bool incr_impl(const sstring& key, T delta);
+    bool fits_packed(const dict_field& f) const;
+    void convert_to_table();
+    // Converts the intset to the packed form, or to the hash table if the
+    // members do not fit.
+    void convert_from_integers();
 };
 }
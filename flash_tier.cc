@@ -0,0 +1,304 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "flash_tier.hh"
+#include <algorithm>
+#include <cstring>
+#include <lz4.h>
+#include "core/align.hh"
+#include "core/future-util.hh"
+#include "core/reactor.hh"
+#include "core/seastar.hh"
+#include "util/log.hh"
+
+using logger =  seastar::logger;
+static logger tier_log ("tier");
+
+namespace redis {
+
+void flash_tier::setup_metrics()
+{
+    namespace sm = seastar::metrics;
+    _metrics.add_group("tier", {
+        sm::make_gauge("values", [this] { return _values; }, sm::description("Number of values moved to the flash tier of this shard.")),
+        sm::make_gauge("live_bytes", [this] { return _live_bytes; }, sm::description("Bytes of the flash tier of this shard held by its values.")),
+        sm::make_gauge("file_bytes", [this] { return file_size(); }, sm::description("Bytes of the file of the flash tier of this shard, live or not.")),
+        sm::make_counter("appended", [this] { return _appended; }, sm::description("Total number of values moved to the flash tier.")),
+        sm::make_counter("appended_bytes", [this] { return _appended_bytes; }, sm::description("Total bytes of the values moved to the flash tier.")),
+        sm::make_counter("stored_bytes", [this] { return _stored_bytes; }, sm::description("Total bytes stored for the values moved to the flash tier, once compressed.")),
+        sm::make_counter("rejected", [this] { return _rejected; }, sm::description("Total number of values kept in memory as the flash tier was full or busy.")),
+        sm::make_counter("reads", [this] { return _reads; }, sm::description("Total number of values read from the file of the flash tier.")),
+        sm::make_counter("buffer_reads", [this] { return _buffer_reads; }, sm::description("Total number of values read from the buffers of the flash tier, not yet written.")),
+        sm::make_counter("read_bytes", [this] { return _read_bytes; }, sm::description("Total bytes read from the file of the flash tier.")),
+        sm::make_counter("writes", [this] { return _writes; }, sm::description("Total number of buffers written to the file of the flash tier.")),
+        sm::make_counter("write_errors", [this] { return _write_errors; }, sm::description("Total number of the buffers whose write failed, they stay in memory.")),
+    });
+}
+
+future<> flash_tier::open(sstring path, size_t max_size, size_t min_value_size, bool compression)
+{
+    _path = std::move(path);
+    _max_segments = std::max<size_t>(max_size / SEGMENT_SIZE, 1);
+    _min_value_size = min_value_size;
+    _compression = compression;
+    return open_file_dma(_path, open_flags::rw | open_flags::create | open_flags::truncate).then([this] (file f) {
+        _file = std::move(f);
+        _enabled = true;
+        tier_releaser::local() = this;
+        setup_metrics();
+        tier_log.info("moving the cold values to {} (up to {} bytes)", _path, _max_segments * SEGMENT_SIZE);
+    });
+}
+
+future<> flash_tier::close()
+{
+    if (!_enabled) {
+        return make_ready_future<>();
+    }
+    _enabled = false;
+    // the entries released from now on have nothing to give back.
+    tier_releaser::local() = nullptr;
+    return _gate.close().then([this] {
+        return _file.close();
+    }).then([this] {
+        return remove_file(_path);
+    });
+}
+
+bool flash_tier::open_buffer()
+{
+    if (_segments.empty() || _segment_used + BUFFER_SIZE > SEGMENT_SIZE) {
+        auto had_segment = !_segments.empty();
+        auto previous = _current_segment;
+        if (!_free_segments.empty()) {
+            _current_segment = _free_segments.back();
+            _free_segments.pop_back();
+            _segments[_current_segment]._free = false;
+        }
+        else if (_segments.size() < _max_segments) {
+            _segments.emplace_back();
+            _current_segment = _segments.size() - 1;
+        }
+        else {
+            return false;
+        }
+        _segment_used = 0;
+        if (had_segment) {
+            maybe_free(previous);
+        }
+    }
+    _current = make_lw_shared<write_buffer>(uint64_t(_current_segment) * SEGMENT_SIZE + _segment_used);
+    _segment_used += BUFFER_SIZE;
+    return true;
+}
+
+void flash_tier::seal_buffer()
+{
+    auto b = std::move(_current);
+    _current = nullptr;
+    if (!b || b->_used == 0) {
+        return;
+    }
+    auto size = align_up<size_t>(b->_used, ALIGNMENT);
+    std::fill(b->_data.get_write() + b->_used, b->_data.get_write() + size, 0);
+    auto index = static_cast<uint32_t>(b->_offset / SEGMENT_SIZE);
+    ++_segments[index]._writes;
+    _writing.push_back(b);
+    ++_writes;
+    (void)with_gate(_gate, [this, b, size, index] {
+        return _file.dma_write(b->_offset, b->_data.get(), size).then_wrapped([this, b, size, index] (future<size_t> f) {
+            --_segments[index]._writes;
+            try {
+                if (f.get0() != size) {
+                    throw std::runtime_error("short write to the flash tier");
+                }
+            } catch (...) {
+                // the records are served from memory, the buffer is never released.
+                ++_write_errors;
+                tier_log.error("failed to write {} bytes to {} at {}: {}", size, _path, b->_offset, std::current_exception());
+                return;
+            }
+            _writing.erase(std::find(_writing.begin(), _writing.end(), b));
+            maybe_free(index);
+        });
+    });
+}
+
+void flash_tier::maybe_free(uint32_t index)
+{
+    auto& s = _segments[index];
+    if (s._live_bytes == 0 && s._reads == 0 && s._writes == 0 && !s._free && index != _current_segment) {
+        s._free = true;
+        _free_segments.push_back(index);
+    }
+}
+
+uint64_t flash_tier::append(bytes_view value)
+{
+    if (!accepting() || value.size() > MAX_VALUE_SIZE) {
+        ++_rejected;
+        return 0;
+    }
+    auto data = reinterpret_cast<const char*>(value.data());
+    size_t stored = value.size();
+    if (_compression) {
+        auto bound = LZ4_compressBound(value.size());
+        _scratch.resize(bound);
+        auto n = LZ4_compress_default(data, _scratch.data(), value.size(), bound);
+        // incompressible values are stored as they are.
+        if (n > 0 && size_t(n) < value.size()) {
+            data = _scratch.data();
+            stored = n;
+        }
+    }
+    auto length = HEADER_SIZE + stored;
+    auto padded = padded_length(length);
+    if (!_current || _current->_used + padded > BUFFER_SIZE) {
+        seal_buffer();
+        if (!open_buffer()) {
+            ++_rejected;
+            return 0;
+        }
+    }
+    auto offset = _current->_offset + _current->_used;
+    auto p = _current->_data.get_write() + _current->_used;
+    uint32_t header[2] = { static_cast<uint32_t>(value.size()), static_cast<uint32_t>(stored) };
+    std::memcpy(p, header, HEADER_SIZE);
+    std::memcpy(p + HEADER_SIZE, data, stored);
+    std::fill(p + length, p + padded, 0);
+    _current->_used += padded;
+    segment_of(offset)._live_bytes += padded;
+    ++_values;
+    _live_bytes += padded;
+    ++_appended;
+    _appended_bytes += value.size();
+    _stored_bytes += stored;
+    return make_location(offset, length);
+}
+
+temporary_buffer<char> flash_tier::decode(temporary_buffer<char> data)
+{
+    uint32_t header[2];
+    std::memcpy(header, data.get(), HEADER_SIZE);
+    auto size = header[0];
+    auto stored = header[1];
+    if (stored == size) {
+        return data.share(HEADER_SIZE, size);
+    }
+    temporary_buffer<char> value(size);
+    auto n = LZ4_decompress_safe(data.get() + HEADER_SIZE, value.get_write(), stored, size);
+    if (n < 0 || uint32_t(n) != size) {
+        throw std::runtime_error("corrupted value in the flash tier");
+    }
+    return value;
+}
+
+future<temporary_buffer<char>> flash_tier::read(uint64_t location)
+{
+    auto offset = offset_of(location);
+    auto length = length_of(location);
+    auto in_buffer = [offset] (const lw_shared_ptr<write_buffer>& b) {
+        return b && offset >= b->_offset && offset < b->_offset + b->_used;
+    };
+    auto b = in_buffer(_current) ? _current : nullptr;
+    for (auto it = _writing.begin(); !b && it != _writing.end(); ++it) {
+        if (in_buffer(*it)) {
+            b = *it;
+        }
+    }
+    if (b) {
+        ++_buffer_reads;
+        try {
+            return make_ready_future<temporary_buffer<char>>(decode(temporary_buffer<char>(b->_data.get() + (offset - b->_offset), length)));
+        } catch (...) {
+            return make_exception_future<temporary_buffer<char>>(std::current_exception());
+        }
+    }
+    auto begin = align_down<uint64_t>(offset, ALIGNMENT);
+    auto end = align_up<uint64_t>(offset + length, ALIGNMENT);
+    auto index = static_cast<uint32_t>(offset / SEGMENT_SIZE);
+    // the segment isn't reused before the read completes.
+    ++_segments[index]._reads;
+    ++_reads;
+    return with_gate(_gate, [this, begin, end] {
+        return _file.dma_read<char>(begin, end - begin);
+    }).then([this, offset, length, begin] (temporary_buffer<char> data) {
+        if (data.size() < offset - begin + length) {
+            throw std::runtime_error("short read of the flash tier");
+        }
+        _read_bytes += data.size();
+        return decode(data.share(offset - begin, length));
+    }).finally([this, index] {
+        --_segments[index]._reads;
+        maybe_free(index);
+    });
+}
+
+void flash_tier::release(uint64_t location)
+{
+    auto offset = offset_of(location);
+    auto padded = stored_size(location);
+    auto index = static_cast<uint32_t>(offset / SEGMENT_SIZE);
+    _segments[index]._live_bytes -= padded;
+    _live_bytes -= padded;
+    --_values;
+    _staged.erase(location);
+    maybe_free(index);
+}
+
+future<> flash_tier::stage(std::vector<uint64_t> locations)
+{
+    std::unordered_map<uint64_t, temporary_buffer<char>> staged;
+    std::vector<uint64_t> missing;
+    for (auto location : locations) {
+        auto it = _staged.find(location);
+        if (it != _staged.end()) {
+            staged.emplace(location, std::move(it->second));
+        }
+        else if (!staged.count(location)) {
+            missing.push_back(location);
+        }
+    }
+    _staged = std::move(staged);
+    return do_with(std::move(missing), [this] (auto& missing) {
+        return parallel_for_each(missing, [this] (uint64_t location) {
+            return read(location).then([this, location] (temporary_buffer<char> value) {
+                _staged.emplace(location, std::move(value));
+            });
+        });
+    });
+}
+
+bytes_view flash_tier::value_of(const cache_entry& e)
+{
+    if (!e.value_tiered()) {
+        return e.value_bytes_view();
+    }
+    auto tier = local();
+    if (tier != nullptr) {
+        auto it = tier->_staged.find(e.tier_location());
+        if (it != tier->_staged.end()) {
+            return bytes_view(reinterpret_cast<const signed char*>(it->second.get()), it->second.size());
+        }
+    }
+    throw std::runtime_error("the tiered value was not staged");
+}
+
+}
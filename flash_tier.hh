@@ -0,0 +1,175 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/future.hh"
+#include "core/file.hh"
+#include "core/gate.hh"
+#include "core/shared_ptr.hh"
+#include "core/sstring.hh"
+#include "core/temporary_buffer.hh"
+#include "core/metrics_registration.hh"
+#include <unordered_map>
+#include <vector>
+#include "cache.hh"
+
+namespace redis {
+
+// The flash tier of a shard: the cold large strings are moved out of the LSA
+// into a log structured file, their entries keep the location of the value
+// only, and a read brings the value back into memory. The file is a cache of
+// the running process, it is truncated when opened; the snapshot and the log
+// save the tiered values as the others.
+//
+// The records are appended to a buffer of BUFFER_SIZE bytes, which is written
+// to the file with one DMA write once full. The file is split in segments of
+// SEGMENT_SIZE bytes, a segment is reused once none of its records is live.
+// A record is an 8 bytes header, the size of the value and the size stored,
+// smaller if the value was compressed with LZ4, then the stored bytes.
+//
+// The location of a record packs its offset, in units of RECORD_ALIGNMENT,
+// and its length; 0 is never a location.
+class flash_tier final : public tier_releaser {
+public:
+    static constexpr const size_t ALIGNMENT = 4096;
+    static constexpr const size_t RECORD_ALIGNMENT = 16;
+    static constexpr const size_t HEADER_SIZE = 8;
+    static constexpr const size_t BUFFER_SIZE = 1024 * 1024;
+    static constexpr const size_t SEGMENT_SIZE = 16 * BUFFER_SIZE;
+    // The largest value moved to the tier, a record never spans two buffers.
+    static constexpr const size_t MAX_VALUE_SIZE = BUFFER_SIZE - HEADER_SIZE;
+    // No value is moved while this many buffers are still being written.
+    static constexpr const size_t MAX_PENDING_WRITES = 4;
+private:
+    static constexpr const unsigned LENGTH_BITS = 28;
+    struct segment {
+        size_t _live_bytes = 0;
+        unsigned _reads = 0;
+        unsigned _writes = 0;
+        bool _free = false;
+    };
+    // A buffer of records, served from memory until it's written.
+    struct write_buffer {
+        uint64_t _offset;
+        temporary_buffer<char> _data;
+        size_t _used = 0;
+        write_buffer(uint64_t offset) : _offset(offset), _data(temporary_buffer<char>::aligned(ALIGNMENT, BUFFER_SIZE)) {}
+    };
+    bool _enabled = false;
+    sstring _path;
+    file _file;
+    size_t _max_segments = 0;
+    size_t _min_value_size = 0;
+    bool _compression = false;
+    std::vector<segment> _segments;
+    std::vector<uint32_t> _free_segments;
+    uint32_t _current_segment = 0;
+    // The bytes of the current segment given to the buffers so far.
+    size_t _segment_used = 0;
+    lw_shared_ptr<write_buffer> _current;
+    std::vector<lw_shared_ptr<write_buffer>> _writing;
+    seastar::gate _gate;
+    std::vector<char> _scratch;
+    // The values read for the running snapshot, see stage().
+    std::unordered_map<uint64_t, temporary_buffer<char>> _staged;
+
+    size_t _values = 0;
+    size_t _live_bytes = 0;
+    uint64_t _appended = 0;
+    uint64_t _appended_bytes = 0;
+    uint64_t _stored_bytes = 0;
+    uint64_t _rejected = 0;
+    uint64_t _reads = 0;
+    uint64_t _buffer_reads = 0;
+    uint64_t _read_bytes = 0;
+    uint64_t _writes = 0;
+    uint64_t _write_errors = 0;
+    seastar::metrics::metric_groups _metrics;
+
+    static inline uint64_t offset_of(uint64_t location) { return (location >> LENGTH_BITS) * RECORD_ALIGNMENT; }
+    static inline size_t length_of(uint64_t location) { return location & ((uint64_t(1) << LENGTH_BITS) - 1); }
+    static inline uint64_t make_location(uint64_t offset, size_t length)
+    {
+        return ((offset / RECORD_ALIGNMENT) << LENGTH_BITS) | length;
+    }
+    static inline size_t padded_length(size_t length)
+    {
+        return (length + RECORD_ALIGNMENT - 1) & ~(RECORD_ALIGNMENT - 1);
+    }
+    inline segment& segment_of(uint64_t offset) { return _segments[offset / SEGMENT_SIZE]; }
+    // Opens the next buffer, in a new segment if the current one is full.
+    bool open_buffer();
+    void seal_buffer();
+    void maybe_free(uint32_t index);
+    // The value of the record @data, which was read whole.
+    temporary_buffer<char> decode(temporary_buffer<char> data);
+    void setup_metrics();
+public:
+    flash_tier() {}
+    ~flash_tier() {
+        if (local() == this) {
+            tier_releaser::local() = nullptr;
+        }
+    }
+    flash_tier(const flash_tier&) = delete;
+    flash_tier& operator = (const flash_tier&) = delete;
+
+    // The tier of the current shard, nullptr if it has none.
+    static inline flash_tier* local() { return static_cast<flash_tier*>(tier_releaser::local()); }
+
+    // Opens the tier of this shard at @path, at most @max_size bytes of it are
+    // used. The strings of at least @min_value_size bytes are moved to it, and
+    // compressed with LZ4 first if @compression.
+    future<> open(sstring path, size_t max_size, size_t min_value_size, bool compression);
+    // Waits for the running writes, and removes the file.
+    future<> close();
+
+    inline bool enabled() const { return _enabled; }
+    inline size_t min_value_size() const { return _min_value_size; }
+    // Whether the tier takes the values for now: none while too many buffers
+    // wait to be written.
+    inline bool accepting() const { return _enabled && _writing.size() < MAX_PENDING_WRITES; }
+
+    // Appends @value to the tier, returns its location, 0 if the tier is full.
+    uint64_t append(bytes_view value);
+    // Reads the value at @location, which stays live.
+    future<temporary_buffer<char>> read(uint64_t location);
+    // The value at @location isn't used any more.
+    virtual void release(uint64_t location) override;
+    // The bytes of the tier a value stored at @location takes.
+    static inline size_t stored_size(uint64_t location) { return padded_length(length_of(location)); }
+
+    // [SNAPSHOT]
+    // The encoders of the snapshot, of the log and of the full syncs are
+    // synchronous: the values tiered in the next part of the data are read
+    // before, and only them are kept.
+    future<> stage(std::vector<uint64_t> locations);
+    inline void clear_staged() { _staged.clear(); }
+    // The value of the string @e, the staged one if it's tiered.
+    static bytes_view value_of(const cache_entry& e);
+
+    inline size_t values() const { return _values; }
+    inline size_t live_bytes() const { return _live_bytes; }
+    inline size_t file_size() const { return _segments.size() * SEGMENT_SIZE; }
+    inline uint64_t appended() const { return _appended; }
+    inline uint64_t reads() const { return _reads + _buffer_reads; }
+};
+
+}
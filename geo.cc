@@ -21,6 +21,12 @@
 #include "geo.hh"
 #include "common.hh"
 #include "util/log.hh"
+#include <algorithm>
+#include <cmath>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define PEDIS_GEO_X86 1
+#endif
 using logger =  seastar::logger;
 static logger geo_log ("db");
 namespace redis {
@@ -265,27 +271,22 @@ bool geo::dist(const double& lhash, const double& rhash, double& output)
     return dist(llongitude, llatitude, rlongitude, rlatitude, output);
 }
 
-static bool geohash_bounding_box(double longitude, double latitude, double radius, double* bounds)
+// Fills @bounds with the degrees around the center holding every point of @s:
+// the rectangle is the widest at the latitude the farthest from the equator.
+static void geohash_bounding_box(const geo::shape& s, double* bounds)
 {
-    if (!bounds) return false;
-
-    double lonr = deg_rad(longitude), latr = deg_rad(latitude);
-    if (radius > EARTH_RADIUS_IN_METERS)
-        radius = EARTH_RADIUS_IN_METERS;
-    double distance = radius / EARTH_RADIUS_IN_METERS;
-    double min_latitude = latr - distance;
-    double max_latitude = latr + distance;
-
-    double min_longitude, max_longitude;
-    double difference_longitude = std::asin(std::sin(distance) / std::cos(latr));
-    min_longitude = lonr - difference_longitude;
-    max_longitude = lonr + difference_longitude;
-
-    bounds[0] = rad_deg(min_longitude);
-    bounds[1] = rad_deg(min_latitude);
-    bounds[2] = rad_deg(max_longitude);
-    bounds[3] = rad_deg(max_latitude);
-    return true;
+    double half_width = s.box ? s.width / 2 : s.radius;
+    double half_height = s.box ? s.height / 2 : s.radius;
+    double latitude_delta = rad_deg(half_height / EARTH_RADIUS_IN_METERS);
+    double farthest = std::abs(s.latitude) + latitude_delta;
+    double longitude_delta = 360;
+    if (farthest < 90) {
+        longitude_delta = rad_deg(half_width / EARTH_RADIUS_IN_METERS / std::cos(deg_rad(farthest)));
+    }
+    bounds[0] = s.longitude - longitude_delta;
+    bounds[1] = s.latitude - latitude_delta;
+    bounds[2] = s.longitude + longitude_delta;
+    bounds[3] = s.latitude + latitude_delta;
 }
 
 static uint8_t geohash_estimate_steps_by_radius(double range, const double lat)
@@ -428,48 +429,39 @@ static void geohash_neighbors(const geo_hash& hash, geo_hash_neighbors& neighbor
     geohash_move_y(neighbors._south_west, -1);
 }
 
-static int fetch_points_in_box(geo_hash& h, double longitude, double latitude, double radius, geo::fetch_point& f, geo::points_type& points)
+static double align_hash(const geo_hash& h)
 {
-    uint64_t min = 0, max = 0;
-    auto align_hash = [] (const geo_hash& h) -> uint64_t {
-        uint64_t hash = h._hash;
-        hash <<= (52 - h._step * 2);
-        return hash;
-    };
-    min = align_hash(h);
-    h._hash++;
-    max = align_hash(h);
-    return f(min, max, longitude, latitude, radius, points);
+    uint64_t hash = h._hash;
+    hash <<= (52 - h._step * 2);
+    return hash;
 }
 
-bool geo::fetch_points_from_location(double longitude, double latitude, double radius, fetch_point&& f, points_type& points)
+bool geo::areas_of(const shape& s, std::vector<area>& areas, double* bounds)
 {
     geo_radius output;
 
-    double bounds[4];
-    if (geohash_bounding_box(longitude, latitude, radius, bounds) == false) {
-        return false;
-    }
+    geohash_bounding_box(s, bounds);
     double min_lon = bounds[0], max_lon = bounds[2], min_lat = bounds[1], max_lat = bounds[3];
 
-    // 1. step
-    output._hash._step = geohash_estimate_steps_by_radius(radius, latitude);
+    // 1. step, the rectangle is estimated by the circle around it.
+    double radius = s.box ? std::sqrt(s.width * s.width + s.height * s.height) / 2 : s.radius;
+    output._hash._step = geohash_estimate_steps_by_radius(radius, s.latitude);
 
     // 2. hash
     geo_hash_range longitude_range { GEO_LONG_MIN, GEO_LONG_MAX }, latitude_range { GEO_LAT_MIN, GEO_LAT_MAX };
-    if (geohash_encode_internal(longitude_range, latitude_range, longitude, latitude, output._hash._step, output._hash._hash) == false) {
+    if (geohash_encode_internal(longitude_range, latitude_range, s.longitude, s.latitude, output._hash._step, output._hash._hash) == false) {
         return false;
     }
 
     // 3. neighbors
     geohash_neighbors(output._hash, output._neighbors);
 
-
     // 4. area
     if (geohash_decode_internal(longitude_range, latitude_range, output._hash, output._area) == false) {
         return false;
     }
 
+    // the neighbors must reach the bounds, or the boxes are too small.
     bool decrease_step = false;
     {
         geo_hash_area north, south, east, west;
@@ -479,23 +471,23 @@ bool geo::fetch_points_from_location(double longitude, double latitude, double r
         geohash_decode_internal(longitude_range, latitude_range, output._neighbors._east, east);
         geohash_decode_internal(longitude_range, latitude_range, output._neighbors._west, west);
 
-        if (dist_internal(longitude, latitude, longitude, north._latitude_range._max) < radius) {
+        if (north._latitude_range._max < max_lat) {
             decrease_step = true;
         }
-        if (dist_internal(longitude, latitude, longitude, south._latitude_range._min) < radius) {
+        if (south._latitude_range._min > min_lat) {
             decrease_step = true;
         }
-        if (dist_internal(longitude, latitude, east._longitude_range._max, latitude) < radius) {
+        if (east._longitude_range._max < max_lon) {
             decrease_step = true;
         }
-        if (dist_internal(longitude, latitude, west._longitude_range._min, latitude) < radius) {
+        if (west._longitude_range._min > min_lon) {
             decrease_step = true;
         }
     }
 
-    if (decrease_step) {
+    if (decrease_step && output._hash._step > 1) {
         output._hash._step--;
-        if (geohash_encode_internal(longitude_range, latitude_range, longitude, latitude, output._hash._step, output._hash._hash) == false) {
+        if (geohash_encode_internal(longitude_range, latitude_range, s.longitude, s.latitude, output._hash._step, output._hash._hash) == false) {
             return false;
         }
         geohash_neighbors(output._hash, output._neighbors);
@@ -532,7 +524,6 @@ bool geo::fetch_points_from_location(double longitude, double latitude, double r
         output._neighbors._south_east,
         output._neighbors._south_west
     };
-    size_t count = 0;
     int last_processed = 0;
     for (int i = 0; i < 9; ++i) {
         auto& h = gh[i];
@@ -542,12 +533,148 @@ bool geo::fetch_points_from_location(double longitude, double latitude, double r
         if (last_processed && gh[i]._hash == gh[last_processed]._hash && gh[i]._step == gh[last_processed]._step) {
             continue;
         }
-        count += fetch_points_in_box(gh[i], longitude, latitude, radius, f, points);
+        // no point of a box is nearer than the latitudes apart, along a meridian.
+        geo_hash_area box;
+        double nearest = 0;
+        if (geohash_decode_internal(longitude_range, latitude_range, h, box)) {
+            if (s.latitude < box._latitude_range._min) {
+                nearest = EARTH_RADIUS_IN_METERS * deg_rad(box._latitude_range._min - s.latitude);
+            }
+            else if (s.latitude > box._latitude_range._max) {
+                nearest = EARTH_RADIUS_IN_METERS * deg_rad(s.latitude - box._latitude_range._max);
+            }
+        }
+        geo_hash next = h;
+        next._hash++;
+        areas.emplace_back(area { align_hash(h), align_hash(next), nearest });
         last_processed = i;
     }
+    std::stable_sort(areas.begin(), areas.end(), [] (const area& l, const area& r) { return l._nearest < r._nearest; });
+
+    // the boxes around the 180th meridian hold the longitudes of both sides.
+    if (bounds[0] < GEO_LONG_MIN || bounds[2] > GEO_LONG_MAX) {
+        bounds[0] = GEO_LONG_MIN;
+        bounds[2] = GEO_LONG_MAX;
+    }
     return true;
 }
 
+static size_t decode_within_generic(const double* scores, size_t n, const double* bounds, double* longitudes, double* latitudes, uint32_t* selected)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        geo::decode_from_geohash(scores[i], longitudes[i], latitudes[i]);
+        if (longitudes[i] >= bounds[0] && longitudes[i] <= bounds[2] && latitudes[i] >= bounds[1] && latitudes[i] <= bounds[3]) {
+            selected[count++] = i;
+        }
+    }
+    return count;
+}
+
+#ifdef PEDIS_GEO_X86
+// Decodes and filters 4 geohashes at once, as decode_from_geohash does: the
+// scores of the boxes are integers below 2^52, which convert exactly to and
+// from the mantissa of 2^52.
+__attribute__((target("avx2")))
+static size_t decode_within_avx2(const double* scores, size_t n, const double* bounds, double* longitudes, double* latitudes, uint32_t* selected)
+{
+    const __m256d magic = _mm256_set1_pd(4503599627370496.0);
+    const __m256i magic_bits = _mm256_castpd_si256(magic);
+    const __m256d steps = _mm256_set1_pd(1ull << GEO_HASH_STEP_MAX);
+    const __m256d one = _mm256_set1_pd(1);
+    const __m256d two = _mm256_set1_pd(2);
+    const __m256d lat_min = _mm256_set1_pd(GEO_LAT_MIN), lat_scale = _mm256_set1_pd(GEO_LAT_SCALE);
+    const __m256d long_min = _mm256_set1_pd(GEO_LONG_MIN), long_scale = _mm256_set1_pd(GEO_LONG_SCALE);
+    const __m256d min_lon = _mm256_set1_pd(bounds[0]), min_lat = _mm256_set1_pd(bounds[1]);
+    const __m256d max_lon = _mm256_set1_pd(bounds[2]), max_lat = _mm256_set1_pd(bounds[3]);
+    static const uint64_t B[] = {
+        0x5555555555555555ULL,
+        0x3333333333333333ULL,
+        0x0F0F0F0F0F0F0F0FULL,
+        0x00FF00FF00FF00FFULL,
+        0x0000FFFF0000FFFFULL,
+        0x00000000FFFFFFFFULL
+    };
+    size_t count = 0, i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto score = _mm256_round_pd(_mm256_loadu_pd(scores + i), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        auto hash = _mm256_xor_si256(_mm256_castpd_si256(_mm256_add_pd(score, magic)), magic_bits);
+        auto x = _mm256_and_si256(hash, _mm256_set1_epi64x(B[0]));
+        auto y = _mm256_and_si256(_mm256_srli_epi64(hash, 1), _mm256_set1_epi64x(B[0]));
+        x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi64(x, 1)), _mm256_set1_epi64x(B[1]));
+        y = _mm256_and_si256(_mm256_or_si256(y, _mm256_srli_epi64(y, 1)), _mm256_set1_epi64x(B[1]));
+        x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi64(x, 2)), _mm256_set1_epi64x(B[2]));
+        y = _mm256_and_si256(_mm256_or_si256(y, _mm256_srli_epi64(y, 2)), _mm256_set1_epi64x(B[2]));
+        x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi64(x, 4)), _mm256_set1_epi64x(B[3]));
+        y = _mm256_and_si256(_mm256_or_si256(y, _mm256_srli_epi64(y, 4)), _mm256_set1_epi64x(B[3]));
+        x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi64(x, 8)), _mm256_set1_epi64x(B[4]));
+        y = _mm256_and_si256(_mm256_or_si256(y, _mm256_srli_epi64(y, 8)), _mm256_set1_epi64x(B[4]));
+        x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi64(x, 16)), _mm256_set1_epi64x(B[5]));
+        y = _mm256_and_si256(_mm256_or_si256(y, _mm256_srli_epi64(y, 16)), _mm256_set1_epi64x(B[5]));
+        auto ilato = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(x, magic_bits)), magic);
+        auto ilono = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(y, magic_bits)), magic);
+        auto latitude_min = _mm256_add_pd(lat_min, _mm256_mul_pd(_mm256_div_pd(ilato, steps), lat_scale));
+        auto latitude_max = _mm256_add_pd(lat_min, _mm256_mul_pd(_mm256_div_pd(_mm256_add_pd(ilato, one), steps), lat_scale));
+        auto longitude_min = _mm256_add_pd(long_min, _mm256_mul_pd(_mm256_div_pd(ilono, steps), long_scale));
+        auto longitude_max = _mm256_add_pd(long_min, _mm256_mul_pd(_mm256_div_pd(_mm256_add_pd(ilono, one), steps), long_scale));
+        auto longitude = _mm256_div_pd(_mm256_add_pd(longitude_min, longitude_max), two);
+        auto latitude = _mm256_div_pd(_mm256_add_pd(latitude_min, latitude_max), two);
+        _mm256_storeu_pd(longitudes + i, longitude);
+        _mm256_storeu_pd(latitudes + i, latitude);
+        auto in = _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(longitude, min_lon, _CMP_GE_OQ), _mm256_cmp_pd(longitude, max_lon, _CMP_LE_OQ)),
+                                _mm256_and_pd(_mm256_cmp_pd(latitude, min_lat, _CMP_GE_OQ), _mm256_cmp_pd(latitude, max_lat, _CMP_LE_OQ)));
+        auto mask = _mm256_movemask_pd(in);
+        while (mask) {
+            selected[count++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    auto rest = decode_within_generic(scores + i, n - i, bounds, longitudes + i, latitudes + i, selected + count);
+    for (size_t j = count; j < count + rest; ++j) {
+        selected[j] += i;
+    }
+    return count + rest;
+}
+#endif
+
+using decode_within_kernel = size_t (*)(const double*, size_t, const double*, double*, double*, uint32_t*);
+
+static decode_within_kernel select_decode_within()
+{
+#ifdef PEDIS_GEO_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return decode_within_avx2;
+    }
+#endif
+    return decode_within_generic;
+}
+
+static const decode_within_kernel decode_within_kernel_selected = select_decode_within();
+
+size_t geo::decode_within(const double* scores, size_t n, const double* bounds, double* longitudes, double* latitudes, uint32_t* selected)
+{
+    return decode_within_kernel_selected(scores, n, bounds, longitudes, latitudes, selected);
+}
+
+bool geo::inside(const shape& s, double longitude, double latitude, double& dist)
+{
+    if (s.box) {
+        // as Redis does, the height along the meridian, the width along the parallel of the point.
+        double height = EARTH_RADIUS_IN_METERS * std::abs(deg_rad(latitude) - deg_rad(s.latitude));
+        if (height > s.height / 2) {
+            return false;
+        }
+        if (dist_internal(longitude, latitude, s.longitude, latitude) > s.width / 2) {
+            return false;
+        }
+        dist = dist_internal(s.longitude, s.latitude, longitude, latitude);
+        return true;
+    }
+    dist = dist_internal(s.longitude, s.latitude, longitude, latitude);
+    return dist <= s.radius;
+}
+
 bool geo::to_meters(double& n, int flags)
 {
     if (flags & GEO_UNIT_M) {
@@ -556,10 +683,10 @@ bool geo::to_meters(double& n, int flags)
         n *= 1000;
     }
     else if (flags & GEO_UNIT_MI) {
-        n *= 0.3048;
+        n *= 1609.34;
     }
     else if (flags & GEO_UNIT_FT) {
-        n *= 1609.34;
+        n *= 0.3048;
     }
     else {
         return false;
@@ -575,10 +702,10 @@ bool geo::from_meters(double& n, int flags)
         n /= 1000;
     }
     else if (flags & GEO_UNIT_MI) {
-        n /= 0.3048;
+        n /= 1609.34;
     }
     else if (flags & GEO_UNIT_FT) {
-        n /= 1609.34;
+        n /= 0.3048;
     }
     else {
         return false;
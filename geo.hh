@@ -32,8 +32,33 @@ public:
 
     //[key, dist, score, longitude, latitude]
     using points_type = std::vector<std::tuple<sstring, double, double, double, double>>;
-    using fetch_point = std::function<size_t (uint64_t, uint64_t, const double, const double, const double, points_type& points)>;
-    static bool fetch_points_from_location(double longitude, double latitude, double radius, fetch_point&& f, points_type& points);
+
+    // The circle of GEORADIUS, or the rectangle of GEOSEARCH BYBOX, around
+    // a center, in meters.
+    struct shape {
+        double longitude = 0;
+        double latitude = 0;
+        double radius = 0;
+        double width = 0;
+        double height = 0;
+        bool box = false;
+    };
+    // The scores [_min, _max) of a geohash box, and the least distance from
+    // the center of the shape to any point of the box.
+    struct area {
+        double _min;
+        double _max;
+        double _nearest;
+    };
+    // Fills @areas with the boxes covering @s, the nearest first, and @bounds
+    // with the degrees (min longitude, min latitude, max longitude, max latitude)
+    // holding every point of @s.
+    static bool areas_of(const shape& s, std::vector<area>& areas, double* bounds);
+    // Decodes the @n geohashes of @scores, and fills @selected with the indexes
+    // of the points within @bounds. Returns the number of selected points.
+    static size_t decode_within(const double* scores, size_t n, const double* bounds, double* longitudes, double* latitudes, uint32_t* selected);
+    // Returns true if the point is in @s, @dist is its distance to the center.
+    static bool inside(const shape& s, double longitude, double latitude, double& dist);
     static bool to_meters(double& n, int flags);
     static bool from_meters(double& n, int flags);
 };
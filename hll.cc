@@ -20,6 +20,12 @@
 */
 #include "hll.hh"
 #include "common.hh"
+#include <algorithm>
+#include <cstring>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define PEDIS_HLL_X86 1
+#endif
 
 namespace redis {
 
@@ -38,6 +44,9 @@ static constexpr const double PE[64] = {
     1.0 / (1ULL << 57), 1.0 / (1ULL << 58), 1.0 / (1ULL << 59), 1.0 / (1ULL << 60), 1.0 / (1ULL << 61), 1.0 / (1ULL << 62), 1.0 / (1ULL << 63) 
 };
 
+static constexpr const int HLL_SPARSE_VAL_MAX = 32;
+static constexpr const size_t HLL_REGISTERS_SIZE = HLL_BYTES_SIZE - HLL_CARD_CACHE_SIZE;
+
 static inline void hll_invalidate_cache(uint8_t* cache, size_t size)
 {
     if (size > 7) {
@@ -50,6 +59,7 @@ static inline bool hll_is_valid_cache(const uint8_t* cache, size_t size)
     return size > 7 && (cache[7] & (1 << 7)) == 0;
 }
 
+// The last register ends on a byte boundary, the byte after it is not touched.
 static inline void hll_get_counter_on_bucket(uint8_t& counter, const uint8_t* p, long index)
 {
     const uint8_t* _p = p;
@@ -57,7 +67,7 @@ static inline void hll_get_counter_on_bucket(uint8_t& counter, const uint8_t* p,
     unsigned long _fb = index * HLL_BITS & 7;
     unsigned long _fb8 = 8 - _fb;
     unsigned long b0 = _p[_byte];
-    unsigned long b1 = _p[_byte+1];
+    unsigned long b1 = _fb8 < HLL_BITS ? _p[_byte+1] : 0;
     counter = ((b0 >> _fb) | (b1 << _fb8)) & HLL_BUCKET_COUNT_MAX;
 }
 
@@ -70,75 +80,333 @@ static inline void hll_set_counter_on_bucket(uint8_t* p, long index, uint8_t cou
     unsigned long _v = counter;
     _p[_byte] &= ~(HLL_BUCKET_COUNT_MAX << _fb);
     _p[_byte] |= _v << _fb;
-    _p[_byte+1] &= ~(HLL_BUCKET_COUNT_MAX >> _fb8);
-    _p[_byte+1] |= _v >> _fb8;
+    if (_fb8 < HLL_BITS) {
+        _p[_byte+1] &= ~(HLL_BUCKET_COUNT_MAX >> _fb8);
+        _p[_byte+1] |= _v >> _fb8;
+    }
 }
 
-bool hll_add(managed_bytes& data, const sstring& element)
+// The register of @element and the count to raise it to.
+static inline void hll_hash(const sstring& element, long& index, uint8_t& count)
 {
-    uint8_t oldcount = 0, count = 1;
-    uint8_t* p = (uint8_t*)(data.data()) + HLL_CARD_CACHE_SIZE;
     auto hash = (uint64_t)(std::hash<sstring>()(element));
     //auto hash = murmur_hash_64a((uint8_t*)element.data(), element.size(), 0xadc83b19ULL);
-    auto index = hash & HLL_BUCKET_COUNT_MASK;
+    index = hash & HLL_BUCKET_COUNT_MASK;
     hash |= ((uint64_t) 1 << 63);
     uint64_t bit = HLL_BUCKET_COUNT;
+    count = 1;
     while ((hash & bit) == 0) {
         ++count;
         bit <<= 1;
     }
-    hll_get_counter_on_bucket(oldcount, p, index);
-    if (count > oldcount) {
-        hll_set_counter_on_bucket(p, index, count);
-        hll_invalidate_cache((uint8_t*)(data.data()), HLL_CARD_CACHE_SIZE);
-        return true;
+}
+
+static inline uint8_t* hll_registers(managed_bytes& data)
+{
+    return reinterpret_cast<uint8_t*>(data.data()) + HLL_CARD_CACHE_SIZE;
+}
+
+static inline const uint8_t* hll_registers(const managed_bytes& data)
+{
+    return reinterpret_cast<const uint8_t*>(data.data()) + HLL_CARD_CACHE_SIZE;
+}
+
+// The sparse opcodes of Redis:
+//   ZERO  00xxxxxx           xxxxxx + 1 registers set to 0 (up to 64)
+//   XZERO 01xxxxxx yyyyyyyy  xxxxxxyyyyyyyy + 1 registers set to 0 (up to 16384)
+//   VAL   1vvvvvxx           xx + 1 registers set to vvvvv + 1 (up to 4, and 32)
+// Invokes func(index, run, value) on every run of registers, returns false if
+// the opcodes do not cover exactly the registers.
+template <typename Func>
+static bool hll_sparse_for_each_run(const uint8_t* p, size_t size, Func&& func)
+{
+    auto end = p + size;
+    size_t index = 0;
+    while (p < end) {
+        size_t run = 0;
+        uint8_t value = 0;
+        if ((*p & 0xc0) == 0) {
+            run = (*p & 0x3f) + 1;
+            ++p;
+        }
+        else if ((*p & 0xc0) == 0x40) {
+            if (end - p < 2) {
+                return false;
+            }
+            run = ((size_t(*p & 0x3f) << 8) | p[1]) + 1;
+            p += 2;
+        }
+        else {
+            value = ((*p >> 2) & 0x1f) + 1;
+            run = (*p & 0x3) + 1;
+            ++p;
+        }
+        if (index + run > HLL_BUCKET_COUNT) {
+            return false;
+        }
+        func(index, run, value);
+        index += run;
     }
-    return false;
+    return index == HLL_BUCKET_COUNT;
 }
 
-size_t hll::append(managed_bytes& data, const std::vector<sstring>& elements)
+// The registers of a sparse HyperLogLog which are not zero, by index.
+using hll_sparse_registers = std::vector<std::pair<uint16_t, uint8_t>>;
+
+static void hll_sparse_decode(const uint8_t* p, size_t size, hll_sparse_registers& registers)
 {
-    size_t result = 0;
-    for (size_t i = 0; i < elements.size(); ++i) {
-        if (hll_add(data, elements[i])) {
-            ++result;
+    hll_sparse_for_each_run(p, size, [&registers] (size_t index, size_t run, uint8_t value) {
+        if (value != 0) {
+            for (size_t i = 0; i < run; ++i) {
+                registers.emplace_back(static_cast<uint16_t>(index + i), value);
+            }
         }
+    });
+}
+
+static void hll_sparse_zeros(std::vector<uint8_t>& out, size_t run)
+{
+    while (run > 64) {
+        auto n = std::min<size_t>(run, HLL_BUCKET_COUNT);
+        out.push_back(static_cast<uint8_t>(0x40 | ((n - 1) >> 8)));
+        out.push_back(static_cast<uint8_t>((n - 1) & 0xff));
+        run -= n;
+    }
+    if (run > 0) {
+        out.push_back(static_cast<uint8_t>(run - 1));
     }
-    return result > 0;
 }
 
+// Encodes the @registers, returns false if they do not fit in the sparse
+// encoding.
+static bool hll_sparse_encode(const hll_sparse_registers& registers, std::vector<uint8_t>& out)
+{
+    size_t index = 0;
+    for (size_t i = 0; i < registers.size();) {
+        auto value = registers[i].second;
+        if (value > HLL_SPARSE_VAL_MAX || out.size() > hll::SPARSE_MAX_BYTES) {
+            return false;
+        }
+        hll_sparse_zeros(out, registers[i].first - index);
+        index = registers[i].first;
+        size_t run = 1;
+        while (run < 4 && i + run < registers.size() && registers[i + run].first == index + run && registers[i + run].second == value) {
+            ++run;
+        }
+        out.push_back(static_cast<uint8_t>(0x80 | ((value - 1) << 2) | (run - 1)));
+        index += run;
+        i += run;
+    }
+    hll_sparse_zeros(out, HLL_BUCKET_COUNT - index);
+    return out.size() <= hll::SPARSE_MAX_BYTES;
+}
 
-static double hll_bucket_counter_sum(const uint8_t* data, size_t size, int& ez)
+// The value, with an invalid cached cardinality, of the registers @size bytes
+// at @p, or of @size zeros if @p is nullptr.
+template <typename Bytes>
+static Bytes hll_make_value(const uint8_t* p, size_t size)
 {
-    ez = 0;
-    double E = 0;
+    Bytes value(typename Bytes::initialized_later(), HLL_CARD_CACHE_SIZE + size);
+    auto v = reinterpret_cast<uint8_t*>(value.begin());
+    std::memset(v, 0, HLL_CARD_CACHE_SIZE);
+    hll_invalidate_cache(v, HLL_CARD_CACHE_SIZE);
+    if (p != nullptr) {
+        std::memcpy(v + HLL_CARD_CACHE_SIZE, p, size);
+    }
+    else {
+        std::memset(v + HLL_CARD_CACHE_SIZE, 0, size);
+    }
+    return value;
+}
+
+static void hll_sparse_store(managed_bytes& data, const hll_sparse_registers& registers)
+{
+    std::vector<uint8_t> encoded;
+    if (hll_sparse_encode(registers, encoded)) {
+        data = hll_make_value<managed_bytes>(encoded.data(), encoded.size());
+        return;
+    }
+    auto dense = hll_make_value<managed_bytes>(nullptr, HLL_REGISTERS_SIZE);
+    auto p = hll_registers(dense);
+    for (auto& r : registers) {
+        hll_set_counter_on_bucket(p, r.first, r.second);
+    }
+    data = std::move(dense);
+}
+
+// The kernels of the dense registers: unpacking them to bytes, and merging
+// the bytes, use AVX2 when the CPU has it.
+static void hll_unpack_max_generic(const uint8_t* p, uint8_t* raw, size_t groups)
+{
+    for (size_t i = 0; i < groups; ++i, p += 3, raw += 4) {
+        uint8_t r[4] = {
+            uint8_t(p[0] & 63),
+            uint8_t((p[0] >> 6 | p[1] << 2) & 63),
+            uint8_t((p[1] >> 4 | p[2] << 4) & 63),
+            uint8_t(p[2] >> 2)
+        };
+        for (int j = 0; j < 4; ++j) {
+            raw[j] = std::max(raw[j], r[j]);
+        }
+    }
+}
+
+static void hll_max_generic(uint8_t* raw, const uint8_t* other, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        raw[i] = std::max(raw[i], other[i]);
+    }
+}
+
+#ifdef PEDIS_HLL_X86
+// Every 16-bit lane picks the two bytes holding its register, aligned by its
+// own shift. 24 bytes give 32 registers, reading 10 bytes past them.
+__attribute__((target("avx2")))
+static inline __m256i hll_unpack16_avx2(const uint8_t* p)
+{
+    const __m256i shuffle = _mm256_setr_epi8(0, 1, 0, 1, 1, 2, 1, 2, 3, 4, 3, 4, 4, 5, 4, 5,
+                                             0, 1, 0, 1, 1, 2, 1, 2, 3, 4, 3, 4, 4, 5, 4, 5);
+    auto v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))),
+                                     _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 6)), 1);
+    auto t = _mm256_shuffle_epi8(v, shuffle);
+    auto x = _mm256_blend_epi16(t, _mm256_srli_epi16(t, 6), 0x22);
+    x = _mm256_blend_epi16(x, _mm256_srli_epi16(t, 4), 0x44);
+    x = _mm256_blend_epi16(x, _mm256_srli_epi16(t, 10), 0x88);
+    return _mm256_and_si256(x, _mm256_set1_epi16(63));
+}
+
+__attribute__((target("avx2")))
+static void hll_unpack_max_avx2(const uint8_t* p, uint8_t* raw, size_t groups)
+{
+    size_t i = 0;
+    for (; i + 8 + 4 <= groups; i += 8, p += 24, raw += 32) {
+        auto packed = _mm256_packus_epi16(hll_unpack16_avx2(p), hll_unpack16_avx2(p + 12));
+        auto registers = _mm256_permute4x64_epi64(packed, 0xd8);
+        auto r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(raw));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(raw), _mm256_max_epu8(r, registers));
+    }
+    hll_unpack_max_generic(p, raw, groups - i);
+}
+
+__attribute__((target("avx2")))
+static void hll_max_avx2(uint8_t* raw, const uint8_t* other, size_t size)
+{
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        auto r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(raw + i));
+        auto o = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(other + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(raw + i), _mm256_max_epu8(r, o));
+    }
+    hll_max_generic(raw + i, other + i, size - i);
+}
+#endif
+
+struct hll_kernels {
+    void (*unpack_max)(const uint8_t* p, uint8_t* raw, size_t groups);
+    void (*max)(uint8_t* raw, const uint8_t* other, size_t size);
+};
+
+static hll_kernels hll_select_kernels()
+{
+#ifdef PEDIS_HLL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return hll_kernels { hll_unpack_max_avx2, hll_max_avx2 };
+    }
+#endif
+    return hll_kernels { hll_unpack_max_generic, hll_max_generic };
+}
+
+static const hll_kernels kernels = hll_select_kernels();
+
+// Adds the number of dense registers of every value to @histogram, 8 registers
+// out of every 6 bytes, in 4 histograms not to wait on the same counters.
+static void hll_dense_histogram(const uint8_t* p, uint32_t* histogram)
+{
+    uint32_t h[4][64] = {};
+    for (size_t i = 0; i < HLL_REGISTERS_SIZE; i += 6) {
+        uint64_t w = 0;
+        std::memcpy(&w, p + i, 6);
+        ++h[0][w & 63];
+        ++h[1][(w >> 6) & 63];
+        ++h[2][(w >> 12) & 63];
+        ++h[3][(w >> 18) & 63];
+        ++h[0][(w >> 24) & 63];
+        ++h[1][(w >> 30) & 63];
+        ++h[2][(w >> 36) & 63];
+        ++h[3][(w >> 42) & 63];
+    }
+    for (int v = 0; v < 64; ++v) {
+        histogram[v] += h[0][v] + h[1][v] + h[2][v] + h[3][v];
+    }
+}
+
+static void hll_raw_histogram(const uint8_t* raw, uint32_t* histogram)
+{
+    uint32_t h[4][64] = {};
+    for (size_t i = 0; i < HLL_BUCKET_COUNT; i += 4) {
+        ++h[0][raw[i] & 63];
+        ++h[1][raw[i + 1] & 63];
+        ++h[2][raw[i + 2] & 63];
+        ++h[3][raw[i + 3] & 63];
+    }
+    for (int v = 0; v < 64; ++v) {
+        histogram[v] += h[0][v] + h[1][v] + h[2][v] + h[3][v];
+    }
+}
+
+static void hll_histogram(const uint8_t* p, size_t size, uint32_t* histogram)
+{
+    if (size == HLL_REGISTERS_SIZE) {
+        hll_dense_histogram(p, histogram);
+        return;
+    }
+    hll_sparse_for_each_run(p, size, [histogram] (size_t, size_t run, uint8_t value) {
+        histogram[value] += run;
+    });
+}
 
-    const uint8_t *r = data;
-    unsigned long r0, r1, r2, r3, r4, r5, r6, r7, r8, r9, r10, r11, r12, r13, r14, r15;
-    for (int j = 0; j < 1024; j++) {
-        r0 = r[0] & 63; if (r0 == 0) ez++;
-        r1 = (r[0] >> 6 | r[1] << 2) & 63; if (r1 == 0) ez++;
-        r2 = (r[1] >> 4 | r[2] << 4) & 63; if (r2 == 0) ez++;
-        r3 = (r[2] >> 2) & 63; if (r3 == 0) ez++;
-        r4 = r[3] & 63; if (r4 == 0) ez++;
-        r5 = (r[3] >> 6 | r[4] << 2) & 63; if (r5 == 0) ez++;
-        r6 = (r[4] >> 4 | r[5] << 4) & 63; if (r6 == 0) ez++;
-        r7 = (r[5] >> 2) & 63; if (r7 == 0) ez++;
-        r8 = r[6] & 63; if (r8 == 0) ez++;
-        r9 = (r[6] >> 6 | r[7] << 2) & 63; if (r9 == 0) ez++;
-        r10 = (r[7] >> 4 | r[8] << 4) & 63; if (r10 == 0) ez++;
-        r11 = (r[8] >> 2) & 63; if (r11 == 0) ez++;
-        r12 = r[9] & 63; if (r12 == 0) ez++;
-        r13 = (r[9] >> 6 | r[10] << 2) & 63; if (r13 == 0) ez++;
-        r14 = (r[10] >> 4 | r[11] << 4) & 63; if (r14 == 0) ez++;
-        r15 = (r[11] >> 2) & 63; if (r15 == 0) ez++;
-
-        E += (PE[r0] + PE[r1]) + (PE[r2] + PE[r3]) + (PE[r4] + PE[r5]) +
-            (PE[r6] + PE[r7]) + (PE[r8] + PE[r9]) + (PE[r10] + PE[r11]) +
-            (PE[r12] + PE[r13]) + (PE[r14] + PE[r15]);
-        r += 12;
-    }
-    return E;
+size_t hll::append(managed_bytes& data, const std::vector<sstring>& elements)
+{
+    bool changed = false;
+    long index = 0;
+    uint8_t count = 0;
+    if (!is_sparse(data)) {
+        auto p = hll_registers(data);
+        for (auto& element : elements) {
+            hll_hash(element, index, count);
+            uint8_t oldcount = 0;
+            hll_get_counter_on_bucket(oldcount, p, index);
+            if (count > oldcount) {
+                hll_set_counter_on_bucket(p, index, count);
+                changed = true;
+            }
+        }
+        if (changed) {
+            hll_invalidate_cache(reinterpret_cast<uint8_t*>(data.data()), HLL_CARD_CACHE_SIZE);
+        }
+        return changed;
+    }
+    hll_sparse_registers registers;
+    hll_sparse_decode(hll_registers(data), data.size() - HLL_CARD_CACHE_SIZE, registers);
+    for (auto& element : elements) {
+        hll_hash(element, index, count);
+        auto it = std::lower_bound(registers.begin(), registers.end(), index, [] (const std::pair<uint16_t, uint8_t>& r, long i) { return r.first < i; });
+        if (it != registers.end() && it->first == index) {
+            if (count > it->second) {
+                it->second = count;
+                changed = true;
+            }
+        }
+        else {
+            registers.emplace(it, static_cast<uint16_t>(index), count);
+            changed = true;
+        }
+    }
+    if (changed) {
+        hll_sparse_store(data, registers);
+    }
+    return changed;
 }
 
 static size_t hll_read_card_from_cache(const managed_bytes& data)
@@ -169,13 +437,15 @@ static void hll_write_card_to_cache(uint64_t card, managed_bytes& data)
     p[7] = (card >> 56) & 0xff;
 }
 
-
-static uint64_t compute_card(const uint8_t* data, size_t size)
+// The estimate from the number of registers of every value.
+static uint64_t compute_card(const uint32_t* histogram)
 {
-    int ez = 0;
-    auto S = hll_bucket_counter_sum(data, size, ez);
-
-    S = (1/ S )* ALPHA_BUCKET_COUNT_POWER_2;
+    double E = 0;
+    for (int v = 0; v < 64; ++v) {
+        E += histogram[v] * PE[v];
+    }
+    auto ez = histogram[0];
+    auto S = (1/ E)* ALPHA_BUCKET_COUNT_POWER_2;
 
     if (S < HLL_BUCKET_COUNT * 2.5 && ez != 0) {
         S = HLL_BUCKET_COUNT * std::log ( double(HLL_BUCKET_COUNT) / double(ez));
@@ -192,59 +462,131 @@ static uint64_t compute_card(const uint8_t* data, size_t size)
 
 size_t hll::count(managed_bytes& data)
 {
-    uint64_t card = 0;
     // read the card from cache.
     if (hll_is_valid_cache((uint8_t*)(data.data()), HLL_CARD_CACHE_SIZE)) {
         return hll_read_card_from_cache(data);
     }
     // compute the value of card.
-    auto S = compute_card((uint8_t*)(data.data()) + HLL_CARD_CACHE_SIZE, data.size() - HLL_CARD_CACHE_SIZE);
-    card = (uint64_t) S;
+    uint32_t histogram[64] = {};
+    hll_histogram(hll_registers(data), data.size() - HLL_CARD_CACHE_SIZE, histogram);
+    auto card = compute_card(histogram);
     hll_write_card_to_cache(card, data);
     return (size_t) card;
 }
 
-size_t hll::count(const uint8_t* merged_sources, size_t size)
+bytes_view hll::empty()
 {
-    auto S = compute_card(merged_sources + HLL_CARD_CACHE_SIZE, size - HLL_CARD_CACHE_SIZE);
-    return (size_t) S;
+    static const int8_t value[] = { 0, 0, 0, 0, 0, 0, 0, int8_t(0x80), 0x7f, int8_t(0xff) };
+    return bytes_view(value, sizeof(value));
 }
 
-size_t hll::merge(managed_bytes& data, const uint8_t* merged_sources, size_t size)
+void hll::merge(uint8_t* raw, const char* data, size_t size)
 {
-    if (size != HLL_BYTES_SIZE) {
-        return 0;
+    if (size < HLL_CARD_CACHE_SIZE) {
+        return;
     }
-    uint8_t* p = (uint8_t*)(data.data()) + HLL_CARD_CACHE_SIZE;
-    const uint8_t* s = merged_sources + HLL_CARD_CACHE_SIZE;
-    uint8_t counter = 0, counter_s = 0;
-    for (size_t i = 0; i < HLL_BUCKET_COUNT; ++i) {
-        hll_get_counter_on_bucket(counter_s, s, i);
-        hll_get_counter_on_bucket(counter, p, i);
-        if (counter_s > counter) {
-            hll_set_counter_on_bucket(p, i, counter_s);
-        }
+    auto p = reinterpret_cast<const uint8_t*>(data) + HLL_CARD_CACHE_SIZE;
+    size -= HLL_CARD_CACHE_SIZE;
+    if (size == HLL_REGISTERS_SIZE) {
+        kernels.unpack_max(p, raw, HLL_BUCKET_COUNT / 4);
+        return;
     }
-    hll_invalidate_cache((uint8_t*)data.data(), HLL_CARD_CACHE_SIZE);
-    return 1;
+    hll_sparse_for_each_run(p, size, [raw] (size_t index, size_t run, uint8_t value) {
+        if (value != 0) {
+            for (size_t i = index; i < index + run; ++i) {
+                raw[i] = std::max(raw[i], value);
+            }
+        }
+    });
+}
+
+void hll::merge(uint8_t* raw, const managed_bytes& data)
+{
+    merge(raw, reinterpret_cast<const char*>(data.data()), data.size());
 }
 
-size_t hll::merge(uint8_t* data, size_t size, const sstring& merged_sources)
+void hll::merge(managed_bytes& data, const uint8_t* raw)
 {
-    if (merged_sources.size() != HLL_BYTES_SIZE) {
-        return 0;
+    std::vector<uint8_t> registers(RAW_SIZE, 0);
+    merge(registers.data(), data);
+    kernels.max(registers.data(), raw, RAW_SIZE);
+    auto value = compact(registers.data());
+    data = managed_bytes(bytes_view(reinterpret_cast<const int8_t*>(value.begin()), value.size()));
+}
+
+size_t hll::count(const uint8_t* raw)
+{
+    uint32_t histogram[64] = {};
+    hll_raw_histogram(raw, histogram);
+    return (size_t) compute_card(histogram);
+}
+
+sstring hll::compact(const uint8_t* raw)
+{
+    hll_sparse_registers registers;
+    bool sparse = true;
+    for (size_t i = 0; i < RAW_SIZE && sparse; ++i) {
+        if (raw[i] != 0) {
+            registers.emplace_back(static_cast<uint16_t>(i), raw[i]);
+            sparse = raw[i] <= HLL_SPARSE_VAL_MAX && registers.size() <= SPARSE_MAX_BYTES * 4;
+        }
+    }
+    std::vector<uint8_t> encoded;
+    if (sparse && hll_sparse_encode(registers, encoded)) {
+        return hll_make_value<sstring>(encoded.data(), encoded.size());
     }
-    uint8_t* p = data + HLL_CARD_CACHE_SIZE;
-    const uint8_t* s = (uint8_t*)(merged_sources.data()) + HLL_CARD_CACHE_SIZE;
-    uint8_t counter = 0, counter_s = 0;
-    for (size_t i = 0; i < HLL_BUCKET_COUNT; ++i) {
-        hll_get_counter_on_bucket(counter_s, s, i);
-        hll_get_counter_on_bucket(counter, p, i);
-        if (counter_s > counter) {
-            hll_set_counter_on_bucket(p, i, counter_s);
+    auto dense = hll_make_value<sstring>(nullptr, HLL_REGISTERS_SIZE);
+    auto p = reinterpret_cast<uint8_t*>(dense.begin()) + HLL_CARD_CACHE_SIZE;
+    for (size_t i = 0; i < RAW_SIZE; ++i) {
+        if (raw[i] != 0) {
+            hll_set_counter_on_bucket(p, i, raw[i]);
         }
     }
-    hll_invalidate_cache(data, HLL_CARD_CACHE_SIZE);
-    return 1;
+    return dense;
+}
+
+void hll::redis_header(const managed_bytes& data, uint8_t* header)
+{
+    static const uint8_t magic[] = { 'H', 'Y', 'L', 'L', 0, 0, 0, 0 };
+    std::memcpy(header, magic, sizeof(magic));
+    header[4] = is_sparse(data) ? 1 : 0;
+    std::memcpy(header + sizeof(magic), data.data(), HLL_CARD_CACHE_SIZE);
+    hll_invalidate_cache(header + sizeof(magic), HLL_CARD_CACHE_SIZE);
+}
+
+sstring hll::to_redis(const managed_bytes& data)
+{
+    auto registers = data.size() - HLL_CARD_CACHE_SIZE;
+    sstring encoded(sstring::initialized_later(), DENSE_HEADER_SIZE + registers);
+    redis_header(data, reinterpret_cast<uint8_t*>(encoded.begin()));
+    std::memcpy(encoded.begin() + DENSE_HEADER_SIZE, data.data() + HLL_CARD_CACHE_SIZE, registers);
+    return encoded;
+}
+
+bool hll::is_redis_encoding(const char* data, size_t size)
+{
+    if (size <= DENSE_HEADER_SIZE || std::memcmp(data, "HYLL", 4) != 0) {
+        return false;
+    }
+    if (data[4] == 0) {
+        return size == DENSE_SIZE;
+    }
+    auto p = reinterpret_cast<const uint8_t*>(data) + DENSE_HEADER_SIZE;
+    return data[4] == 1 && hll_sparse_for_each_run(p, size - DENSE_HEADER_SIZE, [] (size_t, size_t, uint8_t) {});
+}
+
+managed_bytes hll::import(const char* data, size_t size)
+{
+    auto p = reinterpret_cast<const uint8_t*>(data) + DENSE_HEADER_SIZE;
+    size -= DENSE_HEADER_SIZE;
+    // the sparse HyperLogLogs of Redis may be longer than ours.
+    if (data[4] == 1 && size > SPARSE_MAX_BYTES) {
+        hll_sparse_registers registers;
+        hll_sparse_decode(p, size, registers);
+        managed_bytes value;
+        hll_sparse_store(value, registers);
+        return value;
+    }
+    return hll_make_value<managed_bytes>(p, size);
 }
 }
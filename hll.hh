@@ -21,14 +21,52 @@
 #pragma once
 #include "core/sstring.hh"
 #include "utils/managed_bytes.hh"
+#include "common.hh"
 namespace redis {
+// A HyperLogLog is kept as the cached cardinality (HLL_CARD_CACHE_SIZE bytes)
+// followed by either the sparse or the dense registers of Redis. The sparse
+// opcodes code runs of registers, a new HyperLogLog takes 10 bytes. It turns
+// dense, 6 bits per register, once its opcodes would take more than
+// SPARSE_MAX_BYTES or a register exceeds 32. The value is dense if and only
+// if it is HLL_BYTES_SIZE long.
+//
+// The multi-key commands merge the registers one byte each ("raw"), the
+// shards send their HyperLogLogs compacted.
 class hll {
 public:
+    static constexpr const size_t SPARSE_MAX_BYTES = 3000;
+    static constexpr const size_t RAW_SIZE = HLL_BUCKET_COUNT;
+
+    // The value of a new, empty HyperLogLog.
+    static bytes_view empty();
+    static inline bool is_sparse(const managed_bytes& data) {
+        return data.size() != HLL_BYTES_SIZE;
+    }
     static size_t append(managed_bytes& data, const std::vector<sstring>& elements);
     static size_t count(managed_bytes& data);
-    static size_t count(const uint8_t* merged_sources, size_t size);
-    static size_t merge(managed_bytes& data, const uint8_t* merged_sources, size_t size); 
-    static size_t merge(uint8_t* dest, size_t size, const sstring& merged_sources); 
+
+    // Raises the @raw registers to those of the value @data of @size bytes.
+    static void merge(uint8_t* raw, const char* data, size_t size);
+    static void merge(uint8_t* raw, const managed_bytes& data);
+    // Raises the registers of @data to the @raw ones.
+    static void merge(managed_bytes& data, const uint8_t* raw);
+    static size_t count(const uint8_t* raw);
+    // The value holding the @raw registers, sparse if they fit.
+    static sstring compact(const uint8_t* raw);
+
+    // The HyperLogLog of Redis: a 16 bytes header ("HYLL", the encoding, 3
+    // unused bytes and the cached cardinality), then the registers, laid out as
+    // the registers of Pedis.
+    static constexpr const size_t DENSE_HEADER_SIZE = 16;
+    static constexpr const size_t DENSE_SIZE = DENSE_HEADER_SIZE + HLL_BYTES_SIZE - HLL_CARD_CACHE_SIZE;
+    // Fills the header of the Redis encoding of @data, the cached cardinality
+    // is invalidated since the reader recomputes it.
+    static void redis_header(const managed_bytes& data, uint8_t* header);
+    // The Redis encoding of @data as a string.
+    static sstring to_redis(const managed_bytes& data);
+    static bool is_redis_encoding(const char* data, size_t size);
+    // The value of the Redis encoding @data, which is_redis_encoding().
+    static managed_bytes import(const char* data, size_t size);
 };
 
 }
@@ -0,0 +1,158 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/reactor.hh"
+#include "core/sstring.hh"
+#include "core/timer.hh"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+namespace redis {
+
+// Space-saving sketch of the keys accessed by the clients of a shard, with
+// the number of keys going to every shard. One access in SAMPLE_RATE is
+// counted. When a new key is sampled and all the CAPACITY counters are
+// taken, the smallest counter goes to the new key, which inherits its count
+// as the error. Every key accessed more often than 1 / CAPACITY of the
+// samples keeps its counter. Every PERIOD_SECONDS the counts are halved, so they
+// follow the current load: a key sampled r times per period settles at 2r.
+class hot_keys final {
+public:
+    static constexpr const size_t CAPACITY = 128;
+    static constexpr const unsigned SAMPLE_RATE = 16;
+    static constexpr const unsigned PERIOD_SECONDS = 1;
+
+    struct counter {
+        sstring _key;
+        unsigned _shard;
+        uint64_t _count;
+        uint64_t _error;
+        // The accesses per second, estimated from the decayed count.
+        inline double ops() const {
+            return static_cast<double>(_count) * SAMPLE_RATE / (2 * PERIOD_SECONDS);
+        }
+    };
+private:
+    std::vector<counter> _counters;
+    std::unordered_map<sstring, size_t> _index;
+    // The sampled keys owned by every shard in the current period, and the
+    // estimated accesses per second of the last one.
+    std::vector<uint64_t> _sampled_by_shard;
+    std::vector<double> _ops_by_shard;
+    uint64_t _sampled = 0;
+    std::minstd_rand _random;
+    timer<lowres_clock> _timer;
+
+    void add(const sstring& key, unsigned shard) {
+        auto it = _index.find(key);
+        if (it != _index.end()) {
+            ++_counters[it->second]._count;
+            return;
+        }
+        if (_counters.size() < CAPACITY) {
+            _index.emplace(key, _counters.size());
+            _counters.push_back(counter { key, shard, 1, 0 });
+            return;
+        }
+        auto min = std::min_element(_counters.begin(), _counters.end(), [] (const counter& l, const counter& r) {
+            return l._count < r._count;
+        });
+        _index.erase(min->_key);
+        _index.emplace(key, min - _counters.begin());
+        min->_error = min->_count;
+        min->_count += 1;
+        min->_key = key;
+        min->_shard = shard;
+    }
+
+    void decay() {
+        for (size_t i = 0; i < _sampled_by_shard.size(); ++i) {
+            _ops_by_shard[i] = static_cast<double>(_sampled_by_shard[i]) * SAMPLE_RATE / PERIOD_SECONDS;
+            _sampled_by_shard[i] = 0;
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < _counters.size(); ++i) {
+            auto& c = _counters[i];
+            c._count /= 2;
+            c._error /= 2;
+            if (c._count > 0) {
+                if (kept != i) {
+                    _counters[kept] = std::move(c);
+                }
+                ++kept;
+            }
+        }
+        _counters.resize(kept);
+        _index.clear();
+        for (size_t i = 0; i < _counters.size(); ++i) {
+            _index.emplace(_counters[i]._key, i);
+        }
+    }
+public:
+    hot_keys()
+        : _sampled_by_shard(smp::count)
+        , _ops_by_shard(smp::count)
+        , _random(engine().cpu_id() + 1)
+    {
+        _counters.reserve(CAPACITY);
+        _timer.set_callback([this] { decay(); });
+        _timer.arm_periodic(std::chrono::duration_cast<lowres_clock::duration>(std::chrono::seconds(unsigned(PERIOD_SECONDS))));
+    }
+
+    // Picks the requests whose keys are counted.
+    inline bool sampled() {
+        return _random() % SAMPLE_RATE == 0;
+    }
+
+    // Counts an access of @key, owned by @shard, of a sampled request.
+    inline void record(const sstring& key, unsigned shard) {
+        ++_sampled;
+        ++_sampled_by_shard[shard];
+        add(key, shard);
+    }
+
+    inline uint64_t samples() const {
+        return _sampled;
+    }
+
+    inline const std::vector<counter>& counters() const {
+        return _counters;
+    }
+
+    // The estimated accesses per second of the keys owned by every shard.
+    inline const std::vector<double>& ops_by_shard() const {
+        return _ops_by_shard;
+    }
+
+    // The largest accesses per second of a key, 0 if none was sampled.
+    double hottest() const {
+        double ops = 0;
+        for (auto& c : _counters) {
+            ops = std::max(ops, c.ops());
+        }
+        return ops;
+    }
+};
+}
@@ -0,0 +1,333 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "intset.hh"
+#include <algorithm>
+#include <cstring>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+namespace redis {
+
+int64_t intset::load(const char* p, uint8_t width)
+{
+    switch (width) {
+        case sizeof(int16_t): {
+            int16_t v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+        case sizeof(int32_t): {
+            int32_t v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+        default: {
+            int64_t v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+    }
+}
+
+void intset::store(char* p, uint8_t width, int64_t v)
+{
+    switch (width) {
+        case sizeof(int16_t): {
+            auto n = static_cast<int16_t>(v);
+            memcpy(p, &n, sizeof(n));
+            break;
+        }
+        case sizeof(int32_t): {
+            auto n = static_cast<int32_t>(v);
+            memcpy(p, &n, sizeof(n));
+            break;
+        }
+        default:
+            memcpy(p, &v, sizeof(v));
+            break;
+    }
+}
+
+size_t intset::lower_bound(int64_t v) const
+{
+    size_t first = 0;
+    size_t count = size();
+    auto p = begin();
+    while (count > 0) {
+        auto half = count / 2;
+        if (load(p + (first + half) * _width, _width) < v) {
+            first += half + 1;
+            count -= half + 1;
+        }
+        else {
+            count = half;
+        }
+    }
+    return first;
+}
+
+bool intset::contains(int64_t v) const
+{
+    if (width_of(v) > _width) {
+        return false;
+    }
+    auto pos = lower_bound(v);
+    return pos < size() && at(pos) == v;
+}
+
+bool intset::insert(int64_t v)
+{
+    auto n = size();
+    auto width = width_of(v);
+    if (width > _width) {
+        // the value is out of the range of all the others: it goes at one
+        // end of the array, which is re-encoded on the new width.
+        managed_bytes blob(managed_bytes::initialized_later(), (n + 1) * width);
+        auto out = reinterpret_cast<char*>(blob.data());
+        if (v < 0) {
+            store(out, width, v);
+            out += width;
+        }
+        for_each([&out, width] (int64_t o) {
+            store(out, width, o);
+            out += width;
+        });
+        if (v >= 0) {
+            store(out, width, v);
+        }
+        _data = std::move(blob);
+        _width = width;
+        return true;
+    }
+    auto pos = lower_bound(v);
+    if (pos < n && at(pos) == v) {
+        return false;
+    }
+    managed_bytes blob(managed_bytes::initialized_later(), (n + 1) * _width);
+    auto out = reinterpret_cast<char*>(blob.data());
+    memcpy(out, begin(), pos * _width);
+    store(out + pos * _width, _width, v);
+    memcpy(out + (pos + 1) * _width, begin() + pos * _width, (n - pos) * _width);
+    _data = std::move(blob);
+    return true;
+}
+
+bool intset::erase(int64_t v)
+{
+    if (!contains(v)) {
+        return false;
+    }
+    auto n = size();
+    auto pos = lower_bound(v);
+    managed_bytes blob(managed_bytes::initialized_later(), (n - 1) * _width);
+    auto out = reinterpret_cast<char*>(blob.data());
+    memcpy(out, begin(), pos * _width);
+    memcpy(out + pos * _width, begin() + (pos + 1) * _width, (n - pos - 1) * _width);
+    _data = std::move(blob);
+    return true;
+}
+
+bool intset::parse(const char* data, size_t size, int64_t& v)
+{
+    if (size == 0 || size > max_digits) {
+        return false;
+    }
+    const char* p = data;
+    const char* end = data + size;
+    bool negative = false;
+    if (*p == '-') {
+        negative = true;
+        if (++p == end) {
+            return false;
+        }
+    }
+    if (*p == '0') {
+        // "0" is the only form of zero, and no other number starts with it.
+        if (size == 1) {
+            v = 0;
+            return true;
+        }
+        return false;
+    }
+    uint64_t n = 0;
+    for (; p != end; ++p) {
+        if (*p < '0' || *p > '9') {
+            return false;
+        }
+        auto digit = static_cast<uint64_t>(*p - '0');
+        if (n > (UINT64_MAX - digit) / 10) {
+            return false;
+        }
+        n = n * 10 + digit;
+    }
+    if (negative) {
+        if (n > static_cast<uint64_t>(INT64_MAX) + 1) {
+            return false;
+        }
+        v = static_cast<int64_t>(0 - n);
+    }
+    else {
+        if (n > static_cast<uint64_t>(INT64_MAX)) {
+            return false;
+        }
+        v = static_cast<int64_t>(n);
+    }
+    return true;
+}
+
+size_t intset::format(int64_t v, char* out)
+{
+    char digits[max_digits];
+    size_t count = 0;
+    uint64_t n = v < 0 ? 0 - static_cast<uint64_t>(v) : static_cast<uint64_t>(v);
+    do {
+        digits[count++] = static_cast<char>('0' + n % 10);
+        n /= 10;
+    } while (n > 0);
+    size_t size = 0;
+    if (v < 0) {
+        out[size++] = '-';
+    }
+    while (count > 0) {
+        out[size++] = digits[--count];
+    }
+    return size;
+}
+
+namespace {
+
+// The ratio of the sizes above which the smaller array is looked up in the
+// larger one, rather than merged with it.
+constexpr size_t galloping_ratio = 32;
+
+// Returns the first position from @first in @a whose value is not less than @v,
+// probing at exponentially growing distances before the binary search.
+size_t gallop(const std::vector<int64_t>& a, size_t first, int64_t v)
+{
+    size_t step = 1;
+    size_t hi = first;
+    while (hi < a.size() && a[hi] < v) {
+        first = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    hi = std::min(hi, a.size());
+    return std::lower_bound(a.begin() + first, a.begin() + hi, v) - a.begin();
+}
+
+void intersect_galloping(const std::vector<int64_t>& small, const std::vector<int64_t>& large, std::vector<int64_t>& out)
+{
+    size_t pos = 0;
+    for (auto v : small) {
+        pos = gallop(large, pos, v);
+        if (pos == large.size()) {
+            return;
+        }
+        if (large[pos] == v) {
+            out.push_back(v);
+        }
+    }
+}
+
+void intersect_merge(const std::vector<int64_t>& a, const std::vector<int64_t>& b, std::vector<int64_t>& out)
+{
+    size_t i = 0, j = 0;
+#ifdef __AVX2__
+    // compares blocks of 4 values with each other: the block of @b is rotated
+    // 4 times, and the block whose last value is the lower is consumed.
+    while (i + 4 <= a.size() && j + 4 <= b.size()) {
+        auto va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a.data() + i));
+        auto vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b.data() + j));
+        auto m = _mm256_cmpeq_epi64(va, vb);
+        vb = _mm256_permute4x64_epi64(vb, 0x39);
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi64(va, vb));
+        vb = _mm256_permute4x64_epi64(vb, 0x39);
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi64(va, vb));
+        vb = _mm256_permute4x64_epi64(vb, 0x39);
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi64(va, vb));
+        auto mask = _mm256_movemask_pd(_mm256_castsi256_pd(m));
+        for (size_t k = 0; k < 4; ++k) {
+            if (mask & (1 << k)) {
+                out.push_back(a[i + k]);
+            }
+        }
+        auto last_a = a[i + 3];
+        auto last_b = b[j + 3];
+        if (last_a <= last_b) {
+            i += 4;
+        }
+        if (last_b <= last_a) {
+            j += 4;
+        }
+    }
+#endif
+    while (i < a.size() && j < b.size()) {
+        if (a[i] < b[j]) {
+            ++i;
+        }
+        else if (b[j] < a[i]) {
+            ++j;
+        }
+        else {
+            out.push_back(a[i]);
+            ++i;
+            ++j;
+        }
+    }
+}
+}
+
+void intset_intersect(const std::vector<int64_t>& a, const std::vector<int64_t>& b, std::vector<int64_t>& out)
+{
+    if (a.empty() || b.empty()) {
+        return;
+    }
+    auto& small = a.size() <= b.size() ? a : b;
+    auto& large = a.size() <= b.size() ? b : a;
+    if (large.size() / small.size() >= galloping_ratio) {
+        intersect_galloping(small, large, out);
+    }
+    else {
+        intersect_merge(small, large, out);
+    }
+}
+
+void intset_union(const std::vector<int64_t>& a, const std::vector<int64_t>& b, std::vector<int64_t>& out)
+{
+    out.reserve(out.size() + a.size() + b.size());
+    std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(out));
+}
+
+void intset_difference(const std::vector<int64_t>& a, const std::vector<int64_t>& b, std::vector<int64_t>& out)
+{
+    if (b.size() / std::max<size_t>(a.size(), 1) >= galloping_ratio) {
+        size_t pos = 0;
+        for (auto v : a) {
+            pos = gallop(b, pos, v);
+            if (pos == b.size() || b[pos] != v) {
+                out.push_back(v);
+            }
+        }
+        return;
+    }
+    std::set_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(out));
+}
+}
@@ -0,0 +1,121 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "utils/managed_bytes.hh"
+#include "core/sstring.hh"
+#include <vector>
+namespace redis {
+// A set of integers: the sorted array of their values, all encoded on the
+// width of the widest one, 2, 4 or 8 bytes. The array is upgraded to a wider
+// encoding as soon as a value needs it, and never downgraded. A membership
+// test is a binary search over contiguous memory.
+class intset final {
+    managed_bytes _data;
+    uint8_t _width = sizeof(int16_t);
+
+    static inline uint8_t width_of(int64_t v)
+    {
+        if (v >= INT16_MIN && v <= INT16_MAX) {
+            return sizeof(int16_t);
+        }
+        if (v >= INT32_MIN && v <= INT32_MAX) {
+            return sizeof(int32_t);
+        }
+        return sizeof(int64_t);
+    }
+    static int64_t load(const char* p, uint8_t width);
+    static void store(char* p, uint8_t width, int64_t v);
+    inline const char* begin() const
+    {
+        return reinterpret_cast<const char*>(_data.data());
+    }
+    // Returns the position of the first value not less than @v.
+    size_t lower_bound(int64_t v) const;
+public:
+    // The longest decimal form of an int64_t.
+    static constexpr size_t max_digits = 20;
+
+    intset() noexcept {}
+    intset(intset&& o) noexcept : _data(std::move(o._data)), _width(o._width) {}
+
+    inline size_t size() const
+    {
+        return _data.size() / _width;
+    }
+
+    inline bool empty() const
+    {
+        return _data.size() == 0;
+    }
+
+    inline int64_t at(size_t index) const
+    {
+        return load(begin() + index * _width, _width);
+    }
+
+    bool contains(int64_t v) const;
+    // Returns true if @v was not there.
+    bool insert(int64_t v);
+    // Returns true if @v was there.
+    bool erase(int64_t v);
+
+    inline void clear()
+    {
+        _data = managed_bytes();
+        _width = sizeof(int16_t);
+    }
+
+    // Bytes allocated out of the intset object for the values.
+    inline size_t memory_usage() const
+    {
+        return _data.external_memory_usage();
+    }
+
+    // Calls @func on the values, in ascending order.
+    template <typename Func>
+    void for_each(Func&& func) const
+    {
+        auto p = begin();
+        for (size_t i = 0, n = size(); i < n; ++i, p += _width) {
+            func(load(p, _width));
+        }
+    }
+
+    void fetch(std::vector<int64_t>& values) const
+    {
+        values.reserve(values.size() + size());
+        for_each([&values] (int64_t v) { values.push_back(v); });
+    }
+
+    // Returns true if @data is the canonical decimal form of an int64_t:
+    // no sign but for negative numbers, and no leading zero. Only those members
+    // of a set are stored in an intset, as their value gives back the member.
+    static bool parse(const char* data, size_t size, int64_t& v);
+    // Writes the decimal form of @v at @out, which holds max_digits bytes.
+    static size_t format(int64_t v, char* out);
+};
+
+// The kernels of the set algebra on sorted arrays of distinct integers, as
+// fetched from intsets. The results are sorted and appended to @out.
+void intset_intersect(const std::vector<int64_t>& a, const std::vector<int64_t>& b, std::vector<int64_t>& out);
+void intset_union(const std::vector<int64_t>& a, const std::vector<int64_t>& b, std::vector<int64_t>& out);
+void intset_difference(const std::vector<int64_t>& a, const std::vector<int64_t>& b, std::vector<int64_t>& out);
+}
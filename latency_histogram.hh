@@ -0,0 +1,115 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include <array>
+#include <cstdint>
+#include <limits>
+#include "core/bitops.hh"
+
+namespace redis {
+
+// HDR style logarithmic histogram of latencies in microseconds.
+// Values below 2^SUB_BUCKET_BITS are counted exactly; above that every power
+// of two is split into 2^SUB_BUCKET_BITS linear sub buckets, so the relative
+// error of a reported percentile is below 1 / 2^SUB_BUCKET_BITS (12.5%).
+// Recording a value is a few instructions and never allocates.
+class latency_histogram {
+public:
+    static constexpr const size_t SUB_BUCKET_BITS = 3;
+    static constexpr const size_t SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    // Values above 2^MAX_EXPONENT us (~71 minutes) are counted in the last bucket.
+    static constexpr const size_t MAX_EXPONENT = 32;
+    static constexpr const size_t BUCKET_COUNT = (MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKET_COUNT;
+private:
+    std::array<uint64_t, BUCKET_COUNT> _buckets {};
+    uint64_t _count = 0;
+    uint64_t _sum = 0;
+
+    static inline size_t bucket_of(uint64_t v) {
+        if (v < SUB_BUCKET_COUNT) {
+            return v;
+        }
+        size_t e = std::numeric_limits<uint64_t>::digits - 1 - count_leading_zeros(v);
+        if (e > MAX_EXPONENT) {
+            return BUCKET_COUNT - 1;
+        }
+        auto sub = (v >> (e - SUB_BUCKET_BITS)) & (SUB_BUCKET_COUNT - 1);
+        return ((e - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) + sub;
+    }
+
+    // The highest value which is counted in the bucket.
+    static inline uint64_t highest_of(size_t bucket) {
+        if (bucket < SUB_BUCKET_COUNT) {
+            return bucket;
+        }
+        auto e = (bucket >> SUB_BUCKET_BITS) + SUB_BUCKET_BITS - 1;
+        auto sub = bucket & (SUB_BUCKET_COUNT - 1);
+        auto shift = e - SUB_BUCKET_BITS;
+        return ((uint64_t(SUB_BUCKET_COUNT | sub) << shift) + (uint64_t(1) << shift)) - 1;
+    }
+public:
+    inline void record(uint64_t us) {
+        ++_buckets[bucket_of(us)];
+        ++_count;
+        _sum += us;
+    }
+
+    inline uint64_t count() const {
+        return _count;
+    }
+
+    inline uint64_t sum() const {
+        return _sum;
+    }
+
+    inline double mean() const {
+        return _count ? static_cast<double>(_sum) / _count : 0;
+    }
+
+    // Returns the value below which @p (0 < p <= 1) of the recorded values fall.
+    uint64_t percentile(double p) const {
+        if (_count == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(p * _count);
+        if (rank == 0) {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+            seen += _buckets[i];
+            if (seen >= rank) {
+                return highest_of(i);
+            }
+        }
+        return highest_of(BUCKET_COUNT - 1);
+    }
+
+    latency_histogram& operator += (const latency_histogram& o) {
+        for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+            _buckets[i] += o._buckets[i];
+        }
+        _count += o._count;
+        _sum += o._sum;
+        return *this;
+    }
+};
+}
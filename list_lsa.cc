@@ -1,2 +1,310 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
 #include "list_lsa.hh"
-namespace redis {}
+namespace redis {
+
+std::pair<list_lsa::chunk*, size_t> list_lsa::locate(size_t index) const
+{
+    assert(index < _size);
+    if (index < _size / 2) {
+        for (auto& c : _chunks) {
+            if (index < c._count) {
+                return { const_cast<chunk*>(&c), index };
+            }
+            index -= c._count;
+        }
+    }
+    else {
+        auto rindex = _size - 1 - index;
+        for (auto it = _chunks.rbegin(); it != _chunks.rend(); ++it) {
+            if (rindex < it->_count) {
+                return { const_cast<chunk*>(&*it), it->_count - 1 - rindex };
+            }
+            rindex -= it->_count;
+        }
+    }
+    assert(false);
+    return { nullptr, 0 };
+}
+
+size_t list_lsa::offset_of(const chunk& c, size_t index)
+{
+    auto p = c.begin();
+    for (size_t i = 0; i < index; ++i) {
+        decode(p);
+    }
+    return p - c.begin();
+}
+
+list_lsa::chunk& list_lsa::new_chunk(chunk_list_type::const_iterator pos)
+{
+    auto c = current_allocator().construct<chunk>();
+    _chunks.insert(pos, *c);
+    return *c;
+}
+
+void list_lsa::dispose(chunk& c)
+{
+    _chunks.erase_and_dispose(_chunks.iterator_to(c), current_deleter<chunk>());
+}
+
+void list_lsa::splice(chunk& c, size_t offset, size_t erased, const sstring* data)
+{
+    const size_t inserted = data ? varint_size(data->size()) + data->size() : 0;
+    managed_bytes blob(managed_bytes::initialized_later(), c.bytes() - erased + inserted);
+    auto out = reinterpret_cast<char*>(blob.data());
+    out = std::copy_n(c.begin(), offset, out);
+    if (data) {
+        out = write_varint(out, data->size());
+        out = std::copy_n(data->data(), data->size(), out);
+    }
+    std::copy_n(c.begin() + offset + erased, c.bytes() - offset - erased, out);
+    c._data = std::move(blob);
+}
+
+void list_lsa::keep(chunk& c, size_t first, size_t last)
+{
+    auto from = offset_of(c, first);
+    auto p = c.begin() + from;
+    for (size_t i = first; i < last; ++i) {
+        decode(p);
+    }
+    auto to = static_cast<size_t>(p - c.begin());
+    managed_bytes blob(reinterpret_cast<const signed char*>(c.begin()) + from, to - from);
+    c._data = std::move(blob);
+    _size -= c._count - (last - first);
+    c._count = last - first;
+}
+
+void list_lsa::insert_head(const sstring& data)
+{
+    if (_chunks.empty() || !fits(_chunks.front(), data.size())) {
+        new_chunk(_chunks.begin());
+    }
+    auto& c = _chunks.front();
+    splice(c, 0, 0, &data);
+    ++c._count;
+    ++_size;
+}
+
+void list_lsa::insert_tail(const sstring& data)
+{
+    if (_chunks.empty() || !fits(_chunks.back(), data.size())) {
+        new_chunk(_chunks.end());
+    }
+    auto& c = _chunks.back();
+    splice(c, c.bytes(), 0, &data);
+    ++c._count;
+    ++_size;
+}
+
+void list_lsa::insert_at(size_t index, const sstring& data)
+{
+    auto l = locate(index);
+    auto& c = *l.first;
+    auto offset = offset_of(c, l.second);
+    if (!fits(c, data.size())) {
+        // splits the chunk before the element, the value goes at the end of
+        // the first half, or at the head of the second one.
+        auto& tail = new_chunk(std::next(_chunks.iterator_to(c)));
+        tail._data = managed_bytes(reinterpret_cast<const signed char*>(c.begin()) + offset, c.bytes() - offset);
+        tail._count = c._count - l.second;
+        c._data = managed_bytes(reinterpret_cast<const signed char*>(c.begin()), offset);
+        c._count = l.second;
+        if (fits(c, data.size())) {
+            splice(c, c.bytes(), 0, &data);
+            ++c._count;
+        }
+        else if (fits(tail, data.size())) {
+            splice(tail, 0, 0, &data);
+            ++tail._count;
+        }
+        else {
+            auto& n = new_chunk(_chunks.iterator_to(tail));
+            splice(n, 0, 0, &data);
+            ++n._count;
+        }
+        ++_size;
+        return;
+    }
+    splice(c, offset, 0, &data);
+    ++c._count;
+    ++_size;
+}
+
+size_t list_lsa::index_of(const sstring& pivot) const
+{
+    size_t index = 0;
+    for (auto& c : _chunks) {
+        auto p = c.begin();
+        for (size_t i = 0; i < c._count; ++i, ++index) {
+            if (equal(decode(p), pivot)) {
+                return index;
+            }
+        }
+    }
+    return _size;
+}
+
+bytes_view list_lsa::at(size_t index) const
+{
+    auto l = locate(index);
+    auto p = l.first->begin() + offset_of(*l.first, l.second);
+    return decode(p);
+}
+
+void list_lsa::set(size_t index, const sstring& data)
+{
+    auto l = locate(index);
+    auto& c = *l.first;
+    auto offset = offset_of(c, l.second);
+    auto p = c.begin() + offset;
+    decode(p);
+    splice(c, offset, (p - c.begin()) - offset, &data);
+}
+
+void list_lsa::pop_front()
+{
+    assert(!empty());
+    auto& c = _chunks.front();
+    --_size;
+    if (--c._count == 0) {
+        dispose(c);
+        return;
+    }
+    auto p = c.begin();
+    decode(p);
+    splice(c, 0, p - c.begin(), nullptr);
+}
+
+void list_lsa::pop_back()
+{
+    assert(!empty());
+    auto& c = _chunks.back();
+    --_size;
+    if (--c._count == 0) {
+        dispose(c);
+        return;
+    }
+    auto offset = offset_of(c, c._count);
+    splice(c, offset, c.bytes() - offset, nullptr);
+}
+
+void list_lsa::trim(size_t start, size_t end)
+{
+    assert(start <= end && end < _size);
+    size_t index = 0;
+    for (auto it = _chunks.begin(); it != _chunks.end();) {
+        auto& c = *it++;
+        auto first = index;
+        auto last = index + c._count;
+        index = last;
+        if (last <= start || first > end) {
+            _size -= c._count;
+            dispose(c);
+            continue;
+        }
+        auto from = start > first ? start - first : 0;
+        auto to = std::min(end + 1, last) - first;
+        if (from > 0 || to < c._count) {
+            keep(c, from, to);
+        }
+    }
+}
+
+void list_lsa::fetch(size_t start, size_t end, std::vector<bytes_view>& values) const
+{
+    assert(start <= end && end < _size);
+    auto l = locate(start);
+    auto count = end - start + 1;
+    auto local = l.second;
+    for (auto it = _chunks.iterator_to(*l.first); count > 0 && it != _chunks.end(); ++it, local = 0) {
+        auto p = it->begin() + offset_of(*it, local);
+        for (auto i = local; i < it->_count && count > 0; ++i, --count) {
+            values.push_back(decode(p));
+        }
+    }
+}
+
+size_t list_lsa::remove(const sstring& data, size_t count, bool from_head)
+{
+    size_t removed = 0;
+    std::vector<bytes_view> elements;
+    std::vector<bytes_view> kept;
+    auto process = [&] (chunk& c) {
+        elements.clear();
+        kept.clear();
+        auto p = c.begin();
+        for (size_t i = 0; i < c._count; ++i) {
+            elements.push_back(decode(p));
+        }
+        if (!from_head) {
+            std::reverse(elements.begin(), elements.end());
+        }
+        for (auto& v : elements) {
+            if ((count == 0 || removed < count) && equal(v, data)) {
+                ++removed;
+            }
+            else {
+                kept.push_back(v);
+            }
+        }
+        if (kept.size() == elements.size()) {
+            return;
+        }
+        if (!from_head) {
+            std::reverse(kept.begin(), kept.end());
+        }
+        size_t bytes = 0;
+        for (auto& v : kept) {
+            bytes += varint_size(v.size()) + v.size();
+        }
+        managed_bytes blob(managed_bytes::initialized_later(), bytes);
+        auto out = reinterpret_cast<char*>(blob.data());
+        for (auto& v : kept) {
+            out = write_varint(out, v.size());
+            out = std::copy_n(reinterpret_cast<const char*>(v.data()), v.size(), out);
+        }
+        c._data = std::move(blob);
+        _size -= c._count - kept.size();
+        c._count = kept.size();
+    };
+    if (from_head) {
+        for (auto it = _chunks.begin(); it != _chunks.end() && (count == 0 || removed < count);) {
+            auto& c = *it++;
+            process(c);
+            if (c._count == 0) {
+                dispose(c);
+            }
+        }
+    }
+    else {
+        for (auto it = _chunks.end(); it != _chunks.begin() && (count == 0 || removed < count);) {
+            auto& c = *--it;
+            process(c);
+            if (c._count == 0) {
+                it = _chunks.erase_and_dispose(it, current_deleter<chunk>());
+            }
+        }
+    }
+    return removed;
+}
+}
@@ -20,37 +20,55 @@
 */
 #pragma once
 #include <boost/intrusive/list.hpp>
+#include <algorithm>
 #include "utils/allocation_strategy.hh"
 #include "utils/managed_ref.hh"
 #include "utils/managed_bytes.hh"
+#include "common.hh"
 namespace redis {
+// A quicklist: the elements are packed in chunks of at most max_chunk_bytes
+// bytes (or max_chunk_entries elements), and the chunks are linked.
+// Every chunk knows its number of elements, so that a lookup by index skips
+// whole chunks, from the head or from the tail. Pushes and pops touch only the
+// chunk at the end.
 class list_lsa {
-    struct internal_node {
+    // A run of consecutive elements in one blob, every element encoded as its
+    // length (varint) and its bytes.
+    struct chunk {
         boost::intrusive::list_member_hook<> _link;
         managed_bytes _data;
-        internal_node(bytes_view data) noexcept : _link(), _data(data) {}
-        internal_node(internal_node&& o) noexcept
-            : _link(std::move(o._link)), _data(std::move(o._data))
+        size_t _count = 0;
+        chunk() noexcept {}
+        // The compaction moves a chunk, the new one takes its place in the list.
+        chunk(chunk&& o) noexcept
+            : _data(std::move(o._data)), _count(o._count)
         {
+            _link.swap_nodes(o._link);
         }
-        inline bool operator==(const internal_node& o) const
+        inline const char* begin() const
         {
-            return _data == o._data;
+            return reinterpret_cast<const char*>(_data.data());
+        }
+        inline size_t bytes() const
+        {
+            return _data.size();
         }
     };
-    using internal_list_type = boost::intrusive::list<internal_node,
-                                                      boost::intrusive::member_hook<internal_node, boost::intrusive::list_member_hook<>,
-                                                      &internal_node::_link>>;
-    using const_iterator = internal_list_type::const_iterator;
-    using iterator = internal_list_type::iterator;
-    internal_list_type  _list;
+    using chunk_list_type = boost::intrusive::list<chunk,
+                                                   boost::intrusive::member_hook<chunk, boost::intrusive::list_member_hook<>,
+                                                   &chunk::_link>>;
+    static constexpr size_t max_chunk_bytes = 8192;
+    static constexpr size_t max_chunk_entries = 512;
+    chunk_list_type _chunks;
+    size_t _size = 0;
 public:
     list_lsa() noexcept
     {
     }
 
-    list_lsa(list_lsa&& o) noexcept : _list(std::move(o._list))
+    list_lsa(list_lsa&& o) noexcept : _chunks(std::move(o._chunks)), _size(o._size)
     {
+        o._size = 0;
     }
 
     ~list_lsa()
@@ -58,90 +76,48 @@ public:
         clear();
     }
     // Inserts the value in the front of the list.
-    inline void insert_head(const sstring& data)
-    {
-        bytes_view v {reinterpret_cast<const signed char*>(data.data()), data.size()};
-        auto entry = current_allocator().construct<internal_node>(v);
-        _list.push_front(*entry);
-    }
+    void insert_head(const sstring& data);
 
     // Inserts the value in the back of the list.
-    inline void insert_tail(const sstring& data)
-    {
-        bytes_view v {reinterpret_cast<const signed char*>(data.data()), data.size()};
-        auto entry = current_allocator().construct<internal_node>(v);
-        _list.push_back(*entry);
-    }
+    void insert_tail(const sstring& data);
 
-    inline void insert_at(size_t index, const sstring& data)
-    {
-        assert(index < _list.size());
-        bytes_view v {reinterpret_cast<const signed char*>(data.data()), data.size()};
-        auto entry = current_allocator().construct<internal_node>(v);
-        const_iterator p = iterator_to(index);
-        _list.insert(p, *entry);
-    }
+    // Inserts the value before the element at @index.
+    void insert_at(size_t index, const sstring& data);
 
-    inline size_t index_of(const std::string& pivot)
-    {
-        size_t result = _list.size();
-        for (auto i = _list.begin(); i != _list.end(); ++i, --result) {
-            if (equal(pivot, *i)) {
-                return _list.size() - result;
-            }
-        }
-        return result;
-    }
+    // Returns the index of the first element equal to @pivot, or size().
+    size_t index_of(const sstring& pivot) const;
 
-    inline const managed_bytes& at(size_t index) const
-    {
-        assert(index < _list.size());
-        auto i = iterator_to(index);
-        return i->_data;
-    }
+    // The views returned are valid until the list is modified.
+    bytes_view at(size_t index) const;
 
-    inline managed_bytes& at(size_t index)
-    {
-        assert(index < _list.size());
-        iterator i = iterator_to(index);
-        return i->_data;
-    }
+    // Replaces the value of the element at @index.
+    void set(size_t index, const sstring& data);
 
-    // Returns a reference to the data of first element of the list.
-    inline const managed_bytes& front() const
+    inline bytes_view front() const
     {
-        auto& front_ref = _list.front();
-        return front_ref._data;
+        return at(0);
     }
 
-    // Erases the first element of the list. Destructors are called.
-    inline void pop_front()
-    {
-        _list.pop_front_and_dispose(current_deleter<internal_node>());
-    }
+    // Erases the first element of the list.
+    void pop_front();
 
-    // Returns a reference to the data of last element of the list.
-    inline const managed_bytes& back() const
+    inline bytes_view back() const
     {
-        auto& back_ref = _list.back();
-        return back_ref._data;
+        return at(_size - 1);
     }
 
-    // Erases the last element of the list. Destructors are called.
-    inline void pop_back()
-    {
-        _list.pop_back_and_dispose(current_deleter<internal_node>());
-    }
+    // Erases the last element of the list.
+    void pop_back();
 
     inline bool empty() const
     {
-        return _list.empty();
+        return _size == 0;
     }
 
     // Returns the number of the elements contained in the list.
     inline size_t size() const
     {
-        return static_cast<size_t>(_list.size());
+        return _size;
     }
 
     // Erase the elements from the list.
@@ -153,94 +129,135 @@ public:
     template<bool RemoveAllEqual, bool FromHeadToTail>
     inline size_t trem(const std::string& data, size_t count)
     {
-        size_t erased = 0;
-        if (FromHeadToTail) {
-            for (auto it = _list.begin(); it != _list.end(); ++it) {
-                if (equal(*it, data)) {
-                    ++erased;
-                    const_iterator eit = it;
-                    ++it;
-                    _list.erase_and_dispose(eit, current_deleter<internal_node>());
-                    if (!RemoveAllEqual && erased == count) {
-                        break;
-                    }
-                }
-            }
-        }
-        else {
-            for (auto it = _list.rbegin(); it != _list.rend(); ++it) {
-                if (equal(*it, data)) {
-                    ++erased;
-                    auto& entry = *it;
-                    ++it;
-                    _list.remove_and_dispose(entry, current_deleter<internal_node>());
-                    if (!RemoveAllEqual && erased == count) {
-                        break;
-                    }
-                }
-            }
-        }
-        return erased;
+        return remove(data, RemoveAllEqual ? 0 : count, FromHeadToTail);
+    }
+
+    // Keeps the elements from @start to @end, both included.
+    void trim(size_t start, size_t end);
+
+    // Erases all the elements of the list. Destructors are called.
+    inline void clear()
+    {
+        _chunks.clear_and_dispose(current_deleter<chunk>());
+        _size = 0;
     }
 
-    inline bool trim(size_t start, size_t end)
+    // Erases up to @budget elements, whole chunks from the head, and takes
+    // them off @budget. Returns true once the list is empty.
+    bool release(size_t& budget)
     {
-        auto i = iterator_to(start);
-        for (auto it = _list.begin(); it != i; ++it) {
-            _list.erase_and_dispose(it, current_deleter<internal_node>());
+        while (budget > 0 && !_chunks.empty()) {
+            auto count = std::max<size_t>(_chunks.front()._count, 1);
+            _size -= _chunks.front()._count;
+            _chunks.pop_front_and_dispose(current_deleter<chunk>());
+            budget -= std::min(budget, count);
         }
-        for (auto it = iterator_to(end); it != _list.end(); ++it) {
-            _list.erase_and_dispose(it, current_deleter<internal_node>());
+        return _chunks.empty();
+    }
+
+    // Appends the elements from @start to @end, both included, to @values.
+    void fetch(size_t start, size_t end, std::vector<bytes_view>& values) const;
+
+    // Calls @func on the data of every element, from the head to the tail.
+    template <typename Func>
+    void for_each(Func&& func) const
+    {
+        for (auto& c : _chunks) {
+            auto p = c.begin();
+            for (size_t i = 0; i < c._count; ++i) {
+                func(decode(p));
+            }
         }
-        return true;
     }
 
-    // Erases all the elements of the list. Destructors are called.
-    inline void clear()
+    // A position in the list, left by walk() for the next walk. It's valid as
+    // long as the list is neither changed nor moved by the compaction.
+    struct cursor {
+        const void* _chunk = nullptr;
+        size_t _local = 0;
+        size_t _offset = 0;
+    };
+
+    // Calls @func on the data of the elements from @index on, until it returns
+    // false or the list ends, and leaves @c past the last element visited. The
+    // walk resumes from @c if it's set, @index is then the index it left.
+    template <typename Func>
+    void walk(size_t index, cursor& c, Func&& func) const
     {
-        _list.clear_and_dispose(current_deleter<internal_node>());
+        if (index >= _size) {
+            c = cursor();
+            return;
+        }
+        if (c._chunk == nullptr) {
+            auto l = locate(index);
+            c = cursor { l.first, l.second, offset_of(*l.first, l.second) };
+        }
+        auto it = _chunks.iterator_to(*static_cast<const chunk*>(c._chunk));
+        auto local = c._local;
+        auto p = it->begin() + c._offset;
+        bool more = true;
+        while (more) {
+            if (local == it->_count) {
+                if (++it == _chunks.end()) {
+                    break;
+                }
+                local = 0;
+                p = it->begin();
+                continue;
+            }
+            more = func(decode(p));
+            ++local;
+        }
+        c = it != _chunks.end() ? cursor { &*it, local, static_cast<size_t>(p - it->begin()) } : cursor();
     }
 
-    // reduce
-    void reduce(size_t start, size_t end, std::function<void(const_iterator it)>&& reduce_fn)
+    // Bytes allocated for the list, its chunks and their data.
+    size_t memory_usage() const
     {
-        auto start_it = iterator_to(start);
-        auto end_it = iterator_to(end);
-        for (; start_it != end_it; ++start_it) {
-            reduce_fn(start_it);
+        size_t usage = sizeof(list_lsa);
+        for (auto& c : _chunks) {
+            usage += sizeof(chunk) + c._data.external_memory_usage();
         }
+        return usage;
     }
 
     bool index_out_of_range(long index) const
     {
-        return index < 0 || static_cast<size_t>(index) > _list.size();
+        return index < 0 || static_cast<size_t>(index) >= _size;
     }
 private:
-    const_iterator iterator_to(size_t index) const
-    {
-        auto i = _list.begin();
-        for (size_t idx = 0; idx < index && i != _list.end(); ++idx, ++i) {};
-        return i;
-    }
-    iterator iterator_to(size_t index)
+    // Decodes the element at @p and moves @p past it.
+    static inline bytes_view decode(const char*& p)
     {
-        auto i = _list.begin();
-        for (size_t idx = 0; idx < index && i != _list.end(); ++idx, ++i) {};
-        return i;
+        auto size = read_varint(p);
+        bytes_view v {reinterpret_cast<const signed char*>(p), size};
+        p += size;
+        return v;
     }
 
-    inline bool equal(const internal_node& n, const sstring& data) const
+    static inline bool equal(bytes_view v, const sstring& data)
     {
-        auto mb = n._data;
-        bytes_view b {mb.data(), mb.size()} ;
-        bytes_view a {reinterpret_cast<const signed char*>(data.data()), data.size()};
-        return b == a;
+        return v == bytes_view {reinterpret_cast<const signed char*>(data.data()), data.size()};
     }
 
-    inline bool equal(const sstring& data, const internal_node& n) const
+    static inline bool fits(const chunk& c, size_t size)
     {
-        return equal(data, n);
+        return c._count == 0 || (c._count < max_chunk_entries && c.bytes() + varint_size(size) + size <= max_chunk_bytes);
     }
 
+    // Returns the chunk holding the element at @index, and the index of the
+    // element in the chunk.
+    std::pair<chunk*, size_t> locate(size_t index) const;
+    // Returns the offset in the blob of the element at @index of the chunk.
+    static size_t offset_of(const chunk& c, size_t index);
+    chunk& new_chunk(chunk_list_type::const_iterator pos);
+    void dispose(chunk& c);
+    // Replaces the @erased bytes at @offset of the chunk with the element @data,
+    // if not nullptr.
+    static void splice(chunk& c, size_t offset, size_t erased, const sstring* data);
+    // Keeps the elements of the chunk from @first to @last, excluded.
+    void keep(chunk& c, size_t first, size_t last);
+    // Removes @count elements equal to @data (all of them if @count is 0).
+    size_t remove(const sstring& data, size_t count, bool from_head);
 };
 }
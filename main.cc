@@ -23,8 +23,10 @@
 #include "redis.hh"
 #include "redis_protocol.hh"
 #include "server.hh"
+#include "aof.hh"
 #include "util/log.hh"
 #include "core/prometheus.hh"
+#include <boost/algorithm/string.hpp>
 #define PLATFORM "seastar"
 #define VERSION "v1.0"
 #define VERSION_STRING PLATFORM " " VERSION
@@ -43,21 +45,212 @@ int main(int ac, char** av) {
     app_template app;
     app.add_options()
         ("port", bpo::value<uint16_t>()->default_value(6379), "Redis server port to listen on")
+        ("shard-ports-base", bpo::value<uint16_t>()->default_value(0), "Every shard also listens on this port plus its id, for the clients sending the requests on a key to its owner shard, 0 means never")
         ("prometheus_port", bpo::value<uint16_t>()->default_value(10000), "Prometheus server port to listen on")
+        ("maxmemory", bpo::value<uint64_t>()->default_value(0), "Maximum memory (bytes) used by the data of every shard, 0 means no limit")
+        ("maxmemory-policy", bpo::value<std::string>()->default_value("noeviction"), "How to evict entries when the memory limit is reached: noeviction, allkeys-lru, volatile-lru, allkeys-lfu, volatile-ttl")
+        ("databases", bpo::value<uint32_t>()->default_value(redis::database::DEFAULT_DB_COUNT), "Number of databases of every shard, SELECT picks the one of the connection")
+        ("active-expire-budget", bpo::value<uint32_t>()->default_value(500), "Maximum time (us) an active expiry cycle may hold a shard")
+        ("lazyfree-lazy-user-del", bpo::value<bool>()->default_value(false), "DEL frees the large collections in the background, as UNLINK does")
+        ("lazyfree-lazy-expire", bpo::value<bool>()->default_value(false), "Free the large collections which expired in the background")
+        ("lazyfree-lazy-overwrite", bpo::value<bool>()->default_value(false), "Free the large collections overwritten by SET and the like in the background")
+        ("lsa-compaction-free-segments", bpo::value<uint32_t>()->default_value(32), "Number of free LSA segments (256KB) every shard keeps by compacting in the background, 0 means it compacts as long as it can")
+        ("lsa-compaction-budget", bpo::value<uint32_t>()->default_value(200), "Maximum time (us) a background compaction step may hold a shard")
+        ("lsa-stall-threshold", bpo::value<uint32_t>()->default_value(1000), "Allocations stalled compacting or evicting for this time (us) or more are logged with their command")
+        ("packed-max-entries", bpo::value<uint32_t>()->default_value(128), "Maximum number of fields of a hash or a set stored in the packed encoding")
+        ("packed-max-value", bpo::value<uint32_t>()->default_value(64), "Maximum size (bytes) of a field or a value of a hash or a set stored in the packed encoding")
+        ("intset-max-entries", bpo::value<uint32_t>()->default_value(512), "Maximum number of members of a set of integers stored as an intset")
+        ("tier-filename", bpo::value<std::string>()->default_value(""), "Name of the file of the flash tier the cold strings are moved to, every shard writes its own file, e.g. tier.0.dat, empty means never")
+        ("tier-dir", bpo::value<std::string>()->default_value(""), "Directory of the flash tier files, on the NVMe device, empty means dir")
+        ("tier-size", bpo::value<uint64_t>()->default_value(uint64_t(64) << 30), "Maximum size (bytes) of the flash tier file of every shard")
+        ("tier-memory", bpo::value<uint64_t>()->default_value(0), "Memory (bytes) used by the data of every shard above which the cold strings are moved to the flash tier, 0 means 90% of maxmemory")
+        ("tier-min-value", bpo::value<uint32_t>()->default_value(1024), "Minimum size (bytes) of the strings moved to the flash tier")
+        ("tier-compression", bpo::value<bool>()->default_value(false), "Compress the strings moved to the flash tier with LZ4")
+        ("dir", bpo::value<std::string>()->default_value("."), "Directory of the snapshot files")
+        ("dbfilename", bpo::value<std::string>()->default_value("dump.rdb"), "Name of the snapshot file, every shard writes its own file, e.g. dump.0.rdb")
+        ("appendonly", bpo::value<bool>()->default_value(false), "Log every change to the append only files, replayed at start")
+        ("appendfilename", bpo::value<std::string>()->default_value("appendonly.aof"), "Name of the append only file, every shard writes its own file, e.g. appendonly.0.aof")
+        ("appendfsync", bpo::value<std::string>()->default_value("everysec"), "When the log is flushed: always (before the reply), everysec, no (on the interval, the reply doesn't wait)")
+        ("aof-fsync-interval", bpo::value<uint32_t>()->default_value(1000), "Interval (ms) of the flushes of the log for everysec and no")
+        ("aof-fsync-bytes", bpo::value<uint64_t>()->default_value(0), "Number of pending bytes starting a write of the log before the interval, 0 means never")
+        ("replicate-keys", bpo::value<std::string>()->default_value(""), "Comma separated string or hash keys whose read only copies are held by every shard")
+        ("shard-queue-limit", bpo::value<uint64_t>()->default_value(0), "Number of requests of the clients of a shard another shard may serve at once, the next ones get -BUSY (half of it for the commands not batchable), 0 means no limit")
+        ("proto-max-bulk-len", bpo::value<uint32_t>()->default_value(redis_protocol_parser::DEFAULT_MAX_BULK_LEN), "Maximum size (bytes) of a bulk argument of a request, the clients sending a larger one are dropped")
+        ("replicate-hot-keys-ops", bpo::value<double>()->default_value(0), "Accesses per second from a shard making a key of another shard replicated there, 0 means never")
+        ("repl-backlog-size", bpo::value<uint64_t>()->default_value(uint64_t(redis::replication_backlog::DEFAULT_SIZE)), "Size (bytes) of the backlog of the changes of every shard kept for the replicas, 0 disables the replication")
+        ("replicaof", bpo::value<std::string>()->default_value(""), "Address (ip:port) of the master this server replicates, every shard follows the same shard of the master")
+        ("cluster-enabled", bpo::value<bool>()->default_value(false), "Serve the hash slots assigned to this node of a Redis Cluster, the keys of a slot live on one shard")
+        ("cluster-config-file", bpo::value<std::string>()->default_value(redis::cluster_state::DEFAULT_CONFIG_FILE), "Name of the file in dir keeping the view of the cluster of this node")
+        ("cluster-announce-ip", bpo::value<std::string>()->default_value("127.0.0.1"), "Address of this node given to the clients redirected to it")
         ;
 
     return app.run_deprecated(ac, av, [&] {
         engine().at_exit([&] { return server.stop(); });
+        engine().at_exit([&] { return redis.stop_replication(); });
+        engine().at_exit([&] { return redis.stop_cluster(); });
+        engine().at_exit([&] { return redis.stop_pubsub(); });
         engine().at_exit([&] { return db.stop(); });
         engine().at_exit([&] { return prometheus_server.stop(); });
 
         auto&& config = app.configuration();
         auto port = config["port"].as<uint16_t>();
         auto pport = config["prometheus_port"].as<uint16_t>();
-        return db.start().then([&, port] {
-            return server.start(std::ref(redis), port);
+        auto shard_ports_base = config["shard-ports-base"].as<uint16_t>();
+        if (shard_ports_base > 0 && (size_t(shard_ports_base) + smp::count > 65536
+                || (port >= shard_ports_base && port < size_t(shard_ports_base) + smp::count))) {
+            main_log.error("shard-ports-base {} gives no free port to each of the {} shards", shard_ports_base, smp::count);
+            return make_exception_future<>(std::invalid_argument("shard-ports-base"));
+        }
+        redis.configure_shard_ports(shard_ports_base);
+        auto maxmemory = config["maxmemory"].as<uint64_t>();
+        auto policy_name = config["maxmemory-policy"].as<std::string>();
+        auto databases = config["databases"].as<uint32_t>();
+        if (databases == 0) {
+            main_log.error("databases must be at least 1");
+            return make_exception_future<>(std::invalid_argument("databases"));
+        }
+        auto expire_budget = std::chrono::microseconds(config["active-expire-budget"].as<uint32_t>());
+        auto lazyfree_del = config["lazyfree-lazy-user-del"].as<bool>();
+        auto lazyfree_expire = config["lazyfree-lazy-expire"].as<bool>();
+        auto lazyfree_overwrite = config["lazyfree-lazy-overwrite"].as<bool>();
+        auto compaction_free_segments = config["lsa-compaction-free-segments"].as<uint32_t>();
+        auto compaction_budget = std::chrono::microseconds(config["lsa-compaction-budget"].as<uint32_t>());
+        auto stall_threshold = std::chrono::microseconds(config["lsa-stall-threshold"].as<uint32_t>());
+        auto packed_max_entries = config["packed-max-entries"].as<uint32_t>();
+        auto packed_max_value = config["packed-max-value"].as<uint32_t>();
+        auto intset_max_entries = config["intset-max-entries"].as<uint32_t>();
+        if (!redis::dict_lsa::valid_configuration(packed_max_entries, packed_max_value, intset_max_entries)) {
+            main_log.error("packed-max-entries, packed-max-value or intset-max-entries too large: a packed hash or set, or an intset, must fit in {} bytes",
+                redis::dict_lsa::max_blob_size);
+            return make_exception_future<>(std::invalid_argument("packed-max-entries"));
+        }
+        redis.configure_snapshot(config["dir"].as<std::string>(), config["dbfilename"].as<std::string>());
+        redis::eviction_policy policy;
+        if (!redis::database::parse_eviction_policy(policy_name, policy)) {
+            main_log.error("unknown maxmemory-policy: {}", policy_name);
+            return make_exception_future<>(std::invalid_argument("maxmemory-policy"));
+        }
+        auto appendonly = config["appendonly"].as<bool>();
+        auto dir = sstring(config["dir"].as<std::string>());
+        auto appendfilename = sstring(config["appendfilename"].as<std::string>());
+        auto fsync_name = config["appendfsync"].as<std::string>();
+        auto fsync_interval = std::chrono::milliseconds(config["aof-fsync-interval"].as<uint32_t>());
+        auto fsync_bytes = config["aof-fsync-bytes"].as<uint64_t>();
+        redis::aof_fsync_policy fsync_policy;
+        if (!redis::parse_aof_fsync_policy(fsync_name, fsync_policy)) {
+            main_log.error("unknown appendfsync: {}", fsync_name);
+            return make_exception_future<>(std::invalid_argument("appendfsync"));
+        }
+        redis.configure_append_only(appendonly);
+        std::vector<std::string> names;
+        boost::split(names, config["replicate-keys"].as<std::string>(), boost::is_any_of(","));
+        std::vector<sstring> replicated_keys;
+        for (auto& name : names) {
+            if (!name.empty()) {
+                replicated_keys.emplace_back(name.data(), name.size());
+            }
+        }
+        auto replicate_ops = config["replicate-hot-keys-ops"].as<double>();
+        auto shard_queue_limit = config["shard-queue-limit"].as<uint64_t>();
+        auto max_bulk_len = config["proto-max-bulk-len"].as<uint32_t>();
+        auto backlog_size = config["repl-backlog-size"].as<uint64_t>();
+        auto replicaof = config["replicaof"].as<std::string>();
+        sstring master_host;
+        uint16_t master_port = 0;
+        if (!replicaof.empty()) {
+            auto colon = replicaof.rfind(':');
+            try {
+                master_port = colon == std::string::npos ? 0 : std::stoul(replicaof.substr(colon + 1));
+            } catch (...) {
+            }
+            if (master_port == 0) {
+                main_log.error("bad replicaof address: {}", replicaof);
+                return make_exception_future<>(std::invalid_argument("replicaof"));
+            }
+            master_host = replicaof.substr(0, colon);
+        }
+        auto tier_filename = sstring(config["tier-filename"].as<std::string>());
+        auto tier_dir = sstring(config["tier-dir"].as<std::string>());
+        if (tier_dir.empty()) {
+            tier_dir = dir;
+        }
+        auto tier_size = config["tier-size"].as<uint64_t>();
+        auto tier_memory = config["tier-memory"].as<uint64_t>();
+        if (tier_memory == 0) {
+            tier_memory = maxmemory / 10 * 9;
+        }
+        auto tier_min_value = config["tier-min-value"].as<uint32_t>();
+        auto tier_compression = config["tier-compression"].as<bool>();
+        if (!tier_filename.empty() && tier_memory == 0) {
+            main_log.error("the flash tier needs tier-memory or maxmemory");
+            return make_exception_future<>(std::invalid_argument("tier-memory"));
+        }
+        auto cluster_enabled = config["cluster-enabled"].as<bool>();
+        auto cluster_file = dir + "/" + sstring(config["cluster-config-file"].as<std::string>());
+        auto cluster_ip = sstring(config["cluster-announce-ip"].as<std::string>());
+        return db.start(size_t(databases)).then([&db, maxmemory, policy, expire_budget, lazyfree_del, lazyfree_expire, lazyfree_overwrite, packed_max_entries, packed_max_value, intset_max_entries,
+                compaction_free_segments, compaction_budget, stall_threshold] {
+            return db.invoke_on_all([maxmemory, policy, expire_budget, lazyfree_del, lazyfree_expire, lazyfree_overwrite, packed_max_entries, packed_max_value, intset_max_entries,
+                    compaction_free_segments, compaction_budget, stall_threshold] (auto& d) {
+                d.configure_eviction(maxmemory, policy);
+                d.configure_expiry(expire_budget);
+                d.configure_lazyfree(lazyfree_del, lazyfree_expire, lazyfree_overwrite);
+                d.configure_encoding(packed_max_entries, packed_max_value, intset_max_entries);
+                d.configure_compaction(compaction_free_segments, compaction_budget, stall_threshold);
+            });
+        }).then([&, appendonly, dir, appendfilename, fsync_policy, fsync_interval, fsync_bytes] {
+            if (!appendonly) {
+                // the snapshot is loaded before the clients get in.
+                return redis.load_snapshot();
+            }
+            // the logs of the last run are replayed before the changes are logged,
+            // and before the clients get in.
+            return redis::replay_append_only_logs(redis, dir, appendfilename).then([&, dir, appendfilename, fsync_policy, fsync_interval, fsync_bytes] (unsigned found) {
+                return db.invoke_on_all([dir, appendfilename, fsync_policy, fsync_interval, fsync_bytes] (auto& d) {
+                    return d.configure_aof(dir, appendfilename, fsync_policy, fsync_interval, fsync_bytes);
+                }).then([&, dir, appendfilename, found] {
+                    if (found == 0 || found == smp::count) {
+                        return make_ready_future<>();
+                    }
+                    // the logs were written by another number of shards, every shard
+                    // rewrites its own one before the stale ones are removed.
+                    main_log.info("rewriting the {} append only logs of the last run for {} shards", found, smp::count);
+                    return db.invoke_on_all(&redis::database::rewrite_log).then([dir, appendfilename, found] {
+                        return redis::remove_stale_append_only_logs(dir, appendfilename, found);
+                    });
+                });
+            });
+        }).then([&, tier_filename, tier_dir, tier_size, tier_memory, tier_min_value, tier_compression] {
+            if (tier_filename.empty()) {
+                return make_ready_future<>();
+            }
+            // the loaded entries are complete, the cold ones may be moved.
+            return db.invoke_on_all([tier_filename, tier_dir, tier_size, tier_memory, tier_min_value, tier_compression] (auto& d) {
+                auto path = redis::shard_file_path(tier_dir, tier_filename, engine().cpu_id());
+                return d.configure_tier(path, tier_size, tier_memory, tier_min_value, tier_compression);
+            });
+        }).then([&, replicated_keys, backlog_size] {
+            // the copies are published once the data is loaded.
+            return db.invoke_on_all([&db, replicated_keys, backlog_size] (auto& d) {
+                d.configure_replication(db, replicated_keys);
+                d.configure_backlog(backlog_size);
+            });
+        }).then([&, dir] {
+            // before the servers, which own the request statistics of their shard.
+            return redis.start_replication(dir);
+        }).then([&, cluster_enabled, cluster_file, cluster_ip, port] {
+            return redis.start_cluster(cluster_enabled, cluster_file, cluster_ip, port);
+        }).then([&] {
+            return redis.start_pubsub();
+        }).then([&, port, replicate_ops, shard_ports_base, shard_queue_limit, max_bulk_len] {
+            return server.start(std::ref(redis), port, replicate_ops, shard_ports_base, shard_queue_limit, max_bulk_len);
         }).then([&] {
             return server.invoke_on_all(&redis::server::start);
+        }).then([&, master_host, master_port] {
+            if (master_port == 0) {
+                return make_ready_future<>();
+            }
+            return redis.follow(master_host, master_port);
         }).then([&, pport] {
              prometheus_config.metric_help = "Redis server statistics";
              prometheus_config.prefix = "redis";
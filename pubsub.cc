@@ -0,0 +1,355 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "pubsub.hh"
+#include "common.hh"
+#include "core/metrics.hh"
+#include "core/reactor.hh"
+#include <algorithm>
+#include <cstring>
+
+namespace redis {
+
+glob_pattern::glob_pattern(sstring pattern) : _pattern(std::move(pattern)), _kind(kind::glob)
+{
+    auto special = [] (char c) {
+        return c == '*' || c == '?' || c == '[' || c == '\\';
+    };
+    auto size = _pattern.size();
+    auto first = std::find_if(_pattern.begin(), _pattern.end(), special);
+    if (first == _pattern.end()) {
+        _kind = kind::exact;
+        _literal = _pattern;
+    } else if (size == 1 && _pattern[0] == '*') {
+        _kind = kind::all;
+    } else if (first == _pattern.end() - 1 && _pattern[size - 1] == '*') {
+        _kind = kind::prefix;
+        _literal = sstring(_pattern.data(), size - 1);
+    } else if (_pattern[0] == '*' && std::find_if(_pattern.begin() + 1, _pattern.end(), special) == _pattern.end()) {
+        _kind = kind::suffix;
+        _literal = sstring(_pattern.data() + 1, size - 1);
+    }
+}
+
+bool glob_pattern::matches(const sstring& s) const
+{
+    switch (_kind) {
+    case kind::all:
+        return true;
+    case kind::exact:
+        return s == _literal;
+    case kind::prefix:
+        return s.size() >= _literal.size() && std::memcmp(s.data(), _literal.data(), _literal.size()) == 0;
+    case kind::suffix:
+        return s.size() >= _literal.size() && std::memcmp(s.data() + s.size() - _literal.size(), _literal.data(), _literal.size()) == 0;
+    case kind::glob:
+        break;
+    }
+    return glob_match(_pattern.data(), _pattern.size(), s.data(), s.size());
+}
+
+void subscriber::deliver(temporary_buffer<char> message)
+{
+    if (_overflowed) {
+        return;
+    }
+    _pending_bytes += message.size();
+    if (_pending_bytes > PENDING_MAX) {
+        _overflowed = true;
+        _pending.clear();
+        _pending_bytes = 0;
+        _disconnect();
+        return;
+    }
+    _pending.push_back(std::move(message));
+    if (!_held && !_draining) {
+        drain();
+    }
+}
+
+void subscriber::drain()
+{
+    _draining = true;
+    // the messages queued while the others are written follow, until the
+    // replies of the requests take over.
+    _drained = repeat([this] {
+        return do_until([this] { return _pending.empty() || _overflowed; }, [this] {
+            auto message = std::move(_pending.front());
+            _pending.pop_front();
+            _pending_bytes -= message.size();
+            return _out.write(std::move(message));
+        }).then([this] {
+            return _out.flush();
+        }).then([this] {
+            return stop_iteration(_held || _overflowed || _pending.empty());
+        });
+    }).handle_exception([] (std::exception_ptr) {
+        // the connection is closing, its requests fail as well.
+    }).finally([this] {
+        _draining = false;
+        if (!_held && !_overflowed && !_pending.empty()) {
+            drain();
+        }
+    });
+}
+
+future<> subscriber::hold()
+{
+    _held = true;
+    if (!_draining) {
+        return make_ready_future<>();
+    }
+    return std::exchange(_drained, make_ready_future<>());
+}
+
+void subscriber::release()
+{
+    _held = false;
+    if (!_pending.empty() && !_draining) {
+        drain();
+    }
+}
+
+future<> subscriber::close()
+{
+    _overflowed = true;
+    _pending.clear();
+    return std::exchange(_drained, make_ready_future<>());
+}
+
+pubsub::pubsub()
+{
+    namespace sm = seastar::metrics;
+    _metrics.add_group("pubsub", {
+        sm::make_counter("published", [this] { return _published; }, sm::description("Total number of messages published to the subscribers of this shard.")),
+        sm::make_counter("delivered", [this] { return _delivered; }, sm::description("Total number of messages written to the subscribers of this shard.")),
+        sm::make_gauge("channels", [this] { return _channels.size(); }, sm::description("Number of channels the clients of this shard subscribed to.")),
+        sm::make_gauge("patterns", [this] { return _patterns.size(); }, sm::description("Number of patterns the clients of this shard subscribed to.")),
+    });
+}
+
+bool pubsub::subscribe(subscriber& s, const sstring& channel)
+{
+    if (!s.channels().insert(channel).second) {
+        return false;
+    }
+    auto& subscribers = _channels[channel];
+    subscribers.push_back(&s);
+    return subscribers.size() == 1;
+}
+
+static bool remove_subscriber(std::vector<subscriber*>& subscribers, subscriber& s)
+{
+    auto it = std::find(subscribers.begin(), subscribers.end(), &s);
+    if (it != subscribers.end()) {
+        *it = subscribers.back();
+        subscribers.pop_back();
+    }
+    return subscribers.empty();
+}
+
+bool pubsub::unsubscribe(subscriber& s, const sstring& channel)
+{
+    if (s.channels().erase(channel) == 0) {
+        return false;
+    }
+    auto it = _channels.find(channel);
+    if (!remove_subscriber(it->second, s)) {
+        return false;
+    }
+    _channels.erase(it);
+    return true;
+}
+
+bool pubsub::psubscribe(subscriber& s, const sstring& pattern)
+{
+    if (!s.patterns().insert(pattern).second) {
+        return false;
+    }
+    auto it = _patterns.find(pattern);
+    if (it == _patterns.end()) {
+        it = _patterns.emplace(pattern, pattern_subscribers { glob_pattern(pattern), {} }).first;
+    }
+    it->second._subscribers.push_back(&s);
+    return it->second._subscribers.size() == 1;
+}
+
+bool pubsub::punsubscribe(subscriber& s, const sstring& pattern)
+{
+    if (s.patterns().erase(pattern) == 0) {
+        return false;
+    }
+    auto it = _patterns.find(pattern);
+    if (!remove_subscriber(it->second._subscribers, s)) {
+        return false;
+    }
+    _patterns.erase(it);
+    return true;
+}
+
+void pubsub::set_channel_shard(const sstring& channel, unsigned shard, bool subscribed)
+{
+    if (subscribed) {
+        auto& shards = _channel_shards[channel];
+        shards.resize(smp::count);
+        shards[shard] = true;
+        return;
+    }
+    auto it = _channel_shards.find(channel);
+    if (it == _channel_shards.end()) {
+        return;
+    }
+    it->second[shard] = false;
+    if (std::none_of(it->second.begin(), it->second.end(), [] (bool b) { return b; })) {
+        _channel_shards.erase(it);
+    }
+}
+
+void pubsub::set_pattern_shard(const sstring& pattern, unsigned shard, bool subscribed)
+{
+    if (subscribed) {
+        auto it = _pattern_shards.find(pattern);
+        if (it == _pattern_shards.end()) {
+            it = _pattern_shards.emplace(pattern, pattern_shards { glob_pattern(pattern), std::vector<bool>(smp::count) }).first;
+        }
+        it->second._shards[shard] = true;
+        return;
+    }
+    auto it = _pattern_shards.find(pattern);
+    if (it == _pattern_shards.end()) {
+        return;
+    }
+    auto& shards = it->second._shards;
+    shards[shard] = false;
+    if (std::none_of(shards.begin(), shards.end(), [] (bool b) { return b; })) {
+        _pattern_shards.erase(it);
+    }
+}
+
+std::vector<unsigned> pubsub::shards_of(const sstring& channel)
+{
+    std::vector<bool> targets(smp::count);
+    auto it = _channel_shards.find(channel);
+    if (it != _channel_shards.end()) {
+        targets = it->second;
+    }
+    for (auto& p : _pattern_shards) {
+        if (p.second._pattern.matches(channel)) {
+            for (unsigned shard = 0; shard < smp::count; ++shard) {
+                if (p.second._shards[shard]) {
+                    targets[shard] = true;
+                }
+            }
+        }
+    }
+    std::vector<unsigned> shards;
+    for (unsigned shard = 0; shard < smp::count; ++shard) {
+        if (targets[shard]) {
+            shards.push_back(shard);
+        }
+    }
+    return shards;
+}
+
+// Encodes the push of a message, an array of bulk strings, into one buffer.
+static temporary_buffer<char> encode_push(std::initializer_list<const sstring*> parts)
+{
+    auto header = sstring("*") + to_sstring(parts.size()) + sstring("\r\n");
+    size_t size = header.size();
+    std::vector<sstring> lengths;
+    for (auto p : parts) {
+        lengths.emplace_back(sstring("$") + to_sstring(p->size()) + sstring("\r\n"));
+        size += lengths.back().size() + p->size() + 2;
+    }
+    temporary_buffer<char> buf(size);
+    auto out = buf.get_write();
+    auto append = [&out] (const char* data, size_t n) {
+        std::memcpy(out, data, n);
+        out += n;
+    };
+    append(header.data(), header.size());
+    size_t i = 0;
+    for (auto p : parts) {
+        append(lengths[i].data(), lengths[i].size());
+        append(p->data(), p->size());
+        append("\r\n", 2);
+        ++i;
+    }
+    return buf;
+}
+
+size_t pubsub::deliver(const sstring& channel, const sstring& message)
+{
+    static const sstring message_kind {"message"};
+    static const sstring pmessage_kind {"pmessage"};
+    ++_published;
+    size_t delivered = 0;
+    auto it = _channels.find(channel);
+    if (it != _channels.end()) {
+        auto push = encode_push({ &message_kind, &channel, &message });
+        for (auto s : it->second) {
+            s->deliver(push.share());
+        }
+        delivered += it->second.size();
+    }
+    for (auto& p : _patterns) {
+        auto& subscribers = p.second;
+        if (!subscribers._pattern.matches(channel)) {
+            continue;
+        }
+        auto push = encode_push({ &pmessage_kind, &p.first, &channel, &message });
+        for (auto s : subscribers._subscribers) {
+            s->deliver(push.share());
+        }
+        delivered += subscribers._subscribers.size();
+    }
+    _delivered += delivered;
+    return delivered;
+}
+
+std::vector<sstring> pubsub::active_channels(const sstring& pattern) const
+{
+    std::vector<sstring> channels;
+    for (auto& c : _channel_shards) {
+        if (pattern.empty() || glob_match(pattern.data(), pattern.size(), c.first.data(), c.first.size())) {
+            channels.push_back(c.first);
+        }
+    }
+    return channels;
+}
+
+size_t pubsub::local_subscribers(const sstring& channel) const
+{
+    auto it = _channels.find(channel);
+    return it == _channels.end() ? 0 : it->second.size();
+}
+
+sstring subscription_reply(const char* kind, const sstring* name, size_t count)
+{
+    auto kind_size = std::strlen(kind);
+    auto reply = sstring("*3\r\n$") + to_sstring(kind_size) + sstring("\r\n") + sstring(kind, kind_size) + sstring("\r\n");
+    if (name) {
+        reply += sstring("$") + to_sstring(name->size()) + sstring("\r\n") + *name + sstring("\r\n");
+    } else {
+        reply += sstring("$-1\r\n");
+    }
+    return reply + sstring(":") + to_sstring(count) + sstring("\r\n");
+}
+}
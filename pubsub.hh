@@ -0,0 +1,152 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/future.hh"
+#include "core/iostream.hh"
+#include "core/metrics_registration.hh"
+#include "core/sstring.hh"
+#include "core/temporary_buffer.hh"
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace redis {
+
+// A glob-style pattern of PSUBSCRIBE, compiled once when it's subscribed to:
+// the patterns without a special character, and the prefixes or suffixes
+// followed or preceded by a single '*', are matched without glob_match().
+class glob_pattern final {
+    enum class kind { all, exact, prefix, suffix, glob };
+    sstring _pattern;
+    sstring _literal;
+    kind _kind;
+public:
+    explicit glob_pattern(sstring pattern);
+    bool matches(const sstring& s) const;
+    inline const sstring& pattern() const { return _pattern; }
+};
+
+// The subscriptions of a connection, and the messages pushed to it. The
+// messages are written between the batches of the replies of its requests,
+// held meanwhile. A subscriber which doesn't read the messages as fast as
+// they come is disconnected once PENDING_MAX bytes of them are queued.
+class subscriber final {
+public:
+    static constexpr const size_t PENDING_MAX = 32 * 1024 * 1024;
+private:
+    output_stream<char>& _out;
+    std::unordered_set<sstring> _channels;
+    std::unordered_set<sstring> _patterns;
+    std::deque<temporary_buffer<char>> _pending;
+    size_t _pending_bytes = 0;
+    // a subscriber is created by the request it replies to.
+    bool _held = true;
+    bool _draining = false;
+    bool _overflowed = false;
+    future<> _drained = make_ready_future<>();
+    std::function<void ()> _disconnect;
+    void drain();
+public:
+    subscriber(output_stream<char>& out, std::function<void ()> disconnect)
+        : _out(out)
+        , _disconnect(std::move(disconnect))
+    {
+    }
+    inline std::unordered_set<sstring>& channels() { return _channels; }
+    inline std::unordered_set<sstring>& patterns() { return _patterns; }
+    inline size_t subscriptions() const { return _channels.size() + _patterns.size(); }
+    // The bytes of the subscriber, with its subscriptions and the messages queued.
+    size_t memory_usage() const
+    {
+        auto bytes = sizeof(*this) + _pending_bytes;
+        for (auto& names : { &_channels, &_patterns }) {
+            for (auto& name : *names) {
+                bytes += sizeof(name) + name.size();
+            }
+        }
+        return bytes;
+    }
+    // Queues @message, shared with the other subscribers of the shard.
+    void deliver(temporary_buffer<char> message);
+    // The replies of the requests are written from now on, once the messages
+    // being written are.
+    future<> hold();
+    // The replies were flushed, the messages queued meanwhile follow.
+    void release();
+    // Waits for the messages being written.
+    future<> close();
+};
+
+// The subscriptions of the clients of a shard. The shards where a channel or
+// a pattern has subscribers are known by all the shards: a message is sent
+// once to each of them, which encodes it once and writes the same buffer to
+// all its subscribers.
+class pubsub final {
+    struct pattern_subscribers {
+        glob_pattern _pattern;
+        std::vector<subscriber*> _subscribers;
+    };
+    struct pattern_shards {
+        glob_pattern _pattern;
+        std::vector<bool> _shards;
+    };
+    std::unordered_map<sstring, std::vector<subscriber*>> _channels;
+    std::unordered_map<sstring, pattern_subscribers> _patterns;
+    std::unordered_map<sstring, std::vector<bool>> _channel_shards;
+    std::unordered_map<sstring, pattern_shards> _pattern_shards;
+    uint64_t _published = 0;
+    uint64_t _delivered = 0;
+    seastar::metrics::metric_groups _metrics;
+public:
+    pubsub();
+    // The local subscriptions return true if @s is the first subscriber of
+    // the shard to the channel or the pattern, or the last one to leave: the
+    // other shards must be told.
+    bool subscribe(subscriber& s, const sstring& channel);
+    bool unsubscribe(subscriber& s, const sstring& channel);
+    bool psubscribe(subscriber& s, const sstring& pattern);
+    bool punsubscribe(subscriber& s, const sstring& pattern);
+    // Records whether @shard has subscribers to @channel or to @pattern.
+    void set_channel_shard(const sstring& channel, unsigned shard, bool subscribed);
+    void set_pattern_shard(const sstring& pattern, unsigned shard, bool subscribed);
+    // The shards with subscribers to @channel, directly or by a pattern.
+    std::vector<unsigned> shards_of(const sstring& channel);
+    // Writes @message to the local subscribers of @channel and of the patterns
+    // matching it, returns their number.
+    size_t deliver(const sstring& channel, const sstring& message);
+
+    // PUBSUB CHANNELS, NUMSUB and NUMPAT.
+    std::vector<sstring> active_channels(const sstring& pattern) const;
+    size_t local_subscribers(const sstring& channel) const;
+    inline size_t channels() const { return _channel_shards.size(); }
+    inline size_t patterns() const { return _pattern_shards.size(); }
+    future<> stop() { return make_ready_future<>(); }
+};
+
+// The reply of PING on a subscribed connection.
+static const sstring msg_subscribed_pong {"*2\r\n$4\r\npong\r\n$0\r\n\r\n"};
+
+// The reply of (P)SUBSCRIBE and (P)UNSUBSCRIBE for @name, the channel or the
+// pattern, while the client is left with @count subscriptions.
+sstring subscription_reply(const char* kind, const sstring* name, size_t count);
+}
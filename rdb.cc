@@ -0,0 +1,757 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "rdb.hh"
+#include "hll.hh"
+#include "flash_tier.hh"
+#include <cerrno>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
+
+namespace redis {
+
+static constexpr const uint64_t CRC64_POLY = 0x95ac9329ac4bc9b5ULL;
+
+struct crc64_table {
+    uint64_t _table[256];
+    crc64_table()
+    {
+        for (uint64_t i = 0; i < 256; ++i) {
+            uint64_t crc = i;
+            for (int j = 0; j < 8; ++j) {
+                crc = (crc & 1) ? (crc >> 1) ^ CRC64_POLY : crc >> 1;
+            }
+            _table[i] = crc;
+        }
+    }
+};
+static const crc64_table crc64_lookup;
+
+uint64_t crc64(uint64_t crc, const char* data, size_t size)
+{
+    auto p = reinterpret_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        crc = crc64_lookup._table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static inline void encode_little_endian(uint8_t* p, uint64_t value, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        p[i] = static_cast<uint8_t>(value >> (i * 8));
+    }
+}
+
+static inline uint64_t decode_little_endian(const char* p, size_t n)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < n; ++i) {
+        value |= static_cast<uint64_t>(static_cast<uint8_t>(p[i])) << (i * 8);
+    }
+    return value;
+}
+
+static inline uint64_t decode_big_endian(const char* p, size_t n)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < n; ++i) {
+        value = (value << 8) | static_cast<uint8_t>(p[i]);
+    }
+    return value;
+}
+
+// The LZF decompression of liblzf, which Redis compresses the long strings with.
+// Returns the size of the decompressed bytes, 0 if @in is corrupted.
+static size_t lzf_decompress(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size)
+{
+    auto ip = in;
+    auto in_end = in + in_size;
+    auto op = out;
+    auto out_end = out + out_size;
+    while (ip < in_end) {
+        unsigned ctrl = *ip++;
+        if (ctrl < (1 << 5)) {
+            // a run of literal bytes.
+            ++ctrl;
+            if (op + ctrl > out_end || ip + ctrl > in_end) {
+                return 0;
+            }
+            std::memcpy(op, ip, ctrl);
+            op += ctrl;
+            ip += ctrl;
+            continue;
+        }
+        // a back reference, which may overlap the bytes it produces.
+        unsigned len = ctrl >> 5;
+        auto ref = op - ((ctrl & 0x1f) << 8) - 1;
+        if (len == 7) {
+            if (ip >= in_end) {
+                return 0;
+            }
+            len += *ip++;
+        }
+        if (ip >= in_end) {
+            return 0;
+        }
+        ref -= *ip++;
+        len += 2;
+        if (op + len > out_end || ref < out) {
+            return 0;
+        }
+        for (; len > 0; --len) {
+            *op++ = *ref++;
+        }
+    }
+    return op - out;
+}
+
+void rdb_writer::reserve(size_t n)
+{
+    if (_size + n <= _buffer.size()) {
+        return;
+    }
+    auto capacity = std::max(std::max(_capacity, _buffer.size() * 2), _size + n);
+    temporary_buffer<char> buffer(capacity);
+    std::memcpy(buffer.get_write(), _buffer.get(), _size);
+    _buffer = std::move(buffer);
+}
+
+void rdb_writer::update_crc()
+{
+    _crc = crc64(_crc, _buffer.get() + _crc_position, _size - _crc_position);
+    _crc_position = _size;
+}
+
+temporary_buffer<char> rdb_writer::release()
+{
+    update_crc();
+    auto buffer = std::move(_buffer);
+    buffer.trim(_size);
+    _bytes += _size;
+    _size = 0;
+    _crc_position = 0;
+    return buffer;
+}
+
+void rdb_writer::write_header()
+{
+    char header[16];
+    auto n = std::snprintf(header, sizeof(header), "REDIS%04d", RDB_VERSION);
+    write_raw(header, n);
+}
+
+void rdb_writer::write_aux(const sstring& key, const sstring& value)
+{
+    write_byte(RDB_OPCODE_AUX);
+    write_string(key);
+    write_string(value);
+}
+
+void rdb_writer::write_select_db(size_t index)
+{
+    write_byte(RDB_OPCODE_SELECTDB);
+    write_length(index);
+}
+
+void rdb_writer::write_resize_db(size_t size, size_t expiring_size)
+{
+    write_byte(RDB_OPCODE_RESIZEDB);
+    write_length(size);
+    write_length(expiring_size);
+}
+
+void rdb_writer::write_eof()
+{
+    write_byte(RDB_OPCODE_EOF);
+    update_crc();
+    uint8_t checksum[8];
+    encode_little_endian(checksum, _crc, sizeof(checksum));
+    write_raw(checksum, sizeof(checksum));
+    _crc_position = _size;
+}
+
+void rdb_writer::write_length(uint64_t length)
+{
+    if (length < (1 << 6)) {
+        write_byte(static_cast<uint8_t>((RDB_6BITLEN << 6) | length));
+    } else if (length < (1 << 14)) {
+        uint8_t b[2] = { static_cast<uint8_t>((RDB_14BITLEN << 6) | (length >> 8)), static_cast<uint8_t>(length & 0xff) };
+        write_raw(b, sizeof(b));
+    } else if (length <= std::numeric_limits<uint32_t>::max()) {
+        uint8_t b[5] = { RDB_32BITLEN, static_cast<uint8_t>(length >> 24), static_cast<uint8_t>(length >> 16),
+            static_cast<uint8_t>(length >> 8), static_cast<uint8_t>(length) };
+        write_raw(b, sizeof(b));
+    } else {
+        uint8_t b[9];
+        b[0] = RDB_64BITLEN;
+        for (size_t i = 0; i < 8; ++i) {
+            b[1 + i] = static_cast<uint8_t>(length >> ((7 - i) * 8));
+        }
+        write_raw(b, sizeof(b));
+    }
+}
+
+void rdb_writer::write_string(const char* data, size_t size)
+{
+    write_length(size);
+    write_raw(data, size);
+}
+
+// The integers are encoded as Redis encodes the strings holding an integer.
+void rdb_writer::write_integer(int64_t value)
+{
+    uint8_t b[5];
+    size_t n = 0;
+    if (value >= std::numeric_limits<int8_t>::min() && value <= std::numeric_limits<int8_t>::max()) {
+        b[0] = (RDB_ENCVAL << 6) | RDB_ENC_INT8;
+        n = 1;
+    } else if (value >= std::numeric_limits<int16_t>::min() && value <= std::numeric_limits<int16_t>::max()) {
+        b[0] = (RDB_ENCVAL << 6) | RDB_ENC_INT16;
+        n = 2;
+    } else if (value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max()) {
+        b[0] = (RDB_ENCVAL << 6) | RDB_ENC_INT32;
+        n = 4;
+    } else {
+        write_string(to_sstring(value));
+        return;
+    }
+    encode_little_endian(b + 1, static_cast<uint64_t>(value), n);
+    write_raw(b, n + 1);
+}
+
+void rdb_writer::write_double(double value)
+{
+    char buf[32];
+    auto n = std::snprintf(buf, sizeof(buf), "%.17g", value);
+    write_string(buf, n);
+}
+
+void rdb_writer::write_binary_double(double value)
+{
+    static_assert(sizeof(double) == sizeof(uint64_t), "double must be 8 bytes wide");
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint8_t b[8];
+    encode_little_endian(b, bits, sizeof(b));
+    write_raw(b, sizeof(b));
+}
+
+void rdb_writer::write_hll(const managed_bytes& b)
+{
+    uint8_t header[hll::DENSE_HEADER_SIZE];
+    hll::redis_header(b, header);
+    write_length(hll::DENSE_HEADER_SIZE + b.size() - HLL_CARD_CACHE_SIZE);
+    write_raw(header, sizeof(header));
+    write_raw(reinterpret_cast<const uint8_t*>(b.data()) + HLL_CARD_CACHE_SIZE, b.size() - HLL_CARD_CACHE_SIZE);
+}
+
+void rdb_writer::write_entry(const cache_entry& e, clock_type::time_point now, std::chrono::system_clock::time_point wall_now)
+{
+    using namespace std::chrono;
+    if (e.ever_expires()) {
+        auto at = wall_now + duration_cast<milliseconds>(e.get_timeout() - now);
+        uint8_t b[8];
+        encode_little_endian(b, static_cast<uint64_t>(duration_cast<milliseconds>(at.time_since_epoch()).count()), sizeof(b));
+        write_byte(RDB_OPCODE_EXPIRETIME_MS);
+        write_raw(b, sizeof(b));
+    }
+    auto key = e.key();
+    switch (e.type()) {
+    case entry_type::ENTRY_FLOAT:
+        write_byte(RDB_TYPE_STRING);
+        write_string(reinterpret_cast<const char*>(key.data()), key.size());
+        write_double(e.value_float());
+        break;
+    case entry_type::ENTRY_INT64:
+        write_byte(RDB_TYPE_STRING);
+        write_string(reinterpret_cast<const char*>(key.data()), key.size());
+        write_integer(e.value_integer());
+        break;
+    case entry_type::ENTRY_BYTES: {
+        // a tiered value was staged before the step.
+        auto value = flash_tier::value_of(e);
+        write_byte(RDB_TYPE_STRING);
+        write_string(reinterpret_cast<const char*>(key.data()), key.size());
+        write_string(reinterpret_cast<const char*>(value.data()), value.size());
+        break;
+    }
+    case entry_type::ENTRY_HLL:
+        write_byte(RDB_TYPE_STRING);
+        write_string(reinterpret_cast<const char*>(key.data()), key.size());
+        write_hll(e.value_bytes());
+        break;
+    case entry_type::ENTRY_LIST: {
+        auto& list = e.value_list();
+        write_byte(RDB_TYPE_LIST);
+        write_string(reinterpret_cast<const char*>(key.data()), key.size());
+        write_length(list.size());
+        list.for_each([this] (bytes_view v) {
+            write_string(reinterpret_cast<const char*>(v.data()), v.size());
+        });
+        break;
+    }
+    case entry_type::ENTRY_MAP: {
+        auto& map = e.value_map();
+        write_byte(RDB_TYPE_HASH);
+        write_string(reinterpret_cast<const char*>(key.data()), key.size());
+        write_length(map.size());
+        map.for_each([this] (const dict_field& f) {
+            write_string(f.key_data(), f.key_size());
+            if (f.type_of_integer()) {
+                write_integer(f.value_integer());
+            } else if (f.type_of_float()) {
+                write_double(f.value_float());
+            } else {
+                write_string(f.value_bytes_data(), f.value_bytes_size());
+            }
+        });
+        break;
+    }
+    case entry_type::ENTRY_SET: {
+        auto& set = e.value_set();
+        write_byte(RDB_TYPE_SET);
+        write_string(reinterpret_cast<const char*>(key.data()), key.size());
+        write_length(set.size());
+        set.for_each([this] (const dict_field& m) {
+            write_string(m.key_data(), m.key_size());
+        });
+        break;
+    }
+    case entry_type::ENTRY_SSET: {
+        auto& sset = e.value_sset();
+        write_byte(RDB_TYPE_ZSET_2);
+        write_string(reinterpret_cast<const char*>(key.data()), key.size());
+        write_length(sset.size());
+        // from the highest score to the lowest as Redis does, the reader inserts
+        // every member at the head then.
+        sset.reverse_for_each([this] (const sset_entry& m) {
+            write_string(m.key_data(), m.key_size());
+            write_binary_double(m.score());
+        });
+        break;
+    }
+    }
+    ++_entries;
+}
+
+bool rdb_string::to_integer(int64_t& value) const
+{
+    if (is_integer) {
+        value = integer;
+        return true;
+    }
+    // only the canonical form, "007" or "+7" stay strings as Redis does.
+    if (size == 0 || size > 20 || (data[0] == '0' && size > 1) || (data[0] == '-' && (size == 1 || data[1] == '0'))) {
+        return false;
+    }
+    char buf[24];
+    std::memcpy(buf, data, size);
+    buf[size] = '\0';
+    char* end = nullptr;
+    errno = 0;
+    auto v = std::strtoll(buf, &end, 10);
+    if (errno != 0 || end != buf + size || !(buf[0] == '-' || (buf[0] >= '0' && buf[0] <= '9'))) {
+        return false;
+    }
+    value = v;
+    return true;
+}
+
+void rdb_reader::update_crc(size_t position)
+{
+    _crc = crc64(_crc, _pending.data() + _crc_position, position - _crc_position);
+    _crc_position = position;
+}
+
+void rdb_reader::feed(const char* data, size_t size)
+{
+    // the decoded bytes are dropped, unless they belong to the current record.
+    auto consumed = std::min(_position, _retained);
+    if (consumed > 0) {
+        if (_file) {
+            update_crc(_position);
+        }
+        _pending.erase(_pending.begin(), _pending.begin() + consumed);
+        _position -= consumed;
+        _crc_position -= consumed;
+        if (_retained != NONE) {
+            _retained -= consumed;
+            _record_start -= consumed;
+        }
+    }
+    _pending.insert(_pending.end(), data, data + size);
+}
+
+bool rdb_reader::read_length(const char*& p, const char* end, uint64_t& length, bool* encoded)
+{
+    if (p == end) {
+        return false;
+    }
+    auto b = static_cast<uint8_t>(*p);
+    switch (b >> 6) {
+    case RDB_6BITLEN:
+        length = b & 0x3f;
+        p += 1;
+        return true;
+    case RDB_14BITLEN:
+        if (end - p < 2) {
+            return false;
+        }
+        length = ((b & 0x3f) << 8) | static_cast<uint8_t>(p[1]);
+        p += 2;
+        return true;
+    case RDB_ENCVAL:
+        if (encoded == nullptr) {
+            throw std::runtime_error("unexpected encoded length in the snapshot");
+        }
+        *encoded = true;
+        length = b & 0x3f;
+        p += 1;
+        return true;
+    }
+    if (b == RDB_32BITLEN) {
+        if (end - p < 5) {
+            return false;
+        }
+        length = decode_big_endian(p + 1, 4);
+        p += 5;
+        return true;
+    }
+    if (b == RDB_64BITLEN) {
+        if (end - p < 9) {
+            return false;
+        }
+        length = decode_big_endian(p + 1, 8);
+        p += 9;
+        return true;
+    }
+    throw std::runtime_error("unknown length encoding in the snapshot");
+}
+
+bool rdb_reader::read_string(const char*& p, const char* end, rdb_string& s, std::vector<char>& scratch)
+{
+    auto q = p;
+    uint64_t length = 0;
+    bool encoded = false;
+    if (!read_length(q, end, length, &encoded)) {
+        return false;
+    }
+    if (!encoded) {
+        if (static_cast<uint64_t>(end - q) < length) {
+            return false;
+        }
+        s.data = q;
+        s.size = length;
+        s.is_integer = false;
+        p = q + length;
+        return true;
+    }
+    int64_t value = 0;
+    switch (length) {
+    case RDB_ENC_INT8:
+        if (end - q < 1) {
+            return false;
+        }
+        value = static_cast<int8_t>(q[0]);
+        q += 1;
+        break;
+    case RDB_ENC_INT16:
+        if (end - q < 2) {
+            return false;
+        }
+        value = static_cast<int16_t>(decode_little_endian(q, 2));
+        q += 2;
+        break;
+    case RDB_ENC_INT32:
+        if (end - q < 4) {
+            return false;
+        }
+        value = static_cast<int32_t>(decode_little_endian(q, 4));
+        q += 4;
+        break;
+    case RDB_ENC_LZF: {
+        uint64_t compressed_size = 0, size = 0;
+        if (!read_length(q, end, compressed_size) || !read_length(q, end, size)) {
+            return false;
+        }
+        if (static_cast<uint64_t>(end - q) < compressed_size) {
+            return false;
+        }
+        scratch.resize(size);
+        if (lzf_decompress(reinterpret_cast<const uint8_t*>(q), compressed_size, reinterpret_cast<uint8_t*>(scratch.data()), size) != size) {
+            throw std::runtime_error("corrupted compressed string in the snapshot");
+        }
+        s.data = scratch.data();
+        s.size = size;
+        s.is_integer = false;
+        p = q + compressed_size;
+        return true;
+    }
+    default:
+        throw std::runtime_error("unknown string encoding in the snapshot");
+    }
+    scratch.resize(24);
+    auto n = std::snprintf(scratch.data(), scratch.size(), "%" PRId64, value);
+    s.data = scratch.data();
+    s.size = n;
+    s.is_integer = true;
+    s.integer = value;
+    p = q;
+    return true;
+}
+
+// The scores of RDB_TYPE_ZSET are strings, with a length of one byte.
+bool rdb_reader::read_score(const char*& p, const char* end, double& score)
+{
+    if (p == end) {
+        return false;
+    }
+    auto length = static_cast<uint8_t>(*p);
+    switch (length) {
+    case 253:
+        score = std::nan("");
+        p += 1;
+        return true;
+    case 254:
+        score = std::numeric_limits<double>::infinity();
+        p += 1;
+        return true;
+    case 255:
+        score = -std::numeric_limits<double>::infinity();
+        p += 1;
+        return true;
+    }
+    if (end - p < 1 + length) {
+        return false;
+    }
+    char buf[256];
+    std::memcpy(buf, p + 1, length);
+    buf[length] = '\0';
+    score = std::strtod(buf, nullptr);
+    p += 1 + length;
+    return true;
+}
+
+bool rdb_reader::read_element(const char*& p, const char* end)
+{
+    auto q = p;
+    if (!read_string(q, end, _field, _scratch[1])) {
+        return false;
+    }
+    switch (_type) {
+    case RDB_TYPE_HASH:
+        if (!read_string(q, end, _value, _scratch[2])) {
+            return false;
+        }
+        break;
+    case RDB_TYPE_ZSET_2: {
+        if (end - q < 8) {
+            return false;
+        }
+        auto bits = decode_little_endian(q, 8);
+        std::memcpy(&_score, &bits, sizeof(_score));
+        q += 8;
+        break;
+    }
+    case RDB_TYPE_ZSET:
+        if (!read_score(q, end, _score)) {
+            return false;
+        }
+        break;
+    default:
+        break;
+    }
+    p = q;
+    return true;
+}
+
+rdb_reader::item rdb_reader::next()
+{
+    if (_forwarded) {
+        // the caller is done with the record of the last entry.
+        _forwarded = false;
+        _retained = NONE;
+        _record_start = NONE;
+    }
+    for (;;) {
+        auto begin = _pending.data();
+        auto p = begin + _position;
+        auto end = begin + _pending.size();
+        switch (_state) {
+        case state::header: {
+            if (end - p < 9) {
+                return item::none;
+            }
+            if (std::memcmp(p, "REDIS", 5) != 0) {
+                throw std::runtime_error("not a RDB file");
+            }
+            _version = 0;
+            for (size_t i = 5; i < 9; ++i) {
+                if (p[i] < '0' || p[i] > '9') {
+                    throw std::runtime_error("invalid RDB version");
+                }
+                _version = _version * 10 + (p[i] - '0');
+            }
+            if (_version < 1 || _version > RDB_MAX_VERSION) {
+                throw std::runtime_error("unsupported RDB version " + std::to_string(_version));
+            }
+            commit(p + 9);
+            _state = state::opcode;
+            continue;
+        }
+        case state::opcode: {
+            if (p == end) {
+                return item::none;
+            }
+            auto opcode = p;
+            auto op = static_cast<uint8_t>(*p++);
+            switch (op) {
+            case RDB_OPCODE_AUX:
+                if (!read_string(p, end, _field, _scratch[1]) || !read_string(p, end, _value, _scratch[2])) {
+                    return item::none;
+                }
+                commit(p);
+                return item::aux;
+            case RDB_OPCODE_SELECTDB:
+                if (!read_length(p, end, _db_index)) {
+                    return item::none;
+                }
+                commit(p);
+                return item::select_db;
+            case RDB_OPCODE_RESIZEDB:
+                if (!read_length(p, end, _db_size) || !read_length(p, end, _expires_size)) {
+                    return item::none;
+                }
+                commit(p);
+                return item::resize_db;
+            case RDB_OPCODE_EXPIRETIME_MS:
+                if (end - p < 8) {
+                    return item::none;
+                }
+                start_record(opcode);
+                _expire_at = static_cast<int64_t>(decode_little_endian(p, 8));
+                commit(p + 8);
+                continue;
+            case RDB_OPCODE_EXPIRETIME:
+                if (end - p < 4) {
+                    return item::none;
+                }
+                start_record(opcode);
+                _expire_at = static_cast<int64_t>(decode_little_endian(p, 4)) * 1000;
+                commit(p + 4);
+                continue;
+            case RDB_OPCODE_IDLE: {
+                uint64_t idle = 0;
+                if (!read_length(p, end, idle)) {
+                    return item::none;
+                }
+                start_record(opcode);
+                commit(p);
+                continue;
+            }
+            case RDB_OPCODE_FREQ:
+                if (end - p < 1) {
+                    return item::none;
+                }
+                start_record(opcode);
+                commit(p + 1);
+                continue;
+            case RDB_OPCODE_EOF:
+                if (!_file) {
+                    throw std::runtime_error("unexpected end of the forwarded records");
+                }
+                if (_version >= 5) {
+                    if (end - p < 8) {
+                        return item::none;
+                    }
+                    update_crc(p - begin);
+                    auto checksum = decode_little_endian(p, 8);
+                    // a checksum of 0 means it was disabled.
+                    if (checksum != 0 && checksum != _crc) {
+                        throw std::runtime_error("wrong checksum of the snapshot");
+                    }
+                    p += 8;
+                }
+                commit(p);
+                _state = state::done;
+                return item::eof;
+            case RDB_TYPE_STRING:
+            case RDB_TYPE_LIST:
+            case RDB_TYPE_SET:
+            case RDB_TYPE_ZSET:
+            case RDB_TYPE_HASH:
+            case RDB_TYPE_ZSET_2:
+                break;
+            default:
+                throw std::runtime_error("unsupported RDB type " + std::to_string(op));
+            }
+            _type = op;
+            if (!read_string(p, end, _key, _scratch[0])) {
+                return item::none;
+            }
+            if (_type == RDB_TYPE_STRING) {
+                if (!read_string(p, end, _value, _scratch[2])) {
+                    return item::none;
+                }
+                _elements = 0;
+            } else if (!read_length(p, end, _elements)) {
+                return item::none;
+            }
+            start_record(opcode);
+            commit(p);
+            _forwarding = false;
+            _state = state::elements;
+            return item::entry;
+        }
+        case state::elements:
+            if (!_forwarding) {
+                _retained = NONE;
+                _record_start = NONE;
+            }
+            if (_elements == 0) {
+                _state = state::opcode;
+                _expire_at = -1;
+                if (_forwarding) {
+                    _forwarding = false;
+                    _forwarded = true;
+                    return item::forwarded;
+                }
+                continue;
+            }
+            if (!read_element(p, end)) {
+                return item::none;
+            }
+            commit(p);
+            --_elements;
+            if (!_forwarding) {
+                return item::element;
+            }
+            continue;
+        case state::done:
+            return item::eof;
+        }
+    }
+}
+}
@@ -0,0 +1,235 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/sstring.hh"
+#include "core/temporary_buffer.hh"
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include "cache.hh"
+
+namespace redis {
+
+// The snapshot of a shard is written in the RDB format (version 9) of Redis,
+// every shard writes its own file, which is a complete RDB file and can be
+// loaded by Redis or the RDB tools one by one.
+static constexpr const int RDB_VERSION = 9;
+// The newest version the reader accepts, the encodings it doesn't know are
+// rejected when they are met.
+static constexpr const int RDB_MAX_VERSION = 11;
+
+static constexpr const uint8_t RDB_OPCODE_IDLE = 0xF8;
+static constexpr const uint8_t RDB_OPCODE_FREQ = 0xF9;
+static constexpr const uint8_t RDB_OPCODE_AUX = 0xFA;
+static constexpr const uint8_t RDB_OPCODE_RESIZEDB = 0xFB;
+static constexpr const uint8_t RDB_OPCODE_EXPIRETIME_MS = 0xFC;
+static constexpr const uint8_t RDB_OPCODE_EXPIRETIME = 0xFD;
+static constexpr const uint8_t RDB_OPCODE_SELECTDB = 0xFE;
+static constexpr const uint8_t RDB_OPCODE_EOF = 0xFF;
+
+static constexpr const uint8_t RDB_TYPE_STRING = 0;
+static constexpr const uint8_t RDB_TYPE_LIST = 1;
+static constexpr const uint8_t RDB_TYPE_SET = 2;
+static constexpr const uint8_t RDB_TYPE_ZSET = 3;
+static constexpr const uint8_t RDB_TYPE_HASH = 4;
+static constexpr const uint8_t RDB_TYPE_ZSET_2 = 5;
+
+static constexpr const uint8_t RDB_6BITLEN = 0;
+static constexpr const uint8_t RDB_14BITLEN = 1;
+static constexpr const uint8_t RDB_32BITLEN = 0x80;
+static constexpr const uint8_t RDB_64BITLEN = 0x81;
+static constexpr const uint8_t RDB_ENCVAL = 3;
+static constexpr const uint8_t RDB_ENC_INT8 = 0;
+static constexpr const uint8_t RDB_ENC_INT16 = 1;
+static constexpr const uint8_t RDB_ENC_INT32 = 2;
+static constexpr const uint8_t RDB_ENC_LZF = 3;
+
+// The CRC64 (Jones) of Redis, which is the checksum of the RDB file.
+uint64_t crc64(uint64_t crc, const char* data, size_t size);
+
+// Encodes the entries into a buffer, which is released to be written to the
+// file once it is large enough. The encoding runs synchronously, no reference
+// to an entry is kept once write_entry() returns.
+class rdb_writer final {
+    size_t _capacity;
+    temporary_buffer<char> _buffer;
+    size_t _size = 0;
+    size_t _crc_position = 0;
+    uint64_t _crc = 0;
+    uint64_t _entries = 0;
+    uint64_t _bytes = 0;
+public:
+    explicit rdb_writer(size_t capacity = 128 * 1024) : _capacity(capacity) {}
+
+    void write_header();
+    void write_aux(const sstring& key, const sstring& value);
+    void write_select_db(size_t index);
+    void write_resize_db(size_t size, size_t expiring_size);
+    // @now and @wall_now are the same moment on the clock of the cache and the
+    // wall clock, since the expiry is saved as an absolute unix time.
+    void write_entry(const cache_entry& e, clock_type::time_point now, std::chrono::system_clock::time_point wall_now);
+    // Ends the file with the checksum.
+    void write_eof();
+    // Appends a record encoded already, e.g. read by rdb_reader.
+    inline void write_record(const char* data, size_t size)
+    {
+        write_raw(data, size);
+        ++_entries;
+    }
+
+    inline size_t size() const { return _size; }
+    inline uint64_t entries() const { return _entries; }
+    inline uint64_t bytes() const { return _bytes; }
+    // Returns the encoded bytes, the buffer starts over empty.
+    temporary_buffer<char> release();
+private:
+    void reserve(size_t n);
+    void update_crc();
+    inline void write_raw(const void* data, size_t n)
+    {
+        reserve(n);
+        std::memcpy(_buffer.get_write() + _size, data, n);
+        _size += n;
+    }
+    inline void write_byte(uint8_t b)
+    {
+        write_raw(&b, 1);
+    }
+    void write_length(uint64_t length);
+    void write_string(const char* data, size_t size);
+    inline void write_string(const managed_bytes& b)
+    {
+        write_string(reinterpret_cast<const char*>(b.data()), b.size());
+    }
+    inline void write_string(const sstring& s)
+    {
+        write_string(s.data(), s.size());
+    }
+    void write_integer(int64_t value);
+    void write_double(double value);
+    void write_binary_double(double value);
+    void write_hll(const managed_bytes& b);
+};
+
+// A string decoded from a snapshot, the bytes are valid until the reader is fed
+// again.
+struct rdb_string {
+    const char* data = nullptr;
+    size_t size = 0;
+    // Whether the string was encoded as an integer.
+    bool is_integer = false;
+    int64_t integer = 0;
+
+    inline sstring str() const { return sstring(data, size); }
+    // Whether the string is an integer, encoded or written in its canonical
+    // decimal form.
+    bool to_integer(int64_t& value) const;
+};
+
+// Decodes a snapshot incrementally: the bytes are fed as they are read, and the
+// entries are handed out one element at a time, so that a large entry is never
+// held in memory as a whole. A reader created with @file false decodes records
+// forwarded by another shard, which have neither header nor checksum.
+class rdb_reader final {
+public:
+    enum class item {
+        none,       // more bytes are needed.
+        aux,        // field() and value().
+        select_db,  // db_index().
+        resize_db,  // db_size() and expires_size().
+        entry,      // type(), key(), expire_at() and elements(), a string has its value().
+        element,    // field(), value() of a hash, score() of a sorted set.
+        forwarded,  // record() of an entry whose elements were skipped, see forward().
+        eof,
+    };
+private:
+    static constexpr const size_t NONE = std::numeric_limits<size_t>::max();
+    enum class state { header, opcode, elements, done };
+    bool _file;
+    state _state;
+    std::vector<char> _pending;
+    size_t _position = 0;
+    // The bytes from here on are kept by feed(), they belong to the current record.
+    size_t _retained = NONE;
+    size_t _record_start = NONE;
+    bool _forwarding = false;
+    bool _forwarded = false;
+    size_t _crc_position = 0;
+    uint64_t _crc = 0;
+    int _version = 0;
+
+    uint8_t _type = 0;
+    int64_t _expire_at = -1;
+    uint64_t _elements = 0;
+    uint64_t _db_index = 0;
+    uint64_t _db_size = 0;
+    uint64_t _expires_size = 0;
+    rdb_string _key;
+    rdb_string _field;
+    rdb_string _value;
+    double _score = 0;
+    // The decoded bytes of the integers and of the compressed strings.
+    std::vector<char> _scratch[3];
+public:
+    explicit rdb_reader(bool file = true) : _file(file), _state(file ? state::header : state::opcode) {}
+
+    void feed(const char* data, size_t size);
+    item next();
+    // Skips the elements of the entry just returned, next() returns its record
+    // as a whole once it's complete.
+    inline void forward() { _forwarding = true; }
+
+    inline bool done() const { return _state == state::done; }
+    // Whether every byte fed was decoded, and no record was cut.
+    inline bool at_boundary() const { return _state == state::opcode && _position == _pending.size() && _record_start == NONE; }
+
+    inline uint8_t type() const { return _type; }
+    inline const rdb_string& key() const { return _key; }
+    // The expiry as an absolute unix time (ms), -1 if the entry never expires.
+    inline int64_t expire_at() const { return _expire_at; }
+    inline uint64_t elements() const { return _elements; }
+    inline const rdb_string& field() const { return _field; }
+    inline const rdb_string& value() const { return _value; }
+    inline double score() const { return _score; }
+    inline uint64_t db_index() const { return _db_index; }
+    inline uint64_t db_size() const { return _db_size; }
+    inline uint64_t expires_size() const { return _expires_size; }
+    inline std::pair<const char*, size_t> record() const
+    {
+        return { _pending.data() + _record_start, _position - _record_start };
+    }
+private:
+    inline void commit(const char* p) { _position = p - _pending.data(); }
+    inline void start_record(const char* opcode)
+    {
+        if (_record_start == NONE) {
+            _record_start = opcode - _pending.data();
+            _retained = _record_start;
+        }
+    }
+    void update_crc(size_t position);
+    bool read_length(const char*& p, const char* end, uint64_t& length, bool* encoded = nullptr);
+    bool read_string(const char*& p, const char* end, rdb_string& s, std::vector<char>& scratch);
+    bool read_score(const char*& p, const char* end, double& score);
+    bool read_element(const char*& p, const char* end);
+};
+}
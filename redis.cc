@@ -22,6 +22,9 @@
 #include <iomanip>
 #include <sstream>
 #include <algorithm>
+#include <unordered_set>
+#include <numeric>
+#include <ctime>
 #include "core/app-template.hh"
 #include "core/future-util.hh"
 #include "core/timer-set.hh"
@@ -42,8 +45,10 @@
 #include "redis_protocol.hh"
 #include "db.hh"
 #include "reply_builder.hh"
+#include "bits_operation.hh"
 #include  <experimental/vector>
 #include "core/metrics.hh"
+#include "core/reactor.hh"
 using namespace net;
 namespace redis {
 
@@ -53,6 +58,95 @@ static logger redis_log ("redis");
 
 namespace stdx = std::experimental;
 
+template <typename Ret, typename... FuncArgs, typename... Args, typename FutureRet>
+FutureRet redis_service::invoke_on(unsigned cpu, Ret (database::*func)(FuncArgs...), Args&&... args)
+{
+    auto& local = _db.local();
+    auto index = selected_db();
+    if (cpu == engine().cpu_id()) {
+        local.count_dispatch(true);
+        local.maybe_evict();
+        return local.with_store(index, [&] {
+            auto appended = local.log_appended();
+            auto f = futurize<Ret>::apply(std::mem_fn(func), &local, std::forward<Args>(args)...);
+            // the replies returned as futures wait for the log in logged().
+            if (!is_future<Ret>::value) {
+                f = local.durable(std::move(f), appended);
+            }
+            return local.replicated(std::move(f));
+        });
+    }
+    local.count_dispatch(false);
+    // the stalls of the allocations are traced with the command they ran for.
+    auto context = logalloc::shard_tracker().stall_context();
+    return _db.invoke_on(cpu, [func, index, context, args = std::make_tuple(std::forward<Args>(args)...)] (database& db) mutable {
+        logalloc::shard_tracker().set_stall_context(context);
+        db.maybe_evict();
+        auto f = db.with_store(index, [&] {
+            auto appended = db.log_appended();
+            auto r = futurize<Ret>::apply(std::mem_fn(func), std::tuple_cat(std::make_tuple(&db), std::move(args)));
+            if (!is_future<Ret>::value) {
+                r = db.durable(std::move(r), appended);
+            }
+            return db.replicated(std::move(r));
+        });
+        logalloc::shard_tracker().set_stall_context(nullptr);
+        return f;
+    });
+}
+
+unsigned& redis_service::selected_db()
+{
+    static thread_local unsigned db = 0;
+    return db;
+}
+
+bool redis_service::holds_copy(const sstring& key)
+{
+    return _db.local().holds_copy(key);
+}
+
+unsigned redis_service::get_read_cpu(const redis_key& rk)
+{
+    // the copies are the ones of the database 0.
+    if (selected_db() == 0 && holds_copy(rk.key())) {
+        return engine().cpu_id();
+    }
+    return get_cpu(rk);
+}
+
+future<uint64_t> redis_service::watch(unsigned cpu, size_t db, const sstring& key)
+{
+    return _db.invoke_on(cpu, [db, &key] (database& d) {
+        return d.watch(db, key);
+    });
+}
+
+future<> redis_service::unwatch(std::vector<watched_key>& keys)
+{
+    return parallel_for_each(keys, [this] (watched_key& w) {
+        return _db.invoke_on(w._cpu, [&w] (database& d) {
+            d.unwatch(w._db, w._key);
+        });
+    });
+}
+
+bool redis_service::watched_unchanged_here(const std::vector<watched_key>& keys)
+{
+    auto& d = _db.local();
+    for (auto& w : keys) {
+        if (d.watched_changed(w._db, w._key, w._version)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+future<> redis_service::replicate(const sstring& key)
+{
+    return _db.invoke_on(get_cpu(key), &database::replicate, std::cref(key));
+}
+
 future<sstring> redis_service::echo(args_collection& args)
 {
     if (args._command_args_count < 1) {
@@ -66,7 +160,7 @@ future<bool> redis_service::set_impl(sstring& key, sstring& val, long expir, uin
 {
     redis_key rk { std::ref(key) };
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::set_direct, std::move(rk), std::ref(val), expir, flag).then([] (auto&& m) {
+    return invoke_on(cpu, &database::set_direct, std::move(rk), std::ref(val), expir, flag).then([] (auto&& m) {
         return m == REDIS_OK;
     });
 }
@@ -123,40 +217,87 @@ future<> redis_service::set(args_collection& args, output_stream<char>& out)
     }
     redis_key rk { std::ref(key) };
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::set, std::move(rk), std::ref(val), expir, flag).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::set, std::move(rk), std::ref(val), expir, flag).then([&out] (auto&& m) {
+        return m.write(out);
     });;
 }
 
-future<bool> redis_service::remove_impl(sstring& key) {
+future<bool> redis_service::remove_impl(sstring& key, bool lazily) {
     redis_key rk { std::ref(key) };
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::del_direct, std::move(rk));
+    return invoke_on(cpu, lazily ? &database::unlink_direct : &database::del_direct, std::move(rk));
+}
+
+void redis_service::group_by_shard(sstring* first, size_t count, std::vector<std::vector<sstring>>& groups, std::vector<std::pair<unsigned, size_t>>* positions)
+{
+    groups.resize(smp::count);
+    for (size_t i = 0; i < count; ++i) {
+        auto cpu = get_cpu(first[i]);
+        if (positions) {
+            positions->emplace_back(cpu, groups[cpu].size());
+        }
+        groups[cpu].emplace_back(std::move(first[i]));
+    }
+}
+
+bool redis_service::on_one_shard(const sstring* first, size_t count, unsigned& cpu)
+{
+    if (count == 0) {
+        return false;
+    }
+    cpu = get_cpu(first[0]);
+    for (size_t i = 1; i < count; ++i) {
+        if (get_cpu(first[i]) != cpu) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename Func>
+future<> redis_service::for_each_shard(std::vector<std::vector<sstring>>& groups, Func&& func)
+{
+    return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&groups, func = std::forward<Func>(func)] (unsigned cpu) mutable {
+        if (groups[cpu].empty()) {
+            return make_ready_future<>();
+        }
+        return func(cpu, groups[cpu]);
+    });
 }
 
 future<> redis_service::del(args_collection& args, output_stream<char>& out)
+{
+    return del_impl(args, false, out);
+}
+
+future<> redis_service::unlink(args_collection& args, output_stream<char>& out)
+{
+    return del_impl(args, true, out);
+}
+
+// The multi-key commands send the keys of every shard in a single message.
+future<> redis_service::del_impl(args_collection& args, bool lazily, output_stream<char>& out)
 {
     if (args._command_args_count <= 0 || args._command_args.empty()) {
         return out.write(msg_syntax_err);
     }
     if (args._command_args.size() == 1) {
         sstring& key = args._command_args[0];
-        return remove_impl(key).then([&out] (auto r) {
+        return remove_impl(key, lazily).then([&out] (auto r) {
             return out.write( r ? msg_one : msg_zero);
         });
     }
     else {
         struct mdel_state {
-            std::vector<sstring>& keys;
+            std::vector<std::vector<sstring>> groups;
             size_t success_count;
         };
-        for (size_t i = 0; i < args._command_args_count; ++i) {
-            args._tmp_keys.emplace_back(args._command_args[i]);
-        }
-        return do_with(mdel_state{args._tmp_keys, 0}, [this, &out] (auto& state) {
-            return parallel_for_each(std::begin(state.keys), std::end(state.keys), [this, &state] (auto& key) {
-                return this->remove_impl(key).then([&state] (auto r) {
-                    if (r) state.success_count++;
+        return do_with(mdel_state{{}, 0}, [this, &args, lazily, &out] (auto& state) {
+            this->group_by_shard(args._command_args.data(), args._command_args_count, state.groups);
+            return this->for_each_shard(state.groups, [this, &state, lazily] (unsigned cpu, std::vector<sstring>& keys) {
+                auto remove = lazily ? &database::munlink_direct : &database::mdel_direct;
+                return this->invoke_on(cpu, remove, std::ref(keys)).then([&state] (size_t removed) {
+                    state.success_count += removed;
                 });
             }).then([&state, &out] {
                 return reply_builder::build_local(out, state.success_count);
@@ -173,24 +314,26 @@ future<> redis_service::mset(args_collection& args, output_stream<char>& out)
     if (args._command_args.size() % 2 != 0) {
         return out.write(msg_syntax_err);
     }
+    using pairs_type = std::vector<std::pair<sstring, sstring>>;
     struct mset_state {
-        std::vector<std::pair<sstring, sstring>>& key_value_pairs;
-        size_t success_count;
+        std::vector<pairs_type> groups;
+        bool success;
     };
-    auto pair_size = args._command_args.size() / 2;
-    for (size_t i = 0; i < pair_size; ++i) {
-        args._tmp_key_value_pairs.emplace_back(std::make_pair(std::move(args._command_args[i * 2]), std::move(args._command_args[i * 2 + 1])));
-    }
-    return do_with(mset_state{std::ref(args._tmp_key_value_pairs), 0}, [this, &out] (auto& state) {
-        return parallel_for_each(std::begin(state.key_value_pairs), std::end(state.key_value_pairs), [this, &state] (auto& entry) {
-            sstring& key = entry.first;
-            sstring& value = entry.second;
-            redis_key rk {std::ref(key)};
-            return _db.invoke_on(this->get_cpu(rk), &database::set_direct, std::move(rk), std::ref(value), 0, FLAG_SET_NO).then([&state] (auto m) {
-                if (m) state.success_count++ ;
+    return do_with(mset_state{std::vector<pairs_type>(smp::count), true}, [this, &args, &out] (auto& state) {
+        auto pair_size = args._command_args.size() / 2;
+        for (size_t i = 0; i < pair_size; ++i) {
+            auto cpu = this->get_cpu(args._command_args[i * 2]);
+            state.groups[cpu].emplace_back(std::make_pair(std::move(args._command_args[i * 2]), std::move(args._command_args[i * 2 + 1])));
+        }
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [this, &state] (unsigned cpu) {
+            if (state.groups[cpu].empty()) {
+                return make_ready_future<>();
+            }
+            return this->invoke_on(cpu, &database::mset_direct, std::ref(state.groups[cpu])).then([&state] (bool m) {
+                state.success &= m;
             });
         }).then([&state, &out] {
-            return out.write(state.key_value_pairs.size() == state.success_count ? msg_ok : msg_err);
+            return out.write(state.success ? msg_ok : msg_err);
         });
    });
 }
@@ -202,9 +345,9 @@ future<> redis_service::get(args_collection& args, output_stream<char>& out)
     }
     sstring& key = args._command_args[0];
     redis_key rk { std::ref(key) };
-    auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::get, std::move(rk)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    auto cpu = get_read_cpu(rk);
+    return invoke_on(cpu, &database::get, std::move(rk)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -213,24 +356,36 @@ future<> redis_service::mget(args_collection& args, output_stream<char>& out)
     if (args._command_args_count < 1) {
         return out.write(msg_syntax_err);
     }
-    using return_type = foreign_ptr<lw_shared_ptr<sstring>>;
+    using return_type = foreign_ptr<lw_shared_ptr<reply_fragments>>;
     struct mget_state {
-        std::vector<sstring> keys;
-        std::vector<return_type> values;
+        std::vector<std::vector<sstring>> groups;
+        std::vector<std::pair<unsigned, size_t>> positions;
+        std::vector<return_type> fragments;
     };
-    for (size_t i = 0; i < args._command_args_count; ++i) {
-        args._tmp_keys.emplace_back(args._command_args[i]);
-    }
-    return do_with(mget_state{std::move(args._tmp_keys), {}}, [this, &out] (auto& state) {
-        return parallel_for_each(std::begin(state.keys), std::end(state.keys), [this, &state] (sstring& key) {
-            redis_key rk { std::ref(key) };
-            return _db.invoke_on(this->get_cpu(rk), &database::get_direct, std::move(rk)).then([&state] (auto&& m) {
-                if (m) {
-                   state.values.emplace_back(std::move(m));
-                }
+    return do_with(mget_state{}, [this, &args, &out] (auto& state) {
+        this->group_by_shard(args._command_args.data(), args._command_args_count, state.groups, &state.positions);
+        state.fragments.resize(smp::count);
+        return this->for_each_shard(state.groups, [this, &state] (unsigned cpu, std::vector<sstring>& keys) {
+            return this->invoke_on(cpu, &database::mget_direct, std::ref(keys)).then([&state, cpu] (auto&& m) {
+                state.fragments[cpu] = std::move(m);
             });
         }).then([&state, &out] {
-            return reply_builder::build_local(out, state.values);
+            // the replies are reassembled in the order of the keys.
+            auto header = msg_sigle_tag + to_sstring(state.positions.size()) + msg_crlf;
+            size_t size = header.size();
+            for (auto& f : state.fragments) {
+                if (f) {
+                    size += f->_data.size();
+                }
+            }
+            sstring result(sstring::initialized_later(), size);
+            auto p = std::copy_n(header.begin(), header.size(), result.begin());
+            for (auto& position : state.positions) {
+                auto& f = *state.fragments[position.first];
+                auto begin = position.second == 0 ? 0 : f._ends[position.second - 1];
+                p = std::copy_n(f._data.begin() + begin, f._ends[position.second] - begin, p);
+            }
+            return out.write(std::move(result));
         });
     });
 }
@@ -243,8 +398,8 @@ future<> redis_service::strlen(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk { std::ref(key) };
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::strlen, std::ref(rk)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::strlen, std::ref(rk)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -252,7 +407,7 @@ future<bool> redis_service::exists_impl(sstring& key)
 {
     redis_key rk { std::ref(key) };
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::exists_direct, std::move(rk));
+    return invoke_on(cpu, &database::exists_direct, std::move(rk));
 }
 
 future<> redis_service::exists(args_collection& args, output_stream<char>& out)
@@ -268,16 +423,14 @@ future<> redis_service::exists(args_collection& args, output_stream<char>& out)
     }
     else {
         struct mexists_state {
-            std::vector<sstring>& keys;
+            std::vector<std::vector<sstring>> groups;
             size_t success_count;
         };
-        for (size_t i = 0; i < args._command_args_count; ++i) {
-            args._tmp_keys.emplace_back(args._command_args[i]);
-        }
-        return do_with(mexists_state{std::ref(args._tmp_keys), 0}, [this, &out] (auto& state) {
-            return parallel_for_each(std::begin(state.keys), std::end(state.keys), [this, &state] (auto& key) {
-                return this->exists_impl(key).then([&state] (auto r) {
-                    if (r) state.success_count++;
+        return do_with(mexists_state{{}, 0}, [this, &args, &out] (auto& state) {
+            this->group_by_shard(args._command_args.data(), args._command_args_count, state.groups);
+            return this->for_each_shard(state.groups, [this, &state] (unsigned cpu, std::vector<sstring>& keys) {
+                return this->invoke_on(cpu, &database::mexists_direct, std::ref(keys)).then([&state] (size_t found) {
+                    state.success_count += found;
                 });
             }).then([&state, &out] {
                 return reply_builder::build_local(out, state.success_count);
@@ -295,8 +448,8 @@ future<> redis_service::append(args_collection& args, output_stream<char>& out)
     sstring& val = args._command_args[1];
     redis_key rk { std::ref(key) };
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::append, std::move(rk), std::ref(val)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::append, std::move(rk), std::ref(val)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -304,8 +457,8 @@ future<> redis_service::push_impl(sstring& key, sstring& val, bool force, bool l
 {
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::push, std::move(rk), std::ref(val), force, left).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::push, std::move(rk), std::ref(val), force, left).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -313,8 +466,8 @@ future<> redis_service::push_impl(sstring& key, std::vector<sstring>& vals, bool
 {
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::push_multi, std::move(rk), std::ref(vals), force, left).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::push_multi, std::move(rk), std::ref(vals), force, left).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -329,7 +482,7 @@ future<> redis_service::push_impl(args_collection& args, bool force, bool left,
         return push_impl(key, value, force, left, out);
     }
     else {
-        for (size_t i = 1; i < args._command_args.size(); ++i) args._tmp_keys.emplace_back(args._command_args[i]);
+        for (size_t i = 1; i < args._command_args.size(); ++i) args._tmp_keys.emplace_back(std::move(args._command_args[i]));
         return push_impl(key, args._tmp_keys, force, left, out);
     }
 }
@@ -356,12 +509,12 @@ future<> redis_service::rpushx(args_collection& args, output_stream<char>& out)
 
 future<> redis_service::lpop(args_collection& args, output_stream<char>& out)
 {
-    return pop_impl(args, false, out);
+    return pop_impl(args, true, out);
 }
 
 future<> redis_service::rpop(args_collection& args, output_stream<char>& out)
 {
-    return pop_impl(args, true, out);
+    return pop_impl(args, false, out);
 }
 
 future<> redis_service::pop_impl(args_collection& args, bool left, output_stream<char>& out)
@@ -372,8 +525,234 @@ future<> redis_service::pop_impl(args_collection& args, bool left, output_stream
     sstring& key = args._command_args[0];
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::pop, std::move(rk), left).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::pop, std::move(rk), left).then([&out] (auto&& m) {
+        return m.write(out);
+    });
+}
+
+// The timeout of a blocking command, in seconds, 0 blocks forever.
+static bool parse_block_timeout(const sstring& s, lowres_clock::time_point& deadline, sstring& err)
+{
+    double timeout = 0;
+    try {
+        timeout = std::stod(s);
+    } catch (...) {
+        err = msg_timeout_err;
+        return false;
+    }
+    if (timeout < 0) {
+        err = msg_negative_timeout_err;
+        return false;
+    }
+    deadline = timeout == 0 ? lowres_clock::time_point::max()
+                            : lowres_clock::now() + std::chrono::duration_cast<lowres_clock::duration>(std::chrono::duration<double>(timeout));
+    return true;
+}
+
+// The blocked clients are told apart by an id unique over the shards.
+static uint64_t next_blocked_id()
+{
+    static thread_local uint64_t next = 0;
+    return (uint64_t(engine().cpu_id()) << 48) | ++next;
+}
+
+future<> redis_service::blpop(args_collection& args, blocked_client& client, output_stream<char>& out)
+{
+    return bpop_impl(args, true, client, out);
+}
+
+future<> redis_service::brpop(args_collection& args, blocked_client& client, output_stream<char>& out)
+{
+    return bpop_impl(args, false, client, out);
+}
+
+future<> redis_service::unblock(blocked_client& client)
+{
+    client._gone = true;
+    return _db.invoke_on_all([ids = client._ids] (database& db) {
+        for (auto id : ids) {
+            db.unblock(id);
+        }
+    });
+}
+
+future<blocked_pop> redis_service::give_back(blocked_pop result, unsigned db, bool left, blocked_client& client)
+{
+    if (!client._gone || result._state != blocked_pop::state::popped) {
+        return make_ready_future<blocked_pop>(std::move(result));
+    }
+    return do_with(std::move(result), [this, db, left] (auto& r) {
+        selected_db() = db;
+        redis_key rk {std::ref(r._key)};
+        return invoke_on(get_cpu(rk), &database::push_direct, std::move(rk), std::ref(r._value), left).then([] (bool) {
+            return blocked_pop {};
+        });
+    });
+}
+
+future<blocked_pop> redis_service::block_pop(std::vector<sstring>& keys, bool left, lowres_clock::time_point deadline, blocked_client& client)
+{
+    unsigned cpu = 0;
+    auto db = selected_db();
+    // the client may be gone before it blocks, e.g. once its keys were checked in.
+    if (client._gone) {
+        return make_ready_future<blocked_pop>(blocked_pop {});
+    }
+    if (on_one_shard(keys.data(), keys.size(), cpu)) {
+        auto id = next_blocked_id();
+        client._ids.push_back(id);
+        return _db.invoke_on(cpu, [&keys, left, id, deadline, db] (database& d) {
+            return d.with_store(db, [&] { return d.block_pop(keys, left, true, id, deadline); });
+        }).then([this, db, left, &client] (blocked_pop r) {
+            return give_back(std::move(r), db, left, client);
+        });
+    }
+    // the keys are tried in their order, and the client blocks on all the
+    // shards once they are all empty, until it's woken to try again.
+    return do_with(blocked_pop {}, size_t(0), [this, &keys, left, deadline, db, &client] (auto& result, auto& next) {
+        return repeat([this, &keys, left, deadline, db, &client, &result, &next] {
+            if (client._gone) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            if (next < keys.size()) {
+                auto& key = keys[next++];
+                return _db.invoke_on(get_cpu(key), [&key, left, db] (database& d) {
+                    return d.with_store(db, [&] { return d.try_pop(key, left); });
+                }).then([&result] (blocked_pop r) {
+                    result = std::move(r);
+                    return stop_iteration(result._state != blocked_pop::state::empty);
+                });
+            }
+            if (deadline != lowres_clock::time_point::max() && lowres_clock::now() >= deadline) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            return wait_lists(keys, db, left, deadline, client).then([&next] (bool woken) {
+                next = 0;
+                return stop_iteration(!woken);
+            });
+        }).then([this, db, left, &client, &result] {
+            return give_back(std::move(result), db, left, client);
+        });
+    });
+}
+
+future<bool> redis_service::wait_lists(std::vector<sstring>& keys, unsigned db, bool left, lowres_clock::time_point deadline, blocked_client& client)
+{
+    struct wait_state {
+        std::vector<std::vector<sstring>> _groups;
+        bool _done = false;
+        bool _woken = false;
+    };
+    auto state = make_lw_shared<wait_state>();
+    state->_groups.resize(smp::count);
+    for (auto& key : keys) {
+        state->_groups[get_cpu(key)].push_back(key);
+    }
+    auto id = next_blocked_id();
+    client._ids.push_back(id);
+    return parallel_for_each(boost::irange<unsigned>(0, smp::count), [this, state, id, db, left, deadline] (unsigned cpu) {
+        if (state->_groups[cpu].empty()) {
+            return make_ready_future<>();
+        }
+        auto& keys = state->_groups[cpu];
+        return _db.invoke_on(cpu, [&keys, left, id, deadline, db] (database& d) {
+            return d.with_store(db, [&] { return d.block_pop(keys, left, false, id, deadline); });
+        }).then([this, state, id] (blocked_pop r) {
+            if (state->_done) {
+                return make_ready_future<>();
+            }
+            state->_done = true;
+            state->_woken = r._state != blocked_pop::state::empty;
+            // the first shard to answer unblocks the client on the others, the
+            // messages to a shard keep their order, so it blocked there already.
+            return _db.invoke_on_all([id] (database& db) {
+                db.unblock(id);
+            });
+        });
+    }).then([state] {
+        return state->_woken;
+    });
+}
+
+future<> redis_service::bpop_impl(args_collection& args, bool left, blocked_client& client, output_stream<char>& out)
+{
+    if (args._command_args_count < 2 || args._command_args.size() < 2) {
+        return out.write(msg_syntax_err);
+    }
+    lowres_clock::time_point deadline;
+    sstring err;
+    auto count = args._command_args_count;
+    if (!parse_block_timeout(args._command_args[count - 1], deadline, err)) {
+        return out.write(err);
+    }
+    auto keys = std::vector<sstring>(args._command_args.begin(), args._command_args.begin() + count - 1);
+    return do_with(std::move(keys), [this, left, deadline, &client, &out] (auto& keys) {
+        return this->block_pop(keys, left, deadline, client).then([&out] (blocked_pop r) {
+            if (r._state == blocked_pop::state::wrong_type) {
+                return out.write(msg_type_err);
+            }
+            if (r._state != blocked_pop::state::popped) {
+                return out.write(msg_null_multi_bulk);
+            }
+            std::vector<sstring> reply { std::move(r._key), std::move(r._value) };
+            return do_with(std::move(reply), [&out] (auto& reply) {
+                return reply_builder::build(reply).then([&out] (auto&& m) {
+                    return m.write(out);
+                });
+            });
+        });
+    });
+}
+
+static bool parse_list_end(sstring s, bool& left)
+{
+    std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+    left = s == "left";
+    return left || s == "right";
+}
+
+future<> redis_service::blmove(args_collection& args, blocked_client& client, output_stream<char>& out)
+{
+    if (args._command_args_count != 5 || args._command_args.size() < 5) {
+        return out.write(msg_syntax_err);
+    }
+    bool from_left = false, to_left = false;
+    if (!parse_list_end(args._command_args[2], from_left) || !parse_list_end(args._command_args[3], to_left)) {
+        return out.write(msg_syntax_err);
+    }
+    lowres_clock::time_point deadline;
+    sstring err;
+    if (!parse_block_timeout(args._command_args[4], deadline, err)) {
+        return out.write(err);
+    }
+    sstring& dest = args._command_args[1];
+    auto keys = std::vector<sstring> { args._command_args[0] };
+    return do_with(std::move(keys), [this, &dest, from_left, to_left, deadline, &client, &out] (auto& keys) {
+        return this->block_pop(keys, from_left, deadline, client).then([this, &dest, from_left, to_left, db = selected_db(), &out] (blocked_pop r) {
+            if (r._state == blocked_pop::state::wrong_type) {
+                return out.write(msg_type_err);
+            }
+            if (r._state != blocked_pop::state::popped) {
+                return out.write(msg_nil);
+            }
+            // the element goes back where it was if the destination isn't a list.
+            return do_with(std::move(r), [this, &dest, from_left, to_left, db, &out] (auto& r) {
+                selected_db() = db;
+                redis_key rk {std::ref(dest)};
+                return invoke_on(get_cpu(rk), &database::push_direct, std::move(rk), std::ref(r._value), to_left).then([this, &r, from_left, db, &out] (bool pushed) {
+                    if (pushed) {
+                        return reply_builder::build(bytes_view(reinterpret_cast<const int8_t*>(r._value.data()), r._value.size())).then([&out] (auto&& m) {
+                            return m.write(out);
+                        });
+                    }
+                    selected_db() = db;
+                    redis_key src {std::ref(r._key)};
+                    return invoke_on(get_cpu(src), &database::push_direct, std::move(src), std::ref(r._value), from_left).then([&out] (bool) {
+                        return out.write(msg_type_err);
+                    });
+                });
+            });
+        });
     });
 }
 
@@ -386,8 +765,8 @@ future<> redis_service::lindex(args_collection& args, output_stream<char>& out)
     int idx = std::atoi(args._command_args[1].c_str());
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::lindex, std::move(rk), idx).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::lindex, std::move(rk), idx).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -399,8 +778,8 @@ future<> redis_service::llen(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     auto cpu = get_cpu(key);
     redis_key rk {std::ref(key)};
-    return _db.invoke_on(cpu, &database::llen, std::move(rk)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::llen, std::move(rk)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -418,8 +797,8 @@ future<> redis_service::linsert(args_collection& args, output_stream<char>& out)
     if (dir == "BEFORE") after = false;
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::linsert, std::move(rk), std::ref(pivot), std::ref(value), after).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::linsert, std::move(rk), std::ref(pivot), std::ref(value), after).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -435,8 +814,8 @@ future<> redis_service::lrange(args_collection& args, output_stream<char>& out)
     int end = std::atoi(e.c_str());
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::lrange, std::move(rk), start, end).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::lrange, std::move(rk), start, end).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -451,8 +830,8 @@ future<> redis_service::lset(args_collection& args, output_stream<char>& out)
     int idx = std::atoi(index.c_str());
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::lset, std::move(rk), idx, std::ref(value)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::lset, std::move(rk), idx, std::ref(value)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -466,8 +845,8 @@ future<> redis_service::ltrim(args_collection& args, output_stream<char>& out)
     int stop = std::atoi(args._command_args[2].c_str());
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::ltrim, std::move(rk), start, stop).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::ltrim, std::move(rk), start, stop).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -481,8 +860,8 @@ future<> redis_service::lrem(args_collection& args, output_stream<char>& out)
     sstring& value = args._command_args[2];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::lrem, std::move(rk), count, std::ref(value)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::lrem, std::move(rk), count, std::ref(value)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -521,8 +900,8 @@ future<> redis_service::counter_by(args_collection& args, bool incr, bool with_s
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::counter_by, std::move(rk), step, incr).then([&out] (auto&& m) {
-            return out.write(std::move(*m));
+    return invoke_on(cpu, &database::counter_by, std::move(rk), step, incr).then([&out] (auto&& m) {
+            return m.write(out);
     });
 }
 
@@ -536,15 +915,15 @@ future<> redis_service::hdel(args_collection& args, output_stream<char>& out)
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
     if (args._command_args_count == 2) {
-        return _db.invoke_on(cpu, &database::hdel, std::move(rk), std::ref(field)).then([&out] (auto&& m) {
-            return out.write(std::move(*m));
+        return invoke_on(cpu, &database::hdel, std::move(rk), std::ref(field)).then([&out] (auto&& m) {
+            return m.write(out);
         });
     }
     else {
-        for (size_t i = 1; i < args._command_args.size(); ++i) args._tmp_keys.emplace_back(args._command_args[i]);
+        for (size_t i = 1; i < args._command_args.size(); ++i) args._tmp_keys.emplace_back(std::move(args._command_args[i]));
         auto& keys = args._tmp_keys;
-        return _db.invoke_on(cpu, &database::hdel_multi, std::move(rk), std::ref(keys)).then([&out] (auto&& m) {
-            return out.write(std::move(*m));
+        return invoke_on(cpu, &database::hdel_multi, std::move(rk), std::ref(keys)).then([&out] (auto&& m) {
+            return m.write(out);
         });
     }
 }
@@ -558,8 +937,8 @@ future<> redis_service::hexists(args_collection& args, output_stream<char>& out)
     sstring& field = args._command_args[1];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::hexists, std::move(rk), std::ref(field)).then([&out] (auto&& m) {
-        out.write(std::move(*m));
+    return invoke_on(cpu, &database::hexists, std::move(rk), std::ref(field)).then([&out] (auto&& m) {
+        m.write(out);
     });
 }
 
@@ -573,8 +952,8 @@ future<> redis_service::hset(args_collection& args, output_stream<char>& out)
     sstring& val = args._command_args[2];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::hset, std::move(rk), std::ref(field), std::ref(val)).then([&out] (auto&& m) {
-        out.write(std::move(*m));
+    return invoke_on(cpu, &database::hset, std::move(rk), std::ref(field), std::ref(val)).then([&out] (auto&& m) {
+        m.write(out);
     });
 }
 
@@ -586,12 +965,12 @@ future<> redis_service::hmset(args_collection& args, output_stream<char>& out)
     unsigned int field_count = (args._command_args_count - 1) / 2;
     sstring& key = args._command_args[0];
     for (unsigned int i = 0; i < field_count; ++i) {
-        args._tmp_key_values.emplace(std::make_pair(args._command_args[i], args._command_args[i + 1]));
+        args._tmp_key_values.emplace(std::make_pair(std::move(args._command_args[2 * i + 1]), std::move(args._command_args[2 * i + 2])));
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::hmset, std::move(rk), std::ref(args._tmp_key_values)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::hmset, std::move(rk), std::ref(args._tmp_key_values)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -606,8 +985,8 @@ future<> redis_service::hincrby(args_collection& args, output_stream<char>& out)
     int delta = std::atoi(val.c_str());
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::hincrby, std::move(rk), std::ref(field), delta).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::hincrby, std::move(rk), std::ref(field), delta).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -622,8 +1001,8 @@ future<> redis_service::hincrbyfloat(args_collection& args, output_stream<char>&
     double delta = std::atof(val.c_str());
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::hincrbyfloat, std::move(rk), std::ref(field), delta).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::hincrbyfloat, std::move(rk), std::ref(field), delta).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -635,8 +1014,8 @@ future<> redis_service::hlen(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::hlen, std::move(rk)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::hlen, std::move(rk)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -649,8 +1028,8 @@ future<> redis_service::hstrlen(args_collection& args, output_stream<char>& out)
     sstring& field = args._command_args[1];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::hstrlen, std::move(rk), std::ref(field)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::hstrlen, std::move(rk), std::ref(field)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -662,9 +1041,9 @@ future<> redis_service::hget(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     sstring& field = args._command_args[1];
     redis_key rk{std::ref(key)};
-    auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::hget, std::move(rk), std::ref(field)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    auto cpu = get_read_cpu(rk);
+    return invoke_on(cpu, &database::hget, std::move(rk), std::ref(field)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -676,8 +1055,8 @@ future<> redis_service::hgetall(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::hgetall, std::move(rk)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::hgetall, std::move(rk)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -689,8 +1068,8 @@ future<> redis_service::hgetall_keys(args_collection& args, output_stream<char>&
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::hgetall_keys, std::move(rk)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::hgetall_keys, std::move(rk)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -702,8 +1081,8 @@ future<> redis_service::hgetall_values(args_collection& args, output_stream<char
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::hgetall_values, std::move(rk)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::hgetall_values, std::move(rk)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -719,8 +1098,8 @@ future<> redis_service::hmget(args_collection& args, output_stream<char>& out)
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
     auto& keys = args._tmp_keys;
-    return _db.invoke_on(cpu, &database::hmget, std::move(rk), std::ref(keys)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::hmget, std::move(rk), std::ref(keys)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -728,8 +1107,8 @@ future<> redis_service::smembers_impl(sstring& key, output_stream<char>& out)
 {
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::smembers, std::move(rk)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::smembers, std::move(rk)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -746,19 +1125,17 @@ future<> redis_service::sadds_impl(sstring& key, std::vector<sstring>& members,
 {
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::sadds, std::move(rk), std::ref(members)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::sadds, std::move(rk), std::ref(members)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
-future<> redis_service::sadds_impl_return_keys(sstring& key, std::vector<sstring>& members, output_stream<char>& out)
+future<> redis_service::sstore_impl(sstring& key, std::vector<sstring>& members, output_stream<char>& out)
 {
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::sadds_direct, std::move(rk), std::ref(members)).then([&out, &members] (auto m) {
-        if (m)
-           return reply_builder::build_local(out, members);
-        return reply_builder::build_local(out, msg_err);
+    return invoke_on(cpu, &database::sstore_direct, std::move(rk), std::ref(members)).then([&out] (size_t size) {
+        return reply_builder::build_local(out, size);
     });
 }
 
@@ -781,8 +1158,8 @@ future<> redis_service::scard(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::scard, std::move(rk)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::scard, std::move(rk)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 future<> redis_service::sismember(args_collection& args, output_stream<char>& out)
@@ -794,8 +1171,8 @@ future<> redis_service::sismember(args_collection& args, output_stream<char>& ou
     sstring& member = args._command_args[1];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::sismember, std::move(rk), std::ref(member)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::sismember, std::move(rk), std::ref(member)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -809,8 +1186,8 @@ future<> redis_service::srem(args_collection& args, output_stream<char>& out)
     auto cpu = get_cpu(rk);
     for (uint32_t i = 1; i < args._command_args_count; ++i) args._tmp_keys.emplace_back(std::move(args._command_args[i]));
     auto& keys = args._tmp_keys;
-    return _db.invoke_on(cpu, &database::srems, std::move(rk), std::ref(keys)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::srems, std::move(rk), std::ref(keys)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -837,79 +1214,103 @@ future<> redis_service::sdiff(args_collection& args, output_stream<char>& out)
     return sdiff_impl(std::ref(args._command_args), nullptr, out);
 }
 
-future<> redis_service::sdiff_impl(std::vector<sstring>& keys, sstring* dest, output_stream<char>& out)
+// The operands of SUNION are merged as the sorted
+// integers of intsets, or in a hash set if any operand is not an intset.
+static bool integer_operands(std::unordered_map<unsigned, set_members>& sets, uint32_t count)
 {
-    using item_unordered_map = std::unordered_map<unsigned, std::vector<sstring>>;
-    struct sdiff_state {
-        item_unordered_map items_set;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (sets[i]._integers == false) {
+            for (uint32_t j = 0; j < count; ++j) {
+                sets[j].to_keys();
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+// SINTER and SDIFF ship the candidate members to the shards owning the other
+// operands, one after the other, and every shard keeps only the candidates
+// which are (or are not) in its set, looking them up in its hash index (or
+// intset). The smallest set is the first candidates of SINTER, and the other
+// operands are visited by ascending size, so that the list shrinks as fast as
+// possible. Only the candidates left travel back.
+// If the operands and the destination are all owned by one shard, which is
+// the case of the keys sharing a hash tag, the command runs there at once.
+future<> redis_service::sfilter_impl(std::vector<sstring>& keys, sstring* dest, bool intersect, output_stream<char>& out)
+{
+    unsigned owner = 0;
+    if (on_one_shard(keys.data(), keys.size(), owner) && (dest == nullptr || get_cpu(*dest) == owner)) {
+        return invoke_on(owner, &database::soperate, std::ref(keys), dest, intersect ? SOPERATE_INTER : SOPERATE_DIFF).then([&out] (auto&& m) {
+            return m.write(out);
+        });
+    }
+    struct sfilter_state {
         std::vector<sstring>& keys;
         sstring* dest = nullptr;
-        std::vector<sstring> result;
+        std::vector<size_t> sizes;
+        std::vector<unsigned> order;
+        set_members result;
+        unsigned db = selected_db();
     };
     uint32_t count = static_cast<uint32_t>(keys.size());
-    return do_with(sdiff_state{item_unordered_map{}, std::ref(keys), dest, {}}, [&out, this, count] (auto& state) {
+    return do_with(sfilter_state{std::ref(keys), dest, std::vector<size_t>(count, 0), {}, {}}, [this, &out, count, intersect] (auto& state) {
         return parallel_for_each(boost::irange<unsigned>(0, count), [this, &state] (unsigned k) {
-            sstring& key = state.keys[k];
-            redis_key rk { std::ref(key) };
+            redis_key rk { std::ref(state.keys[k]) };
             auto cpu = this->get_cpu(rk);
-            return _db.invoke_on(cpu, &database::smembers_direct, std::move(rk)).then([&state, index = k] (auto&& members) {
-                state.items_set[index] = std::move(*members);
+            return this->invoke_on(cpu, &database::scard_direct, std::move(rk)).then([&state, k] (size_t size) {
+                state.sizes[k] = size;
             });
-        }).then([this, &out, &state, count] {
-            auto& temp = state.items_set[0];
-            for (uint32_t i = 1; i < count; ++i) {
-                auto&& next_items = std::move(state.items_set[i]);
-                for (auto& item : next_items) {
-                    stdx::erase_if(temp, [&item] (auto& o) { return item == o; });
-                }
+        }).then([this, &state, count, intersect] {
+            selected_db() = state.db;
+            for (unsigned k = 0; k < count; ++k) {
+                state.order.push_back(k);
             }
-            std::vector<sstring>& result = temp;
+            // SDIFF keeps its first operand as the candidates.
+            auto first = intersect ? state.order.begin() : state.order.begin() + 1;
+            std::sort(first, state.order.end(), [&state] (unsigned l, unsigned r) { return state.sizes[l] < state.sizes[r]; });
+            if (state.sizes[state.order[0]] == 0) {
+                return make_ready_future<>();
+            }
+            redis_key rk { std::ref(state.keys[state.order[0]]) };
+            auto cpu = this->get_cpu(rk);
+            return this->invoke_on(cpu, &database::smembers_direct, std::move(rk)).then([this, &state, intersect] (auto&& members) {
+                state.result = std::move(*members);
+                return do_for_each(state.order.begin() + 1, state.order.end(), [this, &state, intersect] (unsigned k) {
+                    if (state.result._values.empty() && state.result._keys.empty()) {
+                        return make_ready_future<>();
+                    }
+                    if (!intersect && state.sizes[k] == 0) {
+                        return make_ready_future<>();
+                    }
+                    selected_db() = state.db;
+                    redis_key rk { std::ref(state.keys[k]) };
+                    auto cpu = this->get_cpu(rk);
+                    return this->invoke_on(cpu, &database::sfilter_direct, std::move(rk), std::cref(state.result), intersect).then([&state] (auto&& candidates) {
+                        state.result = std::move(*candidates);
+                    });
+                });
+            });
+        }).then([this, &out, &state] {
+            state.result.to_keys();
+            auto& result = state.result._keys;
             if (state.dest) {
-                return this->sadds_impl_return_keys(*state.dest, result, out);
+                selected_db() = state.db;
+                return this->sstore_impl(*state.dest, result, out);
             }
             return reply_builder::build_local(out, result);
         });
     });
 }
 
+future<> redis_service::sdiff_impl(std::vector<sstring>& keys, sstring* dest, output_stream<char>& out)
+{
+    return sfilter_impl(keys, dest, false, out);
+}
+
 future<> redis_service::sinter_impl(std::vector<sstring>& keys, sstring* dest, output_stream<char>& out)
 {
-    using item_unordered_map = std::unordered_map<unsigned, std::vector<sstring>>;
-    struct sinter_state {
-        item_unordered_map items_set;
-        std::vector<sstring>& keys;
-        sstring* dest = nullptr;
-    };
-    uint32_t count = static_cast<uint32_t>(keys.size());
-    return do_with(sinter_state{item_unordered_map{}, std::ref(keys), dest}, [this, &out, count] (auto& state) {
-        return parallel_for_each(boost::irange<unsigned>(0, count), [this, &state] (unsigned k) {
-            sstring& key = state.keys[k];
-            redis_key rk { std::ref(key) };
-            auto cpu = this->get_cpu(rk);
-            return _db.invoke_on(cpu, &database::smembers_direct, std::move(rk)).then([&state, index = k] (auto&& members) {
-                state.items_set[index] = std::move(*members);
-            });
-        }).then([this, &out, &state, count] {
-            auto& result = state.items_set[0];
-            for (uint32_t i = 1; i < count; ++i) {
-                auto& next_items = state.items_set[i];
-                if (result.empty() || next_items.empty()) {
-                    return reply_builder::build_local(out, result);
-                }
-                std::vector<sstring> temp;
-                for (auto& item : next_items) {
-                    if (std::find_if(result.begin(), result.end(), [&item] (auto& o) { return item == o; }) != result.end()) {
-                        temp.emplace_back(std::move(item));
-                    }
-                }
-                result = std::move(temp);
-            }
-            if (state.dest) {
-                return this->sadds_impl_return_keys(*state.dest, result, out);
-            }
-            return reply_builder::build_local(out, result);
-       });
-   });
+    return sfilter_impl(keys, dest, true, out);
 }
 
 future<> redis_service::sinter(args_collection& args, output_stream<char>& out)
@@ -937,29 +1338,55 @@ future<> redis_service::sinter_store(args_collection& args, output_stream<char>&
 
 future<> redis_service::sunion_impl(std::vector<sstring>& keys, sstring* dest, output_stream<char>& out)
 {
+    unsigned owner = 0;
+    if (on_one_shard(keys.data(), keys.size(), owner) && (dest == nullptr || get_cpu(*dest) == owner)) {
+        return invoke_on(owner, &database::soperate, std::ref(keys), dest, SOPERATE_UNION).then([&out] (auto&& m) {
+            return m.write(out);
+        });
+    }
+    using item_unordered_map = std::unordered_map<unsigned, set_members>;
     struct union_state {
+        item_unordered_map items_set;
         std::vector<sstring> result;
         std::vector<sstring>& keys;
         sstring* dest = nullptr;
+        unsigned db = selected_db();
     };
     uint32_t count = static_cast<uint32_t>(keys.size());
-    return do_with(union_state{{}, std::ref(keys), dest}, [this, &out, count] (auto& state) {
-        return parallel_for_each(boost::irange<unsigned>(0, count), [this, &out, &state] (unsigned k) {
+    return do_with(union_state{item_unordered_map{}, {}, std::ref(keys), dest}, [this, &out, count] (auto& state) {
+        return parallel_for_each(boost::irange<unsigned>(0, count), [this, &state] (unsigned k) {
             sstring& key = state.keys[k];
             redis_key rk { std::ref(key) };
             auto cpu = this->get_cpu(rk);
-            return _db.invoke_on(cpu, &database::smembers_direct, std::move(rk)).then([&state] (auto&& members) {
-                auto& result = state.result;
-                for (auto& item : *members) {
-                    if (std::find_if(result.begin(), result.end(), [&item] (auto& o) { return o == item; }) == result.end()) {
-                        result.emplace_back(std::move(item));
-                    }
-                }
+            return this->invoke_on(cpu, &database::smembers_direct, std::move(rk)).then([&state, index = k] (auto&& members) {
+                state.items_set[index] = std::move(*members);
             });
-        }).then([this, &state, &out] {
+        }).then([this, &state, &out, count] {
             auto& result = state.result;
+            if (integer_operands(state.items_set, count)) {
+                std::vector<int64_t> values;
+                for (uint32_t i = 0; i < count; ++i) {
+                    std::vector<int64_t> temp;
+                    intset_union(values, state.items_set[i]._values, temp);
+                    values = std::move(temp);
+                }
+                state.items_set[0]._values = std::move(values);
+                state.items_set[0].to_keys();
+                result = std::move(state.items_set[0]._keys);
+            }
+            else {
+                std::unordered_set<sstring> seen;
+                for (uint32_t i = 0; i < count; ++i) {
+                    for (auto& item : state.items_set[i]._keys) {
+                        if (seen.insert(item).second) {
+                            result.emplace_back(std::move(item));
+                        }
+                    }
+                }
+            }
             if (state.dest) {
-                return this->sadds_impl_return_keys(*state.dest, result, out);
+                selected_db() = state.db;
+                return this->sstore_impl(*state.dest, result, out);
             }
             return reply_builder::build_local(out, result);
         });
@@ -993,14 +1420,14 @@ future<bool> redis_service::srem_direct(sstring& key, sstring& member)
 {
     redis_key rk {std::ref(key) };
     auto cpu = get_cpu(rk);
-    return   _db.invoke_on(cpu, &database::srem_direct, rk, std::ref(member));
+    return   invoke_on(cpu, &database::srem_direct, rk, std::ref(member));
 }
 
 future<bool> redis_service::sadd_direct(sstring& key, sstring& member)
 {
     redis_key rk {std::ref(key) };
     auto cpu = get_cpu(rk);
-    return  _db.invoke_on(cpu, &database::sadd_direct, rk, std::ref(member));
+    return  invoke_on(cpu, &database::sadd_direct, rk, std::ref(member));
 }
 
 future<> redis_service::smove(args_collection& args, output_stream<char>& out)
@@ -1011,14 +1438,23 @@ future<> redis_service::smove(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     sstring& dest = args._command_args[1];
     sstring& member = args._command_args[2];
+    if (get_cpu(key) == get_cpu(dest)) {
+        redis_key src_rk {std::ref(key)};
+        redis_key dst_rk {std::ref(dest)};
+        auto cpu = get_cpu(src_rk);
+        return invoke_on(cpu, &database::smove, std::move(src_rk), std::move(dst_rk), std::ref(member)).then([&out] (auto&& m) {
+            return m.write(out);
+        });
+    }
     struct smove_state {
         sstring& src;
         sstring& dst;
         sstring& member;
     };
     return do_with(smove_state{std::ref(key), std::ref(dest), std::ref(member)}, [this, &out] (auto& state) {
-        return this->srem_direct(state.src, state.member).then([this, &state, &out] (auto u) {
+        return this->srem_direct(state.src, state.member).then([this, &state, db = selected_db(), &out] (auto u) {
             if (u) {
+                selected_db() = db;
                 return this->sadd_direct(state.dst, state.member).then([&out] (auto m) {
                     return out.write(m ? msg_one : msg_zero);
                 });
@@ -1044,8 +1480,8 @@ future<> redis_service::srandmember(args_collection& args, output_stream<char>&
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::srandmember, rk, count).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::srandmember, rk, count).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1065,8 +1501,8 @@ future<> redis_service::spop(args_collection& args, output_stream<char>& out)
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::spop, rk, count).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::spop, rk, count).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 future<> redis_service::type(args_collection& args, output_stream<char>& out)
@@ -1077,29 +1513,126 @@ future<> redis_service::type(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::type, std::move(rk)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::type, std::move(rk)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
-future<> redis_service::expire(args_collection& args, output_stream<char>& out)
+struct scan_options {
+    size_t cursor = 0;
+    sstring pattern;
+    size_t count = 10;
+    sstring type;
+};
+
+// Parses the cursor at @first and the options after it, MATCH, COUNT and, if
+// @with_type is set, TYPE. Returns false on a syntax error.
+static bool parse_scan_options(args_collection& args, size_t first, bool with_type, scan_options& options)
 {
-    if (args._command_args_count <= 1 || args._command_args.empty()) {
-        return out.write(msg_syntax_err);
-    }
-    sstring& key = args._command_args[0];
-    long expir = 0;
     try {
-        expir = std::atol(args._command_args[1].c_str());
-        expir *= 1000;
+        options.cursor = std::stoull(args._command_args[first].c_str());
+        for (size_t i = first + 1; i < args._command_args_count; ++i) {
+            sstring& cc = args._command_args[i];
+            std::transform(cc.begin(), cc.end(), cc.begin(), ::toupper);
+            if (i + 1 == args._command_args_count) {
+                return false;
+            }
+            sstring& value = args._command_args[++i];
+            if (cc == "MATCH") {
+                // every key matches "*", it is not tried.
+                options.pattern = value == "*" ? sstring() : std::move(value);
+            }
+            else if (cc == "COUNT") {
+                auto count = std::stol(value.c_str());
+                if (count < 1) {
+                    return false;
+                }
+                options.count = count;
+            }
+            else if (cc == "TYPE" && with_type) {
+                std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+                options.type = sstring("+") + value + sstring("\r\n");
+            }
+            else {
+                return false;
+            }
+        }
     } catch (const std::invalid_argument&) {
-        return out.write(msg_syntax_err);
+        return false;
+    } catch (const std::out_of_range&) {
+        return false;
     }
-    redis_key rk{std::ref(key)};
-    auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::expire, std::move(rk), expir).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
-    });
+    return true;
+}
+
+future<> redis_service::scan(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count < 1 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    scan_options options;
+    if (parse_scan_options(args, 0, true, options) == false) {
+        return out.write(msg_syntax_err);
+    }
+    return do_with(std::move(options), [this, &out] (auto& options) {
+        auto cpu = options.cursor % smp::count;
+        return this->invoke_on(cpu, &database::scan, options.cursor / smp::count, std::cref(options.pattern), options.count, std::cref(options.type)).then([&out] (auto&& m) {
+            return m.write(out);
+        });
+    });
+}
+
+future<> redis_service::scan_impl(args_collection& args, collection_scan scan, output_stream<char>& out)
+{
+    if (args._command_args_count < 2 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    scan_options options;
+    if (parse_scan_options(args, 1, false, options) == false) {
+        return out.write(msg_syntax_err);
+    }
+    return do_with(std::move(options), [this, &args, scan, &out] (auto& options) {
+        redis_key rk{std::ref(args._command_args[0])};
+        auto cpu = this->get_cpu(rk);
+        return this->invoke_on(cpu, scan, std::move(rk), options.cursor, std::cref(options.pattern), options.count).then([&out] (auto&& m) {
+            return m.write(out);
+        });
+    });
+}
+
+future<> redis_service::hscan(args_collection& args, output_stream<char>& out)
+{
+    return scan_impl(args, &database::hscan, out);
+}
+
+future<> redis_service::sscan(args_collection& args, output_stream<char>& out)
+{
+    return scan_impl(args, &database::sscan, out);
+}
+
+future<> redis_service::zscan(args_collection& args, output_stream<char>& out)
+{
+    return scan_impl(args, &database::zscan, out);
+}
+
+future<> redis_service::expire(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count <= 1 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    sstring& key = args._command_args[0];
+    long expir = 0;
+    try {
+        expir = std::atol(args._command_args[1].c_str());
+        expir *= 1000;
+    } catch (const std::invalid_argument&) {
+        return out.write(msg_syntax_err);
+    }
+    redis_key rk{std::ref(key)};
+    auto cpu = get_cpu(rk);
+    return invoke_on(cpu, &database::expire, std::move(rk), expir).then([&out] (auto&& m) {
+        return m.write(out);
+    });
 }
 
 future<> redis_service::pexpire(args_collection& args, output_stream<char>& out)
@@ -1116,8 +1649,34 @@ future<> redis_service::pexpire(args_collection& args, output_stream<char>& out)
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::expire, std::move(rk), expir).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::expire, std::move(rk), expir).then([&out] (auto&& m) {
+        return m.write(out);
+    });
+}
+
+future<> redis_service::pexpireat(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count <= 1 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    sstring& key = args._command_args[0];
+    long at = 0;
+    try {
+        at = std::atol(args._command_args[1].c_str());
+    } catch (const std::invalid_argument&) {
+        return out.write(msg_syntax_err);
+    }
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    redis_key rk{std::ref(key)};
+    auto cpu = get_cpu(rk);
+    // a time in the past deletes the key at once.
+    if (at <= now) {
+        return invoke_on(cpu, &database::del, std::move(rk)).then([&out] (auto&& m) {
+            return m.write(out);
+        });
+    }
+    return invoke_on(cpu, &database::expire, std::move(rk), static_cast<long>(at - now)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1129,8 +1688,8 @@ future<> redis_service::pttl(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::pttl, std::move(rk)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::pttl, std::move(rk)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1142,8 +1701,8 @@ future<> redis_service::ttl(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::ttl, std::move(rk)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::ttl, std::move(rk)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1155,8 +1714,8 @@ future<> redis_service::persist(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::persist, std::move(rk)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::persist, std::move(rk)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1199,8 +1758,8 @@ future<> redis_service::zadd(args_collection& args, output_stream<char>& out)
         } catch (const std::invalid_argument&) {
             return out.write(msg_syntax_err);
         }
-        return _db.invoke_on(cpu, &database::zincrby, std::move(rk), std::ref(member), score).then([&out] (auto&& m) {
-            return out.write(std::move(*m));
+        return invoke_on(cpu, &database::zincrby, std::move(rk), std::ref(member), score).then([&out] (auto&& m) {
+            return m.write(out);
         });
     }
     else {
@@ -1221,8 +1780,8 @@ future<> redis_service::zadd(args_collection& args, output_stream<char>& out)
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::zadds, std::move(rk), std::ref(args._tmp_key_scores), zadd_flags).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::zadds, std::move(rk), std::ref(args._tmp_key_scores), zadd_flags).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1234,8 +1793,8 @@ future<> redis_service::zcard(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::zcard, std::move(rk)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::zcard, std::move(rk)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1262,8 +1821,8 @@ future<> redis_service::zrange(args_collection& args, bool reverse, output_strea
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::zrange, std::move(rk), begin, end, reverse, with_score).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::zrange, std::move(rk), begin, end, reverse, with_score).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1282,6 +1841,10 @@ future<> redis_service::zrangebyscore(args_collection& args, bool reverse, outpu
     } catch (const std::invalid_argument&) {
         return out.write(msg_syntax_err);
     }
+    // ZREVRANGEBYSCORE takes the range as max, min.
+    if (reverse) {
+        std::swap(min, max);
+    }
     bool with_score = false;
     if (args._command_args_count == 4) {
         auto ws = args._command_args[3];
@@ -1290,8 +1853,8 @@ future<> redis_service::zrangebyscore(args_collection& args, bool reverse, outpu
             with_score = true;
         }
     }
-    return _db.invoke_on(cpu, &database::zrangebyscore, std::move(rk), min, max, reverse, with_score).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::zrangebyscore, std::move(rk), min, max, reverse, with_score).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1310,8 +1873,8 @@ future<> redis_service::zcount(args_collection& args, output_stream<char>& out)
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::zcount, std::move(rk), min, max).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::zcount, std::move(rk), min, max).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1330,8 +1893,8 @@ future<> redis_service::zincrby(args_collection& args, output_stream<char>& out)
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::zincrby, std::move(rk), std::ref(member), delta).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::zincrby, std::move(rk), std::ref(member), delta).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1344,8 +1907,8 @@ future<> redis_service::zrank(args_collection& args, bool reverse, output_stream
     sstring& member = args._command_args[1];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::zrank, std::move(rk), std::ref(member), reverse).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::zrank, std::move(rk), std::ref(member), reverse).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1361,8 +1924,8 @@ future<> redis_service::zrem(args_collection& args, output_stream<char>& out)
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::zrem, std::move(rk), std::ref(args._tmp_keys)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::zrem, std::move(rk), std::ref(args._tmp_keys)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1375,8 +1938,8 @@ future<> redis_service::zscore(args_collection& args, output_stream<char>& out)
     sstring& member = args._command_args[1];
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::zscore, std::move(rk), std::ref(member)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::zscore, std::move(rk), std::ref(member)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1457,42 +2020,7 @@ future<> redis_service::zunionstore(args_collection& args, output_stream<char>&
     if (parse_zset_args(args, uargs) == false) {
         return out.write(msg_syntax_err);
     }
-    struct zunion_store_state {
-        std::vector<std::pair<sstring, double>> wkeys;
-        sstring dest;
-        std::unordered_map<sstring, double> result;
-        int aggregate_flag;
-    };
-    std::vector<std::pair<sstring, double>> wkeys;
-    for (size_t i = 0; i < uargs.numkeys; ++i) {
-        wkeys.emplace_back(std::pair<sstring, double>(std::move(uargs.keys[i]), uargs.weights[i]));
-    }
-    return do_with(zunion_store_state{std::move(wkeys), std::move(uargs.dest), {}, uargs.aggregate_flag}, [this, &out] (auto& state) {
-        return parallel_for_each(std::begin(state.wkeys), std::end(state.wkeys), [this, &state] (auto& entry) {
-            redis_key rk{std::ref(entry.first)};
-            auto cpu = rk.get_cpu();
-            return _db.invoke_on(cpu, &database::zrange_direct, std::move(rk), 0, -1).then([this, weight = entry.second, &state] (auto&& m) {
-                auto& range_result = *m;
-                auto& result = state.result;
-                for (size_t i = 0; i < range_result.size(); ++i) {
-                    auto& key = range_result[i].first;
-                    auto& score = range_result[i].second;
-                    if (result.find(key) != result.end()) {
-                       result[key] = redis_service::score_aggregation(result[key], score * weight, state.aggregate_flag);
-                    }
-                    else {
-                        result[key] = score;
-                    }
-                }
-            });
-        }).then([this, &state, &out] () {
-            redis_key rk{std::ref(state.dest)};
-            auto cpu = rk.get_cpu();
-            return _db.invoke_on(cpu, &database::zadds, std::move(rk), std::ref(state.result), ZADD_CH).then([&out] (auto&& m) {
-                return out.write(std::move(*m));
-            });
-        });
-    });
+    return zstore_impl(uargs, false, out);
 }
 
 future<> redis_service::zinterstore(args_collection& args, output_stream<char>& out)
@@ -1501,58 +2029,129 @@ future<> redis_service::zinterstore(args_collection& args, output_stream<char>&
     if (parse_zset_args(args, uargs) == false) {
         return out.write(msg_syntax_err);
     }
-    struct zinter_store_state {
-        std::vector<std::pair<sstring, double>> wkeys;
+    return zstore_impl(uargs, true, out);
+}
+
+// The number of members aggregated on the coordinating shard at once.
+static constexpr size_t zaggregate_range_members = 65536;
+
+// ZUNIONSTORE and ZINTERSTORE merge the members of the sources in their order,
+// a range of members at a time, so that the coordinating shard holds one range
+// at a time and every source is read once. For every range, each shard
+// aggregates the weighted scores of its own source sets, and the range ends at
+// the smallest last member read from a set with more members. The coordinator
+// merges these partial results and adds the range to a sorted set built aside
+// on the shard of the destination, which replaces the destination at the end:
+// the destination is never seen half written, and it may be a source too.
+future<> redis_service::zstore_impl(zset_args& uargs, bool intersect, output_stream<char>& out)
+{
+    struct zstore_state {
         sstring dest;
-        std::unordered_map<sstring, double> result;
+        size_t numkeys;
         int aggregate_flag;
+        bool intersect;
+        // The sources with their weights, by owner shard.
+        std::vector<std::vector<std::pair<sstring, double>>> sources;
+        std::vector<sstring> keys;
+        bool empty_source = false;
+        // The range follows @after, unless it's the first one.
+        bool from_start = true;
+        sstring after;
+        bool truncated = false;
+        sstring last;
+        bool done = false;
+        std::unordered_map<sstring, std::pair<double, size_t>> merged;
+        std::unordered_map<sstring, double> result;
+        // The id of the sorted set built aside, 0 until the first range added.
+        uint64_t staged = 0;
+        unsigned db = selected_db();
     };
-    std::vector<std::pair<sstring, double>> wkeys;
+    zstore_state s {std::move(uargs.dest), uargs.numkeys, uargs.aggregate_flag, intersect};
+    s.sources.resize(smp::count);
     for (size_t i = 0; i < uargs.numkeys; ++i) {
-        wkeys.emplace_back(std::pair<sstring, double>(std::move(uargs.keys[i]), uargs.weights[i]));
-    }
-    return do_with(zinter_store_state{std::move(wkeys), std::move(uargs.dest), {}, uargs.aggregate_flag}, [this, &out] (auto& state) {
-        redis_key rk{std::ref(state.wkeys[0].first)};
-        return _db.invoke_on(rk.get_cpu(), &database::zrange_direct, std::move(rk), 0, -1).then([this, &state, weight = state.wkeys[0].second] (auto&& m) {
-            auto& range_result = *m;
-            auto& result = state.result;
-            for (size_t i = 0; i < range_result.size(); ++i) {
-                result[range_result[i].first] = range_result[i].second * weight;
-            }
-            return make_ready_future<bool>(!result.empty() && state.wkeys.size() > 1);
-        }).then([this, &state, &out] (bool continue_next) {
-            if (!continue_next) {
-                return make_ready_future<>();
-            }
-            else {
-                return parallel_for_each(boost::irange<size_t>(1, state.wkeys.size()), [this, &state, &out] (size_t k) {
-                    auto& entry = state.wkeys[k];
-                    redis_key rk{std::ref(entry.first)};
-                    auto cpu = rk.get_cpu();
-                    return _db.invoke_on(cpu, &database::zrange_direct, std::move(rk), 0, -1).then([this, &state, weight = entry.second] (auto&& m) {
-                        auto& range_result = *m;
-                        auto& result = state.result;
-                        std::unordered_map<sstring, double> new_result;
-                        for (size_t i = 0; i < range_result.size(); ++i) {
-                            auto& key = range_result[i].first;
-                            auto& score = range_result[i].second;
-                            auto it = result.find(key);
-                            if (it != result.end()) {
-                                auto& old_score = it->second;
-                                new_result[key] = redis_service::score_aggregation(old_score, score * weight, state.aggregate_flag);
+        redis_key rk {std::ref(uargs.keys[i])};
+        s.sources[rk.get_cpu()].emplace_back(uargs.keys[i], uargs.weights[i]);
+        s.keys.emplace_back(std::move(uargs.keys[i]));
+    }
+    return do_with(std::move(s), [this, &out] (auto& state) {
+        redis_key dest_rk {std::ref(state.dest)};
+        auto dest_cpu = dest_rk.get_cpu();
+        if (state.sources[dest_cpu].size() == state.numkeys) {
+            // the sources and the destination are owned by one shard.
+            return this->invoke_on(dest_cpu, &database::zstore, std::move(dest_rk), std::cref(state.sources[dest_cpu]), state.aggregate_flag, state.intersect).then([&out] (auto&& m) {
+                return m.write(out);
+            });
+        }
+        return parallel_for_each(std::begin(state.keys), std::end(state.keys), [this, &state] (auto& key) {
+            redis_key rk {std::ref(key)};
+            auto cpu = rk.get_cpu();
+            return this->invoke_on(cpu, &database::zcard_direct, std::move(rk)).then([&state] (size_t size) {
+                state.empty_source |= size == 0;
+            });
+        }).then([this, &state, dest_cpu] {
+            state.done = state.intersect && state.empty_source;
+            auto limit = std::max<size_t>(1, zaggregate_range_members / state.numkeys);
+            return do_until([&state] { return state.done; }, [this, &state, dest_cpu, limit] {
+                selected_db() = state.db;
+                return parallel_for_each(boost::irange<unsigned>(0, smp::count), [this, &state, limit] (unsigned cpu) {
+                    if (state.sources[cpu].empty()) {
+                        return make_ready_future<>();
+                    }
+                    return this->invoke_on(cpu, &database::zaggregate_direct, std::cref(state.sources[cpu]), state.aggregate_flag, state.from_start, std::cref(state.after), limit).then([&state] (auto&& partial) {
+                        for (auto& m : partial->_members) {
+                            auto r = state.merged.emplace(std::move(m._member), std::make_pair(m._score, m._sources));
+                            if (!r.second) {
+                                auto& entry = r.first->second;
+                                entry.first = score_aggregation(entry.first, m._score, state.aggregate_flag);
+                                entry.second += m._sources;
                             }
                         }
-                        state.result = std::move(new_result);
+                        if (partial->_truncated && (!state.truncated || sset_lsa::member_less(partial->_last, state.last))) {
+                            state.last = std::move(partial->_last);
+                            state.truncated = true;
+                        }
+                    });
+                }).then([this, &state, dest_cpu] {
+                    for (auto& m : state.merged) {
+                        // the members after the range are read again with the next one.
+                        if (state.truncated && sset_lsa::member_less(state.last, m.first)) {
+                            continue;
+                        }
+                        if (!state.intersect || m.second.second == state.numkeys) {
+                            state.result.emplace(m.first, m.second.first);
+                        }
+                    }
+                    state.merged.clear();
+                    state.done = !state.truncated;
+                    state.from_start = false;
+                    state.after = std::move(state.last);
+                    state.truncated = false;
+                    if (state.result.empty()) {
+                        return make_ready_future<>();
+                    }
+                    selected_db() = state.db;
+                    redis_key rk {std::ref(state.dest)};
+                    return this->invoke_on(dest_cpu, &database::zstage_direct, std::move(rk), state.staged, std::ref(state.result)).then([&state] (uint64_t id) {
+                        state.staged = id;
+                        state.result.clear();
                     });
-                }).then([this] () {
-                    return make_ready_future<>();
+                });
+            });
+        }).then_wrapped([this, &state, &out, dest_cpu] (auto&& f) {
+            selected_db() = state.db;
+            if (f.failed()) {
+                auto ep = f.get_exception();
+                if (state.staged == 0) {
+                    return make_exception_future<>(ep);
+                }
+                return this->invoke_on(dest_cpu, &database::zdiscard_direct, state.staged).then_wrapped([ep] (auto&& f) {
+                    f.ignore_ready_future();
+                    return make_exception_future<>(ep);
                 });
             }
-        }).then([this, &state, &out] {
-            redis_key rk{std::ref(state.dest)};
-            auto cpu = rk.get_cpu();
-            return _db.invoke_on(cpu, &database::zadds, std::move(rk), std::ref(state.result), ZADD_CH).then([&out] (auto&& m) {
-                return out.write(std::move(*m));
+            redis_key rk {std::ref(state.dest)};
+            return this->invoke_on(dest_cpu, &database::zcommit_direct, std::move(rk), state.staged).then([&out] (size_t size) {
+                return reply_builder::build_local(out, size);
             });
         });
     });
@@ -1576,8 +2175,8 @@ future<> redis_service::zremrangebyscore(args_collection& args, output_stream<ch
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::zremrangebyscore, std::move(rk), min, max).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::zremrangebyscore, std::move(rk), min, max).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1599,8 +2198,8 @@ future<> redis_service::zremrangebyrank(args_collection& args, output_stream<cha
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::zremrangebyrank, std::move(rk), begin, end).then([&out] (auto&& m) {
-       return out.write(std::move(*m));
+    return invoke_on(cpu, &database::zremrangebyrank, std::move(rk), begin, end).then([&out] (auto&& m) {
+       return m.write(out);
     });
 }
 
@@ -1634,33 +2233,94 @@ future<> redis_service::zlexcount(args_collection& args, output_stream<char>& ou
     return out.write(msg_syntax_err);
 }
 
-future<> redis_service::select(args_collection& args, output_stream<char>& out)
+// Parses the index of a database, out of range if there is no such one.
+static bool parse_db_index(const sstring& s, size_t databases, size_t& index, sstring& err)
+{
+    long value = 0;
+    try {
+        value = std::stol(s.c_str());
+    } catch (const std::exception&) {
+        err = msg_invalid_db_index_err;
+        return false;
+    }
+    if (value < 0 || static_cast<size_t>(value) >= databases) {
+        err = msg_db_index_err;
+        return false;
+    }
+    index = static_cast<size_t>(value);
+    return true;
+}
+
+future<> redis_service::select(args_collection& args, unsigned& db, output_stream<char>& out)
 {
     if (args._command_args_count < 1 || args._command_args.empty()) {
         return out.write(msg_syntax_err);
     }
     size_t index = 0;
-    try {
-        index = std::stol(args._command_args[0].c_str());
-    } catch (const std::invalid_argument&) {
-        return out.write(msg_err);
+    sstring err;
+    if (!parse_db_index(args._command_args[0], _db.local().databases(), index, err)) {
+        return out.write(err);
     }
-    if (index >= smp::count) {
-        return out.write(msg_err);
+    if (index != 0 && local_cluster().enabled()) {
+        return out.write(msg_select_cluster_err);
     }
-    return do_with(size_t {0}, [this, index, &out] (auto& count) {
-        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [this, index, &count] (unsigned cpu) {
-            return _db.invoke_on(cpu, &database::select, index).then([&count] (auto&& u) {
-                if (u) {
-                    count++;
+    _db.local().select(index);
+    db = index;
+    return out.write(msg_ok);
+}
+
+// The command runs on every shard, which all answer false while a snapshot,
+// a rewrite or a full sync runs, the shards which answered true ran it.
+template <typename Func>
+static future<> on_every_shard(distributed<database>& peers, Func func, output_stream<char>& out)
+{
+    return do_with(size_t {0}, [&peers, func = std::move(func), &out] (auto& done) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&peers, func, &done] (unsigned cpu) {
+            // the copies of the keys changed are dropped before the answer.
+            return peers.invoke_on(cpu, [func] (database& d) {
+                return d.replicated(make_ready_future<bool>(func(d)));
+            }).then([&done] (bool ok) {
+                if (ok) {
+                    ++done;
                 }
             });
-        }).then([&count, &out] () {
-            return out.write((count == smp::count) ? msg_ok : msg_err);
+        }).then([&done, &out] {
+            return out.write(done == smp::count ? msg_ok : msg_snapshot_in_progress_err);
         });
     });
 }
 
+future<> redis_service::flushdb(args_collection& args, output_stream<char>& out)
+{
+    auto db = selected_db();
+    return on_every_shard(_db, [db] (database& d) {
+        return d.with_store(db, [&d] { return d.flushdb(); });
+    }, out);
+}
+
+future<> redis_service::flushall(args_collection& args, output_stream<char>& out)
+{
+    return on_every_shard(_db, [] (database& d) {
+        return d.flushall();
+    }, out);
+}
+
+future<> redis_service::swapdb(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count != 2 || args._command_args.size() < 2) {
+        return out.write(msg_syntax_err);
+    }
+    size_t index1 = 0, index2 = 0;
+    sstring err;
+    auto databases = local_cluster().enabled() ? 1 : _db.local().databases();
+    if (!parse_db_index(args._command_args[0], databases, index1, err) || !parse_db_index(args._command_args[1], databases, index2, err)) {
+        return out.write(err);
+    }
+    return on_every_shard(_db, [index1, index2] (database& d) {
+        return d.swapdb(index1, index2);
+    }, out);
+}
+
 
 future<> redis_service::geoadd(args_collection& args, output_stream<char>& out)
 {
@@ -1686,8 +2346,8 @@ future<> redis_service::geoadd(args_collection& args, output_stream<char>& out)
     }
     redis_key rk{std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::zadds, std::move(rk), std::ref(args._tmp_key_scores), ZADD_CH).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::zadds, std::move(rk), std::ref(args._tmp_key_scores), ZADD_CH).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1699,17 +2359,17 @@ future<> redis_service::geodist(args_collection& args, output_stream<char>& out)
     sstring& key = args._command_args[0];
     sstring& lpos = args._command_args[1];
     sstring& rpos = args._command_args[2];
-    int geodist_flag = GEODIST_UNIT_M;
+    int geodist_flag = GEO_UNIT_M;
     if (args._command_args_count == 4) {
         sstring& unit = args._command_args[3];
         if (unit == "km") {
-            geodist_flag = GEODIST_UNIT_KM;
+            geodist_flag = GEO_UNIT_KM;
         }
         else if (unit == "mi") {
-            geodist_flag = GEODIST_UNIT_MI;
+            geodist_flag = GEO_UNIT_MI;
         }
         else if (unit == "ft") {
-            geodist_flag = GEODIST_UNIT_FT;
+            geodist_flag = GEO_UNIT_FT;
         }
         else {
             return out.write(msg_syntax_err);
@@ -1717,8 +2377,8 @@ future<> redis_service::geodist(args_collection& args, output_stream<char>& out)
     }
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::geodist, std::move(rk), std::ref(lpos), std::ref(rpos), geodist_flag).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::geodist, std::move(rk), std::ref(lpos), std::ref(rpos), geodist_flag).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1733,8 +2393,8 @@ future<> redis_service::geohash(args_collection& args, output_stream<char>& out)
     }
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::geohash, std::move(rk), std::ref(args._tmp_keys)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::geohash, std::move(rk), std::ref(args._tmp_keys)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1750,11 +2410,33 @@ future<> redis_service::geopos(args_collection& args, output_stream<char>& out)
     }
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::geopos, std::move(rk), std::ref(members)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::geopos, std::move(rk), std::ref(members)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
+// Adds the flag of @unit to @flags, returns false if it is not a unit.
+static bool parse_geo_unit(sstring& unit, int& flags)
+{
+    std::transform(unit.begin(), unit.end(), unit.begin(), ::tolower);
+    if (unit == "m") {
+        flags |= GEO_UNIT_M;
+    }
+    else if (unit == "km") {
+        flags |= GEO_UNIT_KM;
+    }
+    else if (unit == "mi") {
+        flags |= GEO_UNIT_MI;
+    }
+    else if (unit == "ft") {
+        flags |= GEO_UNIT_FT;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
 future<> redis_service::georadius(args_collection& args, bool member, output_stream<char>& out)
 {
     size_t option_index = member ? 4 : 5;
@@ -1815,6 +2497,9 @@ future<> redis_service::georadius(args_collection& args, bool member, output_str
                     return out.write(msg_syntax_err);
                 }
             }
+            else if (cc == "ANY") {
+                flags |= GEORADIUS_ANY;
+            }
             else if (cc == "ASC") {
                 flags |= GEORADIUS_ASC;
             }
@@ -1845,29 +2530,23 @@ future<> redis_service::georadius(args_collection& args, bool member, output_str
     if (((flags & GEORADIUS_STORE_SCORE) || (flags & GEORADIUS_STORE_DIST)) && (stored_key_index == 0 || stored_key_index >= args._command_args_count)) {
         return out.write(msg_syntax_err);
     }
-    std::transform(unit.begin(), unit.end(), unit.begin(), ::tolower);
-    if (unit == "m") {
-        flags |= GEO_UNIT_M;
-    }
-    else if (unit == "km") {
-        flags |= GEO_UNIT_KM;
-    }
-    else if (unit == "mi") {
-        flags |= GEO_UNIT_MI;
-    }
-    else if (unit == "ft") {
-        flags |= GEO_UNIT_FT;
+    if ((flags & GEORADIUS_ANY) && count == 0) {
+        return out.write(msg_syntax_err);
     }
-    else {
+    if (parse_geo_unit(unit, flags) == false) {
         return out.write(msg_syntax_err);
     }
     geo::to_meters(radius, flags);
+    geo::shape shape;
+    shape.longitude = log;
+    shape.latitude = lat;
+    shape.radius = radius;
 
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    auto points_ready = !member ? _db.invoke_on(cpu, &database::georadius_coord_direct, std::move(rk), log, lat, radius, count, flags)
-                                : _db.invoke_on(cpu, &database::georadius_member_direct, std::move(rk), std::ref(member_key), radius, count, flags);
-    return  points_ready.then([this, flags, &args, stored_key_index, &out] (auto&& data) {
+    auto points_ready = !member ? invoke_on(cpu, &database::georadius_coord_direct, std::move(rk), shape, count, flags)
+                                : invoke_on(cpu, &database::georadius_member_direct, std::move(rk), std::ref(member_key), shape, count, flags);
+    return  points_ready.then([this, flags, &args, stored_key_index, db = selected_db(), &out] (auto&& data) {
         using data_type = std::vector<std::tuple<sstring, double, double, double, double>>;
         using return_type = std::pair<std::vector<std::tuple<sstring, double, double, double, double>>, int>;
         return_type& return_data = *data;
@@ -1894,10 +2573,11 @@ future<> redis_service::georadius(args_collection& args, bool member, output_str
                 data_type& data;
             };
             sstring& stored_key = args._command_args[stored_key_index];
-            return do_with(store_state{std::move(members), std::ref(stored_key), std::ref(data_)}, [this, &out, flags, &data_] (auto& state) {
+            return do_with(store_state{std::move(members), std::ref(stored_key), std::ref(data_)}, [this, &out, flags, &data_, db] (auto& state) {
+                selected_db() = db;
                 redis_key rk{std::ref(state.stored_key)};
                 auto cpu = rk.get_cpu();
-                return _db.invoke_on(cpu, &database::zadds_direct, std::move(rk), std::ref(state.members), ZADD_CH).then([&out, flags, &data_] (auto&& m) {
+                return this->invoke_on(cpu, &database::zadds_direct, std::move(rk), std::ref(state.members), ZADD_CH).then([&out, flags, &data_] (auto&& m) {
                    if (m)
                      return reply_builder::build_local(out, data_, flags);
                    else
@@ -1909,6 +2589,99 @@ future<> redis_service::georadius(args_collection& args, bool member, output_str
     });
 }
 
+future<> redis_service::geosearch(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count < 5 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    sstring& key = args._command_args[0];
+    sstring member_key {};
+    geo::shape shape;
+    bool from_member = false, from_lonlat = false, by_radius = false, by_box = false;
+    int flags = 0;
+    size_t count = 0;
+    try {
+        for (size_t i = 1; i < args._command_args_count; ++i) {
+            sstring& cc = args._command_args[i];
+            std::transform(cc.begin(), cc.end(), cc.begin(), ::toupper);
+            size_t left = args._command_args_count - i - 1;
+            if (cc == "FROMMEMBER" && left >= 1) {
+                member_key = std::move(args._command_args[++i]);
+                from_member = true;
+            }
+            else if (cc == "FROMLONLAT" && left >= 2) {
+                shape.longitude = std::stod(args._command_args[++i].c_str());
+                shape.latitude = std::stod(args._command_args[++i].c_str());
+                from_lonlat = true;
+            }
+            else if (cc == "BYRADIUS" && left >= 2) {
+                shape.radius = std::stod(args._command_args[++i].c_str());
+                if (parse_geo_unit(args._command_args[++i], flags) == false) {
+                    return out.write(msg_syntax_err);
+                }
+                by_radius = true;
+            }
+            else if (cc == "BYBOX" && left >= 3) {
+                shape.width = std::stod(args._command_args[++i].c_str());
+                shape.height = std::stod(args._command_args[++i].c_str());
+                if (parse_geo_unit(args._command_args[++i], flags) == false) {
+                    return out.write(msg_syntax_err);
+                }
+                shape.box = true;
+                by_box = true;
+            }
+            else if (cc == "COUNT" && left >= 1) {
+                flags |= GEORADIUS_COUNT;
+                count = std::stol(args._command_args[++i].c_str());
+            }
+            else if (cc == "ANY") {
+                flags |= GEORADIUS_ANY;
+            }
+            else if (cc == "ASC") {
+                flags |= GEORADIUS_ASC;
+            }
+            else if (cc == "DESC") {
+                flags |= GEORADIUS_DESC;
+            }
+            else if (cc == "WITHCOORD") {
+                flags |= GEORADIUS_WITHCOORD;
+            }
+            else if (cc == "WITHDIST") {
+                flags |= GEORADIUS_WITHDIST;
+            }
+            else if (cc == "WITHHASH") {
+                flags |= GEORADIUS_WITHHASH;
+            }
+            else {
+                return out.write(msg_syntax_err);
+            }
+        }
+    } catch (const std::invalid_argument&) {
+        return out.write(msg_syntax_err);
+    }
+    if (from_member == from_lonlat || by_radius == by_box || ((flags & GEORADIUS_ANY) && count == 0)) {
+        return out.write(msg_syntax_err);
+    }
+    geo::to_meters(shape.radius, flags);
+    geo::to_meters(shape.width, flags);
+    geo::to_meters(shape.height, flags);
+
+    redis_key rk {std::ref(key)};
+    auto cpu = get_cpu(rk);
+    auto points_ready = from_lonlat ? invoke_on(cpu, &database::georadius_coord_direct, std::move(rk), shape, count, flags)
+                                    : invoke_on(cpu, &database::georadius_member_direct, std::move(rk), std::ref(member_key), shape, count, flags);
+    return points_ready.then([flags, &out] (auto&& data) {
+        auto& return_data = *data;
+        if (return_data.second == REDIS_WRONG_TYPE) {
+            return out.write(msg_type_err);
+        }
+        else if (return_data.second == REDIS_ERR) {
+            return out.write(msg_nil);
+        }
+        return reply_builder::build_local(out, return_data.first, flags);
+    });
+}
+
 future<> redis_service::setbit(args_collection& args, output_stream<char>& out)
 {
     if (args._command_args_count < 3 || args._command_args.empty()) {
@@ -1925,8 +2698,8 @@ future<> redis_service::setbit(args_collection& args, output_stream<char>& out)
     }
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::setbit, std::move(rk), offset, value == 1).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::setbit, std::move(rk), offset, value == 1).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -1944,60 +2717,155 @@ future<> redis_service::getbit(args_collection& args, output_stream<char>& out)
     }
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::getbit, std::move(rk), offset).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::getbit, std::move(rk), offset).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
 future<> redis_service::bitcount(args_collection& args, output_stream<char>& out)
 {
-    if (args._command_args_count < 3 || args._command_args.empty()) {
+    if ((args._command_args_count != 1 && args._command_args_count != 3) || args._command_args.empty()) {
         return out.write(msg_syntax_err);
     }
     sstring& key = args._command_args[0];
-    long start = 0, end = 0;
-    try {
-        start = std::stol(args._command_args[1]);
-        end = std::stol(args._command_args[2]);
-    } catch (const std::invalid_argument&) {
-        return out.write(msg_syntax_err);
+    long start = 0, end = -1;
+    if (args._command_args_count == 3) {
+        try {
+            start = std::stol(args._command_args[1]);
+            end = std::stol(args._command_args[2]);
+        } catch (const std::invalid_argument&) {
+            return out.write(msg_syntax_err);
+        }
     }
     redis_key rk {std::ref(key)};
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::bitcount, std::move(rk), start, end).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::bitcount, std::move(rk), start, end).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
+// BITOP runs at once on the shard owning all of its keys. Otherwise every
+// shard combines its own sources, AND, OR and XOR being associative, and the
+// coordinator combines these partial results before storing the destination.
 future<> redis_service::bitop(args_collection& args, output_stream<char>& out)
 {
-    return out.write(msg_nil);
-}
-
-future<> redis_service::bitpos(args_collection& args, output_stream<char>& out)
-{
-    return out.write(msg_nil);
-}
-
-future<> redis_service::bitfield(args_collection& args, output_stream<char>& out)
-{
-    return out.write(msg_nil);
-}
-
-future<> redis_service::pfadd(args_collection& args, output_stream<char>& out)
-{
-    if (args._command_args_count < 2 || args._command_args.empty()) {
+    if (args._command_args_count < 3 || args._command_args.empty()) {
         return out.write(msg_syntax_err);
     }
-    sstring& key = args._command_args[0];
-    for (size_t i = 1; i < args._command_args_count; ++i) {
-        args._tmp_keys.emplace_back(args._command_args[i]);
+    sstring name = args._command_args[0];
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+    int op = 0;
+    if (name == "AND") {
+        op = BITOP_AND;
     }
-    redis_key rk {std::ref(key)};
-    auto& elements = args._tmp_keys;
+    else if (name == "OR") {
+        op = BITOP_OR;
+    }
+    else if (name == "XOR") {
+        op = BITOP_XOR;
+    }
+    else if (name == "NOT") {
+        op = BITOP_NOT;
+        if (args._command_args_count != 3) {
+            return out.write(msg_syntax_err);
+        }
+    }
+    else {
+        return out.write(msg_syntax_err);
+    }
+    sstring& dest = args._command_args[1];
+    for (size_t i = 2; i < args._command_args.size(); ++i) {
+        args._tmp_keys.emplace_back(std::move(args._command_args[i]));
+    }
+    auto& keys = args._tmp_keys;
+    unsigned owner = 0;
+    if (on_one_shard(keys.data(), keys.size(), owner) && get_cpu(dest) == owner) {
+        redis_key rk {std::ref(dest)};
+        return invoke_on(owner, &database::bitop, std::move(rk), op, std::ref(keys)).then([&out] (auto&& m) {
+            return m.write(out);
+        });
+    }
+    struct bitop_state {
+        sstring& dest;
+        int op;
+        std::vector<std::vector<sstring>> groups;
+        std::vector<sstring> partials;
+        bool type_error = false;
+        unsigned db = selected_db();
+    };
+    return do_with(bitop_state{std::ref(dest), op}, [this, &keys, &out] (auto& state) {
+        this->group_by_shard(keys.data(), keys.size(), state.groups);
+        return this->for_each_shard(state.groups, [this, &state] (unsigned cpu, std::vector<sstring>& keys) {
+            return this->invoke_on(cpu, &database::bitop_direct, std::ref(keys), state.op).then([&state] (auto&& partial) {
+                if (!partial) {
+                    state.type_error = true;
+                    return;
+                }
+                state.partials.emplace_back(std::move(*partial));
+            });
+        }).then([this, &state, &out] {
+            if (state.type_error) {
+                return out.write(msg_type_err);
+            }
+            return do_with(bits_operation::combine(state.op, state.partials), [this, &state, &out] (auto& result) {
+                selected_db() = state.db;
+                redis_key rk {std::ref(state.dest)};
+                auto cpu = rk.get_cpu();
+                return this->invoke_on(cpu, &database::bitstore_direct, std::move(rk), std::ref(result)).then([&out] (size_t size) {
+                    return reply_builder::build_local(out, size);
+                });
+            });
+        });
+    });
+}
+
+future<> redis_service::bitpos(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count < 2 || args._command_args_count > 4 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    sstring& key = args._command_args[0];
+    auto& bit = args._command_args[1];
+    if (bit != "0" && bit != "1") {
+        return out.write(msg_syntax_err);
+    }
+    long start = 0, end = -1;
+    try {
+        if (args._command_args_count > 2) {
+            start = std::stol(args._command_args[2]);
+        }
+        if (args._command_args_count > 3) {
+            end = std::stol(args._command_args[3]);
+        }
+    } catch (const std::invalid_argument&) {
+        return out.write(msg_syntax_err);
+    }
+    redis_key rk {std::ref(key)};
+    auto cpu = get_cpu(rk);
+    return invoke_on(cpu, &database::bitpos, std::move(rk), bit == "1", start, end, args._command_args_count > 3).then([&out] (auto&& m) {
+        return m.write(out);
+    });
+}
+
+future<> redis_service::bitfield(args_collection& args, output_stream<char>& out)
+{
+    return out.write(msg_nil);
+}
+
+future<> redis_service::pfadd(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count < 2 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    sstring& key = args._command_args[0];
+    for (size_t i = 1; i < args._command_args_count; ++i) {
+        args._tmp_keys.emplace_back(std::move(args._command_args[i]));
+    }
+    redis_key rk {std::ref(key)};
+    auto& elements = args._tmp_keys;
     auto cpu = get_cpu(rk);
-    return _db.invoke_on(cpu, &database::pfadd, rk, std::ref(elements)).then([&out] (auto&& m) {
-        return out.write(std::move(*m));
+    return invoke_on(cpu, &database::pfadd, rk, std::ref(elements)).then([&out] (auto&& m) {
+        return m.write(out);
     });
 }
 
@@ -2010,30 +2878,25 @@ future<> redis_service::pfcount(args_collection& args, output_stream<char>& out)
         sstring& key = args._command_args[0];
         redis_key rk {std::ref(key)};
         auto cpu = get_cpu(rk);
-        return _db.invoke_on(cpu, &database::pfcount, std::move(rk)).then([&out] (auto&& m) {
-            return out.write(std::move(*m));
+        return invoke_on(cpu, &database::pfcount, std::move(rk)).then([&out] (auto&& m) {
+            return m.write(out);
         });
     }
     else {
         struct merge_state {
-            std::vector<sstring>& keys;
-            uint8_t merged_sources[HLL_BYTES_SIZE];
+            std::vector<std::vector<sstring>> groups;
+            uint8_t merged[hll::RAW_SIZE];
         };
-        for (size_t i = 0; i < args._command_args_count; ++i) {
-            args._tmp_keys.emplace_back(args._command_args[i]);
-        }
-        return do_with(merge_state{std::ref(args._tmp_keys), { 0 }}, [this, &out] (auto& state) {
-            return parallel_for_each(std::begin(state.keys), std::end(state.keys), [this, &state] (auto& key) {
-                redis_key rk { std::ref(key) };
-                auto cpu = this->get_cpu(rk);
-                return _db.invoke_on(cpu, &database::get_hll_direct, std::move(rk)).then([&state] (auto&& u) {
+        return do_with(merge_state{{}, { 0 }}, [this, &args, &out] (auto& state) {
+            this->group_by_shard(args._command_args.data(), args._command_args_count, state.groups);
+            return this->for_each_shard(state.groups, [this, &state] (unsigned cpu, std::vector<sstring>& keys) {
+                return this->invoke_on(cpu, &database::mget_hll_direct, std::ref(keys)).then([&state] (auto&& u) {
                     if (u) {
-                        hll::merge(state.merged_sources, HLL_BYTES_SIZE, *u);
+                        hll::merge(state.merged, u->data(), u->size());
                     }
-                    return make_ready_future<>();
                 });
             }).then([this, &state, &out] {
-                auto card = hll::count(state.merged_sources, HLL_BYTES_SIZE);
+                auto card = hll::count(state.merged);
                 return reply_builder::build_local(out, card);
             });
         });
@@ -2047,28 +2910,1244 @@ future<> redis_service::pfmerge(args_collection& args, output_stream<char>& out)
     }
     struct merge_state {
         sstring dest;
-        std::vector<sstring>& keys;
-        uint8_t merged_sources[HLL_BYTES_SIZE];
+        std::vector<std::vector<sstring>> groups;
+        uint8_t merged[hll::RAW_SIZE];
+        unsigned db = selected_db();
     };
-    for (size_t i = 1; i < args._command_args_count; ++i) {
-        args._tmp_keys.emplace_back(args._command_args[i]);
-    }
-    return do_with(merge_state{std::move(args._command_args[0]), std::ref(args._tmp_keys), { 0 }}, [this, &out] (auto& state) {
-        return parallel_for_each(std::begin(state.keys), std::end(state.keys), [this, &state] (auto& key) {
-            redis_key rk { std::ref(key) };
-            auto cpu = this->get_cpu(rk);
-            return _db.invoke_on(cpu, &database::get_hll_direct, std::move(rk)).then([&state] (auto&& u) {
+    return do_with(merge_state{std::move(args._command_args[0]), {}, { 0 }}, [this, &args, &out] (auto& state) {
+        // every shard sends one partial of its sources, the destination shard reads the merged registers.
+        this->group_by_shard(args._command_args.data() + 1, args._command_args_count - 1, state.groups);
+        return this->for_each_shard(state.groups, [this, &state] (unsigned cpu, std::vector<sstring>& keys) {
+            return this->invoke_on(cpu, &database::mget_hll_direct, std::ref(keys)).then([&state] (auto&& u) {
                 if (u) {
-                    hll::merge(state.merged_sources, HLL_BYTES_SIZE, *u);
+                    hll::merge(state.merged, u->data(), u->size());
                 }
-                return make_ready_future<>();
             });
         }).then([this, &state, &out] {
+            selected_db() = state.db;
             redis_key rk { std::ref(state.dest) };
             auto cpu = this->get_cpu(rk);
-            return _db.invoke_on(cpu, &database::pfmerge, std::move(rk), state.merged_sources, HLL_BYTES_SIZE).then([&out] (auto&& m) {
-                return out.write(std::move(*m));
+            const uint8_t* merged = state.merged;
+            return this->invoke_on(cpu, &database::pfmerge, std::move(rk), merged).then([&out] (auto&& m) {
+                return m.write(out);
+            });
+        });
+    });
+}
+future<std::vector<reply>> redis_service::pipeline(unsigned cpu, std::vector<pipelined_request>& requests)
+{
+    auto execute = [&requests, index = selected_db()] (database& db) {
+        // every request runs through at once, only the replies of the changes
+        // may wait for the append only log, so the batch shares its fsync.
+        std::vector<future<reply>> pending;
+        pending.reserve(requests.size());
+        logalloc::shard_tracker().set_stall_context("pipeline");
+        db.with_store(index, [&requests, &db, &pending] {
+            for (auto& request : requests) {
+                db.maybe_evict();
+                try {
+                    pending.emplace_back(request(db));
+                } catch (...) {
+                    pending.emplace_back(make_exception_future<reply>(std::current_exception()));
+                }
+            }
+        });
+        logalloc::shard_tracker().set_stall_context(nullptr);
+        return db.replicated(when_all(pending.begin(), pending.end()).then([] (std::vector<future<reply>> results) {
+            std::vector<reply> replies;
+            replies.reserve(results.size());
+            for (auto& f : results) {
+                try {
+                    replies.emplace_back(f.get0());
+                } catch (std::bad_alloc& e) {
+                    replies.emplace_back(reply_builder::build(msg_err).get0());
+                }
+            }
+            return replies;
+        }));
+    };
+    auto& local = _db.local();
+    if (cpu == engine().cpu_id()) {
+        local.count_dispatch(true);
+        return execute(local);
+    }
+    local.count_dispatch(false);
+    return _db.invoke_on(cpu, std::move(execute));
+}
+
+void redis_service::configure_snapshot(const sstring& directory, const sstring& dbfilename)
+{
+    _snapshot_directory = directory;
+    _snapshot_dbfilename = dbfilename;
+}
+
+future<> redis_service::load_snapshot()
+{
+    // the entries owned by another shard are forwarded to it.
+    database::record_forwarder forward = [this] (unsigned shard, temporary_buffer<char> records) {
+        return _db.invoke_on(shard, &database::load_records, std::move(records));
+    };
+    return count_shard_files(_snapshot_directory, _snapshot_dbfilename).then([this, forward] (unsigned found) {
+        if (found > 0) {
+            if (found != smp::count) {
+                redis_log.info("loading the snapshot of {} shards into {} shards", found, smp::count);
+            }
+            return parallel_for_each(boost::irange<unsigned>(0, smp::count), [this, forward, found] (unsigned cpu) {
+                return do_with(cpu, [this, forward, found] (auto& file) {
+                    return do_until([&file, found] { return file >= found; }, [this, &file, forward] {
+                        auto path = shard_file_path(_snapshot_directory, _snapshot_dbfilename, file);
+                        auto cpu = file % smp::count;
+                        file += smp::count;
+                        return _db.invoke_on(cpu, &database::load, path, forward);
+                    });
+                });
+            });
+        }
+        auto path = _snapshot_directory + "/" + _snapshot_dbfilename;
+        return file_exists(path).then([this, path, forward] (bool exists) {
+            if (!exists) {
+                return make_ready_future<>();
+            }
+            return _db.invoke_on(0, &database::load, path, forward);
+        });
+    });
+}
+
+void redis_service::configure_append_only(bool enabled)
+{
+    _append_only = enabled;
+}
+
+future<bool> redis_service::save_all()
+{
+    _saving = true;
+    return parallel_for_each(boost::irange<unsigned>(0, smp::count), [this] (unsigned cpu) {
+        return _db.invoke_on(cpu, &database::save, _snapshot_directory, _snapshot_dbfilename);
+    }).then_wrapped([this] (auto&& f) {
+        _saving = false;
+        try {
+            f.get();
+            _last_save = std::time(nullptr);
+            return true;
+        } catch (...) {
+            redis_log.error("failed to save the snapshot: {}", std::current_exception());
+            return false;
+        }
+    });
+}
+
+future<> redis_service::save(args_collection& args, output_stream<char>& out)
+{
+    return smp::submit_to(0, [this] {
+        if (_saving) {
+            return make_ready_future<const sstring*>(&msg_save_in_progress_err);
+        }
+        return save_all().then([] (bool saved) {
+            return saved ? &msg_ok : &msg_err;
+        });
+    }).then([&out] (const sstring* m) {
+        return out.write(*m);
+    });
+}
+
+future<> redis_service::bgsave(args_collection& args, output_stream<char>& out)
+{
+    return smp::submit_to(0, [this] {
+        if (_saving) {
+            return false;
+        }
+        // the saving goes on in the background, save_all() never fails.
+        save_all();
+        return true;
+    }).then([&out] (bool started) {
+        return out.write(started ? msg_bgsave_started : msg_save_in_progress_err);
+    });
+}
+
+future<> redis_service::lastsave(args_collection& args, output_stream<char>& out)
+{
+    return smp::submit_to(0, [this] {
+        return _last_save;
+    }).then([&out] (time_t last_save) {
+        return reply_builder::build_local(out, static_cast<size_t>(last_save));
+    });
+}
+future<> redis_service::bgrewriteaof(args_collection& args, output_stream<char>& out)
+{
+    return smp::submit_to(0, [this] {
+        if (!_append_only) {
+            return &msg_aof_disabled_err;
+        }
+        if (_rewriting) {
+            return &msg_rewrite_in_progress_err;
+        }
+        _rewriting = true;
+        // the rewrite goes on in the background, the failures are logged.
+        (void)_db.invoke_on_all(&database::rewrite_log).then_wrapped([this] (auto&& f) {
+            _rewriting = false;
+            try {
+                f.get();
+            } catch (...) {
+                redis_log.error("failed to rewrite the append only logs: {}", std::current_exception());
+            }
+        });
+        return &msg_rewrite_started;
+    }).then([&out] (const sstring* m) {
+        return out.write(*m);
+    });
+}
+
+future<> redis_service::start_replication(sstring directory)
+{
+    return _replica_links.start(std::ref(*this), std::ref(_db), directory);
+}
+
+future<> redis_service::stop_replication()
+{
+    return _replica_links.stop();
+}
+
+future<> redis_service::follow(sstring host, uint16_t port)
+{
+    return _replica_links.invoke_on_all([host, port] (replica_link& link) {
+        return link.follow(host, port);
+    });
+}
+
+future<> redis_service::replicaof(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count != 2 || args._command_args.size() < 2) {
+        return out.write(msg_syntax_err);
+    }
+    sstring host = args._command_args[0];
+    sstring port = args._command_args[1];
+    std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+    std::transform(port.begin(), port.end(), port.begin(), ::tolower);
+    if (host == "no" && port == "one") {
+        return _replica_links.invoke_on_all(&replica_link::unfollow).then([&out] {
+            return out.write(msg_ok);
+        });
+    }
+    uint16_t p = 0;
+    try {
+        auto n = std::stoul(port);
+        if (n == 0 || n > std::numeric_limits<uint16_t>::max()) {
+            return out.write(msg_invalid_port_err);
+        }
+        p = static_cast<uint16_t>(n);
+    } catch (...) {
+        return out.write(msg_invalid_port_err);
+    }
+    return follow(args._command_args[0], p).then([&out] {
+        return out.write(msg_ok);
+    });
+}
+
+future<> redis_service::psync(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count != 4 || args._command_args.size() < 4) {
+        return out.write(msg_syntax_err);
+    }
+    int64_t offset = -1;
+    unsigned shard = 0;
+    unsigned shards = 0;
+    try {
+        offset = std::stoll(args._command_args[1]);
+        shard = std::stoul(args._command_args[2]);
+        shards = std::stoul(args._command_args[3]);
+    } catch (...) {
+        return out.write(msg_syntax_err);
+    }
+    if (shards != smp::count) {
+        return out.write(sstring("-ERR the master runs ") + to_sstring(smp::count) + sstring(" shards, the replica ") + to_sstring(shards) + sstring("\r\n"));
+    }
+    if (shard >= smp::count) {
+        return out.write(msg_syntax_err);
+    }
+    return _db.invoke_on(shard, &database::psync, args._command_args[0], offset).then_wrapped([this, &out, shard] (future<replication_chunk> f) {
+        replication_chunk chunk;
+        try {
+            chunk = f.get0();
+        } catch (std::exception& e) {
+            return out.write(sstring("-ERR ") + sstring(e.what()) + sstring("\r\n"));
+        }
+        // the frames are written as they come until the replica leaves.
+        return do_with(std::move(chunk), [this, &out, shard] (auto& chunk) {
+            auto replid = chunk._replid;
+            return repeat([this, &out, shard, &chunk, replid] {
+                return chunk._frames.write(out).then([&out] {
+                    return out.flush();
+                }).then([this, shard, &chunk, replid] {
+                    auto next = chunk._synced ? _db.invoke_on(shard, &database::stream_step, replid, chunk._offset)
+                                              : _db.invoke_on(shard, &database::sync_step);
+                    return next.then([&chunk] (replication_chunk c) {
+                        chunk = std::move(c);
+                        return stop_iteration::no;
+                    });
+                });
+            }).finally([this, shard, &chunk] {
+                return _db.invoke_on(shard, [synced = chunk._synced] (database& db) {
+                    if (!synced) {
+                        db.abort_sync();
+                    }
+                    db.close_stream();
+                });
+            });
+        });
+    });
+}
+
+future<> redis_service::start_cluster(bool enabled, sstring path, sstring host, uint16_t port)
+{
+    return _cluster.start().then([this, enabled, path, host, port] {
+        if (!enabled) {
+            return make_ready_future<>();
+        }
+        return _cluster.invoke_on(0, &cluster_state::enable, path, host, port).then([this] {
+            return _cluster.invoke_on(0, [this] (cluster_state& c) {
+                return copy_cluster(c.config());
+            });
+        });
+    });
+}
+
+future<> redis_service::stop_cluster()
+{
+    return _cluster.stop();
+}
+
+future<> redis_service::copy_cluster(cluster_config config)
+{
+    return do_with(std::move(config), [this] (auto& config) {
+        return parallel_for_each(boost::irange<unsigned>(1, smp::count), [this, &config] (unsigned cpu) {
+            return _cluster.invoke_on(cpu, [copy = config] (cluster_state& c) {
+                c.set_config(copy);
+            });
+        });
+    });
+}
+
+future<> redis_service::change_cluster(std::function<sstring (cluster_config&)> change, output_stream<char>& out)
+{
+    return _cluster.invoke_on(0, [this, change = std::move(change)] (cluster_state& c) {
+        auto config = c.config();
+        auto reply = change(config);
+        if (reply[0] == '-') {
+            return make_ready_future<sstring>(std::move(reply));
+        }
+        c.set_config(config);
+        return copy_cluster(std::move(config)).then([&c] {
+            return c.save();
+        }).then([reply = std::move(reply)] {
+            return reply;
+        });
+    }).then([&out] (sstring reply) {
+        return out.write(reply);
+    });
+}
+
+static bool parse_slot(const sstring& s, unsigned& slot)
+{
+    try {
+        size_t end = 0;
+        auto n = std::stol(std::string(s.data(), s.size()), &end);
+        if (end != s.size() || n < 0 || n >= static_cast<long>(CLUSTER_SLOTS)) {
+            return false;
+        }
+        slot = static_cast<unsigned>(n);
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+static inline sstring bulk_reply(const sstring& data)
+{
+    return sstring("$") + to_sstring(data.size()) + sstring("\r\n") + data + sstring("\r\n");
+}
+
+future<> redis_service::cluster(args_collection& args, output_stream<char>& out)
+{
+    if (!local_cluster().enabled()) {
+        return out.write(msg_cluster_disabled_err);
+    }
+    if (args._command_args_count < 1 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    auto& a = args._command_args;
+    auto count = args._command_args_count;
+    sstring subcommand = a[0];
+    std::transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::tolower);
+    auto& config = local_cluster().config();
+    if (subcommand == "info" && count == 1) {
+        return out.write(bulk_reply(config.info_reply()));
+    }
+    if (subcommand == "myid" && count == 1) {
+        return out.write(bulk_reply(config.myself()._id));
+    }
+    if (subcommand == "nodes" && count == 1) {
+        return out.write(bulk_reply(config.describe()));
+    }
+    if (subcommand == "slots" && count == 1) {
+        return out.write(config.slots_reply());
+    }
+    if (subcommand == "shards" && count == 1) {
+        return out.write(config.shards_reply());
+    }
+    if (subcommand == "keyslot" && count == 2) {
+        return out.write(sstring(":") + to_sstring(key_slot(a[1].data(), a[1].size())) + sstring("\r\n"));
+    }
+    if (subcommand == "countkeysinslot" && count == 2) {
+        unsigned slot = 0;
+        if (!parse_slot(a[1], slot)) {
+            return out.write(msg_invalid_slot_err);
+        }
+        return _db.invoke_on(slot % smp::count, &database::count_keys_in_slot, slot).then([&out] (size_t keys) {
+            return out.write(sstring(":") + to_sstring(keys) + sstring("\r\n"));
+        });
+    }
+    if (subcommand == "getkeysinslot" && count == 3) {
+        unsigned slot = 0;
+        long n = 0;
+        if (!parse_slot(a[1], slot)) {
+            return out.write(msg_invalid_slot_err);
+        }
+        try {
+            n = std::stol(a[2]);
+        } catch (...) {
+            return out.write(msg_syntax_err);
+        }
+        if (n < 0) {
+            return out.write(msg_syntax_err);
+        }
+        return _db.invoke_on(slot % smp::count, &database::keys_in_slot, slot, static_cast<size_t>(n)).then([&out] (std::vector<sstring> keys) {
+            return do_with(std::move(keys), [&out] (auto& keys) {
+                return reply_builder::build(keys).then([&out] (auto&& m) {
+                    return m.write(out);
+                });
+            });
+        });
+    }
+    bool add = subcommand == "addslots" || subcommand == "addslotsrange";
+    if (add || subcommand == "delslots" || subcommand == "delslotsrange") {
+        bool range = subcommand.size() > 8;
+        if (count < 2 || (range && count % 2 == 0)) {
+            return out.write(msg_syntax_err);
+        }
+        std::vector<unsigned> slots;
+        for (size_t i = 1; i < count; i += range ? 2 : 1) {
+            unsigned first = 0, last = 0;
+            if (!parse_slot(a[i], first) || (range && !parse_slot(a[i + 1], last))) {
+                return out.write(msg_invalid_slot_err);
+            }
+            if (!range) {
+                last = first;
+            } else if (first > last) {
+                return out.write(msg_invalid_slot_err);
+            }
+            for (auto slot = first; slot <= last; ++slot) {
+                slots.push_back(slot);
+            }
+        }
+        return change_cluster([add, slots = std::move(slots)] (cluster_config& c) {
+            for (auto slot : slots) {
+                if (add && c.owner(slot) != cluster_config::NO_NODE) {
+                    return sstring("-ERR Slot ") + to_sstring(slot) + sstring(" is already busy\r\n");
+                }
+                if (!add && c.owner(slot) == cluster_config::NO_NODE) {
+                    return sstring("-ERR Slot ") + to_sstring(slot) + sstring(" is already unassigned\r\n");
+                }
+            }
+            for (auto slot : slots) {
+                c.assign(slot, add ? 0 : cluster_config::NO_NODE);
+            }
+            return msg_ok;
+        }, out);
+    }
+    if (subcommand == "setslot" && count >= 3) {
+        unsigned slot = 0;
+        if (!parse_slot(a[1], slot)) {
+            return out.write(msg_invalid_slot_err);
+        }
+        sstring action = a[2];
+        std::transform(action.begin(), action.end(), action.begin(), ::tolower);
+        if (action == "stable" && count == 3) {
+            return change_cluster([slot] (cluster_config& c) {
+                c.stabilize(slot);
+                return msg_ok;
+            }, out);
+        }
+        if (count != 4) {
+            return out.write(msg_syntax_err);
+        }
+        sstring id = a[3];
+        if (action == "importing" || action == "migrating") {
+            bool importing = action == "importing";
+            return change_cluster([slot, id, importing] (cluster_config& c) {
+                auto node = c.find(id);
+                if (node == cluster_config::NO_NODE) {
+                    return msg_unknown_node_err;
+                }
+                if (importing && c.owned(slot)) {
+                    return sstring("-ERR I'm already the owner of hash slot ") + to_sstring(slot) + sstring("\r\n");
+                }
+                if (!importing && !c.owned(slot)) {
+                    return sstring("-ERR I'm not the owner of hash slot ") + to_sstring(slot) + sstring("\r\n");
+                }
+                if (importing) {
+                    c.import(slot, node);
+                } else {
+                    c.migrate(slot, node);
+                }
+                return msg_ok;
+            }, out);
+        }
+        if (action == "node") {
+            // the slot is given away only once its keys left this node.
+            return _db.invoke_on(slot % smp::count, &database::count_keys_in_slot, slot).then([this, slot, id, &out] (size_t keys) {
+                return change_cluster([slot, id, keys] (cluster_config& c) {
+                    auto node = c.find(id);
+                    if (node == cluster_config::NO_NODE) {
+                        return msg_unknown_node_err;
+                    }
+                    if (c.owned(slot) && node != 0 && keys > 0) {
+                        return sstring("-ERR Can't assign hashslot ") + to_sstring(slot) + sstring(" to a different node while I still hold keys for this hash slot.\r\n");
+                    }
+                    // the node completing an import announces its new ownership
+                    // with a new epoch.
+                    bool imported = node == 0 && c.importing_from(slot) != cluster_config::NO_NODE;
+                    c.assign(slot, node);
+                    if (imported) {
+                        c.bump_epoch();
+                    }
+                    return msg_ok;
+                }, out);
+            });
+        }
+        return out.write(msg_syntax_err);
+    }
+    if (subcommand == "meet" && count == 3) {
+        uint16_t port = 0;
+        try {
+            auto n = std::stoul(a[2]);
+            if (n == 0 || n > std::numeric_limits<uint16_t>::max()) {
+                return out.write(msg_syntax_err);
+            }
+            port = static_cast<uint16_t>(n);
+        } catch (...) {
+            return out.write(msg_syntax_err);
+        }
+        sstring host = a[1];
+        return cluster_state::node_id_of(host, port, std::chrono::milliseconds(1000)).then_wrapped([this, host, port, &out] (future<sstring> f) {
+            sstring id;
+            try {
+                id = f.get0();
+            } catch (std::exception& e) {
+                return out.write(sstring("-ERR Can't reach node ") + host + sstring(":") + to_sstring(port) + sstring(": ") + sstring(e.what()) + sstring("\r\n"));
+            }
+            return change_cluster([id, host, port] (cluster_config& c) {
+                c.meet(id, host, port);
+                return msg_ok;
+            }, out);
+        });
+    }
+    if (subcommand == "forget" && count == 2) {
+        sstring id = a[1];
+        return change_cluster([id] (cluster_config& c) {
+            if (c.find(id) == 0) {
+                return sstring("-ERR I tried hard but I can't forget myself...\r\n");
+            }
+            if (!c.forget(id)) {
+                return msg_unknown_node_err;
+            }
+            return msg_ok;
+        }, out);
+    }
+    if (subcommand == "saveconfig" && count == 1) {
+        return _cluster.invoke_on(0, &cluster_state::save).then([&out] {
+            return out.write(msg_ok);
+        });
+    }
+    return out.write(msg_syntax_err);
+}
+
+future<> redis_service::migrate(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count < 5 || args._command_args.size() < 5) {
+        return out.write(msg_syntax_err);
+    }
+    if (!local_cluster().enabled()) {
+        return out.write(msg_cluster_disabled_err);
+    }
+    auto& a = args._command_args;
+    uint16_t port = 0;
+    long timeout = 0;
+    try {
+        auto n = std::stoul(a[1]);
+        if (n == 0 || n > std::numeric_limits<uint16_t>::max()) {
+            return out.write(msg_syntax_err);
+        }
+        port = static_cast<uint16_t>(n);
+        timeout = std::stol(a[4]);
+    } catch (...) {
+        return out.write(msg_syntax_err);
+    }
+    // a cluster node serves the database 0 only.
+    if (a[3] != "0") {
+        return out.write(msg_syntax_err);
+    }
+    bool copy = false, replace = false;
+    std::vector<sstring> keys;
+    if (!a[2].empty()) {
+        keys.push_back(a[2]);
+    }
+    for (size_t i = 5; i < args._command_args_count; ++i) {
+        sstring option = a[i];
+        std::transform(option.begin(), option.end(), option.begin(), ::tolower);
+        if (option == "copy") {
+            copy = true;
+        } else if (option == "replace") {
+            replace = true;
+        } else if (option == "keys" && a[2].empty()) {
+            for (++i; i < args._command_args_count; ++i) {
+                keys.push_back(a[i]);
+            }
+        } else {
+            return out.write(msg_syntax_err);
+        }
+    }
+    unsigned cpu = 0;
+    if (keys.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    if (!on_one_shard(keys.data(), keys.size(), cpu)) {
+        return out.write(msg_crossslot_err);
+    }
+    auto wait = std::chrono::milliseconds(timeout > 0 ? timeout : 1000);
+    return smp::submit_to(cpu, [this, host = a[0], port, keys = std::move(keys), copy, replace, wait] () mutable {
+        return _cluster.local().migrate(_db.local(), host, port, std::move(keys), copy, replace, wait);
+    }).then([&out] (sstring reply) {
+        return out.write(reply);
+    });
+}
+
+future<sstring> redis_service::migrating_redirect(unsigned slot, std::vector<sstring>& keys)
+{
+    return _db.invoke_on(slot % smp::count, &database::mexists_direct, std::ref(keys)).then([this, slot, &keys] (size_t found) {
+        if (found == keys.size()) {
+            return sstring();
+        }
+        if (found == 0) {
+            return _cluster.local().ask_redirect(slot);
+        }
+        return msg_tryagain_err;
+    });
+}
+
+future<> redis_service::start_pubsub()
+{
+    return _pubsub.start();
+}
+
+future<> redis_service::stop_pubsub()
+{
+    return _pubsub.stop();
+}
+
+future<> redis_service::change_subscriptions(std::vector<sstring> names, bool patterns, bool add, subscriber& s, output_stream<char>& out)
+{
+    const char* kind = add ? (patterns ? "psubscribe" : "subscribe") : (patterns ? "punsubscribe" : "unsubscribe");
+    if (names.empty()) {
+        auto& all = patterns ? s.patterns() : s.channels();
+        names.assign(all.begin(), all.end());
+        if (names.empty()) {
+            return out.write(subscription_reply(kind, nullptr, s.subscriptions()));
+        }
+    }
+    return do_with(std::move(names), [this, patterns, add, kind, &s, &out] (auto& names) {
+        return do_for_each(names, [this, patterns, add, kind, &s, &out] (const sstring& name) {
+            auto& local = _pubsub.local();
+            bool changed = patterns ? (add ? local.psubscribe(s, name) : local.punsubscribe(s, name))
+                                    : (add ? local.subscribe(s, name) : local.unsubscribe(s, name));
+            auto reply = subscription_reply(kind, &name, s.subscriptions());
+            if (!changed) {
+                return out.write(reply);
+            }
+            return _pubsub.invoke_on_all([name, patterns, add, shard = engine().cpu_id()] (pubsub& p) {
+                if (patterns) {
+                    p.set_pattern_shard(name, shard, add);
+                } else {
+                    p.set_channel_shard(name, shard, add);
+                }
+            }).then([&out, reply = std::move(reply)] {
+                return out.write(reply);
+            });
+        });
+    });
+}
+
+future<> redis_service::subscribe(args_collection& args, subscriber& s, output_stream<char>& out)
+{
+    if (args._command_args_count < 1 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    std::vector<sstring> names(args._command_args.begin(), args._command_args.begin() + args._command_args_count);
+    return change_subscriptions(std::move(names), false, true, s, out);
+}
+
+future<> redis_service::psubscribe(args_collection& args, subscriber& s, output_stream<char>& out)
+{
+    if (args._command_args_count < 1 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    std::vector<sstring> names(args._command_args.begin(), args._command_args.begin() + args._command_args_count);
+    return change_subscriptions(std::move(names), true, true, s, out);
+}
+
+future<> redis_service::unsubscribe(args_collection& args, subscriber& s, output_stream<char>& out)
+{
+    std::vector<sstring> names(args._command_args.begin(), args._command_args.begin() + args._command_args_count);
+    return change_subscriptions(std::move(names), false, false, s, out);
+}
+
+future<> redis_service::punsubscribe(args_collection& args, subscriber& s, output_stream<char>& out)
+{
+    std::vector<sstring> names(args._command_args.begin(), args._command_args.begin() + args._command_args_count);
+    return change_subscriptions(std::move(names), true, false, s, out);
+}
+
+future<> redis_service::unsubscribe_all(subscriber& s)
+{
+    auto& local = _pubsub.local();
+    std::vector<sstring> channels, patterns;
+    for (auto& channel : std::vector<sstring>(s.channels().begin(), s.channels().end())) {
+        if (local.unsubscribe(s, channel)) {
+            channels.push_back(channel);
+        }
+    }
+    for (auto& pattern : std::vector<sstring>(s.patterns().begin(), s.patterns().end())) {
+        if (local.punsubscribe(s, pattern)) {
+            patterns.push_back(pattern);
+        }
+    }
+    if (channels.empty() && patterns.empty()) {
+        return make_ready_future<>();
+    }
+    return _pubsub.invoke_on_all([channels = std::move(channels), patterns = std::move(patterns), shard = engine().cpu_id()] (pubsub& p) {
+        for (auto& channel : channels) {
+            p.set_channel_shard(channel, shard, false);
+        }
+        for (auto& pattern : patterns) {
+            p.set_pattern_shard(pattern, shard, false);
+        }
+    });
+}
+
+future<> redis_service::publish(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count != 2 || args._command_args.size() < 2) {
+        return out.write(msg_syntax_err);
+    }
+    sstring& channel = args._command_args[0];
+    sstring& message = args._command_args[1];
+    auto shards = _pubsub.local().shards_of(channel);
+    return do_with(std::move(shards), size_t(0), [this, &channel, &message, &out] (auto& shards, auto& receivers) {
+        return parallel_for_each(shards, [this, &channel, &message, &receivers] (unsigned cpu) {
+            if (cpu == engine().cpu_id()) {
+                receivers += _pubsub.local().deliver(channel, message);
+                return make_ready_future<>();
+            }
+            // the shard gets one copy of the message for all its subscribers.
+            return _pubsub.invoke_on(cpu, [channel, message] (pubsub& p) {
+                return p.deliver(channel, message);
+            }).then([&receivers] (size_t n) {
+                receivers += n;
+            });
+        }).then([&receivers, &out] {
+            return out.write(sstring(":") + to_sstring(receivers) + sstring("\r\n"));
+        });
+    });
+}
+
+future<> redis_service::pubsub_command(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count < 1 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    auto& a = args._command_args;
+    auto count = args._command_args_count;
+    sstring subcommand = a[0];
+    std::transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::tolower);
+    if (subcommand == "channels" && count <= 2) {
+        // every shard knows all the channels with subscribers.
+        auto channels = _pubsub.local().active_channels(count == 2 ? a[1] : sstring());
+        return do_with(std::move(channels), [&out] (auto& channels) {
+            return reply_builder::build(channels).then([&out] (auto&& m) {
+                return m.write(out);
+            });
+        });
+    }
+    if (subcommand == "numpat" && count == 1) {
+        return out.write(sstring(":") + to_sstring(_pubsub.local().patterns()) + sstring("\r\n"));
+    }
+    if (subcommand == "numsub") {
+        std::vector<sstring> channels(a.begin() + 1, a.begin() + count);
+        return do_with(std::move(channels), std::vector<size_t>(count - 1), [this, &out] (auto& channels, auto& counts) {
+            return parallel_for_each(boost::irange<unsigned>(0, smp::count), [this, &channels, &counts] (unsigned cpu) {
+                return _pubsub.invoke_on(cpu, [&channels] (pubsub& p) {
+                    std::vector<size_t> local;
+                    for (auto& channel : channels) {
+                        local.push_back(p.local_subscribers(channel));
+                    }
+                    return local;
+                }).then([&counts] (std::vector<size_t> local) {
+                    for (size_t i = 0; i < local.size(); ++i) {
+                        counts[i] += local[i];
+                    }
+                });
+            }).then([&channels, &counts, &out] {
+                auto reply = sstring("*") + to_sstring(channels.size() * 2) + sstring("\r\n");
+                for (size_t i = 0; i < channels.size(); ++i) {
+                    reply += sstring("$") + to_sstring(channels[i].size()) + sstring("\r\n") + channels[i] + sstring("\r\n");
+                    reply += sstring(":") + to_sstring(counts[i]) + sstring("\r\n");
+                }
+                return out.write(reply);
+            });
+        });
+    }
+    return out.write(msg_syntax_err);
+}
+
+void redis_service::configure_shard_ports(uint16_t base)
+{
+    _shard_ports_base = base;
+}
+
+future<> redis_service::shards(args_collection& args, output_stream<char>& out)
+{
+    auto& a = args._command_args;
+    auto count = args._command_args_count;
+    if (count == 0) {
+        // the owner of a key is (crc16(hash tag or key) & (slots - 1)) % count,
+        // see redis_key::get_cpu().
+        auto field = [] (const sstring& name) {
+            return sstring("$") + to_sstring(name.size()) + sstring("\r\n") + name + sstring("\r\n");
+        };
+        auto integer = [] (size_t n) {
+            return sstring(":") + to_sstring(n) + sstring("\r\n");
+        };
+        auto reply = sstring("*10\r\n");
+        reply += field("count") + integer(smp::count);
+        reply += field("port-base") + integer(_shard_ports_base);
+        reply += field("hash") + field("crc16");
+        reply += field("slots") + integer(CLUSTER_SLOTS);
+        reply += field("shard") + integer(engine().cpu_id());
+        return out.write(reply);
+    }
+    sstring subcommand = a[0];
+    std::transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::tolower);
+    if (subcommand == "keyshard" && count == 2) {
+        redis_key rk{a[1]};
+        return out.write(sstring(":") + to_sstring(rk.get_cpu()) + sstring("\r\n"));
+    }
+    return out.write(msg_syntax_err);
+}
+
+// The request statistics of a shard, see request_latency_tracer. The latencies
+// are the histograms of the commands served by the shard, if asked.
+struct shard_requests {
+    uint64_t _connections_current = 0;
+    uint64_t _connections_total = 0;
+    uint64_t _served = 0;
+    uint64_t _exceptions = 0;
+    uint64_t _rejected = 0;
+    std::vector<std::pair<size_t, latency_histogram>> _latencies;
+    // The estimated accesses per second to the keys of every shard.
+    std::vector<double> _ops_by_shard;
+
+    static shard_requests of_local(bool with_latencies) {
+        shard_requests r;
+        auto tracer = request_latency_tracer::local();
+        if (tracer == nullptr) {
+            return r;
+        }
+        r._connections_current = tracer->connections_current();
+        r._connections_total = tracer->connections_total();
+        r._served = tracer->served();
+        r._exceptions = tracer->number_exceptions();
+        r._rejected = tracer->rejected();
+        r._ops_by_shard = tracer->sampled_keys().ops_by_shard();
+        if (with_latencies) {
+            for (size_t i = 0; i < redis_protocol_parser::COMMAND_COUNT; ++i) {
+                auto& h = tracer->latency_of(static_cast<redis_protocol_parser::command>(i));
+                if (h.count() > 0) {
+                    r._latencies.emplace_back(i, h);
+                }
+            }
+        }
+        return r;
+    }
+};
+
+static std::string human_bytes(size_t bytes)
+{
+    static const char* units[] = { "B", "K", "M", "G", "T" };
+    double v = bytes;
+    size_t u = 0;
+    for (; v >= 1024 && u < 4; ++u) {
+        v /= 1024;
+    }
+    std::ostringstream os;
+    os << std::fixed << std::setprecision(2) << v << units[u];
+    return os.str();
+}
+
+static inline double ratio(size_t total, size_t used)
+{
+    return used ? static_cast<double>(total) / used : 0;
+}
+
+future<> redis_service::info(args_collection& args, output_stream<char>& out)
+{
+    sstring section = args._command_args_count > 0 ? args._command_args[0] : sstring("default");
+    std::transform(section.begin(), section.end(), section.begin(), ::tolower);
+    bool all = section == "all" || section == "everything";
+    bool by_default = all || section == "default";
+    // The sections out of the default ones are only listed by their name, or all.
+    auto wants = [section, all, by_default] (const char* name, bool in_default) {
+        return section == name || (in_default ? by_default : all);
+    };
+    bool with_latencies = wants("commandstats", false) || wants("latencystats", false);
+    struct info_state {
+        std::vector<database::shard_info> _shards;
+        std::vector<shard_requests> _requests;
+        std::vector<replica_link::status> _links;
+        info_state() : _shards(smp::count), _requests(smp::count), _links(smp::count) {}
+    };
+    return do_with(info_state {}, [this, &out, wants, with_latencies] (auto& state) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [this, &state, with_latencies] (unsigned cpu) {
+            return _db.invoke_on(cpu, &database::info).then([&state, cpu, with_latencies] (database::shard_info info) {
+                state._shards[cpu] = info;
+                return smp::submit_to(cpu, [with_latencies] {
+                    return shard_requests::of_local(with_latencies);
+                });
+            }).then([this, &state, cpu] (shard_requests requests) {
+                state._requests[cpu] = std::move(requests);
+                return _replica_links.invoke_on(cpu, [] (replica_link& link) {
+                    return link.get_status();
+                });
+            }).then([&state, cpu] (replica_link::status link) {
+                state._links[cpu] = std::move(link);
+            });
+        }).then([this, &state, &out, wants] {
+            database::shard_info total;
+            shard_requests requests;
+            std::vector<latency_histogram> latencies(redis_protocol_parser::COMMAND_COUNT);
+            std::vector<double> ops(smp::count);
+            for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+                total += state._shards[cpu];
+                auto& r = state._requests[cpu];
+                requests._connections_current += r._connections_current;
+                requests._connections_total += r._connections_total;
+                requests._served += r._served;
+                requests._exceptions += r._exceptions;
+                requests._rejected += r._rejected;
+                for (auto& l : r._latencies) {
+                    latencies[l.first] += l.second;
+                }
+                for (size_t owner = 0; owner < r._ops_by_shard.size(); ++owner) {
+                    ops[owner] += r._ops_by_shard[owner];
+                }
+            }
+            // The load of the busiest shard over the mean load of the shards.
+            auto total_ops = std::accumulate(ops.begin(), ops.end(), 0.0);
+            auto skew = total_ops > 0 ? *std::max_element(ops.begin(), ops.end()) * smp::count / total_ops : 0;
+            std::ostringstream os;
+            os << std::fixed << std::setprecision(2);
+            if (wants("server", true)) {
+                auto uptime = std::chrono::duration_cast<std::chrono::seconds>(steady_clock_type::now() - _started).count();
+                os << "# Server\r\n"
+                   << "redis_mode:" << (local_cluster().enabled() ? "cluster" : "standalone") << "\r\n"
+                   << "process_id:" << ::getpid() << "\r\n"
+                   << "arch_bits:" << sizeof(void*) * 8 << "\r\n"
+                   << "shards:" << smp::count << "\r\n"
+                   << "uptime_in_seconds:" << uptime << "\r\n"
+                   << "uptime_in_days:" << uptime / (24 * 3600) << "\r\n"
+                   << "\r\n";
+            }
+            if (wants("clients", true)) {
+                os << "# Clients\r\n"
+                   << "connected_clients:" << requests._connections_current << "\r\n"
+                   << "blocked_clients:" << total.blocked_clients << "\r\n"
+                   << "\r\n";
+            }
+            if (wants("memory", true)) {
+                os << "# Memory\r\n"
+                   << "used_memory:" << total.used_memory << "\r\n"
+                   << "used_memory_human:" << human_bytes(total.used_memory) << "\r\n"
+                   << "used_memory_dataset:" << total.dataset_used << "\r\n"
+                   << "used_memory_dataset_human:" << human_bytes(total.dataset_used) << "\r\n"
+                   << "total_system_memory:" << total.total_memory << "\r\n"
+                   << "total_system_memory_human:" << human_bytes(total.total_memory) << "\r\n"
+                   << "maxmemory:" << total.maxmemory << "\r\n"
+                   << "maxmemory_human:" << human_bytes(total.maxmemory) << "\r\n"
+                   << "maxmemory_policy:" << total.maxmemory_policy << "\r\n"
+                   << "lsa_total_space:" << total.lsa_total << "\r\n"
+                   << "lsa_used_space:" << total.lsa_used << "\r\n"
+                   << "lsa_free_space:" << total.lsa_total - total.lsa_used << "\r\n"
+                   << "lsa_free_segments:" << total.lsa_free_segments << "\r\n"
+                   << "lsa_zones:" << total.lsa_zones << "\r\n"
+                   << "lsa_segments_compacted:" << total.lsa_segments_compacted << "\r\n"
+                   << "lsa_segments_migrated:" << total.lsa_segments_migrated << "\r\n"
+                   << "lsa_large_objects_space:" << total.non_lsa_memory << "\r\n"
+                   << "lsa_fragmentation_ratio:" << ratio(total.lsa_total, total.lsa_used) << "\r\n"
+                   << "lsa_compacted_bytes:" << total.lsa_compacted_bytes << "\r\n"
+                   << "lsa_background_compacted_bytes:" << total.lsa_background_compacted_bytes << "\r\n"
+                   << "lsa_allocation_stalls:" << total.lsa_stalls.count() << "\r\n"
+                   << "lsa_allocation_stall_usec:" << total.lsa_stalls.sum() << "\r\n"
+                   << "lsa_allocation_stall_percentiles_usec:p50=" << total.lsa_stalls.percentile(0.5)
+                   << ",p99=" << total.lsa_stalls.percentile(0.99) << ",p99.9=" << total.lsa_stalls.percentile(0.999) << "\r\n"
+                   << "lsa_allocation_stall_moved_bytes:" << total.lsa_stall_moved_bytes << "\r\n"
+                   << "tiered_values:" << total.tiered_values << "\r\n"
+                   << "tiered_bytes:" << total.tiered_bytes << "\r\n"
+                   << "tiered_bytes_human:" << human_bytes(total.tiered_bytes) << "\r\n"
+                   << "lazyfree_pending_objects:" << total.lazyfree_pending << "\r\n"
+                   << "\r\n";
+            }
+            if (wants("stats", true)) {
+                os << "# Stats\r\n"
+                   << "total_connections_received:" << requests._connections_total << "\r\n"
+                   << "total_commands_processed:" << requests._served << "\r\n"
+                   << "total_error_replies:" << requests._exceptions << "\r\n"
+                   << "total_busy_replies:" << requests._rejected << "\r\n"
+                   << "keyspace_hits:" << total.hits << "\r\n"
+                   << "keyspace_misses:" << (total.reads > total.hits ? total.reads - total.hits : 0) << "\r\n"
+                   << "expired_keys:" << total.expired << "\r\n"
+                   << "evicted_keys:" << total.evicted << "\r\n"
+                   << "tier_promotions:" << total.tier_promotions << "\r\n"
+                   << "lazyfreed_objects:" << total.lazyfreed << "\r\n"
+                   << "pubsub_channels:" << _pubsub.local().channels() << "\r\n"
+                   << "pubsub_patterns:" << _pubsub.local().patterns() << "\r\n"
+                   << "local_dispatch:" << total.local_dispatch << "\r\n"
+                   << "remote_dispatch:" << total.remote_dispatch << "\r\n"
+                   << "shard_ops_skew:" << skew << "\r\n"
+                   << "replicated_keys:" << total.replicated_keys << "\r\n"
+                   << "replica_copies:" << total.replica_copies << "\r\n"
+                   << "replica_hits:" << total.replica_hits << "\r\n"
+                   << "replica_invalidations:" << total.replica_invalidations << "\r\n"
+                   << "\r\n";
+            }
+            if (wants("replication", true)) {
+                auto& master = state._links[0];
+                bool synced = master._following;
+                bool syncing = false;
+                int64_t replica_offset = 0;
+                for (auto& l : state._links) {
+                    synced = synced && l._state == replica_link::state::connected;
+                    syncing = syncing || l._state == replica_link::state::syncing;
+                    replica_offset += std::max<int64_t>(l._offset, 0);
+                }
+                os << "# Replication\r\n"
+                   << "role:" << (master._following ? "slave" : "master") << "\r\n";
+                if (master._following) {
+                    os << "master_host:" << master._host << "\r\n"
+                       << "master_port:" << master._port << "\r\n"
+                       << "master_link_status:" << (synced ? "up" : "down") << "\r\n"
+                       << "master_sync_in_progress:" << (syncing ? 1 : 0) << "\r\n"
+                       << "slave_repl_offset:" << replica_offset << "\r\n";
+                }
+                // every replica streams from all the shards.
+                os << "connected_slaves:" << state._shards[0].repl_streams << "\r\n"
+                   << "master_replid:" << state._shards[0].repl_id << "\r\n"
+                   << "master_repl_offset:" << total.repl_offset << "\r\n"
+                   << "repl_backlog_active:" << (total.repl_backlog_size > 0 ? 1 : 0) << "\r\n"
+                   << "repl_backlog_size:" << total.repl_backlog_size << "\r\n"
+                   << "repl_full_syncs:" << total.repl_full_syncs << "\r\n"
+                   << "repl_partial_syncs:" << total.repl_partial_syncs << "\r\n";
+                for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+                    auto& b = state._shards[cpu];
+                    auto& l = state._links[cpu];
+                    os << "shard" << cpu << ":replid=" << b.repl_id << ",offset=" << b.repl_offset
+                       << ",streams=" << b.repl_streams;
+                    if (l._following) {
+                        os << ",link=" << replica_link::state_name(l._state) << ",master_offset=" << l._offset
+                           << ",applied_bytes=" << l._applied_bytes << ",full_syncs=" << l._full_syncs
+                           << ",partial_syncs=" << l._partial_syncs << ",link_failures=" << l._link_failures;
+                    }
+                    os << "\r\n";
+                }
+                os << "\r\n";
+            }
+            if (wants("cluster", true)) {
+                os << "# Cluster\r\n"
+                   << "cluster_enabled:" << (local_cluster().enabled() ? 1 : 0) << "\r\n"
+                   << "\r\n";
+            }
+            if (wants("keyspace", true)) {
+                os << "# Keyspace\r\n";
+                for (size_t i = 0; i < total.databases.size(); ++i) {
+                    auto& db = total.databases[i];
+                    if (db.first > 0) {
+                        os << "db" << i << ":keys=" << db.first << ",expires=" << db.second << ",avg_ttl=0\r\n";
+                    }
+                }
+                os << "\r\n";
+            }
+            if (wants("commandstats", false)) {
+                os << "# Commandstats\r\n";
+                for (size_t i = 0; i < latencies.size(); ++i) {
+                    auto& h = latencies[i];
+                    if (h.count() == 0) {
+                        continue;
+                    }
+                    os << "cmdstat_" << command_name(static_cast<redis_protocol_parser::command>(i)) << ":calls=" << h.count()
+                       << ",usec=" << h.sum() << ",usec_per_call=" << h.mean() << "\r\n";
+                }
+                os << "\r\n";
+            }
+            if (wants("latencystats", false)) {
+                os << "# Latencystats\r\n";
+                for (size_t i = 0; i < latencies.size(); ++i) {
+                    auto& h = latencies[i];
+                    if (h.count() == 0) {
+                        continue;
+                    }
+                    os << "latency_percentiles_usec_" << command_name(static_cast<redis_protocol_parser::command>(i)) << ":p50=" << h.percentile(0.5)
+                       << ",p99=" << h.percentile(0.99) << ",p99.9=" << h.percentile(0.999) << "\r\n";
+                }
+                os << "\r\n";
+            }
+            if (wants("shards", false)) {
+                os << "# Shards\r\n";
+                for (unsigned cpu = 0; cpu < smp::count; ++cpu) {
+                    auto& s = state._shards[cpu];
+                    auto& r = state._requests[cpu];
+                    os << "shard" << cpu << ":keys=" << s.keys << ",expires=" << s.expires
+                       << ",clients=" << r._connections_current << ",commands=" << r._served
+                       << ",ops_per_sec=" << ops[cpu]
+                       << ",used_memory=" << s.used_memory << ",dataset_used=" << s.dataset_used
+                       << ",lsa_total=" << s.lsa_total << ",lsa_used=" << s.lsa_used
+                       << ",lsa_free_segments=" << s.lsa_free_segments
+                       << ",lsa_segments_compacted=" << s.lsa_segments_compacted
+                       << ",lsa_allocation_stalls=" << s.lsa_stalls.count()
+                       << ",lsa_fragmentation_ratio=" << ratio(s.lsa_total, s.lsa_used) << "\r\n";
+                }
+                os << "\r\n";
+            }
+            auto&& body = os.str();
+            auto m = make_lw_shared<scattered_message<char>>();
+            m->append_static(msg_batch_tag);
+            m->append(to_sstring(body.size()));
+            m->append_static(msg_crlf);
+            m->append(sstring(body.data(), body.size()));
+            m->append_static(msg_crlf);
+            return out.write(std::move(*m));
+        });
+    });
+}
+
+future<> redis_service::memory(args_collection& args, output_stream<char>& out)
+{
+    if (args._command_args_count < 2 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    sstring subcommand = args._command_args[0];
+    std::transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::tolower);
+    if (subcommand != "usage") {
+        return out.write(msg_syntax_err);
+    }
+    if (args._command_args_count != 2) {
+        sstring option = args._command_args[2];
+        std::transform(option.begin(), option.end(), option.begin(), ::tolower);
+        if (args._command_args_count != 4 || option != "samples") {
+            return out.write(msg_syntax_err);
+        }
+    }
+    sstring& key = args._command_args[1];
+    redis_key rk {std::ref(key)};
+    auto cpu = get_cpu(rk);
+    return invoke_on(cpu, &database::memory_usage, std::move(rk)).then([&out] (auto&& m) {
+        return m.write(out);
+    });
+}
+
+// The hot keys sampled by a shard, and its estimate of the accesses to the keys of every shard.
+struct shard_hot_keys {
+    std::vector<hot_keys::counter> _counters;
+    std::vector<double> _ops_by_shard;
+};
+
+future<> redis_service::hotkeys(args_collection& args, output_stream<char>& out)
+{
+    size_t count = 10;
+    if (args._command_args_count > 0) {
+        sstring option = args._command_args[0];
+        std::transform(option.begin(), option.end(), option.begin(), ::tolower);
+        if (args._command_args_count != 2 || option != "count") {
+            return out.write(msg_syntax_err);
+        }
+        auto n = std::atol(args._command_args[1].c_str());
+        if (n <= 0) {
+            return out.write(msg_syntax_err);
+        }
+        count = static_cast<size_t>(n);
+    }
+    return do_with(std::vector<shard_hot_keys>(smp::count), [&out, count] (auto& shards) {
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [&shards] (unsigned cpu) {
+            return smp::submit_to(cpu, [] {
+                shard_hot_keys h;
+                auto tracer = request_latency_tracer::local();
+                if (tracer != nullptr) {
+                    h._counters = tracer->sampled_keys().counters();
+                    h._ops_by_shard = tracer->sampled_keys().ops_by_shard();
+                }
+                return h;
+            }).then([&shards, cpu] (shard_hot_keys h) {
+                shards[cpu] = std::move(h);
             });
+        }).then([&shards, &out, count] {
+            // A key requested from several shards is counted by every one of them.
+            std::unordered_map<sstring, hot_keys::counter> merged;
+            for (auto& s : shards) {
+                for (auto& c : s._counters) {
+                    auto it = merged.find(c._key);
+                    if (it == merged.end()) {
+                        merged.emplace(c._key, c);
+                    } else {
+                        it->second._count += c._count;
+                        it->second._error += c._error;
+                    }
+                }
+            }
+            std::vector<hot_keys::counter> top;
+            top.reserve(merged.size());
+            for (auto& m : merged) {
+                top.emplace_back(std::move(m.second));
+            }
+            auto n = std::min(count, top.size());
+            std::partial_sort(top.begin(), top.begin() + n, top.end(), [] (const hot_keys::counter& l, const hot_keys::counter& r) {
+                return l._count > r._count;
+            });
+            // Every key is replied with its owner shard and its estimated accesses per second.
+            auto m = make_lw_shared<scattered_message<char>>();
+            m->append_static(msg_sigle_tag);
+            m->append(to_sstring(n));
+            m->append_static(msg_crlf);
+            for (size_t i = 0; i < n; ++i) {
+                auto& c = top[i];
+                m->append(sstring("*3\r\n$"));
+                m->append(to_sstring(c._key.size()));
+                m->append_static(msg_crlf);
+                m->append(c._key);
+                m->append_static(msg_crlf);
+                m->append(sstring(":"));
+                m->append(to_sstring(c._shard));
+                m->append_static(msg_crlf);
+                m->append(sstring(":"));
+                m->append(to_sstring(static_cast<uint64_t>(c.ops())));
+                m->append_static(msg_crlf);
+            }
+            return out.write(std::move(*m));
         });
     });
 }
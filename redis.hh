@@ -43,6 +43,11 @@
 #include <cstdlib>
 #include "common.hh"
 #include "geo.hh"
+#include "reply.hh"
+#include "replication.hh"
+#include "cluster.hh"
+#include "pubsub.hh"
+#include "blocked_lists.hh"
 namespace redis {
 
 namespace stdx = std::experimental;
@@ -53,12 +58,24 @@ using message = scattered_message<char>;
 class redis_service {
 private:
     inline unsigned get_cpu(const sstring& key) {
-        return std::hash<sstring>()(key) % smp::count;
+        return redis_key::shard_hash_of(key) % smp::count;
     }
     inline unsigned get_cpu(const redis_key& key) {
-        return key.hash() % smp::count;
+        return key.get_cpu();
     }
+    // Returns true if all the @count keys from @first are owned by one shard,
+    // the multi-key commands on them run there at once.
+    bool on_one_shard(const sstring* first, size_t count, unsigned& cpu);
     distributed<database>& _db;
+    // Runs @func on the shard which owns the key. If the key is owned by the
+    // current shard, the local database is called directly, skipping the
+    // cross-core message.
+    // The result waits on the owner shard until the copies of the keys changed
+    // by @func are dropped, see database::replicated().
+    template <typename Ret, typename... FuncArgs, typename... Args, typename FutureRet = futurize_t<Ret>>
+    FutureRet invoke_on(unsigned cpu, Ret (database::*func)(FuncArgs...), Args&&... args);
+    // The current shard if it holds a copy of the key, or the owner shard.
+    unsigned get_read_cpu(const redis_key& key);
 public:
     redis_service(distributed<database>& db) : _db(db)
     {
@@ -76,6 +93,7 @@ public:
     future<> mset(args_collection& args, output_stream<char>& out);
     future<> set(args_collection& args, output_stream<char>& out);
     future<> del(args_collection& args, output_stream<char>& out);
+    future<> unlink(args_collection& args, output_stream<char>& out);
     future<> exists(args_collection& args, output_stream<char>& out);
     future<> append(args_collection& args, output_stream<char>& out);
     future<> strlen(args_collection& args, output_stream<char>& out);
@@ -89,6 +107,15 @@ public:
     future<> rpushx(args_collection& args, output_stream<char>& out);
     future<> lpop(args_collection& args, output_stream<char>& out);
     future<> rpop(args_collection& args, output_stream<char>& out);
+    // BLPOP key [key ...] timeout and BRPOP, the client blocks until one of the
+    // lists is pushed to, or for @timeout seconds, 0 means forever.
+    // The connection blocks as @client, see unblock().
+    future<> blpop(args_collection& args, blocked_client& client, output_stream<char>& out);
+    future<> brpop(args_collection& args, blocked_client& client, output_stream<char>& out);
+    // BLMOVE source destination LEFT|RIGHT LEFT|RIGHT timeout.
+    future<> blmove(args_collection& args, blocked_client& client, output_stream<char>& out);
+    // Unblocks @client on every shard, its connection is gone.
+    future<> unblock(blocked_client& client);
     future<> llen(args_collection& args, output_stream<char>& out);
     future<> lindex(args_collection& args, output_stream<char>& out);
     future<> linsert(args_collection& args, output_stream<char>& out);
@@ -111,6 +138,7 @@ public:
     future<> hgetall_keys(args_collection& args, output_stream<char>& out);
     future<> hgetall_values(args_collection& args, output_stream<char>& out);
     future<> hmget(args_collection& args, output_stream<char>& out);
+    future<> hscan(args_collection& args, output_stream<char>& out);
 
     // [SET]
     future<> sadd(args_collection& args, output_stream<char>& out);
@@ -118,6 +146,7 @@ public:
     future<> srem(args_collection& args, output_stream<char>& out);
     future<> sismember(args_collection& args, output_stream<char>& out);
     future<> smembers(args_collection& args, output_stream<char>& out);
+    future<> sscan(args_collection& args, output_stream<char>& out);
     future<> sdiff(args_collection& args, output_stream<char>& out);
     future<> sdiff_store(args_collection& args, output_stream<char>& out);
     future<> sinter(args_collection& args, output_stream<char>& out);
@@ -129,9 +158,12 @@ public:
     future<> spop(args_collection& args, output_stream<char>& out);
 
     future<> type(args_collection& args, output_stream<char>& out);
+    // The cursor of SCAN holds the shard it continues on, see database::scan().
+    future<> scan(args_collection& args, output_stream<char>& out);
     future<> expire(args_collection& args, output_stream<char>& out);
     future<> persist(args_collection& args, output_stream<char>& out);
     future<> pexpire(args_collection& args, output_stream<char>& out);
+    future<> pexpireat(args_collection& args, output_stream<char>& out);
     future<> ttl(args_collection& args, output_stream<char>& out);
     future<> pttl(args_collection& args, output_stream<char>& out);
 
@@ -145,6 +177,7 @@ public:
     future<> zrank(args_collection&, bool, output_stream<char>& out);
     future<> zrem(args_collection&, output_stream<char>& out);
     future<> zscore(args_collection&, output_stream<char>& out);
+    future<> zscan(args_collection&, output_stream<char>& out);
     future<> zunionstore(args_collection&, output_stream<char>& out);
     future<> zinterstore(args_collection&, output_stream<char>& out);
     future<> zdiffstore(args_collection&, output_stream<char>& out);
@@ -156,7 +189,19 @@ public:
     future<> zrevrangebylex(args_collection&, output_stream<char>& out);
     future<> zremrangebyscore(args_collection&, output_stream<char>& out);
     future<> zremrangebyrank(args_collection&, output_stream<char>& out);
-    future<> select(args_collection&, output_stream<char>& out);
+
+    // [DATABASES]
+    // The database selected by the connection whose command runs now. The
+    // connection sets it before every command, and the commands calling the
+    // shards again from a continuation set it again first.
+    static unsigned& selected_db();
+    // Selects the database of the connection @db, only the database 0 is
+    // served in cluster mode.
+    future<> select(args_collection&, unsigned& db, output_stream<char>& out);
+    // FLUSHDB and FLUSHALL return at once, the entries are freed in the background.
+    future<> flushdb(args_collection&, output_stream<char>& out);
+    future<> flushall(args_collection&, output_stream<char>& out);
+    future<> swapdb(args_collection&, output_stream<char>& out);
 
     // [GEO]
     future<> geoadd(args_collection&, output_stream<char>& out);
@@ -164,6 +209,7 @@ public:
     future<> geodist(args_collection&, output_stream<char>& out);
     future<> geohash(args_collection&, output_stream<char>& out);
     future<> georadius(args_collection&, bool, output_stream<char>& out);
+    future<> geosearch(args_collection&, output_stream<char>& out);
 
     // [BITMAP]
     future<> setbit(args_collection&, output_stream<char>& out);
@@ -177,18 +223,164 @@ public:
     future<> pfadd(args_collection&, output_stream<char>& out);
     future<> pfcount(args_collection&, output_stream<char>& out);
     future<> pfmerge(args_collection&, output_stream<char>& out);
+
+    // [PIPELINE]
+    // A pipelined request is bound to a key owned by one shard. All requests
+    // of a batch are submitted to the owner shard in a single message, executed
+    // there back to back, and the replies are returned in the same order.
+    using pipelined_request = std::function<future<reply> (database&)>;
+    future<std::vector<reply>> pipeline(unsigned cpu, std::vector<pipelined_request>& requests);
+    // Whether the reads of @key are served by a copy held by the current shard.
+    bool holds_copy(const sstring& key);
+
+    // [TRANSACTIONS]
+    // Watches @key of the database @db on its owner shard @cpu, and returns
+    // its version.
+    future<uint64_t> watch(unsigned cpu, size_t db, const sstring& key);
+    future<> unwatch(std::vector<watched_key>& keys);
+    // Whether none of the @keys, all owned by the current shard, changed since
+    // they were watched.
+    bool watched_unchanged_here(const std::vector<watched_key>& keys);
+
+    // [REPLICAS]
+    // Asks the owner shard of @key to publish copies of it, @key is requested
+    // often by the clients of the current shard.
+    future<> replicate(const sstring& key);
+
+    // [PERSISTENCE]
+    // Every shard saves its data to its own RDB file in @directory, see shard_file_path().
+    void configure_snapshot(const sstring& directory, const sstring& dbfilename);
+    // Loads the snapshot files on all shards in parallel. The files are the ones
+    // of every shard, or a single file, e.g. of Redis, loaded by shard 0.
+    future<> load_snapshot();
+    future<> save(args_collection&, output_stream<char>& out);
+    future<> bgsave(args_collection&, output_stream<char>& out);
+    future<> lastsave(args_collection&, output_stream<char>& out);
+    // Every shard appends the changes of its data to its own log, see append_only_log.
+    void configure_append_only(bool enabled);
+    future<> bgrewriteaof(args_collection&, output_stream<char>& out);
+
+    // [REPLICATION]
+    // Starts the links of the shards to a master, idle until REPLICAOF. The
+    // snapshot of a full sync is written to @directory before it's loaded.
+    future<> start_replication(sstring directory);
+    future<> stop_replication();
+    // Every shard follows the same shard of the master at @host:@port.
+    future<> follow(sstring host, uint16_t port);
+    // REPLICAOF host port | NO ONE, and SLAVEOF.
+    future<> replicaof(args_collection& args, output_stream<char>& out);
+    // PSYNC replid offset shard shards, sent by a shard of a replica. The
+    // connection streams the changes of that shard from then on.
+    future<> psync(args_collection& args, output_stream<char>& out);
+
+    // [CLUSTER]
+    // Every shard gets the view of the cluster of this node, loaded from @path,
+    // if the cluster mode is @enabled. The node is reached at @host:@port.
+    future<> start_cluster(bool enabled, sstring path, sstring host, uint16_t port);
+    future<> stop_cluster();
+    inline cluster_state& local_cluster() { return _cluster.local(); }
+    // CLUSTER INFO | MYID | NODES | SLOTS | SHARDS | KEYSLOT | COUNTKEYSINSLOT |
+    // GETKEYSINSLOT | ADDSLOTS | ADDSLOTSRANGE | DELSLOTS | DELSLOTSRANGE |
+    // SETSLOT | MEET | FORGET | SAVECONFIG.
+    future<> cluster(args_collection& args, output_stream<char>& out);
+    // MIGRATE host port key|"" destination-db timeout [COPY] [REPLACE] [KEYS key...],
+    // run by the shard owning the keys.
+    future<> migrate(args_collection& args, output_stream<char>& out);
+    // The redirect of a request on the @keys of @slot, migrating from this node:
+    // empty if all the keys are still here, ASK if none is, TRYAGAIN otherwise.
+    future<sstring> migrating_redirect(unsigned slot, std::vector<sstring>& keys);
+
+    // [PUBSUB]
+    future<> start_pubsub();
+    future<> stop_pubsub();
+    // SUBSCRIBE channel [channel ...] and PSUBSCRIBE pattern [pattern ...] of
+    // the connection of @s.
+    future<> subscribe(args_collection& args, subscriber& s, output_stream<char>& out);
+    future<> psubscribe(args_collection& args, subscriber& s, output_stream<char>& out);
+    // UNSUBSCRIBE [channel ...] and PUNSUBSCRIBE [pattern ...], all of them if
+    // none is given.
+    future<> unsubscribe(args_collection& args, subscriber& s, output_stream<char>& out);
+    future<> punsubscribe(args_collection& args, subscriber& s, output_stream<char>& out);
+    // Drops all the subscriptions of @s, whose connection closes.
+    future<> unsubscribe_all(subscriber& s);
+    // PUBLISH channel message, the reply is the number of clients it reached.
+    future<> publish(args_collection& args, output_stream<char>& out);
+    // PUBSUB CHANNELS [pattern] | NUMSUB [channel ...] | NUMPAT.
+    future<> pubsub_command(args_collection& args, output_stream<char>& out);
+
+    // [SHARDS]
+    // Every shard also listens on @base + its id, if @base is not 0.
+    void configure_shard_ports(uint16_t base);
+    // SHARDS [KEYSHARD key], the layout of the shards for the shard aware
+    // clients: their count, the base of their ports and how a key is mapped to
+    // its owner, or the owner of a key.
+    future<> shards(args_collection& args, output_stream<char>& out);
+
+    // [INFO]
+    // INFO [section], the statistics are summed over the shards, the "shards"
+    // section lists the ones of every shard.
+    future<> info(args_collection& args, output_stream<char>& out);
+    // MEMORY USAGE key [SAMPLES count], the value is always measured whole.
+    future<> memory(args_collection& args, output_stream<char>& out);
+    // HOTKEYS [COUNT n], the keys accessed the most often, sampled by every shard,
+    // with their owner shard and their estimated accesses per second.
+    future<> hotkeys(args_collection& args, output_stream<char>& out);
 private:
+    steady_clock_type::time_point _started = steady_clock_type::now();
+    // The saving of the shards is coordinated by shard 0, the snapshot state is
+    // touched on shard 0 only.
+    sstring _snapshot_directory {"."};
+    sstring _snapshot_dbfilename {"dump.rdb"};
+    bool _saving = false;
+    time_t _last_save = 0;
+    bool _append_only = false;
+    uint16_t _shard_ports_base = 0;
+    bool _rewriting = false;
+    distributed<replica_link> _replica_links;
+    distributed<cluster_state> _cluster;
+    distributed<pubsub> _pubsub;
+    // Subscribes @s to the channels or the patterns @names, or unsubscribes it
+    // unless @add. The other shards learn this one has subscribers to a name
+    // before the reply, the messages published from then on reach it.
+    future<> change_subscriptions(std::vector<sstring> names, bool patterns, bool add, subscriber& s, output_stream<char>& out);
+    // Changes the view of the cluster on shard 0 by @change, which returns the
+    // reply, an error leaves the view as it was. The view is copied to the
+    // other shards and saved.
+    future<> change_cluster(std::function<sstring (cluster_config&)> change, output_stream<char>& out);
+    // Copies the view of the cluster of shard 0 to the other shards.
+    future<> copy_cluster(cluster_config config);
+    // Saves all shards in parallel, returns false if any of them failed.
+    future<bool> save_all();
     future<std::pair<size_t, int>> zadds_impl(sstring& key, std::unordered_map<sstring, double>&& members, int flags);
     future<bool> exists_impl(sstring& key);
+    // Moves the @count keys from @first into the groups of their owner shards,
+    // @positions records where every key went.
+    void group_by_shard(sstring* first, size_t count, std::vector<std::vector<sstring>>& groups, std::vector<std::pair<unsigned, size_t>>* positions = nullptr);
+    // Runs the multi-key command @func once for every shard owning some of @groups.
+    template <typename Func>
+    future<> for_each_shard(std::vector<std::vector<sstring>>& groups, Func&& func);
     future<> srem_impl(sstring& key, sstring& member, output_stream<char>& out);
     future<> sadd_impl(sstring& key, sstring& member, output_stream<char>& out);
     future<> sadds_impl(sstring& key, std::vector<sstring>& members, output_stream<char>& out);
-    future<> sadds_impl_return_keys(sstring& key, std::vector<sstring>& members, output_stream<char>& out);
+    future<> sstore_impl(sstring& key, std::vector<sstring>& members, output_stream<char>& out);
+    future<> sfilter_impl(std::vector<sstring>& keys, sstring* dest, bool intersect, output_stream<char>& out);
     future<> sdiff_impl(std::vector<sstring>& keys, sstring* dest, output_stream<char>& out);
     future<> sinter_impl(std::vector<sstring>& keys, sstring* dest, output_stream<char>& out);
     future<> sunion_impl(std::vector<sstring>& keys, sstring* dest, output_stream<char>& out);
     future<> smembers_impl(sstring& key, output_stream<char>& out);
+    using collection_scan = future<reply> (database::*)(const redis_key&, size_t, const sstring&, size_t);
+    future<> scan_impl(args_collection& args, collection_scan scan, output_stream<char>& out);
     future<> pop_impl(args_collection& args, bool left, output_stream<char>& out);
+    future<> bpop_impl(args_collection& args, bool left, blocked_client& client, output_stream<char>& out);
+    // Pops from the first list of @keys holding an element, blocking on them
+    // as @client until @deadline if they are all empty.
+    future<blocked_pop> block_pop(std::vector<sstring>& keys, bool left, lowres_clock::time_point deadline, blocked_client& client);
+    // Blocks on the @keys of the database @db of several shards until one is
+    // pushed to, false if none was until @deadline.
+    future<bool> wait_lists(std::vector<sstring>& keys, unsigned db, bool left, lowres_clock::time_point deadline, blocked_client& client);
+    // Pushes the element popped for @client back to its list if the client
+    // is gone meanwhile.
+    future<blocked_pop> give_back(blocked_pop result, unsigned db, bool left, blocked_client& client);
     future<> push_impl(args_collection& arg, bool force, bool left, output_stream<char>& out);
     future<> push_impl(sstring& key, sstring& value, bool force, bool left, output_stream<char>& out);
     future<> push_impl(sstring& key, std::vector<sstring>& vals, bool force, bool left, output_stream<char>& out);
@@ -196,7 +388,8 @@ private:
     future<bool> sadd_direct(sstring& key, sstring& member);
     future<bool> set_impl(sstring& key, sstring& value, long expir, uint8_t flag);
     //future<item_ptr> get_impl(sstring& key);
-    future<bool> remove_impl(sstring& key);
+    future<bool> remove_impl(sstring& key, bool lazily);
+    future<> del_impl(args_collection& args, bool lazily, output_stream<char>& out);
     future<int> hdel_impl(sstring& key, sstring& field);
     future<> counter_by(args_collection& args, bool incr, bool with_step, output_stream<char>& out);
     using georadius_result_type = std::pair<std::vector<std::tuple<sstring, double, double, double, double>>, int>;
@@ -206,21 +399,10 @@ private:
         size_t numkeys;
         std::vector<sstring> keys;
         std::vector<double> weights;
-        int aggregate_flag;
+        int aggregate_flag = 0;
     };
     bool parse_zset_args(args_collection& args, zset_args& uargs);
-    static inline double score_aggregation(const double& old, const double& newscore, int flag)
-    {
-        if (flag == ZAGGREGATE_MIN) {
-            return std::min(old, newscore);
-        }
-        else if (flag == ZAGGREGATE_SUM) {
-            return old + newscore;
-        }
-        else {
-            return std::max(old, newscore);
-        }
-    }
+    future<> zstore_impl(zset_args& uargs, bool intersect, output_stream<char>& out);
 };
 
 } /* namespace redis */
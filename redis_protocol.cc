@@ -21,249 +21,1233 @@
 #include "redis_protocol.hh"
 #include "redis.hh"
 #include "common.hh"
+#include "db.hh"
+#include "cluster.hh"
 #include <algorithm>
+#include <boost/range/irange.hpp>
+#include <iomanip>
+#include <sstream>
 
 namespace redis {
 
-redis_protocol::redis_protocol(redis_service& redis) : _redis(redis)
+static const char* command_names[] = {
+    "set", "mset", "get", "mget", "del", "echo", "ping", "incr", "decr", "incrby", "decrby",
+    "command", "exists", "append", "strlen", "lpush", "lpushx", "lpop", "llen", "lindex",
+    "linsert", "lrange", "lset", "rpush", "rpushx", "rpop", "lrem", "ltrim", "hset", "hdel",
+    "hget", "hlen", "hexists", "hstrlen", "hincrby", "hincrbyfloat", "hkeys", "hvals", "hmget",
+    "hmset", "hgetall", "sadd", "scard", "sismember", "smembers", "srem", "sdiff", "sdiffstore",
+    "sinter", "sinterstore", "sunion", "sunionstore", "smove", "srandmember", "spop", "type",
+    "expire", "pexpire", "ttl", "pttl", "persist", "zadd", "zcard", "zcount", "zincrby", "zrange",
+    "zrangebyscore", "zrank", "zrem", "zremrangebyrank", "zremrangebyscore", "zrevrange",
+    "zrevrangebyscore", "zrevrank", "zscore", "zunionstore", "zinterstore", "zdiffstore", "zunion",
+    "zinter", "zdiff", "zscan", "scan", "hscan", "sscan", "zrangebylex", "zlexcount", "zremrangebylex",
+    "select", "geoadd",
+    "geohash", "geodist", "geopos", "georadius", "georadiusbymember", "geosearch", "setbit", "getbit",
+    "bitcount", "bitop", "bitpos", "bitfield", "pfadd", "pfcount", "pfmerge", "info", "save",
+    "bgsave", "lastsave", "pexpireat", "bgrewriteaof", "memory", "hotkeys", "replicaof",
+    "psync", "cluster", "asking", "migrate", "blpop", "brpop", "blmove", "subscribe",
+    "unsubscribe", "psubscribe", "punsubscribe", "publish", "pubsub", "shards", "unlink", "flushdb",
+    "flushall", "swapdb", "multi", "exec", "discard", "watch", "unwatch", "unknown"
+};
+static_assert(sizeof(command_names) / sizeof(command_names[0]) == redis_protocol_parser::COMMAND_COUNT, "the name of every command is required");
+
+const char* command_name(redis_protocol_parser::command command)
+{
+    return command_names[static_cast<size_t>(command)];
+}
+
+thread_local request_latency_tracer* request_latency_tracer::_local = nullptr;
+
+redis_protocol::redis_protocol(redis_service& redis, bool routed) : _redis(redis), _routed(routed)
+{
+}
+
+subscriber& redis_protocol::subscriber_of(output_stream<char>& out)
+{
+    if (!_subscriber) {
+        _subscriber = std::make_unique<subscriber>(out, _disconnect ? _disconnect : std::function<void ()>([] {}));
+    }
+    return *_subscriber;
+}
+
+future<> redis_protocol::close()
+{
+    // the input read while a client was blocked ends with the connection.
+    if (!_input_watch.available() && _disconnect) {
+        _disconnect();
+    }
+    auto watch = std::move(_input_watch);
+    _input_watch = make_ready_future<>();
+    return watch.then([this] {
+        return release_watched();
+    }).then([this] {
+        if (!_subscriber) {
+            return make_ready_future<>();
+        }
+        return _redis.unsubscribe_all(*_subscriber).then([this] {
+            return _subscriber->close();
+        });
+    });
+}
+
+future<> redis_protocol::watch_input(input_stream<char>& in)
+{
+    return repeat([this, &in] {
+        return in.read().then([this] (temporary_buffer<char> buf) {
+            if (buf.empty()) {
+                client_gone();
+                return stop_iteration::yes;
+            }
+            _stashed_size += buf.size();
+            _stashed.push_back(std::move(buf));
+            return stop_iteration(!_blocking || _stashed_size >= STASHED_INPUT_MAX);
+        });
+    }).handle_exception([this] (std::exception_ptr e) {
+        client_gone();
+    });
+}
+
+void redis_protocol::client_gone()
+{
+    if (!_blocking || _blocked._gone) {
+        return;
+    }
+    (void)_redis.unblock(_blocked).handle_exception([] (std::exception_ptr e) {});
+}
+
+future<> redis_protocol::consume(input_stream<char>& in)
+{
+    if (_stashed.empty()) {
+        return in.consume(_parser);
+    }
+    auto buf = std::move(_stashed.front());
+    _stashed.pop_front();
+    _stashed_size -= buf.size();
+    return _parser(std::move(buf)).then([this, &in] (auto remainder) {
+        if (!remainder) {
+            return consume(in);
+        }
+        if (!remainder->empty()) {
+            _stashed_size += remainder->size();
+            _stashed.push_front(std::move(*remainder));
+        }
+        return make_ready_future<>();
+    });
+}
+
+future<> redis_protocol::execute_blocking(request& req, input_stream<char>& in, output_stream<char>& out, request_latency_tracer& tracer)
+{
+    _blocked = blocked_client {};
+    _blocking = true;
+    if (_input_watch.available()) {
+        _input_watch = watch_input(in);
+    }
+    return execute(req, out, tracer).finally([this] {
+        _blocking = false;
+    });
+}
+
+static size_t memory_of(const std::vector<sstring>& strings)
+{
+    auto bytes = strings.capacity() * sizeof(sstring);
+    for (auto& s : strings) {
+        bytes += s.size();
+    }
+    return bytes;
+}
+
+// About the bytes of the containers of @args, the nodes of the maps included.
+static size_t memory_of(const args_collection& args)
+{
+    constexpr size_t node_size = 2 * sizeof(void*);
+    auto bytes = memory_of(args._command_args) + memory_of(args._tmp_keys);
+    for (auto& kv : args._tmp_key_values) {
+        bytes += sizeof(kv) + node_size + kv.first.size() + kv.second.size();
+    }
+    for (auto& kv : args._tmp_key_scores) {
+        bytes += sizeof(kv) + node_size + kv.first.size();
+    }
+    bytes += args._tmp_key_value_pairs.capacity() * sizeof(std::pair<sstring, sstring>);
+    for (auto& kv : args._tmp_key_value_pairs) {
+        bytes += kv.first.size() + kv.second.size();
+    }
+    return bytes;
+}
+
+size_t redis_protocol::memory_usage() const
 {
+    auto bytes = memory_of(_parser._args_list) + memory_of(_command_args) + _stashed_size;
+    for (auto requests : { &_pipeline, &_queued }) {
+        bytes += requests->capacity() * sizeof(request);
+        for (auto& req : *requests) {
+            bytes += memory_of(req._args) + req._redirect.size();
+        }
+    }
+    bytes += _spare_args.capacity() * sizeof(args_collection);
+    for (auto& args : _spare_args) {
+        bytes += memory_of(args);
+    }
+    bytes += _watched.capacity() * sizeof(watched_key);
+    for (auto& w : _watched) {
+        bytes += w._key.size();
+    }
+    bytes += _blocked._ids.capacity() * sizeof(uint64_t);
+    if (_subscriber) {
+        bytes += _subscriber->memory_usage();
+    }
+    return bytes;
 }
 
 void redis_protocol::prepare_request()
 {
+    if (!_spare_args.empty()) {
+        _command_args = std::move(_spare_args.back());
+        _spare_args.pop_back();
+    }
+    _command_args.reset();
     _command_args._command_args_count = _parser._args_count - 1;
-    _command_args._command_args = std::move(_parser._args_list);
-    _command_args._tmp_keys.clear();
-    _command_args._tmp_key_values.clear();
-    _command_args._tmp_key_scores.clear();
-    _command_args._tmp_key_value_pairs.clear();
+    // The parser gets the cleared vector back for the next request.
+    _command_args._command_args.swap(_parser._args_list);
 }
 
-future<> redis_protocol::handle(input_stream<char>& in, output_stream<char>& out, request_latency_tracer& tracer)
+future<> redis_protocol::dispatch(redis_protocol_parser::command command, args_collection& args, output_stream<char>& out, request_latency_tracer& tracer)
 {
-    _parser.init();
-    // NOTE: The command is handled sequentially. The parser will control the lifetime
-    // of every parameters for command.
-    return in.consume(_parser).then([this, &in, &out, &tracer] () -> future<> {
-        tracer.begin_trace_latency();
-        switch (_parser._state) {
-            case redis_protocol_parser::state::eof:
-            case redis_protocol_parser::state::error:
-                return make_ready_future<>();
+    switch (command) {
+    case redis_protocol_parser::command::set:
+        return _redis.set(args, std::ref(out));
+    case redis_protocol_parser::command::mset:
+        return _redis.mset(args, std::ref(out));
+    case redis_protocol_parser::command::get:
+        return _redis.get(args, std::ref(out));
+    case redis_protocol_parser::command::del:
+        return _redis.del(args, std::ref(out));
+    case redis_protocol_parser::command::unlink:
+        return _redis.unlink(args, std::ref(out));
+    case redis_protocol_parser::command::ping:
+        if (subscribed()) {
+            return out.write(msg_subscribed_pong);
+        }
+        return out.write(msg_pong);
+    case redis_protocol_parser::command::incr:
+        return _redis.incr(args, std::ref(out));
+    case redis_protocol_parser::command::decr:
+        return _redis.decr(args, std::ref(out));
+    case redis_protocol_parser::command::incrby:
+        return _redis.incrby(args, std::ref(out));
+    case redis_protocol_parser::command::decrby:
+        return _redis.decrby(args, std::ref(out));
+    case redis_protocol_parser::command::mget:
+        return _redis.mget(args, out);
+    case redis_protocol_parser::command::command:
+        return out.write(msg_ok);
+    case redis_protocol_parser::command::exists:
+        return _redis.exists(args, std::ref(out));
+    case redis_protocol_parser::command::append:
+        return _redis.append(args, std::ref(out));
+    case redis_protocol_parser::command::strlen:
+        return _redis.strlen(args, std::ref(out));
+    case redis_protocol_parser::command::lpush:
+        return _redis.lpush(args, std::ref(out));
+    case redis_protocol_parser::command::lpushx:
+        return _redis.lpushx(args, std::ref(out));
+    case redis_protocol_parser::command::lpop:
+        return _redis.lpop(args, std::ref(out));
+    case redis_protocol_parser::command::llen:
+        return _redis.llen(args, std::ref(out));
+    case redis_protocol_parser::command::lindex:
+        return _redis.lindex(args, std::ref(out));
+    case redis_protocol_parser::command::linsert:
+        return _redis.linsert(args, std::ref(out));
+    case redis_protocol_parser::command::lrange:
+        return _redis.lrange(args, std::ref(out));
+    case redis_protocol_parser::command::lset:
+        return _redis.lset(args, std::ref(out));
+    case redis_protocol_parser::command::rpush:
+        return _redis.rpush(args, std::ref(out));
+    case redis_protocol_parser::command::rpushx:
+        return _redis.rpushx(args, std::ref(out));
+    case redis_protocol_parser::command::rpop:
+        return _redis.rpop(args, std::ref(out));
+    case redis_protocol_parser::command::lrem:
+        return _redis.lrem(args, std::ref(out));
+    case redis_protocol_parser::command::ltrim:
+        return _redis.ltrim(args, std::ref(out));
+    case redis_protocol_parser::command::hset:
+        return _redis.hset(args, std::ref(out));
+    case redis_protocol_parser::command::hmset:
+        return _redis.hmset(args, std::ref(out));
+    case redis_protocol_parser::command::hdel:
+        return _redis.hdel(args, std::ref(out));
+    case redis_protocol_parser::command::hget:
+        return _redis.hget(args, std::ref(out));
+    case redis_protocol_parser::command::hlen:
+        return _redis.hlen(args, std::ref(out));
+    case redis_protocol_parser::command::hexists:
+        return _redis.hexists(args, std::ref(out));
+    case redis_protocol_parser::command::hstrlen:
+        return _redis.hstrlen(args, std::ref(out));
+    case redis_protocol_parser::command::hincrby:
+        return _redis.hincrby(args, std::ref(out));
+    case redis_protocol_parser::command::hincrbyfloat:
+        return _redis.hincrbyfloat(args, std::ref(out));
+    case redis_protocol_parser::command::hkeys:
+        return _redis.hgetall_keys(args, std::ref(out));
+    case redis_protocol_parser::command::hvals:
+        return _redis.hgetall_values(args, std::ref(out));
+    case redis_protocol_parser::command::hmget:
+        return _redis.hmget(args, std::ref(out));
+    case redis_protocol_parser::command::hgetall:
+        return _redis.hgetall(args, std::ref(out));
+    case redis_protocol_parser::command::sadd:
+        return _redis.sadd(args, std::ref(out));
+    case redis_protocol_parser::command::scard:
+        return _redis.scard(args, std::ref(out));
+    case redis_protocol_parser::command::sismember:
+        return _redis.sismember(args, std::ref(out));
+    case redis_protocol_parser::command::smembers:
+        return _redis.smembers(args, std::ref(out));
+    case redis_protocol_parser::command::srandmember:
+        return _redis.srandmember(args, std::ref(out));
+    case redis_protocol_parser::command::srem:
+        return _redis.srem(args, std::ref(out));
+    case redis_protocol_parser::command::sdiff:
+        return _redis.sdiff(args,std::ref(out));
+    case redis_protocol_parser::command::sdiffstore:
+        return _redis.sdiff_store(args, std::ref(out));
+    case redis_protocol_parser::command::sinter:
+        return _redis.sinter(args, std::ref(out));
+    case redis_protocol_parser::command::sinterstore:
+        return _redis.sinter_store(args, std::ref(out));
+    case redis_protocol_parser::command::sunion:
+        return _redis.sunion(args, std::ref(out));
+    case redis_protocol_parser::command::sunionstore:
+        return _redis.sunion_store(args, std::ref(out));
+    case redis_protocol_parser::command::smove:
+        return _redis.smove(args, std::ref(out));
+    case redis_protocol_parser::command::spop:
+        return _redis.spop(args, std::ref(out));
+    case redis_protocol_parser::command::type:
+        return _redis.type(args, std::ref(out));
+    case redis_protocol_parser::command::scan:
+        return _redis.scan(args, std::ref(out));
+    case redis_protocol_parser::command::hscan:
+        return _redis.hscan(args, std::ref(out));
+    case redis_protocol_parser::command::sscan:
+        return _redis.sscan(args, std::ref(out));
+    case redis_protocol_parser::command::zscan:
+        return _redis.zscan(args, std::ref(out));
+    case redis_protocol_parser::command::expire:
+        return _redis.expire(args, std::ref(out));
+    case redis_protocol_parser::command::pexpire:
+        return _redis.pexpire(args, std::ref(out));
+    case redis_protocol_parser::command::ttl:
+        return _redis.ttl(args, std::ref(out));
+    case redis_protocol_parser::command::pttl:
+        return _redis.pttl(args, std::ref(out));
+    case redis_protocol_parser::command::persist:
+        return _redis.persist(args, std::ref(out));
+    case redis_protocol_parser::command::zadd:
+        return _redis.zadd(args, std::ref(out));
+    case redis_protocol_parser::command::zrange:
+        return _redis.zrange(args, false, std::ref(out));
+    case redis_protocol_parser::command::zrevrange:
+        return _redis.zrange(args, true, std::ref(out));
+    case redis_protocol_parser::command::zrangebyscore:
+        return _redis.zrangebyscore(args, false, std::ref(out));
+    case redis_protocol_parser::command::zrevrangebyscore:
+        return _redis.zrangebyscore(args, true, std::ref(out));
+    case redis_protocol_parser::command::zrem:
+        return _redis.zrem(args, std::ref(out));
+    case redis_protocol_parser::command::zremrangebyscore:
+        return _redis.zremrangebyscore(args, std::ref(out));
+    case redis_protocol_parser::command::zremrangebyrank:
+        return _redis.zremrangebyrank(args, std::ref(out));
+    case redis_protocol_parser::command::zcard:
+        return _redis.zcard(args, std::ref(out));
+    case redis_protocol_parser::command::zcount:
+        return _redis.zcount(args, std::ref(out));
+    case redis_protocol_parser::command::zscore:
+        return _redis.zscore(args, std::ref(out));
+    case redis_protocol_parser::command::zincrby:
+        return _redis.zincrby(args, std::ref(out));
+    case redis_protocol_parser::command::zrank:
+        return _redis.zrank(args, false, std::ref(out));
+    case redis_protocol_parser::command::zrevrank:
+        return _redis.zrank(args, true, std::ref(out));
+    case redis_protocol_parser::command::zunionstore:
+        return _redis.zunionstore(args, std::ref(out));
+    case redis_protocol_parser::command::zinterstore:
+        return _redis.zinterstore(args, std::ref(out));
+    case redis_protocol_parser::command::select:
+        return _redis.select(args, _db_index, std::ref(out));
+    case redis_protocol_parser::command::flushdb:
+        return _redis.flushdb(args, std::ref(out));
+    case redis_protocol_parser::command::flushall:
+        return _redis.flushall(args, std::ref(out));
+    case redis_protocol_parser::command::swapdb:
+        return _redis.swapdb(args, std::ref(out));
+    case redis_protocol_parser::command::geoadd:
+        return _redis.geoadd(args, std::ref(out));
+    case redis_protocol_parser::command::geodist:
+        return _redis.geodist(args, std::ref(out));
+    case redis_protocol_parser::command::geopos:
+        return _redis.geopos(args, std::ref(out));
+    case redis_protocol_parser::command::geohash:
+        return _redis.geohash(args, std::ref(out));
+    case redis_protocol_parser::command::georadius:
+        return _redis.georadius(args, false, std::ref(out));
+    case redis_protocol_parser::command::georadiusbymember:
+        return _redis.georadius(args, true, std::ref(out));
+    case redis_protocol_parser::command::geosearch:
+        return _redis.geosearch(args, std::ref(out));
+    case redis_protocol_parser::command::setbit:
+        return _redis.setbit(args, std::ref(out));
+    case redis_protocol_parser::command::getbit:
+        return _redis.getbit(args, std::ref(out));
+    case redis_protocol_parser::command::bitcount:
+        return _redis.bitcount(args, std::ref(out));
+    case redis_protocol_parser::command::bitpos:
+        return _redis.bitpos(args, std::ref(out));
+    case redis_protocol_parser::command::bitop:
+        return _redis.bitop(args, std::ref(out));
+    case redis_protocol_parser::command::pfadd:
+        return _redis.pfadd(args, std::ref(out));
+    case redis_protocol_parser::command::pfcount:
+        return _redis.pfcount(args, std::ref(out));
+    case redis_protocol_parser::command::pfmerge:
+        return _redis.pfmerge(args, std::ref(out));
+    case redis_protocol_parser::command::info:
+        return _redis.info(args, std::ref(out));
+    case redis_protocol_parser::command::memory:
+        return _redis.memory(args, std::ref(out));
+    case redis_protocol_parser::command::hotkeys:
+        return _redis.hotkeys(args, std::ref(out));
+    case redis_protocol_parser::command::replicaof:
+        return _redis.replicaof(args, std::ref(out));
+    case redis_protocol_parser::command::psync:
+        return _redis.psync(args, std::ref(out));
+    case redis_protocol_parser::command::cluster:
+        return _redis.cluster(args, std::ref(out));
+    case redis_protocol_parser::command::asking:
+        return out.write(_redis.local_cluster().enabled() ? msg_ok : msg_cluster_disabled_err);
+    case redis_protocol_parser::command::migrate:
+        return _redis.migrate(args, std::ref(out));
+    case redis_protocol_parser::command::blpop:
+        return _redis.blpop(args, _blocked, std::ref(out));
+    case redis_protocol_parser::command::brpop:
+        return _redis.brpop(args, _blocked, std::ref(out));
+    case redis_protocol_parser::command::blmove:
+        return _redis.blmove(args, _blocked, std::ref(out));
+    case redis_protocol_parser::command::subscribe:
+        return _redis.subscribe(args, subscriber_of(out), std::ref(out));
+    case redis_protocol_parser::command::unsubscribe:
+        return _redis.unsubscribe(args, subscriber_of(out), std::ref(out));
+    case redis_protocol_parser::command::psubscribe:
+        return _redis.psubscribe(args, subscriber_of(out), std::ref(out));
+    case redis_protocol_parser::command::punsubscribe:
+        return _redis.punsubscribe(args, subscriber_of(out), std::ref(out));
+    case redis_protocol_parser::command::publish:
+        return _redis.publish(args, std::ref(out));
+    case redis_protocol_parser::command::pubsub:
+        return _redis.pubsub_command(args, std::ref(out));
+    case redis_protocol_parser::command::shards:
+        return _redis.shards(args, std::ref(out));
+    case redis_protocol_parser::command::save:
+        return _redis.save(args, std::ref(out));
+    case redis_protocol_parser::command::bgsave:
+        return _redis.bgsave(args, std::ref(out));
+    case redis_protocol_parser::command::lastsave:
+        return _redis.lastsave(args, std::ref(out));
+    case redis_protocol_parser::command::pexpireat:
+        return _redis.pexpireat(args, std::ref(out));
+    case redis_protocol_parser::command::bgrewriteaof:
+        return _redis.bgrewriteaof(args, std::ref(out));
+    case redis_protocol_parser::command::multi:
+        return multi(out);
+    case redis_protocol_parser::command::exec:
+        return exec(out, tracer);
+    case redis_protocol_parser::command::discard:
+        return discard(out);
+    case redis_protocol_parser::command::watch:
+        return watch(args, out);
+    case redis_protocol_parser::command::unwatch:
+        return unwatch(out);
+    default:
+        tracer.incr_number_exceptions();
+        return out.write("+Not Implemented");
+    };
+    std::abort();
+}
 
-            case redis_protocol_parser::state::ok:
-            {
-                prepare_request();
-                switch (_parser._command) {
-                case redis_protocol_parser::command::set:
-                    return _redis.set(_command_args, std::ref(out));
-                case redis_protocol_parser::command::mset:
-                    return _redis.mset(_command_args, std::ref(out));
-                case redis_protocol_parser::command::get:
-                    return _redis.get(_command_args, std::ref(out));
-                case redis_protocol_parser::command::del:
-                    return _redis.del(_command_args, std::ref(out));
-                case redis_protocol_parser::command::ping:
-                    return out.write(msg_pong);
-                case redis_protocol_parser::command::incr:
-                    return _redis.incr(_command_args, std::ref(out));
-                case redis_protocol_parser::command::decr:
-                    return _redis.incr(_command_args, std::ref(out));
-                case redis_protocol_parser::command::incrby:
-                    return _redis.incrby(_command_args, std::ref(out));
-                case redis_protocol_parser::command::decrby:
-                    return _redis.decrby(_command_args, std::ref(out));
-                case redis_protocol_parser::command::mget:
-                    return _redis.mget(_command_args, out);
-                case redis_protocol_parser::command::command:
-                    return out.write(msg_ok);
-                case redis_protocol_parser::command::exists:
-                    return _redis.exists(_command_args, std::ref(out));
-                case redis_protocol_parser::command::append:
-                    return _redis.append(_command_args, std::ref(out));
-                case redis_protocol_parser::command::strlen:
-                    return _redis.strlen(_command_args, std::ref(out));
-                case redis_protocol_parser::command::lpush:
-                    return _redis.lpush(_command_args, std::ref(out));
-                case redis_protocol_parser::command::lpushx:
-                    return _redis.lpushx(_command_args, std::ref(out));
-                case redis_protocol_parser::command::lpop:
-                    return _redis.lpop(_command_args, std::ref(out));
-                case redis_protocol_parser::command::llen:
-                    return _redis.llen(_command_args, std::ref(out));
-                case redis_protocol_parser::command::lindex:
-                    return _redis.lindex(_command_args, std::ref(out));
-                case redis_protocol_parser::command::linsert:
-                    return _redis.linsert(_command_args, std::ref(out));
-                case redis_protocol_parser::command::lrange:
-                    return _redis.lrange(_command_args, std::ref(out));
-                case redis_protocol_parser::command::lset:
-                    return _redis.lset(_command_args, std::ref(out));
-                case redis_protocol_parser::command::rpush:
-                    return _redis.rpush(_command_args, std::ref(out));
-                case redis_protocol_parser::command::rpushx:
-                    return _redis.rpushx(_command_args, std::ref(out));
-                case redis_protocol_parser::command::rpop:
-                    return _redis.rpop(_command_args, std::ref(out));
-                case redis_protocol_parser::command::lrem:
-                    return _redis.lrem(_command_args, std::ref(out));
-                case redis_protocol_parser::command::ltrim:
-                    return _redis.ltrim(_command_args, std::ref(out));
-                case redis_protocol_parser::command::hset:
-                    return _redis.hset(_command_args, std::ref(out));
-                case redis_protocol_parser::command::hmset:
-                    return _redis.hmset(_command_args, std::ref(out));
-                case redis_protocol_parser::command::hdel:
-                    return _redis.hdel(_command_args, std::ref(out));
-                case redis_protocol_parser::command::hget:
-                    return _redis.hget(_command_args, std::ref(out));
-                case redis_protocol_parser::command::hlen:
-                    return _redis.hlen(_command_args, std::ref(out));
-                case redis_protocol_parser::command::hexists:
-                    return _redis.hexists(_command_args, std::ref(out));
-                case redis_protocol_parser::command::hstrlen:
-                    return _redis.hstrlen(_command_args, std::ref(out));
-                case redis_protocol_parser::command::hincrby:
-                    return _redis.hincrby(_command_args, std::ref(out));
-                case redis_protocol_parser::command::hincrbyfloat:
-                    return _redis.hincrbyfloat(_command_args, std::ref(out));
-                case redis_protocol_parser::command::hkeys:
-                    return _redis.hgetall_keys(_command_args, std::ref(out));
-                case redis_protocol_parser::command::hvals:
-                    return _redis.hgetall_values(_command_args, std::ref(out));
-                case redis_protocol_parser::command::hmget:
-                    return _redis.hmget(_command_args, std::ref(out));
-                case redis_protocol_parser::command::hgetall:
-                    return _redis.hgetall(_command_args, std::ref(out));
-                case redis_protocol_parser::command::sadd:
-                    return _redis.sadd(_command_args, std::ref(out));
-                case redis_protocol_parser::command::scard:
-                    return _redis.scard(_command_args, std::ref(out));
-                case redis_protocol_parser::command::sismember:
-                    return _redis.sismember(_command_args, std::ref(out));
-                case redis_protocol_parser::command::smembers:
-                    return _redis.smembers(_command_args, std::ref(out));
-                case redis_protocol_parser::command::srandmember:
-                    return _redis.srandmember(_command_args, std::ref(out));
-                case redis_protocol_parser::command::srem:
-                    return _redis.srem(_command_args, std::ref(out));
-                case redis_protocol_parser::command::sdiff:
-                    return _redis.sdiff(_command_args,std::ref(out));
-                case redis_protocol_parser::command::sdiffstore:
-                    return _redis.sdiff_store(_command_args, std::ref(out));
-                case redis_protocol_parser::command::sinter:
-                    return _redis.sinter(_command_args, std::ref(out));
-                case redis_protocol_parser::command::sinterstore:
-                    return _redis.sinter_store(_command_args, std::ref(out));
-                case redis_protocol_parser::command::sunion:
-                    return _redis.sunion(_command_args, std::ref(out));
-                case redis_protocol_parser::command::sunionstore:
-                    return _redis.sunion_store(_command_args, std::ref(out));
-                case redis_protocol_parser::command::smove:
-                    return _redis.smove(_command_args, std::ref(out));
-                case redis_protocol_parser::command::spop:
-                    return _redis.spop(_command_args, std::ref(out));
-                case redis_protocol_parser::command::type:
-                    return _redis.type(_command_args, std::ref(out));
-                case redis_protocol_parser::command::expire:
-                    return _redis.expire(_command_args, std::ref(out));
-                case redis_protocol_parser::command::pexpire:
-                    return _redis.pexpire(_command_args, std::ref(out));
-                case redis_protocol_parser::command::ttl:
-                    return _redis.ttl(_command_args, std::ref(out));
-                case redis_protocol_parser::command::pttl:
-                    return _redis.pttl(_command_args, std::ref(out));
-                case redis_protocol_parser::command::persist:
-                    return _redis.persist(_command_args, std::ref(out));
-                case redis_protocol_parser::command::zadd:
-                    return _redis.zadd(_command_args, std::ref(out));
-                case redis_protocol_parser::command::zrange:
-                    return _redis.zrange(_command_args, false, std::ref(out));
-                case redis_protocol_parser::command::zrevrange:
-                    return _redis.zrange(_command_args, true, std::ref(out));
-                case redis_protocol_parser::command::zrangebyscore:
-                    return _redis.zrangebyscore(_command_args, false, std::ref(out));
-                case redis_protocol_parser::command::zrevrangebyscore:
-                    return _redis.zrangebyscore(_command_args, true, std::ref(out));
-                case redis_protocol_parser::command::zrem:
-                    return _redis.zrem(_command_args, std::ref(out));
-                case redis_protocol_parser::command::zremrangebyscore:
-                    return _redis.zremrangebyscore(_command_args, std::ref(out));
-                case redis_protocol_parser::command::zremrangebyrank:
-                    return _redis.zremrangebyrank(_command_args, std::ref(out));
-                case redis_protocol_parser::command::zcard:
-                    return _redis.zcard(_command_args, std::ref(out));
-                case redis_protocol_parser::command::zcount:
-                    return _redis.zcount(_command_args, std::ref(out));
-                case redis_protocol_parser::command::zscore:
-                    return _redis.zscore(_command_args, std::ref(out));
-                case redis_protocol_parser::command::zincrby:
-                    return _redis.zincrby(_command_args, std::ref(out));
-                case redis_protocol_parser::command::zrank:
-                    return _redis.zrank(_command_args, false, std::ref(out));
-                case redis_protocol_parser::command::zrevrank:
-                    return _redis.zrank(_command_args, true, std::ref(out));
-                case redis_protocol_parser::command::zunionstore:
-                    return _redis.zunionstore(_command_args, std::ref(out));
-                case redis_protocol_parser::command::zinterstore:
-                    return _redis.zinterstore(_command_args, std::ref(out));
-                case redis_protocol_parser::command::select:
-                    return _redis.select(_command_args, std::ref(out));
-                case redis_protocol_parser::command::geoadd:
-                    return _redis.geoadd(_command_args, std::ref(out));
-                case redis_protocol_parser::command::geodist:
-                    return _redis.geodist(_command_args, std::ref(out));
-                case redis_protocol_parser::command::geopos:
-                    return _redis.geopos(_command_args, std::ref(out));
-                case redis_protocol_parser::command::geohash:
-                    return _redis.geohash(_command_args, std::ref(out));
-                case redis_protocol_parser::command::georadius:
-                    return _redis.georadius(_command_args, false, std::ref(out));
-                case redis_protocol_parser::command::georadiusbymember:
-                    return _redis.georadius(_command_args, true, std::ref(out));
-                case redis_protocol_parser::command::setbit:
-                    return _redis.setbit(_command_args, std::ref(out));
-                case redis_protocol_parser::command::getbit:
-                    return _redis.getbit(_command_args, std::ref(out));
-                case redis_protocol_parser::command::bitcount:
-                    return _redis.bitcount(_command_args, std::ref(out));
-
-                /*
-                case redis_protocol_parser::command::bitpos:
-                    return _redis.bitpos(_command_args).then([&out] (auto&& m) {
-                        return out.write(std::move(m));
-                    });
-                case redis_protocol_parser::command::bitop:
-                    return _redis.bitop(_command_args).then([&out] (auto&& m) {
-                        return out.write(std::move(m));
-                    });
-                */
-                case redis_protocol_parser::command::pfadd:
-                    return _redis.pfadd(_command_args, std::ref(out));
-                case redis_protocol_parser::command::pfcount:
-                    return _redis.pfcount(_command_args, std::ref(out));
-                case redis_protocol_parser::command::pfmerge:
-                    return _redis.pfmerge(_command_args, std::ref(out));
-                default:
-                    tracer.incr_number_exceptions();
-                    return out.write("+Not Implemented");
-                };
-            }
-            default:
-                tracer.incr_number_exceptions();
-                return out.write("+Error\r\n");
-        };
+static bool is_batchable(redis_protocol_parser::command command, const args_collection& args)
+{
+    using cmd = redis_protocol_parser::command;
+    switch (command) {
+    case cmd::get:
+    case cmd::strlen:
+    case cmd::incr:
+    case cmd::decr:
+    case cmd::exists:
+    case cmd::del:
+    case cmd::unlink:
+    case cmd::type:
+    case cmd::ttl:
+    case cmd::pttl:
+    case cmd::llen:
+    case cmd::hlen:
+    case cmd::scard:
+    case cmd::zcard:
+        return args._command_args_count == 1;
+    case cmd::set:
+    case cmd::append:
+    case cmd::incrby:
+    case cmd::decrby:
+    case cmd::hget:
+    case cmd::hexists:
+    case cmd::sismember:
+    case cmd::zscore:
+        return args._command_args_count == 2;
+    case cmd::hset:
+        return args._command_args_count == 3;
+    default:
+        return false;
+    }
+}
+
+// Calls @func on every key of the request: the first argument, all of them,
+// or the ones which follow the destination and the number of keys.
+template <typename Func>
+static void for_each_key(redis_protocol_parser::command command, args_collection& args, Func&& func)
+{
+    using cmd = redis_protocol_parser::command;
+    auto& a = args._command_args;
+    if (a.empty()) {
+        return;
+    }
+    auto numkeys = [&a, &func] (size_t at) {
+        if (a.size() <= at) {
+            return;
+        }
+        auto n = std::strtoul(a[at].c_str(), nullptr, 10);
+        for (size_t i = at + 1; i < a.size() && i <= at + n; ++i) {
+            func(a[i]);
+        }
+    };
+    switch (command) {
+    case cmd::echo:
+    case cmd::ping:
+    case cmd::command:
+    case cmd::select:
+    case cmd::scan:
+    case cmd::info:
+    case cmd::save:
+    case cmd::bgsave:
+    case cmd::lastsave:
+    case cmd::bgrewriteaof:
+    case cmd::hotkeys:
+    case cmd::replicaof:
+    case cmd::psync:
+    case cmd::cluster:
+    case cmd::asking:
+    case cmd::migrate:
+    case cmd::subscribe:
+    case cmd::unsubscribe:
+    case cmd::psubscribe:
+    case cmd::punsubscribe:
+    case cmd::publish:
+    case cmd::pubsub:
+    case cmd::shards:
+    case cmd::flushdb:
+    case cmd::flushall:
+    case cmd::swapdb:
+    case cmd::multi:
+    case cmd::exec:
+    case cmd::discard:
+    case cmd::unwatch:
+    case cmd::unknown:
+        return;
+    case cmd::memory:
+        if (a.size() > 1) {
+            func(a[1]);
+        }
+        return;
+    case cmd::mget:
+    case cmd::del:
+    case cmd::unlink:
+    case cmd::exists:
+    case cmd::sdiff:
+    case cmd::sinter:
+    case cmd::sunion:
+    case cmd::sdiffstore:
+    case cmd::sinterstore:
+    case cmd::sunionstore:
+    case cmd::pfcount:
+    case cmd::pfmerge:
+    case cmd::watch:
+        for (auto& key : a) {
+            func(key);
+        }
+        return;
+    case cmd::mset:
+        for (size_t i = 0; i < a.size(); i += 2) {
+            func(a[i]);
+        }
+        return;
+    case cmd::blpop:
+    case cmd::brpop:
+        for (size_t i = 0; i + 1 < a.size(); ++i) {
+            func(a[i]);
+        }
+        return;
+    case cmd::smove:
+    case cmd::blmove:
+        func(a[0]);
+        if (a.size() > 1) {
+            func(a[1]);
+        }
+        return;
+    case cmd::zunionstore:
+    case cmd::zinterstore:
+    case cmd::zdiffstore:
+        func(a[0]);
+        numkeys(1);
+        return;
+    case cmd::zunion:
+    case cmd::zinter:
+    case cmd::zdiff:
+        numkeys(0);
+        return;
+    case cmd::bitop:
+        for (size_t i = 1; i < a.size(); ++i) {
+            func(a[i]);
+        }
+        return;
+    default:
+        func(a[0]);
+        return;
+    }
+}
+
+// Counts the keys of a sampled request in the hot key sketch of the shard.
+static void sample_keys(redis_protocol_parser::command command, args_collection& args, hot_keys& keys)
+{
+    if (args._command_args.empty() || !keys.sampled()) {
+        return;
+    }
+    for_each_key(command, args, [&keys] (const sstring& key) {
+        keys.record(key, redis_key::shard_hash_of(key) % smp::count);
+    });
+}
+
+unsigned redis_protocol::serving_cpu(const request& req) const
+{
+    // the copies are only held for the database 0.
+    auto local = engine().cpu_id();
+    if (req._cpu != local && _db_index == 0 && (req._command == redis_protocol_parser::command::get || req._command == redis_protocol_parser::command::hget)
+        && !req._args._command_args.empty() && _redis.holds_copy(req._args._command_args[0])) {
+        return local;
+    }
+    return req._cpu;
+}
+
+void redis_protocol::route(request& req)
+{
+    auto asking = _asking;
+    _asking = req._command == redis_protocol_parser::command::asking;
+    auto& cluster = _redis.local_cluster();
+    if (!_routed || !cluster.enabled()) {
+        return;
+    }
+    int slot = -1;
+    bool cross = false;
+    for_each_key(req._command, req._args, [&slot, &cross] (const sstring& key) {
+        int s = key_slot(key.data(), key.size());
+        if (slot < 0) {
+            slot = s;
+        } else if (s != slot) {
+            cross = true;
+        }
+    });
+    if (slot < 0) {
+        return;
+    }
+    if (cross) {
+        req._redirect = msg_crossslot_err;
+        return;
+    }
+    if (cluster.route(slot, asking, req._redirect) == cluster_route::check_keys) {
+        req._migrating_slot = slot;
+    }
+}
+
+// The commands of a connection subscribed to a channel or a pattern.
+static bool allowed_while_subscribed(redis_protocol_parser::command command)
+{
+    using cmd = redis_protocol_parser::command;
+    return command == cmd::subscribe || command == cmd::unsubscribe || command == cmd::psubscribe
+        || command == cmd::punsubscribe || command == cmd::ping;
+}
+
+// The commands which are queued from MULTI on, the others run at once.
+static bool queued_in_multi(redis_protocol_parser::command command)
+{
+    using cmd = redis_protocol_parser::command;
+    return command != cmd::multi && command != cmd::exec && command != cmd::discard && command != cmd::watch;
+}
+
+// The commands which wait for the others, or change the connection, can't run
+// in a transaction.
+static bool allowed_in_multi(redis_protocol_parser::command command)
+{
+    using cmd = redis_protocol_parser::command;
+    switch (command) {
+    case cmd::subscribe:
+    case cmd::unsubscribe:
+    case cmd::psubscribe:
+    case cmd::punsubscribe:
+    case cmd::blpop:
+    case cmd::brpop:
+    case cmd::blmove:
+    case cmd::psync:
+    case cmd::replicaof:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// The commands which may block the client until another one pushes to a list.
+static bool blocks(redis_protocol_parser::command command)
+{
+    using cmd = redis_protocol_parser::command;
+    return command == cmd::blpop || command == cmd::brpop || command == cmd::blmove;
+}
+
+static redis_service::pipelined_request make_pipelined_request(redis_protocol_parser::command command, args_collection& args)
+{
+    using cmd = redis_protocol_parser::command;
+    auto& a = args._command_args;
+    switch (command) {
+    case cmd::get:
+        return [&a] (database& db) { return db.get(redis_key { a[0] }); };
+    case cmd::strlen:
+        return [&a] (database& db) { return db.strlen(redis_key { a[0] }); };
+    case cmd::incr:
+        return [&a] (database& db) { return db.counter_by(redis_key { a[0] }, 1, true); };
+    case cmd::decr:
+        return [&a] (database& db) { return db.counter_by(redis_key { a[0] }, 1, false); };
+    case cmd::incrby:
+    {
+        int64_t step = std::atol(a[1].c_str());
+        return [&a, step] (database& db) { return db.counter_by(redis_key { a[0] }, step, true); };
+    }
+    case cmd::decrby:
+    {
+        int64_t step = std::atol(a[1].c_str());
+        return [&a, step] (database& db) { return db.counter_by(redis_key { a[0] }, step, false); };
+    }
+    case cmd::exists:
+        return [&a] (database& db) { return db.exists(redis_key { a[0] }); };
+    case cmd::del:
+        return [&a] (database& db) { return db.del(redis_key { a[0] }); };
+    case cmd::unlink:
+        return [&a] (database& db) { return db.unlink(redis_key { a[0] }); };
+    case cmd::type:
+        return [&a] (database& db) { return db.type(redis_key { a[0] }); };
+    case cmd::ttl:
+        return [&a] (database& db) { return db.ttl(redis_key { a[0] }); };
+    case cmd::pttl:
+        return [&a] (database& db) { return db.pttl(redis_key { a[0] }); };
+    case cmd::llen:
+        return [&a] (database& db) { return db.llen(redis_key { a[0] }); };
+    case cmd::hlen:
+        return [&a] (database& db) { return db.hlen(redis_key { a[0] }); };
+    case cmd::scard:
+        return [&a] (database& db) { return db.scard(redis_key { a[0] }); };
+    case cmd::zcard:
+        return [&a] (database& db) { return db.zcard(redis_key { a[0] }); };
+    case cmd::set:
+        return [&a] (database& db) { return db.set(redis_key { a[0] }, a[1], 0, FLAG_SET_NO); };
+    case cmd::append:
+        return [&a] (database& db) { return db.append(redis_key { a[0] }, a[1]); };
+    case cmd::hget:
+        return [&a] (database& db) { return db.hget(redis_key { a[0] }, a[1]); };
+    case cmd::hexists:
+        return [&a] (database& db) { return db.hexists(redis_key { a[0] }, a[1]); };
+    case cmd::sismember:
+        return [&a] (database& db) { return db.sismember(redis_key { a[0] }, a[1]); };
+    case cmd::zscore:
+        return [&a] (database& db) { return db.zscore(redis_key { a[0] }, a[1]); };
+    case cmd::hset:
+        return [&a] (database& db) { return db.hset(redis_key { a[0] }, a[1], a[2]); };
+    default:
         std::abort();
-    }).then_wrapped([this, &in, &out, &tracer] (auto&& f) -> future<> {
+    }
+}
+
+future<> redis_protocol::execute(request& req, output_stream<char>& out, request_latency_tracer& tracer)
+{
+    if (!req._redirect.empty()) {
+        // the transaction doesn't run without the requests served elsewhere.
+        _multi_aborted = _multi_aborted || _multi;
+        return out.write(req._redirect);
+    }
+    if (req._migrating_slot >= 0) {
+        // the request is served here as long as its keys didn't migrate yet.
+        std::vector<sstring> keys;
+        for_each_key(req._command, req._args, [&keys] (const sstring& key) {
+            keys.emplace_back(key);
+        });
+        return do_with(std::move(keys), [this, &req, &out, &tracer] (auto& keys) {
+            return _redis.migrating_redirect(req._migrating_slot, keys).then([this, &req, &out, &tracer] (sstring redirect) {
+                if (!redirect.empty()) {
+                    _multi_aborted = _multi_aborted || _multi;
+                    return out.write(redirect);
+                }
+                req._migrating_slot = -1;
+                return this->execute(req, out, tracer);
+            });
+        });
+    }
+    if (subscribed() && !allowed_while_subscribed(req._command)) {
+        return out.write(sstring("-ERR Can't execute '") + sstring(command_name(req._command))
+                         + sstring("': only (P)SUBSCRIBE / (P)UNSUBSCRIBE / PING are allowed in this context\r\n"));
+    }
+    if (_multi && queued_in_multi(req._command)) {
+        return queue(req, out);
+    }
+    auto cpu = serving_cpu(req);
+    if (!tracer.admit(cpu, is_batchable(req._command, req._args))) {
+        _busy_cpu = cpu;
+        return out.write(msg_busy_err);
+    }
+    auto start = tracer.begin_trace_latency();
+    auto command = req._command;
+    tracer.begin_remote(cpu);
+    redis_service::selected_db() = _db_index;
+    // the allocations of the command which stall are traced with its name. A
+    // command throwing before it returns its future fails the future, so that
+    // the stall context is reset and the remote call ended all the same.
+    logalloc::shard_tracker().set_stall_context(command_name(command));
+    auto f = futurize<future<>>::apply([this, command, &req, &out, &tracer] {
+        return dispatch(command, req._args, out, tracer);
+    });
+    logalloc::shard_tracker().set_stall_context(nullptr);
+    return f.then_wrapped([&out, &tracer, command, start, cpu] (auto&& f) -> future<> {
+        tracer.end_remote(cpu);
         try {
             f.get();
         } catch (std::bad_alloc& e) {
             tracer.incr_number_exceptions();
-            tracer.end_trace_latency();
+            tracer.end_trace_latency(command, start);
             return out.write(msg_err);
+        } catch (aof_write_error& e) {
+            tracer.incr_number_exceptions();
+            tracer.end_trace_latency(command, start);
+            return out.write(msg_aof_write_err);
         }
-        tracer.end_trace_latency();
+        tracer.end_trace_latency(command, start);
+        return make_ready_future<>();
+    });
+}
+
+future<> redis_protocol::execute_batched(size_t begin, size_t end, output_stream<char>& out, request_latency_tracer& tracer)
+{
+    // Requests of [begin, end) are grouped by the owner shard, every group is
+    // submitted as one message, and the replies are written in request order.
+    struct shard_batch {
+        std::vector<redis_service::pipelined_request> _requests;
+        std::vector<size_t> _positions;
+    };
+    struct batch_state {
+        std::vector<shard_batch> _batches;
+        std::vector<reply> _replies;
+        // The time every request was received at, for its latency.
+        std::vector<steady_clock_type::time_point> _starts;
+        batch_state(size_t count) : _batches(smp::count), _replies(count), _starts(count) {}
+    };
+    return do_with(batch_state { end - begin }, [this, begin, end, &out, &tracer] (auto& state) {
+        for (size_t i = begin; i < end; ++i) {
+            auto& req = _pipeline[i];
+            // the reads of a key held as a copy join the local batch, which runs
+            // right away below, before the copy could be dropped.
+            auto cpu = serving_cpu(req);
+            state._starts[i - begin] = tracer.begin_trace_latency();
+            if (!tracer.admit(cpu, true)) {
+                _busy_cpu = cpu;
+                state._replies[i - begin].append(msg_busy_err);
+                continue;
+            }
+            tracer.begin_remote(cpu);
+            auto& batch = state._batches[cpu];
+            batch._requests.emplace_back(make_pipelined_request(req._command, req._args));
+            batch._positions.emplace_back(i - begin);
+        }
+        redis_service::selected_db() = _db_index;
+        return parallel_for_each(boost::irange<unsigned>(0, smp::count), [this, &state, &tracer] (unsigned cpu) {
+            auto& batch = state._batches[cpu];
+            if (batch._requests.empty()) {
+                return make_ready_future<>();
+            }
+            return _redis.pipeline(cpu, batch._requests).then_wrapped([&batch, &state, &tracer, cpu] (auto&& f) {
+                tracer.end_remote(cpu, batch._requests.size());
+                // a batch which failed as a whole fails each of its requests.
+                auto fail = [&batch, &state, &tracer] (const sstring& message) {
+                    for (auto position : batch._positions) {
+                        tracer.incr_number_exceptions();
+                        state._replies[position] = reply();
+                        state._replies[position].append(message);
+                    }
+                };
+                try {
+                    auto replies = f.get0();
+                    for (size_t i = 0; i < replies.size(); ++i) {
+                        state._replies[batch._positions[i]] = std::move(replies[i]);
+                    }
+                } catch (aof_write_error& e) {
+                    fail(msg_aof_write_err);
+                } catch (...) {
+                    fail(msg_err);
+                }
+            });
+        }).then([this, begin, &state, &out, &tracer] {
+            for (size_t i = 0; i < state._replies.size(); ++i) {
+                tracer.end_trace_latency(_pipeline[begin + i]._command, state._starts[i]);
+            }
+            return do_for_each(state._replies, [&out] (auto& m) {
+                return m.write(out);
+            });
+        });
+    });
+}
+
+// Appends the data written to a stream to @data: the replies of the requests
+// of a transaction are sent back together.
+class reply_collector final : public data_sink_impl {
+    std::string& _data;
+public:
+    explicit reply_collector(std::string& data) : _data(data) {}
+    using data_sink_impl::put;
+    virtual future<> put(net::packet data) override {
+        for (auto& f : data.fragments()) {
+            _data.append(f.base, f.size);
+        }
+        return make_ready_future<>();
+    }
+    virtual future<> flush() override {
+        return make_ready_future<>();
+    }
+    virtual future<> close() override {
+        return make_ready_future<>();
+    }
+};
+
+future<> redis_protocol::queue(request& req, output_stream<char>& out)
+{
+    if (!allowed_in_multi(req._command)) {
+        _multi_aborted = true;
+        return out.write(msg_not_in_multi_err);
+    }
+    for_each_key(req._command, req._args, [this, &req] (sstring& key) {
+        if (redis_key { key }.get_cpu() != req._cpu) {
+            _queued_cross_shard = true;
+        }
+    });
+    _queued.emplace_back(req._command, std::move(req._args));
+    _queued.back()._cpu = req._cpu;
+    _queued.back()._keyed = req._keyed;
+    return out.write(msg_queued);
+}
+
+future<> redis_protocol::multi(output_stream<char>& out)
+{
+    if (_multi) {
+        return out.write(msg_multi_nested_err);
+    }
+    _multi = true;
+    return out.write(msg_ok);
+}
+
+future<> redis_protocol::discard(output_stream<char>& out)
+{
+    if (!_multi) {
+        return out.write(msg_discard_without_multi_err);
+    }
+    _multi = false;
+    _multi_aborted = false;
+    _queued.clear();
+    _queued_cross_shard = false;
+    return release_watched().then([&out] {
+        return out.write(msg_ok);
+    });
+}
+
+future<> redis_protocol::watch(args_collection& args, output_stream<char>& out)
+{
+    if (_multi) {
+        return out.write(msg_watch_in_multi_err);
+    }
+    if (args._command_args_count < 1 || args._command_args.empty()) {
+        return out.write(msg_syntax_err);
+    }
+    auto db = _db_index;
+    return parallel_for_each(args._command_args, [this, db] (sstring& key) {
+        auto cpu = redis_key { key }.get_cpu();
+        return _redis.watch(cpu, db, key).then([this, &key, db, cpu] (uint64_t version) {
+            _watched.emplace_back(watched_key { key, db, cpu, version });
+        });
+    }).then([&out] {
+        return out.write(msg_ok);
+    });
+}
+
+future<> redis_protocol::unwatch(output_stream<char>& out)
+{
+    return release_watched().then([&out] {
+        return out.write(msg_ok);
+    });
+}
+
+future<> redis_protocol::release_watched()
+{
+    if (_watched.empty()) {
         return make_ready_future<>();
+    }
+    auto watched = std::move(_watched);
+    _watched.clear();
+    return do_with(std::move(watched), [this] (auto& watched) {
+        return _redis.unwatch(watched);
+    });
+}
+
+future<sstring> redis_protocol::execute_queued(std::vector<request>& queued, request_latency_tracer& tracer)
+{
+    struct queued_replies {
+        std::vector<std::string> _replies;
+        std::vector<output_stream<char>> _outs;
+        std::vector<future<>> _pending;
+        std::vector<bool> _failed;
+    };
+    return do_with(queued_replies {}, [this, &queued, &tracer] (auto& state) {
+        auto n = queued.size();
+        state._replies.resize(n);
+        state._outs.reserve(n);
+        state._pending.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            state._outs.emplace_back(data_sink(std::make_unique<reply_collector>(state._replies[i])), QUEUED_REPLY_BUFFER_SIZE);
+        }
+        // the requests which don't wait run back to back, in this task.
+        for (size_t i = 0; i < n; ++i) {
+            auto& req = queued[i];
+            redis_service::selected_db() = _db_index;
+            try {
+                state._pending.emplace_back(dispatch(req._command, req._args, state._outs[i], tracer));
+            } catch (...) {
+                state._pending.emplace_back(make_exception_future<>(std::current_exception()));
+            }
+        }
+        return when_all(state._pending.begin(), state._pending.end()).then([&state] (std::vector<future<>> results) {
+            for (auto& f : results) {
+                state._failed.push_back(f.failed());
+                f.ignore_ready_future();
+            }
+            return parallel_for_each(state._outs, [] (auto& o) {
+                return o.flush();
+            });
+        }).then([&state, &tracer] {
+            std::string body = "*" + std::to_string(state._replies.size()) + "\r\n";
+            for (size_t i = 0; i < state._replies.size(); ++i) {
+                if (state._failed[i]) {
+                    tracer.incr_number_exceptions();
+                    body.append(msg_err.data(), msg_err.size());
+                } else {
+                    body += state._replies[i];
+                }
+            }
+            return sstring(body.data(), body.size());
+        });
+    });
+}
+
+future<redis_protocol::transaction_result> redis_protocol::run_transaction(redis_service& redis, std::vector<request>& queued,
+                                                                          std::vector<watched_key>& watched, unsigned db)
+{
+    // the watched keys are checked and the requests start in the same task, no
+    // other request of the shard runs in between.
+    if (!redis.watched_unchanged_here(watched)) {
+        return make_ready_future<transaction_result>(transaction_result { false, sstring(), db });
+    }
+    auto tracer = request_latency_tracer::local();
+    if (tracer == nullptr) {
+        return make_exception_future<transaction_result>(std::runtime_error("no server on this shard"));
+    }
+    return do_with(redis_protocol(redis, false), [&queued, tracer, db] (auto& executor) {
+        executor._db_index = db;
+        return executor.execute_queued(queued, *tracer).then([&executor] (sstring replies) {
+            return transaction_result { true, std::move(replies), executor._db_index };
+        });
+    });
+}
+
+future<> redis_protocol::exec(output_stream<char>& out, request_latency_tracer& tracer)
+{
+    if (!_multi) {
+        return out.write(msg_exec_without_multi_err);
+    }
+    _multi = false;
+    auto aborted = _multi_aborted;
+    _multi_aborted = false;
+    auto queued = std::move(_queued);
+    _queued.clear();
+    auto watched = std::move(_watched);
+    _watched.clear();
+    // the transaction runs on the shard owning all its keys, the watched ones too.
+    auto one_shard = !_queued_cross_shard;
+    _queued_cross_shard = false;
+    auto cpu = engine().cpu_id();
+    bool keyed = false;
+    auto owned_by = [&cpu, &keyed, &one_shard] (unsigned owner) {
+        if (!keyed) {
+            cpu = owner;
+            keyed = true;
+        } else if (owner != cpu) {
+            one_shard = false;
+        }
+    };
+    for (auto& req : queued) {
+        if (req._keyed) {
+            owned_by(req._cpu);
+        }
+    }
+    for (auto& w : watched) {
+        owned_by(w._cpu);
+    }
+    return do_with(std::move(queued), std::move(watched), [this, &out, &tracer, aborted, one_shard, cpu] (auto& queued, auto& watched) {
+        auto f = make_ready_future<>();
+        if (aborted) {
+            f = out.write(msg_execabort_err);
+        } else if (one_shard) {
+            if (!tracer.admit(cpu, false)) {
+                _busy_cpu = cpu;
+                f = out.write(msg_busy_err);
+            } else {
+                tracer.begin_remote(cpu);
+                f = smp::submit_to(cpu, [&redis = _redis, &queued, &watched, db = _db_index] {
+                    return run_transaction(redis, queued, watched, db);
+                }).then_wrapped([this, &out, &tracer, cpu] (auto&& f) {
+                    tracer.end_remote(cpu);
+                    transaction_result result;
+                    try {
+                        result = f.get0();
+                    } catch (aof_write_error& e) {
+                        tracer.incr_number_exceptions();
+                        return out.write(msg_aof_write_err);
+                    } catch (...) {
+                        tracer.incr_number_exceptions();
+                        return out.write(msg_err);
+                    }
+                    if (!result._executed) {
+                        return out.write(msg_null_multi_bulk);
+                    }
+                    _db_index = result._db;
+                    return out.write(std::move(result._replies));
+                });
+            }
+        } else {
+            // no shard could run the requests in isolation, none of them runs.
+            f = out.write(msg_exec_cross_shard_err);
+        }
+        return f.finally([this, &watched] {
+            return _redis.unwatch(watched);
+        });
+    });
+}
+
+future<> redis_protocol::handle(input_stream<char>& in, output_stream<char>& out, request_latency_tracer& tracer)
+{
+    // the connection stops reading while the shard which refused it is busy.
+    if (_busy_cpu >= 0) {
+        auto cpu = static_cast<unsigned>(_busy_cpu);
+        _busy_cpu = -1;
+        return tracer.wait_for_room(cpu).then([this, &in, &out, &tracer] {
+            return handle(in, out, tracer);
+        });
+    }
+    // NOTE: The pipelined requests which are already buffered in the input stream are
+    // parsed at once. Every request owns its parameters until it is executed.
+    for (auto& req : _pipeline) {
+        if (req._args._command_args.capacity() <= ARGS_RECYCLE_MAX) {
+            _spare_args.emplace_back(std::move(req._args));
+        }
+    }
+    _pipeline.clear();
+    // the input read while the last request blocked is parsed first.
+    if (!_input_watch.available()) {
+        auto watch = std::move(_input_watch);
+        _input_watch = make_ready_future<>();
+        return watch.then([this, &in, &out, &tracer] {
+            return handle(in, out, tracer);
+        });
+    }
+    return repeat([this, &in, &tracer] {
+        _parser.init();
+        return consume(in).then([this, &tracer] {
+            if (_parser._state != redis_protocol_parser::state::ok) {
+                return stop_iteration::yes;
+            }
+            prepare_request();
+            _pipeline.emplace_back(_parser._command, std::move(_command_args));
+            auto& req = _pipeline.back();
+            sample_keys(req._command, req._args, tracer.sampled_keys());
+            route(req);
+            req._batchable = !_multi_parsed && req._redirect.empty() && req._migrating_slot < 0
+                && is_batchable(req._command, req._args);
+            if (req._command == redis_protocol_parser::command::multi) {
+                _multi_parsed = true;
+            } else if (req._command == redis_protocol_parser::command::exec
+                       || req._command == redis_protocol_parser::command::discard) {
+                _multi_parsed = false;
+            }
+            req._cpu = engine().cpu_id();
+            for_each_key(req._command, req._args, [&req] (sstring& key) {
+                if (!req._keyed) {
+                    req._cpu = redis_key { key }.get_cpu();
+                    req._keyed = true;
+                }
+            });
+            // the requests parsed run before the next one is read from the socket.
+            return stop_iteration(!_parser.pending_input() || _pipeline.size() >= PIPELINE_MAX_DEPTH);
+        });
+    }).then([this] {
+        // the messages being written to a subscriber come before the replies.
+        return _subscriber ? _subscriber->hold() : make_ready_future<>();
+    }).then([this, &in, &out, &tracer] {
+        return do_with(size_t(0), [this, &in, &out, &tracer] (auto& pos) {
+            return do_until([this, &pos] { return pos == _pipeline.size(); }, [this, &pos, &in, &out, &tracer] {
+                auto end = pos;
+                while (end < _pipeline.size() && _pipeline[end]._batchable) {
+                    ++end;
+                }
+                if (end - pos > 1 && !subscribed()) {
+                    auto begin = pos;
+                    pos = end;
+                    return execute_batched(begin, end, out, tracer);
+                }
+                auto& req = _pipeline[pos++];
+                if (blocks(req._command) && !_multi) {
+                    return execute_blocking(req, in, out, tracer);
+                }
+                return execute(req, out, tracer);
+            });
+        });
+    }).then([this, &out] {
+        if (_parser._state != redis_protocol_parser::state::too_large) {
+            return make_ready_future<>();
+        }
+        // the requests parsed before the oversized one got their replies, the
+        // connection is dropped after this one.
+        _protocol_error = true;
+        return out.write(msg_invalid_bulk_len_err);
     });
 }
 }
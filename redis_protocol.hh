@@ -24,29 +24,91 @@
 #include "redis_protocol_parser.hh"
 #include "net/packet-data-source.hh"
 #include "net/packet-data-source.hh"
+#include "latency_histogram.hh"
+#include "hot_keys.hh"
+#include "pubsub.hh"
+#include "blocked_lists.hh"
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
 
 namespace redis {
 class redis_service;
 
+const char* command_name(redis_protocol_parser::command command);
+
+// Per shard request statistics. The latency of every request is recorded into
+// the histogram of its command.
+// The requests sent to other shards are counted by owner shard too: once a
+// shard serves the limit of them, the new ones are refused with -BUSY rather
+// than queued behind, the costly ones from half the limit already.
 class request_latency_tracer
 {
-    static constexpr const int SAMPLE_COUNT = 256;
-    circular_buffer<double> _latencies;
-    double _average_latency = 0;
+    std::vector<latency_histogram> _latencies;
     uint64_t _requests_served = 0;
     uint64_t _requests_serving = 0;
     uint64_t _requests_exception = 0;
-    steady_clock_type::time_point _timestamp = steady_clock_type::now();
+    uint64_t _requests_rejected = 0;
+    std::vector<uint64_t> _serving_on;
+    // 0 means no limit.
+    uint64_t _remote_limit = 0;
+    // The connections which were refused by a shard wait until it's below
+    // half the limit before they read their next requests.
+    std::vector<std::vector<promise<>>> _room_waiters;
+    uint64_t _total_latency = 0;
+    uint64_t _connections_current = 0;
+    uint64_t _connections_total = 0;
+    hot_keys _hot_keys;
+    // The tracer of the server of this shard, INFO collects them from every shard.
+    static thread_local request_latency_tracer* _local;
 public:
-    request_latency_tracer() {}
-    ~request_latency_tracer() {}
+    request_latency_tracer()
+        : _latencies(redis_protocol_parser::COMMAND_COUNT)
+        , _serving_on(smp::count)
+        , _room_waiters(smp::count)
+    {
+        _local = this;
+    }
+    ~request_latency_tracer() {
+        if (_local == this) {
+            _local = nullptr;
+        }
+    }
+
+    static inline request_latency_tracer* local() {
+        return _local;
+    }
+
+    inline void open_connection() {
+        ++_connections_current;
+        ++_connections_total;
+    }
+
+    inline void close_connection() {
+        --_connections_current;
+    }
+
+    inline uint64_t connections_current() const {
+        return _connections_current;
+    }
+
+    inline uint64_t connections_total() const {
+        return _connections_total;
+    }
+
+    inline hot_keys& sampled_keys() {
+        return _hot_keys;
+    }
 
     inline uint64_t number_exceptions() const {
         return _requests_exception;
     }
 
+    // Mean latency (us) of all served requests.
     inline double latency() const {
-        return _average_latency;
+        return _requests_served ? static_cast<double>(_total_latency) / _requests_served : 0;
     }
 
     inline uint64_t served() const {
@@ -57,36 +119,195 @@ public:
         return _requests_serving;
     }
 
-    inline void begin_trace_latency() {
+    inline uint64_t half_limit() const {
+        return std::max<uint64_t>(_remote_limit / 2, 1);
+    }
+
+    inline void set_remote_limit(uint64_t limit) {
+        _remote_limit = limit;
+    }
+
+    inline uint64_t rejected() const {
+        return _requests_rejected;
+    }
+
+    // The requests of this shard being served by @cpu.
+    inline uint64_t serving_on(unsigned cpu) const {
+        return _serving_on[cpu];
+    }
+
+    // Whether a request, @cheap or not, may be sent to @cpu now. The refused
+    // ones are counted.
+    inline bool admit(unsigned cpu, bool cheap) {
+        if (_remote_limit == 0 || cpu == engine().cpu_id()) {
+            return true;
+        }
+        if (_serving_on[cpu] < (cheap ? _remote_limit : half_limit())) {
+            return true;
+        }
+        ++_requests_rejected;
+        return false;
+    }
+
+    inline void begin_remote(unsigned cpu) {
+        ++_serving_on[cpu];
+    }
+
+    inline void end_remote(unsigned cpu, uint64_t count = 1) {
+        _serving_on[cpu] -= count;
+        if (_serving_on[cpu] < half_limit() && !_room_waiters[cpu].empty()) {
+            for (auto& w : _room_waiters[cpu]) {
+                w.set_value();
+            }
+            _room_waiters[cpu].clear();
+        }
+    }
+
+    // Resolves once @cpu serves less than half the limit of the requests of
+    // this shard.
+    future<> wait_for_room(unsigned cpu) {
+        if (_remote_limit == 0 || _serving_on[cpu] < half_limit()) {
+            return make_ready_future<>();
+        }
+        _room_waiters[cpu].emplace_back();
+        return _room_waiters[cpu].back().get_future();
+    }
+
+    inline const latency_histogram& latency_of(redis_protocol_parser::command command) const {
+        return _latencies[static_cast<size_t>(command)];
+    }
+
+    inline steady_clock_type::time_point begin_trace_latency() {
         ++_requests_serving;
-        _timestamp = steady_clock_type::now();
+        return steady_clock_type::now();
     }
 
     inline void incr_number_exceptions() {
         ++_requests_exception;
     }
 
-    inline void end_trace_latency() {
-        auto rt = static_cast<double>((steady_clock_type::now() - _timestamp).count() / 1000.0); //us
-        _latencies.push_front(rt);
-        if (_latencies.size() > SAMPLE_COUNT) {
-            auto drop = _latencies.back();
-            _latencies.pop_back();
-            _average_latency -= (drop / SAMPLE_COUNT);
-        }
+    inline void end_trace_latency(redis_protocol_parser::command command, steady_clock_type::time_point start) {
+        auto rt = std::chrono::duration_cast<std::chrono::microseconds>(steady_clock_type::now() - start).count();
+        _latencies[static_cast<size_t>(command)].record(rt);
+        _total_latency += rt;
         --_requests_serving;
         ++_requests_served;
-        _average_latency += (rt / SAMPLE_COUNT);
     }
 };
 
 class redis_protocol {
 private:
+    // Maximum number of pipelined requests parsed from the input buffer before
+    // they are executed.
+    static constexpr const size_t PIPELINE_MAX_DEPTH = 256;
+    // The collections of the executed requests are reused by the next ones,
+    // unless a request with many arguments made them large.
+    static constexpr const size_t ARGS_RECYCLE_MAX = 64;
+    // The replies of the requests of a transaction are buffered by this much.
+    static constexpr const size_t QUEUED_REPLY_BUFFER_SIZE = 1024;
+    struct request {
+        redis_protocol_parser::command _command;
+        args_collection _args;
+        // Set for the single key requests which could be batched to the owner shard.
+        bool _batchable;
+        // The owner shard of the first key, this shard if none.
+        unsigned _cpu;
+        bool _keyed;
+        // In cluster mode, the reply redirecting the request to another node,
+        // or the slot migrating from this node its keys must be checked in.
+        sstring _redirect;
+        int _migrating_slot;
+        request(redis_protocol_parser::command command, args_collection&& args)
+            : _command(command)
+            , _args(std::move(args))
+            , _batchable(false)
+            , _cpu(0)
+            , _keyed(false)
+            , _migrating_slot(-1)
+        {
+        }
+    };
     redis_service& _redis;
+    // Whether the requests are checked against the slots served by this node,
+    // and whether the last request was ASKING.
+    bool _routed;
+    bool _asking = false;
+    // The database selected by the connection, 0 until SELECT.
+    unsigned _db_index = 0;
+    // The shard which refused the last requests with -BUSY, if any: the
+    // connection reads its next requests once the shard caught up.
+    int _busy_cpu = -1;
     redis_protocol_parser _parser;
     args_collection _command_args;
+    std::vector<request> _pipeline;
+    std::vector<args_collection> _spare_args;
+    // The subscriptions of the connection, once it subscribed, and how the
+    // connection is dropped if it doesn't read the messages.
+    std::unique_ptr<subscriber> _subscriber;
+    std::function<void ()> _disconnect;
+    // The client sent a bulk argument larger than proto-max-bulk-len.
+    bool _protocol_error = false;
+    // [BLOCKING LIST]
+    // While a request blocks, the input is read on, so that the client is
+    // unblocked once it disconnects. What it sends meanwhile is parsed next,
+    // the reading stops past this much.
+    static constexpr const size_t STASHED_INPUT_MAX = 64 * 1024;
+    blocked_client _blocked;
+    bool _blocking = false;
+    future<> _input_watch = make_ready_future<>();
+    std::deque<temporary_buffer<char>> _stashed;
+    size_t _stashed_size = 0;
+    future<> watch_input(input_stream<char>& in);
+    void client_gone();
+    // Feeds the parser the input stashed first, then @in.
+    future<> consume(input_stream<char>& in);
+    future<> execute_blocking(request& req, input_stream<char>& in, output_stream<char>& out, request_latency_tracer& tracer);
+    subscriber& subscriber_of(output_stream<char>& out);
+    inline bool subscribed() const { return _subscriber && _subscriber->subscriptions() > 0; }
+    future<> execute(request& req, output_stream<char>& out, request_latency_tracer& tracer);
+    future<> execute_batched(size_t begin, size_t end, output_stream<char>& out, request_latency_tracer& tracer);
+    future<> dispatch(redis_protocol_parser::command command, args_collection& args, output_stream<char>& out, request_latency_tracer& tracer);
+    // In cluster mode, redirects the request if its keys are served by another node.
+    void route(request& req);
+    // The shard serving @req: the owner of its key, unless its copy is read here.
+    unsigned serving_cpu(const request& req) const;
+
+    // [TRANSACTIONS]
+    // From MULTI on, the requests are queued until EXEC runs them. The parser
+    // follows MULTI too, so that the queued requests are never batched.
+    bool _multi = false;
+    bool _multi_parsed = false;
+    // A request refused while queued discards the transaction at EXEC.
+    bool _multi_aborted = false;
+    std::vector<request> _queued;
+    // Whether a queued request has keys of several shards.
+    bool _queued_cross_shard = false;
+    std::vector<watched_key> _watched;
+    struct transaction_result {
+        bool _executed;
+        sstring _replies;
+        unsigned _db;
+    };
+    future<> queue(request& req, output_stream<char>& out);
+    future<> multi(output_stream<char>& out);
+    // The transaction whose keys, the queued and the watched ones, are owned
+    // by one shard runs there in one task. The others are discarded with
+    // -CROSSSLOT, nothing of them runs.
+    future<> exec(output_stream<char>& out, request_latency_tracer& tracer);
+    future<> discard(output_stream<char>& out);
+    future<> watch(args_collection& args, output_stream<char>& out);
+    future<> unwatch(output_stream<char>& out);
+    future<> release_watched();
+    // Runs the @queued requests, each one as far as it goes before the next
+    // one starts, and returns their replies as a multi bulk.
+    future<sstring> execute_queued(std::vector<request>& queued, request_latency_tracer& tracer);
+    // EXEC on the shard owning the keys of the transaction.
+    static future<transaction_result> run_transaction(redis_service& redis, std::vector<request>& queued,
+                                                      std::vector<watched_key>& watched, unsigned db);
 public:
-    redis_protocol(redis_service& redis);
+    // The requests replayed from the log, or streamed by a master, apply to
+    // this node whatever slots it serves, they're not @routed.
+    explicit redis_protocol(redis_service& redis, bool routed = true);
     void prepare_request();
     void print_input()
     {
@@ -96,6 +317,37 @@ public:
         };
         std::cout << "}\n";
     }
+    // Parses the requests buffered in @in, then writes their replies to @out;
+    // the messages of the subscriptions wait until release_messages().
     future<> handle(input_stream<char>& in, output_stream<char>& out, request_latency_tracer& tracer);
+    // Whether complete requests are still buffered in the input after handle(),
+    // their replies can be flushed along with the replies of the previous ones.
+    // A partial request doesn't count, the previous replies don't wait for it.
+    inline bool pending_input() const
+    {
+        return _parser.pending_input();
+    }
+    // Whether the connection must be closed, the input can't be parsed any further.
+    inline bool protocol_error() const
+    {
+        return _protocol_error;
+    }
+    // The replies were written, the messages can be written.
+    inline void release_messages()
+    {
+        if (_subscriber) {
+            _subscriber->release();
+        }
+    }
+    inline void set_disconnect(std::function<void ()> disconnect)
+    {
+        _disconnect = std::move(disconnect);
+    }
+    // The bytes held by the connection besides its own state: the arguments of
+    // the requests and of the transaction, the input stashed and the messages
+    // queued to the subscriptions.
+    size_t memory_usage() const;
+    // The connection closes, its subscriptions are dropped.
+    future<> close();
 };
 }
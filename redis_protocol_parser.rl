@@ -28,6 +28,7 @@
 #include <iostream>
 #include <algorithm>
 #include <functional>
+#include <cstring>
 
 %%{
 
@@ -39,21 +40,42 @@ action mark {
     g.mark_start(p);
 }
 
+# A bulk argument is allocated once at its announced size and filled in place
+# from every input buffer it spans, instead of being accumulated by the builder.
 action start_blob {
-    g.mark_start(p);
+    if (_arg_size > max_bulk_len()) {
+        _state = state::too_large;
+        fbreak;
+    }
     _size_left = _arg_size;
+    if (_args_list.empty()) {
+        _args_list.reserve(_args_count < ARGS_RESERVE_MAX ? _args_count : ARGS_RESERVE_MAX);
+    }
+    _args_list.emplace_back(sstring::initialized_later(), std::min(_arg_size, BLOB_RESERVE_MAX));
 }
 action start_command {
+    if (_arg_size > max_bulk_len()) {
+        _state = state::too_large;
+        fbreak;
+    }
     g.mark_start(p);
     _size_left = _arg_size;
 }
 
 action advance_blob {
     auto len = std::min((uint32_t)(pe - p), _size_left);
+    auto& arg = _args_list.back();
+    size_t filled = _arg_size - _size_left;
+    if (filled + len > arg.size()) {
+        // the argument grows as its bytes arrive, up to the announced size.
+        sstring grown(sstring::initialized_later(), std::min(size_t(_arg_size), std::max(filled + len, arg.size() * 2)));
+        std::memcpy(grown.begin(), arg.begin(), filled);
+        arg = std::move(grown);
+    }
+    std::memcpy(arg.begin() + filled, p, len);
     _size_left -= len;
     p += len;
     if (_size_left == 0) {
-      _args_list.push_back(str());
       p--;
       fret;
     }
@@ -82,6 +104,15 @@ mset = "mset"i ${_command = command::mset;};
 get = "get"i ${_command = command::get;};
 mget = "mget"i ${_command = command::mget;};
 del = "del"i ${_command = command::del;};
+unlink = "unlink"i ${_command = command::unlink;};
+flushdb = "flushdb"i ${_command = command::flushdb;};
+flushall = "flushall"i ${_command = command::flushall;};
+swapdb = "swapdb"i ${_command = command::swapdb;};
+multi = "multi"i ${_command = command::multi;};
+exec = "exec"i ${_command = command::exec;};
+discard = "discard"i ${_command = command::discard;};
+watch = "watch"i ${_command = command::watch;};
+unwatch = "unwatch"i ${_command = command::unwatch;};
 echo = "echo"i ${_command = command::echo;};
 ping = "ping"i ${_command = command::ping;};
 incr = "incr"i ${_command = command::incr;};
@@ -135,6 +166,7 @@ spop = "spop"i ${_command = command::spop;};
 type = "type"i ${_command = command::type; };
 expire = "expire"i ${_command = command::expire; };
 pexpire = "pexpire"i ${_command = command::pexpire; };
+pexpireat = "pexpireat"i ${_command = command::pexpireat; };
 ttl = "ttl"i ${_command = command::ttl; };
 pttl = "pttl"i ${_command = command::pttl; };
 persist = "persist"i ${_command = command::persist; };
@@ -158,6 +190,9 @@ zunion = "zunion"i ${_command = command::zunion; };
 zinter = "zinter"i ${_command = command::zinter; };
 zdiff = "zunion"i ${_command = command::zdiff; };
 zscan = "zscan"i ${_command = command::zscan; };
+scan = "scan"i ${_command = command::scan; };
+hscan = "hscan"i ${_command = command::hscan; };
+sscan = "sscan"i ${_command = command::sscan; };
 zrangebylex = "zrangebylex"i ${_command = command::zrangebylex; };
 zrangebyscore = "zrangebyscore"i ${_command = command::zrangebyscore; };
 zlexcount = "zlexcount"i ${_command = command::zlexcount;};
@@ -169,6 +204,7 @@ geohash = "geohash"i ${_command = command::geohash; };
 geopos = "geopos"i ${_command = command::geopos; };
 georadius = "georadius"i ${_command = command::georadius; };
 georadiusbymember = "georadiusbymember"i ${_command = command::georadiusbymember; };
+geosearch = "geosearch"i ${_command = command::geosearch; };
 setbit = "setbit"i ${_command = command::setbit; };
 getbit = "getbit"i ${_command = command::getbit; };
 bitcount = "bitcount"i ${_command = command::bitcount; };
@@ -178,20 +214,51 @@ bitpos = "bitpos"i ${_command = command::bitpos; };
 pfadd = "pfadd"i ${_command = command::pfadd; };
 pfcount = "pfcount"i ${_command = command::pfcount; };
 pfmerge = "pfmerge"i ${_command = command::pfmerge; };
+info = "info"i ${_command = command::info; };
+save = "save"i ${_command = command::save; };
+bgsave = "bgsave"i ${_command = command::bgsave; };
+lastsave = "lastsave"i ${_command = command::lastsave; };
+bgrewriteaof = "bgrewriteaof"i ${_command = command::bgrewriteaof; };
+memory = "memory"i ${_command = command::memory; };
+hotkeys = "hotkeys"i ${_command = command::hotkeys; };
+replicaof = ("replicaof"i | "slaveof"i) ${_command = command::replicaof; };
+psync = "psync"i ${_command = command::psync; };
+cluster = "cluster"i ${_command = command::cluster; };
+asking = "asking"i ${_command = command::asking; };
+migrate = "migrate"i ${_command = command::migrate; };
+blpop = "blpop"i ${_command = command::blpop; };
+brpop = "brpop"i ${_command = command::brpop; };
+blmove = "blmove"i ${_command = command::blmove; };
+subscribe = "subscribe"i ${_command = command::subscribe; };
+unsubscribe = "unsubscribe"i ${_command = command::unsubscribe; };
+psubscribe = "psubscribe"i ${_command = command::psubscribe; };
+punsubscribe = "punsubscribe"i ${_command = command::punsubscribe; };
+publish = "publish"i ${_command = command::publish; };
+pubsub = "pubsub"i ${_command = command::pubsub; };
+shards = "shards"i ${_command = command::shards; };
 
 command = (setbit | set | getbit | get | del | mget | mset | echo | ping | incr | decr | incrby | decrby | command_ | exists | append |
            strlen | lpushx | lpush | lpop | llen | lindex | linsert | lrange | lset | rpushx | rpush | rpop | lrem |
            ltrim | hset | hgetall |hget | hdel | hlen | hexists | hstrlen | hincrby | hincrbyfloat | hkeys | hvals | hmget | hmset |
            sadd | scard | sismember | smembers | srem | sdiffstore | sdiff | sinterstore | sinter| sunionstore | sunion | smove | srandmember | spop |
-           type | expire | pexpire | persist | ttl | pttl | zadd | zcard | zcount | zincrby |
+           type | expire | pexpireat | pexpire | persist | ttl | pttl | zadd | zcard | zcount | zincrby |
            zrangebyscore | zrank | zremrangebyrank | zremrangebyscore | zremrangebylex | zrem | zrevrangebyscore | zrevrange| zrevrank |
-           zscore | zunionstore  | zinterstore | zdiffstore | zunion | zinter | zdiff | zscan | zrangebylex | zlexcount |
-           zrange | select | geoadd | geodist | geohash | geopos | georadiusbymember | georadius |  bitcount |
+           zscore | zunionstore  | zinterstore | zdiffstore | zunion | zinter | zdiff | zscan | scan | hscan | sscan | zrangebylex | zlexcount |
+           zrange | select | geoadd | geodist | geohash | geopos | georadiusbymember | georadius | geosearch | bitcount |
            bitpos | bitop | bitfield |
-           pfadd | pfcount | pfmerge );
+           pfadd | pfcount | pfmerge | info | save | bgsave | lastsave | bgrewriteaof | memory | hotkeys | replicaof | psync |
+           cluster | asking | migrate | blpop | brpop | blmove | subscribe | unsubscribe | psubscribe | punsubscribe |
+           publish | pubsub | shards | unlink | flushdb | flushall | swapdb | multi | exec | discard | watch | unwatch );
 arg = '$' u32 crlf ${ _arg_size = _u32;};
 
-main := (args_count (arg command crlf) (arg @{fcall blob; } crlf)+) ${_state = state::ok;};
+action done {
+    if (_args_list.size() + 1 == _args_count) {
+        _state = state::ok;
+        fbreak;
+    }
+}
+
+main := (args_count (arg command crlf @done) (arg @{fcall blob; } crlf @done)*);
 
 prepush {
     prepush();
@@ -210,6 +277,8 @@ public:
         error,
         eof,
         ok,
+        // a bulk argument is larger than max_bulk_len().
+        too_large,
     };
     enum class command {
         set,
@@ -294,6 +363,9 @@ public:
         zinter,
         zdiff,
         zscan,
+        scan,
+        hscan,
+        sscan,
         zrangebylex,
         zlexcount,
         zremrangebylex,
@@ -304,6 +376,7 @@ public:
         geopos,
         georadius,
         georadiusbymember,
+        geosearch,
         setbit,
         getbit,
         bitcount,
@@ -313,7 +386,41 @@ public:
         pfadd,
         pfcount,
         pfmerge,
+        info,
+        save,
+        bgsave,
+        lastsave,
+        pexpireat,
+        bgrewriteaof,
+        memory,
+        hotkeys,
+        replicaof,
+        psync,
+        cluster,
+        asking,
+        migrate,
+        blpop,
+        brpop,
+        blmove,
+        subscribe,
+        unsubscribe,
+        psubscribe,
+        punsubscribe,
+        publish,
+        pubsub,
+        shards,
+        unlink,
+        flushdb,
+        flushall,
+        swapdb,
+        multi,
+        exec,
+        discard,
+        watch,
+        unwatch,
+        unknown, // must be the last one
     };
+    static constexpr const size_t COMMAND_COUNT = static_cast<size_t>(command::unknown) + 1;
 
     state _state;
     command _command;
@@ -321,7 +428,58 @@ public:
     uint32_t _arg_size;
     uint32_t _args_count;
     uint32_t _size_left;
+    // Upper bound of the arguments reserved up front, the count is sent by the client.
+    static constexpr const uint32_t ARGS_RESERVE_MAX = 1024;
+    // Upper bound of a bulk argument allocated up front, the size is sent by the client.
+    static constexpr const uint32_t BLOB_RESERVE_MAX = 16 * 1024;
+    static constexpr const uint32_t DEFAULT_MAX_BULK_LEN = 512 * 1024 * 1024;
     std::vector<sstring>  _args_list;
+    // True if the buffer which completed the current request still holds a
+    // complete request, i.e. the client pipelined further requests which can
+    // be parsed without waiting for more input.
+    bool _pending_input;
+    // Whether [@p, @pe) starts with a whole request. The bytes which are not
+    // a multi bulk count as a request, their parse fails at once.
+    static bool buffered_request(const char* p, const char* pe) {
+        auto number = [&p, pe] (uint32_t& n) {
+            n = 0;
+            for (; p != pe && *p >= '0' && *p <= '9'; ++p) {
+                n = n * 10 + (*p - '0');
+            }
+            if (pe - p < 2) {
+                return false;
+            }
+            p += 2;
+            return true;
+        };
+        if (p == pe) {
+            return false;
+        }
+        if (*p++ != '*') {
+            return true;
+        }
+        uint32_t count = 0;
+        if (!number(count)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            if (p == pe) {
+                return false;
+            }
+            if (*p++ != '$') {
+                return true;
+            }
+            uint32_t size = 0;
+            if (!number(size)) {
+                return false;
+            }
+            if (uint64_t(pe - p) < uint64_t(size) + 2) {
+                return false;
+            }
+            p += size + 2;
+        }
+        return true;
+    }
 public:
     void init() {
         init_base();
@@ -330,6 +488,7 @@ public:
         _args_count = 0;
         _size_left = 0;
         _arg_size = 0;
+        _pending_input = false;
         %% write init;
     }
 
@@ -338,6 +497,7 @@ public:
         auto str = [this, &g, &p] { g.mark_end(p); return get_str(); };
         %% write exec;
         if (_state != state::error) {
+            _pending_input = _state == state::ok && buffered_request(p, pe);
             return p;
         }
         // error ?
@@ -350,4 +510,12 @@ public:
     bool eof() const {
         return _state == state::eof;
     }
+    bool pending_input() const {
+        return _pending_input;
+    }
+    // The largest bulk argument accepted from the clients of this shard, as proto-max-bulk-len.
+    static inline uint32_t& max_bulk_len() {
+        static thread_local uint32_t len = DEFAULT_MAX_BULK_LEN;
+        return len;
+    }
 };
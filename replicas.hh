@@ -0,0 +1,232 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/reactor.hh"
+#include "core/sstring.hh"
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+namespace redis {
+
+// Read only copies of the hot string and hash keys, and the bookkeeping of
+// both sides of them on a shard. The owner of a key publishes a copy of its
+// value to every other shard, which serves the reads of the key on the shard
+// of the connection. Every change of a published key drops the copies before
+// it's acknowledged, see database::replicated(), and the key is published
+// again once it's not changed for a sweep. The copies are moved between the
+// shards by the database, nothing here is shared across the shards.
+class key_replicas final {
+public:
+    // Maximum number of keys a shard publishes, of fields of a published hash,
+    // and of bytes of a published value.
+    static constexpr const size_t MAX_PUBLISHED = 32;
+    static constexpr const size_t MAX_FIELDS = 256;
+    static constexpr const size_t MAX_COPY_SIZE = 16 * 1024;
+    // Every SWEEP_PERIOD_MS the keys not changed since the last sweep are
+    // published again, and the hot keys not requested for KEEP_SECONDS are
+    // dropped.
+    static constexpr const unsigned SWEEP_PERIOD_MS = 100;
+    static constexpr const unsigned KEEP_SECONDS = 3;
+
+    struct copy {
+        bool _hash = false;
+        bool _volatile = false;
+        lowres_clock::time_point _deadline;
+        // The encoded bulk string of the value of a string, or of every field
+        // of a hash, the reads write it as is.
+        sstring _value;
+        std::unordered_map<sstring, sstring> _fields;
+
+        inline bool expired(lowres_clock::time_point now) const {
+            return _volatile && _deadline <= now;
+        }
+        size_t size() const {
+            auto size = _value.size();
+            for (auto& f : _fields) {
+                size += f.first.size() + f.second.size();
+            }
+            return size;
+        }
+    };
+
+    // "$<size>\r\n<data>\r\n"
+    static sstring encode_bulk(const char* data, size_t size) {
+        auto header = sstring("$") + to_sstring(size) + sstring("\r\n");
+        sstring encoded(sstring::initialized_later(), header.size() + size + 2);
+        auto p = std::copy_n(header.data(), header.size(), encoded.begin());
+        p = std::copy_n(data, size, p);
+        *p++ = '\r';
+        *p = '\n';
+        return encoded;
+    }
+private:
+    struct publication {
+        // The pinned keys are configured, the others are hot keys.
+        bool _pinned;
+        // Set while the copies are out, or on their way.
+        bool _published = false;
+        bool _changed = false;
+        lowres_clock::time_point _requested;
+    };
+    // The copies of the keys of the other shards.
+    std::unordered_map<sstring, copy> _copies;
+    // The keys of this shard to publish.
+    std::unordered_map<sstring, publication> _publications;
+    // The keys whose copies must be dropped.
+    std::vector<sstring> _invalidated;
+    uint64_t _hits = 0;
+    uint64_t _published_total = 0;
+    uint64_t _invalidated_total = 0;
+
+    inline void invalidate(const sstring& key, publication& p) {
+        if (p._published) {
+            p._published = false;
+            _invalidated.push_back(key);
+            ++_invalidated_total;
+        }
+    }
+public:
+    // [COPIES]
+    // The copy of @key, if it's held and not expired.
+    inline const copy* find(const sstring& key, lowres_clock::time_point now) {
+        if (_copies.empty()) {
+            return nullptr;
+        }
+        auto it = _copies.find(key);
+        if (it == _copies.end()) {
+            return nullptr;
+        }
+        if (it->second.expired(now)) {
+            _copies.erase(it);
+            return nullptr;
+        }
+        ++_hits;
+        return &it->second;
+    }
+    inline bool holds(const sstring& key, lowres_clock::time_point now) const {
+        if (_copies.empty()) {
+            return false;
+        }
+        auto it = _copies.find(key);
+        return it != _copies.end() && !it->second.expired(now);
+    }
+    inline void install(const sstring& key, const copy& c) {
+        _copies[key] = c;
+    }
+    inline void drop(const std::vector<sstring>& keys) {
+        for (auto& key : keys) {
+            _copies.erase(key);
+        }
+    }
+
+    // [PUBLICATIONS]
+    inline bool publishing() const {
+        return !_publications.empty();
+    }
+    // Adds @key to the keys to publish, or renews the promotion of a hot key.
+    // Returns true if the key should be published now.
+    bool request(const sstring& key, bool pinned, lowres_clock::time_point now) {
+        auto it = _publications.find(key);
+        if (it == _publications.end()) {
+            if (!pinned && _publications.size() >= MAX_PUBLISHED) {
+                return false;
+            }
+            it = _publications.emplace(key, publication { pinned }).first;
+        }
+        it->second._requested = now;
+        return !it->second._published && !it->second._changed;
+    }
+    void published(const sstring& key) {
+        auto it = _publications.find(key);
+        if (it != _publications.end() && !it->second._published) {
+            it->second._published = true;
+            ++_published_total;
+        }
+    }
+    // Called for every change of a key of this shard while keys are published.
+    inline void changed(const sstring& key) {
+        auto it = _publications.find(key);
+        if (it != _publications.end()) {
+            it->second._changed = true;
+            invalidate(key, it->second);
+        }
+    }
+    // Called when all the keys of this shard are dropped.
+    inline void changed_all() {
+        for (auto& p : _publications) {
+            p.second._changed = true;
+            invalidate(p.first, p.second);
+        }
+    }
+    // Drops the hot keys which cooled down, and hands every key which wasn't
+    // changed since the last sweep and isn't published to @publish, which
+    // returns true if it published the key.
+    template <typename Func>
+    void sweep(lowres_clock::time_point now, Func&& publish) {
+        auto keep = std::chrono::duration_cast<lowres_clock::duration>(std::chrono::seconds(unsigned(KEEP_SECONDS)));
+        for (auto it = _publications.begin(); it != _publications.end();) {
+            auto& p = it->second;
+            if (!p._pinned && now - p._requested > keep) {
+                invalidate(it->first, p);
+                it = _publications.erase(it);
+                continue;
+            }
+            if (!p._published && !p._changed && publish(it->first)) {
+                p._published = true;
+                ++_published_total;
+            }
+            p._changed = false;
+            ++it;
+        }
+    }
+    inline bool invalidated() const {
+        return !_invalidated.empty();
+    }
+    inline std::vector<sstring> take_invalidated() {
+        auto keys = std::move(_invalidated);
+        _invalidated.clear();
+        return keys;
+    }
+
+    // [STATS]
+    inline size_t copies() const {
+        return _copies.size();
+    }
+    size_t published_keys() const {
+        size_t n = 0;
+        for (auto& p : _publications) {
+            n += p.second._published ? 1 : 0;
+        }
+        return n;
+    }
+    inline uint64_t hits() const {
+        return _hits;
+    }
+    inline uint64_t published_total() const {
+        return _published_total;
+    }
+    inline uint64_t invalidated_total() const {
+        return _invalidated_total;
+    }
+};
+}
@@ -0,0 +1,406 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "replication.hh"
+#include <boost/algorithm/string.hpp>
+#include "core/fstream.hh"
+#include "core/reactor.hh"
+#include "core/seastar.hh"
+#include "core/sleep.hh"
+#include "net/packet-data-source.hh"
+#include "util/log.hh"
+#include "db.hh"
+#include "redis.hh"
+#include "redis_protocol.hh"
+
+using logger =  seastar::logger;
+static logger repl_log ("replication");
+
+namespace redis {
+
+void replication_backlog::enable()
+{
+    if (enabled() || _size == 0) {
+        return;
+    }
+    _ring.resize(_size);
+    reset();
+    _heartbeat.set_callback([this] { wake(); });
+    _heartbeat.arm_periodic(std::chrono::milliseconds(unsigned(HEARTBEAT_PERIOD_MS)));
+}
+
+void replication_backlog::reset()
+{
+    _replid = random_run_id();
+    // the offsets go on, the replicas of the old history can't resume.
+    _start = _end;
+    wake();
+}
+
+void replication_backlog::write(const char* data, size_t size)
+{
+    auto capacity = _ring.size();
+    _end += size;
+    if (size > capacity) {
+        data += size - capacity;
+        size = capacity;
+    }
+    auto position = (_end - size) % capacity;
+    auto n = std::min<size_t>(size, capacity - position);
+    std::memcpy(_ring.data() + position, data, n);
+    std::memcpy(_ring.data(), data + n, size - n);
+    if (_end - _start > capacity) {
+        _start = _end - capacity;
+    }
+    wake();
+}
+
+size_t replication_backlog::complete_size(uint64_t offset, size_t max) const
+{
+    // the changes are appended as whole commands, @offset is where one starts.
+    static constexpr const size_t SCAN_STEP = 4096;
+    aof_scanner scanner;
+    auto capacity = _ring.size();
+    uint64_t scanned = 0;
+    while (offset + scanned < _end && (scanned < max || scanner.valid_size() == 0)) {
+        auto position = (offset + scanned) % capacity;
+        auto n = std::min<uint64_t>(std::min<uint64_t>(_end - offset - scanned, capacity - position), SCAN_STEP);
+        if (!scanner.feed(_ring.data() + position, n)) {
+            break;
+        }
+        scanned += n;
+    }
+    return std::min<uint64_t>(scanner.valid_size(), _end - offset);
+}
+
+temporary_buffer<char> replication_backlog::read(uint64_t offset, size_t max) const
+{
+    auto size = std::min<uint64_t>(_end - offset, max);
+    temporary_buffer<char> data(size);
+    auto capacity = _ring.size();
+    auto position = offset % capacity;
+    auto n = std::min<size_t>(size, capacity - position);
+    std::memcpy(data.get_write(), _ring.data() + position, n);
+    std::memcpy(data.get_write() + n, _ring.data(), size - n);
+    return data;
+}
+
+future<> replication_backlog::wait(uint64_t offset)
+{
+    if (_end > offset || !enabled()) {
+        return make_ready_future<>();
+    }
+    if (!_waiters) {
+        _waiters = make_lw_shared<shared_promise<>>();
+    }
+    return _waiters->get_shared_future();
+}
+
+void replication_backlog::wake()
+{
+    if (_waiters) {
+        auto waiters = std::move(_waiters);
+        waiters->set_value();
+    }
+}
+
+void replication_backlog::close()
+{
+    _heartbeat.cancel();
+    _ring.clear();
+    _ring.shrink_to_fit();
+    wake();
+}
+
+struct replica_link::session {
+    connected_socket _socket;
+    input_stream<char> _in;
+    output_stream<char> _out;
+    // The snapshot of a full sync is written to this file, and loaded once
+    // it's complete.
+    sstring _path;
+    std::experimental::optional<output_stream<char>> _snapshot;
+    // Whether the commands received are counted into the offset.
+    bool _synced = false;
+
+    explicit session(connected_socket socket)
+        : _socket(std::move(socket))
+        , _in(_socket.input())
+        , _out(_socket.output())
+    {
+    }
+};
+
+// Reads a line, without its CRLF.
+static future<sstring> read_line(input_stream<char>& in)
+{
+    static constexpr const size_t MAX_LINE = 1024;
+    return do_with(std::string(), [&in] (auto& line) {
+        return repeat([&in, &line] {
+            return in.read_exactly(1).then([&line] (temporary_buffer<char> c) {
+                if (c.empty()) {
+                    throw std::runtime_error("the master closed the connection");
+                }
+                if (c[0] == '\n') {
+                    return stop_iteration::yes;
+                }
+                if (c[0] != '\r') {
+                    if (line.size() == MAX_LINE) {
+                        throw std::runtime_error("the line of the master is too long");
+                    }
+                    line.push_back(c[0]);
+                }
+                return stop_iteration::no;
+            });
+        }).then([&line] {
+            return sstring(line.data(), line.size());
+        });
+    });
+}
+
+replica_link::replica_link(redis_service& redis, distributed<database>& db, sstring directory)
+    : _db(db)
+    , _directory(std::move(directory))
+    , _tracer(std::make_unique<request_latency_tracer>())
+    , _protocol(std::make_unique<redis_protocol>(redis, false))
+    , _replies(data_sink(std::make_unique<null_data_sink>()), 8192)
+{
+}
+
+replica_link::~replica_link()
+{
+}
+
+future<> replica_link::follow(sstring host, uint16_t port)
+{
+    return with_semaphore(_switch, 1, [this, host, port] {
+        return stop_loop().then([this, host, port] {
+            _host = host;
+            _port = port;
+            _following = true;
+            _state = state::connecting;
+            _loop = run();
+        });
+    });
+}
+
+future<> replica_link::unfollow()
+{
+    return with_semaphore(_switch, 1, [this] {
+        return stop_loop();
+    });
+}
+
+future<> replica_link::stop_loop()
+{
+    _following = false;
+    if (_session) {
+        _session->_socket.shutdown_input();
+        _session->_socket.shutdown_output();
+    }
+    auto loop = std::move(_loop);
+    _loop = make_ready_future<>();
+    return loop.then([this] {
+        _state = state::none;
+    });
+}
+
+future<> replica_link::run()
+{
+    return do_until([this] { return !_following; }, [this] {
+        return link().handle_exception([this] (std::exception_ptr e) {
+            if (!_following) {
+                return make_ready_future<>();
+            }
+            ++_link_failures;
+            _state = state::connecting;
+            repl_log.warn("the link to the master {}:{} failed: {}", _host, _port, e);
+            return sleep(std::chrono::milliseconds(unsigned(RETRY_PERIOD_MS)));
+        });
+    });
+}
+
+future<> replica_link::link()
+{
+    auto address = make_ipv4_address(ipv4_addr(std::string(_host), _port));
+    return engine().connect(address).then([this] (connected_socket socket) {
+        auto s = make_lw_shared<session>(std::move(socket));
+        _session = s;
+        aof_encoder request;
+        request.append("PSYNC", _replid, _offset, engine().cpu_id(), smp::count);
+        auto data = request.release();
+        return s->_out.write(data.data(), data.size()).then([s] {
+            return s->_out.flush();
+        }).then([s] {
+            return read_line(s->_in);
+        }).then([this, s] (sstring line) {
+            std::vector<std::string> words;
+            boost::split(words, std::string(line.data(), line.size()), boost::is_any_of(" "));
+            if (words.size() == 3 && words[0] == "+FULLRESYNC") {
+                _state = state::syncing;
+                _replid = sstring(words[1].data(), words[1].size());
+                _offset = -1;
+                ++_full_syncs;
+                repl_log.info("full sync with the master {}:{}", _host, _port);
+                s->_path = shard_file_path(_directory, "replica-sync.rdb", engine().cpu_id());
+                return open_file_dma(s->_path, open_flags::wo | open_flags::create | open_flags::truncate).then([s] (file f) {
+                    s->_snapshot = make_file_output_stream(std::move(f), REPLICATION_FRAME_SIZE);
+                });
+            }
+            if (words.size() == 2 && words[0] == "+CONTINUE") {
+                _state = state::connected;
+                s->_synced = true;
+                ++_partial_syncs;
+                repl_log.info("resumed the link to the master {}:{} from offset {}", _host, _port, _offset);
+                return make_ready_future<>();
+            }
+            throw std::runtime_error(std::string("PSYNC failed: ") + std::string(line.data(), line.size()));
+        }).then([this, s] {
+            return repeat([this, s] {
+                return read_line(s->_in).then([this, s] (sstring header) {
+                    if (header.empty() || (header[0] != '$' && header[0] != '*' && header[0] != ':')) {
+                        throw std::runtime_error(std::string("unexpected frame: ") + std::string(header.data(), header.size()));
+                    }
+                    uint64_t value = 0;
+                    try {
+                        value = std::stoull(std::string(header.data() + 1, header.size() - 1));
+                    } catch (...) {
+                        throw std::runtime_error("bad frame size");
+                    }
+                    return on_frame(s, header[0], value);
+                });
+            });
+        }).finally([this, s] {
+            _session = {};
+            auto snapshot = make_ready_future<>();
+            if (s->_snapshot) {
+                snapshot = s->_snapshot->close().handle_exception([] (std::exception_ptr) {});
+            }
+            return snapshot.then([s] {
+                return s->_out.close().handle_exception([] (std::exception_ptr) {});
+            }).finally([s] {});
+        });
+    });
+}
+
+future<stop_iteration> replica_link::on_frame(lw_shared_ptr<session> s, char type, uint64_t value)
+{
+    if (type == ':') {
+        // the full sync is over, the changes of the backlog come next.
+        if (s->_snapshot || s->_synced) {
+            throw std::runtime_error("unexpected end of the full sync");
+        }
+        _offset = value;
+        s->_synced = true;
+        _state = state::connected;
+        repl_log.info("synced with the master {}:{} at offset {}", _host, _port, _offset);
+        return make_ready_future<stop_iteration>(stop_iteration::no);
+    }
+    if (type == '$' && !s->_snapshot) {
+        throw std::runtime_error("unexpected piece of a snapshot");
+    }
+    return s->_in.read_exactly(value + 2).then([this, s, type, value] (temporary_buffer<char> data) {
+        if (data.size() != value + 2) {
+            throw std::runtime_error("the master closed the connection");
+        }
+        data.trim(value);
+        if (type == '$') {
+            return s->_snapshot->write(std::move(data));
+        }
+        // the snapshot ends with the first commands.
+        auto loaded = s->_snapshot ? load_snapshot(s) : make_ready_future<>();
+        return loaded.then([this, s, data = std::move(data)] () mutable {
+            auto size = data.size();
+            return apply(std::move(data)).then([this, s, size] {
+                _applied_bytes += size;
+                if (s->_synced) {
+                    _offset += size;
+                }
+            });
+        });
+    }).then([] {
+        return stop_iteration::no;
+    });
+}
+
+future<> replica_link::load_snapshot(lw_shared_ptr<session> s)
+{
+    auto out = std::move(*s->_snapshot);
+    s->_snapshot = {};
+    return do_with(std::move(out), [] (auto& out) {
+        return out.close();
+    }).then([this, s] {
+        auto& db = _db.local();
+        db.flush_all();
+        database::record_forwarder forward = [this] (unsigned shard, temporary_buffer<char> records) {
+            return _db.invoke_on(shard, &database::load_records, std::move(records));
+        };
+        return db.load(s->_path, forward);
+    }).then([s] {
+        return remove_file(s->_path);
+    }).then([this] {
+        // the log of this shard starts over from the data of the master.
+        return _db.local().rewrite_log();
+    });
+}
+
+future<> replica_link::apply(temporary_buffer<char> commands)
+{
+    if (commands.empty()) {
+        return make_ready_future<>();
+    }
+    input_stream<char> in(data_source(std::make_unique<packet_data_source>(net::packet(std::move(commands)))));
+    return do_with(std::move(in), [this] (auto& in) {
+        return do_until([&in] { return in.eof(); }, [this, &in] {
+            return _protocol->handle(in, _replies, *_tracer);
+        });
+    });
+}
+
+replica_link::status replica_link::get_status() const
+{
+    status s;
+    s._following = _following;
+    s._host = _host;
+    s._port = _port;
+    s._state = _state;
+    s._offset = _offset;
+    s._full_syncs = _full_syncs;
+    s._partial_syncs = _partial_syncs;
+    s._applied_bytes = _applied_bytes;
+    s._link_failures = _link_failures;
+    return s;
+}
+
+const char* replica_link::state_name(state s)
+{
+    switch (s) {
+    case state::none:
+        return "none";
+    case state::connecting:
+        return "connecting";
+    case state::syncing:
+        return "sync";
+    case state::connected:
+        return "connected";
+    }
+    return "none";
+}
+}
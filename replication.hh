@@ -0,0 +1,251 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/distributed.hh"
+#include "core/semaphore.hh"
+#include "core/shared_future.hh"
+#include "core/shared_ptr.hh"
+#include "core/sstring.hh"
+#include "core/temporary_buffer.hh"
+#include "core/timer.hh"
+#include "net/api.hh"
+#include <experimental/optional>
+#include <memory>
+#include <vector>
+#include "aof.hh"
+#include "reply.hh"
+
+namespace redis {
+class database;
+class redis_service;
+class redis_protocol;
+class request_latency_tracer;
+
+// [REPLICATION]
+// Every shard of a replica follows the same shard of its master (PSYNC, with the
+// shard and the number of shards), the shards of both run the same number of
+// shards, so that every key is owned by the same shard on both sides. The master
+// answers with frames:
+//   "$<n>\r\n<n bytes>\r\n"  a piece of the snapshot of the shard, for a full sync.
+//   "*<n>\r\n<n bytes>\r\n"  whole commands changing the data of the shard, "*0"
+//                            is a heartbeat. The first ones after a snapshot are
+//                            the changes of the entries sent while it was saved.
+//   ":<offset>\r\n"          the end of a full sync, the commands from here on
+//                            are the ones of the backlog after @offset.
+static constexpr const size_t REPLICATION_FRAME_SIZE = 64 * 1024;
+
+// A step of the stream to a replica: the frames, and the offset of the backlog
+// the stream is at after them. @_synced is false while the snapshot is sent.
+// The chunk returned by PSYNC names the history of the backlog.
+struct replication_chunk {
+    reply _frames;
+    sstring _replid;
+    uint64_t _offset = 0;
+    bool _synced = false;
+};
+
+// Appends a frame of @type holding @data to @frames, without copying @data.
+inline void add_replication_frame(reply_chunks& frames, char type, temporary_buffer<char> data)
+{
+    auto header = sstring(&type, 1) + to_sstring(data.size()) + sstring("\r\n");
+    frames.emplace_back(header.c_str(), header.size());
+    if (data.size() > 0) {
+        frames.push_back(std::move(data));
+    }
+    frames.emplace_back("\r\n", 2);
+}
+// Appends @line and its CRLF to @frames.
+inline void add_replication_line(reply_chunks& frames, const sstring& line)
+{
+    auto l = line + sstring("\r\n");
+    frames.emplace_back(l.c_str(), l.size());
+}
+
+// The last changes of a shard, kept for its replicas as the commands replaying
+// them. The offsets count the bytes appended since the backlog was enabled, by
+// the first replica of the shard; the replication id names this history, a
+// replica resumes from its offset only while its id is the current one, and the
+// offset is still in the backlog.
+class replication_backlog final {
+public:
+    static constexpr const size_t DEFAULT_SIZE = 1024 * 1024;
+    // The streams waiting for changes are woken this often, they send a heartbeat.
+    static constexpr const unsigned HEARTBEAT_PERIOD_MS = 1000;
+private:
+    size_t _size = DEFAULT_SIZE;
+    std::vector<char> _ring;
+    sstring _replid;
+    uint64_t _start = 0;
+    uint64_t _end = 0;
+    aof_encoder _encoder;
+    // The changes of the entries already sent by the running full sync.
+    bool _syncing = false;
+    aof_encoder _sync_pending;
+    lw_shared_ptr<shared_promise<>> _waiters;
+    timer<lowres_clock> _heartbeat;
+    unsigned _streams = 0;
+    uint64_t _full_syncs = 0;
+    uint64_t _partial_syncs = 0;
+
+    void write(const char* data, size_t size);
+    void wake();
+public:
+    // Sets the size of the backlog, before it's enabled.
+    inline void configure(size_t size) { _size = size; }
+    inline bool enabled() const { return !_ring.empty(); }
+    void enable();
+    // Starts a new history, e.g. the data of the shard was replaced by the one of
+    // its master. The replicas of this shard sync again.
+    void reset();
+
+    inline const sstring& replid() const { return _replid; }
+    inline uint64_t start_offset() const { return _start; }
+    inline uint64_t end_offset() const { return _end; }
+    inline bool contains(const sstring& replid, uint64_t offset) const
+    {
+        return enabled() && replid == _replid && offset >= _start && offset <= _end;
+    }
+
+    // Appends the command changing the database @db, @synced is true if the
+    // changed entry was already sent by the running full sync, which gets the
+    // command too then.
+    template <typename... Args>
+    inline void append(size_t db, bool synced, const char* command, const Args&... args)
+    {
+        _encoder.select_db(db);
+        auto offset = _encoder.size();
+        _encoder.append(command, args...);
+        if (synced && _syncing) {
+            _sync_pending.select_db(db);
+            _sync_pending.append_raw(_encoder.data() + offset, _encoder.size() - offset);
+        }
+        write(_encoder.data(), _encoder.size());
+        _encoder.clear();
+    }
+    // The size of the whole commands from @offset, at least one, at most @max
+    // bytes of them unless the first one is larger.
+    size_t complete_size(uint64_t offset, size_t max) const;
+    // Copies at most @max bytes from @offset, which is in the backlog.
+    temporary_buffer<char> read(uint64_t offset, size_t max) const;
+    // Resolves once there are bytes after @offset, or at the next heartbeat.
+    future<> wait(uint64_t offset);
+
+    inline bool syncing() const { return _syncing; }
+    inline void begin_sync()
+    {
+        _syncing = true;
+        _sync_pending.forget_db();
+        ++_full_syncs;
+    }
+    // Returns the commands appended during the sync, the stream goes on from
+    // the end of the backlog, where the replica doesn't know the database
+    // selected.
+    inline std::vector<char> finish_sync()
+    {
+        _syncing = false;
+        _encoder.forget_db();
+        return _sync_pending.release();
+    }
+    inline void abort_sync()
+    {
+        _syncing = false;
+        _sync_pending.release();
+    }
+
+    inline void open_stream(bool partial)
+    {
+        ++_streams;
+        if (partial) {
+            ++_partial_syncs;
+        }
+    }
+    inline void close_stream() { --_streams; }
+    inline unsigned streams() const { return _streams; }
+    inline uint64_t full_syncs() const { return _full_syncs; }
+    inline uint64_t partial_syncs() const { return _partial_syncs; }
+    inline size_t size() const { return _ring.size(); }
+
+    void close();
+};
+
+// The link of a shard of a replica to the same shard of its master. It asks for
+// the changes after the last offset it applied, loads the snapshot of the master
+// if they aren't in the backlog any more, then applies the changes as they are
+// streamed. The link is set up again after a failure, from where it stopped.
+class replica_link final {
+public:
+    static constexpr const unsigned RETRY_PERIOD_MS = 1000;
+    enum class state { none, connecting, syncing, connected };
+private:
+    struct session;
+    distributed<database>& _db;
+    sstring _directory;
+    bool _following = false;
+    sstring _host;
+    uint16_t _port = 0;
+    state _state = state::none;
+    // The history of the master and the offset applied, -1 before a full sync.
+    sstring _replid { "?" };
+    int64_t _offset = -1;
+    lw_shared_ptr<session> _session;
+    future<> _loop = make_ready_future<>();
+    // REPLICAOF switches the master one call at a time.
+    semaphore _switch { 1 };
+    std::unique_ptr<request_latency_tracer> _tracer;
+    std::unique_ptr<redis_protocol> _protocol;
+    output_stream<char> _replies;
+    uint64_t _full_syncs = 0;
+    uint64_t _partial_syncs = 0;
+    uint64_t _applied_bytes = 0;
+    uint64_t _link_failures = 0;
+
+    future<> stop_loop();
+    future<> run();
+    future<> link();
+    future<stop_iteration> on_frame(lw_shared_ptr<session> s, char type, uint64_t value);
+    future<> load_snapshot(lw_shared_ptr<session> s);
+    future<> apply(temporary_buffer<char> commands);
+public:
+    replica_link(redis_service& redis, distributed<database>& db, sstring directory);
+    ~replica_link();
+
+    // Follows the same shard of the master at @host:@port, instead of the current one.
+    future<> follow(sstring host, uint16_t port);
+    // Stops following the master, the data is kept.
+    future<> unfollow();
+    future<> stop() { return unfollow(); }
+
+    // The state of the link reported by INFO.
+    struct status {
+        bool _following = false;
+        sstring _host;
+        uint16_t _port = 0;
+        state _state = state::none;
+        int64_t _offset = -1;
+        uint64_t _full_syncs = 0;
+        uint64_t _partial_syncs = 0;
+        uint64_t _applied_bytes = 0;
+        uint64_t _link_failures = 0;
+    };
+    status get_status() const;
+    static const char* state_name(state s);
+};
+}
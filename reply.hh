@@ -0,0 +1,234 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/shared_ptr.hh"
+#include "core/reactor.hh"
+#include "core/sharded.hh"
+#include "core/stream.hh"
+#include "core/sstring.hh"
+#include "core/scattered_message.hh"
+#include "core/temporary_buffer.hh"
+#include "core/future-util.hh"
+#include <vector>
+#include <cstring>
+#include <cassert>
+
+namespace redis {
+using scattered_message_ptr = foreign_ptr<lw_shared_ptr<scattered_message<char>>>;
+using reply_chunks = std::vector<temporary_buffer<char>>;
+using reply_chunks_ptr = foreign_ptr<lw_shared_ptr<reply_chunks>>;
+
+// The chunks of a reply produced one at a time on the shard owning the data,
+// see entry_stream. next() returns an empty buffer once the reply is done.
+class reply_stream {
+public:
+    virtual ~reply_stream() {}
+    virtual temporary_buffer<char> next() = 0;
+};
+using reply_stream_ptr = foreign_ptr<shared_ptr<reply_stream>>;
+
+// The reply of a command, which is moved back to the shard owning the connection.
+// Small replies (":1\r\n", "+OK\r\n", short bulk strings, ...) are encoded into
+// the inline buffer and carried by value, no heap object is allocated or freed
+// across the cores for them. Large replies keep the scattered message, and the
+// replies of whole collections are encoded into chunks, see chunked_reply.
+// The replies of the largest collections are streamed, see reply_stream.
+class reply final {
+public:
+    static constexpr const size_t INLINE_CAPACITY = 96;
+private:
+    scattered_message_ptr _message;
+    reply_chunks_ptr _chunks;
+    reply_stream_ptr _stream;
+    uint8_t _size = 0;
+    char _data[INLINE_CAPACITY];
+public:
+    reply() {}
+    explicit reply(lw_shared_ptr<scattered_message<char>> m) : _message(std::move(m)) {}
+    explicit reply(lw_shared_ptr<reply_chunks> chunks) : _chunks(std::move(chunks)) {}
+    explicit reply(shared_ptr<reply_stream> stream) : _stream(make_foreign(std::move(stream))) {}
+    reply(reply&& o) noexcept
+        : _message(std::move(o._message))
+        , _chunks(std::move(o._chunks))
+        , _stream(std::move(o._stream))
+        , _size(o._size)
+    {
+        std::memcpy(_data, o._data, _size);
+    }
+    reply& operator = (reply&& o) noexcept {
+        if (this != &o) {
+            _message = std::move(o._message);
+            _chunks = std::move(o._chunks);
+            _stream = std::move(o._stream);
+            _size = o._size;
+            std::memcpy(_data, o._data, _size);
+        }
+        return *this;
+    }
+    reply(const reply&) = delete;
+    reply& operator = (const reply&) = delete;
+
+    inline bool fits(size_t size) const {
+        return _size + size <= INLINE_CAPACITY;
+    }
+    // The caller should make sure the data fits into the inline buffer.
+    inline reply& append(const char* data, size_t size) {
+        assert(fits(size));
+        std::memcpy(_data + _size, data, size);
+        _size += size;
+        return *this;
+    }
+    inline reply& append(const sstring& data) {
+        return append(data.data(), data.size());
+    }
+    // Appends a bulk string, "$<size>\r\n<data>\r\n".
+    inline reply& append_bulk(const char* data, size_t size) {
+        append("$", 1).append(to_sstring(size));
+        return append("\r\n", 2).append(data, size).append("\r\n", 2);
+    }
+    // Upper bound of the encoded size of a bulk string of @size bytes.
+    static inline constexpr size_t bulk_size(size_t size) {
+        return size + 25;
+    }
+
+    // The chunks are written one by one, each write waits for the output stream
+    // to accept the previous one, and every chunk is released once written.
+    inline future<> write(output_stream<char>& out) {
+        if (_message) {
+            return out.write(std::move(*_message));
+        }
+        if (_chunks) {
+            auto chunks = std::move(_chunks);
+            auto& c = *chunks;
+            return do_for_each(c.begin(), c.end(), [&out] (temporary_buffer<char>& chunk) {
+                return out.write(std::move(chunk));
+            }).finally([chunks = std::move(chunks)] {});
+        }
+        if (_stream) {
+            return write_stream(out);
+        }
+        return out.write(_data, _size);
+    }
+private:
+    // Every chunk of a stream is produced by a task of its own on the owner
+    // shard, after a yield, so that the other requests of the shard run in
+    // between. The next chunk is produced once the previous one is written.
+    future<> write_stream(output_stream<char>& out) {
+        return do_with(std::move(_stream), [&out] (reply_stream_ptr& stream) {
+            auto owner = stream.get_owner_shard();
+            return repeat([&out, &stream, owner] {
+                return smp::submit_to(owner, [s = stream.get()] {
+                    return later().then([s] {
+                        return s->next();
+                    });
+                }).then([&out] (temporary_buffer<char> chunk) {
+                    if (chunk.empty()) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
+                    }
+                    return out.write(std::move(chunk)).then([] {
+                        return stop_iteration::no;
+                    });
+                });
+            });
+        });
+    }
+};
+
+// Encodes a reply holding a whole collection (HGETALL, SMEMBERS, LRANGE, ...)
+// straight from the container into buffers of at most CHUNK_SIZE bytes. No
+// fragment is allocated per element, the largest allocation does not grow with
+// the collection, and the client receives the chunks as the connection drains.
+class chunked_reply final {
+public:
+    static constexpr const size_t CHUNK_SIZE = 16 * 1024;
+private:
+    lw_shared_ptr<reply_chunks> _chunks;
+    temporary_buffer<char> _current;
+    size_t _used = 0;
+    // Bytes appended since the chunks were last taken.
+    size_t _size = 0;
+
+    void seal() {
+        if (_used > 0) {
+            _current.trim(_used);
+            _chunks->push_back(std::move(_current));
+            _used = 0;
+        }
+    }
+public:
+    // The first chunk is sized after @hint, the expected size of the reply, so
+    // that a small collection does not pin a whole chunk.
+    explicit chunked_reply(size_t hint = CHUNK_SIZE)
+        : _chunks(make_lw_shared<reply_chunks>())
+        , _current(hint < reply::INLINE_CAPACITY ? reply::INLINE_CAPACITY : (hint < CHUNK_SIZE ? hint : CHUNK_SIZE))
+    {
+    }
+
+    chunked_reply& append(const char* data, size_t size) {
+        while (size > 0) {
+            if (_used == _current.size()) {
+                seal();
+                _current = temporary_buffer<char>(CHUNK_SIZE);
+            }
+            auto n = std::min(size, _current.size() - _used);
+            std::memcpy(_current.get_write() + _used, data, n);
+            _used += n;
+            data += n;
+            size -= n;
+            _size += n;
+        }
+        return *this;
+    }
+    inline chunked_reply& append(const sstring& data) {
+        return append(data.data(), data.size());
+    }
+    // Appends a bulk string, "$<size>\r\n<data>\r\n".
+    inline chunked_reply& append_bulk(const char* data, size_t size) {
+        append("$", 1).append(to_sstring(size)).append("\r\n", 2);
+        return append(data, size).append("\r\n", 2);
+    }
+    inline chunked_reply& append_bulk(const sstring& data) {
+        return append_bulk(data.data(), data.size());
+    }
+    // Appends the header of an array of @count elements, "*<count>\r\n".
+    inline chunked_reply& append_array(size_t count) {
+        return append("*", 1).append(to_sstring(count)).append("\r\n", 2);
+    }
+
+    inline size_t size() const {
+        return _size;
+    }
+
+    // Takes the chunks encoded so far, the next appends go to a new chunk.
+    reply_chunks take_chunks() {
+        seal();
+        reply_chunks chunks;
+        chunks.swap(*_chunks);
+        _size = 0;
+        return chunks;
+    }
+
+    reply finish() {
+        seal();
+        return reply(std::move(_chunks));
+    }
+};
+}
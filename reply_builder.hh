@@ -37,18 +37,131 @@
 #include "dict_lsa.hh"
 #include "sset_lsa.hh"
 #include "geo.hh"
+#include "reply.hh"
+#include <deque>
+#include <functional>
 namespace redis {
-using scattered_message_ptr = foreign_ptr<lw_shared_ptr<scattered_message<char>>>;
+
+// Encodes the reply of a whole collection lazily, about a chunk per task, on
+// the shard owning the entry, so that the other requests of the shard run in
+// between, and only a chunk or so of the reply is held at a time.
+//
+// Every step calls @_next(e, r, moved), which appends the next elements of
+// the value of @e to @r, until r.size() reaches a chunk, and returns false
+// once the value is done; @moved is set if the compaction may have moved the
+// value since the previous step, the positions kept into it are stale then.
+// The entry is found again by its key after a compaction. When the entry is
+// about to change or to go, the cache calls read_all(), which encodes the rest
+// of the value at once, the reply stands for the value as it was when read.
+class entry_stream final : public reply_stream, public entry_reader {
+public:
+    using next_type = std::function<bool (const cache_entry& e, chunked_reply& r, bool moved)>;
+    // Smaller collections are encoded at once, a stream costs a task per chunk.
+    static constexpr const size_t min_elements = 1024;
+private:
+    cache* _cache;
+    sstring _key;
+    logalloc::region& _region;
+    uint64_t _reclaim_counter;
+    const cache_entry* _entry;
+    next_type _next;
+    chunked_reply _encoded;
+    std::deque<temporary_buffer<char>> _chunks;
+    bool _done = false;
+
+    void take() {
+        for (auto& chunk : _encoded.take_chunks()) {
+            _chunks.push_back(std::move(chunk));
+        }
+    }
+
+    void finish() {
+        _done = true;
+        _next = nullptr;
+        _entry = nullptr;
+        if (_cache) {
+            _cache->detach(_key, *this);
+            _cache = nullptr;
+        }
+    }
+public:
+    // The reply is an array of @count elements.
+    entry_stream(cache& c, logalloc::region& r, const cache_entry& e, size_t count, next_type&& next)
+        : _cache(&c)
+        , _key(e.key_data(), e.key_size())
+        , _region(r)
+        , _reclaim_counter(r.reclaim_counter())
+        , _entry(&e)
+        , _next(std::move(next))
+    {
+        _encoded.append_array(count);
+        _cache->attach(e, *this);
+    }
+
+    entry_stream(const entry_stream&) = delete;
+    entry_stream& operator = (const entry_stream&) = delete;
+
+    ~entry_stream() {
+        if (_cache) {
+            _cache->detach(_key, *this);
+        }
+    }
+
+    virtual temporary_buffer<char> next() override {
+        if (_chunks.empty() && !_done) {
+            logalloc::reclaim_lock lock(_region);
+            auto moved = _region.reclaim_counter() != _reclaim_counter;
+            if (moved) {
+                redis_key rk {_key};
+                _entry = _cache->peek(rk);
+                _reclaim_counter = _region.reclaim_counter();
+            }
+            assert(_entry != nullptr);
+            auto more = _next(*_entry, _encoded, moved);
+            take();
+            if (!more) {
+                finish();
+            }
+        }
+        if (_chunks.empty()) {
+            return temporary_buffer<char>();
+        }
+        auto chunk = std::move(_chunks.front());
+        _chunks.pop_front();
+        return chunk;
+    }
+
+    // The cache unregistered the stream already.
+    virtual void read_all(const cache_entry& e) override {
+        _cache = nullptr;
+        if (_done) {
+            return;
+        }
+        logalloc::reclaim_lock lock(_region);
+        auto moved = _region.reclaim_counter() != _reclaim_counter;
+        while (_next(e, _encoded, moved)) {
+            moved = false;
+        }
+        take();
+        finish();
+    }
+};
 
 class reply_builder final {
 public:
-static future<scattered_message_ptr> build(size_t size)
+static future<reply> build(size_t size)
 {
+    auto&& n = to_sstring(size);
+    reply r;
+    if (r.fits(n.size() + 3)) {
+        r.append(msg_num_tag).append(n).append(msg_crlf);
+        return make_ready_future<reply>(std::move(r));
+    }
     auto m = make_lw_shared<scattered_message<char>>();
     m->append_static(msg_num_tag);
-    m->append(to_sstring(size));
+    m->append(std::move(n));
     m->append_static(msg_crlf);
-    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+    return make_ready_future<reply>(reply(m));
 }
 static future<> build_local(output_stream<char>& out, size_t size)
 {
@@ -59,23 +172,33 @@ static future<> build_local(output_stream<char>& out, size_t size)
     return out.write(std::move(*m));
 }
 
-static future<scattered_message_ptr> build(double number)
+static future<reply> build(double number)
 {
-    auto m = make_lw_shared<scattered_message<char>>();
     auto&& n = to_sstring(number);
+    reply r;
+    if (r.fits(reply::bulk_size(n.size()))) {
+        r.append_bulk(n.data(), n.size());
+        return make_ready_future<reply>(std::move(r));
+    }
+    auto m = make_lw_shared<scattered_message<char>>();
     m->append_static(msg_batch_tag);
     m->append(to_sstring(n.size()));
     m->append_static(msg_crlf);
     m->append(std::move(n));
     m->append_static(msg_crlf);
-    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+    return make_ready_future<reply>(reply(m));
 }
 
-static future<scattered_message_ptr> build(const sstring& message)
+static future<reply> build(const sstring& message)
 {
+   reply r;
+   if (r.fits(message.size())) {
+       r.append(message);
+       return make_ready_future<reply>(std::move(r));
+   }
    auto m = make_lw_shared<scattered_message<char>>();
    m->append(message);
-   return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+   return make_ready_future<reply>(reply(m));
 }
 
 inline static future<> build_local(output_stream<char>& out, const sstring& message)
@@ -84,8 +207,15 @@ inline static future<> build_local(output_stream<char>& out, const sstring& mess
 }
 
 template<bool Key, bool Value>
-static future<scattered_message_ptr> build(const cache_entry* e)
+static future<reply> build(const cache_entry* e)
 {
+    if (!Key && Value && e && e->type_of_bytes()) {
+        reply r;
+        if (r.fits(reply::bulk_size(e->value_bytes_size()))) {
+            r.append_bulk(e->value_bytes_data(), e->value_bytes_size());
+            return make_ready_future<reply>(std::move(r));
+        }
+    }
     if (e) {
         //build reply
         auto m = make_lw_shared<scattered_message<char>>();
@@ -121,7 +251,7 @@ static future<scattered_message_ptr> build(const cache_entry* e)
             else {
                m->append_static(msg_type_err);
             }
-            return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+            return make_ready_future<reply>(reply(m));
         }
     }
     else {
@@ -130,72 +260,95 @@ static future<scattered_message_ptr> build(const cache_entry* e)
 }
 
 template<bool Key, bool Value>
-static future<scattered_message_ptr> build(const std::vector<const dict_entry*>& entries)
+static void append_field(chunked_reply& r, const dict_field& e)
 {
-    if (!entries.empty()) {
-        //build reply
-        auto m = make_lw_shared<scattered_message<char>>();
-        m->append_static(msg_sigle_tag);
-        if (Key && Value) {
-           m->append(std::move(to_sstring(entries.size() * 2)));
+    if (Key) {
+        if (e) {
+            r.append_bulk(e.key_data(), e.key_size());
         }
         else {
-           m->append(std::move(to_sstring(entries.size())));
+            r.append(msg_not_found);
         }
-        m->append_static(msg_crlf);
-        for (size_t i = 0; i < entries.size(); ++i) {
-            const auto e = entries[i];
-            if (Key) {
-                if (e) {
-                    m->append_static(msg_batch_tag);
-                    m->append(to_sstring(e->key_size()));
-                    m->append_static(msg_crlf);
-                    m->append(sstring{e->key_data(), e->key_size()});
-                    m->append_static(msg_crlf);
-                }
-                else {
-                    m->append_static(msg_not_found);
-                }
+    }
+    if (Value) {
+        if (e) {
+            if (e.type_of_integer()) {
+                r.append_bulk(to_sstring(e.value_integer()));
+            }
+            else if (e.type_of_float()) {
+                r.append_bulk(to_sstring(e.value_float()));
             }
-            if (Value) {
-                if (e) {
-                    m->append_static(msg_batch_tag);
-                    if (e->type_of_integer()) {
-                        auto&& n = to_sstring(e->value_integer());
-                        m->append(to_sstring(n.size()));
-                        m->append_static(msg_crlf);
-                        m->append(n);
-                        m->append_static(msg_crlf);
-                    }
-                    else if (e->type_of_float()) {
-                        auto&& n = to_sstring(e->value_float());
-                        m->append(to_sstring(n.size()));
-                        m->append_static(msg_crlf);
-                        m->append(n);
-                        m->append_static(msg_crlf);
-                    }
-                    else if (e->type_of_bytes()) {
-                        m->append(to_sstring(e->value_bytes_size()));
-                        m->append_static(msg_crlf);
-                        m->append(sstring{e->value_bytes_data(), e->value_bytes_size()});
-                        m->append_static(msg_crlf);
-                    }
-                    else {
-                        m->append_static(msg_type_err);
-                    }
-                }
-                else {
-                    m->append_static(msg_not_found);
-                }
+            else if (e.type_of_bytes()) {
+                r.append_bulk(e.value_bytes_data(), e.value_bytes_size());
+            }
+            else {
+                r.append(msg_type_err);
             }
         }
-        return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+        else {
+            r.append(msg_not_found);
+        }
+    }
+}
+
+template<bool Key, bool Value>
+static future<reply> build(const std::vector<dict_field>& entries)
+{
+    if (!entries.empty()) {
+        chunked_reply r(entries.size() * 64);
+        r.append_array(Key && Value ? entries.size() * 2 : entries.size());
+        for (const auto& e : entries) {
+            append_field<Key, Value>(r, e);
+        }
+        return make_ready_future<reply>(r.finish());
     }
     else {
         return reply_builder::build(msg_nil);
     }
 }
 
+// HGETALL, HKEYS, HVALS and SMEMBERS: the fields are encoded while the
+// collection is walked, without collecting them first.
+template<bool Key, bool Value>
+static future<reply> build(const dict_lsa& dict)
+{
+    auto size = dict.size();
+    if (size > 0) {
+        chunked_reply r(size * 64);
+        r.append_array(Key && Value ? size * 2 : size);
+        dict.for_each([&r] (const dict_field& e) {
+            append_field<Key, Value>(r, e);
+        });
+        return make_ready_future<reply>(r.finish());
+    }
+    else {
+        return reply_builder::build(msg_nil);
+    }
+}
+
+// The same of the collection of @e, streamed if it's large. The cursor of a
+// scan counts buckets, it does not point into the table.
+template<bool Key, bool Value>
+static future<reply> build(cache& c, logalloc::region& region, const cache_entry& e)
+{
+    const auto& dict = e.type_of_set() ? e.value_set() : e.value_map();
+    if (dict.size() < entry_stream::min_elements) {
+        return build<Key, Value>(dict);
+    }
+    auto count = Key && Value ? dict.size() * 2 : dict.size();
+    size_t cursor = 0;
+    auto stream = make_shared<entry_stream>(c, region, e, count, [cursor] (const cache_entry& e, chunked_reply& r, bool) mutable {
+        const auto& dict = e.type_of_set() ? e.value_set() : e.value_map();
+        do {
+            cursor = dict.scan(cursor, [&r] (const dict_field& f) {
+                append_field<Key, Value>(r, f);
+            });
+        } while (cursor != 0 && r.size() < chunked_reply::CHUNK_SIZE);
+        return cursor != 0;
+    });
+    return make_ready_future<reply>(reply(std::move(stream)));
+}
+
 static  future<> build_local(output_stream<char>& out, std::vector<foreign_ptr<lw_shared_ptr<sstring>>>& entries)
 {
     if (!entries.empty()) {
@@ -241,8 +394,15 @@ static  future<> build_local(output_stream<char>& out, const std::vector<sstring
 }
 
 template<bool Key, bool Value>
-static future<scattered_message_ptr> build(const dict_entry* e)
+static future<reply> build(const dict_field* e)
 {
+    if (!Key && Value && e && e->type_of_bytes()) {
+        reply r;
+        if (r.fits(reply::bulk_size(e->value_bytes_size()))) {
+            r.append_bulk(e->value_bytes_data(), e->value_bytes_size());
+            return make_ready_future<reply>(std::move(r));
+        }
+    }
     if (e) {
         //build reply
         auto m = make_lw_shared<scattered_message<char>>();
@@ -278,40 +438,75 @@ static future<scattered_message_ptr> build(const dict_entry* e)
             else {
                m->append_static(msg_type_err);
             }
-            return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+            return make_ready_future<reply>(reply(m));
         }
-        return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+        return make_ready_future<reply>(reply(m));
     }
     else {
         return reply_builder::build(msg_nil);
     }
 }
 
-static future<scattered_message_ptr> build(const std::vector<const managed_bytes*>& data)
+static future<reply> build(const std::vector<bytes_view>& data)
 {
-    auto m = make_lw_shared<scattered_message<char>>();
-    m->append(msg_sigle_tag);
-    m->append(to_sstring(data.size()));
-    m->append_static(msg_crlf);
-    for (size_t i = 0; i < data.size(); ++i) {
-        m->append_static(msg_batch_tag);
-        m->append(to_sstring(data[i]->size()));
-        m->append_static(msg_crlf);
-        m->append(sstring{reinterpret_cast<const char*>(data[i]->data()), data[i]->size()});
-        m->append_static(msg_crlf);
+    size_t hint = 0;
+    for (const auto& d : data) {
+        hint += reply::bulk_size(d.size());
     }
-    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+    chunked_reply r(hint);
+    r.append_array(data.size());
+    for (const auto& d : data) {
+        r.append_bulk(reinterpret_cast<const char*>(d.data()), d.size());
+    }
+    return make_ready_future<reply>(r.finish());
 }
 
-static future<scattered_message_ptr> build(const managed_bytes& data)
+// LRANGE: the @count elements of the list of @e from @start on, streamed if
+// they are many.
+static future<reply> build(cache& c, logalloc::region& region, const cache_entry& e, size_t start, size_t count)
 {
+    if (count < entry_stream::min_elements) {
+        std::vector<bytes_view> data;
+        if (count > 0) {
+            e.value_list().fetch(start, start + count - 1, data);
+        }
+        return build(data);
+    }
+    list_lsa::cursor position;
+    auto stream = make_shared<entry_stream>(c, region, e, count, [start, count, position] (const cache_entry& e, chunked_reply& r, bool moved) mutable {
+        if (moved) {
+            position = list_lsa::cursor();
+        }
+        e.value_list().walk(start, position, [&] (bytes_view v) {
+            r.append_bulk(reinterpret_cast<const char*>(v.data()), v.size());
+            ++start;
+            --count;
+            return count > 0 && r.size() < chunked_reply::CHUNK_SIZE;
+        });
+        return count > 0;
+    });
+    return make_ready_future<reply>(reply(std::move(stream)));
+}
+
+static future<reply> build(bytes_view data)
+{
+    reply r;
+    if (r.fits(reply::bulk_size(data.size()))) {
+        r.append_bulk(reinterpret_cast<const char*>(data.data()), data.size());
+        return make_ready_future<reply>(std::move(r));
+    }
     auto m = make_lw_shared<scattered_message<char>>();
     m->append_static(msg_batch_tag);
     m->append(to_sstring(data.size()));
     m->append_static(msg_crlf);
     m->append(sstring{reinterpret_cast<const char*>(data.data()), data.size()});
     m->append_static(msg_crlf);
-    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+    return make_ready_future<reply>(reply(m));
+}
+
+static future<reply> build(const managed_bytes& data)
+{
+    return build(static_cast<bytes_view>(data));
 }
 
 static future<> build_local(output_stream<char>& out, std::unordered_map<sstring, double>& data, bool with_score)
@@ -343,44 +538,59 @@ static future<> build_local(output_stream<char>& out, std::unordered_map<sstring
     return out.write(std::move(*m));
 }
 
-static future<scattered_message_ptr> build(const std::vector<const sset_entry*>& entries, bool with_score)
+static future<reply> build(const std::vector<const sset_entry*>& entries, bool with_score)
 {
     if (!entries.empty()) {
-        //build reply
-        auto m = make_lw_shared<scattered_message<char>>();
-        m->append_static(msg_sigle_tag);
-        if (with_score) {
-            m->append(std::move(to_sstring(entries.size() * 2)));
-        }
-        else {
-            m->append(std::move(to_sstring(entries.size())));
-        }
-        m->append_static(msg_crlf);
-        for (size_t i = 0; i < entries.size(); ++i) {
-            const auto& e = entries[i];
+        size_t hint = 0;
+        for (const auto e : entries) {
             assert(e != nullptr);
-            m->append_static(msg_batch_tag);
-            m->append(to_sstring(e->key_size()));
-            m->append_static(msg_crlf);
-            m->append(sstring{e->key_data(), e->key_size()});
-            m->append_static(msg_crlf);
+            hint += reply::bulk_size(e->key_size()) + (with_score ? 32 : 0);
+        }
+        chunked_reply r(hint);
+        r.append_array(with_score ? entries.size() * 2 : entries.size());
+        for (const auto e : entries) {
+            r.append_bulk(e->key_data(), e->key_size());
             if (with_score) {
-                m->append_static(msg_batch_tag);
-                auto&& n = to_sstring(e->score());
-                m->append(to_sstring(n.size()));
-                m->append_static(msg_crlf);
-                m->append(n);
-                m->append_static(msg_crlf);
+                r.append_bulk(to_sstring(e->score()));
             }
         }
-        return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+        return make_ready_future<reply>(r.finish());
     }
     else {
         return reply_builder::build(msg_nil);
     }
 }
 
-static future<scattered_message_ptr> build(std::vector<sstring>& data)
+// ZRANGE and ZREVRANGE: the members of the sorted set of @e between the
+// ranks @begin and @end, streamed if they are many. A rank is found again
+// in logarithmic time, no position is kept into the set.
+static future<reply> build(cache& c, logalloc::region& region, const cache_entry& e, long begin, long end, bool reverse, bool with_score)
+{
+    const auto& sset = e.value_sset();
+    std::vector<const sset_entry*> entries;
+    if (!sset.normalize_rank(begin, end) || static_cast<size_t>(end - begin + 1) < entry_stream::min_elements) {
+        sset.fetch_by_rank(begin, end, entries, reverse);
+        return build(entries, with_score);
+    }
+    size_t rank = begin;
+    size_t count = end - begin + 1;
+    auto stream = make_shared<entry_stream>(c, region, e, with_score ? count * 2 : count,
+            [rank, count, reverse, with_score] (const cache_entry& e, chunked_reply& r, bool) mutable {
+        e.value_sset().for_each_from_rank(rank, reverse, [&] (const sset_entry& m) {
+            r.append_bulk(m.key_data(), m.key_size());
+            if (with_score) {
+                r.append_bulk(to_sstring(m.score()));
+            }
+            ++rank;
+            --count;
+            return count > 0 && r.size() < chunked_reply::CHUNK_SIZE;
+        });
+        return count > 0;
+    });
+    return make_ready_future<reply>(reply(std::move(stream)));
+}
+
+static future<reply> build(std::vector<sstring>& data)
 {
     auto m = make_lw_shared<scattered_message<char>>();
     m->append_static(msg_sigle_tag);
@@ -394,7 +604,33 @@ static future<scattered_message_ptr> build(std::vector<sstring>& data)
         m->append(std::move(uu));
         m->append_static(msg_crlf);
     }
-    return make_ready_future<scattered_message_ptr>(foreign_ptr<lw_shared_ptr<scattered_message<char>>>(m));
+    return make_ready_future<reply>(reply(m));
+}
+
+// The reply of the SCAN family: the next cursor, then the array of @elements.
+static future<reply> build_scan(size_t cursor, std::vector<sstring>& elements)
+{
+    auto m = make_lw_shared<scattered_message<char>>();
+    auto&& c = to_sstring(cursor);
+    m->append_static(msg_sigle_tag);
+    m->append_static("2");
+    m->append_static(msg_crlf);
+    m->append_static(msg_batch_tag);
+    m->append(to_sstring(c.size()));
+    m->append_static(msg_crlf);
+    m->append(std::move(c));
+    m->append_static(msg_crlf);
+    m->append_static(msg_sigle_tag);
+    m->append(to_sstring(elements.size()));
+    m->append_static(msg_crlf);
+    for (auto& e : elements) {
+        m->append_static(msg_batch_tag);
+        m->append(to_sstring(e.size()));
+        m->append_static(msg_crlf);
+        m->append(std::move(e));
+        m->append_static(msg_crlf);
+    }
+    return make_ready_future<reply>(reply(m));
 }
 
 static future<> build_local(output_stream<char>& out, std::vector<std::tuple<sstring, double, double, double, double>>& u, int flags)
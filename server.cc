@@ -24,15 +24,112 @@ void server::setup_metrics()
 {
     namespace sm = seastar::metrics;
     _metrics.add_group("connections", {
-        sm::make_counter("opened_total", [this] { return _stats._connections_total; }, sm::description("Total number of connections opened.")),
-        sm::make_counter("current_total", [this] { return _stats._connections_current; }, sm::description("Total number of connections current opened.")),
+        sm::make_counter("opened_total", [this] { return _latency_tracer.connections_total(); }, sm::description("Total number of connections opened.")),
+        sm::make_counter("current_total", [this] { return _latency_tracer.connections_current(); }, sm::description("Total number of connections current opened.")),
+        sm::make_gauge("bytes_per_connection", [this] { return _connections.empty() ? 0.0 : double(connections_memory()) / _connections.size(); },
+                       sm::description("Mean bytes of a connection opened: its state, its output buffer, the arguments of its requests and its queued messages, besides its socket buffers.")),
+        sm::make_gauge("bytes", [this] { return connections_memory(); }, sm::description("Bytes of the connections opened, besides their socket buffers.")),
+    });
+
+    _metrics.add_group("connections", {
+        sm::make_counter("flushes", [this] { return _flush_stats._flushes; }, sm::description("Total number of flushes of the replies to the sockets.")),
+        sm::make_counter("flushed_bytes", [this] { return _flush_stats._bytes; }, sm::description("Total bytes of the replies written to the sockets.")),
+        sm::make_gauge("bytes_per_flush", [this] { return _flush_stats._flushes ? double(_flush_stats._bytes) / _flush_stats._flushes : 0.0; }, sm::description("Mean bytes written to a socket by a flush.")),
     });
 
     _metrics.add_group("reqests", {
         sm::make_counter("served_total", [this] { return _latency_tracer.served(); }, sm::description("Total number of served requests.")),
         sm::make_counter("serving_total", [this] { return _latency_tracer.serving(); }, sm::description("Total number of requests being serving.")),
         sm::make_counter("exception_total", [this] { return _latency_tracer.number_exceptions(); }, sm::description("Total number of bad requests.")),
-        sm::make_gauge("latency", [this] { return _latency_tracer.latency(); }, sm::description("Request latency (us).")),
+        sm::make_counter("rejected_total", [this] { return _latency_tracer.rejected(); }, sm::description("Total number of requests refused with -BUSY, their shard was overloaded.")),
+        sm::make_gauge("latency", [this] { return _latency_tracer.latency(); }, sm::description("Mean request latency (us).")),
+    });
+
+    static auto shard_label = sm::label("owner");
+    _metrics.add_group("hotkeys", {
+        sm::make_counter("sampled", [this] { return _latency_tracer.sampled_keys().samples(); }, sm::description("Total number of key accesses counted by the hot key sketch.")),
+        sm::make_gauge("hottest_ops", [this] { return _latency_tracer.sampled_keys().hottest(); }, sm::description("Estimated accesses per second of the hottest key requested from this shard.")),
     });
+    for (unsigned owner = 0; owner < smp::count; ++owner) {
+        _metrics.add_group("hotkeys", {
+            sm::make_gauge("ops_to_shard", [this, owner] { return _latency_tracer.sampled_keys().ops_by_shard()[owner]; },
+                           sm::description("Estimated accesses per second requested from this shard to the keys of the owner shard."), {shard_label(owner)}),
+        });
+        _metrics.add_group("reqests", {
+            sm::make_gauge("serving_on_shard", [this, owner] { return _latency_tracer.serving_on(owner); },
+                           sm::description("Number of requests of this shard being served by the owner shard."), {shard_label(owner)}),
+        });
+    }
+
+    static auto command_label = sm::label("command");
+    for (size_t i = 0; i < redis_protocol_parser::COMMAND_COUNT; ++i) {
+        auto command = static_cast<redis_protocol_parser::command>(i);
+        auto label = command_label(command_name(command));
+        _metrics.add_group("commands", {
+            sm::make_counter("calls", [this, command] { return _latency_tracer.latency_of(command).count(); }, sm::description("Total number of calls."), {label}),
+            sm::make_counter("usec", [this, command] { return _latency_tracer.latency_of(command).sum(); }, sm::description("Total time (us) spent serving the calls."), {label}),
+            sm::make_gauge("latency_p50", [this, command] { return _latency_tracer.latency_of(command).percentile(0.5); }, sm::description("Median latency (us)."), {label}),
+            sm::make_gauge("latency_p99", [this, command] { return _latency_tracer.latency_of(command).percentile(0.99); }, sm::description("99th percentile latency (us)."), {label}),
+            sm::make_gauge("latency_p999", [this, command] { return _latency_tracer.latency_of(command).percentile(0.999); }, sm::description("99.9th percentile latency (us)."), {label}),
+        });
+    }
+}
+
+size_t server::connections_memory() const
+{
+    size_t bytes = 0;
+    for (auto c : _connections) {
+        bytes += c->memory_usage();
+    }
+    return bytes;
+}
+
+future<> server::serve(lw_shared_ptr<connection> conn)
+{
+    _latency_tracer.open_connection();
+    _connections.insert(conn.get());
+    // a subscriber too slow to read its messages is dropped.
+    conn->_proto.set_disconnect([c = conn.get()] {
+        c->_socket.shutdown_input();
+        c->_socket.shutdown_output();
+    });
+    return do_until([conn] { return conn->_in.eof() || conn->_proto.protocol_error(); }, [this, conn] {
+        return conn->_proto.handle(conn->_in, conn->_out, _latency_tracer).then([conn] {
+            // a client pipelining more requests than a batch gets their replies
+            // by as few writes as the output buffer allows.
+            if (conn->_proto.pending_input()) {
+                return make_ready_future<>();
+            }
+            return conn->_out.flush();
+        }).then([conn] {
+            conn->_proto.release_messages();
+        });
+    }).finally([this, conn] {
+        _latency_tracer.close_connection();
+        _connections.erase(conn.get());
+        return conn->_proto.close().finally([conn] {
+            return conn->_out.close().finally([conn]{});
+        });
+    }).handle_exception([] (std::exception_ptr e) {
+        // the connection was reset by the client, or failed, it is closed anyway.
+    });
+}
+
+void server::replicate_hot_keys()
+{
+    std::vector<sstring> keys;
+    for (auto& c : _latency_tracer.sampled_keys().counters()) {
+        if (c._shard != engine().cpu_id() && c.ops() >= _replicate_ops) {
+            keys.push_back(c._key);
+        }
+    }
+    if (keys.empty()) {
+        return;
+    }
+    (void)do_with(std::move(keys), [this] (auto& keys) {
+        return do_for_each(keys, [this] (const sstring& key) {
+            return _redis.replicate(key);
+        });
+    }).handle_exception([] (std::exception_ptr e) {});
 }
 }
@@ -23,70 +23,129 @@
 #include "db.hh"
 #include "redis.hh"
 #include "redis_protocol.hh"
+#include "core/iostream.hh"
 #include "core/metrics_registration.hh"
-#include "core/thread.hh"
+#include "core/timer.hh"
+#include <unordered_set>
 namespace redis {
+// The bytes written to the sockets of the connections, and by how many flushes.
+struct flush_stats {
+    uint64_t _flushes = 0;
+    uint64_t _bytes = 0;
+};
+
+// Passes the buffers of the output stream of a connection to its socket as
+// they are, and counts them.
+class counting_sink final : public data_sink_impl {
+    output_stream<char> _out;
+    flush_stats& _stats;
+public:
+    counting_sink(output_stream<char>&& out, flush_stats& stats) : _out(std::move(out)), _stats(stats) {}
+    using data_sink_impl::put;
+    virtual future<> put(net::packet data) override {
+        _stats._bytes += data.len();
+        return _out.write(std::move(data));
+    }
+    virtual future<> flush() override {
+        ++_stats._flushes;
+        return _out.flush();
+    }
+    virtual future<> close() override {
+        return _out.close();
+    }
+};
+
 class server {
 private:
     lw_shared_ptr<server_socket> _listener;
+    // Listens on the port of this shard only, see start().
+    lw_shared_ptr<server_socket> _shard_listener;
     redis_service& _redis;
     uint16_t _port;
+    uint16_t _shard_ports_base;
+    flush_stats _flush_stats;
     struct connection {
+        // The replies are written to the socket once they fill the buffer, or
+        // once the requests buffered in the input are all served.
+        static constexpr const size_t OUTPUT_BUFFER_SIZE = 8192;
         connected_socket _socket;
         socket_address _addr;
         input_stream<char> _in;
         output_stream<char> _out;
         redis_protocol _proto;
-        connection(connected_socket&& socket, socket_address addr, redis_service& redis)
+        connection(connected_socket&& socket, socket_address addr, redis_service& redis, flush_stats& stats)
             : _socket(std::move(socket))
               , _addr(addr)
               , _in(_socket.input())
-              , _out(_socket.output())
+              , _out(data_sink(std::make_unique<counting_sink>(_socket.output(), stats)), OUTPUT_BUFFER_SIZE)
               , _proto(redis)
         {
         }
         ~connection() {
         }
+        // The bytes of the connection, its output buffer included, besides the
+        // buffers of its socket.
+        size_t memory_usage() const {
+            return sizeof(*this) + OUTPUT_BUFFER_SIZE + _proto.memory_usage();
+        }
     };
+    // The connections opened, for their memory.
+    std::unordered_set<const connection*> _connections;
+    size_t connections_memory() const;
     seastar::metrics::metric_groups _metrics;
     void setup_metrics();
-    struct stats {
-        uint64_t _connections_current = 0;
-        uint64_t _connections_total = 0;
-    };
-    stats _stats;
+    // Serves the requests of a connection until it is closed. The loop is made
+    // of continuations only, a connection costs its own state and its buffers,
+    // and no thread stack.
+    future<> serve(lw_shared_ptr<connection> conn);
+    void accept(lw_shared_ptr<server_socket> listener) {
+        keep_doing([this, listener] {
+           return listener->accept().then([this] (connected_socket fd, socket_address addr) mutable {
+               (void)serve(make_lw_shared<connection>(std::move(fd), addr, _redis, _flush_stats));
+           });
+       }).or_terminate();
+    }
     request_latency_tracer _latency_tracer;
+    // The keys of other shards requested more often than this (per second) by
+    // the clients of this shard are replicated here, 0 means never.
+    double _replicate_ops;
+    timer<lowres_clock> _replication_timer;
+    void replicate_hot_keys();
 public:
-    server(redis_service& db, uint16_t port = 6379)
+    // A shard serving @remote_limit requests of the clients of this shard
+    // refuses the next ones with -BUSY, 0 means no limit. The clients sending
+    // a bulk argument larger than @max_bulk_len are dropped.
+    server(redis_service& db, uint16_t port = 6379, double replicate_ops = 0, uint16_t shard_ports_base = 0, uint64_t remote_limit = 0,
+           uint32_t max_bulk_len = redis_protocol_parser::DEFAULT_MAX_BULK_LEN)
         : _redis(db)
         , _port(port)
+        , _shard_ports_base(shard_ports_base)
+        , _replicate_ops(replicate_ops)
     {
+        _latency_tracer.set_remote_limit(remote_limit);
+        redis_protocol_parser::max_bulk_len() = max_bulk_len;
         setup_metrics();
     }
 
     void start() {
+        if (_replicate_ops > 0 && smp::count > 1) {
+            _replication_timer.set_callback([this] { replicate_hot_keys(); });
+            _replication_timer.arm_periodic(std::chrono::seconds(unsigned(hot_keys::PERIOD_SECONDS)));
+        }
         listen_options lo;
         lo.reuse_address = true;
         _listener = engine().listen(make_ipv4_address({_port}), lo);
-        keep_doing([this] {
-           return _listener->accept().then([this] (connected_socket fd, socket_address addr) mutable {
-               return seastar::async([this, &fd, addr] {
-                   ++_stats._connections_total;
-                   ++_stats._connections_current;
-                   auto conn = make_lw_shared<connection>(std::move(fd), addr, _redis);
-                   do_until([conn] { return conn->_in.eof(); }, [this, conn] {
-                       return conn->_proto.handle(conn->_in, conn->_out, _latency_tracer).then([this, conn] {
-                           return conn->_out.flush();
-                       });
-                   }).finally([this, conn] {
-                       --_stats._connections_current;
-                       return conn->_out.close().finally([conn]{});
-                   });
-               });
-           });
-       }).or_terminate();
+        accept(_listener);
+        if (_shard_ports_base > 0) {
+            // only this shard listens on its port, the connections made to it
+            // are served by the shard owning the keys of a shard aware client.
+            auto port = uint16_t(_shard_ports_base + engine().cpu_id());
+            _shard_listener = engine().listen(make_ipv4_address({port}), lo);
+            accept(_shard_listener);
+        }
     }
     future<> stop() {
+        _replication_timer.cancel();
         return make_ready_future<>();
     }
 };
@@ -26,7 +26,6 @@
 #include "core/sstring.hh"
 #include "util/log.hh"
 #include "common.hh"
-#include <boost/intrusive/list.hpp>
 #include <boost/intrusive/set.hpp>
 #include "utils/managed_bytes.hh"
 #include "utils/managed_ref.hh"
@@ -41,32 +40,78 @@ using logger =  seastar::logger;
 static logger sset_log ("sset");
 
 namespace redis {
-struct sset_entry
+// Node of the order statistic tree that keeps the members of a sorted set
+// ordered by (score, member). Every node knows the size of the subtree it
+// roots, which turns rank lookups, selections by rank and counts by score
+// range into O(log n) walks. The tree is a treap whose priorities are the
+// member hashes, so no extra state is needed to keep it balanced.
+//
+// Nodes live in LSA memory and may be moved by the compactor, therefore the
+// links go both ways and the move constructor patches the neighbours.
+struct sset_node
+{
+    sset_node* _parent = nullptr;
+    sset_node* _left = nullptr;
+    sset_node* _right = nullptr;
+    size_t _count = 1;
+
+    sset_node() noexcept {}
+    sset_node(sset_node&& o) noexcept
+        : _parent(o._parent)
+        , _left(o._left)
+        , _right(o._right)
+        , _count(o._count)
+    {
+        if (_parent != nullptr) {
+            if (_parent->_left == &o) {
+                _parent->_left = this;
+            }
+            else if (_parent->_right == &o) {
+                _parent->_right = this;
+            }
+        }
+        if (_left != nullptr) _left->_parent = this;
+        if (_right != nullptr) _right->_parent = this;
+        o._parent = o._left = o._right = nullptr;
+        o._count = 1;
+    }
+
+    static inline size_t count(const sset_node* n) {
+        return n != nullptr ? n->_count : 0;
+    }
+};
+
+struct sset_entry : public sset_node
 {
     using set_hook_type = boost::intrusive::set_member_hook<>;
-    using list_hook_type = boost::intrusive::list_member_hook<>;
-    list_hook_type _list_link;
     set_hook_type _set_link;
     managed_bytes _key;
     size_t _key_hash;
     double _score;
 
     sset_entry(const sstring& key, const double score) noexcept
-        : _list_link()
+        : sset_node()
         , _set_link()
-        , _key(std::move(*(current_allocator().construct<managed_bytes>(bytes_view {reinterpret_cast<const signed char*>(key.data()), key.size()}))))
+        , _key(bytes_view {reinterpret_cast<const signed char*>(key.data()), key.size()})
         , _key_hash(std::hash<managed_bytes>()(_key))
         , _score(score)
     {
     }
 
+    // The compaction moves a member, the new one takes its place in the tree
+    // of the members too. The source is left unlinked.
     sset_entry(sset_entry&& o) noexcept
-        : _list_link(std::move(o._list_link))
-        , _set_link(std::move(o._set_link))
+        : sset_node(std::move(o))
+        , _set_link()
         , _key(std::move(o._key))
         , _key_hash(std::move(o._key_hash))
         , _score(std::move(o._score))
     {
+        using algorithms = boost::intrusive::rbtree_algorithms<boost::intrusive::rbtree_node_traits<void*, false>>;
+        if (o._set_link.is_linked()) {
+            algorithms::replace_node(&o._set_link, &_set_link);
+            algorithms::init(&o._set_link);
+        }
     }
 
     ~sset_entry()
@@ -99,6 +144,17 @@ struct sset_entry
         }
     };
 
+    // Order of the members in the score index: by score, then by member,
+    // the same as redis does for members with equal scores.
+    struct score_compare {
+        inline bool operator () (const sset_entry& l, const sset_entry& r) const noexcept {
+            if (l.score() != r.score()) {
+                return l.score() < r.score();
+            }
+            return compare()(l, r);
+        }
+    };
+
     const managed_bytes& key() const {
         return _key;
     }
@@ -127,16 +183,14 @@ class sset_lsa final {
     using dict_type = boost::intrusive::set<sset_entry,
         boost::intrusive::member_hook<sset_entry, sset_entry::set_hook_type, &sset_entry::_set_link>,
         boost::intrusive::compare<sset_entry::compare>>;
-    using list_type = boost::intrusive::list<sset_entry,
-        boost::intrusive::member_hook<sset_entry, boost::intrusive::list_member_hook<>,
-        &sset_entry::_list_link>>;
     dict_type _dict;
-    list_type _list;
+    // The left child of the header is the root of the score index.
+    sset_node _header;
 public:
-    sset_lsa() noexcept : _dict(), _list()
+    sset_lsa() noexcept : _dict(), _header()
     {
     }
-    sset_lsa(sset_lsa&& o) noexcept : _dict(std::move(o._dict)), _list(std::move(o._list))
+    sset_lsa(sset_lsa&& o) noexcept : _dict(std::move(o._dict)), _header(std::move(o._header))
     {
     }
     ~sset_lsa()
@@ -145,17 +199,41 @@ public:
     }
     void flush_all()
     {
-        _list.clear_and_dispose(current_deleter<sset_entry>());
+        _dict.clear_and_dispose(current_deleter<sset_entry>());
+        _header._left = nullptr;
+    }
+
+    // Erases up to @budget members, and takes them off @budget. The score index
+    // is dropped at once and the members are unlinked without rebalancing, so
+    // the sorted set is only good for more releases. Returns true once empty.
+    bool release(size_t& budget)
+    {
+        _header._left = nullptr;
+        while (budget > 0 && !_dict.empty()) {
+            current_deleter<sset_entry>()(_dict.unlink_leftmost_without_rebalance());
+            --budget;
+        }
+        return _dict.empty();
+    }
+
+    // Bytes allocated for the sorted set and its members.
+    size_t memory_usage() const
+    {
+        size_t usage = sizeof(sset_lsa);
+        for (auto& e : _dict) {
+            usage += sizeof(sset_entry) + e._key.external_memory_usage();
+        }
+        return usage;
     }
 
     inline bool insert(sset_entry* e)
     {
         assert(e != nullptr);
-        if (insert_ordered(e)) {
-            auto r = _dict.insert(*e);
-            return r.second;
+        auto r = _dict.insert(*e);
+        if (r.second) {
+            insert_ordered(e);
         }
-        return false;
+        return r.second;
     }
 
     size_t insert_if_not_exists(std::unordered_map<sstring, double>& members)
@@ -185,11 +263,8 @@ public:
             const auto& score = member.second;
             auto it = _dict.find(key, sset_entry::compare());
             if (it != _dict.end()) {
-                //remove it from list, update score, insert it to list again.
-                auto lit = list_type::s_iterator_to(*it);
-                _list.erase(lit);
                 it->update_score(score);
-                if (insert_ordered(&(*it))) {
+                if (update(&(*it))) {
                     inserted++;
                 }
             }
@@ -236,98 +311,121 @@ public:
         return inserted;
     }
 
-    void fetch_by_rank(long begin, long end, std::vector<std::pair<sstring, double>>& entries) const
+    // Calls @func on at most @limit members following @after in the order of
+    // the members, from the first one if @from_start. Returns true if members
+    // are left after them.
+    template <typename Func>
+    bool for_each_after(bool from_start, const sstring& after, size_t limit, Func&& func) const
     {
-        if (_list.empty()) {
-            return;
+        auto it = from_start ? _dict.begin() : _dict.upper_bound(after, sset_entry::compare());
+        for (; it != _dict.end() && limit > 0; ++it, --limit) {
+            func(*it);
         }
-        auto size = _list.size();
-        if (begin < 0) { begin += static_cast<long>(size); }
-        while (end < 0) { end += static_cast<long>(size); }
+        return it != _dict.end();
+    }
+
+    // The order of the members, the one of for_each_after().
+    static inline bool member_less(const sstring& l, const sstring& r)
+    {
+        return sset_entry::compare().compare_impl(l.data(), l.size(), r.data(), r.size());
+    }
+
+    // Applies the redis conventions to a rank range: negative ranks count
+    // from the end and the end is clamped to the last member. Returns false
+    // if the range selects nothing.
+    inline bool normalize_rank(long& begin, long& end) const
+    {
+        const auto size = static_cast<long>(this->size());
+        if (begin < 0) begin += size;
+        if (end < 0) end += size;
         if (begin < 0) begin = 0;
-        if (begin > end) {
-           return;
-        }
-        if (begin > static_cast<long>(size)) {
-            begin = static_cast<long>(size);
-        }
-        long rank = 0;
-        if (rank_out_of_range(begin, end)) {
+        if (end >= size) end = size - 1;
+        return begin <= end && begin < size;
+    }
+
+    void fetch_by_rank(long begin, long end, std::vector<std::pair<sstring, double>>& entries) const
+    {
+        if (!normalize_rank(begin, end)) {
             return;
         }
-        for (auto it = _list.begin(); it != _list.end(); ++it, ++rank) {
-            if (rank < begin) {
-                continue;
-            }
-            else if (rank > end) {
-                return;
-            }
-            else {
-                const auto& e = *it;
-                entries.emplace_back(std::pair<sstring, double>(sstring(e.key_data(), e.key_size()), e.score()));
-            }
+        auto n = select(static_cast<size_t>(begin));
+        for (long rank = begin; rank <= end && n != nullptr; ++rank, n = next(n)) {
+            const auto& e = *n;
+            entries.emplace_back(std::pair<sstring, double>(sstring(e.key_data(), e.key_size()), e.score()));
         }
     }
 
-    void fetch_by_rank(long begin, long end, std::vector<const sset_entry*>& entries) const
+    // With @reverse set, ranks are counted from the highest score down, as
+    // ZREVRANGE does, and the members are returned in that order.
+    void fetch_by_rank(long begin, long end, std::vector<const sset_entry*>& entries, bool reverse = false) const
     {
-        if (_list.empty()) {
+        if (!normalize_rank(begin, end)) {
             return;
         }
-        auto size = _list.size();
-        if (begin < 0) { begin += static_cast<long>(size); }
-        while (end < 0) { end += static_cast<long>(size); }
-        if (begin < 0) begin = 0;
-        if (begin > end) {
-           return;
+        auto n = select(reverse ? size() - 1 - static_cast<size_t>(begin) : static_cast<size_t>(begin));
+        for (long rank = begin; rank <= end && n != nullptr; ++rank) {
+            entries.push_back(n);
+            n = reverse ? prev(n) : next(n);
         }
-        if (begin > static_cast<long>(size)) {
-            begin = static_cast<long>(size);
-        }
-        long rank = 0;
-        if (rank_out_of_range(begin, end)) {
+    }
+
+    // Calls @func on the members from the rank @rank on, until it returns
+    // false. With @reverse set, ranks are counted from the highest score
+    // down, and the members are visited in that order.
+    template <typename Func>
+    void for_each_from_rank(size_t rank, bool reverse, Func&& func) const
+    {
+        if (rank >= size()) {
             return;
         }
-        for (auto it = _list.begin(); it != _list.end(); ++it, ++rank) {
-            if (rank < begin) {
-                continue;
-            }
-            else if (rank > end) {
-                return;
-            }
-            else {
-                const auto& e = *it;
-                entries.push_back(&e);
-            }
+        auto n = select(reverse ? size() - 1 - rank : rank);
+        while (n != nullptr && func(*n)) {
+            n = reverse ? prev(n) : next(n);
         }
     }
 
-    void fetch_by_score(const double min, const double max, std::vector<const sset_entry*>& entries, size_t limit = 0) const
+    // With @reverse set, the members are returned from @max down to @min.
+    void fetch_by_score(const double min, const double max, std::vector<const sset_entry*>& entries, size_t limit = 0, bool reverse = false) const
     {
-        if (_list.empty()) {
-            return;
-        }
-        if (score_out_of_range(min, max)) {
+        if (empty() || min > max) {
             return;
         }
         if (limit == 0) {
-            limit = _list.size();
+            limit = size();
         }
-        for (auto it = _list.begin(); it != _list.end(); ++it) {
-            const auto& score = it->score();
-            if (score < min) {
-                continue;
+        auto n = reverse ? upper_bound(max) : lower_bound(min);
+        while (n != nullptr && n->score() >= min && n->score() <= max) {
+            entries.push_back(n);
+            if (entries.size() >= limit) {
+                break;
             }
-            else if (score > max) {
+            n = reverse ? prev(n) : next(n);
+        }
+    }
+
+    // Calls @func on up to @count members from the rank @cursor, by score, and
+    // returns the next cursor of a ZSCAN, 0 at the end. Unlike the hash tables
+    // the cursor is a rank: the members added or removed before it between the
+    // calls shift the ones after it.
+    template <typename Func>
+    size_t scan(size_t cursor, size_t count, Func&& func) const
+    {
+        auto n = select(cursor);
+        for (; n != nullptr && count > 0; n = next(n), --count, ++cursor) {
+            func(*n);
+        }
+        return n != nullptr ? cursor : 0;
+    }
+
+    // Calls @func on the members whose score is in [@min, @max), by score, as
+    // long as it returns true.
+    template <typename Func>
+    void for_each_in_range(const double min, const double max, Func&& func) const
+    {
+        for (auto n = lower_bound(min); n != nullptr && n->score() < max; n = next(n)) {
+            if (!func(*n)) {
                 return;
             }
-            else {
-                const auto& e = *it;
-                entries.push_back(&e);
-                if (entries.size() >= limit) {
-                    break;
-                }
-            }
         }
     }
 
@@ -346,10 +444,8 @@ public:
     {
         auto it = _dict.find(key, sset_entry::compare());
         if (it != _dict.end()) {
-            auto lit = list_type::s_iterator_to(*it);
-            _list.erase(lit);
             it->update_score(delta);
-            return insert_ordered(&(*it));
+            return update(&(*it));
         }
         return false;
     }
@@ -357,10 +453,9 @@ public:
     size_t erase(std::vector<const sset_entry*>& entries)
     {
         for (size_t i = 0; i < entries.size(); ++i) {
-            auto lit = list_type::s_iterator_to(*entries[i]);
-            auto dit = dict_type::s_iterator_to(*lit);
-            _dict.erase(dit);
-            _list.erase_and_dispose(lit, current_deleter<sset_entry>());
+            auto e = const_cast<sset_entry*>(entries[i]);
+            erase_ordered(e);
+            _dict.erase_and_dispose(dict_type::s_iterator_to(*e), current_deleter<sset_entry>());
         }
         return entries.size();
     }
@@ -372,9 +467,8 @@ public:
             auto& key = keys[i];
             auto dit = _dict.find(key, sset_entry::compare());
             if (dit != _dict.end()) {
-                auto lit = list_type::s_iterator_to(*dit);
-                _dict.erase(dit);
-                _list.erase_and_dispose(lit, current_deleter<sset_entry>());
+                erase_ordered(&(*dit));
+                _dict.erase_and_dispose(dit, current_deleter<sset_entry>());
                 removed++;
             }
         }
@@ -383,26 +477,10 @@ public:
 
     size_t count_by_score(const double min, const double max) const
     {
-        if (_dict.empty()) {
+        if (empty() || min > max) {
             return 0;
         }
-        if (score_out_of_range(min, max)) {
-            return 0;
-        }
-        size_t count = 0;
-        for (auto it = _list.begin(); it != _list.end(); ++it) {
-            auto score = it->score();
-            if (score < min) {
-                continue;
-            }
-            else if (score > max) {
-                break;
-            }
-            else {
-                count++;
-            }
-        }
-        return count;
+        return count_below(max, true) - count_below(min, false);
     }
 
     template <typename Func>
@@ -431,29 +509,43 @@ public:
 
     inline size_t size() const
     {
-        return _list.size();
+        return sset_node::count(_header._left);
     }
 
     inline bool empty() const
     {
-        return _list.empty();
+        return _header._left == nullptr;
     }
 
     void erase(const sstring& key)
     {
-        auto removed = _dict.erase(_dict.find(key, sset_entry::compare()));
-        if (removed != _dict.end()) {
-            _list.erase_and_dispose(list_type::s_iterator_to(*removed), current_deleter<sset_entry>());
+        auto dit = _dict.find(key, sset_entry::compare());
+        if (dit != _dict.end()) {
+            erase_ordered(&(*dit));
+            _dict.erase_and_dispose(dit, current_deleter<sset_entry>());
+        }
+    }
+
+    // Calls @func on every member, from the highest score to the lowest.
+    template <typename Func>
+    void reverse_for_each(Func&& func) const
+    {
+        for (auto n = last(); n != nullptr; n = prev(n)) {
+            func(*n);
         }
     }
 
     std::experimental::optional<size_t> rank(const sstring& key) const
     {
-        size_t rank = 0;
         auto it = _dict.find(key, sset_entry::compare());
         if (it != _dict.end()) {
-            auto lit = list_type::s_iterator_to(*it);
-            for (auto i = _list.begin(); i != lit; ++i, ++rank) {}
+            const sset_node* n = &(*it);
+            size_t rank = sset_node::count(n->_left);
+            for (; n->_parent != &_header; n = n->_parent) {
+                if (n == n->_parent->_right) {
+                    rank += sset_node::count(n->_parent->_left) + 1;
+                }
+            }
             return std::experimental::optional<size_t>(rank);
         }
         return  std::experimental::optional<size_t>();
@@ -468,52 +560,233 @@ public:
         return  std::experimental::optional<double>();
     }
 private:
-    inline bool score_out_of_range(double min, double max) const
+    static inline const sset_entry* entry(const sset_node* n)
+    {
+        return static_cast<const sset_entry*>(n);
+    }
+
+    static inline size_t priority(const sset_node* n)
+    {
+        return entry(n)->_key_hash;
+    }
+
+    const sset_entry* first() const
     {
-        return (min > _list.rbegin()->score()) || (max < _list.begin()->score());
+        const sset_node* n = _header._left;
+        if (n == nullptr) {
+            return nullptr;
+        }
+        while (n->_left != nullptr) n = n->_left;
+        return entry(n);
     }
 
-    inline bool rank_out_of_range(long begin, long end) const
+    const sset_entry* last() const
     {
-        return begin > static_cast<long>(_list.size()) || end <= 0;
+        const sset_node* n = _header._left;
+        if (n == nullptr) {
+            return nullptr;
+        }
+        while (n->_right != nullptr) n = n->_right;
+        return entry(n);
     }
 
-    inline bool insert_ordered(sset_entry* e)
+    const sset_entry* next(const sset_node* n) const
+    {
+        if (n->_right != nullptr) {
+            n = n->_right;
+            while (n->_left != nullptr) n = n->_left;
+            return entry(n);
+        }
+        auto p = n->_parent;
+        while (p != &_header && n == p->_right) {
+            n = p;
+            p = p->_parent;
+        }
+        return p != &_header ? entry(p) : nullptr;
+    }
+
+    const sset_entry* prev(const sset_node* n) const
+    {
+        if (n->_left != nullptr) {
+            n = n->_left;
+            while (n->_right != nullptr) n = n->_right;
+            return entry(n);
+        }
+        auto p = n->_parent;
+        while (p != &_header && n == p->_left) {
+            n = p;
+            p = p->_parent;
+        }
+        return p != &_header ? entry(p) : nullptr;
+    }
+
+    // Returns the member at the 0-based @rank, or nullptr.
+    const sset_entry* select(size_t rank) const
+    {
+        const sset_node* n = _header._left;
+        while (n != nullptr) {
+            auto left = sset_node::count(n->_left);
+            if (rank < left) {
+                n = n->_left;
+            }
+            else if (rank == left) {
+                return entry(n);
+            }
+            else {
+                rank -= left + 1;
+                n = n->_right;
+            }
+        }
+        return nullptr;
+    }
+
+    // Returns the first member whose score is not less than @score.
+    const sset_entry* lower_bound(double score) const
+    {
+        const sset_node* n = _header._left;
+        const sset_entry* result = nullptr;
+        while (n != nullptr) {
+            if (entry(n)->score() >= score) {
+                result = entry(n);
+                n = n->_left;
+            }
+            else {
+                n = n->_right;
+            }
+        }
+        return result;
+    }
+
+    // Returns the last member whose score is not greater than @score.
+    const sset_entry* upper_bound(double score) const
+    {
+        const sset_node* n = _header._left;
+        const sset_entry* result = nullptr;
+        while (n != nullptr) {
+            if (entry(n)->score() <= score) {
+                result = entry(n);
+                n = n->_right;
+            }
+            else {
+                n = n->_left;
+            }
+        }
+        return result;
+    }
+
+    // Counts the members whose score is less than @score, or not greater
+    // than @score if @inclusive is set.
+    size_t count_below(double score, bool inclusive) const
+    {
+        const sset_node* n = _header._left;
+        size_t count = 0;
+        while (n != nullptr) {
+            auto s = entry(n)->score();
+            if (s < score || (inclusive && s == score)) {
+                count += sset_node::count(n->_left) + 1;
+                n = n->_right;
+            }
+            else {
+                n = n->_left;
+            }
+        }
+        return count;
+    }
+
+    inline void replace_child(sset_node* parent, sset_node* child, sset_node* n)
+    {
+        if (parent->_left == child) {
+            parent->_left = n;
+        }
+        else {
+            parent->_right = n;
+        }
+        if (n != nullptr) {
+            n->_parent = parent;
+        }
+    }
+
+    // Lifts the right child of @n into its place.
+    void rotate_left(sset_node* n)
+    {
+        auto r = n->_right;
+        n->_right = r->_left;
+        if (r->_left != nullptr) r->_left->_parent = n;
+        replace_child(n->_parent, n, r);
+        r->_left = n;
+        n->_parent = r;
+        r->_count = n->_count;
+        n->_count = sset_node::count(n->_left) + sset_node::count(n->_right) + 1;
+    }
+
+    // Lifts the left child of @n into its place.
+    void rotate_right(sset_node* n)
+    {
+        auto l = n->_left;
+        n->_left = l->_right;
+        if (l->_right != nullptr) l->_right->_parent = n;
+        replace_child(n->_parent, n, l);
+        l->_right = n;
+        n->_parent = l;
+        l->_count = n->_count;
+        n->_count = sset_node::count(n->_left) + sset_node::count(n->_right) + 1;
+    }
+
+    void insert_ordered(sset_entry* e)
     {
         assert(e != nullptr);
-        auto it = _list.begin();
-        const auto& score = e->score();
-        if (it == _list.end() || score < it->score()) {
-            _list.push_front(*e);
-            return true;
+        sset_node* parent = &_header;
+        sset_node* n = _header._left;
+        bool left = true;
+        while (n != nullptr) {
+            ++n->_count;
+            parent = n;
+            left = sset_entry::score_compare()(*e, *entry(n));
+            n = left ? n->_left : n->_right;
+        }
+        e->_left = e->_right = nullptr;
+        e->_count = 1;
+        e->_parent = parent;
+        if (left) {
+            parent->_left = e;
         }
         else {
-            auto trace = it;
-            for (; it != _list.end(); ++it) {
-                if (it->score() > score) {
-                    _list.insert(it, *e);
-                    return true;
-                }
-                trace = it;
+            parent->_right = e;
+        }
+        while (e->_parent != &_header && priority(e) > priority(e->_parent)) {
+            if (e->_parent->_left == e) {
+                rotate_right(e->_parent);
             }
-            if (it == _list.end()) {
-                if (trace->score() > score) {
-                    _list.push_front(*e);
-                }
-                else {
-                    _list.push_back(*e);
-                }
-                return true;
+            else {
+                rotate_left(e->_parent);
             }
         }
-        return false;
+    }
+
+    void erase_ordered(sset_entry* e)
+    {
+        while (e->_left != nullptr && e->_right != nullptr) {
+            if (priority(e->_left) > priority(e->_right)) {
+                rotate_right(e);
+            }
+            else {
+                rotate_left(e);
+            }
+        }
+        auto parent = e->_parent;
+        replace_child(parent, e, e->_left != nullptr ? e->_left : e->_right);
+        for (auto p = parent; p != &_header; p = p->_parent) {
+            --p->_count;
+        }
+        e->_parent = e->_left = e->_right = nullptr;
+        e->_count = 1;
     }
 
     inline bool update(sset_entry* e)
     {
-        auto lit = list_type::s_iterator_to(*e);
-        _list.erase(lit);
-        return insert_ordered(e);
+        erase_ordered(e);
+        insert_ordered(e);
+        return true;
     }
 };
 }
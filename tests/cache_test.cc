@@ -1,5 +1,10 @@
 #include "tests/test-utils.hh"
 #include "cache.hh"
+#include "geo.hh"
+#include "hll.hh"
+#include "rdb.hh"
+#include <map>
+#include <unordered_set>
 
 #include "util/log.hh"
 using logger =  seastar::logger;
@@ -9,6 +14,7 @@ using namespace redis;
 
 class cache_holder : private logalloc::region {
 public:
+    cache_holder(size_t initial_bucket_count = DEFAULT_INITIAL_SIZE) : _c(initial_bucket_count) {}
     ~cache_holder()
     {
         with_allocator(allocator(), [this] {
@@ -20,7 +26,7 @@ public:
         redis_key rk { std::ref(key) };
 
         with_allocator(allocator(), [this, &rk, &val] {
-            auto entry = current_allocator().construct<cache_entry>(rk.key(), rk.hash(), val);
+            auto entry = cache_entry::make(rk.key(), rk.hash(), val);
             _c.insert(entry);
             BOOST_CHECK(_c.size() == 1);
             BOOST_CHECK(!_c.empty());
@@ -48,6 +54,994 @@ public:
         BOOST_CHECK(_c.empty());
         return make_ready_future<>();
     }
+
+    future<> rehash() {
+        const size_t count = 10000;
+        std::vector<sstring> keys;
+        for (size_t i = 0; i < count; ++i) {
+            keys.emplace_back(to_sstring(i));
+        }
+        auto initial_bucket_count = _c.bucket_count();
+        with_allocator(allocator(), [this, &keys] {
+            for (auto& key : keys) {
+                redis_key rk { std::ref(key) };
+                auto entry = cache_entry::make(rk.key(), rk.hash(), key);
+                _c.insert(entry);
+            }
+        });
+        BOOST_CHECK(_c.size() == count);
+        BOOST_CHECK(_c.bucket_count() > initial_bucket_count);
+        for (auto& key : keys) {
+            redis_key rk { std::ref(key) };
+            BOOST_REQUIRE(_c.exists(rk));
+        }
+
+        // erases most of the entries, the bucket array should shrink.
+        auto grown_bucket_count = _c.bucket_count();
+        with_allocator(allocator(), [this, &keys] {
+            for (size_t i = 0; i < keys.size() - 10; ++i) {
+                redis_key rk { std::ref(keys[i]) };
+                BOOST_REQUIRE(_c.erase(rk));
+            }
+        });
+        BOOST_CHECK(_c.size() == 10);
+        BOOST_CHECK(_c.bucket_count() < grown_bucket_count);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            redis_key rk { std::ref(keys[i]) };
+            BOOST_REQUIRE(_c.exists(rk) == (i >= keys.size() - 10));
+        }
+        return make_ready_future<>();
+    }
+
+    future<> reserve() {
+        const size_t count = 10000;
+        _c.reserve(count);
+        auto reserved_bucket_count = _c.bucket_count();
+        BOOST_CHECK(reserved_bucket_count * 0.75 >= count);
+        std::vector<sstring> keys;
+        for (size_t i = 0; i < count; ++i) {
+            keys.emplace_back(to_sstring(i));
+        }
+        // the insertions should never rehash.
+        with_allocator(allocator(), [this, &keys] {
+            for (auto& key : keys) {
+                redis_key rk { std::ref(key) };
+                auto entry = cache_entry::make(rk.key(), rk.hash(), key);
+                _c.insert(entry);
+            }
+        });
+        BOOST_CHECK(_c.size() == count);
+        BOOST_CHECK(_c.bucket_count() == reserved_bucket_count);
+        for (auto& key : keys) {
+            redis_key rk { std::ref(key) };
+            BOOST_REQUIRE(_c.exists(rk));
+        }
+        return make_ready_future<>();
+    }
+
+    // The tables don't grow while the resizing is paused, the entries which
+    // don't fit wait in the overflow until it resumes.
+    future<> pause() {
+        const size_t count = 10000;
+        std::vector<sstring> keys;
+        for (size_t i = 0; i < count; ++i) {
+            keys.emplace_back(to_sstring(i));
+        }
+        auto bucket_count = _c.bucket_count();
+        _c.pause_resize();
+        with_allocator(allocator(), [this, &keys] {
+            for (auto& key : keys) {
+                redis_key rk { std::ref(key) };
+                auto entry = cache_entry::make(rk.key(), rk.hash(), key);
+                _c.insert(entry);
+            }
+        });
+        BOOST_CHECK(_c.bucket_count() == bucket_count);
+        BOOST_CHECK(_c.overflow_size() > 0);
+        BOOST_CHECK(_c.size() == count);
+        for (auto& key : keys) {
+            redis_key rk { std::ref(key) };
+            BOOST_REQUIRE(_c.exists(rk));
+        }
+        // some of the entries are erased from the overflow.
+        with_allocator(allocator(), [this, &keys] {
+            for (size_t i = 0; i < keys.size(); i += 2) {
+                redis_key rk { std::ref(keys[i]) };
+                BOOST_REQUIRE(_c.erase(rk));
+            }
+        });
+        _c.resume_resize();
+        BOOST_CHECK(_c.overflow_size() == 0);
+        BOOST_CHECK(_c.bucket_count() > bucket_count);
+        BOOST_CHECK(_c.size() == count / 2);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            redis_key rk { std::ref(keys[i]) };
+            BOOST_REQUIRE(_c.exists(rk) == (i % 2 == 1));
+        }
+        return make_ready_future<>();
+    }
+
+    // The compaction moves every object of the region: the entries, the chunks
+    // of the lists, the fields of the hashes and sets, and the members of the
+    // sorted sets must all be found again at their new locations.
+    future<> compact() {
+        const size_t count = 2000;
+        std::vector<sstring> keys;
+        for (size_t i = 0; i < count; ++i) {
+            keys.emplace_back(sstring("key:") + to_sstring(i));
+        }
+        sstring list_key {"list"}, hash_key {"hash"}, set_key {"set"}, zset_key {"zset"};
+        std::vector<clock_type::time_point> timeouts;
+        with_allocator(allocator(), [this, &keys, &list_key, &hash_key, &set_key, &zset_key] {
+            for (size_t i = 0; i < keys.size(); ++i) {
+                redis_key rk { std::ref(keys[i]) };
+                auto entry = cache_entry::make(rk.key(), rk.hash(), keys[i]);
+                BOOST_REQUIRE(_c.insert_if(entry, i % 2 ? 3600 * 1000 : 0, false, false));
+            }
+            redis_key lk { std::ref(list_key) };
+            auto list = cache_entry::make(lk.key(), lk.hash(), cache_entry::list_initializer());
+            redis_key hk { std::ref(hash_key) };
+            auto hash = cache_entry::make(hk.key(), hk.hash(), cache_entry::dict_initializer());
+            redis_key sk { std::ref(set_key) };
+            auto set = cache_entry::make(sk.key(), sk.hash(), cache_entry::set_initializer());
+            redis_key zk { std::ref(zset_key) };
+            auto zset = cache_entry::make(zk.key(), zk.hash(), cache_entry::sset_initializer());
+            std::unordered_map<sstring, double> members;
+            for (size_t i = 0; i < keys.size(); ++i) {
+                list->value_list().insert_tail(keys[i]);
+                hash->value_map().insert(keys[i], keys[i]);
+                set->value_set().insert(keys[i]);
+                members.emplace(keys[i], double(i));
+            }
+            zset->value_sset().insert_if_not_exists(members);
+            _c.insert(list);
+            _c.insert(hash);
+            _c.insert(set);
+            _c.insert(zset);
+        });
+        for (auto& key : keys) {
+            redis_key rk { std::ref(key) };
+            _c.with_entry_run(rk, [&timeouts] (const cache_entry* e) {
+                timeouts.emplace_back(e->get_timeout());
+            });
+        }
+
+        with_allocator(allocator(), [this] {
+            full_compaction();
+        });
+
+        BOOST_CHECK(_c.size() == count + 4);
+        BOOST_CHECK(_c.expiring_size() == count / 2);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            redis_key rk { std::ref(keys[i]) };
+            _c.with_entry_run(rk, [&keys, &timeouts, i] (const cache_entry* e) {
+                BOOST_REQUIRE(e != nullptr);
+                BOOST_CHECK(e->value_bytes_size() == keys[i].size());
+                BOOST_CHECK(memcmp(e->value_bytes_data(), keys[i].data(), keys[i].size()) == 0);
+                BOOST_CHECK(e->ever_expires() == (i % 2 == 1));
+                BOOST_CHECK(e->get_timeout() == timeouts[i]);
+            });
+        }
+        redis_key lk { std::ref(list_key) };
+        _c.with_entry_run(lk, [&keys] (const cache_entry* e) {
+            BOOST_REQUIRE(e != nullptr);
+            auto& list = e->value_list();
+            BOOST_REQUIRE(list.size() == keys.size());
+            size_t i = 0;
+            list.for_each([&keys, &i] (bytes_view v) {
+                BOOST_REQUIRE(v == bytes_view(reinterpret_cast<const signed char*>(keys[i].data()), keys[i].size()));
+                ++i;
+            });
+            BOOST_CHECK(i == keys.size());
+        });
+        redis_key hk { std::ref(hash_key) };
+        redis_key sk { std::ref(set_key) };
+        _c.with_entry_run(hk, [&keys] (const cache_entry* e) {
+            BOOST_REQUIRE(e != nullptr);
+            BOOST_REQUIRE(e->value_map().size() == keys.size());
+            size_t visited = 0;
+            e->value_map().for_each([&visited] (const dict_field&) {
+                ++visited;
+            });
+            BOOST_CHECK(visited == keys.size());
+            for (auto& key : keys) {
+                BOOST_REQUIRE(e->value_map().exists(key));
+            }
+        });
+        _c.with_entry_run(sk, [&keys] (const cache_entry* e) {
+            BOOST_REQUIRE(e != nullptr);
+            for (auto& key : keys) {
+                BOOST_REQUIRE(e->value_set().exists(key));
+            }
+        });
+        redis_key zk { std::ref(zset_key) };
+        _c.with_entry_run(zk, [&keys] (const cache_entry* e) {
+            BOOST_REQUIRE(e != nullptr);
+            auto& zset = e->value_sset();
+            BOOST_REQUIRE(zset.size() == keys.size());
+            std::vector<std::pair<sstring, double>> members;
+            zset.fetch_by_rank(0, keys.size() - 1, members);
+            BOOST_REQUIRE(members.size() == keys.size());
+            for (size_t i = 0; i < keys.size(); ++i) {
+                BOOST_REQUIRE(members[i].first == keys[i]);
+                BOOST_REQUIRE(*zset.rank(keys[i]) == i);
+            }
+        });
+
+        // the moved entries and elements are unlinked from their new locations.
+        with_allocator(allocator(), [this, &keys, &hk, &sk, &zk] {
+            for (size_t i = 1; i < keys.size(); i += 2) {
+                redis_key rk { std::ref(keys[i]) };
+                BOOST_REQUIRE(_c.never_expired(rk));
+            }
+            _c.with_entry_run(hk, [&keys] (cache_entry* e) {
+                for (auto& key : keys) {
+                    BOOST_REQUIRE(e->value_map().erase(key));
+                }
+            });
+            _c.with_entry_run(sk, [&keys] (cache_entry* e) {
+                for (auto& key : keys) {
+                    BOOST_REQUIRE(e->value_set().erase(key));
+                }
+            });
+            _c.with_entry_run(zk, [&keys] (cache_entry* e) {
+                for (auto& key : keys) {
+                    e->value_sset().erase(key);
+                }
+                BOOST_CHECK(e->value_sset().empty());
+            });
+            for (auto& key : keys) {
+                redis_key rk { std::ref(key) };
+                BOOST_REQUIRE(_c.erase(rk));
+            }
+        });
+        BOOST_CHECK(_c.expiring_size() == 0);
+        BOOST_CHECK(_c.size() == 4);
+        return make_ready_future<>();
+    }
+
+    // A sorted set built aside, as the destination of ZUNIONSTORE, is found
+    // again after a compaction, then replaces the entry of its key. Its
+    // members are read back range after range, in their order.
+    future<> stage() {
+        const size_t count = 1000;
+        sstring zset_key {"zset"};
+        redis_key zk { std::ref(zset_key) };
+        std::vector<sstring> keys;
+        for (size_t i = 0; i < count; ++i) {
+            keys.emplace_back(sstring("member:") + to_sstring(i));
+        }
+        std::sort(keys.begin(), keys.end(), [] (const sstring& l, const sstring& r) { return sset_lsa::member_less(l, r); });
+        with_allocator(allocator(), [this, &zk, &keys] {
+            auto old = cache_entry::make(zk.key(), zk.hash(), zk.key());
+            _c.insert(old);
+            auto zset = cache_entry::make(zk.key(), zk.hash(), cache_entry::sset_initializer());
+            _c.stage(1, zset);
+            for (size_t i = 0; i < keys.size(); i += 100) {
+                std::unordered_map<sstring, double> members;
+                for (size_t j = i; j < i + 100; ++j) {
+                    members.emplace(keys[j], double(j));
+                }
+                BOOST_REQUIRE(_c.staged(1) != nullptr);
+                _c.staged(1)->value_sset().insert_or_update(members);
+            }
+        });
+        BOOST_CHECK(_c.size() == 1);
+        BOOST_CHECK(_c.staged(2) == nullptr);
+
+        with_allocator(allocator(), [this] {
+            full_compaction();
+        });
+
+        with_allocator(allocator(), [this, &zk] {
+            auto zset = _c.unstage(1);
+            BOOST_REQUIRE(zset != nullptr);
+            BOOST_CHECK(_c.staged(1) == nullptr);
+            BOOST_REQUIRE(_c.erase(zk));
+            _c.insert(zset);
+        });
+        _c.with_entry_run(zk, [&keys] (const cache_entry* e) {
+            BOOST_REQUIRE(e != nullptr && e->type_of_sset());
+            auto& zset = e->value_sset();
+            BOOST_REQUIRE(zset.size() == keys.size());
+            size_t i = 0;
+            sstring after;
+            bool more = true;
+            for (bool from_start = true; more; from_start = false) {
+                more = zset.for_each_after(from_start, after, 64, [&keys, &i, &after] (const sset_entry& m) {
+                    after = sstring(m.key_data(), m.key_size());
+                    BOOST_REQUIRE(after == keys[i]);
+                    BOOST_CHECK(m.score() == double(i));
+                    ++i;
+                });
+            }
+            BOOST_CHECK(i == keys.size());
+        });
+
+        // a cache flushed drops the sorted sets still built aside.
+        with_allocator(allocator(), [this, &zk] {
+            _c.stage(3, cache_entry::make(zk.key(), zk.hash(), cache_entry::sset_initializer()));
+            _c.flush_all();
+        });
+        BOOST_CHECK(_c.staged(3) == nullptr);
+        BOOST_CHECK(_c.empty());
+        return make_ready_future<>();
+    }
+
+    // A SCAN reports every entry staying in the cache from its start to its
+    // end, while the insertions grow the table and drain the old one, and the
+    // erasures go on, between its steps.
+    future<> scan_resize() {
+        const size_t count = 40000;
+        std::vector<sstring> keys;
+        for (size_t i = 0; i < count; ++i) {
+            keys.emplace_back(sstring("key:") + to_sstring(i));
+        }
+        auto insert = [this, &keys] (size_t i) {
+            redis_key rk { std::ref(keys[i]) };
+            _c.insert(cache_entry::make(rk.key(), rk.hash(), keys[i]));
+        };
+        with_allocator(allocator(), [&insert] {
+            for (size_t i = 0; i < count / 4; ++i) {
+                insert(i);
+            }
+        });
+        auto bucket_count = _c.bucket_count();
+        std::unordered_set<sstring> seen;
+        size_t inserted = count / 4, erased = 0, cursor = 0;
+        do {
+            cursor = _c.scan(cursor, [&seen] (const cache_entry& e) {
+                seen.emplace(e.key_data(), e.key_size());
+            });
+            with_allocator(allocator(), [this, &keys, &insert, &inserted, &erased] {
+                for (size_t n = 0; n < 32 && inserted < keys.size(); ++n) {
+                    insert(inserted++);
+                }
+                if (erased < keys.size() / 4) {
+                    redis_key rk { std::ref(keys[erased]) };
+                    BOOST_REQUIRE(_c.erase(rk));
+                    erased += 2;
+                }
+            });
+        } while (cursor != 0);
+        BOOST_CHECK(_c.bucket_count() > bucket_count);
+        for (size_t i = 1; i < count / 4; i += 2) {
+            BOOST_REQUIRE(seen.count(keys[i]) == 1);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            redis_key rk { std::ref(keys[i]) };
+            auto gone = i < erased && i % 2 == 0;
+            BOOST_REQUIRE(_c.exists(rk) == (i < inserted && !gone));
+        }
+        BOOST_CHECK(_c.size() == inserted - erased / 2);
+        return make_ready_future<>();
+    }
+
+    // A traversal with the resize paused visits every key once, even the
+    // keys overwritten meanwhile into the overflow.
+    future<> paused_overwrite() {
+        const size_t count = 150;
+        std::vector<sstring> keys;
+        for (size_t i = 0; i < count; ++i) {
+            keys.emplace_back(sstring("key:") + to_sstring(i));
+        }
+        auto insert = [this] (const sstring& key, const sstring& value) {
+            redis_key rk { std::ref(key) };
+            _c.replace(cache_entry::make(rk.key(), rk.hash(), value));
+        };
+        with_allocator(allocator(), [&keys, &insert] {
+            for (auto& key : keys) {
+                insert(key, key);
+            }
+        });
+        std::map<sstring, size_t> seen;
+        _c.pause_resize();
+        size_t added = 0, overwritten = 0;
+        for (size_t position = 0; position < _c.traversal_size(); ++position) {
+            _c.for_each_in_bucket(position, [&seen] (const cache_entry& e) {
+                ++seen[sstring(e.key_data(), e.key_size())];
+            });
+            with_allocator(allocator(), [&keys, &insert, &added, &overwritten] {
+                for (size_t n = 0; n < 8; ++n, ++added, ++overwritten) {
+                    auto key = sstring("new:") + to_sstring(added);
+                    insert(key, key);
+                    insert(keys[overwritten % keys.size()], "overwritten");
+                }
+            });
+        }
+        BOOST_CHECK(_c.overflow_size() > 0);
+        for (auto& key : keys) {
+            BOOST_REQUIRE(seen[key] == 1);
+        }
+        _c.resume_resize();
+        BOOST_CHECK(_c.overflow_size() == 0);
+        BOOST_CHECK(_c.size() == count + added);
+        for (auto& key : keys) {
+            redis_key rk { std::ref(key) };
+            BOOST_REQUIRE(_c.exists(rk));
+        }
+        return make_ready_future<>();
+    }
+
+    // The same for a SCAN of the fields of a hash, while its table grows.
+    future<> hash_scan_resize() {
+        const size_t count = 40000;
+        std::vector<sstring> fields;
+        for (size_t i = 0; i < count; ++i) {
+            fields.emplace_back(sstring("field:") + to_sstring(i));
+        }
+        sstring key {"hash"};
+        redis_key rk { std::ref(key) };
+        with_allocator(allocator(), [this, &rk, &fields] {
+            auto hash = cache_entry::make(rk.key(), rk.hash(), cache_entry::dict_initializer());
+            for (size_t i = 0; i < count / 4; ++i) {
+                hash->value_map().insert(fields[i], fields[i]);
+            }
+            _c.insert(hash);
+        });
+        std::unordered_set<sstring> seen;
+        size_t inserted = count / 4, erased = 0, cursor = 0;
+        do {
+            with_allocator(allocator(), [this, &rk, &fields, &seen, &inserted, &erased, &cursor] {
+                _c.with_entry_run(rk, [&fields, &seen, &inserted, &erased, &cursor] (cache_entry* e) {
+                    BOOST_REQUIRE(e != nullptr);
+                    auto& hash = e->value_map();
+                    cursor = hash.scan(cursor, [&seen] (const dict_field& f) {
+                        seen.emplace(f.key_data(), f.key_size());
+                    });
+                    for (size_t n = 0; n < 32 && inserted < fields.size(); ++n, ++inserted) {
+                        BOOST_REQUIRE(hash.insert(fields[inserted], fields[inserted]));
+                    }
+                    if (erased < fields.size() / 4) {
+                        BOOST_REQUIRE(hash.erase(fields[erased]));
+                        erased += 2;
+                    }
+                });
+            });
+        } while (cursor != 0);
+        for (size_t i = 1; i < count / 4; i += 2) {
+            BOOST_REQUIRE(seen.count(fields[i]) == 1);
+        }
+        _c.with_entry_run(rk, [&fields, inserted, erased] (const cache_entry* e) {
+            BOOST_REQUIRE(e != nullptr);
+            auto& hash = e->value_map();
+            BOOST_CHECK(!hash.packed());
+            BOOST_CHECK(hash.size() == inserted - erased / 2);
+            for (size_t i = 0; i < fields.size(); ++i) {
+                auto gone = i < erased && i % 2 == 0;
+                BOOST_REQUIRE(hash.exists(fields[i]) == (i < inserted && !gone));
+            }
+        });
+        return make_ready_future<>();
+    }
+
+    // The list keeps the order of a plain vector through the insertions, the
+    // replacements and the erasures, in the middle of its chunks and at their
+    // ends, whichever end of the list its lookups start from.
+    future<> list_chunks() {
+        sstring key {"list"};
+        redis_key rk { std::ref(key) };
+        std::vector<sstring> model;
+        auto check = [&rk, &model, this] {
+            _c.with_entry_run(rk, [&model] (const cache_entry* e) {
+                BOOST_REQUIRE(e != nullptr);
+                auto& list = e->value_list();
+                BOOST_REQUIRE(list.size() == model.size());
+                std::vector<bytes_view> values;
+                list.fetch(0, list.size() - 1, values);
+                BOOST_REQUIRE(values.size() == model.size());
+                for (size_t i = 0; i < model.size(); ++i) {
+                    BOOST_REQUIRE(values[i].size() == model[i].size() && memcmp(values[i].data(), model[i].data(), model[i].size()) == 0);
+                    auto v = list.at(i);
+                    BOOST_REQUIRE(v.size() == model[i].size() && memcmp(v.data(), model[i].data(), model[i].size()) == 0);
+                }
+            });
+        };
+        with_allocator(allocator(), [this, &rk, &model] {
+            auto list = cache_entry::make(rk.key(), rk.hash(), cache_entry::list_initializer());
+            _c.insert(list);
+            for (size_t i = 0; i < 3000; ++i) {
+                model.emplace_back(to_sstring(i));
+                list->value_list().insert_tail(model.back());
+            }
+        });
+        check();
+        with_allocator(allocator(), [this, &rk, &model] {
+            _c.with_entry_run(rk, [&model] (cache_entry* e) {
+                auto& list = e->value_list();
+                for (size_t index : { size_t(0), size_t(511), size_t(512), size_t(1024), size_t(2999) }) {
+                    sstring v = sstring("at:") + to_sstring(index);
+                    list.insert_at(index, v);
+                    model.insert(model.begin() + index, v);
+                }
+                list.insert_head(sstring("head"));
+                model.insert(model.begin(), sstring("head"));
+                sstring large(sstring::initialized_later(), 1000);
+                std::fill(large.begin(), large.end(), 'x');
+                list.set(1500, large);
+                model[1500] = large;
+                list.erase(sstring("1000"));
+                model.erase(std::find(model.begin(), model.end(), sstring("1000")));
+                list.pop_front();
+                model.erase(model.begin());
+                list.pop_back();
+                model.pop_back();
+            });
+        });
+        check();
+        with_allocator(allocator(), [this, &rk, &model] {
+            _c.with_entry_run(rk, [&model] (cache_entry* e) {
+                e->value_list().trim(700, 2200);
+                model = std::vector<sstring>(model.begin() + 700, model.begin() + 2201);
+            });
+        });
+        check();
+        return make_ready_future<>();
+    }
+
+    // The sets of integers and the small hashes and sets convert from their
+    // compact encodings right past their thresholds, and keep their members.
+    future<> encodings() {
+        dict_lsa::configure(4, 8, 4);
+        with_allocator(allocator(), [] {
+            dict_lsa integers;
+            for (int64_t i = 0; i < 4; ++i) {
+                BOOST_REQUIRE(integers.insert(to_sstring(i * 1000000000000)));
+            }
+            BOOST_CHECK(integers.integers());
+            BOOST_REQUIRE(!integers.insert(sstring("0")));
+            BOOST_REQUIRE(integers.insert(sstring("-1")));
+            BOOST_CHECK(!integers.integers() && !integers.packed());
+            BOOST_CHECK(integers.size() == 5);
+            for (int64_t i = 0; i < 4; ++i) {
+                BOOST_REQUIRE(integers.exists(to_sstring(i * 1000000000000)));
+            }
+            BOOST_REQUIRE(integers.exists(sstring("-1")));
+
+            dict_lsa mixed;
+            BOOST_REQUIRE(mixed.insert(sstring("7")));
+            BOOST_CHECK(mixed.integers());
+            // "07" is not the canonical form of an integer.
+            BOOST_REQUIRE(mixed.insert(sstring("07")));
+            BOOST_CHECK(!mixed.integers() && mixed.packed());
+            BOOST_REQUIRE(mixed.exists(sstring("7")) && mixed.exists(sstring("07")));
+
+            dict_lsa hash;
+            for (size_t i = 0; i < 4; ++i) {
+                BOOST_REQUIRE(hash.insert(sstring("f") + to_sstring(i), sstring("12345678")));
+            }
+            BOOST_CHECK(hash.packed());
+            BOOST_REQUIRE(hash.insert(sstring("f4"), int64_t(4)));
+            BOOST_CHECK(!hash.packed());
+            BOOST_CHECK(hash.size() == 5);
+
+            dict_lsa wide;
+            BOOST_REQUIRE(wide.insert(sstring("f"), sstring("12345678")));
+            BOOST_CHECK(wide.packed());
+            BOOST_REQUIRE(!wide.insert(sstring("f"), sstring("123456789")));
+            BOOST_CHECK(!wide.packed());
+            BOOST_CHECK(wide.size() == 1);
+            wide.for_each([] (const dict_field& f) {
+                BOOST_CHECK(f.value_bytes_size() == 9 && memcmp(f.value_bytes_data(), "123456789", 9) == 0);
+            });
+        });
+        dict_lsa::configure(128, 64, 512);
+        return make_ready_future<>();
+    }
+
+    // A HyperLogLog stays sparse while small, turns dense as it grows, and
+    // counts the same merged raw, compacted, or in the encoding of Redis.
+    future<> hll_encodings() {
+        with_allocator(allocator(), [] {
+            auto elements = [] (size_t first, size_t count) {
+                std::vector<sstring> v;
+                for (size_t i = first; i < first + count; ++i) {
+                    v.emplace_back(sstring("element:") + to_sstring(i));
+                }
+                return v;
+            };
+            managed_bytes small(hll::empty());
+            BOOST_CHECK(hll::is_sparse(small));
+            hll::append(small, elements(0, 100));
+            BOOST_CHECK(hll::is_sparse(small));
+            auto small_count = hll::count(small);
+            BOOST_CHECK(small_count >= 95 && small_count <= 105);
+
+            managed_bytes large(hll::empty());
+            hll::append(large, elements(0, 50000));
+            BOOST_CHECK(!hll::is_sparse(large));
+            auto large_count = hll::count(large);
+            BOOST_CHECK_CLOSE(double(large_count), 50000.0, 2.0);
+
+            std::vector<uint8_t> raw(hll::RAW_SIZE);
+            hll::merge(raw.data(), small);
+            auto compacted = hll::compact(raw.data());
+            managed_bytes sparse(bytes_view(reinterpret_cast<const signed char*>(compacted.data()), compacted.size()));
+            BOOST_CHECK(hll::is_sparse(sparse));
+            BOOST_CHECK(hll::count(sparse) == small_count);
+            // the elements of the small one are all in the large one.
+            hll::merge(raw.data(), large);
+            BOOST_CHECK(hll::count(raw.data()) == large_count);
+
+            auto redis = hll::to_redis(large);
+            BOOST_REQUIRE(hll::is_redis_encoding(redis.data(), redis.size()));
+            auto imported = hll::import(redis.data(), redis.size());
+            BOOST_CHECK(!hll::is_sparse(imported));
+            BOOST_CHECK(hll::count(imported) == large_count);
+        });
+        return make_ready_future<>();
+    }
+
+    // The ranks, the selections by rank and the counts by score of a sorted
+    // set match those of a sorted vector, through the erasures and the updates
+    // of the scores.
+    future<> zset_ranks() {
+        const size_t count = 1000;
+        sstring key {"zset"};
+        redis_key rk { std::ref(key) };
+        std::vector<std::pair<double, sstring>> model;
+        with_allocator(allocator(), [this, &rk, &model] {
+            auto zset = cache_entry::make(rk.key(), rk.hash(), cache_entry::sset_initializer());
+            _c.insert(zset);
+            std::unordered_map<sstring, double> members;
+            for (size_t i = 0; i < count; ++i) {
+                members.emplace(sstring("m:") + to_sstring(i), double((i * 7919) % count) + 0.5);
+            }
+            zset->value_sset().insert_if_not_exists(members);
+            for (size_t i = 0; i < count; ++i) {
+                auto member = sstring("m:") + to_sstring(i);
+                auto score = members[member];
+                if (i % 3 == 0) {
+                    zset->value_sset().erase(member);
+                    continue;
+                }
+                if (i % 5 == 1) {
+                    BOOST_REQUIRE(zset->value_sset().update_score(member, 2000));
+                    score += 2000;
+                }
+                model.emplace_back(score, member);
+            }
+        });
+        std::sort(model.begin(), model.end());
+        _c.with_entry_run(rk, [&model] (const cache_entry* e) {
+            BOOST_REQUIRE(e != nullptr);
+            auto& zset = e->value_sset();
+            BOOST_REQUIRE(zset.size() == model.size());
+            for (size_t i = 0; i < model.size(); ++i) {
+                BOOST_REQUIRE(*zset.rank(model[i].second) == i);
+            }
+            std::vector<std::pair<sstring, double>> all;
+            zset.fetch_by_rank(0, -1, all);
+            BOOST_REQUIRE(all.size() == model.size());
+            for (size_t i = 0; i < model.size(); ++i) {
+                BOOST_REQUIRE(all[i].first == model[i].second && all[i].second == model[i].first);
+            }
+            std::vector<const sset_entry*> top;
+            zset.fetch_by_rank(0, 9, top, true);
+            BOOST_REQUIRE(top.size() == 10);
+            for (size_t i = 0; i < top.size(); ++i) {
+                auto& m = model[model.size() - 1 - i];
+                BOOST_REQUIRE(sstring(top[i]->key_data(), top[i]->key_size()) == m.second);
+            }
+            size_t rank = model.size() - 20, visited = 0;
+            zset.for_each_from_rank(rank, false, [&model, &rank, &visited] (const sset_entry& m) {
+                BOOST_REQUIRE(sstring(m.key_data(), m.key_size()) == model[rank].second);
+                ++rank;
+                return ++visited < 10;
+            });
+            BOOST_CHECK(visited == 10);
+            for (auto range : { std::make_pair(0.0, 100.0), std::make_pair(100.5, 200.5), std::make_pair(900.0, 2500.0) }) {
+                auto expected = std::count_if(model.begin(), model.end(), [&range] (const std::pair<double, sstring>& m) {
+                    return m.first >= range.first && m.first <= range.second;
+                });
+                BOOST_CHECK(zset.count_by_score(range.first, range.second) == size_t(expected));
+            }
+        });
+        return make_ready_future<>();
+    }
+
+    // An entry decoded from a snapshot: its type, its expiry, and the value of
+    // a string or the elements of a collection, with the values of the fields
+    // of a hash, or the scores of the members of a sorted set.
+    struct decoded_entry {
+        uint8_t _type = 0;
+        int64_t _expire_at = -1;
+        sstring _value;
+        std::vector<std::pair<sstring, sstring>> _elements;
+    };
+    using decoded_entries = std::map<sstring, decoded_entry>;
+
+    // Hands the items of @reader out to @entries until it needs more bytes.
+    // The entries of the keys @forwarded are forwarded, their records are
+    // appended to @records. Returns true at the end of the snapshot.
+    static bool decode(rdb_reader& reader, decoded_entries& entries, sstring& current,
+            const std::unordered_set<sstring>& forwarded, std::vector<sstring>& records) {
+        for (;;) {
+            switch (reader.next()) {
+            case rdb_reader::item::none:
+                return false;
+            case rdb_reader::item::eof:
+                return true;
+            case rdb_reader::item::aux:
+            case rdb_reader::item::resize_db:
+                break;
+            case rdb_reader::item::select_db:
+                BOOST_REQUIRE(reader.db_index() == 0);
+                break;
+            case rdb_reader::item::entry: {
+                current = reader.key().str();
+                if (forwarded.count(current)) {
+                    reader.forward();
+                    break;
+                }
+                auto& e = entries[current];
+                e._type = reader.type();
+                e._expire_at = reader.expire_at();
+                if (reader.type() == RDB_TYPE_STRING) {
+                    e._value = reader.value().str();
+                }
+                break;
+            }
+            case rdb_reader::item::element: {
+                auto& e = entries[current];
+                sstring value;
+                if (e._type == RDB_TYPE_HASH) {
+                    value = reader.value().str();
+                } else if (e._type == RDB_TYPE_ZSET_2) {
+                    value = to_sstring(reader.score());
+                }
+                e._elements.emplace_back(reader.field().str(), value);
+                break;
+            }
+            case rdb_reader::item::forwarded: {
+                auto record = reader.record();
+                records.emplace_back(record.first, record.second);
+                break;
+            }
+            }
+        }
+    }
+
+    // Fills the cache with an entry of every type, and returns what a snapshot
+    // of them should decode to.
+    decoded_entries fill_snapshot_entries() {
+        decoded_entries expected;
+        auto wall_now = std::chrono::system_clock::now();
+        auto expire_at = std::chrono::duration_cast<std::chrono::milliseconds>(wall_now.time_since_epoch()).count() + 3600 * 1000;
+        with_allocator(allocator(), [this, &expected, expire_at] {
+            auto insert = [this] (cache_entry* e, long expired = 0) {
+                BOOST_REQUIRE(_c.insert_if(e, expired, false, false));
+            };
+            sstring string_key {"string"}, integer_key {"integer"}, expiring_key {"expiring"};
+            sstring list_key {"list"}, hash_key {"hash"}, set_key {"set"}, intset_key {"intset"}, zset_key {"zset"};
+            insert(cache_entry::make(string_key, std::hash<sstring>()(string_key), sstring("hello")));
+            expected[string_key] = { RDB_TYPE_STRING, -1, "hello", {} };
+            insert(cache_entry::make(integer_key, std::hash<sstring>()(integer_key), int64_t(-42)));
+            expected[integer_key] = { RDB_TYPE_STRING, -1, "-42", {} };
+            insert(cache_entry::make(expiring_key, std::hash<sstring>()(expiring_key), sstring("soon")), 3600 * 1000);
+            expected[expiring_key] = { RDB_TYPE_STRING, expire_at, "soon", {} };
+
+            auto list = cache_entry::make(list_key, std::hash<sstring>()(list_key), cache_entry::list_initializer());
+            auto hash = cache_entry::make(hash_key, std::hash<sstring>()(hash_key), cache_entry::dict_initializer());
+            auto set = cache_entry::make(set_key, std::hash<sstring>()(set_key), cache_entry::set_initializer());
+            auto intset = cache_entry::make(intset_key, std::hash<sstring>()(intset_key), cache_entry::set_initializer());
+            auto zset = cache_entry::make(zset_key, std::hash<sstring>()(zset_key), cache_entry::sset_initializer());
+            auto& l = expected[list_key] = { RDB_TYPE_LIST, -1, "", {} };
+            auto& h = expected[hash_key] = { RDB_TYPE_HASH, -1, "", {} };
+            auto& st = expected[set_key] = { RDB_TYPE_SET, -1, "", {} };
+            auto& is = expected[intset_key] = { RDB_TYPE_SET, -1, "", {} };
+            auto& z = expected[zset_key] = { RDB_TYPE_ZSET_2, -1, "", {} };
+            std::unordered_map<sstring, double> members;
+            for (size_t i = 0; i < 1000; ++i) {
+                auto v = sstring("element:") + to_sstring(i);
+                list->value_list().insert_tail(v);
+                l._elements.emplace_back(v, "");
+                if (i % 2) {
+                    hash->value_map().insert(v, int64_t(i));
+                    h._elements.emplace_back(v, to_sstring(i));
+                } else {
+                    hash->value_map().insert(v, v);
+                    h._elements.emplace_back(v, v);
+                }
+                set->value_set().insert(v);
+                st._elements.emplace_back(v, "");
+                if (i < 100) {
+                    intset->value_set().insert(to_sstring(i * 1000));
+                    is._elements.emplace_back(to_sstring(i * 1000), "");
+                }
+                members.emplace(v, double(i) / 4);
+                z._elements.emplace_back(v, to_sstring(double(i) / 4));
+            }
+            zset->value_sset().insert_if_not_exists(members);
+            // the sorted sets are saved from the highest score down.
+            std::reverse(z._elements.begin(), z._elements.end());
+            for (auto e : { list, hash, set, intset, zset }) {
+                insert(e);
+            }
+        });
+        return expected;
+    }
+
+    sstring save_snapshot(size_t capacity) {
+        rdb_writer writer(capacity);
+        sstring snapshot;
+        auto flush = [&writer, &snapshot] {
+            auto buffer = writer.release();
+            snapshot += sstring(buffer.get(), buffer.size());
+        };
+        writer.write_header();
+        writer.write_aux(sstring("redis-ver"), sstring("5.0.0"));
+        writer.write_select_db(0);
+        writer.write_resize_db(_c.size(), _c.expiring_size());
+        auto now = clock_type::now();
+        auto wall_now = std::chrono::system_clock::now();
+        size_t cursor = 0;
+        do {
+            cursor = _c.scan(cursor, [&writer, &flush, capacity, now, wall_now] (const cache_entry& e) {
+                writer.write_entry(e, now, wall_now);
+                if (writer.size() >= capacity) {
+                    flush();
+                }
+            });
+        } while (cursor != 0);
+        writer.write_eof();
+        flush();
+        BOOST_CHECK(writer.entries() == _c.size());
+        return snapshot;
+    }
+
+    static void check_entries(decoded_entries& decoded, decoded_entries& expected) {
+        BOOST_REQUIRE(decoded.size() == expected.size());
+        for (auto& x : expected) {
+            auto it = decoded.find(x.first);
+            BOOST_REQUIRE(it != decoded.end());
+            auto& d = it->second;
+            auto& e = x.second;
+            BOOST_CHECK(d._type == e._type);
+            BOOST_CHECK(d._value == e._value);
+            if (e._expire_at < 0) {
+                BOOST_CHECK(d._expire_at < 0);
+            } else {
+                BOOST_CHECK(std::abs(d._expire_at - e._expire_at) < 2000);
+            }
+            // the hashes and the sets are saved in the order of their tables.
+            if (e._type == RDB_TYPE_HASH || e._type == RDB_TYPE_SET) {
+                std::sort(d._elements.begin(), d._elements.end());
+                std::sort(e._elements.begin(), e._elements.end());
+            }
+            BOOST_REQUIRE(d._elements == e._elements);
+        }
+    }
+
+    // The entries of every type are saved to a snapshot in buffers of a few
+    // KB, a string is saved with its expiry, and the snapshot decodes to
+    // the same entries, fed a few bytes at a time.
+    future<> rdb_round_trip() {
+        auto expected = fill_snapshot_entries();
+        auto snapshot = save_snapshot(4096);
+        rdb_reader reader;
+        decoded_entries decoded;
+        sstring current;
+        std::vector<sstring> records;
+        bool done = false;
+        for (size_t position = 0; position < snapshot.size() && !done; position += 7) {
+            reader.feed(snapshot.data() + position, std::min<size_t>(7, snapshot.size() - position));
+            done = decode(reader, decoded, current, {}, records);
+        }
+        BOOST_REQUIRE(done && reader.done());
+        BOOST_CHECK(records.empty());
+        check_entries(decoded, expected);
+
+        // a snapshot whose value was damaged fails its checksum.
+        auto damaged = snapshot;
+        auto hello = std::search(damaged.begin(), damaged.end(), "hello", "hello" + 5);
+        BOOST_REQUIRE(hello != damaged.end());
+        *hello = 'j';
+        rdb_reader damaged_reader;
+        damaged_reader.feed(damaged.data(), damaged.size());
+        decoded_entries ignored;
+        BOOST_CHECK_THROW(decode(damaged_reader, ignored, current, {}, records), std::runtime_error);
+        return make_ready_future<>();
+    }
+
+    // The load of a snapshot fed a byte at a time, which forwards the entries
+    // of some of the keys, as the shards not owning them do: the records
+    // forwarded decode to the same entries with a reader of records, and the
+    // rest of the entries are decoded in place.
+    future<> rdb_forward() {
+        auto expected = fill_snapshot_entries();
+        auto snapshot = save_snapshot(64 * 1024);
+        const std::unordered_set<sstring> forwarded { "string", "expiring", "list", "zset" };
+        rdb_reader reader;
+        decoded_entries decoded;
+        sstring current;
+        std::vector<sstring> records;
+        bool done = false;
+        for (size_t position = 0; position < snapshot.size() && !done; ++position) {
+            reader.feed(snapshot.data() + position, 1);
+            done = decode(reader, decoded, current, forwarded, records);
+        }
+        BOOST_REQUIRE(done && reader.done());
+        BOOST_REQUIRE(records.size() == forwarded.size());
+        BOOST_CHECK(decoded.size() == expected.size() - forwarded.size());
+        rdb_reader records_reader(false);
+        std::vector<sstring> none;
+        for (auto& record : records) {
+            records_reader.feed(record.data(), record.size());
+            BOOST_REQUIRE(!decode(records_reader, decoded, current, {}, none));
+            BOOST_REQUIRE(records_reader.at_boundary());
+        }
+        check_entries(decoded, expected);
+        return make_ready_future<>();
+    }
+
+    struct recording_reader : public entry_reader {
+        size_t _reads = 0;
+        size_t _size = 0;
+        virtual void read_all(const cache_entry& e) override {
+            ++_reads;
+            _size = e.value_list().size();
+        }
+    };
+
+    future<> stream() {
+        const size_t count = 5000;
+        sstring key {"list"};
+        redis_key rk { std::ref(key) };
+        with_allocator(allocator(), [this, &rk] {
+            auto list = cache_entry::make(rk.key(), rk.hash(), cache_entry::list_initializer());
+            _c.insert(list);
+            for (size_t i = 0; i < count; ++i) {
+                list->value_list().insert_tail(to_sstring(i));
+            }
+        });
+        recording_reader reader, detached;
+        auto e = _c.peek(rk);
+        BOOST_REQUIRE(e != nullptr);
+        _c.attach(*e, reader);
+        _c.attach(*e, detached);
+        _c.detach(key, detached);
+
+        // a walk resumes from its cursor, or from its index once the compaction moved the list.
+        size_t index = 0;
+        list_lsa::cursor position;
+        auto walk = [&index, &position] (const cache_entry& e) {
+            e.value_list().walk(index, position, [&index] (bytes_view v) {
+                auto expected = to_sstring(index);
+                BOOST_REQUIRE(v.size() == expected.size() && memcmp(v.data(), expected.data(), v.size()) == 0);
+                return ++index % 1000 != 0;
+            });
+        };
+        walk(*e);
+        walk(*e);
+        BOOST_CHECK(index == 2000);
+        auto counter = reclaim_counter();
+        with_allocator(allocator(), [this] {
+            full_compaction();
+        });
+        if (reclaim_counter() != counter) {
+            position = list_lsa::cursor();
+        }
+        e = _c.peek(rk);
+        BOOST_REQUIRE(e != nullptr);
+        while (index < count) {
+            walk(*e);
+        }
+        BOOST_CHECK(reader._reads == 0);
+
+        // the readers read the rest before the entry changes, then they're detached.
+        with_allocator(allocator(), [this, &rk] {
+            _c.with_entry_run(rk, [] (cache_entry* e) {
+                BOOST_REQUIRE(e != nullptr);
+                e->value_list().insert_tail(sstring("last"));
+            });
+            BOOST_CHECK(_c.erase(rk));
+        });
+        BOOST_CHECK(reader._reads == 1);
+        BOOST_CHECK(reader._size == count);
+        BOOST_CHECK(detached._reads == 0);
+        return make_ready_future<>();
+    }
 protected:
     cache _c;
 };
@@ -55,3 +1049,100 @@ SEASTAR_TEST_CASE(cache_insert) {
     cache_holder h;
     return h.insert();
 }
+
+SEASTAR_TEST_CASE(cache_rehash) {
+    cache_holder h(16);
+    return h.rehash();
+}
+
+SEASTAR_TEST_CASE(cache_reserve) {
+    cache_holder h(16);
+    return h.reserve();
+}
+
+SEASTAR_TEST_CASE(cache_pause_resize) {
+    cache_holder h(64);
+    return h.pause();
+}
+
+SEASTAR_TEST_CASE(cache_compact) {
+    cache_holder h(16);
+    return h.compact();
+}
+
+SEASTAR_TEST_CASE(cache_stage) {
+    cache_holder h;
+    return h.stage();
+}
+
+SEASTAR_TEST_CASE(cache_stream) {
+    cache_holder h;
+    return h.stream();
+}
+
+SEASTAR_TEST_CASE(cache_scan_resize) {
+    cache_holder h(16);
+    return h.scan_resize();
+}
+
+SEASTAR_TEST_CASE(cache_paused_overwrite) {
+    cache_holder h(256);
+    return h.paused_overwrite();
+}
+
+SEASTAR_TEST_CASE(cache_hash_scan_resize) {
+    cache_holder h;
+    return h.hash_scan_resize();
+}
+
+SEASTAR_TEST_CASE(cache_list_chunks) {
+    cache_holder h;
+    return h.list_chunks();
+}
+
+SEASTAR_TEST_CASE(cache_encodings) {
+    cache_holder h;
+    return h.encodings();
+}
+
+SEASTAR_TEST_CASE(cache_hll_encodings) {
+    cache_holder h;
+    return h.hll_encodings();
+}
+
+SEASTAR_TEST_CASE(cache_zset_ranks) {
+    cache_holder h;
+    return h.zset_ranks();
+}
+
+SEASTAR_TEST_CASE(cache_rdb_round_trip) {
+    cache_holder h;
+    return h.rdb_round_trip();
+}
+
+SEASTAR_TEST_CASE(cache_rdb_forward) {
+    cache_holder h;
+    return h.rdb_forward();
+}
+
+// The distances GEODIST reports between Palermo and Catania, in every unit.
+SEASTAR_TEST_CASE(geo_dist) {
+    double palermo = 0, catania = 0;
+    BOOST_REQUIRE(geo::encode_to_geohash(13.361389, 38.115556, palermo));
+    BOOST_REQUIRE(geo::encode_to_geohash(15.087269, 37.502669, catania));
+    double meters = 0;
+    BOOST_REQUIRE(geo::dist(palermo, catania, meters));
+    BOOST_CHECK_CLOSE(meters, 166274.1516, 0.01);
+    const std::pair<int, double> units[] = {
+        { GEO_UNIT_M, 166274.1516 },
+        { GEO_UNIT_KM, 166.2742 },
+        { GEO_UNIT_MI, 103.3182 },
+        { GEO_UNIT_FT, 545518.8700 },
+    };
+    for (auto& u : units) {
+        auto dist = meters;
+        BOOST_REQUIRE(geo::from_meters(dist, u.first));
+        BOOST_CHECK_CLOSE(dist, u.second, 0.01);
+    }
+    return make_ready_future<>();
+}
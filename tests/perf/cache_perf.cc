@@ -0,0 +1,120 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "tests/perf/perf.hh"
+#include "cache.hh"
+#include <memory>
+#include <random>
+
+using namespace redis;
+
+// The cache and the LSA region of its entries, as a shard of the database
+// holds them. Every operation switches to the allocator of the region, as
+// the requests do.
+class cache_bench : private logalloc::region {
+    cache _c;
+public:
+    explicit cache_bench(size_t initial_bucket_count = DEFAULT_INITIAL_SIZE) : _c(initial_bucket_count) {}
+    ~cache_bench()
+    {
+        with_allocator(allocator(), [this] {
+            _c.flush_all();
+        });
+    }
+    void reserve(size_t count) {
+        _c.reserve(count);
+    }
+    void insert(sstring& key) {
+        with_allocator(allocator(), [this, &key] {
+            redis_key rk { key };
+            _c.insert(cache_entry::make(rk.key(), rk.hash(), key));
+        });
+    }
+    bool exists(sstring& key) {
+        redis_key rk { key };
+        return _c.exists(rk);
+    }
+    bool erase(sstring& key) {
+        return with_allocator(allocator(), [this, &key] {
+            redis_key rk { key };
+            return _c.erase(rk);
+        });
+    }
+};
+
+static void cache_suite(perf::runner& r)
+{
+    // the keys which are looked up but never inserted.
+    static constexpr const size_t MISSES = 1000000;
+    for (auto size : r.sizes({ 1000000, 10000000, 100000000 })) {
+        std::vector<sstring> keys;
+        keys.reserve(size);
+        for (size_t i = 0; i < size; ++i) {
+            keys.emplace_back(sstring("key:") + to_sstring(i));
+        }
+        std::vector<sstring> misses;
+        for (size_t i = 0; i < std::min(size, MISSES); ++i) {
+            misses.emplace_back(sstring("miss:") + to_sstring(i));
+        }
+        // the lookups and the erasures visit the keys in a random order.
+        std::vector<uint32_t> order(size);
+        for (size_t i = 0; i < size; ++i) {
+            order[i] = i;
+        }
+        std::shuffle(order.begin(), order.end(), std::mt19937(size));
+
+        std::unique_ptr<cache_bench> b;
+        auto fill = [&] {
+            b = std::make_unique<cache_bench>();
+            b->reserve(size);
+            for (auto& key : keys) {
+                b->insert(key);
+            }
+        };
+        r.measure("cache", "insert", size, size, [&] (size_t i) {
+            b->insert(keys[i]);
+        }, [&] {
+            b = std::make_unique<cache_bench>();
+            b->reserve(size);
+        });
+        // the bucket array grows from 16 buckets, the rehashes are measured.
+        r.measure("cache", "insert_rehash", size, size, [&] (size_t i) {
+            b->insert(keys[i]);
+        }, [&] {
+            b = std::make_unique<cache_bench>(16);
+        });
+        fill();
+        r.measure("cache", "lookup_hit", size, size, [&] (size_t i) {
+            perf::do_not_optimize(b->exists(keys[order[i]]));
+        });
+        r.measure("cache", "lookup_miss", size, misses.size(), [&] (size_t i) {
+            perf::do_not_optimize(b->exists(misses[i]));
+        });
+        r.measure("cache", "erase", size, size, [&] (size_t i) {
+            perf::do_not_optimize(b->erase(keys[order[i]]));
+        }, fill);
+        b.reset();
+    }
+}
+
+int main(int ac, char** av)
+{
+    return perf::run(ac, av, 1000000, cache_suite);
+}
@@ -0,0 +1,244 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "tests/perf/perf.hh"
+#include "dict_lsa.hh"
+#include "sset_lsa.hh"
+#include "list_lsa.hh"
+#include <memory>
+#include <random>
+#include <unordered_map>
+
+using namespace redis;
+
+// Runs the operations on the containers in an LSA region, as the entries of
+// the cache are.
+class region_bench : private logalloc::region {
+public:
+    template <typename Func>
+    decltype(auto) run(Func&& func) {
+        return with_allocator(allocator(), std::forward<Func>(func));
+    }
+};
+
+static std::vector<sstring> make_keys(const char* prefix, size_t count)
+{
+    std::vector<sstring> keys;
+    keys.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        keys.emplace_back(sstring(prefix) + to_sstring(i));
+    }
+    return keys;
+}
+
+static std::vector<uint32_t> random_order(size_t count)
+{
+    std::vector<uint32_t> order(count);
+    for (size_t i = 0; i < count; ++i) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937(count));
+    return order;
+}
+
+// The whole container is walked by one operation, so many operations are
+// needed for the small ones.
+static size_t walks_of(size_t size)
+{
+    return std::max<size_t>(1, 1000000 / size);
+}
+
+static void dict_suite(perf::runner& r, region_bench& region)
+{
+    // the small sizes are packed, see dict_lsa::max_packed_entries.
+    for (auto size : r.sizes({ 16, 128, 1024, 65536, 1000000 })) {
+        auto fields = make_keys("field:", size);
+        auto order = random_order(size);
+        sstring value("value-of-a-field");
+        std::unique_ptr<dict_lsa> d;
+        auto reset = [&] {
+            region.run([&] {
+                d = std::make_unique<dict_lsa>();
+            });
+        };
+        auto fill = [&] {
+            reset();
+            region.run([&] {
+                for (auto& f : fields) {
+                    d->insert(f, value);
+                }
+            });
+        };
+        r.measure("dict_lsa", "insert", size, size, [&] (size_t i) {
+            region.run([&] {
+                d->insert(fields[i], value);
+            });
+        }, reset);
+        fill();
+        r.measure("dict_lsa", "lookup", size, size, [&] (size_t i) {
+            perf::do_not_optimize(d->with_entry_run(fields[order[i]], [] (const dict_field* f) {
+                return f != nullptr;
+            }));
+        });
+        r.measure("dict_lsa", "for_each", size, walks_of(size), [&] (size_t) {
+            size_t bytes = 0;
+            d->for_each([&bytes] (const dict_field& f) {
+                bytes += f.key_size();
+            });
+            perf::do_not_optimize(bytes);
+        });
+        r.measure("dict_lsa", "erase", size, size, [&] (size_t i) {
+            region.run([&] {
+                perf::do_not_optimize(d->erase(fields[order[i]]));
+            });
+        }, fill);
+        region.run([&] {
+            d.reset();
+        });
+    }
+}
+
+static void sset_suite(perf::runner& r, region_bench& region)
+{
+    for (auto size : r.sizes({ 16, 128, 1024, 65536, 1000000 })) {
+        auto keys = make_keys("member:", size);
+        auto order = random_order(size);
+        // the members are added one by one, as ZADD key score member does.
+        std::vector<std::unordered_map<sstring, double>> singles(size);
+        for (size_t i = 0; i < size; ++i) {
+            singles[i].emplace(keys[i], static_cast<double>(order[i]));
+        }
+        std::unique_ptr<sset_lsa> z;
+        auto reset = [&] {
+            region.run([&] {
+                z = std::make_unique<sset_lsa>();
+            });
+        };
+        auto fill = [&] {
+            reset();
+            region.run([&] {
+                for (auto& m : singles) {
+                    z->insert_or_update(m);
+                }
+            });
+        };
+        r.measure("sset_lsa", "insert", size, size, [&] (size_t i) {
+            region.run([&] {
+                z->insert_or_update(singles[i]);
+            });
+        }, reset);
+        fill();
+        r.measure("sset_lsa", "score", size, size, [&] (size_t i) {
+            perf::do_not_optimize(z->with_entry_run(keys[order[i]], [] (const sset_entry* e) {
+                return e ? e->score() : 0;
+            }));
+        });
+        std::vector<const sset_entry*> entries;
+        entries.reserve(10);
+        r.measure("sset_lsa", "range_by_rank_10", size, size, [&] (size_t i) {
+            entries.clear();
+            z->fetch_by_rank(order[i], order[i] + 9, entries);
+            perf::do_not_optimize(entries.size());
+        });
+        r.measure("sset_lsa", "range_by_score_10", size, size, [&] (size_t i) {
+            entries.clear();
+            z->fetch_by_score(order[i], std::numeric_limits<double>::max(), entries, 10);
+            perf::do_not_optimize(entries.size());
+        });
+        r.measure("sset_lsa", "count_by_score", size, size, [&] (size_t i) {
+            perf::do_not_optimize(z->count_by_score(order[i], order[i] + size / 10));
+        });
+        r.measure("sset_lsa", "erase", size, size, [&] (size_t i) {
+            region.run([&] {
+                z->erase(keys[order[i]]);
+            });
+        }, fill);
+        region.run([&] {
+            z.reset();
+        });
+    }
+}
+
+static void list_suite(perf::runner& r, region_bench& region)
+{
+    for (auto size : r.sizes({ 16, 1024, 65536, 1000000 })) {
+        auto order = random_order(size);
+        sstring value("value-of-an-element");
+        std::unique_ptr<list_lsa> l;
+        auto reset = [&] {
+            region.run([&] {
+                l = std::make_unique<list_lsa>();
+            });
+        };
+        auto fill = [&] {
+            reset();
+            region.run([&] {
+                for (size_t i = 0; i < size; ++i) {
+                    l->insert_tail(value);
+                }
+            });
+        };
+        r.measure("list_lsa", "push_tail", size, size, [&] (size_t) {
+            region.run([&] {
+                l->insert_tail(value);
+            });
+        }, reset);
+        r.measure("list_lsa", "push_head", size, size, [&] (size_t) {
+            region.run([&] {
+                l->insert_head(value);
+            });
+        }, reset);
+        fill();
+        r.measure("list_lsa", "index", size, size, [&] (size_t i) {
+            perf::do_not_optimize(l->at(order[i]).size());
+        });
+        std::vector<bytes_view> values;
+        r.measure("list_lsa", "range_10", size, size, [&] (size_t i) {
+            values.clear();
+            l->fetch(order[i], std::min<size_t>(order[i] + 9, size - 1), values);
+            perf::do_not_optimize(values.size());
+        });
+        // the insertions in the middle move the elements of a chunk, a few of
+        // them are enough.
+        r.measure("list_lsa", "insert_middle", size, std::min<size_t>(size, 10000), [&] (size_t) {
+            region.run([&] {
+                l->insert_at(l->size() / 2, value);
+            });
+        }, fill);
+        r.measure("list_lsa", "pop_front", size, size, [&] (size_t) {
+            region.run([&] {
+                l->pop_front();
+            });
+        }, fill);
+        region.run([&] {
+            l.reset();
+        });
+    }
+}
+
+int main(int ac, char** av)
+{
+    return perf::run(ac, av, 1000000, [] (perf::runner& r) {
+        region_bench region;
+        dict_suite(r, region);
+        sset_suite(r, region);
+        list_suite(r, region);
+    });
+}
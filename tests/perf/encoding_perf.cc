@@ -0,0 +1,166 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#include "tests/perf/perf.hh"
+#include "hll.hh"
+#include "geo.hh"
+#include "bits_operation.hh"
+#include "utils/logalloc.hh"
+#include "utils/managed_bytes.hh"
+#include <memory>
+#include <random>
+
+using namespace redis;
+
+class region_bench : private logalloc::region {
+public:
+    template <typename Func>
+    decltype(auto) run(Func&& func) {
+        return with_allocator(allocator(), std::forward<Func>(func));
+    }
+};
+
+static void hll_suite(perf::runner& r, region_bench& region)
+{
+    // the small HyperLogLogs stay sparse, the large ones are dense.
+    for (auto size : r.sizes({ 1000, 100000, 1000000 })) {
+        // every element is added by its own PFADD.
+        std::vector<std::vector<sstring>> elements(size);
+        for (size_t i = 0; i < size; ++i) {
+            elements[i].emplace_back(sstring("element:") + to_sstring(i));
+        }
+        std::unique_ptr<managed_bytes> data;
+        auto reset = [&] {
+            region.run([&] {
+                data = std::make_unique<managed_bytes>(hll::empty());
+            });
+        };
+        r.measure("hll", "append", size, size, [&] (size_t i) {
+            region.run([&] {
+                perf::do_not_optimize(hll::append(*data, elements[i]));
+            });
+        }, reset);
+        reset();
+        region.run([&] {
+            for (auto& e : elements) {
+                hll::append(*data, e);
+            }
+        });
+        r.measure("hll", "count", size, 10000, [&] (size_t) {
+            perf::do_not_optimize(hll::count(*data));
+        });
+        uint8_t raw[hll::RAW_SIZE];
+        r.measure("hll", "merge", size, 10000, [&] (size_t) {
+            hll::merge(raw, *data);
+            perf::do_not_optimize(raw);
+        }, [&] {
+            std::fill(raw, raw + hll::RAW_SIZE, 0);
+        });
+        r.measure("hll", "count_raw", size, 10000, [&] (size_t) {
+            perf::do_not_optimize(hll::count(raw));
+        });
+        region.run([&] {
+            data.reset();
+        });
+    }
+}
+
+static void geo_suite(perf::runner& r)
+{
+    // the points are spread over a square of about 100 km around the center,
+    // and their scores are sorted as the members of the sorted set are.
+    static constexpr const size_t BATCH = 64;
+    for (auto size : r.sizes({ 10000, 1000000, 10000000 })) {
+        std::mt19937 random(size);
+        std::uniform_real_distribution<double> longitude(12.7, 14.1), latitude(52.1, 52.9);
+        std::vector<double> scores(size);
+        for (auto& score : scores) {
+            geo::encode_to_geohash(longitude(random), latitude(random), score);
+        }
+        std::sort(scores.begin(), scores.end());
+        double longitudes[BATCH], latitudes[BATCH];
+        uint32_t selected[BATCH];
+        double everywhere[4] = { -180, -90, 180, 90 };
+        r.measure("geo", "decode_within", size, size / BATCH, [&] (size_t i) {
+            perf::do_not_optimize(geo::decode_within(scores.data() + i * BATCH, BATCH, everywhere, longitudes, latitudes, selected));
+        });
+        // GEOSEARCH FROMLONLAT BYRADIUS 5 km: the boxes around the center, the
+        // members of every box decoded by batches and measured.
+        geo::shape s;
+        s.longitude = 13.4;
+        s.latitude = 52.5;
+        s.radius = 5000;
+        std::vector<geo::area> areas;
+        r.measure("geo", "search_radius_5km", size, 1000, [&] (size_t) {
+            double bounds[4];
+            areas.clear();
+            geo::areas_of(s, areas, bounds);
+            size_t found = 0;
+            for (auto& area : areas) {
+                auto first = std::lower_bound(scores.begin(), scores.end(), area._min);
+                auto last = std::lower_bound(first, scores.end(), area._max);
+                for (auto p = first; p < last; p += BATCH) {
+                    auto n = std::min<size_t>(BATCH, last - p);
+                    auto within = geo::decode_within(&*p, n, bounds, longitudes, latitudes, selected);
+                    for (size_t j = 0; j < within; ++j) {
+                        double dist = 0;
+                        found += geo::inside(s, longitudes[selected[j]], latitudes[selected[j]], dist);
+                    }
+                }
+            }
+            perf::do_not_optimize(found);
+        });
+    }
+}
+
+static void bits_suite(perf::runner& r, region_bench& region)
+{
+    for (auto size : r.sizes({ 1024, 65536, 1024 * 1024, 16 * 1024 * 1024 })) {
+        std::unique_ptr<managed_bytes> bitmap;
+        region.run([&] {
+            bitmap = std::make_unique<managed_bytes>(size, 0);
+            std::mt19937 random(size);
+            for (size_t i = 0; i < size; i += 7) {
+                bits_operation::set(*bitmap, (i * 8 + random() % 8), true);
+            }
+        });
+        // BITCOUNT of the whole bitmap, and of a range starting and ending
+        // within bytes.
+        r.measure("bits", "count", size, std::max<size_t>(1, 64 * 1024 * 1024 / size), [&] (size_t) {
+            perf::do_not_optimize(bits_operation::count(*bitmap, 0, size - 1));
+        });
+        r.measure("bits", "count_range", size, std::max<size_t>(1, 64 * 1024 * 1024 / size), [&] (size_t) {
+            perf::do_not_optimize(bits_operation::count(*bitmap, 3, size - 5));
+        });
+        region.run([&] {
+            bitmap.reset();
+        });
+    }
+}
+
+int main(int ac, char** av)
+{
+    return perf::run(ac, av, 1000000, [] (perf::runner& r) {
+        region_bench region;
+        hll_suite(r, region);
+        geo_suite(r);
+        bits_suite(r, region);
+    });
+}
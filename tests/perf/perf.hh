@@ -0,0 +1,131 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+#pragma once
+#include "core/app-template.hh"
+#include "core/memory.hh"
+#include "core/reactor.hh"
+#include "core/sstring.hh"
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+namespace perf {
+
+// Keeps the compiler from dropping the computation of @value.
+template <typename T>
+inline void do_not_optimize(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+// Runs the benchmarks of a suite and writes one line of JSON per benchmark to
+// the output, with the time and the allocations per operation, so that the
+// results of two builds can be diffed by a script.
+class runner final {
+    sstring _filter;
+    unsigned _runs;
+    size_t _max_size;
+    std::ostream& _out;
+public:
+    runner(sstring filter, unsigned runs, size_t max_size, std::ostream& out)
+        : _filter(std::move(filter))
+        , _runs(std::max(runs, 1u))
+        , _max_size(max_size)
+        , _out(out)
+    {
+    }
+
+    // The benchmarks run are the ones whose "group.name" holds the filter.
+    bool wants(const char* group, const char* name) const {
+        if (_filter.empty()) {
+            return true;
+        }
+        auto full = sstring(group) + sstring(".") + sstring(name);
+        return full.find(_filter) != sstring::npos;
+    }
+
+    // The sizes of @sizes not above the --max-size option.
+    std::vector<size_t> sizes(std::initializer_list<size_t> sizes) const {
+        std::vector<size_t> kept;
+        for (auto size : sizes) {
+            if (size <= _max_size) {
+                kept.push_back(size);
+            }
+        }
+        return kept;
+    }
+
+    // Calls @op(i) for every i in [0, @ops), once per run, and reports the
+    // median run. @setup prepares every run and is not measured.
+    template <typename Op, typename Setup>
+    void measure(const char* group, const char* name, size_t size, size_t ops, Op&& op, Setup&& setup) {
+        if (!wants(group, name) || ops == 0) {
+            return;
+        }
+        std::vector<double> ns(_runs);
+        std::vector<double> allocs(_runs);
+        for (unsigned run = 0; run < _runs; ++run) {
+            setup();
+            auto mallocs = memory::stats().mallocs();
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < ops; ++i) {
+                op(i);
+            }
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            ns[run] = std::chrono::duration<double, std::nano>(elapsed).count() / ops;
+            allocs[run] = static_cast<double>(memory::stats().mallocs() - mallocs) / ops;
+        }
+        auto min = *std::min_element(ns.begin(), ns.end());
+        std::nth_element(ns.begin(), ns.begin() + _runs / 2, ns.end());
+        std::nth_element(allocs.begin(), allocs.begin() + _runs / 2, allocs.end());
+        _out << "{\"group\":\"" << group << "\",\"name\":\"" << name << "\",\"size\":" << size
+             << ",\"ops\":" << ops << ",\"runs\":" << _runs
+             << ",\"ns_per_op\":" << ns[_runs / 2] << ",\"min_ns_per_op\":" << min
+             << ",\"allocs_per_op\":" << allocs[_runs / 2] << "}" << std::endl;
+    }
+
+    template <typename Op>
+    void measure(const char* group, const char* name, size_t size, size_t ops, Op&& op) {
+        measure(group, name, size, ops, std::forward<Op>(op), [] {});
+    }
+};
+
+// The main of a suite: the benchmarks are run by @suite on the first shard,
+// the allocations are counted by the seastar allocator.
+inline int run(int ac, char** av, size_t default_max_size, std::function<void (runner&)> suite) {
+    namespace bpo = boost::program_options;
+    app_template app;
+    app.add_options()
+        ("filter", bpo::value<std::string>()->default_value(""), "Runs the benchmarks whose group.name holds this string")
+        ("runs", bpo::value<unsigned>()->default_value(5), "Number of runs of every benchmark, the median is reported")
+        ("max-size", bpo::value<size_t>()->default_value(default_max_size), "Largest number of elements or keys of a benchmark")
+        ;
+    return app.run(ac, av, [&app, suite = std::move(suite)] {
+        auto&& config = app.configuration();
+        runner r(config["filter"].as<std::string>(), config["runs"].as<unsigned>(), config["max-size"].as<size_t>(), std::cout);
+        suite(r);
+        return make_ready_future<int>(0);
+    });
+}
+}
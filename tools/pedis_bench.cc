@@ -0,0 +1,598 @@
+/*
+* Pedis is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Affero General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* You may obtain a copy of the License at
+*
+*     http://www.gnu.org/licenses
+*
+* Unless required by applicable law or agreed to in writing,
+* software distributed under the License is distributed on an
+* "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+* KIND, either express or implied.  See the License for the
+* specific language governing permissions and limitations
+* under the License.
+*
+*  Copyright (c) 2016-2026, Peng Jian, pstack@163.com. All rights reserved.
+*
+*/
+// A load generator speaking RESP. Every core opens its own connections to the
+// server, and every connection sends batches of pipelined requests drawn from
+// the command mix, then waits for all their replies. The latency of a request
+// is the time from the write of its batch to the end of its reply.
+#include "core/app-template.hh"
+#include "core/distributed.hh"
+#include "core/future-util.hh"
+#include "core/reactor.hh"
+#include "core/sstring.hh"
+#include "net/api.hh"
+#include "util/log.hh"
+#include "common.hh"
+#include "latency_histogram.hh"
+#include <boost/algorithm/string.hpp>
+#include <boost/range/irange.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using logger = seastar::logger;
+static logger bench_log ("bench");
+
+namespace bench {
+
+using clock_type = std::chrono::steady_clock;
+
+enum class command {
+    get, set, mget, incr, hget, hset, lpush, lrange, sadd, zadd,
+};
+
+struct weighted_command {
+    command _command;
+    unsigned _weight;
+};
+
+struct config {
+    sstring _server;
+    unsigned _connections;
+    unsigned _pipeline;
+    unsigned _duration;
+    size_t _keys;
+    bool _zipfian;
+    double _zipf_theta;
+    size_t _value_size;
+    unsigned _hash_tags;
+    unsigned _server_shards;
+    bool _populate;
+    std::vector<weighted_command> _mix;
+};
+
+// Parses the command mix, e.g. "get:9,set:1".
+static bool parse_mix(const std::string& text, std::vector<weighted_command>& mix)
+{
+    static const std::vector<std::pair<const char*, command>> names = {
+        { "get", command::get }, { "set", command::set }, { "mget", command::mget },
+        { "incr", command::incr }, { "hget", command::hget }, { "hset", command::hset },
+        { "lpush", command::lpush }, { "lrange", command::lrange }, { "sadd", command::sadd },
+        { "zadd", command::zadd },
+    };
+    std::vector<std::string> items;
+    boost::split(items, text, boost::is_any_of(","));
+    for (auto& item : items) {
+        auto colon = item.find(':');
+        auto name = boost::to_lower_copy(item.substr(0, colon));
+        unsigned weight = 1;
+        if (colon != std::string::npos) {
+            try {
+                weight = std::stoul(item.substr(colon + 1));
+            } catch (...) {
+                return false;
+            }
+        }
+        auto it = std::find_if(names.begin(), names.end(), [&name] (auto& n) { return name == n.first; });
+        if (it == names.end()) {
+            return false;
+        }
+        if (weight > 0) {
+            mix.push_back(weighted_command { it->second, weight });
+        }
+    }
+    return !mix.empty();
+}
+
+// Picks the ranks of the keys, uniformly or following a zipfian distribution
+// where the rank 0 is the most popular, as YCSB does (Gray et al., "Quickly
+// generating billion-record synthetic databases").
+class key_chooser {
+    size_t _keys;
+    bool _zipfian;
+    double _theta;
+    double _alpha = 0;
+    double _zetan = 0;
+    double _eta = 0;
+    std::uniform_real_distribution<double> _unit { 0, 1 };
+    std::uniform_int_distribution<size_t> _uniform;
+
+    static double zeta(size_t n, double theta) {
+        double sum = 0;
+        for (size_t i = 1; i <= n; ++i) {
+            sum += 1 / std::pow(static_cast<double>(i), theta);
+        }
+        return sum;
+    }
+public:
+    key_chooser(size_t keys, bool zipfian, double theta)
+        : _keys(keys)
+        , _zipfian(zipfian)
+        , _theta(theta)
+        , _uniform(0, keys - 1)
+    {
+        if (_zipfian) {
+            _alpha = 1 / (1 - _theta);
+            _zetan = zeta(_keys, _theta);
+            _eta = (1 - std::pow(2.0 / _keys, 1 - _theta)) / (1 - zeta(2, _theta) / _zetan);
+        }
+    }
+
+    template <typename Random>
+    size_t next(Random& random) {
+        if (!_zipfian) {
+            return _uniform(random);
+        }
+        auto u = _unit(random);
+        auto uz = u * _zetan;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + std::pow(0.5, _theta)) {
+            return 1;
+        }
+        auto rank = static_cast<size_t>(_keys * std::pow(_eta * u - _eta + 1, _alpha));
+        return rank < _keys ? rank : _keys - 1;
+    }
+};
+
+// Counts the complete replies in the bytes read from the connection. The
+// replies may be split anywhere, the arrays may be nested.
+class reply_counter {
+    enum class state { type, line, bulk };
+    state _state = state::type;
+    char _type = 0;
+    int64_t _number = 0;
+    bool _negative = false;
+    size_t _bulk_left = 0;
+    // The elements left in every open array.
+    std::vector<int64_t> _arrays;
+    uint64_t _errors = 0;
+
+    // Ends a value, returns true if it ended a whole reply.
+    bool complete() {
+        _state = state::type;
+        while (!_arrays.empty()) {
+            if (--_arrays.back() > 0) {
+                return false;
+            }
+            _arrays.pop_back();
+        }
+        return true;
+    }
+    bool end_of_line() {
+        auto n = _negative ? -_number : _number;
+        switch (_type) {
+        case '-':
+            ++_errors;
+            return complete();
+        case '$':
+            if (n < 0) {
+                return complete();
+            }
+            _bulk_left = n + 2;
+            _state = state::bulk;
+            return false;
+        case '*':
+            if (n <= 0) {
+                return complete();
+            }
+            _arrays.push_back(n);
+            _state = state::type;
+            return false;
+        default:
+            return complete();
+        }
+    }
+public:
+    // Returns the number of replies ended in [p, end).
+    size_t feed(const char* p, const char* end) {
+        size_t replies = 0;
+        while (p < end) {
+            switch (_state) {
+            case state::type:
+                _type = *p++;
+                _number = 0;
+                _negative = false;
+                _state = state::line;
+                break;
+            case state::line:
+            {
+                auto c = *p++;
+                if (c == '\n') {
+                    replies += end_of_line();
+                } else if (c == '-') {
+                    _negative = true;
+                } else if (c >= '0' && c <= '9') {
+                    _number = _number * 10 + (c - '0');
+                }
+                break;
+            }
+            case state::bulk:
+            {
+                auto n = std::min<size_t>(_bulk_left, end - p);
+                p += n;
+                _bulk_left -= n;
+                if (_bulk_left == 0) {
+                    replies += complete();
+                }
+                break;
+            }
+            }
+        }
+        return replies;
+    }
+    inline uint64_t errors() const {
+        return _errors;
+    }
+};
+
+struct shard_stats {
+    uint64_t _requests = 0;
+    uint64_t _errors = 0;
+    double _seconds = 0;
+    redis::latency_histogram _latencies;
+    // The requests sent to every shard of the server, with --server-shards.
+    std::vector<uint64_t> _by_server_shard;
+
+    shard_stats& operator += (const shard_stats& o) {
+        _requests += o._requests;
+        _errors += o._errors;
+        _seconds = std::max(_seconds, o._seconds);
+        _latencies += o._latencies;
+        _by_server_shard.resize(std::max(_by_server_shard.size(), o._by_server_shard.size()));
+        for (size_t i = 0; i < o._by_server_shard.size(); ++i) {
+            _by_server_shard[i] += o._by_server_shard[i];
+        }
+        return *this;
+    }
+};
+
+class connection {
+    connected_socket _socket;
+    input_stream<char> _in;
+    output_stream<char> _out;
+    reply_counter _replies;
+public:
+    explicit connection(connected_socket socket)
+        : _socket(std::move(socket))
+        , _in(_socket.input())
+        , _out(_socket.output())
+    {
+    }
+    // Writes the @count requests of @batch, and calls @on_reply once per reply
+    // received, until all of them are.
+    template <typename Func>
+    future<> round_trip(const sstring& batch, size_t count, Func&& on_reply) {
+        return _out.write(batch).then([this] {
+            return _out.flush();
+        }).then([this, count, on_reply = std::forward<Func>(on_reply)] () mutable {
+            return do_with(size_t(0), std::move(on_reply), [this, count] (size_t& received, auto& on_reply) {
+                return do_until([&received, count] { return received >= count; }, [this, &received, &on_reply] {
+                    return _in.read().then([this, &received, &on_reply] (temporary_buffer<char> buf) {
+                        if (buf.empty()) {
+                            throw std::runtime_error("the server closed the connection");
+                        }
+                        auto n = _replies.feed(buf.begin(), buf.end());
+                        received += n;
+                        on_reply(n);
+                    });
+                });
+            });
+        });
+    }
+    inline uint64_t errors() const {
+        return _replies.errors();
+    }
+    future<> close() {
+        return _out.close();
+    }
+};
+
+// The load of a core: its connections, and the statistics of its requests.
+class client {
+    config _config;
+    key_chooser _chooser;
+    std::mt19937_64 _random;
+    sstring _value;
+    unsigned _total_weight = 0;
+    std::vector<lw_shared_ptr<connection>> _connections;
+    shard_stats _stats;
+    clock_type::time_point _deadline;
+
+    sstring key_of(size_t rank) const {
+        auto key = sstring("key:") + to_sstring(rank);
+        if (_config._hash_tags > 0) {
+            key = sstring("{tag") + to_sstring(rank % _config._hash_tags) + sstring("}") + key;
+        }
+        return key;
+    }
+    static void append_arg(std::string& out, const sstring& arg) {
+        out += '$';
+        out += std::to_string(arg.size());
+        out += "\r\n";
+        out.append(arg.data(), arg.size());
+        out += "\r\n";
+    }
+    static void append_request(std::string& out, std::initializer_list<sstring> args) {
+        out += '*';
+        out += std::to_string(args.size());
+        out += "\r\n";
+        for (auto& arg : args) {
+            append_arg(out, arg);
+        }
+    }
+    void count_key(const sstring& key) {
+        if (_config._server_shards > 0) {
+            ++_stats._by_server_shard[redis::redis_key::shard_hash_of(key) % _config._server_shards];
+        }
+    }
+    command pick() {
+        auto n = std::uniform_int_distribution<unsigned>(0, _total_weight - 1)(_random);
+        for (auto& c : _config._mix) {
+            if (n < c._weight) {
+                return c._command;
+            }
+            n -= c._weight;
+        }
+        return _config._mix.back()._command;
+    }
+    void append_next(std::string& out) {
+        auto key = key_of(_chooser.next(_random));
+        count_key(key);
+        switch (pick()) {
+        case command::get:
+            return append_request(out, { "GET", key });
+        case command::set:
+            return append_request(out, { "SET", key, _value });
+        case command::mget:
+        {
+            // the keys of an MGET share the hash tag of the first one, if any.
+            out += "*11\r\n";
+            append_arg(out, "MGET");
+            append_arg(out, key);
+            for (int i = 1; i < 10; ++i) {
+                append_arg(out, key_of(_chooser.next(_random)));
+            }
+            return;
+        }
+        case command::incr:
+            return append_request(out, { "INCR", sstring("counter:") + key });
+        case command::hget:
+            return append_request(out, { "HGET", sstring("hash:") + key, "field" });
+        case command::hset:
+            return append_request(out, { "HSET", sstring("hash:") + key, "field", _value });
+        case command::lpush:
+            return append_request(out, { "LPUSH", sstring("list:") + key, _value });
+        case command::lrange:
+            return append_request(out, { "LRANGE", sstring("list:") + key, "0", "9" });
+        case command::sadd:
+            return append_request(out, { "SADD", sstring("set:") + key, to_sstring(_random() % 1000) });
+        case command::zadd:
+            return append_request(out, { "ZADD", sstring("zset:") + key, to_sstring(_random() % 1000), to_sstring(_random() % 1000) });
+        }
+    }
+    future<> drive(lw_shared_ptr<connection> c) {
+        return do_until([this] { return clock_type::now() >= _deadline; }, [this, c] {
+            std::string batch;
+            for (unsigned i = 0; i < _config._pipeline; ++i) {
+                append_next(batch);
+            }
+            auto start = clock_type::now();
+            return c->round_trip(sstring(batch.data(), batch.size()), _config._pipeline, [this, start] (size_t replies) {
+                auto us = std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - start).count();
+                for (size_t i = 0; i < replies; ++i) {
+                    _stats._latencies.record(us);
+                }
+                _stats._requests += replies;
+            });
+        });
+    }
+public:
+    explicit client(config c)
+        : _config(std::move(c))
+        , _chooser(_config._keys, _config._zipfian, _config._zipf_theta)
+        , _random(engine().cpu_id() + 1)
+        , _value(_config._value_size, 'x')
+    {
+        for (auto& c : _config._mix) {
+            _total_weight += c._weight;
+        }
+        _stats._by_server_shard.resize(_config._server_shards);
+    }
+
+    future<> connect() {
+        auto address = make_ipv4_address(ipv4_addr(std::string(_config._server)));
+        return parallel_for_each(boost::irange(0u, _config._connections), [this, address] (unsigned) {
+            return engine().connect(address).then([this] (connected_socket s) {
+                _connections.push_back(make_lw_shared<connection>(std::move(s)));
+            });
+        });
+    }
+
+    // Sets the string keys of this core, every core sets one key in smp::count,
+    // so that the GETs hit.
+    future<> populate() {
+        if (!_config._populate || _connections.empty() || engine().cpu_id() >= _config._keys) {
+            return make_ready_future<>();
+        }
+        auto c = _connections.front();
+        auto ranks = boost::irange<size_t>(engine().cpu_id(), _config._keys, smp::count);
+        return do_with(ranks.begin(), [this, c, ranks] (auto& it) {
+            return do_until([&it, ranks] { return it == ranks.end(); }, [this, c, &it, ranks] {
+                std::string batch;
+                size_t count = 0;
+                for (; it != ranks.end() && count < 1000; ++it, ++count) {
+                    append_request(batch, { "SET", key_of(*it), _value });
+                }
+                return c->round_trip(sstring(batch.data(), batch.size()), count, [] (size_t) {});
+            });
+        });
+    }
+
+    future<> run() {
+        auto start = clock_type::now();
+        _deadline = start + std::chrono::seconds(_config._duration);
+        return parallel_for_each(_connections, [this] (lw_shared_ptr<connection> c) {
+            return drive(c);
+        }).then([this, start] {
+            _stats._seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+            for (auto& c : _connections) {
+                _stats._errors += c->errors();
+            }
+        });
+    }
+
+    shard_stats stats() const {
+        return _stats;
+    }
+
+    future<> stop() {
+        return parallel_for_each(_connections, [] (lw_shared_ptr<connection> c) {
+            return c->close().finally([c] {});
+        });
+    }
+};
+
+static void report(const std::vector<shard_stats>& shards, bool json)
+{
+    shard_stats total;
+    for (auto& s : shards) {
+        total += s;
+    }
+    auto rate = [] (const shard_stats& s) {
+        return s._seconds > 0 ? s._requests / s._seconds : 0;
+    };
+    auto& h = total._latencies;
+    if (json) {
+        std::cout << "{\"requests\":" << total._requests << ",\"errors\":" << total._errors
+                  << ",\"ops_per_sec\":" << rate(total) << ",\"latency_us\":{\"mean\":" << h.mean()
+                  << ",\"p50\":" << h.percentile(0.5) << ",\"p90\":" << h.percentile(0.9)
+                  << ",\"p99\":" << h.percentile(0.99) << ",\"p999\":" << h.percentile(0.999)
+                  << ",\"max\":" << h.percentile(1) << "},\"cores\":[";
+        for (size_t i = 0; i < shards.size(); ++i) {
+            auto& s = shards[i];
+            std::cout << (i ? "," : "") << "{\"ops_per_sec\":" << rate(s) << ",\"p99\":" << s._latencies.percentile(0.99) << "}";
+        }
+        std::cout << "],\"server_shards\":[";
+        for (size_t i = 0; i < total._by_server_shard.size(); ++i) {
+            std::cout << (i ? "," : "") << total._by_server_shard[i];
+        }
+        std::cout << "]}" << std::endl;
+        return;
+    }
+    std::cout << "requests: " << total._requests << ", errors: " << total._errors << "\n"
+              << "throughput: " << static_cast<uint64_t>(rate(total)) << " ops/sec\n"
+              << "latency (us): mean " << h.mean() << ", p50 " << h.percentile(0.5)
+              << ", p90 " << h.percentile(0.9) << ", p99 " << h.percentile(0.99)
+              << ", p99.9 " << h.percentile(0.999) << ", max " << h.percentile(1) << "\n";
+    for (size_t i = 0; i < shards.size(); ++i) {
+        auto& s = shards[i];
+        std::cout << "core " << i << ": " << static_cast<uint64_t>(rate(s)) << " ops/sec, p99 "
+                  << s._latencies.percentile(0.99) << " us\n";
+    }
+    if (!total._by_server_shard.empty()) {
+        uint64_t busiest = *std::max_element(total._by_server_shard.begin(), total._by_server_shard.end());
+        double mean = static_cast<double>(total._requests) / total._by_server_shard.size();
+        for (size_t i = 0; i < total._by_server_shard.size(); ++i) {
+            std::cout << "server shard " << i << ": " << total._by_server_shard[i] << " keys\n";
+        }
+        std::cout << "server shard skew: " << (mean > 0 ? busiest / mean : 0) << "\n";
+    }
+    std::cout << std::flush;
+}
+}
+
+int main(int ac, char** av)
+{
+    namespace bpo = boost::program_options;
+    distributed<bench::client> clients;
+    app_template app;
+    app.add_options()
+        ("server", bpo::value<std::string>()->default_value("127.0.0.1:6379"), "Address of the server")
+        ("connections", bpo::value<unsigned>()->default_value(16), "Number of connections opened by every core")
+        ("pipeline", bpo::value<unsigned>()->default_value(1), "Number of requests sent at once by a connection")
+        ("duration", bpo::value<unsigned>()->default_value(10), "Duration (seconds) of the run")
+        ("keys", bpo::value<size_t>()->default_value(1000000), "Number of keys")
+        ("distribution", bpo::value<std::string>()->default_value("uniform"), "Distribution of the keys: uniform or zipfian")
+        ("zipf-theta", bpo::value<double>()->default_value(0.99), "Skew of the zipfian distribution, below 1")
+        ("ratio", bpo::value<std::string>()->default_value("get:9,set:1"), "Command mix, of get, set, mget, incr, hget, hset, lpush, lrange, sadd and zadd")
+        ("data-size", bpo::value<size_t>()->default_value(32), "Size (bytes) of the values")
+        ("hash-tags", bpo::value<unsigned>()->default_value(0), "Number of hash tags the keys are spread over, 0 means none")
+        ("server-shards", bpo::value<unsigned>()->default_value(0), "Number of shards of the server, the requests to every one are counted")
+        ("populate", bpo::value<bool>()->default_value(true), "Sets all the keys before the run")
+        ("json", bpo::value<bool>()->default_value(false), "Reports the results as a line of JSON")
+        ;
+    return app.run(ac, av, [&] {
+        auto&& c = app.configuration();
+        bench::config cfg;
+        cfg._server = c["server"].as<std::string>();
+        cfg._connections = c["connections"].as<unsigned>();
+        cfg._pipeline = std::max(c["pipeline"].as<unsigned>(), 1u);
+        cfg._duration = c["duration"].as<unsigned>();
+        cfg._keys = std::max<size_t>(c["keys"].as<size_t>(), 2);
+        auto distribution = c["distribution"].as<std::string>();
+        cfg._zipfian = distribution == "zipfian";
+        cfg._zipf_theta = c["zipf-theta"].as<double>();
+        cfg._value_size = c["data-size"].as<size_t>();
+        cfg._hash_tags = c["hash-tags"].as<unsigned>();
+        cfg._server_shards = c["server-shards"].as<unsigned>();
+        cfg._populate = c["populate"].as<bool>();
+        auto json = c["json"].as<bool>();
+        if ((!cfg._zipfian && distribution != "uniform") || (cfg._zipfian && (cfg._zipf_theta <= 0 || cfg._zipf_theta >= 1))) {
+            bench_log.error("unknown distribution: {} (theta {})", distribution, cfg._zipf_theta);
+            return make_ready_future<int>(1);
+        }
+        if (!bench::parse_mix(c["ratio"].as<std::string>(), cfg._mix)) {
+            bench_log.error("bad command mix: {}", c["ratio"].as<std::string>());
+            return make_ready_future<int>(1);
+        }
+        return clients.start(cfg).then([&clients] {
+            return clients.invoke_on_all(&bench::client::connect);
+        }).then([&clients] {
+            return clients.invoke_on_all(&bench::client::populate);
+        }).then([&clients] {
+            return clients.invoke_on_all(&bench::client::run);
+        }).then([&clients, json] {
+            return do_with(std::vector<bench::shard_stats>(smp::count), [&clients, json] (auto& shards) {
+                return parallel_for_each(boost::irange(0u, smp::count), [&clients, &shards] (unsigned cpu) {
+                    return clients.invoke_on(cpu, &bench::client::stats).then([&shards, cpu] (bench::shard_stats s) {
+                        shards[cpu] = std::move(s);
+                    });
+                }).then([&shards, json] {
+                    bench::report(shards, json);
+                });
+            });
+        }).then_wrapped([&clients] (future<> f) {
+            return clients.stop().then([f = std::move(f)] () mutable {
+                try {
+                    f.get();
+                    return 0;
+                } catch (std::exception& e) {
+                    bench_log.error("the run failed: {}", e.what());
+                    return 1;
+                }
+            });
+        });
+    });
+}
@@ -58,6 +58,16 @@ class tracker::impl {
     bool _reclaiming_enabled = true;
     size_t _reclamation_step = 1;
     bool _abort_on_bad_alloc = false;
+    size_t _compaction_watermark = 0;
+    std::chrono::microseconds _idle_compaction_budget { 500 };
+    size_t _background_bytes_compacted = 0;
+    std::function<void (const tracker::stall&)> _stall_observer;
+    const char* _stall_context = nullptr;
+    unsigned _stall_depth = 0;
+    uint64_t _stalls = 0;
+    uint64_t _stall_us = 0;
+    uint64_t _stall_bytes_moved = 0;
+    class stall_guard;
 private:
     // Prevents tracker's reclaimer from running while live. Reclaimer may be
     // invoked synchronously with allocator. This guard ensures that this
@@ -83,7 +93,11 @@ public:
     void unregister_region(region::impl*);
     size_t reclaim(size_t bytes);
     reactor::idle_cpu_handler_result compact_on_idle(reactor::work_waiting_on_reactor check_for_work);
+    bool compact_in_background(std::chrono::microseconds budget, reactor::work_waiting_on_reactor check_for_work);
     size_t compact_and_evict(size_t bytes);
+    // compact_and_evict() for an allocation which found no free segment, the
+    // time it takes is a stall.
+    size_t compact_and_evict_on_allocation(size_t bytes);
     void full_compaction();
     void reclaim_all_free_segments();
     occupancy_stats region_occupancy();
@@ -92,6 +106,13 @@ public:
     size_t reclamation_step() const { return _reclamation_step; }
     void enable_abort_on_bad_alloc() { _abort_on_bad_alloc = true; }
     bool should_abort_on_bad_alloc() const { return _abort_on_bad_alloc; }
+    void set_compaction_watermark(size_t free_segments) { _compaction_watermark = free_segments; }
+    size_t compaction_watermark() const { return _compaction_watermark; }
+    void set_idle_compaction_budget(std::chrono::microseconds budget) { _idle_compaction_budget = budget; }
+    size_t background_bytes_compacted() const { return _background_bytes_compacted; }
+    void set_stall_observer(std::function<void (const tracker::stall&)> observer) { _stall_observer = std::move(observer); }
+    void set_stall_context(const char* context) { _stall_context = context; }
+    const char* stall_context() const { return _stall_context; }
 };
 
 class tracker_reclaimer_lock {
@@ -116,6 +137,34 @@ reactor::idle_cpu_handler_result tracker::compact_on_idle(reactor::work_waiting_
     return _impl->compact_on_idle(check_for_work);
 }
 
+bool tracker::compact_in_background(std::chrono::microseconds budget, reactor::work_waiting_on_reactor check_for_work) {
+    return _impl->compact_in_background(budget, check_for_work);
+}
+
+void tracker::set_compaction_watermark(size_t free_segments) {
+    _impl->set_compaction_watermark(free_segments);
+}
+
+size_t tracker::compaction_watermark() const {
+    return _impl->compaction_watermark();
+}
+
+void tracker::set_idle_compaction_budget(std::chrono::microseconds budget) {
+    _impl->set_idle_compaction_budget(budget);
+}
+
+void tracker::set_stall_observer(std::function<void (const stall&)> observer) {
+    _impl->set_stall_observer(std::move(observer));
+}
+
+void tracker::set_stall_context(const char* context) {
+    _impl->set_stall_context(context);
+}
+
+const char* tracker::stall_context() const {
+    return _impl->stall_context();
+}
+
 occupancy_stats tracker::region_occupancy() {
     return _impl->region_occupancy();
 }
@@ -562,6 +611,7 @@ public:
     struct stats {
         size_t segments_migrated;
         size_t segments_compacted;
+        size_t bytes_compacted;
     };
 private:
     stats _stats{};
@@ -569,7 +619,10 @@ public:
     size_t zone_count() const { return _all_zones.size(); }
     const stats& statistics() const { return _stats; }
     void on_segment_migration() { _stats.segments_migrated++; }
-    void on_segment_compaction() { _stats.segments_compacted++; }
+    void on_segment_compaction(size_t bytes) {
+        _stats.segments_compacted++;
+        _stats.bytes_compacted += bytes;
+    }
     size_t free_segments_in_zones() const { return _free_segments_in_zones; }
     size_t free_segments() const { return _free_segments_in_zones + _emergency_reserve.size(); }
 };
@@ -686,7 +739,7 @@ segment* segment_pool::allocate_segment()
             }
             return seg;
         }
-    } while (shard_tracker().get_impl().compact_and_evict(shard_tracker().reclamation_step() * segment::size));
+    } while (shard_tracker().get_impl().compact_and_evict_on_allocation(shard_tracker().reclamation_step() * segment::size));
     if (shard_tracker().should_abort_on_bad_alloc()) {
         logger.error("Aborting due to segment allocation failure");
         abort();
@@ -879,6 +932,7 @@ public:
     struct stats {
         size_t segments_migrated;
         size_t segments_compacted;
+        size_t bytes_compacted;
     };
 private:
     stats _stats{};
@@ -886,7 +940,10 @@ public:
     size_t zone_count() const { return 0; }
     const stats& statistics() const { return _stats; }
     void on_segment_migration() { _stats.segments_migrated++; }
-    void on_segment_compaction() { _stats.segments_compacted++; }
+    void on_segment_compaction(size_t bytes) {
+        _stats.segments_compacted++;
+        _stats.bytes_compacted += bytes;
+    }
     size_t free_segments_in_zones() const { return 0; }
     size_t free_segments() const { return 0; }
 public:
@@ -915,6 +972,13 @@ size_t segment_pool::segments_in_use() const {
 
 static thread_local segment_pool shard_segment_pool;
 
+tracker::segment_stats tracker::segment_statistics() const {
+    auto& s = shard_segment_pool.statistics();
+    return { shard_segment_pool.free_segments(), shard_segment_pool.zone_count(),
+             s.segments_compacted, s.segments_migrated, shard_segment_pool.non_lsa_memory_in_use(),
+             s.bytes_compacted, _impl->background_bytes_compacted() };
+}
+
 void segment::record_alloc(segment::size_type size) {
     shard_segment_pool.descriptor(this).record_alloc(size);
 }
@@ -1452,8 +1516,9 @@ public:
         logger.debug("Compacting segment {} from region {}, {}", seg, id(), seg->occupancy());
         _segments.pop();
         _closed_occupancy -= seg->occupancy();
+        auto bytes = seg->occupancy().used_space();
         compact(seg);
-        shard_segment_pool.on_segment_compaction();
+        shard_segment_pool.on_segment_compaction(bytes);
     }
 
     // Compacts a single segment
@@ -1770,13 +1835,66 @@ struct reclaim_timer {
     }
 };
 
+// Measures a stall, the outermost one only when a reclaim runs another.
+class tracker::impl::stall_guard {
+    impl& _ref;
+    bool _observed;
+    clock::time_point _start;
+    size_t _moved = 0;
+    size_t _released = 0;
+    const char* _context = nullptr;
+
+    static size_t bytes_moved() {
+        auto& s = shard_segment_pool.statistics();
+        return s.bytes_compacted + s.segments_migrated * segment::size;
+    }
+public:
+    stall_guard(impl& ref)
+        : _ref(ref)
+        , _observed(ref._stall_depth++ == 0)
+    {
+        if (_observed) {
+            _start = clock::now();
+            _moved = bytes_moved();
+            _context = ref._stall_context;
+        }
+    }
+    ~stall_guard() {
+        --_ref._stall_depth;
+        if (!_observed) {
+            return;
+        }
+        auto moved = bytes_moved() - _moved;
+        if (!_released && !moved) {
+            return;
+        }
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - _start);
+        ++_ref._stalls;
+        _ref._stall_us += duration.count();
+        _ref._stall_bytes_moved += moved;
+        if (_ref._stall_observer) {
+            _ref._stall_observer(tracker::stall { duration, _released, moved, _context });
+        }
+    }
+    size_t released(size_t bytes) {
+        _released += bytes;
+        return bytes;
+    }
+};
+
 reactor::idle_cpu_handler_result tracker::impl::compact_on_idle(reactor::work_waiting_on_reactor check_for_work) {
+    return compact_in_background(_idle_compaction_budget, check_for_work)
+           ? reactor::idle_cpu_handler_result::no_more_work
+           : reactor::idle_cpu_handler_result::interrupted_by_higher_priority_task;
+}
+
+bool tracker::impl::compact_in_background(std::chrono::microseconds budget, reactor::work_waiting_on_reactor check_for_work) {
     if (!_reclaiming_enabled) {
-        return reactor::idle_cpu_handler_result::no_more_work;
+        return true;
     }
     reclaiming_lock rl(*this);
     if (_regions.empty()) {
-        return reactor::idle_cpu_handler_result::no_more_work;
+        return true;
     }
     segment_pool::reservation_goal open_emergency_pool(shard_segment_pool, 0);
 
@@ -1789,19 +1907,32 @@ reactor::idle_cpu_handler_result tracker::impl::compact_on_idle(reactor::work_wa
 
     boost::range::make_heap(_regions, cmp);
 
+    auto deadline = clock::now() + budget;
+    auto compacted = shard_segment_pool.statistics().bytes_compacted;
+    bool done = false;
     while (!check_for_work()) {
+        if (_compaction_watermark && shard_segment_pool.free_segments_in_zones() >= _compaction_watermark) {
+            done = true;
+            break;
+        }
         boost::range::pop_heap(_regions, cmp);
         region::impl* r = _regions.back();
 
         if (!r->is_idle_compactible()) {
-            return reactor::idle_cpu_handler_result::no_more_work;
+            boost::range::push_heap(_regions, cmp);
+            done = true;
+            break;
         }
 
         r->compact();
 
         boost::range::push_heap(_regions, cmp);
+        if (clock::now() >= deadline) {
+            break;
+        }
     }
-    return reactor::idle_cpu_handler_result::interrupted_by_higher_priority_task;
+    _background_bytes_compacted += shard_segment_pool.statistics().bytes_compacted - compacted;
+    return done;
 }
 
 size_t tracker::impl::reclaim(size_t memory_to_release) {
@@ -1813,6 +1944,7 @@ size_t tracker::impl::reclaim(size_t memory_to_release) {
         return 0;
     }
 
+    stall_guard guard(*this);
     size_t mem_released;
     {
         reclaiming_lock rl(*this);
@@ -1821,10 +1953,18 @@ size_t tracker::impl::reclaim(size_t memory_to_release) {
         auto nr_released = shard_segment_pool.reclaim_segments(segments_to_release);
         mem_released = nr_released * segment::size;
         if (mem_released > memory_to_release) {
-            return memory_to_release;
+            return guard.released(memory_to_release);
         }
     }
-    return compact_and_evict(memory_to_release - mem_released) + mem_released;
+    return guard.released(compact_and_evict(memory_to_release - mem_released) + mem_released);
+}
+
+size_t tracker::impl::compact_and_evict_on_allocation(size_t memory_to_release) {
+    if (!_reclaiming_enabled) {
+        return 0;
+    }
+    stall_guard guard(*this);
+    return guard.released(compact_and_evict(memory_to_release));
 }
 
 size_t tracker::impl::compact_and_evict(size_t memory_to_release) {
@@ -2040,6 +2180,21 @@ tracker::impl::impl() {
 
         sm::make_derive("segments_compacted", [this] { return shard_segment_pool.statistics().segments_compacted; },
                         sm::description("Counts a number of compacted segments.")),
+
+        sm::make_derive("compacted_bytes", [this] { return shard_segment_pool.statistics().bytes_compacted; },
+                        sm::description("Counts the bytes of the live objects moved by the compactions.")),
+
+        sm::make_derive("background_compacted_bytes", [this] { return _background_bytes_compacted; },
+                        sm::description("Counts the bytes of the live objects moved by the compactions of the background.")),
+
+        sm::make_derive("allocation_stalls", [this] { return _stalls; },
+                        sm::description("Counts the allocations which had to reclaim, compact or evict first.")),
+
+        sm::make_derive("allocation_stall_us", [this] { return _stall_us; },
+                        sm::description("Counts the time (us) the allocations spent reclaiming, compacting or evicting.")),
+
+        sm::make_derive("allocation_stall_moved_bytes", [this] { return _stall_bytes_moved; },
+                        sm::description("Counts the bytes moved by the allocations which reclaimed or compacted.")),
     });
 }
 
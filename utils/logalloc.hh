@@ -22,6 +22,8 @@
 #pragma once
 
 #include <memory>
+#include <chrono>
+#include <functional>
 #include <seastar/core/memory.hh>
 #include <seastar/core/reactor.hh>
 #include <seastar/core/shared_ptr.hh>
@@ -436,10 +438,40 @@ public:
     //
     size_t reclaim(size_t bytes);
 
-    // Compacts one segment at a time from sparsest segment to least sparse until work_waiting_on_reactor returns true
-    // or there are no more segments to compact.
+    // Compacts one segment at a time from sparsest segment to least sparse until work_waiting_on_reactor returns true,
+    // the compaction budget elapsed, the free segments reached the watermark, or there are no more segments to compact.
     reactor::idle_cpu_handler_result compact_on_idle(reactor::work_waiting_on_reactor);
 
+    // Compacts the sparsest segments ahead of the allocations, for at most
+    // @budget, until the segments free in the zones reach the watermark or
+    // work_waiting_on_reactor returns true. Returns true once the watermark is
+    // reached or nothing is left to compact.
+    bool compact_in_background(std::chrono::microseconds budget, reactor::work_waiting_on_reactor);
+
+    // The number of free segments the background compaction keeps, 0 means
+    // it compacts as long as segments are compactible, and the time it may
+    // spend at most from an idle reactor before it polls again.
+    void set_compaction_watermark(size_t free_segments);
+    size_t compaction_watermark() const;
+    void set_idle_compaction_budget(std::chrono::microseconds budget);
+
+    // A reclaim, compaction or eviction, run by an allocation which found no
+    // free segment (or by the seastar allocator short of memory).
+    struct stall {
+        std::chrono::microseconds duration;
+        size_t bytes_released;
+        size_t bytes_moved;
+        // The label given by set_stall_context() when the stall began.
+        const char* context;
+    };
+    // @observer is called right after every stall, from the allocating
+    // context: it must not allocate.
+    void set_stall_observer(std::function<void (const stall&)> observer);
+
+    // Labels the stalls until the next call, e.g. with the command running.
+    void set_stall_context(const char* context);
+    const char* stall_context() const;
+
     // Compacts as much as possible. Very expensive, mainly for testing.
     // Guarantees that every live object from reclaimable regions will be moved.
     // Invalidates references to objects in all compactible and evictable regions.
@@ -453,6 +485,20 @@ public:
     // Returns statistics for all segments allocated by LSA on this shard.
     occupancy_stats occupancy();
 
+    struct segment_stats {
+        size_t free_segments;
+        size_t zones;
+        size_t segments_compacted;
+        size_t segments_migrated;
+        size_t non_lsa_memory_in_use;
+        // Bytes of the live objects moved by the compactions, and by the
+        // compactions of the background.
+        size_t bytes_compacted;
+        size_t background_bytes_compacted;
+    };
+    // Returns the state of the segment pool of this shard.
+    segment_stats segment_statistics() const;
+
     impl& get_impl() { return *_impl; }
 
     // Set the minimum number of segments reclaimed during single reclamation cycle.
@@ -425,6 +425,18 @@ public:
         return read_linearize();
     }
 
+    // Invokes func(bytes_view) on every fragment in order, without linearizing.
+    template <typename Func>
+    void for_each_fragment(Func&& func) const {
+        if (!external()) {
+            func(bytes_view(_u.small.data, _u.small.size));
+            return;
+        }
+        for (auto b = _u.ptr; b != nullptr; b = b->next) {
+            func(bytes_view(b->data, b->frag_size));
+        }
+    }
+
     // Returns the amount of external memory used.
     size_t external_memory_usage() const {
         if (external()) {